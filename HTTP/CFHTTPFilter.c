@@ -30,8 +30,17 @@
 #include <CFNetwork/CFSocketStreamPriv.h>
 #include "CFHTTPInternal.h"
 #include "CFNetworkInternal.h"
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#if !defined(__WIN32__)
+#include <sys/uio.h>
+#endif
+#include <zlib.h>
+#if defined(HAVE_BROTLI)
+#include <brotli/decode.h>
+#endif
 
 extern CFDataRef _CFHTTPMessageCopySerializedHeaders(CFHTTPMessageRef msg, Boolean forProxy);
 
@@ -41,7 +50,6 @@ const SInt32 _kCFStreamErrorHTTPSProxyFailure = -2096;
 
 #ifdef __CONSTANT_CFSTRINGS__
 #define _kCFHTTPFilterCommaSeparator					CFSTR(",")
-#define _kCFHTTPFilterContentLengthHeader				CFSTR("Content-Length")
 #define _kCFHTTPFilterTransferEncodingHeader			CFSTR("Transfer-Encoding")
 #define _kCFHTTPFilterTransferEncodingChunked			CFSTR("chunked")
 #define _kCFHTTPFilterTransferEncodingChunked2			CFSTR("Chunked")
@@ -54,9 +62,10 @@ const SInt32 _kCFStreamErrorHTTPSProxyFailure = -2096;
 #define _kCFHTTPStreamProxyConnectionHeader				CFSTR("Proxy-Connection")
 #define _kCFHTTPStreamConnectionKeepAlive				CFSTR("keep-alive")
 #define _kCFHTTPStreamConnectionClose					CFSTR("close")
+#define _kCFHTTPFilterContentEncodingHeader				CFSTR("Content-Encoding")
+#define _kCFHTTPFilterContentLengthHeader				CFSTR("Content-Length")
 #else
 static CONST_STRING_DECL(_kCFHTTPFilterCommaSeparator, ",")
-static CONST_STRING_DECL(_kCFHTTPFilterContentLengthHeader, "Content-Length")
 static CONST_STRING_DECL(_kCFHTTPFilterTransferEncodingHeader, "Transfer-Encoding")
 static CONST_STRING_DECL(_kCFHTTPFilterTransferEncodingChunked, "chunked")
 static CONST_STRING_DECL(_kCFHTTPFilterTransferEncodingChunked2, "Chunked")
@@ -69,6 +78,8 @@ static CONST_STRING_DECL(_kCFHTTPStreamConnectionHeader, "Connection")
 static CONST_STRING_DECL(_kCFHTTPStreamProxyConnectionHeader, "Proxy-Connection")
 static CONST_STRING_DECL(_kCFHTTPStreamConnectionKeepAlive, "keep-alive")
 static CONST_STRING_DECL(_kCFHTTPStreamConnectionClose, "close")
+static CONST_STRING_DECL(_kCFHTTPFilterContentEncodingHeader, "Content-Encoding")
+static CONST_STRING_DECL(_kCFHTTPFilterContentLengthHeader, "Content-Length")
 #endif	/* __CONSTANT_CFSTRINGS__ */
 
 CONST_STRING_DECL(_kCFStreamPropertyHTTPSProxyHoldYourFire, "_kCFStreamPropertyHTTPSProxyHoldYourFire")
@@ -84,6 +95,61 @@ static Boolean httpWrFilterCanWrite(CFWriteStreamRef stream, void *info);
 //#define DEBUG_FILTER 1
 //#define LOG_FILTER 1
 
+#define DECODE_BUFFER_LENGTH (16 * 1024)
+#define CHUNK_HELD_LENGTH (32)
+
+/* Content-Encodings the read filter knows how to undo */
+enum {
+    kDecodeGzip = 1,
+    kDecodeDeflate,
+    kDecodeBrotli
+};
+
+// Content decoding state.  Allocated the first time a response on the connection needs it, then reset for each later response, so a persistent connection only ever pays for one inflate window.
+typedef struct {
+    int encoding;
+    z_stream zstream;
+    Boolean zstreamInited;
+    Boolean checkedWrapper;   // Some servers send "deflate" without the zlib wrapper; we look before inflating
+    Boolean outputPending;    // The last pass filled the caller's buffer; the decoder may hold more output
+#if defined(HAVE_BROTLI)
+    BrotliDecoderState *brotli;
+#endif
+    Boolean streamEnded;  // The decoder has seen the end of the encoded body; any further body bytes are discarded
+    Boolean rawAtEOF;     // The underlying (de-chunked) body has been fully read
+    Boolean sawInput;     // Some of the encoded body has arrived
+    Boolean finished;     // End-of-stream has been reported for the decoded body
+    CFIndex inputOffset;
+    CFIndex inputLength;
+    UInt8 input[DECODE_BUFFER_LENGTH];
+} _CFHTTPDecoder;
+
+// Chunk coalescing state for write streams.  Allocated when a chunk size is first set; bytes holds room for a chunk header followed by size bytes of body, so a gathered chunk goes out in a single write.
+typedef struct {
+    CFIndex size;               // Gather writes into chunks of up to this many bytes
+    CFIndex length;             // Number of bytes gathered thusfar
+    CFTimeInterval interval;    // How long the first gathered byte may wait; 0 waits for the chunk to fill
+    CFAbsoluteTime started;     // When the first gathered byte arrived
+    CFRunLoopTimerRef timer;    // Created the first time a flush interval is needed
+    UInt8 *bytes;
+} _CFHTTPChunkGather;
+
+/* Where the chunked body decoder is within the chunk framing; see decodeChunkedBytes */
+enum {
+    kChunkStateSize = 0,     // chunk-size
+    kChunkStateSizeLWS,      // white space after chunk-size
+    kChunkStateExtension,    // chunk-extension
+    kChunkStateQuoted,       // quoted-string within a chunk-extension
+    kChunkStateQuotedPair,   // escaped character within a quoted-string
+    kChunkStateHeaderLF,     // LF ending the chunk header
+    kChunkStateData,         // chunk-data
+    kChunkStateDataEnd,      // CRLF after chunk-data
+    kChunkStateDataLF,       // LF of the CRLF after chunk-data
+    kChunkStateDataCRLF,     // the CRLF after chunk-data has been seen, and nothing since
+    kChunkStateTrailers,     // past last-chunk; the trailer is next
+    kChunkStateDone          // the body ended without a trailer
+};
+
 typedef struct {
     CFHTTPMessageRef header;
     UInt32 flags;
@@ -100,12 +166,21 @@ typedef struct {
         CFWriteStreamRef w;
     } filteredStream;
     CFDataRef customSSLContext;
+    _CFHTTPDecoder *decoder;
+    _CFHTTPChunkGather *gather;
+    UInt8 chunkState;         // Where the chunked body decoder is; one of the kChunkState values
+    long long chunkSize;      // Chunk size parsed thusfar from a chunk header
+    CFIndex chunkHeldLength;  // Number of body bytes in chunkHeld; these are de-chunked bytes found while checking for bytes available, and are returned ahead of anything else
+    UInt8 chunkHeld[CHUNK_HELD_LENGTH];
 #if defined(DEBUG_FILTER)
     CFMutableDataRef _allData;
 #endif    
 } _CFHTTPFilter;
 
 static Boolean httpRdFilterCanReadNoSignal(CFReadStreamRef stream, _CFHTTPFilter *httpFilter, CFStreamError *err);
+static void startDecoding(_CFHTTPFilter *httpFilter);
+static CFStreamError transmitHeader(_CFHTTPFilter *filter, Boolean blockUntilDone, Boolean holdForBody);
+static Boolean writeGatheredChunk(_CFHTTPFilter *filter, const UInt8 *extra, CFIndex extraLength, CFStreamError *error);
 
 /* flag bits */
 
@@ -123,6 +198,8 @@ static Boolean httpRdFilterCanReadNoSignal(CFReadStreamRef stream, _CFHTTPFilter
 #define LAST_CHUNK (10)
 #define ZERO_LENGTH_RESPONSE_EXPECTED (11)
 #define LAX_PARSING (12)
+#define DECODE_CONTENT (13)
+#define IS_DECODING (14)
 
 /* For write streams - 16-31 */
 #define HEADER_TRANSMITTED (16)
@@ -131,9 +208,9 @@ static Boolean httpRdFilterCanReadNoSignal(CFReadStreamRef stream, _CFHTTPFilter
 #define IS_HTTPS_PROXY (19)
 #define HTTPS_PROXY_FAILURE (20)
 #define STRIP_PROXY_AUTH (21)
+#define HEADER_HELD (22)
 
 /* special values for expectedBytes for read streams*/
-#define MID_CHUNK_HEADER_PARSE  (-3)
 #define HEADERS_NOT_YET_CHECKED (-2)
 #define WAIT_FOR_END_OF_STREAM  (-1)
 
@@ -149,6 +226,10 @@ CF_INLINE void setParseFailure(_CFHTTPFilter *filter, CFStreamError *error) {
     __CFBitSet(filter->flags, PARSE_FAILED);
 }
 
+CF_INLINE Boolean isGatheringChunks(_CFHTTPFilter *filter) {
+    return filter->gather && filter->gather->size > 0 && __CFBitIsSet(filter->flags, IS_CHUNKED);
+}
+
 CF_INLINE Boolean httpRdFilterAtMark(_CFHTTPFilter *httpFilter) {
     if (__CFBitIsSet(httpFilter->flags, MARK_ENABLED) && __CFBitIsSet(httpFilter->flags, AT_MARK)) {
         return TRUE;
@@ -174,6 +255,11 @@ static void *httpRdFilterCreate(CFReadStreamRef stream, void *info) {
     CFRetain(filter->socketStream.r);
     filter->filteredStream.r = stream; // Do not retain; that will introduce a retain loop.
     filter->customSSLContext = NULL;
+    filter->decoder = NULL;
+    filter->gather = NULL;
+    filter->chunkState = kChunkStateSize;
+    filter->chunkSize = 0;
+    filter->chunkHeldLength = 0;
 #if defined(LOG_FILTER)
     fprintf(stderr, "HTTPFilter: Creating read filter 0x%x\n", (unsigned)filter);
 #endif
@@ -188,6 +274,13 @@ static void httpRdFilterDealloc(CFReadStreamRef stream, void *info) {
 	__CFSpinLock(&filter->lock);
     if (filter->header) CFRelease(filter->header);
     if (filter->_data) CFRelease(filter->_data);
+    if (filter->decoder) {
+        if (filter->decoder->zstreamInited) inflateEnd(&filter->decoder->zstream);
+#if defined(HAVE_BROTLI)
+        if (filter->decoder->brotli) BrotliDecoderDestroyInstance(filter->decoder->brotli);
+#endif
+        CFAllocatorDeallocate(CFGetAllocator(stream), filter->decoder);
+    }
 #if defined(DEBUG_FILTER)
     filter->_allData = CFDataCreateMutable(NULL, 0);
 #endif    
@@ -316,7 +409,7 @@ static long long expectedSizeFromHeaders(CFHTTPMessageRef responseHeader) {
 		return 0; // GET requests send no message body
     }
    
-    contentLength = CFHTTPMessageCopyHeaderFieldValue(responseHeader, _kCFHTTPFilterContentLengthHeader);
+    contentLength = _CFHTTPMessageCopyHeaderFieldValueByID(responseHeader, _kCFHTTPHeaderContentLength);
     if (contentLength) {
         CFIndex charIndex = 0, length = CFStringGetLength(contentLength);
         UniChar ch;
@@ -398,7 +491,13 @@ static Boolean readHeaderBytes(_CFHTTPFilter *httpFilter, Boolean toCompletion,
 	}
 	
     while (parseSucceeded && !CFHTTPMessageIsHeaderComplete(httpFilter->header) && (toCompletion || CFReadStreamHasBytesAvailable(stream))) {
-        CFIndex bytesRead = CFReadStreamRead(stream, buffer, bufferLength);
+        // Parse straight out of the socket stream's buffer when it has bytes waiting
+        CFIndex bytesRead;
+        const UInt8 *bytes = CFReadStreamGetBuffer(stream, bufferLength, &bytesRead);
+        if (!bytes) {
+            bytes = buffer;
+            bytesRead = CFReadStreamRead(stream, buffer, bufferLength);
+        }
         if (bytesRead == 0) {
             // ???? EOF isn't legal at this point; can we convert to an 0.9 response?
             if (_CFHTTPMessageIsEmpty(httpFilter->header)) {
@@ -414,9 +513,9 @@ static Boolean readHeaderBytes(_CFHTTPFilter *httpFilter, Boolean toCompletion,
             break;
         } else {
 #if defined(DEBUG_FILTER)
-            CFDataAppendBytes(httpFilter->_allData, buffer, bytesRead);
+            CFDataAppendBytes(httpFilter->_allData, bytes, bytesRead);
 #endif
-            parseSucceeded = CFHTTPMessageAppendBytes(httpFilter->header, buffer, bytesRead);
+            parseSucceeded = CFHTTPMessageAppendBytes(httpFilter->header, bytes, bytesRead);
         }
     }
     if (!parseSucceeded) {
@@ -454,6 +553,7 @@ static Boolean readHeaderBytes(_CFHTTPFilter *httpFilter, Boolean toCompletion,
         if (__CFBitIsSet(httpFilter->flags, LAX_PARSING)) {
             _CFHTTPMessageSetLaxParsing(newHeader, TRUE);
         }
+        _CFHTTPMessageSetLazyHeaders(newHeader, TRUE);
         CFRelease(httpFilter->header);
         httpFilter->header = newHeader;
         return readHeaderBytes(httpFilter, toCompletion, buffer, bufferLength, error);
@@ -496,7 +596,9 @@ static Boolean readHeaderBytes(_CFHTTPFilter *httpFilter, Boolean toCompletion,
     
     if (__CFBitIsSet(httpFilter->flags, IS_CHUNKED)) {
         // Mark it as at the end of a chunk so the read routine will start with a new chunk
-        __CFBitSet(httpFilter->flags, FIRST_CHUNK);
+        httpFilter->chunkState = kChunkStateSize;
+        httpFilter->chunkSize = 0;
+        httpFilter->chunkHeldLength = 0;
         httpFilter->expectedBytes = 0;
     } else {
         // See if we have a valid content-length
@@ -505,6 +607,11 @@ static Boolean readHeaderBytes(_CFHTTPFilter *httpFilter, Boolean toCompletion,
 		if ((httpFilter->expectedBytes == WAIT_FOR_END_OF_STREAM) && (CFReadStreamGetStatus(stream) == kCFStreamStatusAtEnd))
 			httpFilter->expectedBytes = 0;
     }
+    
+    // Now that the body framing is known, see if the body needs decoding
+    if (__CFBitIsSet(httpFilter->flags, DECODE_CONTENT)) {
+        startDecoding(httpFilter);
+    }
     return TRUE;
 }
 
@@ -542,144 +649,124 @@ And from section 3.6.1, the productions for the chunked terms
     trailer = *(entity-header CRLF)
 */
 
-static inline Boolean isToken(UInt8 ch) {
-    if (ch < 32 || ch == 127) return FALSE;
-    if (ch == '(' || ch == ')' || ch == '<' || ch == '>' || ch == '@') return FALSE;
-    if (ch == ',' || ch == ';' || ch == ':' || ch == '\\' || ch == '\"') return FALSE;
-    if (ch == '/' || ch == '[' || ch == ']' || ch == '?' || ch == '=') return FALSE;
-    if (ch == '{' || ch == '}' || ch == ' ' || ch == '\t') return FALSE;
-    return TRUE;
-}
-
-static inline const UInt8 *skipLWS(const UInt8 *current, const UInt8 *end) {
-    while (current < end) {
-        if (*current != ' ' && *current != '\t') break;
-        current ++;
-    }
-    return current;
-}
-
-static inline const UInt8 *skipToken(const UInt8 *curr, const UInt8 *end) {
-    while (curr < end && isToken(*curr)) {
-        curr ++;
-    }
-    return curr;
-}
-
-static inline const UInt8 *skipQuotedString(const UInt8 *curr, const UInt8 *end) {
-    curr ++; // Get past the initial quote; the caller should have checked this
-    while (curr < end) {
-        if (*curr == '\"') {
-            curr ++;
-            return curr;
-        } else if (*curr == '\\') {
-            curr ++;
-        }
-        curr ++;
-    }
-    return curr;
-}
-
-/* Return the size of the chunk, -1 on parse failure, or MID_CHUNK_HEADER_PARSE if the buffer doesn't provide enough data */
-static CFIndex parseChunkedHeader(const UInt8 *buffer, CFIndex bufferLength, Boolean isFirstChunk, CFIndex *firstDataByte) {
-    const UInt8 *curr = buffer, *end = buffer + bufferLength;
-    CFIndex size = 0;
-    if (!isFirstChunk) {
-		while (curr != end) {
-			UInt8 c = *curr;
-			if ((c == '\r') || (c == '\n') || (c == ' ') || (c == '\t'))
-				curr++;
-			else
-				break;
-		}
-		if (curr == end) return MID_CHUNK_HEADER_PARSE;
-    }
-    for (; curr < end; curr ++) {
+// Runs the chunked body decoder over bytes, copying chunk-data to out and dropping the framing; when out and bytes are the same buffer, this strips the framing in place.  All of the decoder's state lives in httpFilter, so a chunk header may be split across any number of calls without us having to hold on to its bytes.  Stops when out is full or the last-chunk has been parsed, setting *consumed to the number of bytes used.  Returns the number of bytes placed in out, or -1 if the framing is malformed.
+static CFIndex decodeChunkedBytes(_CFHTTPFilter *httpFilter, const UInt8 *bytes, CFIndex length, UInt8 *out, CFIndex outLength, CFIndex *consumed) {
+    const UInt8 *curr = bytes, *end = bytes + length;
+    CFIndex filled = 0;
+    while (curr < end && httpFilter->chunkState < kChunkStateTrailers) {
+        UInt8 ch = *curr;
         int digit;
-        if (*curr >= '0' && *curr <= '9') {
-            digit = *curr - '0';
-        } else if (*curr >= 'A' && *curr <= 'F') {
-            digit = *curr - 'A' + 10;
-        } else  if (*curr >= 'a' && *curr <= 'f') {
-            digit = *curr - 'a' + 10;
-        } else {
-            break;
-        }
-        size = (size << 4) + digit;
-    }
-    curr = skipLWS(curr, end);
-    if (curr == end) return MID_CHUNK_HEADER_PARSE;
-    while (*curr == ';') {
-		curr++;						// Skip the semi-colon
-        curr = skipLWS(curr, end);
-        if (curr == end) return MID_CHUNK_HEADER_PARSE;
-        UInt8 c = *curr;
-        if (c == '\r' || c == '\n') {
-            // malformed chunk
-            // semicolon without chunk extension
-            // just move on
+        switch (httpFilter->chunkState) {
+        case kChunkStateData: {
+            long long remaining = httpFilter->expectedBytes - httpFilter->processedBytes;
+            CFIndex run = end - curr;
+            if (run > remaining) run = (CFIndex)remaining;
+            if (run > outLength - filled) run = outLength - filled;
+            if (run == 0) {
+                // out is full
+                *consumed = curr - bytes;
+                return filled;
+            }
+            memmove(out + filled, curr, run);
+            curr += run;
+            filled += run;
+            httpFilter->processedBytes += run;
+            if (httpFilter->processedBytes == httpFilter->expectedBytes) {
+                httpFilter->chunkState = kChunkStateDataEnd;
+            }
             break;
         }
-        else {
-            // Advance past extensions
-            curr = skipToken(curr, end);
-            curr = skipLWS(curr, end);
-            if (curr == end) return MID_CHUNK_HEADER_PARSE;
-            if (*curr == '=') {
-                curr = skipLWS(curr, end);
-                if (curr == end) return MID_CHUNK_HEADER_PARSE;
-                if (*curr == '\"') {
-                    curr = skipQuotedString(curr, end);
+        case kChunkStateDataEnd:
+        case kChunkStateDataLF:
+        case kChunkStateDataCRLF:
+            // Be tolerant of any white space between the chunk-data and the next chunk-size, but note when exactly CRLF came; decodeChunkedBody needs that to tell a bare CRLF last chunk from a truncated body
+            if (ch == '\r' || ch == '\n' || ch == ' ' || ch == '\t') {
+                if (ch == '\r' && httpFilter->chunkState == kChunkStateDataEnd) {
+                    httpFilter->chunkState = kChunkStateDataLF;
+                } else if (ch == '\n' && httpFilter->chunkState == kChunkStateDataLF) {
+                    httpFilter->chunkState = kChunkStateDataCRLF;
                 } else {
-                    curr = skipToken(curr, end);
+                    httpFilter->chunkState = kChunkStateDataEnd;
                 }
-                curr = skipLWS(curr, end);
-                if (curr == end) return MID_CHUNK_HEADER_PARSE;
+                curr ++;
+            } else {
+                httpFilter->chunkState = kChunkStateSize;
+                httpFilter->chunkSize = 0;
             }
+            break;
+        case kChunkStateSize:
+            if (ch >= '0' && ch <= '9') {
+                digit = ch - '0';
+            } else if (ch >= 'A' && ch <= 'F') {
+                digit = ch - 'A' + 10;
+            } else if (ch >= 'a' && ch <= 'f') {
+                digit = ch - 'a' + 10;
+            } else {
+                digit = -1;
+            }
+            if (digit >= 0) {
+                if (httpFilter->chunkSize > (LLONG_MAX >> 4)) return -1;
+                httpFilter->chunkSize = (httpFilter->chunkSize << 4) + digit;
+            } else if (ch == ' ' || ch == '\t') {
+                httpFilter->chunkState = kChunkStateSizeLWS;
+            } else if (ch == ';') {
+                httpFilter->chunkState = kChunkStateExtension;
+            } else if (ch == '\r') {
+                httpFilter->chunkState = kChunkStateHeaderLF;
+            } else {
+                return -1;
+            }
+            curr ++;
+            break;
+        case kChunkStateSizeLWS:
+            if (ch == ';') {
+                httpFilter->chunkState = kChunkStateExtension;
+            } else if (ch == '\r') {
+                httpFilter->chunkState = kChunkStateHeaderLF;
+            } else if (ch != ' ' && ch != '\t') {
+                return -1;
+            }
+            curr ++;
+            break;
+        case kChunkStateExtension:
+            // We don't use chunk extensions, so simply skip them; a semicolon without an extension is let through
+            if (ch == '\"') {
+                httpFilter->chunkState = kChunkStateQuoted;
+            } else if (ch == '\r') {
+                httpFilter->chunkState = kChunkStateHeaderLF;
+            } else if (ch < 32 && ch != '\t') {
+                return -1;
+            }
+            curr ++;
+            break;
+        case kChunkStateQuoted:
+            if (ch == '\\') {
+                httpFilter->chunkState = kChunkStateQuotedPair;
+            } else if (ch == '\"') {
+                httpFilter->chunkState = kChunkStateExtension;
+            }
+            curr ++;
+            break;
+        case kChunkStateQuotedPair:
+            httpFilter->chunkState = kChunkStateQuoted;
+            curr ++;
+            break;
+        case kChunkStateHeaderLF:
+            if (ch != '\n') return -1;
+            curr ++;
+            httpFilter->expectedBytes = httpFilter->chunkSize;
+            httpFilter->processedBytes = 0;
+            if (httpFilter->chunkSize == 0) {
+                __CFBitSet(httpFilter->flags, LAST_CHUNK);
+                httpFilter->chunkState = kChunkStateTrailers;
+            } else {
+                httpFilter->chunkState = kChunkStateData;
+            }
+            break;
         }
     }
-    if (*curr == '\r') {
-        if (curr + 1 == end) {
-            return MID_CHUNK_HEADER_PARSE;
-        } else if (*(curr + 1) == '\n') {
-            *firstDataByte = curr + 2 - buffer;
-            return ((size >= 0) ? size : -1);
-        } else {
-            // Parse failure
-            return -1;
-        }
-    }
-    return -1;    
-}
-
-// Returns TRUE if and only if there were enough bytes in headerBytes to get a definitive result; otherwise, returns FALSE leaving httpFilter unmodified.  if TRUE is returned, firstDataByte is set to point to the first byte that should be reported back to the client (and httpFilter->expectedBytes and httpFilter->processedBytes is set accordingly), or -1 if the parse failed.  Regardless, error is set accordingly.
-static Boolean setFilterForChunkedHeaderBytes(_CFHTTPFilter *httpFilter, const UInt8 *headerBytes, CFIndex headerByteLength, CFIndex *firstDataByte, CFStreamError *error) {
-    CFIndex chunkSize;
-    if (__CFBitIsSet(httpFilter->flags, FIRST_CHUNK)) {
-        chunkSize = parseChunkedHeader(headerBytes, headerByteLength, TRUE, firstDataByte);
-        if (chunkSize != MID_CHUNK_HEADER_PARSE) {
-            __CFBitClear(httpFilter->flags, FIRST_CHUNK);
-        }
-    } else {
-        chunkSize = parseChunkedHeader(headerBytes, headerByteLength, FALSE, firstDataByte);
-    }
-    if (chunkSize == -1) {
-        // parse failure
-        *firstDataByte = -1;
-        setParseFailure(httpFilter, error);
-        return TRUE;
-    } else if (chunkSize == MID_CHUNK_HEADER_PARSE) {
-        return FALSE;
-    } else {
-        // parse success
-        error->error = 0;
-        httpFilter->expectedBytes = chunkSize;
-        httpFilter->processedBytes = 0;
-        if (chunkSize == 0) {
-            __CFBitSet(httpFilter->flags, LAST_CHUNK);
-        }
-        return TRUE;
-    }
+    *consumed = curr - bytes;
+    return filled;
 }
 
 static inline void setDataForRange(_CFHTTPFilter *filter, CFRange newRange) {
@@ -712,135 +799,61 @@ static inline void setDataForBytes(_CFHTTPFilter *filter, const UInt8 *bytes, CF
 }
 
 
-// Returns FALSE and sets error on parse/stream error.  Returns TRUE and sets httpFilter->expectedBytes to MID_CHUNK_HEADER_PARSE if there are insufficient bytes to parse the header, and we were requested to not block.  Otherwise, returns TRUE and sets expectedBytes accordingly.
-static Boolean readChunkedHeader(_CFHTTPFilter *httpFilter, Boolean toCompletion, UInt8 *buffer, CFIndex bufferLength, CFStreamError *error) {
-    CFIndex dataLength = httpFilter->_data ? CFDataGetLength(httpFilter->_data) : 0;
-    const UInt8 *dataBytes = dataLength != 0 ? CFDataGetBytePtr(httpFilter->_data) : NULL;
-    Boolean result = TRUE, done = FALSE;
+// Fills out with de-chunked body bytes, first from any bytes held over in httpFilter->_data, then straight out of the socket stream's buffer.  If the socket stream has no buffer to lend us, we read into out itself and strip the framing in place.  We never take more bytes than out can hold, so there is nothing left over unless the body ends part way through; those bytes are kept in _data for the trailer.  Only blocks if toCompletion is set and no bytes have been placed in out.  Returns the number of bytes placed in out, or -1 with error set.
+static CFIndex decodeChunkedBody(_CFHTTPFilter *httpFilter, Boolean toCompletion, UInt8 *out, CFIndex outLength, CFStreamError *error) {
     CFReadStreamRef stream = httpFilter->socketStream.r;
-    // First see if the bytes in data are sufficient 
-    if (dataBytes) {
-        CFIndex endOfHeader;
-        if (setFilterForChunkedHeaderBytes(httpFilter, dataBytes, dataLength, &endOfHeader, error)) {
-            done = TRUE;
-            result = (endOfHeader != -1);
-            // if the parse succeeded, we must deal with any fragmentary bytes.  It is possible that data should be unchanged (if the client has requested that we return the chunk headers to them), hence the second clause below
-            if (result && endOfHeader != 0) {
-                setDataForRange(httpFilter, CFRangeMake(endOfHeader, dataLength-endOfHeader));
+    CFIndex filled = 0;
+    while (filled < outLength && httpFilter->chunkState < kChunkStateTrailers) {
+        CFIndex room = outLength - filled;
+        CFIndex length, consumed, decoded;
+        if (httpFilter->_data) {
+            CFIndex dataLength = CFDataGetLength(httpFilter->_data);
+            length = dataLength < room ? dataLength : room;
+            decoded = decodeChunkedBytes(httpFilter, CFDataGetBytePtr(httpFilter->_data), length, out + filled, room, &consumed);
+            if (decoded >= 0) {
+                setDataForRange(httpFilter, CFRangeMake(consumed, dataLength - consumed));
             }
-        }
-    }
-    // At this point, we'll have to read from the stream; if we can't do that, jump to the end.
-    if (!done && !toCompletion && !CFReadStreamHasBytesAvailable(stream) && CFReadStreamGetStatus(stream) != kCFStreamStatusError) {
-        httpFilter->expectedBytes = MID_CHUNK_HEADER_PARSE;
-        done = TRUE;
-        result = TRUE;
-    }
-
-    // Try and use buffer if possible
-    if (!done && dataLength < bufferLength) {
-        UInt8 *readBuffer = buffer;
-        CFIndex readBufferLength = bufferLength;
-        CFIndex bytesRead;
-        if (dataBytes) {
-            memmove(buffer, dataBytes, dataLength);
-            readBuffer += dataLength;
-            readBufferLength -= dataLength;
-        }
-        bytesRead = CFReadStreamRead(stream, readBuffer, readBufferLength);
-        if (bytesRead < 0) {
-            // stream error
-            *error = CFReadStreamGetError(stream);
-            done = TRUE;
-            result = FALSE;
-        } else if (bytesRead == 0) {
-            // Premature end of stream.  However, some servers send simply CRLF for their last chunk instead of 0CRLF; be tolerant of this.
-            if (readBuffer == buffer + 2 && buffer[0] == '\r' && buffer[1] == '\n') {
-                httpFilter->expectedBytes = 0;
-                httpFilter->processedBytes = 0;
-                __CFBitSet(httpFilter->flags, LAST_CHUNK);
-                result = TRUE;
-            } else {
+        } else {
+            const UInt8 *bytes;
+            // Our contract is to not block if we have bytes on-hand
+            if ((!toCompletion || filled > 0) && !CFReadStreamHasBytesAvailable(stream) && CFReadStreamGetStatus(stream) != kCFStreamStatusError) {
+                break;
+            }
+            bytes = CFReadStreamGetBuffer(stream, room, &length);
+            if (!bytes) {
+                bytes = out + filled;
+                length = CFReadStreamRead(stream, out + filled, room);
+            }
+            if (length < 0) {
+                *error = CFReadStreamGetError(stream);
+                return -1;
+            } else if (length == 0) {
+                // Premature end of stream.  However, some servers send simply CRLF for their last chunk instead of 0CRLF; be tolerant of this, but only if exactly that CRLF followed the last chunk-data.
+                if (httpFilter->chunkState == kChunkStateDataCRLF) {
+                    httpFilter->expectedBytes = 0;
+                    httpFilter->processedBytes = 0;
+                    __CFBitSet(httpFilter->flags, LAST_CHUNK);
+                    httpFilter->chunkState = kChunkStateDone;
+                    break;
+                }
                 setParseFailure(httpFilter, error);
-                result = FALSE;
+                return -1;
             }
-            done = TRUE;
-        } else {
-            // Read was successful; the header bytes are now in buffer and have length dataLength + bytesRead
-            CFIndex endOfHeader;
 #if defined(DEBUG_FILTER)
-            CFDataAppendBytes(httpFilter->_allData, readBuffer, bytesRead);
+            CFDataAppendBytes(httpFilter->_allData, bytes, length);
 #endif
-            if (setFilterForChunkedHeaderBytes(httpFilter, buffer, dataLength + bytesRead, &endOfHeader, error)) {
-                done = TRUE;
-                result = (endOfHeader != -1);
-                if (result) {
-                    // parse succeeded; figure out what to do with the excess bytes.  Note that endOfHeader must be interpretted relative to buffer.
-                    setDataForBytes(httpFilter, buffer + endOfHeader, dataLength + bytesRead - endOfHeader);
-                }
-            } else {
-                // Still don't have enough bytes.  Return the bytes we have thusfar read in httpFilter->header
-                if (dataLength && __CFBitIsSet(httpFilter->flags, DATA_IS_MUTABLE)) {
-                    CFDataAppendBytes(httpFilter->_data, buffer + dataLength, bytesRead);
-                } else {
-                    setDataForBytes(httpFilter, buffer, dataLength + bytesRead);
-                }
+            decoded = decodeChunkedBytes(httpFilter, bytes, length, out + filled, room, &consumed);
+            if (decoded >= 0 && consumed < length) {
+                setDataForBytes(httpFilter, bytes + consumed, length - consumed);
             }
         }
-    }
-    
-    // If all else fails, keep reading bytes into data until we have enough.  Hopefully we never reach this case (assuming we're being given a reasonably sized buffer, we shouldn't - chunk headers are in general very small), since it's somewhat expensive.
-    if (httpFilter->_data == NULL || !__CFBitIsSet(httpFilter->flags, DATA_IS_MUTABLE)) {
-        if (httpFilter->_data) {
-            CFMutableDataRef newData = CFDataCreateMutableCopy(CFGetAllocator(httpFilter->_data), 0, httpFilter->_data);
-            CFRelease(httpFilter->_data);
-            httpFilter->_data = newData;
-        } else {
-            httpFilter->_data = CFDataCreateMutable(CFGetAllocator(httpFilter->header), 0);
-        }
-        __CFBitSet(httpFilter->flags, DATA_IS_MUTABLE);
-    }
-
-    while (!done && (toCompletion || CFReadStreamHasBytesAvailable(stream) || CFReadStreamGetStatus(stream) == kCFStreamStatusError)) {
-        CFIndex bytesRead, oldLength = CFDataGetLength(httpFilter->_data);
-        UInt8 *bytes;
-        CFDataSetLength(httpFilter->_data, oldLength + bufferLength);
-        bytes = CFDataGetMutableBytePtr(httpFilter->_data);
-        bytesRead = CFReadStreamRead(stream, bytes + oldLength, bufferLength);
-        if (bytesRead < 0) {
-            // error
-            done = TRUE;
-            result = FALSE;
-            *error = CFReadStreamGetError(stream);
-        } else if (bytesRead == 0) {
-            // premature end of stream
-            done = TRUE;
-            result = FALSE;
+        if (decoded < 0) {
             setParseFailure(httpFilter, error);
-        } else {
-            // Append the read bytes to the header, then try and parse the header bytes
-            CFIndex firstDataByte;
-#if defined(DEBUG_FILTER)
-            CFDataAppendBytes(httpFilter->_allData, bytes + oldLength, bytesRead);
-#endif
-            if (setFilterForChunkedHeaderBytes(httpFilter, bytes, oldLength + bytesRead, &firstDataByte, error)) {
-                done = TRUE;
-                result = (firstDataByte != -1);
-                if (result && firstDataByte != 0) {
-                    CFDataDeleteBytes(httpFilter->_data, CFRangeMake(0, firstDataByte));
-                    CFDataSetLength(httpFilter->_data, oldLength + bytesRead - firstDataByte);
-                }
-            } else {
-                CFDataSetLength(httpFilter->_data, oldLength + bytesRead);
-            }
+            return -1;
         }
+        filled += decoded;
     }
-    if (!done) {
-        // never could get enough bytes
-        result = TRUE;
-        httpFilter->expectedBytes = MID_CHUNK_HEADER_PARSE;
-    }
-    return result;
+    return filled;
 }
 
 
@@ -920,102 +933,40 @@ static Boolean readChunkedTrailers(_CFHTTPFilter *httpFilter, CFStreamError *err
 }
 
 static CFIndex doChunkedRead(_CFHTTPFilter *httpFilter, UInt8 *buffer, CFIndex bufferLength, CFStreamError *error, Boolean *atEOF) {
-    CFIndex lengthFilled = 0; // The number of bytes to actually report back; buffer is advance and bufferLength decremented as we get bytes from the various sources.
-    Boolean errorOccurred = FALSE;
-    CFReadStreamRef stream = httpFilter->socketStream.r;
+    CFIndex lengthFilled = 0;
     *atEOF = FALSE;
     error->error = 0;
-    
-    while (bufferLength > 0) {
-        CFIndex bytesRemainingInChunk;
-        
-        if (__CFBitIsSet(httpFilter->flags, LAST_CHUNK)) {
-            *atEOF = TRUE;
-            errorOccurred = (readChunkedTrailers(httpFilter, error)) ? FALSE : TRUE;
-            break;
+
+    // Bytes decoded by httpRdFilterCanReadNoSignal go first
+    if (httpFilter->chunkHeldLength != 0) {
+        lengthFilled = httpFilter->chunkHeldLength < bufferLength ? httpFilter->chunkHeldLength : bufferLength;
+        memmove(buffer, httpFilter->chunkHeld, lengthFilled);
+        httpFilter->chunkHeldLength -= lengthFilled;
+        if (httpFilter->chunkHeldLength != 0) {
+            memmove(httpFilter->chunkHeld, httpFilter->chunkHeld + lengthFilled, httpFilter->chunkHeldLength);
+            return lengthFilled;
         }
-        
-        // Read the header if necessary
-        if (httpFilter->expectedBytes == MID_CHUNK_HEADER_PARSE || httpFilter->expectedBytes == httpFilter->processedBytes) {
-            // Note that we don't want to block reading the chunk header if we've already got some bytes to return
-            if (!readChunkedHeader(httpFilter, lengthFilled > 0 ? FALSE : TRUE, buffer, bufferLength, error)) {
-                // Error occurred; error has already been set.
-                errorOccurred = TRUE;
-                break;
-            } else if (httpFilter->expectedBytes == MID_CHUNK_HEADER_PARSE) {
-                errorOccurred = FALSE;
-                break;
-            } else if (httpFilter->expectedBytes == 0) {
-                // all done
-                *atEOF = TRUE;
-                errorOccurred = (readChunkedTrailers(httpFilter, error)) ? FALSE : TRUE;
-                break;
-            }
-            // else we got a good chunk header; fall-through to start processing the actual bytes.
+    }
+
+    if (lengthFilled < bufferLength && !__CFBitIsSet(httpFilter->flags, LAST_CHUNK)) {
+        // Note that we don't want to block if we've already got some bytes to return
+        CFIndex decoded = decodeChunkedBody(httpFilter, lengthFilled == 0, buffer + lengthFilled, bufferLength - lengthFilled, error);
+        if (decoded < 0) {
+            return -1;
         }
-        
-        bytesRemainingInChunk = httpFilter->expectedBytes - httpFilter->processedBytes;
-        // Exhaust any data we're holding
-        if (httpFilter->_data) {
-            const UInt8 *bytes = CFDataGetBytePtr(httpFilter->_data);
-            CFIndex length = CFDataGetLength(httpFilter->_data);
-            CFIndex numBytesToMove;
-            if (length >= bytesRemainingInChunk) {
-                // Data spans 2 chunks; do not take more than bytesRemainingInChunk
-                if (bytesRemainingInChunk >= bufferLength) {
-                    numBytesToMove = bufferLength;
-                } else {
-                    numBytesToMove = bytesRemainingInChunk;
-                }
-            } else {
-                // Data's in a single chunk; can safely take it all
-                if (length >= bufferLength) {
-                    numBytesToMove = bufferLength;
-                } else {
-                    numBytesToMove = length;
-                }
-            }
-            memmove(buffer, bytes, numBytesToMove);
-            buffer += numBytesToMove;
-            bufferLength -= numBytesToMove;
-            lengthFilled += numBytesToMove;
-            httpFilter->processedBytes += numBytesToMove;
-            setDataForRange(httpFilter, CFRangeMake(numBytesToMove, length - numBytesToMove));
-            bytesRemainingInChunk -= numBytesToMove;
-        }
-        if (bufferLength == 0) break;
-        if (bytesRemainingInChunk == 0) continue;
-        // Read up to the lesser of bytesRemainingInChunk and bufferLength directly from the stream.  Note that if we have already filled some bytes, we must not read from the stream unless it has bytes available; our contract is to not block if we have bytes on-hand.
-        if (lengthFilled > 0 && !CFReadStreamHasBytesAvailable(stream) && CFReadStreamGetStatus(stream) != kCFStreamStatusError) {
-            break;
-        } else {
-            CFIndex bytesToRead = bytesRemainingInChunk > bufferLength ? bufferLength : bytesRemainingInChunk;
-            CFIndex numRead = CFReadStreamRead(stream, buffer, bytesToRead);
-            if (numRead < 0) {
-                *error = CFReadStreamGetError(stream);
-                errorOccurred = TRUE;
-                break;
-            } else if (numRead == 0) {
-                // Premature end-of-stream
-                setParseFailure(httpFilter, error);
-                errorOccurred = TRUE;
-                break;
-            } else {
-#if defined(DEBUG_FILTER)
-                CFDataAppendBytes(httpFilter->_allData, buffer, numRead);
-#endif
-                buffer += numRead;
-                bufferLength -= numRead;
-                lengthFilled += numRead;
-                httpFilter->processedBytes += numRead;
+        lengthFilled += decoded;
+    }
+
+    if (__CFBitIsSet(httpFilter->flags, LAST_CHUNK)) {
+        *atEOF = TRUE;
+        if (httpFilter->chunkState == kChunkStateTrailers) {
+            httpFilter->chunkState = kChunkStateDone;
+            if (!readChunkedTrailers(httpFilter, error)) {
+                return -1;
             }
         }
     }
-    if (errorOccurred) {
-        return -1;
-    } else {
-        return lengthFilled;
-    }
+    return lengthFilled;
 }
 
 static CFIndex doPlainRead(_CFHTTPFilter *httpFilter, UInt8 *buffer, CFIndex bufferLength, CFStreamError *error, Boolean *atEOF) {
@@ -1077,6 +1028,209 @@ static CFIndex doPlainRead(_CFHTTPFilter *httpFilter, UInt8 *buffer, CFIndex buf
     return result;
 }
 
+static CFIndex doRawRead(_CFHTTPFilter *httpFilter, UInt8 *buffer, CFIndex bufferLength, CFStreamError *error, Boolean *atEOF) {
+    if (__CFBitIsSet(httpFilter->flags, IS_CHUNKED)) {
+        return doChunkedRead(httpFilter, buffer, bufferLength, error, atEOF);
+    } else {
+        return doPlainRead(httpFilter, buffer, bufferLength, error, atEOF);
+    }
+}
+
+// Called once the response headers are parsed and DECODE_CONTENT is set.  If the body carries a single Content-Encoding we understand, arm the decoder and rewrite the headers to describe the decoded body; otherwise the body passes through untouched.
+static void startDecoding(_CFHTTPFilter *httpFilter) {
+    _CFHTTPDecoder *decoder = httpFilter->decoder;
+    CFStringRef value;
+    char coding[16];
+    int encoding = 0;
+
+    if (CFHTTPMessageIsRequest(httpFilter->header) || (!__CFBitIsSet(httpFilter->flags, IS_CHUNKED) && httpFilter->expectedBytes == 0)) {
+        // Nothing to decode
+        return;
+    }
+    value = _CFHTTPMessageCopyHeaderFieldValueByID(httpFilter->header, _kCFHTTPHeaderContentEncoding);
+    if (!value) return;
+    if (CFStringGetCString(value, coding, sizeof(coding), kCFStringEncodingASCII)) {
+        char *start = coding, *end = coding + strlen(coding);
+        while (*start == ' ' || *start == '\t') start ++;
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t')) end --;
+        *end = '\0';
+        if (!strcasecmp(start, "gzip") || !strcasecmp(start, "x-gzip")) {
+            encoding = kDecodeGzip;
+        } else if (!strcasecmp(start, "deflate")) {
+            encoding = kDecodeDeflate;
+#if defined(HAVE_BROTLI)
+        } else if (!strcasecmp(start, "br")) {
+            encoding = kDecodeBrotli;
+#endif
+        }
+    }
+    CFRelease(value);
+    // Stacked or unknown codings go to the client as-is
+    if (!encoding) return;
+
+    if (!decoder) {
+        decoder = (_CFHTTPDecoder *)CFAllocatorAllocate(CFGetAllocator(httpFilter->filteredStream.r), sizeof(_CFHTTPDecoder), 0);
+        if (!decoder) return;
+        memset(decoder, 0, sizeof(_CFHTTPDecoder));
+        httpFilter->decoder = decoder;
+    }
+    if (encoding == kDecodeBrotli) {
+#if defined(HAVE_BROTLI)
+        // libbrotlidec has no reset; a fresh instance per response is cheap next to the window it allocates lazily
+        if (decoder->brotli) BrotliDecoderDestroyInstance(decoder->brotli);
+        decoder->brotli = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+        if (!decoder->brotli) return;
+#endif
+    } else {
+        int windowBits = (encoding == kDecodeGzip) ? (16 + MAX_WBITS) : MAX_WBITS;
+        if (!decoder->zstreamInited) {
+            memset(&decoder->zstream, 0, sizeof(z_stream));
+            if (inflateInit2(&decoder->zstream, windowBits) != Z_OK) return;
+            decoder->zstreamInited = TRUE;
+        } else if (inflateReset2(&decoder->zstream, windowBits) != Z_OK) {
+            return;
+        }
+    }
+    decoder->encoding = encoding;
+    decoder->checkedWrapper = (encoding != kDecodeDeflate);
+    decoder->outputPending = FALSE;
+    decoder->streamEnded = FALSE;
+    decoder->rawAtEOF = FALSE;
+    decoder->sawInput = FALSE;
+    decoder->finished = FALSE;
+    decoder->inputOffset = 0;
+    decoder->inputLength = 0;
+    __CFBitSet(httpFilter->flags, IS_DECODING);
+
+    // The client sees the decoded entity, so the coding and the encoded length no longer describe it
+    CFHTTPMessageSetHeaderFieldValue(httpFilter->header, _kCFHTTPFilterContentEncodingHeader, NULL);
+    value = _CFHTTPMessageCopyHeaderFieldValueByID(httpFilter->header, _kCFHTTPHeaderContentLength);
+    if (value) {
+        CFHTTPMessageSetHeaderFieldValue(httpFilter->header, _kCFHTTPFilterContentLengthHeader, NULL);
+        CFRelease(value);
+    }
+}
+
+// Runs the buffered input through the decoder; returns the number of bytes produced, or -1 if the body is corrupt.
+static CFIndex runDecoder(_CFHTTPDecoder *decoder, UInt8 *buffer, CFIndex bufferLength) {
+    const UInt8 *input = decoder->input + decoder->inputOffset;
+    CFIndex consumed, produced;
+#if defined(HAVE_BROTLI)
+    if (decoder->encoding == kDecodeBrotli) {
+        size_t availIn = decoder->inputLength, availOut = bufferLength;
+        const uint8_t *nextIn = input;
+        uint8_t *nextOut = buffer;
+        BrotliDecoderResult result = BrotliDecoderDecompressStream(decoder->brotli, &availIn, &nextIn, &availOut, &nextOut, NULL);
+        if (result == BROTLI_DECODER_RESULT_ERROR) return -1;
+        decoder->streamEnded = (result == BROTLI_DECODER_RESULT_SUCCESS);
+        decoder->outputPending = (result == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT);
+        consumed = decoder->inputLength - availIn;
+        produced = bufferLength - availOut;
+    } else
+#endif
+    {
+        z_stream *zstream = &decoder->zstream;
+        int err;
+        zstream->next_in = (Bytef *)input;
+        zstream->avail_in = (uInt)decoder->inputLength;
+        zstream->next_out = buffer;
+        zstream->avail_out = (uInt)bufferLength;
+        err = inflate(zstream, Z_NO_FLUSH);
+        if (err == Z_STREAM_END) {
+            decoder->streamEnded = TRUE;
+        } else if (err != Z_OK && err != Z_BUF_ERROR) {
+            return -1;
+        }
+        decoder->outputPending = (!decoder->streamEnded && zstream->avail_out == 0);
+        consumed = decoder->inputLength - zstream->avail_in;
+        produced = bufferLength - zstream->avail_out;
+    }
+    decoder->inputOffset += consumed;
+    decoder->inputLength -= consumed;
+    return produced;
+}
+
+// RFC 1950: CM must be 8 (deflate) with a window of at most 32K, and the first two bytes taken as a big-endian number must be a multiple of 31
+CF_INLINE Boolean isZlibHeader(const UInt8 *bytes) {
+    return (bytes[0] & 0x0f) == Z_DEFLATED && (bytes[0] >> 4) <= 7 && ((bytes[0] << 8) | bytes[1]) % 31 == 0;
+}
+
+CF_INLINE Boolean rawBytesAvailable(_CFHTTPFilter *httpFilter) {
+    return httpFilter->chunkHeldLength != 0 || (httpFilter->_data && CFDataGetLength(httpFilter->_data) != 0) || CFReadStreamHasBytesAvailable(httpFilter->socketStream.r);
+}
+
+// The decoding stage sits on top of doChunkedRead/doPlainRead: the de-chunked body is pulled into the decoder's input buffer and inflated straight into the client's buffer.  As with the raw reads, we only block when we have nothing at all to return.
+static CFIndex doDecodedRead(_CFHTTPFilter *httpFilter, UInt8 *buffer, CFIndex bufferLength, CFStreamError *error, Boolean *atEOF) {
+    _CFHTTPDecoder *decoder = httpFilter->decoder;
+    CFIndex lengthFilled = 0;
+    *atEOF = FALSE;
+    error->error = 0;
+
+    // zlib counts in uInts
+    if (bufferLength > INT_MAX) bufferLength = INT_MAX;
+
+    while (lengthFilled < bufferLength) {
+        CFIndex produced;
+        if (decoder->inputLength == 0 && !decoder->outputPending) {
+            CFIndex numRead;
+            if (decoder->rawAtEOF) {
+                // Everything has been read and run through the decoder.  Unless the body was empty, the encoded stream must have ended too, or the body was cut short.
+                if (!decoder->streamEnded && decoder->sawInput) {
+                    setParseFailure(httpFilter, error);
+                    return -1;
+                }
+                *atEOF = TRUE;
+                break;
+            }
+            if (lengthFilled > 0 && !rawBytesAvailable(httpFilter)) {
+                break;
+            }
+            numRead = doRawRead(httpFilter, decoder->input, DECODE_BUFFER_LENGTH, error, &decoder->rawAtEOF);
+            if (numRead < 0) {
+                return -1;
+            } else if (numRead == 0) {
+                decoder->rawAtEOF = TRUE;
+            }
+            decoder->inputOffset = 0;
+            decoder->inputLength = numRead;
+            if (!decoder->checkedWrapper) {
+                // Nothing has been decoded yet, so it's fine to block for the two bytes that tell a zlib stream from a bare one
+                while (decoder->inputLength < 2 && !decoder->rawAtEOF) {
+                    numRead = doRawRead(httpFilter, decoder->input + decoder->inputLength, DECODE_BUFFER_LENGTH - decoder->inputLength, error, &decoder->rawAtEOF);
+                    if (numRead < 0) {
+                        return -1;
+                    } else if (numRead == 0) {
+                        decoder->rawAtEOF = TRUE;
+                    }
+                    decoder->inputLength += numRead;
+                }
+                decoder->checkedWrapper = TRUE;
+                if (decoder->inputLength >= 2 && !isZlibHeader(decoder->input) && inflateReset2(&decoder->zstream, -MAX_WBITS) != Z_OK) {
+                    setParseFailure(httpFilter, error);
+                    return -1;
+                }
+            }
+            if (decoder->inputLength > 0) decoder->sawInput = TRUE;
+            continue;
+        }
+        if (decoder->streamEnded) {
+            // Trailing bytes after the end of the encoded body; drop them
+            decoder->inputLength = 0;
+            continue;
+        }
+        produced = runDecoder(decoder, buffer + lengthFilled, bufferLength - lengthFilled);
+        if (produced < 0) {
+            setParseFailure(httpFilter, error);
+            return -1;
+        }
+        lengthFilled += produced;
+    }
+    if (*atEOF) {
+        decoder->finished = TRUE;
+    }
+    return lengthFilled;
+}
+
 static CFIndex httpRdFilterRead(CFReadStreamRef stream, UInt8 *buffer, CFIndex bufferLength, CFStreamError *error, Boolean *atEOF, void *info) {
     _CFHTTPFilter *httpFilter = (_CFHTTPFilter *)info;
     Boolean parseSucceeded = TRUE;
@@ -1128,10 +1282,10 @@ static CFIndex httpRdFilterRead(CFReadStreamRef stream, UInt8 *buffer, CFIndex b
         return -1; // readHeaderBytes set our error code for us.
     }
     
-    if (__CFBitIsSet(httpFilter->flags, IS_CHUNKED)) {
-        result = doChunkedRead(httpFilter, buffer, bufferLength, error, atEOF);
+    if (__CFBitIsSet(httpFilter->flags, IS_DECODING)) {
+        result = doDecodedRead(httpFilter, buffer, bufferLength, error, atEOF);
     } else {
-        result = doPlainRead(httpFilter, buffer, bufferLength, error, atEOF);
+        result = doRawRead(httpFilter, buffer, bufferLength, error, atEOF);
     }
     if (*atEOF && !error->error && __CFBitIsSet(httpFilter->flags, MARK_ENABLED)) {
         *atEOF = FALSE;
@@ -1172,21 +1326,34 @@ static Boolean httpRdFilterCanReadNoSignal(CFReadStreamRef stream, _CFHTTPFilter
         } 
     }
     
-    // We are safely past the http header; now see if we need to pass a chunk header.  We cannot fold this into the code above because we may be between chunks
-    if (__CFBitIsSet(httpFilter->flags, IS_CHUNKED) && (httpFilter->expectedBytes == httpFilter->processedBytes || httpFilter->expectedBytes == MID_CHUNK_HEADER_PARSE)) {
-        if (__CFBitIsSet(httpFilter->flags, LAST_CHUNK)) {
+    if (__CFBitIsSet(httpFilter->flags, IS_DECODING) && !httpFilter->decoder->finished && (httpFilter->decoder->inputLength != 0 || httpFilter->decoder->outputPending || httpFilter->decoder->rawAtEOF)) {
+        // The decoder is holding bytes (or the end of the body) for the next read
+        return TRUE;
+    }
+
+    // We are safely past the http header; now see if we need to pass a chunk header.  We cannot fold this into the code above because we may be between chunks.  Any body bytes behind the chunk header are held for the next read.
+    if (__CFBitIsSet(httpFilter->flags, IS_CHUNKED)) {
+        if (__CFBitIsSet(httpFilter->flags, LAST_CHUNK) || httpFilter->chunkHeldLength != 0) {
             return TRUE;
-        } else if (!readChunkedHeader(httpFilter, FALSE, buffer, BUFFER_LENGTH, err)) {
-            return FALSE;
-        } else if (httpFilter->expectedBytes == MID_CHUNK_HEADER_PARSE) {
-            return FALSE;
+        } else if (httpFilter->chunkState == kChunkStateData && !httpFilter->_data) {
+            return CFReadStreamHasBytesAvailable(httpFilter->socketStream.r);
+        } else {
+            CFIndex held = decodeChunkedBody(httpFilter, FALSE, httpFilter->chunkHeld, CHUNK_HELD_LENGTH, err);
+            if (held < 0) {
+                return FALSE;
+            }
+            httpFilter->chunkHeldLength = held;
+            return (held != 0 || __CFBitIsSet(httpFilter->flags, LAST_CHUNK));
         }
     }
     if (httpFilter->_data && CFDataGetLength(httpFilter->_data) != 0) {
         return TRUE;
     } else if (httpFilter->expectedBytes == httpFilter->processedBytes) {
         // At EOF
-        if (__CFBitIsSet(httpFilter->flags, MARK_ENABLED)) {
+        if (__CFBitIsSet(httpFilter->flags, IS_DECODING) && !httpFilter->decoder->finished) {
+            // Let the next read drain the decoder; it will find the mark itself
+            return TRUE;
+        } else if (__CFBitIsSet(httpFilter->flags, MARK_ENABLED)) {
             __CFBitSet(httpFilter->flags, AT_MARK);
             return FALSE;
         } else {
@@ -1242,6 +1409,9 @@ void _CFHTTPReadStreamReadMark(CFReadStreamRef fStream) {
         if (__CFBitIsSet(httpFilter->flags, LAX_PARSING)) {
             _CFHTTPMessageSetLaxParsing(newHeader, TRUE);
         }
+        if (!CFHTTPMessageIsRequest(newHeader)) {
+            _CFHTTPMessageSetLazyHeaders(newHeader, TRUE);
+        }
         CFRelease(httpFilter->header);
         httpFilter->header = newHeader;
         httpFilter->expectedBytes = HEADERS_NOT_YET_CHECKED;
@@ -1249,11 +1419,12 @@ void _CFHTTPReadStreamReadMark(CFReadStreamRef fStream) {
         __CFBitClear(httpFilter->flags, AT_MARK);
         __CFBitClear(httpFilter->flags, MARK_SIGNALLED);
         __CFBitClear(httpFilter->flags, IS_CHUNKED);
-        __CFBitClear(httpFilter->flags, FIRST_CHUNK);
         __CFBitClear(httpFilter->flags, LAST_CHUNK);
         __CFBitClear(httpFilter->flags, PARSE_FAILED);
         __CFBitClear(httpFilter->flags, CONNECTION_LOST);
         __CFBitClear(httpFilter->flags, ZERO_LENGTH_RESPONSE_EXPECTED);
+        __CFBitClear(httpFilter->flags, DECODE_CONTENT);
+        __CFBitClear(httpFilter->flags, IS_DECODING);
 #if defined(DEBUG_FILTER)
         CFRelease(httpFilter->_allData);
         httpFilter->_allData = CFDataCreateMutable(NULL, 0);
@@ -1327,6 +1498,18 @@ static Boolean httpRdFilterSetProperty(CFReadStreamRef stream, CFStringRef propN
         }
 		__CFSpinUnlock(&filter->lock);
         return TRUE;
+    } else if (CFEqual(propName, _kCFStreamPropertyHTTPDecodeContent)) {
+        if (propValue == kCFBooleanTrue) {
+            __CFBitSet(filter->flags, DECODE_CONTENT);
+            // The headers may already have been parsed while the stream was being polled
+            if (filter->expectedBytes != HEADERS_NOT_YET_CHECKED && !__CFBitIsSet(filter->flags, AT_MARK) && !__CFBitIsSet(filter->flags, IS_DECODING)) {
+                startDecoding(filter);
+            }
+        } else {
+            __CFBitClear(filter->flags, DECODE_CONTENT);
+        }
+		__CFSpinUnlock(&filter->lock);
+        return TRUE;
     } else if (CFEqual(propName, _kCFStreamPropertyHTTPLaxParsing)) {
         if (propValue == kCFBooleanTrue) {
             __CFBitSet(filter->flags, LAX_PARSING);
@@ -1374,7 +1557,10 @@ CFReadStreamRef CFReadStreamCreateHTTPStream(CFAllocatorRef alloc, CFReadStreamR
     memset(&filter, 0, sizeof(_CFHTTPFilter));
     filter.socketStream.r = readStream;
     if (forResponse) {
+        // Most responses are only ever asked about a handful of headers,
+        // so don't build strings for the rest of them.
         filter.header = CFHTTPMessageCreateEmpty(alloc, FALSE);
+        _CFHTTPMessageSetLazyHeaders(filter.header, TRUE);
     } else {
         filter.header = CFHTTPMessageCreateEmpty(alloc, TRUE);
     }
@@ -1404,6 +1590,11 @@ static void *httpWrFilterCreate(CFWriteStreamRef stream, void *info) {
     CFRetain(filter->socketStream.w);
     filter->filteredStream.w = stream; // Do not retain; that will introduce a retain loop.
     filter->customSSLContext = NULL;
+    filter->decoder = NULL;
+    filter->gather = NULL;
+    filter->chunkState = kChunkStateSize;
+    filter->chunkSize = 0;
+    filter->chunkHeldLength = 0;
     return filter;
 }
 
@@ -1416,6 +1607,14 @@ static void httpWrFilterDealloc(CFWriteStreamRef stream, void *info) {
     CFWriteStreamSetClient(filter->socketStream.w, kCFStreamEventNone, NULL, NULL);
     CFRelease(filter->socketStream.w);
     if (filter->customSSLContext) CFRelease(filter->customSSLContext);
+    if (filter->gather) {
+        if (filter->gather->timer) {
+            CFRunLoopTimerInvalidate(filter->gather->timer);
+            CFRelease(filter->gather->timer);
+        }
+        if (filter->gather->bytes) CFAllocatorDeallocate(CFGetAllocator(stream), filter->gather->bytes);
+        CFAllocatorDeallocate(CFGetAllocator(stream), filter->gather);
+    }
     CFAllocatorDeallocate(CFGetAllocator(stream), filter);
 }
 
@@ -1483,12 +1682,27 @@ static Boolean httpWrFilterOpen(CFWriteStreamRef stream, CFStreamError *errorCod
 
 static void httpWrFilterClose(CFWriteStreamRef stream, void *info) {
     _CFHTTPFilter *filter = (_CFHTTPFilter *)info;
+    CFStreamError error = {0, 0};
 	__CFSpinLock(&filter->lock);
+    if (filter->gather && filter->gather->length != 0) {
+        writeGatheredChunk(filter, NULL, 0, &error);
+    }
+    if (error.error == 0 && __CFBitIsSet(filter->flags, HEADER_HELD)) {
+        transmitHeader(filter, TRUE, FALSE);
+    }
     CFWriteStreamClose(filter->socketStream.w);
 	__CFSpinUnlock(&filter->lock);
+    if (error.error != 0) {
+        CFWriteStreamSignalEvent(stream, kCFStreamEventErrorOccurred, &error);
+    }
 }
 
-static CFStreamError transmitHeader(_CFHTTPFilter *filter, Boolean blockUntilDone) {
+/*
+   When holdForBody is set and a body is expected, the serialized header is
+   held back (HEADER_HELD) so that transmitHeaderWithBody can send it along
+   with the first body bytes in one write.  Passing FALSE flushes a held header.
+*/
+static CFStreamError transmitHeader(_CFHTTPFilter *filter, Boolean blockUntilDone, Boolean holdForBody) {
     CFStreamError err = {0, 0};
     long long length;
     const UInt8 *bytes;
@@ -1568,6 +1782,16 @@ static CFStreamError transmitHeader(_CFHTTPFilter *filter, Boolean blockUntilDon
         filter->_data = (CFMutableDataRef)_CFHTTPMessageCopySerializedHeaders(filter->header, __CFBitIsSet(filter->flags, IS_PROXY));  
         isFirstWriteOfHeader = TRUE;
         filter->processedBytes = 0;
+
+#if !defined(__WIN32__)
+        if (filter->_data && (filter->expectedBytes > 0 || __CFBitIsSet(filter->flags, IS_CHUNKED))) {
+            CFTypeRef gather = CFWriteStreamCopyProperty(stream, _kCFStreamPropertySocketGatherWrite);
+            if (gather) {
+                __CFBitSet(filter->flags, HEADER_HELD);
+                CFRelease(gather);
+            }
+        }
+#endif
     }
 
     if (!filter->_data) {
@@ -1575,6 +1799,14 @@ static CFStreamError transmitHeader(_CFHTTPFilter *filter, Boolean blockUntilDon
         err.error = kCFStreamErrorHTTPParseFailure;
         return err;
     }
+
+    if (__CFBitIsSet(filter->flags, HEADER_HELD)) {
+        if (holdForBody) {
+            return err;
+        }
+        __CFBitClear(filter->flags, HEADER_HELD);
+        isFirstWriteOfHeader = (filter->processedBytes == 0);
+    }
     length = CFDataGetLength(filter->_data);
     bytes = CFDataGetBytePtr(filter->_data);
     while (filter->processedBytes < length && (blockUntilDone || CFWriteStreamCanAcceptBytes(stream))) {
@@ -1611,12 +1843,11 @@ static CFStreamError transmitHeader(_CFHTTPFilter *filter, Boolean blockUntilDon
 
 // CFIndex <= uint64 so no more than 16 characters to encode + 2 for CRLF + 2 for leading CRLF
 #define MAX_CHUNK_HEADER_SIZE (20)
-static void sendChunkHeader(CFWriteStreamRef stream, CFIndex chunkLength, Boolean firstChunk, CFStreamError *error) {
+
+// Formats the chunk header at the end of writeBuffer and returns where it starts
+static UInt8 *formatChunkHeader(UInt8 writeBuffer[MAX_CHUNK_HEADER_SIZE], CFIndex chunkLength, Boolean firstChunk) {
     // hex representation of chunkLength, followed by CRLF
-    UInt8 writeBuffer[MAX_CHUNK_HEADER_SIZE];
     UInt8 *writeBase;
-    CFIndex bytesWritten;
-    error->error = 0;
     writeBuffer[MAX_CHUNK_HEADER_SIZE - 1] = '\n';
     writeBuffer[MAX_CHUNK_HEADER_SIZE - 2] = '\r';
     writeBase = &(writeBuffer[MAX_CHUNK_HEADER_SIZE-3]); 
@@ -1633,8 +1864,14 @@ static void sendChunkHeader(CFWriteStreamRef stream, CFIndex chunkLength, Boolea
         writeBase --;
         *writeBase = '\r';
     }
-    while (writeBase < writeBuffer + MAX_CHUNK_HEADER_SIZE) {
-        bytesWritten = CFWriteStreamWrite(stream, writeBase, writeBuffer + MAX_CHUNK_HEADER_SIZE - writeBase);
+    return writeBase;
+}
+
+static void writeAllBytes(CFWriteStreamRef stream, const UInt8 *writeBase, const UInt8 *writeEnd, CFStreamError *error) {
+    CFIndex bytesWritten;
+    error->error = 0;
+    while (writeBase < writeEnd) {
+        bytesWritten = CFWriteStreamWrite(stream, writeBase, writeEnd - writeBase);
         if (bytesWritten < 0) {
             *error = CFWriteStreamGetError(stream);
             break;
@@ -1649,6 +1886,102 @@ static void sendChunkHeader(CFWriteStreamRef stream, CFIndex chunkLength, Boolea
     }
 }
 
+static void sendChunkHeader(CFWriteStreamRef stream, CFIndex chunkLength, Boolean firstChunk, CFStreamError *error) {
+    UInt8 writeBuffer[MAX_CHUNK_HEADER_SIZE];
+    UInt8 *writeBase = formatChunkHeader(writeBuffer, chunkLength, firstChunk);
+    writeAllBytes(stream, writeBase, writeBuffer + MAX_CHUNK_HEADER_SIZE, error);
+}
+
+#if !defined(__WIN32__)
+/*
+   Sends what's left of a held header, the chunk header if chunked, and the
+   start of the body with a single gather write.  Returns the number of body
+   bytes written, which may be zero if the write came up short; the filter is
+   then left in a state where the regular write path can carry on.
+*/
+static CFIndex transmitHeaderWithBody(_CFHTTPFilter *filter, const UInt8 *buffer, CFIndex bufferLength, CFStreamError *error) {
+    CFWriteStreamRef stream = filter->socketStream.w;
+    UInt8 chunkBuffer[MAX_CHUNK_HEADER_SIZE];
+    UInt8 *chunkBase = NULL;
+    CFIndex headerLength = CFDataGetLength(filter->_data) - filter->processedBytes;
+    CFIndex chunkLength = 0;
+    CFIndex bytesWritten;
+    Boolean isFirstWriteOfHeader = (filter->processedBytes == 0);
+    struct iovec iov[3];
+    int iovcnt = 0;
+
+    iov[iovcnt].iov_base = (void *)(CFDataGetBytePtr(filter->_data) + filter->processedBytes);
+    iov[iovcnt++].iov_len = headerLength;
+
+    if (__CFBitIsSet(filter->flags, IS_CHUNKED)) {
+        chunkBase = formatChunkHeader(chunkBuffer, bufferLength, __CFBitIsSet(filter->flags, FIRST_CHUNK));
+        chunkLength = chunkBuffer + MAX_CHUNK_HEADER_SIZE - chunkBase;
+        iov[iovcnt].iov_base = chunkBase;
+        iov[iovcnt++].iov_len = chunkLength;
+    } else if (bufferLength > filter->expectedBytes) {
+        // Do not allow more than the promised number of bytes to be written
+        bufferLength = filter->expectedBytes;
+    }
+
+    iov[iovcnt].iov_base = (void *)buffer;
+    iov[iovcnt++].iov_len = bufferLength;
+
+    bytesWritten = _CFSocketStreamWriteVector(stream, iov, iovcnt, error);
+    if (bytesWritten <= 0) {
+        if (bytesWritten == 0) {
+            // Premature end-of-stream
+            if (isFirstWriteOfHeader) {
+                error->domain = kCFStreamErrorDomainHTTP;
+                error->error = kCFStreamErrorHTTPConnectionLost;
+            } else {
+                setParseFailure(filter, error);
+            }
+        } else if (isFirstWriteOfHeader && error->domain == _kCFStreamErrorDomainNativeSockets && (error->error == EPIPE || error->error == ECONNRESET)) {
+            error->domain = kCFStreamErrorDomainHTTP;
+            error->error = kCFStreamErrorHTTPConnectionLost;
+        }
+        CFRelease(filter->_data);
+        filter->_data = NULL;
+        filter->processedBytes = 0;
+        __CFBitClear(filter->flags, HEADER_HELD);
+        __CFBitSet(filter->flags, HEADER_TRANSMITTED);
+        return -1;
+    }
+
+    if (bytesWritten < headerLength) {
+        // Didn't get past the header; finish it off and let the body go the usual way.
+        filter->processedBytes += bytesWritten;
+        *error = transmitHeader(filter, TRUE, FALSE);
+        return error->error ? -1 : 0;
+    }
+
+    bytesWritten -= headerLength;
+    CFRelease(filter->_data);
+    filter->_data = NULL;
+    filter->processedBytes = 0;
+    __CFBitClear(filter->flags, HEADER_HELD);
+    __CFBitSet(filter->flags, HEADER_TRANSMITTED);
+
+    if (__CFBitIsSet(filter->flags, IS_CHUNKED)) {
+        __CFBitClear(filter->flags, FIRST_CHUNK);
+        if (bytesWritten < chunkLength) {
+            writeAllBytes(stream, chunkBase + bytesWritten, chunkBuffer + MAX_CHUNK_HEADER_SIZE, error);
+            if (error->error != 0) {
+                return -1;
+            }
+            bytesWritten = 0;
+        } else {
+            bytesWritten -= chunkLength;
+        }
+        // Now in the middle of this chunk
+        filter->expectedBytes = bufferLength;
+    }
+
+    filter->processedBytes = bytesWritten;
+    return bytesWritten;
+}
+#endif
+
 static CFIndex doChunkedWrite(const UInt8 *buffer, CFIndex bufferLength, CFStreamError *error, _CFHTTPFilter *filter) {
     CFIndex totalBytesWritten = 0;
     CFWriteStreamRef stream = filter->socketStream.w;
@@ -1693,6 +2026,176 @@ static CFIndex doChunkedWrite(const UInt8 *buffer, CFIndex bufferLength, CFStrea
     
 }
 
+#if !defined(__WIN32__)
+// Like writeAllBytes, but for a gather write.  iov is used up as the bytes go out.
+static void writeAllVector(CFWriteStreamRef stream, struct iovec *iov, int iovcnt, CFStreamError *error) {
+    CFIndex bytesWritten;
+    error->error = 0;
+    while (iovcnt > 0) {
+        bytesWritten = _CFSocketStreamWriteVector(stream, iov, iovcnt, error);
+        if (bytesWritten < 0) {
+            break;
+        } else if (bytesWritten == 0) {
+            // Premature EOF
+            error->domain = kCFStreamErrorDomainHTTP;
+            error->error = kCFStreamErrorHTTPParseFailure;
+            break;
+        }
+        while (iovcnt > 0 && bytesWritten >= (CFIndex)iov->iov_len) {
+            bytesWritten -= iov->iov_len;
+            iov ++;
+            iovcnt --;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (UInt8 *)iov->iov_base + bytesWritten;
+            iov->iov_len -= bytesWritten;
+        }
+    }
+}
+#endif
+
+/*
+   Sends the gathered bytes, followed by extra, as a single chunk.  The chunk
+   header is formatted directly in front of the gathered bytes, and a held
+   request header goes out in the same write; with gather writes available
+   the whole thing takes one system call.  Blocks until everything is out.
+*/
+static Boolean writeGatheredChunk(_CFHTTPFilter *filter, const UInt8 *extra, CFIndex extraLength, CFStreamError *error) {
+    CFWriteStreamRef stream = filter->socketStream.w;
+    _CFHTTPChunkGather *gather = filter->gather;
+    UInt8 *chunkEnd = gather->bytes + MAX_CHUNK_HEADER_SIZE + gather->length;
+    UInt8 *chunkBase;
+#if !defined(__WIN32__)
+    Boolean headerHeld = __CFBitIsSet(filter->flags, HEADER_HELD);
+    Boolean vectored = headerHeld;
+    struct iovec iov[3];
+    int iovcnt = 0;
+#endif
+
+    error->error = 0;
+    if (gather->length + extraLength == 0) {
+        return TRUE;
+    }
+    chunkBase = formatChunkHeader(gather->bytes, gather->length + extraLength, __CFBitIsSet(filter->flags, FIRST_CHUNK));
+    __CFBitClear(filter->flags, FIRST_CHUNK);
+    gather->length = 0;
+
+#if !defined(__WIN32__)
+    if (!vectored && extraLength != 0) {
+        CFTypeRef gatherWrite = CFWriteStreamCopyProperty(stream, _kCFStreamPropertySocketGatherWrite);
+        if (gatherWrite) {
+            vectored = TRUE;
+            CFRelease(gatherWrite);
+        }
+    }
+    if (vectored) {
+        Boolean isFirstWriteOfHeader = headerHeld && (filter->processedBytes == 0);
+        if (headerHeld) {
+            iov[iovcnt].iov_base = (void *)(CFDataGetBytePtr(filter->_data) + filter->processedBytes);
+            iov[iovcnt++].iov_len = CFDataGetLength(filter->_data) - filter->processedBytes;
+        }
+        iov[iovcnt].iov_base = chunkBase;
+        iov[iovcnt++].iov_len = chunkEnd - chunkBase;
+        if (extraLength != 0) {
+            iov[iovcnt].iov_base = (void *)extra;
+            iov[iovcnt++].iov_len = extraLength;
+        }
+        writeAllVector(stream, iov, iovcnt, error);
+        if (headerHeld) {
+            if (isFirstWriteOfHeader && error->error && error->domain == _kCFStreamErrorDomainNativeSockets && (error->error == EPIPE || error->error == ECONNRESET)) {
+                error->domain = kCFStreamErrorDomainHTTP;
+                error->error = kCFStreamErrorHTTPConnectionLost;
+            }
+            CFRelease(filter->_data);
+            filter->_data = NULL;
+            filter->processedBytes = 0;
+            __CFBitClear(filter->flags, HEADER_HELD);
+            __CFBitSet(filter->flags, HEADER_TRANSMITTED);
+        }
+        return error->error == 0;
+    }
+#endif
+    writeAllBytes(stream, chunkBase, chunkEnd, error);
+    if (error->error == 0 && extraLength != 0) {
+        writeAllBytes(stream, extra, extra + extraLength, error);
+    }
+    return error->error == 0;
+}
+
+static void gatherTimerCallBack(CFRunLoopTimerRef timer, void *info) {
+    _CFHTTPFilter *filter = (_CFHTTPFilter *)info;
+    CFStreamError error = {0, 0};
+    __CFSpinLock(&filter->lock);
+    if (filter->gather->length != 0 && filter->gather->interval > 0) {
+        CFAbsoluteTime deadline = filter->gather->started + filter->gather->interval;
+        if (CFAbsoluteTimeGetCurrent() < deadline) {
+            // The chunk we were armed for went out early; wait on the one being gathered now
+            CFRunLoopTimerSetNextFireDate(timer, deadline);
+        } else {
+            writeGatheredChunk(filter, NULL, 0, &error);
+        }
+    }
+    __CFSpinUnlock(&filter->lock);
+    if (error.error != 0) {
+        CFWriteStreamSignalEvent(filter->filteredStream.w, kCFStreamEventErrorOccurred, &error);
+    }
+}
+
+// Sees to it that the gathered bytes go out once they've waited the flush interval, even if no more writes come
+static void armGatherTimer(_CFHTTPFilter *filter) {
+    _CFHTTPChunkGather *gather = filter->gather;
+    CFAbsoluteTime deadline = gather->started + gather->interval;
+    if (gather->timer) {
+        CFRunLoopTimerSetNextFireDate(gather->timer, deadline);
+    } else {
+        CFRunLoopTimerContext ctxt = {0, filter, NULL, NULL, NULL};
+        CFArrayRef rlArray = _CFWriteStreamCopyRunLoopsAndModes(filter->filteredStream.w);
+        // The interval is only there to keep the timer valid after it fires; it is rearmed for each chunk
+        gather->timer = CFRunLoopTimerCreate(CFGetAllocator(filter->filteredStream.w), deadline, 1.0e10, 0, 0, gatherTimerCallBack, &ctxt);
+        if (rlArray) {
+            CFIndex i, c = CFArrayGetCount(rlArray);
+            if (gather->timer) {
+                for (i = 0; i + 1 < c; i += 2) {
+                    CFRunLoopAddTimer((CFRunLoopRef)CFArrayGetValueAtIndex(rlArray, i), gather->timer, (CFStringRef)CFArrayGetValueAtIndex(rlArray, i + 1));
+                }
+            }
+            CFRelease(rlArray);
+        }
+    }
+}
+
+/*
+   Gathers small writes into chunks of up to gather->size bytes.  A write
+   that would fill the chunk is sent straight from the caller's buffer along
+   with whatever was gathered ahead of it, so large writes are never copied.
+*/
+static CFIndex doGatheredWrite(const UInt8 *buffer, CFIndex bufferLength, CFStreamError *error, _CFHTTPFilter *filter) {
+    _CFHTTPChunkGather *gather = filter->gather;
+    error->error = 0;
+    if (filter->expectedBytes > filter->processedBytes) {
+        // Finish the chunk that was under way when gathering was turned on
+        CFIndex remaining = filter->expectedBytes - filter->processedBytes;
+        return doChunkedWrite(buffer, bufferLength < remaining ? bufferLength : remaining, error, filter);
+    }
+    if (bufferLength == 0) {
+        return 0;
+    }
+    if (gather->length + bufferLength >= gather->size) {
+        return writeGatheredChunk(filter, buffer, bufferLength, error) ? bufferLength : -1;
+    }
+    if (gather->length == 0) {
+        gather->started = CFAbsoluteTimeGetCurrent();
+        if (gather->interval > 0) armGatherTimer(filter);
+    }
+    memmove(gather->bytes + MAX_CHUNK_HEADER_SIZE + gather->length, buffer, bufferLength);
+    gather->length += bufferLength;
+    // Checked here as well as by the timer, which cannot fire if the client is writing synchronously
+    if (gather->interval > 0 && CFAbsoluteTimeGetCurrent() >= gather->started + gather->interval) {
+        if (!writeGatheredChunk(filter, NULL, 0, error)) return -1;
+    }
+    return bufferLength;
+}
+
 static CFIndex httpWrFilterWrite(CFWriteStreamRef stream, const UInt8 *buffer, CFIndex bufferLength, CFStreamError *error, void *info) {
     _CFHTTPFilter *filter = (_CFHTTPFilter *)info;
     error->error = 0;
@@ -1711,12 +2214,27 @@ static CFIndex httpWrFilterWrite(CFWriteStreamRef stream, const UInt8 *buffer, C
         return -1;
     }
     if (!__CFBitIsSet(filter->flags, HEADER_TRANSMITTED)) {
-        *error = transmitHeader(filter, TRUE);
+        *error = transmitHeader(filter, TRUE, bufferLength > 0);
     }
     if (error->error != 0) {
 		__CFSpinUnlock(&filter->lock);
         return -1;
     }
+    if (isGatheringChunks(filter)) {
+        // A held header goes out with the first gathered chunk
+        CFIndex result = doGatheredWrite(buffer, bufferLength, error, filter);
+        __CFSpinUnlock(&filter->lock);
+        return result;
+    }
+#if !defined(__WIN32__)
+    if (__CFBitIsSet(filter->flags, HEADER_HELD)) {
+        CFIndex result = transmitHeaderWithBody(filter, buffer, bufferLength, error);
+        if (result != 0) {
+            __CFSpinUnlock(&filter->lock);
+            return result;
+        }
+    }
+#endif
     if (__CFBitIsSet(filter->flags, IS_CHUNKED)) {
         CFIndex result = doChunkedWrite(buffer, bufferLength, error, filter);
 		__CFSpinUnlock(&filter->lock);
@@ -1765,14 +2283,14 @@ static Boolean httpWrFilterCanWrite(CFWriteStreamRef stream, void *info) {
 		return FALSE; // Only way this can happen is if we've not yet been given the first request header; we refuse to write until the first request has been given to us and been sent along.
     }
 	if (!__CFBitIsSet(filter->flags, HEADER_TRANSMITTED)) {
-        CFStreamError error  = transmitHeader(filter, FALSE);
+        CFStreamError error  = transmitHeader(filter, FALSE, TRUE);
         if (error.error != 0) {
 			__CFSpinUnlock(&filter->lock);
             CFWriteStreamSignalEvent(stream, kCFStreamEventErrorOccurred, &error);
             return FALSE;
         } 
     }
-    if (!__CFBitIsSet(filter->flags, HEADER_TRANSMITTED) || !CFWriteStreamCanAcceptBytes(filter->socketStream.w)) {
+    if ((!__CFBitIsSet(filter->flags, HEADER_TRANSMITTED) && !__CFBitIsSet(filter->flags, HEADER_HELD)) || !CFWriteStreamCanAcceptBytes(filter->socketStream.w)) {
 		__CFSpinUnlock(&filter->lock);
         return FALSE;
     }
@@ -1789,6 +2307,20 @@ extern
 void _CFHTTPWriteStreamWriteMark(CFWriteStreamRef filteredStream) {
     _CFHTTPFilter *filter = (_CFHTTPFilter *)CFWriteStreamGetInfoPointer(filteredStream);
 
+    if (filter->gather && filter->gather->length != 0) {
+        // The last of the body has to go out ahead of the trailer; without it there's no point in the trailer
+        CFStreamError error;
+        if (!writeGatheredChunk(filter, NULL, 0, &error)) {
+            CFWriteStreamSignalEvent(filteredStream, kCFStreamEventErrorOccurred, &error);
+            return;
+        }
+    }
+
+    if (__CFBitIsSet(filter->flags, HEADER_HELD)) {
+        // The body never came, but the header still has to go out.
+        transmitHeader(filter, TRUE, FALSE);
+    }
+
     if (__CFBitIsSet(filter->flags, MARK_ENABLED)) {
         __CFBitSet(filter->flags, AT_MARK);
         if (filter->header && __CFBitIsSet(filter->flags, IS_CHUNKED)) {
@@ -1814,6 +2346,12 @@ static CFTypeRef httpWrFilterCopyProperty(CFWriteStreamRef stream, CFStringRef p
 		if (__CFBitIsSet(filter->flags, HTTPS_PROXY_FAILURE)) result = kCFBooleanTrue;
 	} else if (CFEqual(propertyName, _kCFStreamPropertyHTTPPersistent)) {
         result = __CFBitIsSet(filter->flags, MARK_ENABLED) ? kCFBooleanTrue : kCFBooleanFalse;
+    } else if (CFEqual(propertyName, _kCFStreamPropertyHTTPChunkSize)) {
+        CFIndex size = filter->gather ? filter->gather->size : 0;
+        result = CFNumberCreate(CFGetAllocator(stream), kCFNumberCFIndexType, &size);
+    } else if (CFEqual(propertyName, _kCFStreamPropertyHTTPChunkFlushInterval)) {
+        CFTimeInterval interval = filter->gather ? filter->gather->interval : 0;
+        result = CFNumberCreate(CFGetAllocator(stream), kCFNumberDoubleType, &interval);
     } else if (filter->header && ((CFHTTPMessageIsRequest(filter->header) && CFEqual(propertyName, kCFStreamPropertyHTTPRequest)) || (!CFHTTPMessageIsRequest(filter->header) && CFEqual(propertyName, kCFStreamPropertyHTTPResponseHeader)))) {
         CFRetain(filter->header);
         result = filter->header;
@@ -1848,6 +2386,58 @@ static void prepareHTTPSProxy(_CFHTTPFilter *filter) {
 	}
 }
 
+// Handles the chunk gathering properties.  Anything already gathered is sent before the chunk size changes.
+static Boolean setGatherProperty(CFWriteStreamRef stream, _CFHTTPFilter *filter, CFStringRef propName, CFTypeRef propValue, CFStreamError *error) {
+    CFAllocatorRef alloc = CFGetAllocator(stream);
+    _CFHTTPChunkGather *gather = filter->gather;
+    if (CFEqual(propName, _kCFStreamPropertyHTTPChunkFlush)) {
+        if (propValue != kCFBooleanTrue) return FALSE;
+        return gather ? writeGatheredChunk(filter, NULL, 0, error) : TRUE;
+    }
+    if (!propValue || CFGetTypeID(propValue) != CFNumberGetTypeID()) {
+        return FALSE;
+    }
+    if (CFEqual(propName, _kCFStreamPropertyHTTPChunkFlushInterval)) {
+        CFTimeInterval interval;
+        CFNumberGetValue((CFNumberRef)propValue, kCFNumberDoubleType, &interval);
+        if (interval < 0) return FALSE;
+        if (!gather && interval == 0) return TRUE;
+        if (!gather) {
+            gather = (_CFHTTPChunkGather *)CFAllocatorAllocate(alloc, sizeof(_CFHTTPChunkGather), 0);
+            if (!gather) return FALSE;
+            memset(gather, 0, sizeof(_CFHTTPChunkGather));
+            filter->gather = gather;
+        }
+        gather->interval = interval;
+        return TRUE;
+    } else {
+        CFIndex size;
+        UInt8 *bytes = NULL;
+        CFNumberGetValue((CFNumberRef)propValue, kCFNumberCFIndexType, &size);
+        if (size < 0) return FALSE;
+        if (gather ? gather->size == size : size == 0) return TRUE;
+        if (size > 0) {
+            bytes = (UInt8 *)CFAllocatorAllocate(alloc, MAX_CHUNK_HEADER_SIZE + size, 0);
+            if (!bytes) return FALSE;
+        }
+        if (!gather) {
+            gather = (_CFHTTPChunkGather *)CFAllocatorAllocate(alloc, sizeof(_CFHTTPChunkGather), 0);
+            if (!gather) {
+                CFAllocatorDeallocate(alloc, bytes);
+                return FALSE;
+            }
+            memset(gather, 0, sizeof(_CFHTTPChunkGather));
+            filter->gather = gather;
+        } else if (gather->length != 0) {
+            writeGatheredChunk(filter, NULL, 0, error);
+        }
+        if (gather->bytes) CFAllocatorDeallocate(alloc, gather->bytes);
+        gather->bytes = bytes;
+        gather->size = size;
+        return TRUE;
+    }
+}
+
 static Boolean httpWrFilterSetProperty(CFWriteStreamRef stream, CFStringRef propName, CFTypeRef propValue, void *info) {
     _CFHTTPFilter *filter = (_CFHTTPFilter *)info;
 	__CFSpinLock(&filter->lock);
@@ -1859,6 +2449,14 @@ static Boolean httpWrFilterSetProperty(CFWriteStreamRef stream, CFStringRef prop
         }
 		__CFSpinUnlock(&filter->lock);
         return TRUE;
+    } else if (CFEqual(propName, _kCFStreamPropertyHTTPChunkSize) || CFEqual(propName, _kCFStreamPropertyHTTPChunkFlushInterval) || CFEqual(propName, _kCFStreamPropertyHTTPChunkFlush)) {
+        CFStreamError error = {0, 0};
+        Boolean result = setGatherProperty(stream, filter, propName, propValue, &error);
+		__CFSpinUnlock(&filter->lock);
+        if (error.error != 0) {
+            CFWriteStreamSignalEvent(stream, kCFStreamEventErrorOccurred, &error);
+        }
+        return result;
     } else if ((filter->header == NULL || (__CFBitIsSet(filter->flags, MARK_ENABLED) && __CFBitIsSet(filter->flags, AT_MARK))) && CFEqual(propName, _kCFStreamPropertyHTTPNewHeader) && CFGetTypeID(propValue) == CFHTTPMessageGetTypeID()) {
 		CFHTTPMessageRef msg = (CFHTTPMessageRef)propValue;
 		CFRetain(msg);
@@ -1866,6 +2464,7 @@ static Boolean httpWrFilterSetProperty(CFWriteStreamRef stream, CFStringRef prop
 		filter->header = msg;
 		filter->expectedBytes = 0;
 		filter->processedBytes = 0;
+		if (filter->gather) filter->gather->length = 0;
 		if (filter->_data) {
 			CFRelease(filter->_data);
 			filter->_data = NULL;
@@ -1874,6 +2473,7 @@ static Boolean httpWrFilterSetProperty(CFWriteStreamRef stream, CFStringRef prop
 		__CFBitClear(filter->flags, DATA_IS_MUTABLE);
 		__CFBitClear(filter->flags, AT_MARK);
 		__CFBitClear(filter->flags, HEADER_TRANSMITTED);
+		__CFBitClear(filter->flags, HEADER_HELD);
 		__CFBitClear(filter->flags, HTTPS_PROXY_FAILURE);
 		
 		if ((__CFBitIsSet(filter->flags, STRIP_PROXY_AUTH) || __CFBitIsSet(filter->flags, IS_PROXY)) && CFHTTPMessageIsRequest(msg)) {
@@ -1902,7 +2502,7 @@ static Boolean httpWrFilterSetProperty(CFWriteStreamRef stream, CFStringRef prop
 		}
 		
 		if (CFWriteStreamCanAcceptBytes(filter->socketStream.w)) {
-			transmitHeader(filter, FALSE);
+			transmitHeader(filter, FALSE, TRUE);
 		}
 		
 		__CFSpinUnlock(&filter->lock);
@@ -1928,6 +2528,7 @@ static void httpWrFilterSchedule(CFWriteStreamRef stream, CFRunLoopRef runLoop,
     _CFHTTPFilter *filter = (_CFHTTPFilter *)info;
 	__CFSpinLock(&filter->lock);
     CFWriteStreamScheduleWithRunLoop(filter->socketStream.w, runLoop, runLoopMode);
+    if (filter->gather && filter->gather->timer) CFRunLoopAddTimer(runLoop, filter->gather->timer, runLoopMode);
 	__CFSpinUnlock(&filter->lock);
 }
 
@@ -1935,6 +2536,7 @@ static void httpWrFilterUnschedule(CFWriteStreamRef stream, CFRunLoopRef runLoop
     _CFHTTPFilter *filter = (_CFHTTPFilter *)info;
 	__CFSpinLock(&filter->lock);
     CFWriteStreamUnscheduleFromRunLoop(filter->socketStream.w, runLoop, runLoopMode);
+    if (filter->gather && filter->gather->timer) CFRunLoopRemoveTimer(runLoop, filter->gather->timer, runLoopMode);
 	__CFSpinUnlock(&filter->lock);
 }
 
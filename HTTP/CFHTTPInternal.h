@@ -41,6 +41,77 @@
 extern "C" {
 #endif
 
+// Well-known header names, in the form _CFCapitalizeHeader produces.  Used to
+// look headers up without building a CFString key.
+enum _CFHTTPHeaderID {
+    _kCFHTTPHeaderUnknown = -1,
+    _kCFHTTPHeaderAccept = 0,
+    _kCFHTTPHeaderAcceptCharset,
+    _kCFHTTPHeaderAcceptEncoding,
+    _kCFHTTPHeaderAcceptLanguage,
+    _kCFHTTPHeaderAcceptRanges,
+    _kCFHTTPHeaderAccessControlAllowOrigin,
+    _kCFHTTPHeaderAge,
+    _kCFHTTPHeaderAllow,
+    _kCFHTTPHeaderAuthorization,
+    _kCFHTTPHeaderCacheControl,
+    _kCFHTTPHeaderConnection,
+    _kCFHTTPHeaderContentDisposition,
+    _kCFHTTPHeaderContentEncoding,
+    _kCFHTTPHeaderContentLanguage,
+    _kCFHTTPHeaderContentLength,
+    _kCFHTTPHeaderContentLocation,
+    _kCFHTTPHeaderContentMd5,
+    _kCFHTTPHeaderContentRange,
+    _kCFHTTPHeaderContentSecurityPolicy,
+    _kCFHTTPHeaderContentType,
+    _kCFHTTPHeaderCookie,
+    _kCFHTTPHeaderDate,
+    _kCFHTTPHeaderEtag,
+    _kCFHTTPHeaderExpect,
+    _kCFHTTPHeaderExpires,
+    _kCFHTTPHeaderFrom,
+    _kCFHTTPHeaderHost,
+    _kCFHTTPHeaderIfMatch,
+    _kCFHTTPHeaderIfModifiedSince,
+    _kCFHTTPHeaderIfNoneMatch,
+    _kCFHTTPHeaderIfRange,
+    _kCFHTTPHeaderIfUnmodifiedSince,
+    _kCFHTTPHeaderKeepAlive,
+    _kCFHTTPHeaderLastModified,
+    _kCFHTTPHeaderLink,
+    _kCFHTTPHeaderLocation,
+    _kCFHTTPHeaderMaxForwards,
+    _kCFHTTPHeaderOrigin,
+    _kCFHTTPHeaderPragma,
+    _kCFHTTPHeaderProxyAuthenticate,
+    _kCFHTTPHeaderProxyAuthorization,
+    _kCFHTTPHeaderProxyConnection,
+    _kCFHTTPHeaderRange,
+    _kCFHTTPHeaderReferer,
+    _kCFHTTPHeaderRefresh,
+    _kCFHTTPHeaderRetryAfter,
+    _kCFHTTPHeaderServer,
+    _kCFHTTPHeaderSetCookie,
+    _kCFHTTPHeaderSetCookie2,
+    _kCFHTTPHeaderStrictTransportSecurity,
+    _kCFHTTPHeaderTe,
+    _kCFHTTPHeaderTrailer,
+    _kCFHTTPHeaderTransferEncoding,
+    _kCFHTTPHeaderUpgrade,
+    _kCFHTTPHeaderUserAgent,
+    _kCFHTTPHeaderVary,
+    _kCFHTTPHeaderVia,
+    _kCFHTTPHeaderWarning,
+    _kCFHTTPHeaderWwwAuthenticate,
+    _kCFHTTPHeaderXForwardedFor,
+    _kCFHTTPHeaderXFrameOptions,
+    _kCFHTTPHeaderXPoweredBy,
+
+    _kCFHTTPHeaderCount
+};
+typedef enum _CFHTTPHeaderID _CFHTTPHeaderID;
+
 extern CFHTTPAuthenticationRef _CFHTTPMessageGetAuthentication(CFHTTPMessageRef message, Boolean proxy);
 extern void _CFHTTPMessageSetAuthentication(CFHTTPMessageRef message, CFHTTPAuthenticationRef auth, Boolean proxy);
 extern void _CFHTTPMessageSetResponseURL(CFHTTPMessageRef response, CFURLRef url);
@@ -49,6 +120,7 @@ extern void _CFHTTPMessageSetHeader(CFHTTPMessageRef msg, CFStringRef theHeader,
 
     
 extern void _CFHTTPMessageSetLaxParsing(CFHTTPMessageRef msg, Boolean allowLaxParsing);
+extern void _CFHTTPMessageSetLazyHeaders(CFHTTPMessageRef msg, Boolean lazy);
 extern CFDataRef _CFHTTPMessageCopySerializedMessage(CFHTTPMessageRef msg, Boolean forProxy);
 extern void _CFHTTPMessageSetHeader(CFHTTPMessageRef msg, CFStringRef theHeader, CFStringRef value, CFIndex position);
 extern Boolean _CFHTTPMessageConvertToDataOnlyResponse(CFHTTPMessageRef message);
@@ -56,6 +128,8 @@ extern Boolean _CFHTTPMessageIsEmpty(CFHTTPMessageRef message);
 extern Boolean _CFHTTPMessageCanStandAlone(CFHTTPMessageRef message);
 extern CFDataRef _CFHTTPMessageGetBody(CFHTTPMessageRef msg);
 extern Boolean _CFHTTPMessageIsGetMethod(CFHTTPMessageRef msg);
+extern _CFHTTPHeaderID _CFHTTPHeaderIDForBytes(const UInt8 *bytes, CFIndex length);
+extern CFStringRef _CFHTTPMessageCopyHeaderFieldValueByID(CFHTTPMessageRef msg, _CFHTTPHeaderID header);
 
 extern const CFStringRef _kCFStreamPropertyHTTPZeroLengthResponseExpected;
 extern const CFStringRef _kCFStreamPropertyHTTPLaxParsing;
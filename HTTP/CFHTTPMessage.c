@@ -46,6 +46,16 @@
 
 /* To do - add in asserts/argument checking */
 
+// Location of a header parsed in lazy mode.  Offsets are relative to the
+// start of the raw header bytes (see _rawHeaderBytes).
+typedef struct {
+    UInt32 _nameOffset;
+    UInt32 _nameLength;
+    UInt32 _valueOffset;
+    UInt32 _valueLength;
+    _CFHTTPHeaderID _headerID;
+} _CFHTTPHeaderRange;
+
 struct __CFHTTPMessage {
     CFRuntimeBase _cfBase;
 
@@ -59,6 +69,22 @@ struct __CFHTTPMessage {
 	CFHTTPAuthenticationRef _auth;
 	CFHTTPAuthenticationRef _proxyAuth;
     UInt32 _flags;
+
+    // Used instead of _headers while LAZY_HEADERS is set.  The raw bytes of
+    // the parsed header lines are held in _rawHeaders and _ranges indexes into
+    // them; CFStrings are only created for the headers that are asked for.
+    CFMutableDataRef _rawHeaders;
+    _CFHTTPHeaderRange* _ranges;
+    CFIndex _rangeCount;
+    CFIndex _rangeCapacity;
+
+    // Serialization cache, indexed by SERIALIZED_FORM.  _serializedLines maps
+    // a header key to its encoded "Key: value\r\n" line and survives changes
+    // to other headers, so re-sending a request with one header changed only
+    // re-encodes that one line.
+    CFMutableDictionaryRef _serializedLines;
+    CFDataRef _serializedHeaders[2];
+    CFDataRef _serializedMessage[2];
 };
 
 /* To do - convert this ot the CFBit family of functions */
@@ -79,85 +105,306 @@ struct __CFHTTPMessage {
 #define LAX_PARSING			0x00008000
 
 #define IS_GET_METHOD		0x00010000
+#define LAZY_HEADERS		0x00020000
 
-// table used in message header parsing
+// Responses serialize the same way whether or not it's for a proxy.
+#define SERIALIZED_FORM(msg, forProxy)	((((msg)->_flags & IS_RESPONSE) == 0 && (forProxy)) ? 1 : 0)
+
+// table used in message header parsing.  Names are in _CFCapitalizeHeader
+// form and indexed by _CFHTTPHeaderID.
 struct MessageHeaderMap {
-    const char			_header[19];
+    const char			_header[28];
     int					_length;
 };
 
 static const struct MessageHeaderMap kHTTPMessageHeaderMap[] = {
-    {"Accept-Ranges",		13},
-    {"Cache-Control",		13},
-    {"Connection",			10},
-    {"Content-Language",	16},
-    {"Content-Length",		14},
-    {"Content-Location",	16},
-    {"Content-Type",		12},
-    {"Date",				 4},
-    {"Etag",				 4},
-    {"Expires",				 7},
-    {"Last-Modified",		13},
-    {"Location",			 8},
-    {"Proxy-Authenticate",	18},
-    {"Server",				 6},
-    {"Set-Cookie",			10}
+    {"Accept",						 6},
+    {"Accept-Charset",				14},
+    {"Accept-Encoding",				15},
+    {"Accept-Language",				15},
+    {"Accept-Ranges",				13},
+    {"Access-Control-Allow-Origin",	27},
+    {"Age",							 3},
+    {"Allow",						 5},
+    {"Authorization",				13},
+    {"Cache-Control",				13},
+    {"Connection",					10},
+    {"Content-Disposition",			19},
+    {"Content-Encoding",			16},
+    {"Content-Language",			16},
+    {"Content-Length",				14},
+    {"Content-Location",			16},
+    {"Content-Md5",					11},
+    {"Content-Range",				13},
+    {"Content-Security-Policy",		23},
+    {"Content-Type",				12},
+    {"Cookie",						 6},
+    {"Date",						 4},
+    {"Etag",						 4},
+    {"Expect",						 6},
+    {"Expires",						 7},
+    {"From",						 4},
+    {"Host",						 4},
+    {"If-Match",					 8},
+    {"If-Modified-Since",			17},
+    {"If-None-Match",				13},
+    {"If-Range",					 8},
+    {"If-Unmodified-Since",			19},
+    {"Keep-Alive",					10},
+    {"Last-Modified",				13},
+    {"Link",						 4},
+    {"Location",					 8},
+    {"Max-Forwards",				12},
+    {"Origin",						 6},
+    {"Pragma",						 6},
+    {"Proxy-Authenticate",			18},
+    {"Proxy-Authorization",			19},
+    {"Proxy-Connection",			16},
+    {"Range",						 5},
+    {"Referer",						 7},
+    {"Refresh",						 7},
+    {"Retry-After",					11},
+    {"Server",						 6},
+    {"Set-Cookie",					10},
+    {"Set-Cookie2",					11},
+    {"Strict-Transport-Security",	25},
+    {"Te",							 2},
+    {"Trailer",						 7},
+    {"Transfer-Encoding",			17},
+    {"Upgrade",						 7},
+    {"User-Agent",					10},
+    {"Vary",						 4},
+    {"Via",							 3},
+    {"Warning",						 7},
+    {"Www-Authenticate",			16},
+    {"X-Forwarded-For",				15},
+    {"X-Frame-Options",				15},
+    {"X-Powered-By",				12}
 };
 
 #ifdef __CONSTANT_CFSTRINGS__
-#define _kCFHTTPMessageAcceptRangesHeader		CFSTR("Accept-Ranges")
-#define _kCFHTTPMessageCacheControlHeader		CFSTR("Cache-Control")
-#define _kCFHTTPMessageConnectHeader			CFSTR("Connection")
-#define _kCFHTTPMessageContentLanguageHeader	CFSTR("Content-Language")
-#define _kCFHTTPMessageContentLengthHeader		CFSTR("Content-Length")
-#define _kCFHTTPMessageContentLocationHeader	CFSTR("Content-Location")
-#define _kCFHTTPMessageContentTypeHeader		CFSTR("Content-Type")
-#define _kCFHTTPMessageDateHeader				CFSTR("Date")
-#define _kCFHTTPMessageEtagHeader				CFSTR("Etag")
-#define _kCFHTTPMessageExpiresHeader			CFSTR("Expires")
-#define _kCFHTTPMessageLastModifiedHeader		CFSTR("Last-Modified")
-#define _kCFHTTPMessageLocationHeader			CFSTR("Location")
-#define _kCFHTTPMessageProxyAuthenticateHeader	CFSTR("Proxy-Authenticate")
-#define _kCFHTTPMessageServerHeader				CFSTR("Server")
-#define _kCFHTTPMessageSetCookieHeader			CFSTR("Set-Cookie")
+#define _kCFHTTPMessageAcceptHeader					CFSTR("Accept")
+#define _kCFHTTPMessageAcceptCharsetHeader			CFSTR("Accept-Charset")
+#define _kCFHTTPMessageAcceptEncodingHeader			CFSTR("Accept-Encoding")
+#define _kCFHTTPMessageAcceptLanguageHeader			CFSTR("Accept-Language")
+#define _kCFHTTPMessageAcceptRangesHeader			CFSTR("Accept-Ranges")
+#define _kCFHTTPMessageAccessControlAllowOriginHeader	CFSTR("Access-Control-Allow-Origin")
+#define _kCFHTTPMessageAgeHeader					CFSTR("Age")
+#define _kCFHTTPMessageAllowHeader					CFSTR("Allow")
+#define _kCFHTTPMessageAuthorizationHeader			CFSTR("Authorization")
+#define _kCFHTTPMessageCacheControlHeader			CFSTR("Cache-Control")
+#define _kCFHTTPMessageConnectionHeader				CFSTR("Connection")
+#define _kCFHTTPMessageContentDispositionHeader		CFSTR("Content-Disposition")
+#define _kCFHTTPMessageContentEncodingHeader		CFSTR("Content-Encoding")
+#define _kCFHTTPMessageContentLanguageHeader		CFSTR("Content-Language")
+#define _kCFHTTPMessageContentLengthHeader			CFSTR("Content-Length")
+#define _kCFHTTPMessageContentLocationHeader		CFSTR("Content-Location")
+#define _kCFHTTPMessageContentMd5Header				CFSTR("Content-Md5")
+#define _kCFHTTPMessageContentRangeHeader			CFSTR("Content-Range")
+#define _kCFHTTPMessageContentSecurityPolicyHeader	CFSTR("Content-Security-Policy")
+#define _kCFHTTPMessageContentTypeHeader			CFSTR("Content-Type")
+#define _kCFHTTPMessageCookieHeader					CFSTR("Cookie")
+#define _kCFHTTPMessageDateHeader					CFSTR("Date")
+#define _kCFHTTPMessageEtagHeader					CFSTR("Etag")
+#define _kCFHTTPMessageExpectHeader					CFSTR("Expect")
+#define _kCFHTTPMessageExpiresHeader				CFSTR("Expires")
+#define _kCFHTTPMessageFromHeader					CFSTR("From")
+#define _kCFHTTPMessageHostHeader					CFSTR("Host")
+#define _kCFHTTPMessageIfMatchHeader				CFSTR("If-Match")
+#define _kCFHTTPMessageIfModifiedSinceHeader		CFSTR("If-Modified-Since")
+#define _kCFHTTPMessageIfNoneMatchHeader			CFSTR("If-None-Match")
+#define _kCFHTTPMessageIfRangeHeader				CFSTR("If-Range")
+#define _kCFHTTPMessageIfUnmodifiedSinceHeader		CFSTR("If-Unmodified-Since")
+#define _kCFHTTPMessageKeepAliveHeader				CFSTR("Keep-Alive")
+#define _kCFHTTPMessageLastModifiedHeader			CFSTR("Last-Modified")
+#define _kCFHTTPMessageLinkHeader					CFSTR("Link")
+#define _kCFHTTPMessageLocationHeader				CFSTR("Location")
+#define _kCFHTTPMessageMaxForwardsHeader			CFSTR("Max-Forwards")
+#define _kCFHTTPMessageOriginHeader					CFSTR("Origin")
+#define _kCFHTTPMessagePragmaHeader					CFSTR("Pragma")
+#define _kCFHTTPMessageProxyAuthenticateHeader		CFSTR("Proxy-Authenticate")
+#define _kCFHTTPMessageProxyAuthorizationHeader		CFSTR("Proxy-Authorization")
+#define _kCFHTTPMessageProxyConnectionHeader		CFSTR("Proxy-Connection")
+#define _kCFHTTPMessageRangeHeader					CFSTR("Range")
+#define _kCFHTTPMessageRefererHeader				CFSTR("Referer")
+#define _kCFHTTPMessageRefreshHeader				CFSTR("Refresh")
+#define _kCFHTTPMessageRetryAfterHeader				CFSTR("Retry-After")
+#define _kCFHTTPMessageServerHeader					CFSTR("Server")
+#define _kCFHTTPMessageSetCookieHeader				CFSTR("Set-Cookie")
+#define _kCFHTTPMessageSetCookie2Header				CFSTR("Set-Cookie2")
+#define _kCFHTTPMessageStrictTransportSecurityHeader	CFSTR("Strict-Transport-Security")
+#define _kCFHTTPMessageTeHeader						CFSTR("Te")
+#define _kCFHTTPMessageTrailerHeader				CFSTR("Trailer")
+#define _kCFHTTPMessageTransferEncodingHeader		CFSTR("Transfer-Encoding")
+#define _kCFHTTPMessageUpgradeHeader				CFSTR("Upgrade")
+#define _kCFHTTPMessageUserAgentHeader				CFSTR("User-Agent")
+#define _kCFHTTPMessageVaryHeader					CFSTR("Vary")
+#define _kCFHTTPMessageViaHeader					CFSTR("Via")
+#define _kCFHTTPMessageWarningHeader				CFSTR("Warning")
+#define _kCFHTTPMessageWwwAuthenticateHeader		CFSTR("Www-Authenticate")
+#define _kCFHTTPMessageXForwardedForHeader			CFSTR("X-Forwarded-For")
+#define _kCFHTTPMessageXFrameOptionsHeader			CFSTR("X-Frame-Options")
+#define _kCFHTTPMessageXPoweredByHeader				CFSTR("X-Powered-By")
 #else
+static CONST_STRING_DECL(_kCFHTTPMessageAcceptHeader, "Accept")
+static CONST_STRING_DECL(_kCFHTTPMessageAcceptCharsetHeader, "Accept-Charset")
+static CONST_STRING_DECL(_kCFHTTPMessageAcceptEncodingHeader, "Accept-Encoding")
+static CONST_STRING_DECL(_kCFHTTPMessageAcceptLanguageHeader, "Accept-Language")
 static CONST_STRING_DECL(_kCFHTTPMessageAcceptRangesHeader, "Accept-Ranges")
+static CONST_STRING_DECL(_kCFHTTPMessageAccessControlAllowOriginHeader, "Access-Control-Allow-Origin")
+static CONST_STRING_DECL(_kCFHTTPMessageAgeHeader, "Age")
+static CONST_STRING_DECL(_kCFHTTPMessageAllowHeader, "Allow")
+static CONST_STRING_DECL(_kCFHTTPMessageAuthorizationHeader, "Authorization")
 static CONST_STRING_DECL(_kCFHTTPMessageCacheControlHeader, "Cache-Control")
-static CONST_STRING_DECL(_kCFHTTPMessageConnectHeader, "Connection")
+static CONST_STRING_DECL(_kCFHTTPMessageConnectionHeader, "Connection")
+static CONST_STRING_DECL(_kCFHTTPMessageContentDispositionHeader, "Content-Disposition")
+static CONST_STRING_DECL(_kCFHTTPMessageContentEncodingHeader, "Content-Encoding")
 static CONST_STRING_DECL(_kCFHTTPMessageContentLanguageHeader, "Content-Language")
 static CONST_STRING_DECL(_kCFHTTPMessageContentLengthHeader, "Content-Length")
 static CONST_STRING_DECL(_kCFHTTPMessageContentLocationHeader, "Content-Location")
+static CONST_STRING_DECL(_kCFHTTPMessageContentMd5Header, "Content-Md5")
+static CONST_STRING_DECL(_kCFHTTPMessageContentRangeHeader, "Content-Range")
+static CONST_STRING_DECL(_kCFHTTPMessageContentSecurityPolicyHeader, "Content-Security-Policy")
 static CONST_STRING_DECL(_kCFHTTPMessageContentTypeHeader, "Content-Type")
+static CONST_STRING_DECL(_kCFHTTPMessageCookieHeader, "Cookie")
 static CONST_STRING_DECL(_kCFHTTPMessageDateHeader, "Date")
 static CONST_STRING_DECL(_kCFHTTPMessageEtagHeader, "Etag")
+static CONST_STRING_DECL(_kCFHTTPMessageExpectHeader, "Expect")
 static CONST_STRING_DECL(_kCFHTTPMessageExpiresHeader, "Expires")
+static CONST_STRING_DECL(_kCFHTTPMessageFromHeader, "From")
+static CONST_STRING_DECL(_kCFHTTPMessageHostHeader, "Host")
+static CONST_STRING_DECL(_kCFHTTPMessageIfMatchHeader, "If-Match")
+static CONST_STRING_DECL(_kCFHTTPMessageIfModifiedSinceHeader, "If-Modified-Since")
+static CONST_STRING_DECL(_kCFHTTPMessageIfNoneMatchHeader, "If-None-Match")
+static CONST_STRING_DECL(_kCFHTTPMessageIfRangeHeader, "If-Range")
+static CONST_STRING_DECL(_kCFHTTPMessageIfUnmodifiedSinceHeader, "If-Unmodified-Since")
+static CONST_STRING_DECL(_kCFHTTPMessageKeepAliveHeader, "Keep-Alive")
 static CONST_STRING_DECL(_kCFHTTPMessageLastModifiedHeader, "Last-Modified")
+static CONST_STRING_DECL(_kCFHTTPMessageLinkHeader, "Link")
 static CONST_STRING_DECL(_kCFHTTPMessageLocationHeader, "Location")
+static CONST_STRING_DECL(_kCFHTTPMessageMaxForwardsHeader, "Max-Forwards")
+static CONST_STRING_DECL(_kCFHTTPMessageOriginHeader, "Origin")
+static CONST_STRING_DECL(_kCFHTTPMessagePragmaHeader, "Pragma")
 static CONST_STRING_DECL(_kCFHTTPMessageProxyAuthenticateHeader, "Proxy-Authenticate")
+static CONST_STRING_DECL(_kCFHTTPMessageProxyAuthorizationHeader, "Proxy-Authorization")
+static CONST_STRING_DECL(_kCFHTTPMessageProxyConnectionHeader, "Proxy-Connection")
+static CONST_STRING_DECL(_kCFHTTPMessageRangeHeader, "Range")
+static CONST_STRING_DECL(_kCFHTTPMessageRefererHeader, "Referer")
+static CONST_STRING_DECL(_kCFHTTPMessageRefreshHeader, "Refresh")
+static CONST_STRING_DECL(_kCFHTTPMessageRetryAfterHeader, "Retry-After")
 static CONST_STRING_DECL(_kCFHTTPMessageServerHeader, "Server")
 static CONST_STRING_DECL(_kCFHTTPMessageSetCookieHeader, "Set-Cookie")
+static CONST_STRING_DECL(_kCFHTTPMessageSetCookie2Header, "Set-Cookie2")
+static CONST_STRING_DECL(_kCFHTTPMessageStrictTransportSecurityHeader, "Strict-Transport-Security")
+static CONST_STRING_DECL(_kCFHTTPMessageTeHeader, "Te")
+static CONST_STRING_DECL(_kCFHTTPMessageTrailerHeader, "Trailer")
+static CONST_STRING_DECL(_kCFHTTPMessageTransferEncodingHeader, "Transfer-Encoding")
+static CONST_STRING_DECL(_kCFHTTPMessageUpgradeHeader, "Upgrade")
+static CONST_STRING_DECL(_kCFHTTPMessageUserAgentHeader, "User-Agent")
+static CONST_STRING_DECL(_kCFHTTPMessageVaryHeader, "Vary")
+static CONST_STRING_DECL(_kCFHTTPMessageViaHeader, "Via")
+static CONST_STRING_DECL(_kCFHTTPMessageWarningHeader, "Warning")
+static CONST_STRING_DECL(_kCFHTTPMessageWwwAuthenticateHeader, "Www-Authenticate")
+static CONST_STRING_DECL(_kCFHTTPMessageXForwardedForHeader, "X-Forwarded-For")
+static CONST_STRING_DECL(_kCFHTTPMessageXFrameOptionsHeader, "X-Frame-Options")
+static CONST_STRING_DECL(_kCFHTTPMessageXPoweredByHeader, "X-Powered-By")
 #endif	/* __CONSTANT_CFSTRINGS__ */
 
 static const CFStringRef kHTTPMessageHeaderMap2[] = {
+	_kCFHTTPMessageAcceptHeader,
+	_kCFHTTPMessageAcceptCharsetHeader,
+	_kCFHTTPMessageAcceptEncodingHeader,
+	_kCFHTTPMessageAcceptLanguageHeader,
 	_kCFHTTPMessageAcceptRangesHeader,
+	_kCFHTTPMessageAccessControlAllowOriginHeader,
+	_kCFHTTPMessageAgeHeader,
+	_kCFHTTPMessageAllowHeader,
+	_kCFHTTPMessageAuthorizationHeader,
 	_kCFHTTPMessageCacheControlHeader,
-	_kCFHTTPMessageConnectHeader,
+	_kCFHTTPMessageConnectionHeader,
+	_kCFHTTPMessageContentDispositionHeader,
+	_kCFHTTPMessageContentEncodingHeader,
 	_kCFHTTPMessageContentLanguageHeader,
 	_kCFHTTPMessageContentLengthHeader,
 	_kCFHTTPMessageContentLocationHeader,
+	_kCFHTTPMessageContentMd5Header,
+	_kCFHTTPMessageContentRangeHeader,
+	_kCFHTTPMessageContentSecurityPolicyHeader,
 	_kCFHTTPMessageContentTypeHeader,
+	_kCFHTTPMessageCookieHeader,
 	_kCFHTTPMessageDateHeader,
 	_kCFHTTPMessageEtagHeader,
+	_kCFHTTPMessageExpectHeader,
 	_kCFHTTPMessageExpiresHeader,
+	_kCFHTTPMessageFromHeader,
+	_kCFHTTPMessageHostHeader,
+	_kCFHTTPMessageIfMatchHeader,
+	_kCFHTTPMessageIfModifiedSinceHeader,
+	_kCFHTTPMessageIfNoneMatchHeader,
+	_kCFHTTPMessageIfRangeHeader,
+	_kCFHTTPMessageIfUnmodifiedSinceHeader,
+	_kCFHTTPMessageKeepAliveHeader,
 	_kCFHTTPMessageLastModifiedHeader,
+	_kCFHTTPMessageLinkHeader,
 	_kCFHTTPMessageLocationHeader,
+	_kCFHTTPMessageMaxForwardsHeader,
+	_kCFHTTPMessageOriginHeader,
+	_kCFHTTPMessagePragmaHeader,
 	_kCFHTTPMessageProxyAuthenticateHeader,
+	_kCFHTTPMessageProxyAuthorizationHeader,
+	_kCFHTTPMessageProxyConnectionHeader,
+	_kCFHTTPMessageRangeHeader,
+	_kCFHTTPMessageRefererHeader,
+	_kCFHTTPMessageRefreshHeader,
+	_kCFHTTPMessageRetryAfterHeader,
 	_kCFHTTPMessageServerHeader,
-	_kCFHTTPMessageSetCookieHeader
+	_kCFHTTPMessageSetCookieHeader,
+	_kCFHTTPMessageSetCookie2Header,
+	_kCFHTTPMessageStrictTransportSecurityHeader,
+	_kCFHTTPMessageTeHeader,
+	_kCFHTTPMessageTrailerHeader,
+	_kCFHTTPMessageTransferEncodingHeader,
+	_kCFHTTPMessageUpgradeHeader,
+	_kCFHTTPMessageUserAgentHeader,
+	_kCFHTTPMessageVaryHeader,
+	_kCFHTTPMessageViaHeader,
+	_kCFHTTPMessageWarningHeader,
+	_kCFHTTPMessageWwwAuthenticateHeader,
+	_kCFHTTPMessageXForwardedForHeader,
+	_kCFHTTPMessageXFrameOptionsHeader,
+	_kCFHTTPMessageXPoweredByHeader
+};
+
+// Perfect hash over the names above, see _CFHTTPHeaderIDForBytes.  Generated
+// offline by searching for multipliers that put every name in its own slot;
+// regenerate if a name is added.  Slots hold a _CFHTTPHeaderID or -1.
+#define HEADER_HASH(len, first, last, next)	(((len) + (first) * 8 + (last) * 13 + (next) * 3) & 0xFF)
+
+static const SInt8 kHTTPMessageHeaderSlots[256] = {
+    16, -1, -1, -1, -1, 10, -1, -1, -1, -1, 25, 15, -1, -1, 11, 39,
+    -1, -1, -1, -1, -1, -1, -1, 61, -1, -1, -1,  4, -1, 34, -1, 50,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1,  1, -1, -1, -1, -1, -1, 55,
+    -1, -1, 49, -1, -1, 24, 52, -1, 44, -1, -1, 23, -1, -1, -1, -1,
+    -1, -1,  0, -1, 57, 58, -1, -1, -1, -1, -1, 35, -1, -1, -1, 37,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 48, -1, -1, -1,
+    -1,  6, -1, -1, -1,  7, -1, -1, -1, -1, -1, -1, -1,  3, -1, -1,
+    -1, -1, -1, 41, -1, -1, 40, 36, -1, -1, 20, 17, -1, 18, 13, -1,
+    -1, 26, -1, -1, -1, -1, -1, -1, -1, -1, 22, -1, -1, -1, -1, -1,
+    43, -1, -1, -1, 45, 19, -1, 46, -1, -1, -1, -1,  2, -1, -1, -1,
+    51, 21, -1, 28, -1, 31, 30, -1, -1, -1, -1, -1, -1, 12, -1, -1,
+    33, -1, -1, -1, -1, -1, -1, -1, -1, -1, 38, -1, -1, -1, -1, -1,
+    -1, 27, -1, -1, -1, -1, 29, -1, -1, -1, 14, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 56, -1, -1, -1, -1,
+    54, -1, -1, -1, -1, 32, 59, -1, -1, -1, -1, 42, -1, -1,  9, -1,
+    60, -1, -1, -1,  5, -1, -1, -1,  8, -1, -1, -1, 53, -1, 47, -1
 };
 
 #define kHTTPMessageNumItems (sizeof(kHTTPMessageHeaderMap) / sizeof(kHTTPMessageHeaderMap[0]))
 
+static void _CFHTTPMessageMaterializeHeaders(CFHTTPMessageRef msg);
+static void _CFHTTPMessageInvalidateSerializedHeaders(CFHTTPMessageRef msg, CFStringRef header);
+static void _CFHTTPMessageInvalidateSerializedMessage(CFHTTPMessageRef msg);
+
 #ifdef __CONSTANT_CFSTRINGS__
 #define _kCFHTTPMessageDescribeFormat		CFSTR("<CFHTTPMessage 0x%x>{url = %@; %@ = %@}")
 #define _kCFHTTPMessageDescribeRequest		CFSTR("request")
@@ -167,6 +414,7 @@ static const CFStringRef kHTTPMessageHeaderMap2[] = {
 #define _kCFHTTPMessageSpace				CFSTR(" ")
 #define _kCFHTTPMessageEmptyString			CFSTR("")
 #define _kCFHTTPMessageAppendHeaderFormat	CFSTR("%@, %@")
+#define _kCFHTTPMessageHeaderLineFormat		CFSTR("%@: %@\r\n")
 #else
 static CONST_STRING_DECL(_kCFHTTPMessageDescribeFormat, "<CFHTTPMessage 0x%x>{url = %@; %@ = %@}")
 static CONST_STRING_DECL(_kCFHTTPMessageDescribeRequest, "request")
@@ -176,6 +424,7 @@ static CONST_STRING_DECL(_kCFHTTPMessageResponseLineFormat, " %d ")
 static CONST_STRING_DECL(_kCFHTTPMessageSpace, " ")
 static CONST_STRING_DECL(_kCFHTTPMessageEmptyString, "")
 static CONST_STRING_DECL(_kCFHTTPMessageAppendHeaderFormat, "%@, %@")
+static CONST_STRING_DECL(_kCFHTTPMessageHeaderLineFormat, "%@: %@\r\n")
 #endif	/* __CONSTANT_CFSTRINGS__ */
 
 static CFStringRef __CFHTTPMessageCopyDescription(CFTypeRef cf) {
@@ -194,6 +443,10 @@ static void __CFHTTPMessageDeallocate(CFTypeRef cf) {
 	if (req->_auth) CFRelease(req->_auth);
 	if (req->_proxyAuth) CFRelease(req->_proxyAuth);
     if (req->_lastKey) CFRelease(req->_lastKey);
+    if (req->_rawHeaders) CFRelease(req->_rawHeaders);
+    if (req->_ranges) CFAllocatorDeallocate(CFGetAllocator(req), req->_ranges);
+    if (req->_serializedLines) CFRelease(req->_serializedLines);
+    _CFHTTPMessageInvalidateSerializedHeaders(req, NULL);
 }
 
 CONST_STRING_DECL(kCFHTTPVersion1_0, "HTTP/1.0")  
@@ -216,6 +469,10 @@ CONST_STRING_DECL(kCFStreamPropertyHTTPAttemptPersistentConnection, "kCFStreamPr
 CONST_STRING_DECL(kCFStreamPropertyHTTPRequestBytesWrittenCount, "kCFStreamPropertyHTTPRequestBytesWrittenCount")
 CONST_STRING_DECL(_kCFStreamPropertyHTTPConnectionStreams, "_kCFStreamPropertyHTTPConnectionStreams")
 CONST_STRING_DECL(_kCFStreamPropertyHTTPZeroLengthResponseExpected, "_kCFStreamPropertyHTTPZeroLengthResponseExpected")
+CONST_STRING_DECL(_kCFStreamPropertyHTTPDecodeContent, "_kCFStreamPropertyHTTPDecodeContent")
+CONST_STRING_DECL(_kCFStreamPropertyHTTPChunkSize, "_kCFStreamPropertyHTTPChunkSize")
+CONST_STRING_DECL(_kCFStreamPropertyHTTPChunkFlushInterval, "_kCFStreamPropertyHTTPChunkFlushInterval")
+CONST_STRING_DECL(_kCFStreamPropertyHTTPChunkFlush, "_kCFStreamPropertyHTTPChunkFlush")
 CONST_STRING_DECL(_kCFStreamPropertyHTTPProxyProxyAutoConfigURLString, "ProxyAutoConfigURLString")
 CONST_STRING_DECL(_kCFStreamPropertyHTTPProxyProxyAutoConfigEnable, "ProxyAutoConfigEnable")
 CONST_STRING_DECL(_kCFStreamPropertyHTTPConnection, "_kCFStreamPropertyHTTPConnection")
@@ -290,12 +547,20 @@ static CFHTTPMessageRef _CFHTTPMessageCreate(CFAllocatorRef allocator) {
         newMsg->_auth = NULL;
         newMsg->_proxyAuth = NULL;
         newMsg->_flags = LAX_PARSING; // Turn on lax parsing by default.
+        newMsg->_rawHeaders = NULL;
+        newMsg->_ranges = NULL;
+        newMsg->_rangeCount = 0;
+        newMsg->_rangeCapacity = 0;
+        newMsg->_serializedLines = NULL;
+        newMsg->_serializedHeaders[0] = newMsg->_serializedHeaders[1] = NULL;
+        newMsg->_serializedMessage[0] = newMsg->_serializedMessage[1] = NULL;
     }
     return newMsg;
 }
 
 CFHTTPMessageRef CFHTTPMessageCreateCopy(CFAllocatorRef allocator, CFHTTPMessageRef msg) {
     struct __CFHTTPMessage *result;
+    _CFHTTPMessageMaterializeHeaders(msg);
     result = (struct __CFHTTPMessage *)_CFRuntimeCreateInstance(allocator, CFHTTPMessageGetTypeID(), sizeof(struct __CFHTTPMessage) - sizeof(CFRuntimeBase), NULL);
     if (result) {
         result->_firstLine = msg->_firstLine ? CFStringCreateCopy(allocator, msg->_firstLine) : NULL;
@@ -318,6 +583,18 @@ CFHTTPMessageRef CFHTTPMessageCreateCopy(CFAllocatorRef allocator, CFHTTPMessage
             CFRetain(msg->_auth);
         if (result->_proxyAuth)
             CFRetain(msg->_proxyAuth);
+        result->_rawHeaders = NULL;
+        result->_ranges = NULL;
+        result->_rangeCount = 0;
+        result->_rangeCapacity = 0;
+
+        // Copies are usually made of a template request in order to change
+        // a header or two, so carry the encoded lines over.
+        result->_serializedLines = msg->_serializedLines ? CFDictionaryCreateMutableCopy(allocator, 0, msg->_serializedLines) : NULL;
+        result->_serializedHeaders[0] = msg->_serializedHeaders[0] ? CFRetain(msg->_serializedHeaders[0]) : NULL;
+        result->_serializedHeaders[1] = msg->_serializedHeaders[1] ? CFRetain(msg->_serializedHeaders[1]) : NULL;
+        result->_serializedMessage[0] = msg->_serializedMessage[0] ? CFRetain(msg->_serializedMessage[0]) : NULL;
+        result->_serializedMessage[1] = msg->_serializedMessage[1] ? CFRetain(msg->_serializedMessage[1]) : NULL;
     }
     return result;
 }
@@ -567,6 +844,7 @@ CFDataRef CFHTTPMessageCopyBody(CFHTTPMessageRef msg) {
 }
 
 void CFHTTPMessageSetBody(CFHTTPMessageRef msg, CFDataRef data) {
+    _CFHTTPMessageInvalidateSerializedMessage(msg);
     msg->_flags &= (~MUTABLE_DATA);
     if (data)  {
         data = CFDataCreateCopy(CFGetAllocator(msg), data);
@@ -640,7 +918,257 @@ CFStringRef _CFCapitalizeHeader(CFStringRef headerString) {
     }
 }
 
+/* extern */ _CFHTTPHeaderID _CFHTTPHeaderIDForBytes(const UInt8 *bytes, CFIndex length) {
+
+    const struct MessageHeaderMap* map;
+    SInt8 slot;
+    CFIndex i;
+
+    if (length < 2 || length >= sizeof(map->_header))
+        return _kCFHTTPHeaderUnknown;
+
+    // Folding with 0x20 lowercases letters and leaves '-' and digits alone,
+    // which is all the table's names contain.  Anything else just lands in
+    // a slot whose name won't compare equal below.
+    slot = kHTTPMessageHeaderSlots[HEADER_HASH(length, bytes[0] | 0x20, bytes[length - 1] | 0x20, bytes[length - 2] | 0x20)];
+    if (slot < 0)
+        return _kCFHTTPHeaderUnknown;
+
+    map = &kHTTPMessageHeaderMap[slot];
+    if (map->_length != length)
+        return _kCFHTTPHeaderUnknown;
+
+    // Same folding as _CFCapitalizeHeader; only ASCII letters are touched.
+    for (i = 0; i < length; i++) {
+        UInt8 a = bytes[i], b = map->_header[i];
+        if (a >= 'A' && a <= 'Z') a += 'a' - 'A';
+        if (b >= 'A' && b <= 'Z') b += 'a' - 'A';
+        if (a != b)
+            return _kCFHTTPHeaderUnknown;
+    }
+
+    return (_CFHTTPHeaderID)slot;
+}
+
+
+static CFStringRef _CFHTTPMessageCopyHeaderKey(CFAllocatorRef alloc, const UInt8 *bytes, CFIndex length) {
+
+    CFStringRef key, temp;
+    _CFHTTPHeaderID headerID = _CFHTTPHeaderIDForBytes(bytes, length);
+
+    if (headerID != _kCFHTTPHeaderUnknown)
+        return CFRetain(kHTTPMessageHeaderMap2[headerID]);
+
+    key = CFStringCreateWithBytes(alloc, bytes, length, kCFStringEncodingISOLatin1, FALSE);
+    temp = _CFCapitalizeHeader(key);
+    CFRelease(key);
+    return temp;
+}
+
+
+/*******************/
+/* Lazy header map */
+/*******************/
+
+static const UInt8 *_rawHeaderBytes(CFHTTPMessageRef msg, UInt32 offset) {
+
+    // Ranges recorded during the current parse pass point into _data; the
+    // bytes are only moved over to _rawHeaders once the pass trims them off.
+    CFIndex rawLength = msg->_rawHeaders ? CFDataGetLength(msg->_rawHeaders) : 0;
+
+    if (offset < rawLength)
+        return CFDataGetBytePtr(msg->_rawHeaders) + offset;
+
+    return CFDataGetBytePtr(msg->_data) + (offset - rawLength);
+}
+
+
+static void _appendHeaderRange(CFHTTPMessageRef msg, const UInt8 *name, CFIndex nameLength, const UInt8 *value, CFIndex valueLength) {
+
+    const UInt8 *base = CFDataGetBytePtr(msg->_data);
+    CFIndex rawLength = msg->_rawHeaders ? CFDataGetLength(msg->_rawHeaders) : 0;
+    _CFHTTPHeaderRange *range;
+
+    if (msg->_rangeCount == msg->_rangeCapacity) {
+        msg->_rangeCapacity = msg->_rangeCapacity ? (msg->_rangeCapacity * 2) : 16;
+        msg->_ranges = CFAllocatorReallocate(CFGetAllocator(msg), msg->_ranges, msg->_rangeCapacity * sizeof(msg->_ranges[0]), 0);
+    }
+
+    range = &msg->_ranges[msg->_rangeCount++];
+    range->_nameOffset = rawLength + (name - base);
+    range->_nameLength = nameLength;
+    range->_valueOffset = valueLength ? rawLength + (value - base) : 0;
+    range->_valueLength = valueLength;
+    range->_headerID = _CFHTTPHeaderIDForBytes(name, nameLength);
+}
+
+
+static CFStringRef _copyRangeValue(CFHTTPMessageRef msg, const _CFHTTPHeaderRange *range) {
+
+    if (!range->_valueLength)
+        return CFRetain(_kCFHTTPMessageEmptyString);
+
+    return CFStringCreateWithBytes(CFGetAllocator(msg), _rawHeaderBytes(msg, range->_valueOffset), range->_valueLength, kCFStringEncodingISOLatin1, FALSE);
+}
+
+
+static Boolean _rangeNameMatches(CFHTTPMessageRef msg, const _CFHTTPHeaderRange *range, const UInt8 *name, CFIndex length) {
+
+    const UInt8 *bytes;
+    CFIndex i;
+
+    if (range->_nameLength != length)
+        return FALSE;
+
+    // Same folding as _CFCapitalizeHeader; only ASCII letters are touched.
+    bytes = _rawHeaderBytes(msg, range->_nameOffset);
+    for (i = 0; i < length; i++) {
+        UInt8 a = bytes[i], b = name[i];
+        if (a >= 'A' && a <= 'Z') a += 'a' - 'A';
+        if (b >= 'A' && b <= 'Z') b += 'a' - 'A';
+        if (a != b)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static CFStringRef _copyLazyHeaderValue(CFHTTPMessageRef msg, _CFHTTPHeaderID headerID, const UInt8 *name, CFIndex length) {
+
+    CFAllocatorRef alloc = CFGetAllocator(msg);
+    CFStringRef result = NULL;
+    CFIndex i;
+
+    // Repeated headers are folded together the same way the parser
+    // folds them into _headers.
+    for (i = 0; i < msg->_rangeCount; i++) {
+
+        const _CFHTTPHeaderRange *range = &msg->_ranges[i];
+
+        // Well-known names compare by ID; a name without one can only
+        // match ranges which didn't get one either.
+        if ((headerID != _kCFHTTPHeaderUnknown) ? (range->_headerID == headerID) :
+            ((range->_headerID == _kCFHTTPHeaderUnknown) && _rangeNameMatches(msg, range, name, length)))
+        {
+
+            CFStringRef value = _copyRangeValue(msg, range);
+
+            if (result) {
+                CFStringRef newValue = CFStringCreateWithFormat(alloc, NULL, _kCFHTTPMessageAppendHeaderFormat, result, value);
+                CFRelease(value);
+                CFRelease(result);
+                value = newValue;
+            }
+
+            result = value;
+        }
+    }
+
+    return result;
+}
+
+
+static void _CFHTTPMessageMaterializeHeaders(CFHTTPMessageRef msg) {
+
+    CFAllocatorRef alloc = CFGetAllocator(msg);
+    CFIndex i;
+
+    if (!(msg->_flags & LAZY_HEADERS))
+        return;
+
+    // Clear the flag first so _CFHTTPMessageSetHeader takes the dictionary path.
+    msg->_flags &= ~LAZY_HEADERS;
+
+    for (i = 0; i < msg->_rangeCount; i++) {
+
+        const _CFHTTPHeaderRange *range = &msg->_ranges[i];
+        CFStringRef key = (range->_headerID != _kCFHTTPHeaderUnknown) ?
+            CFRetain(kHTTPMessageHeaderMap2[range->_headerID]) :
+            _CFHTTPMessageCopyHeaderKey(alloc, _rawHeaderBytes(msg, range->_nameOffset), range->_nameLength);
+        CFStringRef value = _copyRangeValue(msg, range);
+        CFStringRef old = CFDictionaryGetValue(msg->_headers, key);
+
+        if (old) {
+            CFStringRef newValue = CFStringCreateWithFormat(alloc, NULL, _kCFHTTPMessageAppendHeaderFormat, old, value);
+            CFRelease(value);
+            value = newValue;
+        }
+
+        _CFHTTPMessageSetHeader(msg, key, value, -1);
+
+        // Parsing may still be under way, in which case a continuation line
+        // needs to know which header it belongs to.
+        if ((i == (msg->_rangeCount - 1)) && !(msg->_flags & HEADERS_COMPLETE)) {
+            if (msg->_lastKey) CFRelease(msg->_lastKey);
+            msg->_lastKey = CFRetain(key);
+        }
+
+        CFRelease(key);
+        CFRelease(value);
+    }
+
+    if (msg->_ranges) {
+        CFAllocatorDeallocate(alloc, msg->_ranges);
+        msg->_ranges = NULL;
+    }
+    msg->_rangeCount = 0;
+    msg->_rangeCapacity = 0;
+
+    if (msg->_rawHeaders) {
+        CFRelease(msg->_rawHeaders);
+        msg->_rawHeaders = NULL;
+    }
+}
+
+
+/* extern */ void _CFHTTPMessageSetLazyHeaders(CFHTTPMessageRef msg, Boolean lazy) {
+
+    if (!lazy)
+        _CFHTTPMessageMaterializeHeaders(msg);
+
+    // Only messages which haven't started parsing headers can switch over.
+    else if (!msg->_firstLine && !CFDictionaryGetCount(msg->_headers))
+        msg->_flags |= LAZY_HEADERS;
+}
+
+
+/* extern */ CFStringRef _CFHTTPMessageCopyHeaderFieldValueByID(CFHTTPMessageRef msg, _CFHTTPHeaderID header) {
+
+    CFStringRef result;
+
+    if (msg->_flags & LAZY_HEADERS)
+        return _copyLazyHeaderValue(msg, header, NULL, 0);
+
+    result = CFDictionaryGetValue(msg->_headers, kHTTPMessageHeaderMap2[header]);
+    if (result) CFRetain(result);
+    return result;
+}
+
+
 CFStringRef CFHTTPMessageCopyHeaderFieldValue(CFHTTPMessageRef msg, CFStringRef header) {
+
+    char buffer[128];
+    const char *name = CFStringGetCStringPtr(header, kCFStringEncodingISOLatin1);
+
+    if (!name && CFStringGetCString(header, buffer, sizeof(buffer), kCFStringEncodingISOLatin1))
+        name = buffer;
+
+    if (name) {
+
+        CFIndex length = strlen(name);
+        _CFHTTPHeaderID headerID = _CFHTTPHeaderIDForBytes((const UInt8*)name, length);
+
+        if (headerID != _kCFHTTPHeaderUnknown)
+            return _CFHTTPMessageCopyHeaderFieldValueByID(msg, headerID);
+
+        if (msg->_flags & LAZY_HEADERS)
+            return _copyLazyHeaderValue(msg, _kCFHTTPHeaderUnknown, (const UInt8*)name, length);
+    }
+
+    // Name can't be matched against the raw bytes; fall back to the dictionary.
+    _CFHTTPMessageMaterializeHeaders(msg);
+
     CFStringRef lowerHeader = _CFCapitalizeHeader(header);
     CFStringRef result = CFDictionaryGetValue(msg->_headers, lowerHeader);
     CFRelease(lowerHeader);
@@ -649,12 +1177,16 @@ CFStringRef CFHTTPMessageCopyHeaderFieldValue(CFHTTPMessageRef msg, CFStringRef
 }
 
 CFDictionaryRef CFHTTPMessageCopyAllHeaderFields(CFHTTPMessageRef msg) {
+    _CFHTTPMessageMaterializeHeaders(msg);
     CFRetain(msg->_headers);
     return msg->_headers;
 }
 
 extern void _CFHTTPMessageSetHeader(CFHTTPMessageRef msg, CFStringRef header, CFStringRef value, CFIndex position) {
 
+    _CFHTTPMessageMaterializeHeaders(msg);
+    _CFHTTPMessageInvalidateSerializedHeaders(msg, header);
+
     if (!value) {
         CFDictionaryRemoveValue(msg->_headers, header);
         CFArrayRemoveValueAtIndex(msg->_headerOrder,
@@ -690,47 +1222,131 @@ void CFHTTPMessageSetHeaderFieldValue(CFHTTPMessageRef message, CFStringRef head
     CFRelease(header);
 }
 
+static void _CFHTTPMessageInvalidateSerializedMessage(CFHTTPMessageRef msg) {
+
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (msg->_serializedMessage[i]) {
+            CFRelease(msg->_serializedMessage[i]);
+            msg->_serializedMessage[i] = NULL;
+        }
+    }
+}
+
+
+// Passing a NULL header drops everything but the encoded header lines; use
+// it when the first line changes.
+static void _CFHTTPMessageInvalidateSerializedHeaders(CFHTTPMessageRef msg, CFStringRef header) {
+
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (msg->_serializedHeaders[i]) {
+            CFRelease(msg->_serializedHeaders[i]);
+            msg->_serializedHeaders[i] = NULL;
+        }
+    }
+
+    if (header && msg->_serializedLines)
+        CFDictionaryRemoveValue(msg->_serializedLines, header);
+
+    _CFHTTPMessageInvalidateSerializedMessage(msg);
+}
+
+
+static Boolean _appendEncodedString(CFMutableDataRef data, CFStringRef string) {
+
+    CFDataRef encoded = CFStringCreateExternalRepresentation(CFGetAllocator(data), string, kCFStringEncodingISOLatin1, '?');
+
+    if (!encoded)
+        return FALSE;
+
+    CFDataAppendBytes(data, CFDataGetBytePtr(encoded), CFDataGetLength(encoded));
+    CFRelease(encoded);
+    return TRUE;
+}
+
+
 extern CFDataRef _CFHTTPMessageCopySerializedHeaders(CFHTTPMessageRef msg, Boolean forProxy);
 extern CFDataRef _CFHTTPMessageCopySerializedHeaders(CFHTTPMessageRef msg, Boolean forProxy) {
     CFAllocatorRef allocator = CFGetAllocator(msg);
-    CFMutableStringRef headers;
-    CFDataRef result;
+    int form = SERIALIZED_FORM(msg, forProxy);
+    CFMutableDataRef result;
+    CFStringRef line;
+    Boolean ok;
     unsigned i,c;
-    
-    if ((msg->_flags & IS_RESPONSE) != 0 || !forProxy) {
-        headers = CFStringCreateMutableCopy(allocator, 0, msg->_firstLine);
+
+    _CFHTTPMessageMaterializeHeaders(msg);
+
+    if (msg->_serializedHeaders[form])
+        return CFRetain(msg->_serializedHeaders[form]);
+
+    if (!form) {
+        line = CFRetain(msg->_firstLine);
     } else {
         CFStringRef method = CFHTTPMessageCopyRequestMethod(msg);
         CFStringRef version = CFHTTPMessageCopyVersion(msg);
-        CFStringRef line = createRequestLine(allocator, method, msg->_url, version, forProxy);
+        line = createRequestLine(allocator, method, msg->_url, version, forProxy);
         CFRelease(method);
         CFRelease(version);
-        headers = CFStringCreateMutableCopy(allocator, 0, line);
-        CFRelease(line);
     }
-    CFStringAppendCString(headers, "\r\n", kCFStringEncodingASCII);
-    for (i = 0, c = CFArrayGetCount(msg->_headerOrder); i < c; i ++) {
+
+    result = CFDataCreateMutable(allocator, 0);
+    ok = _appendEncodedString(result, line);
+    CFRelease(line);
+    CFDataAppendBytes(result, (const UInt8*)"\r\n", 2);
+
+    if (!msg->_serializedLines)
+        msg->_serializedLines = CFDictionaryCreateMutable(allocator, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+
+    for (i = 0, c = CFArrayGetCount(msg->_headerOrder); ok && i < c; i ++) {
         CFStringRef header = CFArrayGetValueAtIndex(msg->_headerOrder, i);
-        CFStringAppend(headers, header);
-        CFStringAppendCString(headers, ": ", kCFStringEncodingASCII);
-        CFStringAppend(headers, CFDictionaryGetValue(msg->_headers, header));
-        CFStringAppendCString(headers, "\r\n", kCFStringEncodingASCII);
+        CFDataRef encoded = CFDictionaryGetValue(msg->_serializedLines, header);
+
+        if (!encoded) {
+            line = CFStringCreateWithFormat(allocator, NULL, _kCFHTTPMessageHeaderLineFormat, header, CFDictionaryGetValue(msg->_headers, header));
+            encoded = CFStringCreateExternalRepresentation(allocator, line, kCFStringEncodingISOLatin1, '?');
+            CFRelease(line);
+            if (!encoded) {
+                ok = FALSE;
+                break;
+            }
+            CFDictionarySetValue(msg->_serializedLines, header, encoded);
+            CFRelease(encoded);
+        }
+
+        CFDataAppendBytes(result, CFDataGetBytePtr(encoded), CFDataGetLength(encoded));
     }
-    CFStringAppendCString(headers, "\r\n", kCFStringEncodingASCII);
-    result = CFStringCreateExternalRepresentation(allocator, headers, kCFStringEncodingISOLatin1, '?');
-    CFRelease(headers);
-    return result;
+
+    if (!ok) {
+        CFRelease(result);
+        return NULL;
+    }
+
+    CFDataAppendBytes(result, (const UInt8*)"\r\n", 2);
+
+    msg->_serializedHeaders[form] = result;
+    return CFRetain(result);
 }
 
 extern CFDataRef _CFHTTPMessageCopySerializedMessage(CFHTTPMessageRef msg, Boolean forProxy);
 extern CFDataRef _CFHTTPMessageCopySerializedMessage(CFHTTPMessageRef msg, Boolean forProxy) {
-    CFDataRef result = _CFHTTPMessageCopySerializedHeaders(msg, forProxy);
-    if (msg->_data) {
+    int form = SERIALIZED_FORM(msg, forProxy);
+    CFDataRef result;
+
+    if (msg->_serializedMessage[form])
+        return CFRetain(msg->_serializedMessage[form]);
+
+    result = _CFHTTPMessageCopySerializedHeaders(msg, forProxy);
+    if (result && msg->_data) {
         CFMutableDataRef hdrData = CFDataCreateMutableCopy(CFGetAllocator(msg), CFDataGetLength(msg->_data) + CFDataGetLength(result), result);
         CFRelease(result);
         CFDataAppendBytes(hdrData, CFDataGetBytePtr(msg->_data), CFDataGetLength(msg->_data));
         result = hdrData;
     }
+    if (result)
+        msg->_serializedMessage[form] = CFRetain(result);
     return result;
 }
 
@@ -794,6 +1410,7 @@ CFURLRef CFHTTPMessageCopyRequestURL(CFHTTPMessageRef request) {
 
 extern
 void _CFHTTPMessageSetResponseURL(CFHTTPMessageRef response, CFURLRef url) {
+    _CFHTTPMessageInvalidateSerializedHeaders(response, NULL);
     CFRetain(url);
     if (response->_url) CFRelease(response->_url);
     response->_url = url;
@@ -822,6 +1439,127 @@ CFStringRef CFHTTPMessageCopyResponseStatusLine(CFHTTPMessageRef response) {
     return response->_firstLine;
 }
 
+/******************/
+/* Header scanner */
+/******************/
+
+/*
+	Header parsing spends nearly all of its time looking for line
+	terminators and the colon separating name from value.  The scanners
+	below return the first byte in [bytes, end) matching any of the three
+	given bytes, or NULL.  The vector versions test 16 or 32 bytes per
+	compare and leave the tail to the narrower version.  The widest one
+	supported by the processor is picked once, at first use.
+*/
+typedef const UInt8 *(*_CFHTTPScanFunction)(const UInt8 *bytes, const UInt8 *end, UInt8 c1, UInt8 c2, UInt8 c3);
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define __CFHTTP_HAS_VECTOR_SCANNERS	1
+#include <immintrin.h>
+#endif
+
+static const UInt8 *_scanScalar(const UInt8 *bytes, const UInt8 *end, UInt8 c1, UInt8 c2, UInt8 c3) {
+    for (; bytes < end; bytes++) {
+        UInt8 ch = *bytes;
+        if (ch == c1 || ch == c2 || ch == c3)
+            return bytes;
+    }
+    return NULL;
+}
+
+#if defined(__CFHTTP_HAS_VECTOR_SCANNERS)
+__attribute__((target("sse2")))
+static const UInt8 *_scanSSE2(const UInt8 *bytes, const UInt8 *end, UInt8 c1, UInt8 c2, UInt8 c3) {
+    const __m128i v1 = _mm_set1_epi8((char)c1);
+    const __m128i v2 = _mm_set1_epi8((char)c2);
+    const __m128i v3 = _mm_set1_epi8((char)c3);
+
+    while ((end - bytes) >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)bytes);
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, v1), _mm_cmpeq_epi8(block, v2)), _mm_cmpeq_epi8(block, v3));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+        if (mask)
+            return bytes + __builtin_ctz(mask);
+        bytes += 16;
+    }
+    return _scanScalar(bytes, end, c1, c2, c3);
+}
+
+__attribute__((target("avx2")))
+static const UInt8 *_scanAVX2(const UInt8 *bytes, const UInt8 *end, UInt8 c1, UInt8 c2, UInt8 c3) {
+    const __m256i v1 = _mm256_set1_epi8((char)c1);
+    const __m256i v2 = _mm256_set1_epi8((char)c2);
+    const __m256i v3 = _mm256_set1_epi8((char)c3);
+
+    while ((end - bytes) >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)bytes);
+        __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, v1), _mm256_cmpeq_epi8(block, v2)), _mm256_cmpeq_epi8(block, v3));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+        if (mask)
+            return bytes + __builtin_ctz(mask);
+        bytes += 32;
+    }
+    return _scanSSE2(bytes, end, c1, c2, c3);
+}
+#endif	/* __CFHTTP_HAS_VECTOR_SCANNERS */
+
+static const UInt8 *_scanSelect(const UInt8 *bytes, const UInt8 *end, UInt8 c1, UInt8 c2, UInt8 c3);
+
+static _CFHTTPScanFunction __CFHTTPScan = _scanSelect;
+
+static _CFHTTPScanFunction _scanFunctionForKind(_CFHTTPScannerKind kind) {
+
+    switch (kind) {
+
+#if defined(__CFHTTP_HAS_VECTOR_SCANNERS)
+        case _kCFHTTPScannerSSE2:
+            return __builtin_cpu_supports("sse2") ? _scanSSE2 : NULL;
+
+        case _kCFHTTPScannerAVX2:
+            return __builtin_cpu_supports("avx2") ? _scanAVX2 : NULL;
+#endif
+
+        case _kCFHTTPScannerScalar:
+            return _scanScalar;
+
+        case _kCFHTTPScannerAutomatic:
+        {
+            _CFHTTPScanFunction result = _scanFunctionForKind(_kCFHTTPScannerAVX2);
+            if (!result)
+                result = _scanFunctionForKind(_kCFHTTPScannerSSE2);
+            return result ? result : _scanScalar;
+        }
+
+        default:
+            return NULL;
+    }
+}
+
+static const UInt8 *_scanSelect(const UInt8 *bytes, const UInt8 *end, UInt8 c1, UInt8 c2, UInt8 c3) {
+
+    // First use; replace ourselves with the best the hardware offers.
+    // Racing threads will all come to the same answer.
+    __CFHTTPScan = _scanFunctionForKind(_kCFHTTPScannerAutomatic);
+
+    return __CFHTTPScan(bytes, end, c1, c2, c3);
+}
+
+/* extern */ Boolean _CFHTTPSetScanner(_CFHTTPScannerKind kind) {
+
+    _CFHTTPScanFunction scanner = _scanFunctionForKind(kind);
+
+    if (!scanner)
+        return FALSE;
+
+    __CFHTTPScan = scanner;
+    return TRUE;
+}
+
+/* extern */ const UInt8 *_CFHTTPScanForBytes(const UInt8 *bytes, CFIndex length, UInt8 c1, UInt8 c2, UInt8 c3) {
+    return __CFHTTPScan(bytes, bytes + length, c1, c2, c3);
+}
+
+
 static const UInt8 *parseHTTPVersion(const UInt8 *bytes, CFIndex len, Boolean consumeSpaces) {
     Boolean sawDecimal = FALSE, sawOneDigit = FALSE;
     const UInt8 *currentByte, *lastByte = bytes + len;
@@ -883,11 +1621,9 @@ static const UInt8 *_extractResponseStatusLine(CFHTTPMessageRef response, const
         UInt32 delim = DELIM_UNKNOWN;
         UInt32 status = (currentByte[0] - '0')*100 + (currentByte[1] - '0')*10 + (currentByte[2] - '0');
         currentByte += 3;
-        while (currentByte < end) {
-            if (*currentByte == '\n' || *currentByte == '\r') {
-                break;
-            }
-            currentByte ++;
+        currentByte = __CFHTTPScan(currentByte, end, '\n', '\r', '\r');
+        if (!currentByte) {
+            currentByte = end;
         }
         if (currentByte < end) {
             if (*currentByte == '\n') {
@@ -986,8 +1722,24 @@ static const UInt8 *_extractRequestFirstLine(CFHTTPMessageRef request, const UIn
     }
 }
 
-static inline const UInt8 *_findEOL(CFHTTPMessageRef response, const UInt8 *bytes, CFIndex len) {
-    
+static inline const UInt8 *_scanHeaderLine(const UInt8 *bytes, const UInt8 *end, UInt8 term1, UInt8 term2, const UInt8 **colon) {
+
+    // Single pass over the line picking up the first colon on the
+    // way to the terminator, so the caller doesn't have to go back
+    // and memchr for it.
+    const UInt8 *result = __CFHTTPScan(bytes, end, term1, term2, ':');
+
+    if (result && (*result == ':')) {
+        *colon = result;
+        result = __CFHTTPScan(result + 1, end, term1, term2, term2);
+    }
+
+    return result;
+}
+
+
+static inline const UInt8 *_findEOL(CFHTTPMessageRef response, const UInt8 *bytes, CFIndex len, const UInt8 **colon) {
+
     // According to the HTTP specification EOL is defined as
     // a CRLF pair.  Unfortunately, some servers will use LF
     // instead.  Worse yet, some servers will use a combination
@@ -995,13 +1747,45 @@ static inline const UInt8 *_findEOL(CFHTTPMessageRef response, const UInt8 *byte
     // to be more forgiving.  It will now accept CRLF, LF, or
     // CR.
     //
+    // The delimiter was determined once while extracting the
+    // first line, so it's used here rather than being rediscovered
+    // on every line.  Servers which use a bare CR stop at either
+    // terminator; everyone else stops at LF and only falls back
+    // to CR when there is no LF at all.
+    //
     // It returns NULL if EOL is not found or it will return
-    // a pointer to the first terminating character.
-    
-    const UInt8* result = memchr(bytes, '\n', len);
-    if (!result)
-        result = memchr(bytes, '\r', len - 1);  // NOTE (len - 1) in order to prevent spanning CRLF.
-    
+    // a pointer to the first terminating character.  If colon
+    // is non-NULL upon return, it points at the first colon
+    // on the line.
+
+    const UInt8* end = bytes + len;
+    const UInt8* result;
+
+    *colon = NULL;
+
+    if (DELIMITER(response->_flags) == DELIM_CR) {
+
+        result = _scanHeaderLine(bytes, end, '\r', '\n', colon);
+
+        if (result && (*result == '\r')) {
+            if ((result + 1) == end)
+                result = NULL;      // Could be the front half of a CRLF; wait for more bytes.
+            else if (result[1] == '\n')
+                result++;
+        }
+    }
+
+    else {
+
+        result = _scanHeaderLine(bytes, end, '\n', '\n', colon);
+
+        if (!result) {
+            result = __CFHTTPScan(bytes, end - 1, '\r', '\r', '\r');  // NOTE (len - 1) in order to prevent spanning CRLF.
+            if (result && *colon && (*colon > result))
+                *colon = NULL;
+        }
+    }
+
     return result;
 }
 
@@ -1038,7 +1822,8 @@ static Boolean _parseHeadersFromData(CFHTTPMessageRef message) {
         
         UInt8 c;
         const UInt8* eov;	// End of value?
-        const UInt8* eol = _findEOL(message, start, end - start);
+        const UInt8* colon;
+        const UInt8* eol = _findEOL(message, start, end - start, &colon);
         
         if (!eol)
             break;
@@ -1064,7 +1849,10 @@ static Boolean _parseHeadersFromData(CFHTTPMessageRef message) {
         
         // Check for continuation header
         if ((c == ' ') || (c == '\t')) {
-            
+
+            // Folded values can't be described by a single byte range.
+            _CFHTTPMessageMaterializeHeaders(message);
+
             if (!message->_lastKey) {
                 if (!(message->_flags & LAX_PARSING)) {
                     result = FALSE;
@@ -1084,8 +1872,6 @@ static Boolean _parseHeadersFromData(CFHTTPMessageRef message) {
         // It's a new header
         else {
         
-            const UInt8* colon = memchr(start, ':', eol - start);
-            
             if (!colon) {
                 // Bad header; check to see if it's the IIS/eBay bug (second status
                 // line being sent) before declaring it a parse error - 3140081
@@ -1100,29 +1886,20 @@ static Boolean _parseHeadersFromData(CFHTTPMessageRef message) {
                 }
             }
             
+            else if (message->_flags & LAZY_HEADERS) {
+
+                const UInt8* value = colon + 1;
+
+                while ((*value == ' ') || (*value == '\t'))
+                    value++;
+
+                _appendHeaderRange(message, start, colon - start, value, (value > eov) ? 0 : (eov - value + 1));
+            }
+
             else {
                 
-                CFStringRef key = NULL;
+                CFStringRef key = _CFHTTPMessageCopyHeaderKey(alloc, start, colon - start);
                 CFStringRef value, old;
-                int i;
-                
-                for (i = 0; i < kHTTPMessageNumItems; i++) {
-                    const struct MessageHeaderMap* map = &kHTTPMessageHeaderMap[i];
-                    if (((colon - start) == map->_length) &&
-                        !strncmp(map->_header, (const char*)start, map->_length))
-                    {
-                        key = CFRetain(kHTTPMessageHeaderMap2[i]);
-                        break;
-                    }
-                }
-                
-                if (!key) {
-                    CFStringRef temp;
-                    key = CFStringCreateWithBytes(alloc, start, colon - start, kCFStringEncodingISOLatin1, FALSE);
-                    temp = _CFCapitalizeHeader(key);
-                    CFRelease(key);
-                    key = temp;
-                }
                 
                 if (message->_lastKey)
                     CFRelease(message->_lastKey);
@@ -1155,14 +1932,37 @@ static Boolean _parseHeadersFromData(CFHTTPMessageRef message) {
     }
     
     if (start != CFDataGetBytePtr(message->_data)) {
-    
-        if (message->_flags & MUTABLE_DATA) {
-            CFDataReplaceBytes((CFMutableDataRef)message->_data, CFRangeMake(0, start - CFDataGetBytePtr(message->_data)), NULL, 0);
+
+        CFIndex consumed = start - CFDataGetBytePtr(message->_data);
+
+        if ((message->_flags & LAZY_HEADERS) && (message->_flags & MUTABLE_DATA) && !message->_rawHeaders) {
+
+            // Rather than shifting the remainder down, hand the buffer over
+            // to the header index and only copy out the bytes left behind.
+            CFMutableDataRef remainder = CFDataCreateMutable(alloc, 0);
+            CFDataAppendBytes(remainder, start, end - start);
+
+            message->_rawHeaders = (CFMutableDataRef)message->_data;
+            CFDataSetLength(message->_rawHeaders, consumed);
+            message->_data = remainder;
         }
+
         else {
-            message->_flags &= (~MUTABLE_DATA);
-            CFRelease(message->_data);
-            message->_data = CFDataCreate(alloc, start, end - start);
+
+            if (message->_flags & LAZY_HEADERS) {
+                if (!message->_rawHeaders)
+                    message->_rawHeaders = CFDataCreateMutable(alloc, 0);
+                CFDataAppendBytes(message->_rawHeaders, CFDataGetBytePtr(message->_data), consumed);
+            }
+
+            if (message->_flags & MUTABLE_DATA) {
+                CFDataReplaceBytes((CFMutableDataRef)message->_data, CFRangeMake(0, consumed), NULL, 0);
+            }
+            else {
+                message->_flags &= (~MUTABLE_DATA);
+                CFRelease(message->_data);
+                message->_data = CFDataCreate(alloc, start, end - start);
+            }
         }
     }
 
@@ -1175,6 +1975,9 @@ Boolean CFHTTPMessageAppendBytes(CFHTTPMessageRef message, const UInt8 *newBytes
         return TRUE;
     }
 
+    // The body and possibly the first line are about to change.
+    _CFHTTPMessageInvalidateSerializedHeaders(message, NULL);
+
     // First append the data, then see if we have more header parsing to do
     if (message->_data == NULL) {
         message->_data = CFDataCreateMutable(CFGetAllocator(message), 0);
@@ -1197,6 +2000,7 @@ Boolean CFHTTPMessageAppendBytes(CFHTTPMessageRef message, const UInt8 *newBytes
 extern Boolean _CFHTTPMessageConvertToDataOnlyResponse(CFHTTPMessageRef message) {
     if (message->_firstLine) return FALSE;
     if (!(message->_flags & IS_RESPONSE)) return FALSE;
+    _CFHTTPMessageInvalidateSerializedHeaders(message, NULL);
     message->_firstLine = CFRetain(_kCFHTTPMessageEmptyString);
     message->_flags |= HEADERS_COMPLETE;
     return TRUE;
@@ -514,6 +514,88 @@ _CFStringCreateRFC2616DateStringWithGregorianDate(
 
 
 
+/*
+ *  _CFHTTPScannerKind
+ *
+ *  Discussion:
+ *    Implementations of the byte scanner used by the HTTP header
+ *    parser.  Automatic selects the widest implementation supported by
+ *    the running processor.
+ */
+enum _CFHTTPScannerKind {
+  _kCFHTTPScannerAutomatic      = 0,
+  _kCFHTTPScannerScalar         = 1,
+  _kCFHTTPScannerSSE2           = 2,
+  _kCFHTTPScannerAVX2           = 3
+};
+typedef enum _CFHTTPScannerKind _CFHTTPScannerKind;
+
+
+/*
+ *  _CFHTTPSetScanner()
+ *
+ *  Discussion:
+ *    Forces the HTTP header parser to use the given scanner
+ *    implementation.  This is intended for benchmarking and testing;
+ *    the default is _kCFHTTPScannerAutomatic.
+ *
+ *  Mac OS X threading:
+ *    Not thread safe
+ *    Must not be called while messages are being parsed on other
+ *    threads.
+ *
+ *  Parameters:
+ *
+ *    kind:
+ *      The scanner implementation to be used.
+ *
+ *  Result:
+ *    Returns FALSE if the implementation is not supported on this
+ *    processor, in which case the current scanner is left in place.
+ *
+ */
+extern Boolean
+_CFHTTPSetScanner(_CFHTTPScannerKind kind);
+
+
+
+/*
+ *  _CFHTTPScanForBytes()
+ *
+ *  Discussion:
+ *    Finds the first byte matching any of the three given bytes using
+ *    the scanner currently in use by the HTTP header parser.  Pass the
+ *    same value more than once to search for fewer bytes.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ *  Parameters:
+ *
+ *    bytes:
+ *      Pointer to the bytes to be searched.
+ *
+ *    length:
+ *      Number of bytes located at the bytes pointer location.
+ *
+ *    c1, c2, c3:
+ *      The bytes being searched for.
+ *
+ *  Result:
+ *    Returns a pointer to the first matching byte or NULL if none of
+ *    the bytes were found.
+ *
+ */
+extern const UInt8 *
+_CFHTTPScanForBytes(
+  const UInt8 *   bytes,
+  CFIndex         length,
+  UInt8           c1,
+  UInt8           c2,
+  UInt8           c3);
+
+
+
 #if PRAGMA_ENUM_ALWAYSINT
     #pragma enumsalwaysint reset
 #endif
@@ -72,17 +72,24 @@
 #pragma mark Includes
 #include <CFNetwork/CFServerPriv.h>
 #include <CFNetwork/CFHTTPServerPriv.h>
+#include <CFNetwork/CFSocketStreamPriv.h>
 #include "CFNetworkInternal.h"
 
 #include <CoreFoundation/CFRuntime.h>
 #if !defined(__WIN32__)
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <strings.h>
+#include <unistd.h>
 #define SOCK_MAXADDRLEN 255
 #else
 #include <winsock2.h>
 #define SOCK_MAXADDRLEN 255
 #endif
+#include <stdlib.h>
+#include <zlib.h>
 
 
 #if 0
@@ -100,6 +107,16 @@
 #define _kCFHTTPServerTransferEncodingChunked	CFSTR("chunked")
 #define _kCFHTTPServerConnectionHeader			CFSTR("Connection")
 #define _kCFHTTPServerConnectionClose			CFSTR("close")
+#define _kCFHTTPServerFileNativeHandleProperty	CFSTR("_kCFStreamPropertyFileNativeHandle")
+#define _kCFHTTPServerAcceptEncodingHeader		CFSTR("Accept-Encoding")
+#define _kCFHTTPServerContentEncodingHeader		CFSTR("Content-Encoding")
+#define _kCFHTTPServerContentEncodingGzip		CFSTR("gzip")
+#define _kCFHTTPServerContentTypeHeader			CFSTR("Content-Type")
+#define _kCFHTTPServerVaryHeader				CFSTR("Vary")
+#define _kCFHTTPServerVaryFormat				CFSTR("%@, %@")
+#define _kCFHTTPServerVaryAll					CFSTR("*")
+#define _kCFHTTPServerHEADMethod				CFSTR("HEAD")
+#define _kCFHTTPServerContentRangeHeader		CFSTR("Content-Range")
 #else
 static CONST_STRING_DECL(_kCFHTTPServerDescribeFormat, "<HttpServer 0x%x>{server=%@, connections=%@, info=%@}")
 static CONST_STRING_DECL(_kCFHTTPServerPtrFormat, "<0x%x>")
@@ -110,12 +127,24 @@ static CONST_STRING_DECL(_kCFHTTPServerTransferEncodingHeader, "Transfer-Encodin
 static CONST_STRING_DECL(_kCFHTTPServerTransferEncodingChunked, "chunked")
 static CONST_STRING_DECL(_kCFHTTPServerConnectionHeader, "Connection")
 static CONST_STRING_DECL(_kCFHTTPServerConnectionClose, "close")
+static CONST_STRING_DECL(_kCFHTTPServerFileNativeHandleProperty, "_kCFStreamPropertyFileNativeHandle")
+static CONST_STRING_DECL(_kCFHTTPServerAcceptEncodingHeader, "Accept-Encoding")
+static CONST_STRING_DECL(_kCFHTTPServerContentEncodingHeader, "Content-Encoding")
+static CONST_STRING_DECL(_kCFHTTPServerContentEncodingGzip, "gzip")
+static CONST_STRING_DECL(_kCFHTTPServerContentTypeHeader, "Content-Type")
+static CONST_STRING_DECL(_kCFHTTPServerVaryHeader, "Vary")
+static CONST_STRING_DECL(_kCFHTTPServerVaryFormat, "%@, %@")
+static CONST_STRING_DECL(_kCFHTTPServerVaryAll, "*")
+static CONST_STRING_DECL(_kCFHTTPServerHEADMethod, "HEAD")
+static CONST_STRING_DECL(_kCFHTTPServerContentRangeHeader, "Content-Range")
 #endif	/* __CONSTANT_CFSTRINGS__ */
 
 
 #pragma mark -
 #pragma mark Type Declarations
 
+typedef struct _HttpWorker HttpWorker;
+
 typedef struct {
     CFRuntimeBase			_base;			// CFRuntimeBase for CF types
 	
@@ -125,14 +154,40 @@ typedef struct {
     
     _CFHTTPServerCallBacks	_callbacks;		// Callback functions for user
     _CFHTTPServerContext	_ctxt;			// User's context for callback
+	
+	CFIndex					_workerCount;	// Number of worker threads to hand connections to
+	HttpWorker*				_workers;		// Running workers, NULL when connections stay on this run loop
+	CFIndex					_nextWorker;	// Worker to receive the next accepted connection
+	
+	int						_compressLevel;	// zlib level for response bodies, or 0 to send them as-is
+	CFIndex					_compressMin;	// Bodies known to be smaller than this go out as-is
+	CFArrayRef				_compressTypes;	// Content types worth compressing, NULL for the defaults
 } HttpServer;
 
 
+struct _HttpWorker {
+	HttpServer*				_server;		// Owning server (not retained; the server outlives its workers)
+	
+	_CFThread				_thread;		// Thread running the worker's run loop
+	Boolean					_threadStarted;	// Set once _thread was spawned and needs joining
+	CFRunLoopRef			_runLoop;		// The worker's run loop, NULL until the thread is up
+	CFRunLoopSourceRef		_source;		// Signalled when there are sockets to pick up or when stopping
+	
+	CFMutableArrayRef		_connections;	// HttpConnection's owned by this worker, changed only on its thread under _lock
+	
+	_CFMutex				_lock;			// Protects the fields below
+	CFMutableDataRef		_pending;		// Accepted sockets not yet picked up by the worker
+	CFMutableArrayRef		_handedResponses;	// Requests and their response lists, alternating, added from other threads
+	Boolean					_stopping;		// Set when the worker should tear down and exit
+};
+
+
 typedef struct {
     CFAllocatorRef			_alloc;			// Allocator used to allocate this
     UInt32					_rc;			// Number of times retained.
 	
 	HttpServer*				_server;		// Reference back to the owning server context.
+	HttpWorker*				_worker;		// Worker whose run loop the connection is on, or NULL
 	
     CFDataRef				_peer;			// Peer's address
     
@@ -145,6 +200,15 @@ typedef struct {
 	CFMutableArrayRef		_requests;		// Ordered incoming requests
 	
 	CFMutableDataRef		_bufferedBytes;	// Bytes bound for delivery but not yet sent
+	
+	int						_bodyFile;		// Descriptor of a file body going out with sendfile, or -1
+	long long				_bodyFileLeft;	// Bytes of the file body not yet sent
+	Boolean					_bodyChunked;	// Body is framed in chunks by the server and still needs its last chunk
+	
+	CFMutableSetRef			_gzipRequests;	// Requests whose Accept-Encoding takes a gzip'd response
+	z_stream*				_deflater;		// Compressor, kept across responses on the connection
+	Boolean					_compressing;	// Current body is going out gzip'd in chunks
+	Boolean					_compressDone;	// Last of the compressed body, final chunk included, is buffered
 } HttpConnection;
 
 
@@ -167,6 +231,21 @@ static void _HttpConnectionHandleHasBytesAvailable(HttpConnection* connection);
 static void _HttpConnectionHandleCanAcceptBytes(HttpConnection* connection);
 static void _HttpConnectionHandleErrorOccurred(HttpConnection* connection, const CFStreamError* error);
 static void _HttpConnectionHandleTimeOut(HttpConnection* connection);
+static void _HttpConnectionHandleResponseSent(HttpConnection* connection, CFHTTPMessageRef request, CFHTTPMessageRef response);
+
+// Body framing for HttpConnection object
+static void _HttpConnectionPrepareBodyFraming(HttpConnection* connection, CFHTTPMessageRef request, CFHTTPMessageRef response);
+
+// Zero-copy sending of file bodies for HttpConnection object
+static void _HttpConnectionPrepareFileBody(HttpConnection* connection, CFHTTPMessageRef response, CFReadStreamRef stream);
+static void _HttpConnectionSendFileBody(HttpConnection* connection, CFHTTPMessageRef request, CFHTTPMessageRef response);
+
+// Compression of response bodies for HttpConnection object
+static void _HttpConnectionNegotiateEncoding(HttpConnection* connection, CFHTTPMessageRef request);
+static void _HttpConnectionPrepareCompressedBody(HttpConnection* connection, CFHTTPMessageRef request, CFHTTPMessageRef response);
+static void _HttpConnectionCompressBody(HttpConnection* connection, CFHTTPMessageRef request, CFHTTPMessageRef response, CFReadStreamRef stream);
+static void _HttpConnectionAppendChunk(HttpConnection* connection, const UInt8* bytes, CFIndex length);
+static Boolean _HttpServerIsCompressibleType(HttpServer* server, CFStringRef type);
 
 static const void*	_ArrayRetainCallBack(CFAllocatorRef allocator, const HttpConnection* connection);
 static void _ArrayReleaseCallBack(CFAllocatorRef allocator, const HttpConnection* connection);
@@ -181,10 +260,27 @@ static void _TimerCallBack(CFRunLoopTimerRef timer, HttpConnection* connection);
 static void _HttpServerAddConnection(HttpServer* server, HttpConnection* connection);
 static void _HttpServerRemoveConnection(HttpServer* server, HttpConnection* connection);
 
+static CFMutableArrayRef _HttpServerGetConnections(HttpServer* server);
+static HttpConnection* _HttpServerFindConnection(CFArrayRef connections, CFHTTPMessageRef request, CFIndex* index);
+static Boolean _HttpServerDeliverResponse(CFArrayRef connections, CFHTTPMessageRef request, CFArrayRef list);
+static void _HttpServerForwardResponse(HttpServer* server, CFHTTPMessageRef request, CFArrayRef list);
+
+// Guard a connection's place in its worker's list against other threads searching it
+static void _HttpConnectionLock(HttpConnection* connection);
+static void _HttpConnectionUnlock(HttpConnection* connection);
+
 // Handlers for HttpServer object
 static void _HttpServerHandleNewConnection(HttpServer* server, CFSocketNativeHandle sock);
+static void _HttpServerAcceptConnection(HttpServer* server, HttpWorker* worker, CFSocketNativeHandle sock);
 static void _HttpServerHandleError(HttpServer* server, const CFStreamError* error);
 
+// Functions for the HttpServer's worker threads
+static Boolean _HttpServerStartWorkers(HttpServer* server);
+static void _HttpServerStopWorkers(HttpServer* server);
+static void _HttpWorkerHandOff(HttpWorker* worker, CFSocketNativeHandle sock);
+static void* _HttpWorkerMain(HttpWorker* worker);
+static void _HttpWorkerPerform(HttpWorker* worker);
+
 // Server callback -- call into HttpServer's handlers
 static void _ServerCallBack(_CFServerRef server, CFSocketNativeHandle sock, const CFStreamError* error, HttpServer* httpServer);
 
@@ -209,6 +305,7 @@ extern void _CFSocketStreamCreatePair(CFAllocatorRef alloc, CFStringRef host, UI
 // A shorter timeout should be used for a more heavily used server.
 #define kTimeOutInSeconds ((CFTimeInterval)60.0)
 #define kBufferSize ((CFIndex)8192)
+#define kSendFileSize ((CFIndex)(1 << 30))
 
 #define kReadEvents	((CFOptionFlags)(kCFStreamEventHasBytesAvailable | kCFStreamEventErrorOccurred))
 #define kWriteEvents	((CFOptionFlags)(kCFStreamEventCanAcceptBytes | kCFStreamEventErrorOccurred))
@@ -286,6 +383,16 @@ _CFHTTPServerCreate(CFAllocatorRef alloc, const _CFHTTPServerCallBacks* callback
         memset(&server->_callbacks, 0, sizeof(server->_callbacks));
         memset(&server->_ctxt, 0, sizeof(server->_ctxt));
         
+        // Connections stay on the creating thread's run loop until told otherwise.
+        server->_workerCount = 0;
+        server->_workers = NULL;
+        server->_nextWorker = 0;
+        
+        // Bodies go out as given until compression is turned on.
+        server->_compressLevel = 0;
+        server->_compressMin = 0;
+        server->_compressTypes = NULL;
+        
 		// Set the info on the callback context
 		ctxt.info = server;
 		
@@ -371,17 +478,71 @@ _CFHTTPServerStart(_CFHTTPServerRef server, CFStringRef name, CFStringRef type,
 
     HttpServer* s = (HttpServer*)server;
 
-    // Nothing special needed for the HTTP server.
+    // Bring up the workers before any connection can arrive for them.
+    if ((s->_workerCount != 0) && (s->_workers == NULL) && !_HttpServerStartWorkers(s))
+        return FALSE;
     
     return _CFServerStart(s->_server, name, type, port);
 }
 
 
+/* CF_EXPORT */ Boolean
+_CFHTTPServerSetWorkerCount(_CFHTTPServerRef server, CFIndex count) {
+    
+    HttpServer* s = (HttpServer*)server;
+    
+#if defined(__WIN32__)
+    // Win32 threads can't be joined, so there's no clean way to stop workers.
+    if (count != 0)
+        return FALSE;
+#endif
+
+    // The count can't change once the workers are running.
+    if ((s->_workers != NULL) || (count < 0))
+        return FALSE;
+    
+    s->_workerCount = count;
+    
+    return TRUE;
+}
+
+
+/* CF_EXPORT */ Boolean
+_CFHTTPServerSetCompression(_CFHTTPServerRef server, CFIndex level, CFIndex minimumSize, CFArrayRef contentTypes) {
+    
+    HttpServer* s = (HttpServer*)server;
+    
+    // Only zlib's levels are understood.
+    if ((level < 0) || (level > 9) || (minimumSize < 0))
+        return FALSE;
+    
+    // Connections read the settings without a lock, so they're fixed once running.
+    if (!s->_server || _CFServerGetPort(s->_server))
+        return FALSE;
+    
+    s->_compressLevel = (int)level;
+    s->_compressMin = minimumSize;
+    
+    // Swap in the new list of types.
+    if (contentTypes)
+        CFRetain(contentTypes);
+    if (s->_compressTypes)
+        CFRelease(s->_compressTypes);
+    s->_compressTypes = contentTypes;
+    
+    return TRUE;
+}
+
+
 /* CF_EXPORT */ void
 _CFHTTPServerInvalidate(_CFHTTPServerRef server) {
 	
 	HttpServer* s = (HttpServer*)server;
 	
+	// Stop the workers first, so none of them is in a callback while the context goes away.
+	// This also closes out the connections they own.
+	_HttpServerStopWorkers(s);
+	
 	// Release the user's context info pointer.
 	if (s->_ctxt.info && s->_ctxt.release)
 		s->_ctxt.release(s->_ctxt.info);
@@ -404,6 +565,12 @@ _CFHTTPServerInvalidate(_CFHTTPServerRef server) {
         CFRelease(s->_server);
         s->_server = NULL;
     }
+    
+    // Drop the list of compressible types.
+    if (s->_compressTypes) {
+        CFRelease(s->_compressTypes);
+        s->_compressTypes = NULL;
+    }
 }
 
 
@@ -417,34 +584,33 @@ _CFHTTPServerGetPort(_CFHTTPServerRef server) {
 /* CF_EXPORT */ CFDataRef
 _CFHTTPServerCopyPeerAddressForRequest(_CFHTTPServerRef server, CFHTTPMessageRef request) {
     
-    CFIndex i, count;
+    CFIndex i;
+    CFDataRef result = NULL;
     HttpServer* s = (HttpServer*)server;
     
-    // Prepare to look for the given request in the connections
-    count = CFArrayGetCount(s->_connections);
+    // Look on this thread first, where nothing else changes the connections.
+    HttpConnection* c = _HttpServerFindConnection(_HttpServerGetConnections(s), request, NULL);
     
-    // Start the search
-    for (i = 0; i < count; i++) {
+    // return the copy that was found
+    if (c != NULL)
+        return (c->_peer == NULL) ? NULL : CFDataCreateCopy(CFGetAllocator(server), c->_peer);
+    
+    // Otherwise the request may be on any of the workers, so look through each under its lock.
+    for (i = 0; (s->_workers != NULL) && (i < s->_workerCount) && (c == NULL); i++) {
         
-        // **FIXME** This is somewhat incestuous.  The server should not be reaching
-        // into the connections.  There should really be a HttpConnection method for
-        // adding a response.
+        HttpWorker* worker = &s->_workers[i];
         
-        // Pull out the current connection
-        HttpConnection* c = (HttpConnection*)CFArrayGetValueAtIndex(s->_connections, i);
+        _CFMutexLock(&worker->_lock);
         
-        // Check to see if the connection knows of the request
-        CFIndex j = CFArrayGetFirstIndexOfValue(c->_requests, CFRangeMake(0, CFArrayGetCount(c->_requests)), request);
+        c = _HttpServerFindConnection(worker->_connections, request, NULL);
         
-        // Handle the response if it was found
-        if (j != kCFNotFound) {
+        if ((c != NULL) && (c->_peer != NULL))
+            result = CFDataCreateCopy(CFGetAllocator(server), c->_peer);
         
-            // return the copy that was found
-            return (c->_peer == NULL) ? NULL : CFDataCreateCopy(CFGetAllocator(server), c->_peer);
-        }
+        _CFMutexUnlock(&worker->_lock);
     }
 
-    return NULL;
+    return result;
 }
 
 
@@ -512,7 +678,6 @@ _CFHTTPServerAddResponse(_CFHTTPServerRef server, CFHTTPMessageRef request, CFHT
 _CFHTTPServerAddStreamedResponse(_CFHTTPServerRef server, CFHTTPMessageRef request, CFHTTPMessageRef response, CFReadStreamRef body) {
 
     CFArrayRef list;
-    CFIndex i, count;
     
     HttpServer* s = (HttpServer*)server;
     CFAllocatorRef alloc = CFGetAllocator(server);
@@ -526,36 +691,9 @@ _CFHTTPServerAddStreamedResponse(_CFHTTPServerRef server, CFHTTPMessageRef reque
     // Create the response list for the request
     list = CFArrayCreate(alloc, objs, sizeof(objs) / sizeof(objs[0]), &kCFTypeArrayCallBacks);
     
-    // Prepare to look for the given request in the connections
-    count = CFArrayGetCount(s->_connections);
-    
-    // Start the search
-    for (i = 0; i < count; i++) {
-        
-        // **FIXME** This is somewhat incestuous.  The server should not be reaching
-        // into the connections.  There should really be a HttpConnection method for
-        // adding a response.
-        
-        // Pull out the current connection
-        HttpConnection* c = (HttpConnection*)CFArrayGetValueAtIndex(s->_connections, i);
-        
-        // Check to see if the connection knows of the request
-        CFIndex j = CFArrayGetFirstIndexOfValue(c->_requests, CFRangeMake(0, CFArrayGetCount(c->_requests)), request);
-        
-        // Handle the response if it was found
-        if (j != kCFNotFound) {
-            
-            // Add the response list to the connection for the given request
-            CFDictionaryAddValue(c->_responses, request, list);
-        
-            // If the request was the head of the request queue and the stream can send, pump it.
-            if ((j == 0) && CFWriteStreamCanAcceptBytes(c->_outStream))
-                _HttpConnectionHandleCanAcceptBytes(c);
-        
-            // Everything has been handled
-            break;
-        }
-    }
+    // Add it here if the request is on this thread, otherwise hand it to the worker whose request it is.
+    if (!_HttpServerDeliverResponse(_HttpServerGetConnections(s), request, list) && (s->_workers != NULL))
+        _HttpServerForwardResponse(s, request, list);
     
     // List has been handled, so it's not needed anymore.
     CFRelease(list);
@@ -603,6 +741,9 @@ _HttpConnectionCreate(CFAllocatorRef alloc, HttpServer* server, CFSocketNativeHa
 		
 		memset(connection, 0, sizeof(connection[0]));
 		
+		// No file body being sent yet.
+		connection->_bodyFile = -1;
+		
 		// Save the allocator for deallocating later.
 		connection->_alloc = alloc ? CFRetain(alloc) : NULL;
 		
@@ -684,6 +825,16 @@ _HttpConnectionCreate(CFAllocatorRef alloc, HttpServer* server, CFSocketNativeHa
         if (connection->_bufferedBytes == NULL)
             break;
         
+        // Track which requests will take a compressed response, if any can.
+        if (server->_compressLevel != 0) {
+            
+            connection->_gzipRequests = CFSetCreateMutable(alloc, 0, &kCFTypeSetCallBacks);
+            
+            // Make sure the set was created
+            if (connection->_gzipRequests == NULL)
+                break;
+        }
+        
         // It's all good
 		return connection;
 			
@@ -766,6 +917,16 @@ _HttpConnectionRelease(HttpConnection* connection) {
         if (connection->_bufferedBytes)
             CFRelease(connection->_bufferedBytes);
         
+        // Toss the requests taking compressed responses
+        if (connection->_gzipRequests)
+            CFRelease(connection->_gzipRequests);
+        
+        // Shut down the compressor
+        if (connection->_deflater) {
+            deflateEnd(connection->_deflater);
+            CFAllocatorDeallocate(alloc, connection->_deflater);
+        }
+        
 		// Free the memory in use by the connection.
 		CFAllocatorDeallocate(alloc, connection);
 		
@@ -898,6 +1059,9 @@ _HttpConnectionHandleRequest(HttpConnection* connection) {
 
                 if (body) CFRelease(body);
                 
+                // Note whether the response can go out compressed before the client sees the request.
+                _HttpConnectionNegotiateEncoding(connection, msg);
+                
                 // Inform the client of the incoming request
                 if (connection->_server->_callbacks.didReceiveRequestCallBack != NULL) {
                     CFRetain(msg);
@@ -925,6 +1089,9 @@ _HttpConnectionHandleRequest(HttpConnection* connection) {
                 // Toss the new body since it's retained by the request.
                 CFRelease(newBody);
 
+                // Note whether the response can go out compressed before the client sees the request.
+                _HttpConnectionNegotiateEncoding(connection, msg);
+                
                 // Inform the client of the incoming request
                 if (connection->_server->_callbacks.didReceiveRequestCallBack != NULL) {
                     CFRetain(msg);
@@ -938,7 +1105,9 @@ _HttpConnectionHandleRequest(HttpConnection* connection) {
                 msg = newMsg;
                 
                 // Put the new request in the requests list.
+                _HttpConnectionLock(connection);
                 CFArrayAppendValue(connection->_requests, msg);
+                _HttpConnectionUnlock(connection);
 
                 // Drop the retain count now since it's being held by the queue.
                 CFRelease(msg);
@@ -1013,7 +1182,9 @@ _HttpConnectionHandleHasBytesAvailable(HttpConnection* connection) {
 		
         // There was no requests, so create a new one with which to work
 		msg = CFHTTPMessageCreateEmpty(connection->_alloc, TRUE);
+		_HttpConnectionLock(connection);
 		CFArrayAppendValue(connection->_requests, msg);
+		_HttpConnectionUnlock(connection);
 		CFRelease(msg);
 	}
 	
@@ -1108,10 +1279,16 @@ _HttpConnectionHandleCanAcceptBytes(HttpConnection* connection) {
         // Only handle if there is a response ready to go
         if (list != NULL) {
         
-            CFIndex bytesWritten;
+            CFIndex bytesWritten = 0;
         
-            // If there are no buffered bytes, need to start the next request.
-            if (CFDataGetLength(connection->_bufferedBytes) == 0) {
+            // If there are no buffered bytes and no body being sent, need to start the next request.
+            if ((CFDataGetLength(connection->_bufferedBytes) == 0) && (connection->_bodyFile == -1) && !connection->_compressing) {
+                
+                // Switch the headers over to a compressed body if the request and response allow.
+                _HttpConnectionPrepareCompressedBody(connection, request, response);
+                
+                // Settle how the body is framed, whichever way it ends up being sent.
+                _HttpConnectionPrepareBodyFraming(connection, request, response);
                 
                 // Serialize if for sending
                 CFDataRef serialized = CFHTTPMessageCopySerializedMessage(response);
@@ -1124,32 +1301,51 @@ _HttpConnectionHandleCanAcceptBytes(HttpConnection* connection) {
                 
                 // Release the original.
                 CFRelease(serialized);
+                
+                // See if the body can go out straight from its file.
+                if (!connection->_compressing)
+                    _HttpConnectionPrepareFileBody(connection, response, stream);
             }
             
-            // Try writing the entire buffer
-            bytesWritten = CFWriteStreamWrite(connection->_outStream,
-                                              CFDataGetBytePtr(connection->_bufferedBytes),
-                                              CFDataGetLength(connection->_bufferedBytes));
+            // Buffered bytes always go out first.
+            if (CFDataGetLength(connection->_bufferedBytes) != 0) {
+                
+                // Try writing the entire buffer
+                bytesWritten = CFWriteStreamWrite(connection->_outStream,
+                                                  CFDataGetBytePtr(connection->_bufferedBytes),
+                                                  CFDataGetLength(connection->_bufferedBytes));
+                
+                // If successfully wrote, continue on.
+                if (bytesWritten > 0) {
+                
+                    // Compute the new size of the buffer after the write
+                    CFIndex newSize = CFDataGetLength(connection->_bufferedBytes) - bytesWritten;
+                    
+                    // Tickle the timer
+                    CFRunLoopTimerSetNextFireDate(connection->_timer, CFAbsoluteTimeGetCurrent() + kTimeOutInSeconds);
             
-            // If successfully wrote, continue on.
-            if (bytesWritten > 0) {
+                    // Move the remaining bytes down in the buffer
+                    memmove(CFDataGetMutableBytePtr(connection->_bufferedBytes),
+                            CFDataGetBytePtr(connection->_bufferedBytes) + bytesWritten,
+                            newSize);
+                            
+                    // Resize the buffer to indicate what is left
+                    CFDataSetLength(connection->_bufferedBytes, newSize);
+                }
+            }
             
-                // Compute the new size of the buffer after the write
-                CFIndex newSize = CFDataGetLength(connection->_bufferedBytes) - bytesWritten;
+            // If nothing left in the buffer, move on with the body
+            if ((bytesWritten >= 0) && (CFDataGetLength(connection->_bufferedBytes) == 0)) {
                 
-                // Tickle the timer
-                CFRunLoopTimerSetNextFireDate(connection->_timer, CFAbsoluteTimeGetCurrent() + kTimeOutInSeconds);
-        
-                // Move the remaining bytes down in the buffer
-                memmove(CFDataGetMutableBytePtr(connection->_bufferedBytes),
-                        CFDataGetBytePtr(connection->_bufferedBytes) + bytesWritten,
-                        newSize);
-                        
-                // Resize the buffer to indicate what is left
-                CFDataSetLength(connection->_bufferedBytes, newSize);
+                // A file body bypasses the buffer altogether.
+                if (connection->_bodyFile != -1)
+                    _HttpConnectionSendFileBody(connection, request, response);
+                
+                // A compressed body fills the buffer with chunks of its own.
+                else if (connection->_compressing)
+                    _HttpConnectionCompressBody(connection, request, response, stream);
                 
-                // If nothing left in the buffer, fill the buffer
-                if (newSize == 0) {
+                else {
                 
                     CFIndex bytesRead;
                     
@@ -1167,6 +1363,16 @@ _HttpConnectionHandleCanAcceptBytes(HttpConnection* connection) {
                     if (bytesRead >= 0)
                         CFDataSetLength(connection->_bufferedBytes, bytesRead);
                     
+                    // Frame what was read as a chunk if the body is chunked.
+                    if ((bytesRead > 0) && connection->_bodyChunked) {
+                        
+                        char chunk[32];
+                        int length = snprintf(chunk, sizeof(chunk), "%lx\r\n", (unsigned long)bytesRead);
+                        
+                        CFDataReplaceBytes(connection->_bufferedBytes, CFRangeMake(0, 0), (const UInt8*)chunk, length);
+                        CFDataAppendBytes(connection->_bufferedBytes, (const UInt8*)"\r\n", 2);
+                    }
+                    
                     // Was there an error?
                     if (bytesRead < 0) {
                         
@@ -1177,44 +1383,15 @@ _HttpConnectionHandleCanAcceptBytes(HttpConnection* connection) {
                         _HttpConnectionHandleErrorOccurred(connection, &error);
                     }
                     
-                    // Was this the end of the response's stream?
-                    else if (bytesRead == 0) {
-                        
-                        // Get the HTTP version and the connection header from the response.
-                        CFStringRef close = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPServerConnectionHeader);
-                        CFStringRef version = CFHTTPMessageCopyVersion(response);
-                        
-                        // If no header, check the original request for one.
-                        if (close == NULL)
-                            close = CFHTTPMessageCopyHeaderFieldValue(request, _kCFHTTPServerConnectionHeader);
-                        
-                        // Inform the client of a successful send of the response.
-                        if (connection->_server->_callbacks.didSendResponseCallBack != NULL) {
-                            connection->_server->_callbacks.didSendResponseCallBack((_CFHTTPServerRef)connection->_server,
-                                                                                    request,
-                                                                                    response,
-                                                                                    connection->_server->_ctxt.info);
-                        }
-                        
-                        // Remove the request-response pair from the conneciton's queue
-                        CFDictionaryRemoveValue(connection->_responses, request);
-                        CFArrayRemoveValueAtIndex(connection->_requests, 0);
-                        
-                        // If there was a header and it said, "close," or if there was no header and HTTP version
-                        // 1.0 is being used, then close the connection and remove it from the server.
-                        if (((close != NULL) &&
-                            CFStringCompare(close, _kCFHTTPServerConnectionClose, kCFCompareCaseInsensitive) == kCFCompareEqualTo) ||
-                        	((close == NULL) && (version != NULL) &&
-                            CFStringCompare(version, kCFHTTPVersion1_1, kCFCompareCaseInsensitive) != kCFCompareEqualTo))
-                        {
-                            _HttpServerRemoveConnection(connection->_server, connection);
-                        }
-                        if (close != NULL)
-                            CFRelease(close);
-                            
-                        if (version != NULL)
-                            CFRelease(version);
+                    // At the end of a chunked body, the last chunk still has to go out.
+                    else if ((bytesRead == 0) && connection->_bodyChunked) {
+                        CFDataAppendBytes(connection->_bufferedBytes, (const UInt8*)"0\r\n\r\n", 5);
+                        connection->_bodyChunked = FALSE;
                     }
+                    
+                    // Was this the end of the response's stream?
+                    else if (bytesRead == 0)
+                        _HttpConnectionHandleResponseSent(connection, request, response);
                 }
             }
         }
@@ -1222,6 +1399,580 @@ _HttpConnectionHandleCanAcceptBytes(HttpConnection* connection) {
 }
 
 
+/* static */ void
+_HttpConnectionHandleResponseSent(HttpConnection* connection, CFHTTPMessageRef request, CFHTTPMessageRef response) {
+    
+    // Get the HTTP version and the connection header from the response.
+    CFStringRef close = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPServerConnectionHeader);
+    CFStringRef version = CFHTTPMessageCopyVersion(response);
+    
+    // If no header, check the original request for one.
+    if (close == NULL)
+        close = CFHTTPMessageCopyHeaderFieldValue(request, _kCFHTTPServerConnectionHeader);
+    
+    // Inform the client of a successful send of the response.
+    if (connection->_server->_callbacks.didSendResponseCallBack != NULL) {
+        connection->_server->_callbacks.didSendResponseCallBack((_CFHTTPServerRef)connection->_server,
+                                                                request,
+                                                                response,
+                                                                connection->_server->_ctxt.info);
+    }
+    
+    // It no longer needs tracking for compression.
+    if (connection->_gzipRequests)
+        CFSetRemoveValue(connection->_gzipRequests, request);
+    
+    // Remove the request-response pair from the conneciton's queue
+    CFDictionaryRemoveValue(connection->_responses, request);
+    _HttpConnectionLock(connection);
+    CFArrayRemoveValueAtIndex(connection->_requests, 0);
+    _HttpConnectionUnlock(connection);
+    
+    // If there was a header and it said, "close," or if there was no header and HTTP version
+    // 1.0 is being used, then close the connection and remove it from the server.
+    if (((close != NULL) &&
+        CFStringCompare(close, _kCFHTTPServerConnectionClose, kCFCompareCaseInsensitive) == kCFCompareEqualTo) ||
+        ((close == NULL) && (version != NULL) &&
+        CFStringCompare(version, kCFHTTPVersion1_1, kCFCompareCaseInsensitive) != kCFCompareEqualTo))
+    {
+        _HttpServerRemoveConnection(connection->_server, connection);
+    }
+    if (close != NULL)
+        CFRelease(close);
+        
+    if (version != NULL)
+        CFRelease(version);
+}
+
+
+/* static */ void
+_HttpConnectionPrepareBodyFraming(HttpConnection* connection, CFHTTPMessageRef request, CFHTTPMessageRef response) {
+    
+    CFStringRef value, method, version;
+    UInt32 status;
+    Boolean chunked;
+    
+    connection->_bodyChunked = FALSE;
+    
+    // A compressed body does its own chunking.
+    if (connection->_compressing)
+        return;
+    
+    // A known length needs no framing.
+    value = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPServerContentLengthHeader);
+    if (value) {
+        CFRelease(value);
+        return;
+    }
+    
+    // Neither do responses which never have a body.
+    status = CFHTTPMessageGetResponseStatusCode(response);
+    if ((status < 200) || (status == 204) || (status == 304))
+        return;
+    
+    method = CFHTTPMessageCopyRequestMethod(request);
+    chunked = !method || (CFStringCompare(method, _kCFHTTPServerHEADMethod, 0) != kCFCompareEqualTo);
+    
+    if (method)
+        CFRelease(method);
+    
+    if (!chunked)
+        return;
+    
+    // A body whose transfer encoding the caller set is already framed by the caller, so it goes out as it is.
+    value = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPServerTransferEncodingHeader);
+    if (value) {
+        CFRelease(value);
+        return;
+    }
+    
+    // Otherwise chunk for clients which understand it; older ones find the end when the connection closes.
+    version = CFHTTPMessageCopyVersion(request);
+    chunked = version && (CFStringCompare(version, kCFHTTPVersion1_1, kCFCompareCaseInsensitive) == kCFCompareEqualTo);
+    
+    if (version)
+        CFRelease(version);
+    
+    if (chunked) {
+        CFHTTPMessageSetHeaderFieldValue(response, _kCFHTTPServerTransferEncodingHeader, _kCFHTTPServerTransferEncodingChunked);
+        connection->_bodyChunked = TRUE;
+    }
+}
+
+
+/* static */ void
+_HttpConnectionPrepareFileBody(HttpConnection* connection, CFHTTPMessageRef response, CFReadStreamRef stream) {
+    
+#if defined(__linux__)
+    // The body can skip user space if it's a plain file and the socket can take it with sendfile.
+    CFTypeRef canSendFile = CFWriteStreamCopyProperty(connection->_outStream, _kCFStreamPropertySocketSendFile);
+    CFDataRef native;
+    struct stat sb;
+    off_t offset;
+    int fd = -1;
+    
+    if (canSendFile == NULL)
+        return;
+    
+    CFRelease(canSendFile);
+    
+    // The stream has to be open for it to have a descriptor.
+    if (CFReadStreamGetStatus(stream) == kCFStreamStatusNotOpen)
+        CFReadStreamOpen(stream);
+    
+    // File streams hand out their descriptor like socket streams do.
+    native = (CFDataRef)CFReadStreamCopyProperty(stream, _kCFHTTPServerFileNativeHandleProperty);
+    if (native == NULL)
+        native = (CFDataRef)CFReadStreamCopyProperty(stream, kCFStreamPropertySocketNativeHandle);
+    
+    if (native == NULL)
+        return;
+    
+    if ((CFGetTypeID(native) == CFDataGetTypeID()) && (CFDataGetLength(native) == sizeof(fd)))
+        memmove(&fd, CFDataGetBytePtr(native), sizeof(fd));
+    
+    CFRelease(native);
+    
+    // Only regular files have a known amount left to send.
+    if ((fd == -1) || (fstat(fd, &sb) != 0) || !S_ISREG(sb.st_mode) || ((offset = lseek(fd, 0, SEEK_CUR)) < 0))
+        return;
+    
+    connection->_bodyFile = fd;
+    connection->_bodyFileLeft = (sb.st_size > offset) ? (sb.st_size - offset) : 0;
+    
+    // The whole file is a single chunk, so its header rides along with the response headers.
+    if (connection->_bodyChunked && connection->_bodyFileLeft) {
+        
+        char chunk[32];
+        int length = snprintf(chunk, sizeof(chunk), "%llx\r\n", (unsigned long long)connection->_bodyFileLeft);
+        
+        CFDataAppendBytes(connection->_bufferedBytes, (const UInt8*)chunk, length);
+    }
+    
+    // An empty file is just the last chunk.
+    else if (connection->_bodyChunked) {
+        CFDataAppendBytes(connection->_bufferedBytes, (const UInt8*)"0\r\n\r\n", 5);
+        connection->_bodyChunked = FALSE;
+    }
+#endif
+}
+
+
+/* static */ void
+_HttpConnectionSendFileBody(HttpConnection* connection, CFHTTPMessageRef request, CFHTTPMessageRef response) {
+    
+#if defined(__linux__)
+    // Send what's left of the file straight from the kernel.
+    if (connection->_bodyFileLeft) {
+        
+        CFStreamError error;
+        CFIndex bytesWritten = _CFSocketStreamWriteFile(connection->_outStream,
+                                                        connection->_bodyFile,
+                                                        (connection->_bodyFileLeft < kSendFileSize) ? connection->_bodyFileLeft : kSendFileSize,
+                                                        &error);
+        
+        // The stream's client callback isn't told of errors here, so do it.
+        if (bytesWritten < 0) {
+            _HttpConnectionHandleErrorOccurred(connection, &error);
+            return;
+        }
+        
+        // Tickle the timer
+        CFRunLoopTimerSetNextFireDate(connection->_timer, CFAbsoluteTimeGetCurrent() + kTimeOutInSeconds);
+        
+        connection->_bodyFileLeft -= bytesWritten;
+        
+        // Still more to go, so wait for the next time the stream can take it.
+        if (connection->_bodyFileLeft)
+            return;
+        
+        // Chunked bodies still need to close out the chunk and send the empty last chunk.
+        if (connection->_bodyChunked) {
+            CFDataAppendBytes(connection->_bufferedBytes, (const UInt8*)"\r\n0\r\n\r\n", 7);
+            connection->_bodyChunked = FALSE;
+            return;
+        }
+    }
+    
+    // All of it, last chunk included, is out.
+    connection->_bodyFile = -1;
+    
+    _HttpConnectionHandleResponseSent(connection, request, response);
+#endif
+}
+
+
+/* static */ void
+_HttpConnectionNegotiateEncoding(HttpConnection* connection, CFHTTPMessageRef request) {
+    
+    CFStringRef value;
+    char buffer[256];
+    char* next;
+    Boolean gzip = FALSE, gzipListed = FALSE, any = FALSE;
+    
+    // Only bother when the server compresses at all.
+    if (connection->_gzipRequests == NULL)
+        return;
+    
+    value = CFHTTPMessageCopyHeaderFieldValue(request, _kCFHTTPServerAcceptEncodingHeader);
+    if (value == NULL)
+        return;
+    
+    // Header values are ASCII; anything longer than the buffer is treated as no header.
+    if (!CFStringGetCString(value, buffer, sizeof(buffer), kCFStringEncodingASCII))
+        buffer[0] = '\0';
+    
+    CFRelease(value);
+    
+    // Walk each "coding;q=value" element of the list.
+    next = buffer;
+    while (next) {
+        
+        char* element = next;
+        char* params;
+        double q = 1.0;
+        size_t length;
+        
+        // Split off the element.
+        next = strchr(element, ',');
+        if (next)
+            *next++ = '\0';
+        
+        // Split off its parameters.
+        params = strchr(element, ';');
+        if (params)
+            *params++ = '\0';
+        
+        // Trim the coding.
+        while ((*element == ' ') || (*element == '\t'))
+            element++;
+        length = strlen(element);
+        while (length && ((element[length - 1] == ' ') || (element[length - 1] == '\t')))
+            element[--length] = '\0';
+        
+        // Pick the quality out of the parameters.
+        while (params) {
+            
+            char* param = params;
+            
+            params = strchr(param, ';');
+            if (params)
+                *params++ = '\0';
+            
+            while ((*param == ' ') || (*param == '\t'))
+                param++;
+            
+            if (((param[0] == 'q') || (param[0] == 'Q')) && (param[1] == '='))
+                q = strtod(param + 2, NULL);
+        }
+        
+        // An explicit gzip entry, even at q=0, wins over the wildcard.
+        if (!strcasecmp(element, "gzip") || !strcasecmp(element, "x-gzip")) {
+            gzipListed = TRUE;
+            gzip = gzip || (q > 0);
+        }
+        
+        else if (!strcmp(element, "*"))
+            any = (q > 0);
+    }
+    
+    if (gzip || (!gzipListed && any))
+        CFSetAddValue(connection->_gzipRequests, request);
+}
+
+
+/* static */ void
+_HttpConnectionPrepareCompressedBody(HttpConnection* connection, CFHTTPMessageRef request, CFHTTPMessageRef response) {
+    
+    HttpServer* server = connection->_server;
+    CFStringRef value, method, version;
+    UInt32 status;
+    Boolean compress, hasLength;
+    
+    // Each response starts out uncompressed.
+    connection->_compressing = FALSE;
+    connection->_compressDone = FALSE;
+    
+    if (server->_compressLevel == 0)
+        return;
+    
+    // Only the configured types are worth compressing.
+    value = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPServerContentTypeHeader);
+    compress = value && _HttpServerIsCompressibleType(server, value);
+    
+    if (value)
+        CFRelease(value);
+    
+    if (!compress)
+        return;
+    
+    // Caches need to know the body depends on Accept-Encoding, compressed or not.
+    value = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPServerVaryHeader);
+    if (value == NULL)
+        CFHTTPMessageSetHeaderFieldValue(response, _kCFHTTPServerVaryHeader, _kCFHTTPServerAcceptEncodingHeader);
+    
+    else {
+        
+        // Add to the list unless it's already there or everything varies.
+        if (!CFStringFindWithOptions(value, _kCFHTTPServerAcceptEncodingHeader, CFRangeMake(0, CFStringGetLength(value)), kCFCompareCaseInsensitive, NULL) &&
+            (CFStringFind(value, _kCFHTTPServerVaryAll, 0).location == kCFNotFound))
+        {
+            CFStringRef vary = CFStringCreateWithFormat(connection->_alloc, NULL, _kCFHTTPServerVaryFormat, value, _kCFHTTPServerAcceptEncodingHeader);
+            
+            if (vary) {
+                CFHTTPMessageSetHeaderFieldValue(response, _kCFHTTPServerVaryHeader, vary);
+                CFRelease(vary);
+            }
+        }
+        
+        CFRelease(value);
+    }
+    
+    // The client has to have asked for it.
+    if (!CFSetContainsValue(connection->_gzipRequests, request))
+        return;
+    
+    // Informational, no-content and not-modified responses have no body to compress.
+    status = CFHTTPMessageGetResponseStatusCode(response);
+    if ((status < 200) || (status == 204) || (status == 304))
+        return;
+    
+    // A compressed range would no longer match its Content-Range.
+    if (status == 206)
+        return;
+    
+    // Neither does a response to HEAD.
+    method = CFHTTPMessageCopyRequestMethod(request);
+    compress = !method || (CFStringCompare(method, _kCFHTTPServerHEADMethod, 0) != kCFCompareEqualTo);
+    
+    if (method)
+        CFRelease(method);
+    
+    // Compressed bodies are of unknown length, so need chunking from the client's end too.
+    version = CFHTTPMessageCopyVersion(request);
+    compress = compress && version && (CFStringCompare(version, kCFHTTPVersion1_1, kCFCompareCaseInsensitive) == kCFCompareEqualTo);
+    
+    if (version)
+        CFRelease(version);
+    
+    if (!compress)
+        return;
+    
+    // Leave bodies alone which are already encoded in some way, or are part of a larger one.
+    value = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPServerContentEncodingHeader);
+    if (value == NULL)
+        value = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPServerTransferEncodingHeader);
+    if (value == NULL)
+        value = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPServerContentRangeHeader);
+    
+    if (value) {
+        CFRelease(value);
+        return;
+    }
+    
+    // Small bodies would barely shrink; those of unknown length are assumed large.
+    value = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPServerContentLengthHeader);
+    hasLength = (value != NULL);
+    if (value) {
+        
+        compress = (CFStringGetIntValue(value) >= server->_compressMin);
+        CFRelease(value);
+        
+        if (!compress)
+            return;
+    }
+    
+    // Create the compressor the first time it's needed and reuse it after that.
+    if (connection->_deflater == NULL) {
+        
+        z_stream* deflater = CFAllocatorAllocate(connection->_alloc, sizeof(deflater[0]), 0);
+        
+        if (deflater == NULL)
+            return;
+        
+        memset(deflater, 0, sizeof(deflater[0]));
+        
+        // Window bits past 15 ask for the gzip wrapper.
+        if (deflateInit2(deflater, server->_compressLevel, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            CFAllocatorDeallocate(connection->_alloc, deflater);
+            return;
+        }
+        
+        connection->_deflater = deflater;
+    }
+    
+    else if (deflateReset(connection->_deflater) != Z_OK)
+        return;
+    
+    // Switch the headers over to a gzip'd, chunked body.  Only remove a length that's there;
+    // removing a missing header isn't safe.
+    if (hasLength)
+        CFHTTPMessageSetHeaderFieldValue(response, _kCFHTTPServerContentLengthHeader, NULL);
+    CFHTTPMessageSetHeaderFieldValue(response, _kCFHTTPServerContentEncodingHeader, _kCFHTTPServerContentEncodingGzip);
+    CFHTTPMessageSetHeaderFieldValue(response, _kCFHTTPServerTransferEncodingHeader, _kCFHTTPServerTransferEncodingChunked);
+    
+    connection->_compressing = TRUE;
+}
+
+
+/* static */ void
+_HttpConnectionCompressBody(HttpConnection* connection, CFHTTPMessageRef request, CFHTTPMessageRef response, CFReadStreamRef stream) {
+    
+    z_stream* deflater = connection->_deflater;
+    int flush;
+    
+    // Everything, last chunk included, has been written.
+    if (connection->_compressDone) {
+        
+        connection->_compressing = FALSE;
+        connection->_compressDone = FALSE;
+        
+        _HttpConnectionHandleResponseSent(connection, request, response);
+        
+        return;
+    }
+    
+    // If the response's stream isn't open yet, open it.
+    if (CFReadStreamGetStatus(stream) == kCFStreamStatusNotOpen)
+        CFReadStreamOpen(stream);
+    
+    // Keep feeding the compressor until it has something to send.
+    do {
+        
+        UInt8 input[kBufferSize];
+        CFIndex bytesRead = CFReadStreamRead(stream, input, sizeof(input));
+        
+        // Was there an error?
+        if (bytesRead < 0) {
+            
+            // Get the error from the read stream
+            CFStreamError error = CFReadStreamGetError(stream);
+            
+            // Inform the client of the error.
+            _HttpConnectionHandleErrorOccurred(connection, &error);
+            
+            return;
+        }
+        
+        // Finish at the end of the body.  Otherwise hold output back while more input is
+        // ready, but flush what there is when the body would make the client wait.
+        if ((bytesRead == 0) || (CFReadStreamGetStatus(stream) == kCFStreamStatusAtEnd))
+            flush = Z_FINISH;
+        else if (CFReadStreamHasBytesAvailable(stream))
+            flush = Z_NO_FLUSH;
+        else
+            flush = Z_SYNC_FLUSH;
+        
+        deflater->next_in = input;
+        deflater->avail_in = (uInt)bytesRead;
+        
+        // Drain the compressor into chunks.
+        do {
+            
+            UInt8 output[kBufferSize];
+            
+            deflater->next_out = output;
+            deflater->avail_out = sizeof(output);
+            
+            deflate(deflater, flush);
+            
+            _HttpConnectionAppendChunk(connection, output, sizeof(output) - deflater->avail_out);
+            
+        } while (deflater->avail_out == 0);
+        
+    } while ((flush == Z_NO_FLUSH) && (CFDataGetLength(connection->_bufferedBytes) == 0));
+    
+    // Close out the body with the last chunk.
+    if (flush == Z_FINISH) {
+        CFDataAppendBytes(connection->_bufferedBytes, (const UInt8*)"0\r\n\r\n", 5);
+        connection->_compressDone = TRUE;
+    }
+}
+
+
+/* static */ void
+_HttpConnectionAppendChunk(HttpConnection* connection, const UInt8* bytes, CFIndex length) {
+    
+    char header[32];
+    int headerLength;
+    
+    // A zero-length chunk would end the body early.
+    if (length == 0)
+        return;
+    
+    headerLength = snprintf(header, sizeof(header), "%lx\r\n", (unsigned long)length);
+    
+    CFDataAppendBytes(connection->_bufferedBytes, (const UInt8*)header, headerLength);
+    CFDataAppendBytes(connection->_bufferedBytes, bytes, length);
+    CFDataAppendBytes(connection->_bufferedBytes, (const UInt8*)"\r\n", 2);
+}
+
+
+/* static */ Boolean
+_HttpServerIsCompressibleType(HttpServer* server, CFStringRef type) {
+    
+    static const char* const defaults[] = {
+        "text/",
+        "application/json",
+        "application/javascript",
+        "application/xml",
+        "image/svg+xml"
+    };
+    
+    char buffer[128];
+    char* end;
+    size_t length;
+    CFIndex i, count;
+    
+    // Pull out just the media type, without parameters.
+    if (!CFStringGetCString(type, buffer, sizeof(buffer), kCFStringEncodingASCII))
+        return FALSE;
+    
+    end = strchr(buffer, ';');
+    if (end)
+        *end = '\0';
+    
+    length = strlen(buffer);
+    while (length && ((buffer[length - 1] == ' ') || (buffer[length - 1] == '\t')))
+        buffer[--length] = '\0';
+    
+    count = server->_compressTypes ? CFArrayGetCount(server->_compressTypes) : (CFIndex)(sizeof(defaults) / sizeof(defaults[0]));
+    
+    for (i = 0; i < count; i++) {
+        
+        char entry[128];
+        size_t entryLength;
+        
+        // Use the client's list if there is one.
+        if (server->_compressTypes) {
+            CFStringRef item = (CFStringRef)CFArrayGetValueAtIndex(server->_compressTypes, i);
+            
+            if ((CFGetTypeID(item) != CFStringGetTypeID()) ||
+                !CFStringGetCString(item, entry, sizeof(entry), kCFStringEncodingASCII))
+            {
+                continue;
+            }
+        }
+        
+        else
+            snprintf(entry, sizeof(entry), "%s", defaults[i]);
+        
+        entryLength = strlen(entry);
+        
+        // Entries ending in a slash cover the whole top-level type.
+        if (entryLength && (entry[entryLength - 1] == '/')) {
+            if (!strncasecmp(buffer, entry, entryLength))
+                return TRUE;
+        }
+        
+        else if (!strcasecmp(buffer, entry))
+            return TRUE;
+    }
+    
+    return FALSE;
+}
+
+
 /* static */ void
 _HttpConnectionHandleErrorOccurred(HttpConnection* connection, const CFStreamError* error) {
     
@@ -1340,29 +2091,179 @@ _TimerCallBack(CFRunLoopTimerRef timer, HttpConnection* connection) {
 /* static */ void
 _HttpServerAddConnection(HttpServer* server, HttpConnection* connection) {
 
-    // Add the given connection to the list
-    CFArrayAppendValue(server->_connections, connection);
+    // Add the given connection to the list of whoever owns it
+    _HttpConnectionLock(connection);
+    CFArrayAppendValue(connection->_worker ? connection->_worker->_connections : server->_connections, connection);
+    _HttpConnectionUnlock(connection);
 }
 
 
 /* static */ void
 _HttpServerRemoveConnection(HttpServer* server, HttpConnection* connection) {
     
+    CFIndex i;
+    CFMutableArrayRef connections = connection->_worker ? connection->_worker->_connections : server->_connections;
+    
+    // Hold on so the list's reference isn't the last one let go under the lock.
+    _HttpConnectionRetain(connection);
+    _HttpConnectionLock(connection);
+    
     // Find the given connection in the list of connections
-    CFMutableArrayRef connections = server->_connections;
-    CFIndex i = CFArrayGetFirstIndexOfValue(connections,
-                                            CFRangeMake(0, CFArrayGetCount(connections)),
-                                            connection);
+    i = CFArrayGetFirstIndexOfValue(connections,
+                                    CFRangeMake(0, CFArrayGetCount(connections)),
+                                    connection);
     
     // If it existed, remove it from the list.
     if (i != kCFNotFound)
         CFArrayRemoveValueAtIndex(connections, i);
+    
+    _HttpConnectionUnlock(connection);
+    _HttpConnectionRelease(connection);
+}
+
+
+/* static */ CFMutableArrayRef
+_HttpServerGetConnections(HttpServer* server) {
+    
+    CFIndex i;
+    CFRunLoopRef rl;
+    
+    // Without workers, everything is on the server's list.
+    if (server->_workers == NULL)
+        return server->_connections;
+    
+    rl = CFRunLoopGetCurrent();
+    
+    // Workers only see requests on their own thread, so the current
+    // run loop identifies the worker whose connections to use.
+    for (i = 0; i < server->_workerCount; i++) {
+        if (server->_workers[i]._runLoop == rl)
+            return server->_workers[i]._connections;
+    }
+    
+    return server->_connections;
+}
+
+
+/* static */ HttpConnection*
+_HttpServerFindConnection(CFArrayRef connections, CFHTTPMessageRef request, CFIndex* index) {
+    
+    CFIndex i, count = CFArrayGetCount(connections);
+    
+    // Start the search
+    for (i = 0; i < count; i++) {
+        
+        // **FIXME** This is somewhat incestuous.  The server should not be reaching
+        // into the connections.  There should really be a HttpConnection method for
+        // adding a response.
+        
+        // Pull out the current connection
+        HttpConnection* c = (HttpConnection*)CFArrayGetValueAtIndex(connections, i);
+        
+        // Check to see if the connection knows of the request
+        CFIndex j = CFArrayGetFirstIndexOfValue(c->_requests, CFRangeMake(0, CFArrayGetCount(c->_requests)), request);
+        
+        if (j != kCFNotFound) {
+            
+            if (index != NULL)
+                *index = j;
+            
+            return c;
+        }
+    }
+    
+    return NULL;
+}
+
+
+/* static */ Boolean
+_HttpServerDeliverResponse(CFArrayRef connections, CFHTTPMessageRef request, CFArrayRef list) {
+    
+    CFIndex j;
+    HttpConnection* c = _HttpServerFindConnection(connections, request, &j);
+    
+    if (c == NULL)
+        return FALSE;
+    
+    // Add the response list to the connection for the given request
+    CFDictionaryAddValue(c->_responses, request, list);
+    
+    // If the request was the head of the request queue and the stream can send, pump it.
+    if ((j == 0) && CFWriteStreamCanAcceptBytes(c->_outStream))
+        _HttpConnectionHandleCanAcceptBytes(c);
+    
+    return TRUE;
+}
+
+
+/* static */ void
+_HttpServerForwardResponse(HttpServer* server, CFHTTPMessageRef request, CFArrayRef list) {
+    
+    CFIndex i;
+    Boolean found = FALSE;
+    
+    for (i = 0; (i < server->_workerCount) && !found; i++) {
+        
+        HttpWorker* worker = &server->_workers[i];
+        
+        _CFMutexLock(&worker->_lock);
+        
+        // The worker's connections only change under its lock, so they can be searched from here.
+        found = (_HttpServerFindConnection(worker->_connections, request, NULL) != NULL);
+        
+        // Queue the response for the worker to add on its own thread.
+        if (found && !worker->_stopping) {
+            
+            CFArrayAppendValue(worker->_handedResponses, request);
+            CFArrayAppendValue(worker->_handedResponses, list);
+            
+            CFRunLoopSourceSignal(worker->_source);
+            CFRunLoopWakeUp(worker->_runLoop);
+        }
+        
+        _CFMutexUnlock(&worker->_lock);
+    }
+}
+
+
+/* static */ void
+_HttpConnectionLock(HttpConnection* connection) {
+    
+    // Only connections on workers are searched from other threads.
+    if (connection->_worker)
+        _CFMutexLock(&connection->_worker->_lock);
+}
+
+
+/* static */ void
+_HttpConnectionUnlock(HttpConnection* connection) {
+    
+    if (connection->_worker)
+        _CFMutexUnlock(&connection->_worker->_lock);
 }
 
 
 /* static */ void
 _HttpServerHandleNewConnection(HttpServer* server, CFSocketNativeHandle sock) {
     
+    // Without workers, the connection lives on this run loop.
+    if (server->_workers == NULL)
+        _HttpServerAcceptConnection(server, NULL, sock);
+    
+    else {
+        
+        // Hand the socket to the next worker in turn.
+        HttpWorker* worker = &server->_workers[server->_nextWorker];
+        server->_nextWorker = (server->_nextWorker + 1) % server->_workerCount;
+        
+        _HttpWorkerHandOff(worker, sock);
+    }
+}
+
+
+/* static */ void
+_HttpServerAcceptConnection(HttpServer* server, HttpWorker* worker, CFSocketNativeHandle sock) {
+    
     CFAllocatorRef alloc = CFGetAllocator((_CFHTTPServerRef)server);
     
     // Assume the server will allow the connection.
@@ -1400,6 +2301,7 @@ _HttpServerHandleNewConnection(HttpServer* server, CFSocketNativeHandle sock) {
         
         // Add the connection to the server if it created.
         if (connection != NULL) {
+            connection->_worker = worker;
             _HttpServerAddConnection(server, connection);
             _HttpConnectionRelease(connection);
         }
@@ -1425,6 +2327,265 @@ _HttpServerHandleError(HttpServer* server, const CFStreamError* error) {
 }
 
 
+/* static */ Boolean
+_HttpServerStartWorkers(HttpServer* server) {
+    
+    CFIndex i;
+    CFAllocatorRef alloc = CFGetAllocator((_CFHTTPServerRef)server);
+    
+    CFArrayCallBacks arrayCallBacks = {
+        0,
+        (CFArrayRetainCallBack)_ArrayRetainCallBack,
+        (CFArrayReleaseCallBack)_ArrayReleaseCallBack,
+        (CFArrayCopyDescriptionCallBack)_HttpConnectionCopyDescription,
+        NULL																// Default pointer comparison
+    };
+    
+    CFRunLoopSourceContext sourceCtxt = {
+        0,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        (void (*)(void*))_HttpWorkerPerform
+    };
+    
+    // Allocate all the workers at once.
+    server->_workers = CFAllocatorAllocate(alloc, server->_workerCount * sizeof(server->_workers[0]), 0);
+    
+    if (server->_workers == NULL)
+        return FALSE;
+    
+    memset(server->_workers, 0, server->_workerCount * sizeof(server->_workers[0]));
+    
+    for (i = 0; i < server->_workerCount; i++) {
+        
+        HttpWorker* worker = &server->_workers[i];
+        
+        worker->_server = server;
+        _CFMutexInit(&worker->_lock, FALSE);
+        
+        // The source is signalled whenever there is something for the worker to do.
+        sourceCtxt.info = worker;
+        worker->_source = CFRunLoopSourceCreate(alloc, 0, &sourceCtxt);
+        
+        worker->_connections = CFArrayCreateMutable(alloc, 0, &arrayCallBacks);
+        worker->_pending = CFDataCreateMutable(alloc, 0);
+        worker->_handedResponses = CFArrayCreateMutable(alloc, 0, &kCFTypeArrayCallBacks);
+        
+        // Spawn the thread once everything it needs is in place.
+        if ((worker->_source == NULL) || (worker->_connections == NULL) || (worker->_pending == NULL) ||
+            (worker->_handedResponses == NULL) ||
+            (_CFThreadSpawn(&worker->_thread, (void* (*)(void*))_HttpWorkerMain, worker) != 0))
+        {
+            CFIndex count = server->_workerCount;
+            
+            // Tear down this worker and the ones before it; this one's thread never started, so it isn't joined.
+            server->_workerCount = i + 1;
+            _HttpServerStopWorkers(server);
+            
+            // Leave the setting as it was, for another attempt.
+            server->_workerCount = count;
+            
+            return FALSE;
+        }
+        
+        worker->_threadStarted = TRUE;
+    }
+    
+    return TRUE;
+}
+
+
+/* static */ void
+_HttpServerStopWorkers(HttpServer* server) {
+    
+    CFIndex i;
+    
+    if (server->_workers == NULL)
+        return;
+    
+    // Tell every worker to stop first, so they all wind down together.
+    for (i = 0; i < server->_workerCount; i++) {
+        
+        HttpWorker* worker = &server->_workers[i];
+        
+        _CFMutexLock(&worker->_lock);
+        
+        worker->_stopping = TRUE;
+        
+        // If the thread isn't up yet, it'll see the flag once it is.
+        if (worker->_runLoop != NULL) {
+            CFRunLoopSourceSignal(worker->_source);
+            CFRunLoopWakeUp(worker->_runLoop);
+        }
+        
+        _CFMutexUnlock(&worker->_lock);
+    }
+    
+    for (i = 0; i < server->_workerCount; i++) {
+        
+        HttpWorker* worker = &server->_workers[i];
+        
+        // Wait for the worker to finish with its connections.
+        if (worker->_threadStarted)
+            _CFThreadJoin(worker->_thread);
+        
+        if (worker->_source) {
+            CFRunLoopSourceInvalidate(worker->_source);
+            CFRelease(worker->_source);
+        }
+        
+        if (worker->_connections)
+            CFRelease(worker->_connections);
+        
+        if (worker->_pending)
+            CFRelease(worker->_pending);
+        
+        // Responses handed over too late to go out are dropped, as for a closed connection.
+        if (worker->_handedResponses)
+            CFRelease(worker->_handedResponses);
+        
+        _CFMutexDestroy(&worker->_lock);
+    }
+    
+    CFAllocatorDeallocate(CFGetAllocator((_CFHTTPServerRef)server), server->_workers);
+    server->_workers = NULL;
+    server->_nextWorker = 0;
+}
+
+
+/* static */ void
+_HttpWorkerHandOff(HttpWorker* worker, CFSocketNativeHandle sock) {
+    
+    Boolean stopping;
+    
+    _CFMutexLock(&worker->_lock);
+    
+    stopping = worker->_stopping;
+    
+    if (!stopping) {
+        
+        // Queue the socket for the worker.
+        CFDataAppendBytes(worker->_pending, (const UInt8*)&sock, sizeof(sock));
+        
+        // Kick the worker if it's already running; otherwise it picks the socket up as it starts.
+        if (worker->_runLoop != NULL) {
+            CFRunLoopSourceSignal(worker->_source);
+            CFRunLoopWakeUp(worker->_runLoop);
+        }
+    }
+    
+    _CFMutexUnlock(&worker->_lock);
+    
+    // Nobody is going to pick it up, so drop it.
+    if (stopping)
+        close(sock);
+}
+
+
+/* static */ void*
+_HttpWorkerMain(HttpWorker* worker) {
+    
+    Boolean stopping;
+    CFArrayRef connections;
+    CFRunLoopRef rl = CFRunLoopGetCurrent();
+    
+    CFRunLoopAddSource(rl, worker->_source, kCFRunLoopCommonModes);
+    
+    _CFMutexLock(&worker->_lock);
+    
+    // Publish the run loop so the listener can wake it.
+    worker->_runLoop = rl;
+    
+    // Pick up anything which was handed over before the run loop existed.
+    if (worker->_stopping || (CFDataGetLength(worker->_pending) != 0))
+        CFRunLoopSourceSignal(worker->_source);
+    
+    _CFMutexUnlock(&worker->_lock);
+    
+    // Run until told to stop.  The run loop can return early if it ever runs
+    // dry, so check the flag rather than trusting the return.
+    do {
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 1.0e10, FALSE);
+        
+        _CFMutexLock(&worker->_lock);
+        stopping = worker->_stopping;
+        _CFMutexUnlock(&worker->_lock);
+        
+    } while (!stopping);
+    
+    // Close out the connections on this thread, since they are scheduled on its run loop.
+    // They are let go outside the lock, which other threads take to search the list.
+    _CFMutexLock(&worker->_lock);
+    connections = CFArrayCreateCopy(CFGetAllocator(worker->_connections), worker->_connections);
+    CFArrayRemoveAllValues(worker->_connections);
+    _CFMutexUnlock(&worker->_lock);
+    
+    if (connections)
+        CFRelease(connections);
+    
+    CFRunLoopRemoveSource(rl, worker->_source, kCFRunLoopCommonModes);
+    
+    return NULL;
+}
+
+
+/* static */ void
+_HttpWorkerPerform(HttpWorker* worker) {
+    
+    CFIndex i, count;
+    Boolean stopping;
+    CFMutableDataRef pending;
+    CFMutableArrayRef handed;
+    CFAllocatorRef alloc = CFGetAllocator(worker->_pending);
+    
+    _CFMutexLock(&worker->_lock);
+    
+    // Take the whole queue so the lock isn't held while connections are set up.
+    stopping = worker->_stopping;
+    pending = worker->_pending;
+    worker->_pending = CFDataCreateMutable(alloc, 0);
+    handed = worker->_handedResponses;
+    worker->_handedResponses = CFArrayCreateMutable(alloc, 0, &kCFTypeArrayCallBacks);
+    
+    _CFMutexUnlock(&worker->_lock);
+    
+    count = CFDataGetLength(pending) / sizeof(CFSocketNativeHandle);
+    
+    for (i = 0; i < count; i++) {
+        
+        CFSocketNativeHandle sock = ((const CFSocketNativeHandle*)CFDataGetBytePtr(pending))[i];
+        
+        // Set up the connection on this thread, so all of its callbacks come here.
+        if (!stopping)
+            _HttpServerAcceptConnection(worker->_server, worker, sock);
+        else
+            close(sock);
+    }
+    
+    CFRelease(pending);
+    
+    count = CFArrayGetCount(handed);
+    
+    // Add the responses handed over from other threads; any whose connection has since closed are dropped.
+    for (i = 0; !stopping && (i < count); i += 2) {
+        _HttpServerDeliverResponse(worker->_connections,
+                                   (CFHTTPMessageRef)CFArrayGetValueAtIndex(handed, i),
+                                   (CFArrayRef)CFArrayGetValueAtIndex(handed, i + 1));
+    }
+    
+    CFRelease(handed);
+    
+    if (stopping)
+        CFRunLoopStop(worker->_runLoop);
+}
+
+
 /* static */ void
 _ServerCallBack(_CFServerRef server, CFSocketNativeHandle sock, const CFStreamError* error, HttpServer* httpServer) {
 
@@ -441,6 +441,98 @@ _CFHTTPServerStart(
   UInt32             port)                                    AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
 
 
+/*
+ *  _CFHTTPServerSetWorkerCount()
+ *  
+ *  Discussion:
+ *    Sets the number of worker threads the server spreads its
+ *    connections across.  With a count of zero (the default), every
+ *    connection is handled on the run loop of the thread which created
+ *    the server.  Otherwise _CFHTTPServerStart spawns the workers,
+ *    each with its own run loop, and hands accepted connections to
+ *    them in turn.  All callbacks for a connection, including the
+ *    acceptNewConnectionCallBack, are made on its worker's thread.
+ *    Responses may still be added from any thread; one added off the
+ *    connection's worker is handed to that worker to send.
+ *  
+ *  Mac OS X threading:
+ *    Not thread safe
+ *  
+ *  Parameters:
+ *    
+ *    server:
+ *      The server being configured.  Must be non-NULL. If this
+ *      reference is not a valid _CFHTTPServerRef, the behavior is
+ *      undefined.
+ *    
+ *    count:
+ *      The number of worker threads to use, or zero for none.
+ *  
+ *  Result:
+ *    Returns TRUE if the count was set.  It returns FALSE if the
+ *    server has already been started with workers or if workers are
+ *    not supported on the platform.
+ *  
+ */
+extern Boolean 
+_CFHTTPServerSetWorkerCount(
+  _CFHTTPServerRef   server,
+  CFIndex            count)                                   AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
+
+
+/*
+ *  _CFHTTPServerSetCompression()
+ *  
+ *  Discussion:
+ *    Turns on gzip compression of response bodies.  A body is
+ *    compressed as it is sent when the request's Accept-Encoding
+ *    takes gzip, the request is HTTP/1.1, the response's Content-Type
+ *    is in the list of compressible types, and the response carries
+ *    no Content-Encoding or Transfer-Encoding of its own.  The
+ *    compressed body replaces any Content-Length and is sent with
+ *    chunked framing.  Responses of a compressible type also get a
+ *    "Vary: Accept-Encoding" header whether or not they end up
+ *    compressed.  Compression is off by default.
+ *  
+ *  Mac OS X threading:
+ *    Not thread safe
+ *  
+ *  Parameters:
+ *    
+ *    server:
+ *      The server being configured.  Must be non-NULL. If this
+ *      reference is not a valid _CFHTTPServerRef, the behavior is
+ *      undefined.
+ *    
+ *    level:
+ *      The zlib compression level, 1 (fastest) through 9 (smallest),
+ *      or zero to turn compression off.
+ *    
+ *    minimumSize:
+ *      Responses with a Content-Length below this many bytes are
+ *      sent as-is.  Streamed responses of unknown length are always
+ *      compressed.
+ *    
+ *    contentTypes:
+ *      An array of CFStrings listing the compressible media types.
+ *      An entry ending in "/" matches every subtype.  Pass NULL for
+ *      the default list of text/, application/json,
+ *      application/javascript, application/xml and image/svg+xml.
+ *  
+ *  Result:
+ *    Returns TRUE if the settings were taken.  It returns FALSE if
+ *    the level or size is out of range or if the server has already
+ *    been started.
+ *  
+ */
+extern Boolean 
+_CFHTTPServerSetCompression(
+  _CFHTTPServerRef   server,
+  CFIndex            level,
+  CFIndex            minimumSize,
+  CFArrayRef         contentTypes)                            AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
+
+
 /*
  *  _CFHTTPServerInvalidate()
  *  
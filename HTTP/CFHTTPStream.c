@@ -81,6 +81,12 @@
     that to cause us to send an endEncountered event.  Now, if we receive such an event and we have not yet read the mark,
     we simply do so and continue.  */
 #define HAVE_READ_MARK (20)
+// The client opted out of automatic content decoding
+#define NO_CONTENT_DECODING (21)
+// We advertised Accept-Encoding for the current request, so the response body should be decoded
+#define DECODE_CONTENT (22)
+// The connection pool for our host is full; we're in line for a connection, and connectionWaitSource fires when one may be free
+#define WAITING_FOR_CONNECTION (23)
 
 typedef struct _CFHTTPRequest {
     CFOptionFlags flags;
@@ -101,8 +107,11 @@ typedef struct _CFHTTPRequest {
     
     _CFNetConnectionRef conn;  // The connection we are scheduled on; consult OWNS_CONNECTION flag bit to determine whether we own the connection or the connection owns us
     CFRunLoopSourceRef stateChangeSource; // This source is used when we need to wait on an outside state change - either for bytes to come in on the connection, or for some request upstream of us to progress.
+    CFRunLoopSourceRef connectionWaitSource; // Scheduled wherever we are once we've had to wait for a pooled connection; see findConnectionForKey
     CFMutableDictionaryRef connProps;
 	CFArrayRef peerCertificates;
+    CFNumberRef chunkSize;          // How the request stream should gather a streamed body into chunks; NULL for the default
+    CFNumberRef chunkFlushInterval;
 } _CFHTTPRequest;
 
 struct _CFHTTPTestSOCKSContext {
@@ -112,6 +121,8 @@ struct _CFHTTPTestSOCKSContext {
 
 static _CFNetConnectionCacheKey nextConnectionCacheKeyFromProxyArray(_CFHTTPRequest *http, CFMutableArrayRef proxyArray, CFURLRef targetURL, CFDictionaryRef connProperties);
 static void advanceToNextProxyFromProxyArray(CFMutableArrayRef proxyArray);
+static _CFNetConnectionRef getConnectionForRequest(_CFHTTPRequest *req, Boolean *created, CFStreamError *error);
+static void connectionWaitAvailable(void *info);
 
 // number of properties that can occur in a socks proxy dict
 #define NUM_SOCKS_PROPS  7
@@ -141,6 +152,12 @@ static void advanceToNextProxyFromProxyArray(CFMutableArrayRef proxyArray);
 #define _kCFStreamSocketCreatedCallBack			CFSTR("_kCFStreamSocketCreatedCallBack")
 #define _kCFHTTPStreamPrivateRunLoopMode		CFSTR("_kCFHTTPStreamPrivateRunLoopMode")
 #define _kCFNTLMMethod							CFSTR("NTLM")
+#define _kCFHTTPStreamAcceptEncodingHeader		CFSTR("Accept-Encoding")
+#if defined(HAVE_BROTLI)
+#define _kCFHTTPStreamAcceptEncodings			CFSTR("gzip, deflate, br")
+#else
+#define _kCFHTTPStreamAcceptEncodings			CFSTR("gzip, deflate")
+#endif
 #else
 static CONST_STRING_DECL(_kCFHTTPStreamFTPScheme, "ftp")
 static CONST_STRING_DECL(_kCFHTTPStreamFTPSScheme, "ftps")
@@ -166,6 +183,12 @@ static CONST_STRING_DECL(_kCFHTTPStreamHEADMethod, "HEAD")
 static CONST_STRING_DECL(_kCFStreamSocketCreatedCallBack, "_kCFStreamSocketCreatedCallBack")
 static CONST_STRING_DECL(_kCFHTTPStreamPrivateRunLoopMode, "_kCFHTTPStreamPrivateRunLoopMode")
 static CONST_STRING_DECL(_kCFNTLMMethod, "NTLM")
+static CONST_STRING_DECL(_kCFHTTPStreamAcceptEncodingHeader, "Accept-Encoding")
+#if defined(HAVE_BROTLI)
+static CONST_STRING_DECL(_kCFHTTPStreamAcceptEncodings, "gzip, deflate, br")
+#else
+static CONST_STRING_DECL(_kCFHTTPStreamAcceptEncodings, "gzip, deflate")
+#endif
 #endif	/* __CONSTANT_CFSTRINGS__ */
 
 // Connection cache management; the cache is created and accessed in getConnectionForRequest
@@ -531,6 +554,8 @@ static void *httpRequestCreate(CFReadStreamRef stream, void *info) {
         newReq->requestPayload = NULL;
     }
 	newReq->peerCertificates = NULL;
+    newReq->chunkSize = NULL;
+    newReq->chunkFlushInterval = NULL;
     newReq->requestFragment = NULL;
     newReq->requestBytesWritten = 0;
     newReq->responseStream = stream; // Do not retain.
@@ -541,6 +566,7 @@ static void *httpRequestCreate(CFReadStreamRef stream, void *info) {
     newReq->firstRedirection = NULL;
     newReq->conn = NULL;
     newReq->stateChangeSource = NULL;
+    newReq->connectionWaitSource = NULL;
 #if defined(LOG_REQUESTS)
     fprintf(stderr, "Created request 0x%x\n", (int)newReq);
 #endif
@@ -570,7 +596,10 @@ _CFHTTPRequest *createZombieDouble1(CFAllocatorRef alloc, _CFHTTPRequest *orig,
     zombie->responseHeaders = NULL;
     zombie->requestBytesWritten = orig->requestBytesWritten;
     zombie->stateChangeSource = NULL;
+    zombie->connectionWaitSource = NULL;
 	zombie->peerCertificates = NULL;
+    zombie->chunkSize = NULL;
+    zombie->chunkFlushInterval = NULL;
     // Sadly, the zombie needs the original request in case there was auth on it; we may need to advance the state of the auth token when our response comes in.
     zombie->originalRequest = orig->originalRequest;
     CFRetain(zombie->originalRequest);
@@ -693,6 +722,8 @@ static void dequeueFromConnection1(_CFHTTPRequest *req) {
                 _CFNetConnectionSetAllowsNewRequests(conn, FALSE);
                 removeFromConnectionCache(httpConnectionCache, conn, (_CFNetConnectionCacheKey)_CFNetConnectionGetInfoPointer(conn));
             }
+            // The connection has room for another request now; let the next in line for the host try for it.
+            wakeConnectionCacheWaiter(httpConnectionCache, (_CFNetConnectionCacheKey)_CFNetConnectionGetInfoPointer(conn));
             CFRelease(conn);
         }
     }
@@ -718,7 +749,14 @@ static void httpRequestDestroy(CFAllocatorRef alloc, _CFHTTPRequest *req) {
     if (req->firstRedirection) CFRelease(req->firstRedirection);
     if (req->connProps) CFRelease(req->connProps);
     if (req->stateChangeSource) CFRelease(req->stateChangeSource);
+    if (req->connectionWaitSource) {
+        if (__CFBitIsSet(req->flags, WAITING_FOR_CONNECTION)) cancelConnectionCacheWait(httpConnectionCache, req->connectionWaitSource);
+        CFRunLoopSourceInvalidate(req->connectionWaitSource);
+        CFRelease(req->connectionWaitSource);
+    }
 	if (req->peerCertificates) CFRelease(req->peerCertificates);
+    if (req->chunkSize) CFRelease(req->chunkSize);
+    if (req->chunkFlushInterval) CFRelease(req->chunkFlushInterval);
     
     CFAllocatorDeallocate(alloc, req); 
 }
@@ -862,6 +900,18 @@ static void prepareTransmission1(_CFHTTPRequest *req, CFWriteStreamRef requestSt
         cleanUpRequest(req->currentRequest, -1, reqIsPersistent, forProxy);
     }
     
+    // Advertise the codings the response filter can undo, unless the client is managing Accept-Encoding itself
+    __CFBitClear(req->flags, DECODE_CONTENT);
+    if (!__CFBitIsSet(req->flags, NO_CONTENT_DECODING) && req->originalRequest) {
+        CFStringRef acceptEncoding = _CFHTTPMessageCopyHeaderFieldValueByID(req->originalRequest, _kCFHTTPHeaderAcceptEncoding);
+        if (acceptEncoding) {
+            CFRelease(acceptEncoding);
+        } else {
+            CFHTTPMessageSetHeaderFieldValue(req->currentRequest, _kCFHTTPStreamAcceptEncodingHeader, _kCFHTTPStreamAcceptEncodings);
+            __CFBitSet(req->flags, DECODE_CONTENT);
+        }
+    }
+    
     // Set client on both streams and schedule.  Open payload (requestStream is already open)
     if (req->requestPayload) {
         CFArrayRef rlArray;
@@ -880,6 +930,14 @@ static void prepareTransmission1(_CFHTTPRequest *req, CFWriteStreamRef requestSt
         }
         CFReadStreamOpen(req->requestPayload);
     }
+    if (req->requestPayload && !__CFBitIsSet(req->flags, PAYLOAD_IS_DATA)) {
+        // Only a streamed body goes out chunked.  The request stream may have gathered a prior request's chunks differently, so always tell it.
+        CFIndex zero = 0;
+        CFNumberRef none = CFNumberCreate(CFGetAllocator(requestStream), kCFNumberCFIndexType, &zero);
+        CFWriteStreamSetProperty(requestStream, _kCFStreamPropertyHTTPChunkSize, req->chunkSize ? req->chunkSize : none);
+        CFWriteStreamSetProperty(requestStream, _kCFStreamPropertyHTTPChunkFlushInterval, req->chunkFlushInterval ? req->chunkFlushInterval : none);
+        CFRelease(none);
+    }
     CFWriteStreamSetProperty(requestStream, _kCFStreamPropertyHTTPNewHeader, req->currentRequest);
     if (!__CFBitIsSet(req->flags, OPEN_SIGNALLED)) {
         CFReadStreamSignalEvent(req->responseStream, kCFStreamEventOpenCompleted, NULL);
@@ -904,6 +962,9 @@ static void prepareReception1(_CFHTTPRequest *req, CFReadStreamRef responseStrea
         CFReadStreamSetProperty(responseStream, _kCFStreamPropertyHTTPZeroLengthResponseExpected, kCFBooleanTrue);
     }
     if (cmd) CFRelease(cmd);
+    if (__CFBitIsSet(req->flags, DECODE_CONTENT)) {
+        CFReadStreamSetProperty(responseStream, _kCFStreamPropertyHTTPDecodeContent, kCFBooleanTrue);
+    }
     if (CFReadStreamHasBytesAvailable(responseStream)) {
         _CFReadStreamSignalEventDelayed(responseStream, kCFStreamEventHasBytesAvailable, NULL);
     } else if (_CFHTTPReadStreamIsAtMark(responseStream)) {
@@ -1297,6 +1358,103 @@ static CFHTTPAuthenticationRef connectionOrientedAuth(_CFHTTPRequest *http, Bool
     return connAuth;
 }
 
+/* Persistent requests share a pool of connections to the key's host, waiting in line for one if the pool is
+full; NULL is returned in that case, and connectionWaitAvailable tries again when a connection may be free.
+Connection-oriented authentication must stay on the connection it authenticated, so those requests keep to
+the key's first connection. */
+static _CFNetConnectionRef findConnectionForKey(_CFHTTPRequest *req, _CFNetConnectionCacheKey key, Boolean hasConnectionAuth) {
+    CFAllocatorRef alloc = CFGetAllocator(req->responseStream);
+    _CFNetConnectionRef conn;
+    CFArrayRef rlArray;
+    
+    __CFSpinLock(&cacheInitLock);
+    if (httpConnectionCache == NULL) {
+        httpConnectionCache = createConnectionCache();
+    }
+    __CFSpinUnlock(&cacheInitLock);
+    
+    if (!isPersistent(req) || hasConnectionAuth) {
+        return findOrCreateNetConnection(httpConnectionCache, alloc, &httpConnectionCallBacks, key, key, isPersistent(req), req->connProps);
+    }
+    
+    rlArray = _CFReadStreamCopyRunLoopsAndModes(req->responseStream);
+    if (!req->connectionWaitSource) {
+        CFRunLoopSourceContext rlsCtxt = {0, req, NULL, NULL, NULL, NULL, NULL, NULL, NULL, connectionWaitAvailable};
+        req->connectionWaitSource = CFRunLoopSourceCreate(alloc, 0, &rlsCtxt);
+        if (req->connectionWaitSource && rlArray) {
+            CFIndex i, c = CFArrayGetCount(rlArray);
+            for (i = 0; i + 1 < c; i += 2) {
+                CFRunLoopAddSource((CFRunLoopRef)CFArrayGetValueAtIndex(rlArray, i), req->connectionWaitSource, CFArrayGetValueAtIndex(rlArray, i + 1));
+            }
+        }
+    }
+    if (!req->connectionWaitSource) {
+        // No way to be told when to try again; just share a connection.
+        conn = findOrCreateNetConnection(httpConnectionCache, alloc, &httpConnectionCallBacks, key, key, TRUE, req->connProps);
+    } else {
+        conn = findOrWaitForNetConnection(httpConnectionCache, alloc, &httpConnectionCallBacks, key, key, req->connProps, req->connectionWaitSource, rlArray);
+    }
+    if (rlArray) CFRelease(rlArray);
+    
+    if (conn) {
+        __CFBitClear(req->flags, WAITING_FOR_CONNECTION);
+    } else {
+        __CFBitSet(req->flags, WAITING_FOR_CONNECTION);
+    }
+    return conn;
+}
+
+// Number of times enqueueRequest will go back for a connection before giving up
+#define MAX_ENQUEUE_ATTEMPTS (3)
+
+/* Puts req in req->conn's queue.  The connection may have stopped taking requests since it was handed
+out; when it refuses, go back for another rather than leave the request parked on a connection that will
+never run it.  Returns FALSE with error set if no connection would take the request; TRUE otherwise,
+including when req is now waiting for a connection to come free. */
+static Boolean enqueueRequest(_CFHTTPRequest *req, CFStreamError *error) {
+    Boolean dummy;
+    int attempts = 0;
+    
+    error->domain = 0;
+    error->error = 0;
+    while (req->conn) {
+        if (_CFNetConnectionEnqueue(req->conn, req)) {
+            if (!isPersistent(req)) {
+                _CFNetConnectionSetAllowsNewRequests(req->conn, FALSE);
+            }
+            return TRUE;
+        }
+        CFRelease(req->conn);
+        req->conn = NULL;
+        if (++ attempts == MAX_ENQUEUE_ATTEMPTS) {
+            error->domain = kCFStreamErrorDomainHTTP;
+            error->error = kCFStreamErrorHTTPConnectionLost;
+            return FALSE;
+        }
+        req->conn = getConnectionForRequest(req, &dummy, error);
+        if (error->domain != 0) return FALSE;
+    }
+    return TRUE;
+}
+
+// Fires when a connection in the pool may have come free for a waiting request
+static void connectionWaitAvailable(void *info) {
+    _CFHTTPRequest *req = (_CFHTTPRequest *)info;
+    CFStreamError err;
+    Boolean dummy;
+    
+    if (!__CFBitIsSet(req->flags, WAITING_FOR_CONNECTION) || req->conn) return;
+    
+    __CFBitClear(req->flags, WAITING_FOR_CONNECTION);
+    req->conn = getConnectionForRequest(req, &dummy, &err);
+    if (err.domain == 0 && req->conn) {
+        enqueueRequest(req, &err);
+    }
+    if (err.domain != 0) {
+        CFReadStreamSignalEvent(req->responseStream, kCFStreamEventErrorOccurred, &err);
+    }
+}
+
 static void setConnectionFromProxyStream(_CFHTTPRequest *http, CFStreamError *err) {
     Boolean isComplete;
     err->domain = 0;
@@ -1327,14 +1485,14 @@ static void setConnectionFromProxyStream(_CFHTTPRequest *http, CFStreamError *er
         CFURLRef targetURL = CFHTTPMessageCopyRequestURL(request);
         _CFNetConnectionCacheKey key = nextConnectionCacheKeyFromProxyArray(http, http->proxyList, targetURL, http->connProps);
         CFRelease(targetURL);
-		__CFSpinLock(&cacheInitLock);
-        if (httpConnectionCache == NULL) {
-            httpConnectionCache = createConnectionCache();
-        }
-		__CFSpinUnlock(&cacheInitLock);
-        http->conn = findOrCreateNetConnection(httpConnectionCache, CFGetAllocator(http->responseStream), &httpConnectionCallBacks, key, key, isPersistent(http), http->connProps);
+        http->conn = findConnectionForKey(http, key, (auth || proxyAuth));
         releaseConnectionCacheKey(key);
 		
+		if (!http->conn) {
+			// Waiting in line for a pooled connection
+			return;
+		}
+		
 		if ((auth || proxyAuth) && http->conn) {
 			
 			err->error = 0;
@@ -1354,10 +1512,7 @@ static void setConnectionFromProxyStream(_CFHTTPRequest *http, CFStreamError *er
 			}
 		}
 		
-        _CFNetConnectionEnqueue(http->conn, http);
-        if (!isPersistent(http)) {
-            _CFNetConnectionSetAllowsNewRequests(http->conn, FALSE);
-        }
+        enqueueRequest(http, err);
     }
 }
 
@@ -1449,12 +1604,7 @@ static _CFNetConnectionRef getConnectionForRequest(_CFHTTPRequest *req, Boolean
         } else {
             // Just advance to the next proxy
             _CFNetConnectionCacheKey key = nextConnectionCacheKeyFromProxyArray(req, req->proxyList, targetURL, req->connProps);
-            __CFSpinLock(&cacheInitLock);
-            if (httpConnectionCache == NULL) {
-                httpConnectionCache = createConnectionCache();
-            }
-            __CFSpinUnlock(&cacheInitLock);
-            conn = findOrCreateNetConnection(httpConnectionCache, CFGetAllocator(req->responseStream), &httpConnectionCallBacks, key, key, isPersistent(req), req->connProps);
+            conn = findConnectionForKey(req, key, (auth || proxyAuth));
             releaseConnectionCacheKey(key);
         }
     }
@@ -1638,11 +1788,7 @@ static Boolean resetForRequest(CFHTTPMessageRef newRequest, _CFHTTPRequest *http
         // Asynchronous discovery of the correct connection; getConnectionForRequest took care of setting everything up 
         return TRUE;
     } else {
-        _CFNetConnectionEnqueue(http->conn, http);
-        if (!isPersistent(http)) {
-            _CFNetConnectionSetAllowsNewRequests(http->conn, FALSE);
-        }
-        return TRUE;
+        return enqueueRequest(http, error);
     }
 }
 
@@ -1841,6 +1987,13 @@ static Boolean checkHeaders(_CFHTTPRequest *http, CFReadStreamRef stream, CFStre
 			_CFNetConnectionLost(http->conn);
 #if !defined(NO_PIPELINING)
 		} else {
+			// Let the connection pace pipelining to this server by its record, and hold back
+			// requests from going out behind a long body.
+			CFStringRef lenStr = http->responseHeaders ? CFHTTPMessageCopyHeaderFieldValue(http->responseHeaders, _kCFHTTPStreamContentLengthHeader) : NULL;
+			long long len = (nextAction == DONE) ? 0 : (lenStr ? CFStringGetIntValue(lenStr) : -1);
+			if (lenStr) CFRelease(lenStr);
+			_CFNetConnectionSetPipelineServer(http->conn, (_CFNetConnectionCacheKey)_CFNetConnectionGetInfoPointer(http->conn));
+			_CFNetConnectionSetResponseLength(http->conn, http, len);
 			_CFNetConnectionSetShouldPipeline(http->conn, TRUE);
 #endif
 		}
@@ -1986,6 +2139,17 @@ static CFIndex httpRequestRead(CFReadStreamRef stream, UInt8 *buffer, CFIndex bu
             }
         }
     }
+    if (__CFBitIsSet(req->flags, WAITING_FOR_CONNECTION)) {
+        // Must wait our turn for a pooled connection.  Ask again once scheduled here, so it's this run loop that gets woken.
+        CFRunLoopRef currentRL = CFRunLoopGetCurrent();
+        CFStringRef mode = _kCFHTTPStreamPrivateRunLoopMode;
+        CFReadStreamScheduleWithRunLoop(stream, currentRL, mode);
+        connectionWaitAvailable(req);
+        while (__CFBitIsSet(req->flags, WAITING_FOR_CONNECTION)) {
+            CFRunLoopRunInMode(mode, 1e+20, TRUE);
+        }
+        CFReadStreamUnscheduleFromRunLoop(stream, currentRL, mode);
+    }
     oldConn = req->conn; // We grab the old connection so we can detect it if the connection changes through GetState below.
     __CFBitSet(req->flags, IN_READ_CALLBACK);
     state = oldConn ? _CFNetConnectionGetState(oldConn, TRUE, req) : -1;
@@ -2129,6 +2293,10 @@ static void httpRequestClose(CFReadStreamRef stream, void *info) {
         CFRelease(req->proxyStream);
         req->proxyStream = NULL;
     }
+    if (__CFBitIsSet(req->flags, WAITING_FOR_CONNECTION)) {
+        cancelConnectionCacheWait(httpConnectionCache, req->connectionWaitSource);
+        __CFBitClear(req->flags, WAITING_FOR_CONNECTION);
+    }
 }
 
 static CFTypeRef httpRequestCopyProperty(CFReadStreamRef stream, CFStringRef propertyName, void *info) {
@@ -2200,6 +2368,11 @@ static Boolean httpRequestSetProperty(CFReadStreamRef stream, CFStringRef proper
 #if defined(LOG_REQUESTS)
     fprintf(stderr, "httpRequestSetProperty(req = 0x%x)\n", (int)http);
 #endif 
+    if (CFEqual(propertyName, _kCFStreamPropertyHTTPChunkFlush)) {
+        // The one property that only makes sense once open; it pushes out what the request stream has gathered of our body
+        if (propertyValue != kCFBooleanTrue || !http->conn || _CFHTTPRequestGetState(http) != kTransmittingRequest) return FALSE;
+        return CFWriteStreamSetProperty(_CFNetConnectionGetRequestStream(http->conn), propertyName, propertyValue);
+    }
     if (CFReadStreamGetStatus(stream) > kCFStreamStatusNotOpen) return FALSE;
     if (CFEqual(propertyName, kCFStreamPropertyHTTPShouldAutoredirect)) {
         if (propertyValue == kCFBooleanTrue) {
@@ -2282,6 +2455,23 @@ static Boolean httpRequestSetProperty(CFReadStreamRef stream, CFStringRef proper
             }
         }        
         return TRUE;
+    } else if (CFEqual(propertyName, _kCFStreamPropertyHTTPDecodeContent)) {
+        if (propertyValue == kCFBooleanTrue) {
+            __CFBitClear(http->flags, NO_CONTENT_DECODING);
+            return TRUE;
+        } else if (propertyValue == kCFBooleanFalse) {
+            __CFBitSet(http->flags, NO_CONTENT_DECODING);
+            return TRUE;
+        } else {
+            return FALSE;
+        }
+    } else if (CFEqual(propertyName, _kCFStreamPropertyHTTPChunkSize) || CFEqual(propertyName, _kCFStreamPropertyHTTPChunkFlushInterval)) {
+        CFNumberRef *value = CFEqual(propertyName, _kCFStreamPropertyHTTPChunkSize) ? &http->chunkSize : &http->chunkFlushInterval;
+        if (propertyValue && CFGetTypeID(propertyValue) != CFNumberGetTypeID()) return FALSE;
+        if (propertyValue) CFRetain(propertyValue);
+        if (*value) CFRelease(*value);
+        *value = (CFNumberRef)propertyValue;
+        return TRUE;
     } else if (CFEqual(propertyName, kCFStreamPropertyHTTPAttemptPersistentConnection)) {
         if (propertyValue == kCFBooleanTrue) {
             if (!isPersistent(http)) __CFBitSet(http->flags, IS_PERSISTENT);
@@ -2329,6 +2519,9 @@ static void httpRequestSchedule(CFReadStreamRef stream, CFRunLoopRef runLoop, CF
         if (req->proxyStream) {
             CFReadStreamScheduleWithRunLoop(req->proxyStream, runLoop, runLoopMode);
         }
+        if (req->connectionWaitSource) {
+            CFRunLoopAddSource(runLoop, req->connectionWaitSource, runLoopMode);
+        }
     }
 }
 
@@ -2344,6 +2537,9 @@ static void httpRequestUnschedule(CFReadStreamRef stream, CFRunLoopRef runLoop,
         if (req->proxyStream) {
             CFReadStreamUnscheduleFromRunLoop(req->proxyStream, runLoop, runLoopMode);
         }
+        if (req->connectionWaitSource) {
+            CFRunLoopRemoveSource(runLoop, req->connectionWaitSource, runLoopMode);
+        }
     }
 }
 
@@ -2415,9 +2611,9 @@ extern Boolean canKeepAlive(CFHTTPMessageRef responseHeaders, CFHTTPMessageRef r
         // 0.9 server
         return FALSE;
     } 
-    connectionHeader = CFHTTPMessageCopyHeaderFieldValue(responseHeaders, _kCFHTTPStreamProxyConnectionHeader);
+    connectionHeader = _CFHTTPMessageCopyHeaderFieldValueByID(responseHeaders, _kCFHTTPHeaderProxyConnection);
 	if (!connectionHeader) {
-		connectionHeader = CFHTTPMessageCopyHeaderFieldValue(responseHeaders, _kCFHTTPStreamConnectionHeader);
+		connectionHeader = _CFHTTPMessageCopyHeaderFieldValueByID(responseHeaders, _kCFHTTPHeaderConnection);
     }
     if (connectionHeader) {
         // According to the HTTP/1.1 spec, this can actually be a comma-delimited list of values, specifying keep-alive or close, then a list of headers that should be removed when propagating the message across a proxy.  But I don't think anyone actually sets it to anything other than "keep-alive" or "close", so we check for those before doing the exhaustive case.
@@ -2648,6 +2844,19 @@ void CFHTTPReadStreamSetProxy(CFReadStreamRef stream, CFStringRef proxyHost, CFI
     }
 }
 
+Boolean _CFHTTPStreamSetMaxConnectionsPerHost(CFIndex maxConnections) {
+    if (maxConnections < 1) return FALSE;
+    __CFSpinLock(&cacheInitLock);
+    if (httpConnectionCache == NULL) {
+        httpConnectionCache = createConnectionCache();
+    }
+    if (httpConnectionCache) {
+        setConnectionCacheMaxConnectionsPerHost(httpConnectionCache, maxConnections);
+    }
+    __CFSpinUnlock(&cacheInitLock);
+    return (httpConnectionCache != NULL);
+}
+
 #if defined(__WIN32__)
 extern void _CFHTTPStreamCleanup(void) {
     __CFSpinLock(&cacheInitLock);
@@ -114,6 +114,91 @@ extern const CFStringRef _kCFStreamPropertyHTTPZeroLengthResponseExpected AVAILA
 extern const CFStringRef _kCFStreamPropertyHTTPProxyProxyAutoConfigURLString AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
 extern const CFStringRef _kCFStreamPropertyHTTPProxyProxyAutoConfigEnable AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
 
+/*
+ *  _kCFStreamPropertyHTTPDecodeContent
+ *  
+ *  Discussion:
+ *    Property key to specify whether an HTTP read stream should
+ *    advertise the content codings it understands (gzip and deflate,
+ *    plus br where available) and hand back decoded response bodies.
+ *    The value is a CFBoolean; the default is kCFBooleanTrue.  Set it
+ *    to kCFBooleanFalse before opening the stream to receive the raw
+ *    entity instead.  Decoding is also skipped if the request already
+ *    carries its own Accept-Encoding header.  When a body is decoded,
+ *    the Content-Encoding and Content-Length headers are removed from
+ *    the response returned by kCFStreamPropertyHTTPResponseHeader.
+ *  
+ */
+extern const CFStringRef _kCFStreamPropertyHTTPDecodeContent         AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
+
+/*
+ *  _kCFStreamPropertyHTTPChunkSize
+ *  
+ *  Discussion:
+ *    Property key to gather the writes of a chunked request body into
+ *    chunks of up to the given size, rather than sending each write
+ *    as its own chunk.  The value is a CFNumber of bytes; 0, the
+ *    default, turns gathering off.  A write which would fill the
+ *    chunk is sent along with the bytes gathered before it, in a
+ *    single chunk.  Chunks are also sent when the flush interval runs
+ *    out, when _kCFStreamPropertyHTTPChunkFlush is set, and at the end
+ *    of the body.  Set it on an HTTP read stream before opening it.
+ *  
+ */
+extern const CFStringRef _kCFStreamPropertyHTTPChunkSize             AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _kCFStreamPropertyHTTPChunkFlushInterval
+ *  
+ *  Discussion:
+ *    Property key for the longest a gathered request body byte waits
+ *    before its chunk is sent, whether or not it is full.  The value
+ *    is a CFNumber of seconds; 0, the default, waits for the chunk to
+ *    fill.  The deadline is kept by a timer on the run loops the
+ *    stream is scheduled on, and checked on every write.  Set it on an
+ *    HTTP read stream before opening it.
+ *  
+ */
+extern const CFStringRef _kCFStreamPropertyHTTPChunkFlushInterval    AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _kCFStreamPropertyHTTPChunkFlush
+ *  
+ *  Discussion:
+ *    Property key to send the request body bytes gathered so far as a
+ *    chunk right away.  Set it to kCFBooleanTrue on an open HTTP read
+ *    stream while its request body is being sent; setting it at any
+ *    other time fails.  Bytes the stream has yet to read from the
+ *    body stream are not affected.
+ *  
+ */
+extern const CFStringRef _kCFStreamPropertyHTTPChunkFlush            AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFHTTPStreamSetMaxConnectionsPerHost()
+ *  
+ *  Discussion:
+ *    Sets how many persistent connections HTTP read streams open to
+ *    any one host (and port, through the same proxy).  A newly
+ *    opened stream goes out on an idle connection to its host if
+ *    there is one, otherwise on a new connection while there are
+ *    fewer than this many, otherwise pipelined on the least busy
+ *    connection that can take it right away.  Failing all of those,
+ *    it waits for a connection in line behind the host's other
+ *    waiting streams.  Streams using connection-based authentication
+ *    such as NTLM always share the host's first connection.  The
+ *    default is 6.
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ *  Result:
+ *    Returns TRUE if set, or FALSE if maxConnections is less than 1.
+ *  
+ */
+extern Boolean
+_CFHTTPStreamSetMaxConnectionsPerHost(CFIndex maxConnections)   AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
 #if PRAGMA_ENUM_ALWAYSINT
     #pragma enumsalwaysint reset
 #endif
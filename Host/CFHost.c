@@ -78,6 +78,17 @@
         master lookup is scheduled on all loops and modes as the list of clients.  When the
         master lookup completes, all clients in the list are informed.  If all clients cancel,
         the master lookup will be canceled and removed from the master lookups list.
+
+        Completed master lookups are cached by hostname.  Cache entries hold the addresses
+        along with their fetch time and TTL, or the error for names which don't exist.  They
+        are kept on a list in least recently used order, so hits and evictions don't need to
+        scan the cache.  Once an entry's TTL runs out, its addresses are still handed out for
+        a while but a master lookup with no clients is started to refresh the entry.
+
+        On Linux, hostname lookups are run loop sources signalled from a small pool of
+        threads calling getaddrinfo, or, if turned on, from a built-in resolver which asks
+        the name servers directly over a socket shared by all lookups.  Record lookups always
+        use the built-in resolver.
 */
 
 #pragma mark - Includes
@@ -98,12 +109,18 @@
 
 #else
 
+  #include <CoreFoundation/CFFileDescriptor.h>
   #include <arpa/inet.h>
+  #include <ctype.h>
+  #include <net/if.h>
   #include <netdb.h>
   #include <poll.h>
+  #include <pthread.h>
   #include <signal.h>
-  #include <sys/signalfd.h>
+  #include <sys/random.h>
+  #include <sys/stat.h>
   #include <sys/syscall.h>
+  #include <time.h>
   #include <unistd.h>
 
 #endif /* __MACH__ */
@@ -116,13 +133,14 @@
 
 #define _kCFNullHostInfoType ((CFHostInfoType)0xFFFFFFFF)
 
-#define _kCFHostIPv4Addresses ((CFHostInfoType)0x0000FFFE)
-#define _kCFHostIPv6Addresses ((CFHostInfoType)0x0000FFFD)
 #define _kCFHostMasterAddressLookup ((CFHostInfoType)0x0000FFFC)
 #define _kCFHostByPassMasterAddressLookup ((CFHostInfoType)0x0000FFFB)
+#define _kCFHostTimeToLive ((CFHostInfoType)0x0000FFFA) /* CFNumber of seconds, set by lookups which know the record TTL */
 
-#define _kCFHostCacheMaxEntries 25
-#define _kCFHostCacheTimeout ((CFTimeInterval)1.0)
+#define _kCFHostCacheDefaultMaxEntries 512
+#define _kCFHostCacheDefaultTTL ((CFTimeInterval)60.0)
+#define _kCFHostCacheDefaultNegativeTTL ((CFTimeInterval)10.0)
+#define _kCFHostCacheDefaultStaleTTL ((CFTimeInterval)30.0)
 
 #pragma mark - Constant Strings
 
@@ -134,7 +152,32 @@ static CONST_STRING_DECL(_kCFHostBlockingMode, "_kCFHostBlockingMode") static CO
 #endif /* __CONSTANT_CFSTRINGS__ */
 
 #if defined(__linux__)
-  #define __kCFHostLinuxSignalFdSignal ((int)SIGRTMIN + 11)
+  #define _kCFHostResolverMaxWorkers 16   /* Most getaddrinfo calls made at once */
+  #define _kCFHostResolverIdleTimeout 30  /* Seconds an idle worker waits before exiting */
+
+  #define _kCFHostDNSResolvConf "/etc/resolv.conf"
+  #define _kCFHostDNSPort 53
+  #define _kCFHostDNSMaxServers 3        /* Name servers used, as MAXNS */
+  #define _kCFHostDNSDefaultTimeout 5    /* Seconds to wait for a reply before retrying */
+  #define _kCFHostDNSDefaultAttempts 2   /* Rounds through the name servers */
+  #define _kCFHostDNSMaxTimeout 30       /* Longest timeout resolv.conf can set, as RES_MAXRETRANS */
+  #define _kCFHostDNSMaxAttempts 5       /* Most attempts resolv.conf can set, as RES_MAXRETRY */
+  #define _kCFHostDNSHeaderSize 12
+  #define _kCFHostDNSMaxUDPSize 512
+  #define _kCFHostDNSMaxNameSize 255
+  #define _kCFHostDNSMaxLabelSize 63
+  #define _kCFHostDNSMaxPointers 64      /* Compression pointers followed before a name is malformed */
+  #define _kCFHostDNSMaxIDAttempts 64    /* Random transaction IDs tried before giving up on a free one */
+  #define _kCFHostDNSReceiveBufferSize (1024 * 1024)
+  #define _kCFHostDNSClassIN 1
+  #define _kCFHostDNSTypeA 1
+  #define _kCFHostDNSTypeCNAME 5
+  #define _kCFHostDNSTypeAAAA 28
+  #define _kCFHostDNSRcodeNoError 0
+  #define _kCFHostDNSRcodeServFail 2
+  #define _kCFHostDNSRcodeNXDomain 3
+  #define _kCFHostDNSRcodeNotImp 4
+  #define _kCFHostDNSRcodeRefused 5
 #endif
 
 #pragma mark - CFHost struct
@@ -155,31 +198,128 @@ typedef struct {
   CFMutableArrayRef    _schedules;  // List of loops and modes
   CFHostClientCallBack _callback;
   CFHostClientContext  _client;
+
+  CFStreamError _cachedError;  // Error from a negative cache hit, reported when its lookup fires
 } _CFHost;
 
 #if defined(__linux__)
 /**
  *  @brief
- *    The active heap-based object used to manage forward DNS look-ups
- *    with Linux, glibc, and getaddrinfo_a.
+ *    A forward DNS look-up being made by the resolver worker pool.
  *
- *    This represents all of the active state needed to manage
- *    outstanding forward DNS look-ups using Linux, glibc, and
- *    getaddrinfo_a.
+ *    Look-ups for the same name and address family while one is
+ *    queued or in flight share its request, each as a waiter on it.
+ *    The request is freed once getaddrinfo has returned and every
+ *    waiter has gone, in whichever order that happens.
  *
- *  @note
- *    Since there is no equivalent getnameinfo_a in Linux with glibc,
- *    this portability approach for CFHost on Linux is, for now, a
- *    dead end and undesirable.
+ */
+typedef struct _CFHostResolverRequest {
+  struct _CFHostResolverRequest* _next;     // Next request on the pending queue
+  struct _CFHostResolverWaiter*  _waiters;  // Look-ups waiting on the result
+  char*                          _key;      // Family and name, for coalescing
+  const char*                    _name;     // Name to resolve, within _key
+  struct addrinfo                _hints;    // Hints for getaddrinfo
+  int                            _status;   // Result of getaddrinfo
+  int                            _errno;    // errno for an EAI_SYSTEM result
+  struct addrinfo*               _result;   // Addresses from getaddrinfo
+  Boolean                        _done;     // getaddrinfo has returned
+} _CFHostResolverRequest;
+
+/**
+ *  @brief
+ *    A look-up waiting on a resolver request.
+ *
+ *    The waiter is the info of the look-up's run loop source, which is
+ *    signalled when the request completes.  The source owns it.
+ *
+ */
+typedef struct _CFHostResolverWaiter {
+  struct _CFHostResolverWaiter* _next;      // Next waiter on the same request
+  _CFHostResolverRequest*       _request;   // The request being waited on
+  CFRunLoopSourceRef            _source;    // The look-up; not retained
+  CFMutableArrayRef             _runLoops;  // Run loops the source is scheduled on
+  void*                         _context;   // The CFHost to call back
+} _CFHostResolverWaiter;
+
+/**
+ *  @brief
+ *    One question of a native DNS query, with its own transaction ID.
+ *
+ *    The query message is kept for retries, after room for the length
+ *    prefix it needs if the question moves to TCP.
  *
  */
 typedef struct {
-  struct gaicb    _request_gaicb;
-  struct addrinfo _request_hints;
-  struct gaicb*   _request_list[1];
-} _CFHostGAIARequest;
+  UInt16              _id;                                  // Transaction ID
+  UInt16              _type;                                // Record type asked for
+  UInt16              _class;                               // Record class asked for
+  Boolean             _done;                                // Answered, or given up on
+  int                 _status;                              // EAI status once done
+  struct addrinfo*    _result;                              // Addresses from the answers
+  CFIndex             _length;                              // Length of the query message
+  UInt8               _packet[2 + _kCFHostDNSMaxUDPSize];   // Length prefix and query message
+  CFFileDescriptorRef _stream;                              // TCP connection after a truncated reply
+  CFRunLoopSourceRef  _streamSource;                        // Run loop source for _stream
+  CFIndex             _offset;                              // Bytes written or read on _stream
+  UInt8               _prefix[2];                           // Length of the reply over TCP
+  UInt8*              _buffer;                              // Reply being read over TCP
+  CFIndex             _replyLength;                         // Length of the reply over TCP
+} _CFHostDNSQuestion;
+
+/**
+ *  @brief
+ *    A lookup made by the native DNS resolver.
+ *
+ *    The query is the info of the lookup's run loop source, which is
+ *    signalled once all of its questions are done.  The source owns
+ *    it.
+ *
+ */
+typedef struct {
+  CFRunLoopSourceRef      _source;        // The lookup; not retained
+  void*                   _context;       // The CFHost to call back
+  CFMutableArrayRef       _schedules;     // Run loops and modes the lookup is scheduled on
+  CFRunLoopTimerRef       _timer;         // Fires to retry the unanswered questions
+  CFAbsoluteTime          _deadline;      // When the timer fires next
+  CFIndex                 _server;        // Name server being asked
+  CFIndex                 _tries;         // Times the questions have been sent
+  Boolean                 _addresses;     // Looking up addresses rather than a record
+  int                     _socktype;      // Socket type for the addrinfo results
+  int                     _protocol;      // Protocol for the addrinfo results
+  CFIndex                 _count;         // Number of questions
+  _CFHostDNSQuestion      _questions[2];  // AAAA and A, or the record asked for
+  Boolean                 _done;          // All questions are done
+  int                     _status;        // EAI status once done
+  struct addrinfo*        _result;        // Addresses once done
+  Boolean                 _hasTTL;        // Whether _ttl was learned
+  UInt32                  _ttl;           // Lowest TTL of the answers
+  UInt8*                  _reply;         // Reply to a record lookup
+  CFIndex                 _replyLength;   // Length of _reply
+  struct sockaddr_storage _from;          // Name server which sent _reply
+} _CFHostDNSQuery;
 #endif /* __linux__ */
 
+/**
+ *  @brief
+ *    An entry in the hostname lookup cache.
+ *
+ *    Entries are kept on a doubly-linked list from most to least
+ *    recently used, so that both hits and evictions are O(1).  A
+ *    negative entry has no addresses and remembers the error the
+ *    lookup failed with instead.
+ *
+ */
+typedef struct _CFHostCacheEntry {
+  struct _CFHostCacheEntry* _prev;
+  struct _CFHostCacheEntry* _next;
+
+  CFStringRef    _name;       // Key for the entry in _HostCache
+  CFArrayRef     _addresses;  // Resolved addresses, or NULL if negative
+  CFStreamError  _error;      // Error for a negative entry
+  CFAbsoluteTime _fetched;    // When the lookup completed
+  CFTimeInterval _ttl;        // How long after _fetched the entry is fresh
+} _CFHostCacheEntry;
+
 /**
  *  The callback type used for deallocating addrinfo.
  *
@@ -199,6 +339,7 @@ static Boolean _HostBlockUntilComplete(_CFHost* host);
 static void    _HostLookupCancel_NoLock(_CFHost* host);
 
 static Boolean _CreateLookup_NoLock(_CFHost* host, CFHostInfoType info, Boolean* _Radar4012176);
+static Boolean _CreateCachedAddressLookup_NoLock(_CFHost* host, CFHostInfoType info, CFStringRef name, Boolean* _Radar4012176);
 
 static CFTypeRef _CreateMasterAddressLookup(CFStringRef name, CFHostInfoType info, CFTypeRef context, CFStreamError* error);
 static CFTypeRef _CreateAddressLookup(CFStringRef name, CFHostInfoType info, void* context, CFStreamError* error);
@@ -207,6 +348,7 @@ static CFTypeRef _CreateDNSLookup(CFTypeRef thing, CFHostInfoType info, void* co
 
 #if defined(__MACH__) || defined(__linux__)
 static void _GetAddrInfoCallBack(int eai_status, const struct addrinfo* res, void* ctxt);
+static void _DNSCallBack(int32_t status, char* buf, uint32_t len, struct sockaddr* from, int fromlen, void* context);
 #endif
 
 static void _GetAddrInfoCallBackWithFree(int eai_status, const struct addrinfo* res, void* ctxt, FreeAddrInfoCallBack freeaddrinfo_cb);
@@ -229,7 +371,14 @@ static void _MasterLookupCallBack(CFHostRef theHost, CFHostInfoType typeInfo, co
 static void _AddressLookupPerform(_CFHost* host);
 static void _AddressLookupSchedule_NoLock(_CFHost* host, CFRunLoopRef rl, CFStringRef mode);
 
-static void _ExpireCacheEntries(void);
+static CFMutableArrayRef _StartMasterLookup_NoLock(CFStringRef name, CFStreamError* error);
+
+static Boolean _HostCacheCopyEntry(CFStringRef name, CFArrayRef* addresses, CFStreamError* error, Boolean* stale);
+static void    _HostCacheAddEntry_NoLock(CFStringRef name, CFArrayRef addresses, const CFStreamError* error, CFTimeInterval ttl);
+static void    _HostCacheRemoveEntry_NoLock(_CFHostCacheEntry* entry);
+static void    _HostCacheTrim_NoLock(CFIndex limit);
+static void    _HostCacheRefresh(CFStringRef name, CFArrayRef schedules);
+static Boolean _HostCacheIsNegativeError(const CFStreamError* error);
 
 static CFArrayRef _CFArrayCreateDeepCopy(CFAllocatorRef alloc, CFArrayRef array);
 static UInt8*     _CFStringToCStringWithError(CFTypeRef thing, CFStreamError* error);
@@ -243,21 +392,55 @@ static void _InitGetAddrInfoHints(CFHostInfoType info, struct addrinfo* hints);
 
 #if defined(__linux__)
 
-  #include <CoreFoundation/CFFileDescriptor.h>
-static CFFileDescriptorRef _CreateMasterAddressLookup_Linux(CFStringRef name, CFHostInfoType info, CFTypeRef context, CFStreamError* error);
-static CFFileDescriptorRef _CreateDNSLookup_Linux(CFTypeRef thing, CFHostInfoType type, void* context, CFStreamError* error);
-
-static int                 _CreateAddressLookupRequest(const char* name, CFHostInfoType info, int signal, CFStreamError* error);
-static CFFileDescriptorRef _CreateAddressLookupSource_Linux(int signal, CFTypeRef context, CFStreamError* error);
-
-static void _MasterAddressLookupCallBack_Linux(CFFileDescriptorRef fdref, CFOptionFlags callBackTypes, void* info);
-
-static int           _CreateSignalFd(int signal, CFStreamError* error);
-static int           _SignalFdClearGetAddrInfoSignalWithHost(_CFHost* host);
-static int           _SignalFdClearSignalWithError(int signal, sigset_t* set, CFStreamError* error);
-static int           _SignalFdModifySignalWithError(int how, int signal, sigset_t* set, CFStreamError* error);
-static int           _SignalFdSetSignalWithError(int signal, sigset_t* set, CFStreamError* error);
-static struct gaicb* _SignalFdGetAddrInfoResult(CFFileDescriptorRef fdref);
+static CFRunLoopSourceRef _CreateMasterAddressLookup_Linux(CFStringRef name, CFHostInfoType info, CFTypeRef context, CFStreamError* error);
+static CFRunLoopSourceRef _CreateDNSLookup_Linux(CFTypeRef thing, CFHostInfoType type, void* context, CFStreamError* error);
+
+static CFRunLoopSourceRef _ResolverCreateLookup(const char* name, CFHostInfoType info, void* context, CFStreamError* error);
+static int                _ResolverStartWorker_Locked(void);
+static void*              _ResolverWorkerMain(void* arg);
+static void               _ResolverRequestFree_Locked(_CFHostResolverRequest* request);
+static void               _ResolverWaiterSignal_Locked(_CFHostResolverWaiter* waiter);
+static void               _ResolverWaiterSchedule(void* info, CFRunLoopRef rl, CFStringRef mode);
+static void               _ResolverWaiterCancel(void* info, CFRunLoopRef rl, CFStringRef mode);
+static void               _ResolverWaiterPerform(void* info);
+static void               _ResolverWaiterRelease(const void* info);
+static CFHashCode         _ResolverKeyHash(const void* key);
+static Boolean            _ResolverKeyEqual(const void* key1, const void* key2);
+
+static CFRunLoopSourceRef _DNSCreateLookup(const char* name, CFHostInfoType info, void* context, CFStreamError* error);
+static Boolean            _DNSIsNativeName(const char* name);
+static int                _DNSClamp(int value, int maximum);
+static void               _DNSLoadConfiguration_Locked(void);
+static Boolean            _DNSIsNameServer_Locked(const struct sockaddr_storage* from);
+static Boolean            _DNSCreateID_Locked(UInt16* id);
+static int                _DNSOpenSocket_Locked(int family);
+static void               _DNSUnschedule_Locked(CFRunLoopRef rl, CFStringRef mode);
+static Boolean            _DNSQuestionEncode(_CFHostDNSQuestion* question, const char* name);
+static CFIndex            _DNSExpandName(const UInt8* message, CFIndex length, CFIndex offset, UInt8* name, CFIndex* nameLength);
+static Boolean            _DNSNameEqual(const UInt8* name1, const UInt8* name2, CFIndex length);
+static void               _DNSFreeAddrInfo(struct addrinfo* info);
+static void               _DNSQuestionAddAddress(_CFHostDNSQuery* query, _CFHostDNSQuestion* question, const UInt8* rdata);
+static Boolean _DNSQuestionParseAnswers(_CFHostDNSQuery* query, _CFHostDNSQuestion* question, const UInt8* message, CFIndex length, CFIndex offset);
+static void    _DNSQuestionHandleReply_Locked(_CFHostDNSQuery*               query,
+                                              _CFHostDNSQuestion*            question,
+                                              const UInt8*                   message,
+                                              CFIndex                        length,
+                                              const struct sockaddr_storage* from,
+                                              Boolean                        stream);
+static void    _DNSQuestionStartStream_Locked(_CFHostDNSQuery* query, _CFHostDNSQuestion* question, const struct sockaddr_storage* server);
+static void    _DNSQuestionCloseStream_Locked(_CFHostDNSQuestion* question);
+static void    _DNSQuestionFinish_Locked(_CFHostDNSQuestion* question, int status);
+static void    _DNSQueryFinishIfDone_Locked(_CFHostDNSQuery* query);
+static void    _DNSQuerySend_Locked(_CFHostDNSQuery* query);
+static void    _DNSQueryRetry_Locked(_CFHostDNSQuery* query);
+static void    _DNSQueryScheduleTimer_Locked(_CFHostDNSQuery* query);
+static void    _DNSSocketCallBack(CFFileDescriptorRef fdref, CFOptionFlags callBackTypes, void* info);
+static void    _DNSStreamCallBack(CFFileDescriptorRef fdref, CFOptionFlags callBackTypes, void* info);
+static void    _DNSLookupTimerCallBack(CFRunLoopTimerRef timer, void* info);
+static void    _DNSLookupSchedule(void* info, CFRunLoopRef rl, CFStringRef mode);
+static void    _DNSLookupCancel(void* info, CFRunLoopRef rl, CFStringRef mode);
+static void    _DNSLookupPerform(void* info);
+static void    _DNSLookupRelease(const void* info);
 
 static CFFileDescriptorRef _CreateNameLookup_Linux(CFDataRef address, void* context, CFStreamError* error);
 
@@ -270,7 +453,6 @@ static CFMachPortRef            _CreateMasterAddressLookup_Mach(CFStringRef name
 static CFMachPortRef            _CreateNameLookup_Mach(CFDataRef address, void* context, CFStreamError* error);
 static SCNetworkReachabilityRef _CreateReachabilityLookup(CFTypeRef thing, void* context, CFStreamError* error);
 
-static void    _DNSCallBack(int32_t status, char* buf, uint32_t len, struct sockaddr* from, int fromlen, void* context);
 static void    _DNSMachPortCallBack(CFMachPortRef port, void* msg, CFIndex size, void* info);
 static void    _GetAddrInfoMachPortCallBack(CFMachPortRef port, void* msg, CFIndex size, void* info);
 static void    _GetNameInfoCallBack(int eai_status, char* hostname, char* serv, void* ctxt);
@@ -289,7 +471,40 @@ static CFTypeID    _kCFHostTypeID        = _kCFRuntimeNotATypeID;
 
 static _CFMutex*              _HostLock;    /* Lock used for cache and master list */
 static CFMutableDictionaryRef _HostLookups; /* Active hostname lookups; for duplicate supression */
-static CFMutableDictionaryRef _HostCache;   /* Cached hostname lookups (successes only) */
+static CFMutableDictionaryRef _HostCache;   /* Cached hostname lookups; value = _CFHostCacheEntry* */
+
+static _CFHostCacheEntry* _HostCacheHead; /* Most recently used cache entry */
+static _CFHostCacheEntry* _HostCacheTail; /* Least recently used cache entry; evicted first */
+
+static CFIndex        _HostCacheMaxEntries  = _kCFHostCacheDefaultMaxEntries;
+static CFTimeInterval _HostCacheTTL         = _kCFHostCacheDefaultTTL;
+static CFTimeInterval _HostCacheNegativeTTL = _kCFHostCacheDefaultNegativeTTL;
+static CFTimeInterval _HostCacheStaleTTL    = _kCFHostCacheDefaultStaleTTL;
+
+#if defined(__linux__)
+static _CFMutex                _ResolverLock;                                  /* Lock used for the resolver pool */
+static pthread_cond_t          _ResolverCondition = PTHREAD_COND_INITIALIZER;  /* Signalled when a request is queued */
+static _CFHostResolverRequest* _ResolverPending;     /* Oldest request waiting for a worker */
+static _CFHostResolverRequest* _ResolverPendingTail; /* Newest request waiting for a worker */
+static CFMutableDictionaryRef  _ResolverRequests;    /* Queued and running requests; for coalescing */
+static CFIndex                 _ResolverWorkers;     /* Worker threads running */
+static CFIndex                 _ResolverIdle;        /* Worker threads waiting for a request */
+
+static _CFMutex                _DNSLock;                /* Lock used for the native resolver */
+static CFMutableDictionaryRef  _DNSQueries;             /* Outstanding questions; key = transaction ID, value = _CFHostDNSQuery* */
+static CFMutableArrayRef       _DNSSchedules;           /* Loops and modes of all native lookups, repeated per lookup */
+static int                     _DNSSockets[2] = {-1, -1}; /* Shared UDP sockets for IPv4 and IPv6 name servers */
+static CFFileDescriptorRef     _DNSSocketRefs[2];
+static CFRunLoopSourceRef      _DNSSocketSources[2];
+static Boolean                 _DNSEnabled;             /* Address lookups use the native resolver */
+static Boolean                 _DNSServersOverridden;   /* Name servers were set by _CFHostSetNameServers */
+static Boolean                 _DNSConfigurationLoaded; /* resolv.conf has been read */
+static struct timespec         _DNSConfigurationTime;   /* Modification time of resolv.conf when read */
+static struct sockaddr_storage _DNSServers[_kCFHostDNSMaxServers];
+static CFIndex                 _DNSServerCount;
+static int                     _DNSTimeout  = _kCFHostDNSDefaultTimeout;
+static int                     _DNSAttempts = _kCFHostDNSDefaultAttempts;
+#endif /* __linux__ */
 
 #pragma mark - ---- Definitions ----
 #pragma mark - Static Function
@@ -297,6 +512,8 @@ static CFMutableDictionaryRef _HostCache;   /* Cached hostname lookups (successe
 /* static */
 void _CFHostRegisterClass(void)
 {
+  CFDictionaryValueCallBacks entries = {0, NULL, NULL, NULL, NULL};
+
   static const CFRuntimeClass _kCFHostClass = {
       0,                                           // version
       "CFHost",                                    // class name
@@ -316,8 +533,12 @@ void _CFHostRegisterClass(void)
   if (_HostLock) {
     _CFMutexInit(_HostLock, FALSE);
   }
+#if defined(__linux__)
+  _CFMutexInit(&_ResolverLock, FALSE);
+  _CFMutexInit(&_DNSLock, FALSE);
+#endif /* __linux__ */
   _HostLookups = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-  _HostCache   = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  _HostCache   = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &entries);
 }
 
 /* static */
@@ -492,6 +713,9 @@ void _HostLookupCancel_NoLock(_CFHost* host)
   host->_lookup = NULL;
   host->_type   = _kCFNullHostInfoType;
 
+  // Any error held back for the lookup goes with it.
+  memset(&host->_cachedError, 0, sizeof(host->_cachedError));
+
 done:
   return;
 }
@@ -520,59 +744,9 @@ Boolean _CreateLookup_NoLock(_CFHost* host, CFHostInfoType info, Boolean* _Radar
     // If a address lookup and there is a name, create and start the lookup.
     case kCFHostAddresses:
 
-      if (name) {
-        CFArrayRef cached = NULL;
-
-        /* Expire any entries from the cache */
-        _ExpireCacheEntries();
-
-        /* Lock the cache */
-        _CFMutexLock(_HostLock);
-
-        /* Go for a cache entry. */
-        if (_HostCache) {
-          cached = (CFArrayRef)CFDictionaryGetValue(_HostCache, name);
-          if (cached) {
-            CFRetain(cached);
-          }
-        }
-        _CFMutexUnlock(_HostLock);
-
-        /* Create a lookup if no cache entry. */
-        if (!cached) {
-          host->_lookup = _CreateAddressLookup(name, info, host, &(host->_error));
-        } else {
-          CFAllocatorRef alloc = CFGetAllocator(name);
-
-          /* Make a copy of the addresses in the cached entry. */
-          CFArrayRef cp =
-              _CFArrayCreateDeepCopy(alloc, CFHostGetInfo((CFHostRef)CFArrayGetValueAtIndex(cached, 0), _kCFHostMasterAddressLookup, NULL));
-
-          CFRunLoopSourceContext ctxt = {0,    host, CFRetain, CFRelease, CFCopyDescription,
-                                         NULL, NULL, NULL,     NULL,      (void (*)(void*))_AddressLookupPerform};
-
-          /* Create the lookup source.  This source will be signalled immediately. */
-          host->_lookup               = CFRunLoopSourceCreate(alloc, 0, &ctxt);
-
-          /* Upon success, add the data and signal the source. */
-          if (host->_lookup && cp) {
-            CFDictionaryAddValue(host->_info, (const void*)info, cp);
-            CFRunLoopSourceSignal((CFRunLoopSourceRef)host->_lookup);
-            *_Radar4012176 = TRUE;
-          } else {
-            host->_error.error  = ENOMEM;
-            host->_error.domain = kCFStreamErrorDomainPOSIX;
-          }
-
-          if (cp) {
-            CFRelease(cp);
-          } else if (host->_lookup) {
-            CFRelease(host->_lookup);
-            host->_lookup = NULL;
-          }
-
-          CFRelease(cached);
-        }
+      /* Create a lookup if no cache entry, positive or negative. */
+      if (name && !_CreateCachedAddressLookup_NoLock(host, info, name, _Radar4012176)) {
+        host->_lookup = _CreateAddressLookup(name, info, host, &(host->_error));
       }
 
       break;
@@ -673,8 +847,11 @@ Boolean _CreateLookup_NoLock(_CFHost* host, CFHostInfoType info, Boolean* _Radar
     default:
 
       if (name) {
-        if ((info == _kCFHostIPv4Addresses) || (info == _kCFHostIPv6Addresses) || (info == _kCFHostByPassMasterAddressLookup) ||
-            (info == _kCFHostMasterAddressLookup)) {
+        if ((info == _kCFHostIPv4Addresses) || (info == _kCFHostIPv6Addresses)) {
+          /* Single family lookups are answered from the cache too, but don't share or fill it. */
+          if (!_CreateCachedAddressLookup_NoLock(host, info, name, _Radar4012176))
+            host->_lookup = _CreateMasterAddressLookup(name, info, host, &(host->_error));
+        } else if ((info == _kCFHostByPassMasterAddressLookup) || (info == _kCFHostMasterAddressLookup)) {
           host->_lookup = _CreateMasterAddressLookup(name, info, host, &(host->_error));
         } else {
           host->_lookup = _CreateDNSLookup(name, info, host, &(host->_error));
@@ -701,76 +878,332 @@ Boolean _CreateLookup_NoLock(_CFHost* host, CFHostInfoType info, Boolean* _Radar
   return result;
 }
 
+/**
+ *  @brief
+ *    Create a lookup which is answered from the cache.
+ *
+ *  On a hit, the addresses are saved on the host under @a info and
+ *  the lookup source is signalled right away.  Lookups for a single
+ *  family only get that family's addresses out of the entry, which
+ *  may leave none.  A negative entry fails the lookup with the cached
+ *  error once the source fires.
+ *
+ *  @param[in]   host           The host to create the lookup for.
+ *  @param[in]   info           kCFHostAddresses or one of the single
+ *                              family address types.
+ *  @param[in]   name           The hostname to look up.
+ *  @param[out]  _Radar4012176  Set to TRUE if the lookup source was
+ *                              signalled.
+ *
+ *  @returns
+ *    TRUE if there was a cache entry, in which case either the
+ *    lookup or the error on @a host is set; otherwise, FALSE.
+ *
+ */
 /* static */
-void _ExpireCacheEntries(void)
+Boolean _CreateCachedAddressLookup_NoLock(_CFHost* host, CFHostInfoType info, CFStringRef name, Boolean* _Radar4012176)
 {
-  CFIndex count;
+  CFArrayRef     cached = NULL;
+  CFStreamError  cachedError;
+  Boolean        stale = FALSE;
+  CFAllocatorRef alloc = CFGetAllocator(name);
+  CFTypeRef      cp    = kCFNull;
+
+  CFRunLoopSourceContext ctxt = {0,    host, CFRetain, CFRelease, CFCopyDescription,
+                                 NULL, NULL, NULL,     NULL,      (void (*)(void*))_AddressLookupPerform};
+
+  if (!_HostCacheCopyEntry(name, &cached, &cachedError, &stale))
+    return FALSE;
+
+  /* Make a copy of the addresses in the cached entry.  Negative entries have none. */
+  if (cached && (info == kCFHostAddresses)) {
+    cp = _CFArrayCreateDeepCopy(alloc, cached);
+  } else if (cached) {
+    CFIndex           i, count = CFArrayGetCount(cached);
+    int               family   = (info == _kCFHostIPv6Addresses) ? AF_INET6 : AF_INET;
+    CFMutableArrayRef list     = CFArrayCreateMutable(alloc, count, &kCFTypeArrayCallBacks);
+
+    /* The addresses are immutable, so the filtered list can share them. */
+    for (i = 0; list && (i < count); i++) {
+      CFDataRef address = (CFDataRef)CFArrayGetValueAtIndex(cached, i);
+
+      if (((const struct sockaddr*)CFDataGetBytePtr(address))->sa_family == family)
+        CFArrayAppendValue(list, address);
+    }
+
+    cp = list;
+  }
+
+  /* Create the lookup source.  This source will be signalled immediately. */
+  host->_lookup = CFRunLoopSourceCreate(alloc, 0, &ctxt);
 
-  CFStringRef keys_buffer[_kCFHostCacheMaxEntries];
-  CFArrayRef  values_buffer[_kCFHostCacheMaxEntries];
+  /* Upon success, add the data and signal the source. */
+  if (host->_lookup && cp) {
+    /* A negative entry fails the same way the lookup did, once the source fires. */
+    if (cp == kCFNull)
+      memmove(&host->_cachedError, &cachedError, sizeof(cachedError));
+
+    CFDictionaryAddValue(host->_info, (const void*)info, cp);
+    CFRunLoopSourceSignal((CFRunLoopSourceRef)host->_lookup);
+    *_Radar4012176 = TRUE;
+  } else {
+    host->_error.error  = ENOMEM;
+    host->_error.domain = kCFStreamErrorDomainPOSIX;
+  }
+
+  if (cp) {
+    if (cp != kCFNull)
+      CFRelease(cp);
+  } else if (host->_lookup) {
+    CFRelease(host->_lookup);
+    host->_lookup = NULL;
+  }
+
+  if (cached)
+    CFRelease(cached);
+
+  /* A stale entry is served as is, but a fresh lookup goes out behind it. */
+  if (host->_lookup && stale)
+    _HostCacheRefresh(name, host->_schedules);
+
+  return TRUE;
+}
+
+/**
+ *  @brief
+ *    Look up a hostname in the cache.
+ *
+ *  Fresh entries are returned as is.  A positive entry that has
+ *  outlived its TTL, but not the stale window after it, is still
+ *  returned, with @a stale set so that the caller refreshes it.
+ *  Anything older is dropped.  Hits move the entry to the front of
+ *  the LRU list.
+ *
+ *  @param[in]   name       The hostname to look up.
+ *  @param[out]  addresses  Set to a retained copy of the cached
+ *                          addresses, or NULL for a negative entry.
+ *  @param[out]  error      Set to the cached error for a negative
+ *                          entry.
+ *  @param[out]  stale      Set to TRUE if the entry should be
+ *                          refreshed.
+ *
+ *  @returns
+ *    TRUE if there was a usable entry; otherwise, FALSE.
+ *
+ */
+/* static */
+Boolean _HostCacheCopyEntry(CFStringRef name, CFArrayRef* addresses, CFStreamError* error, Boolean* stale)
+{
+  Boolean            result = FALSE;
+  _CFHostCacheEntry* entry;
 
-  CFStringRef* keys   = &keys_buffer[0];
-  CFArrayRef*  values = &values_buffer[0];
+  *addresses = NULL;
+  *stale     = FALSE;
+  memset(error, 0, sizeof(error[0]));
 
   /* Lock the cache */
   _CFMutexLock(_HostLock);
 
-  if (_HostCache) {
-    /* Get the count for proper allocation if needed and for iteration. */
-    count = CFDictionaryGetCount(_HostCache);
+  entry = _HostCache ? (_CFHostCacheEntry*)CFDictionaryGetValue(_HostCache, name) : NULL;
+
+  if (entry) {
+    /* How long since it was fetched?  Use abs in order to handle clock changes. */
+    CFTimeInterval age = fabs(CFAbsoluteTimeGetCurrent() - entry->_fetched);
 
-    /* Allocate buffers for keys and values if don't have large enough static buffers. */
-    if (count > _kCFHostCacheMaxEntries) {
-      keys   = (CFStringRef*)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(keys[0]) * count, 0);
-      values = (CFArrayRef*)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(values[0]) * count, 0);
+    if ((age < entry->_ttl) || (entry->_addresses && (age < (entry->_ttl + _HostCacheStaleTTL)))) {
+      *stale = (age >= entry->_ttl);
+
+      if (entry->_addresses)
+        *addresses = (CFArrayRef)CFRetain(entry->_addresses);
+      else
+        memmove(error, &entry->_error, sizeof(error[0]));
+
+      /* Move it to the front of the list. */
+      if (entry != _HostCacheHead) {
+        entry->_prev->_next = entry->_next;
+
+        if (entry->_next)
+          entry->_next->_prev = entry->_prev;
+        else
+          _HostCacheTail = entry->_prev;
+
+        entry->_prev          = NULL;
+        entry->_next          = _HostCacheHead;
+        _HostCacheHead->_prev = entry;
+        _HostCacheHead        = entry;
+      }
+
+      result = TRUE;
     }
 
-    /* Only iterate if buffers were allocated. */
-    if (keys && values) {
-      CFIndex        i, j = 0;
-      CFTimeInterval oldest = 0.0;
+    /* Too old to be of any use. */
+    else
+      _HostCacheRemoveEntry_NoLock(entry);
+  }
 
-      /* Get "now" for comparison for freshness. */
-      CFDateRef now         = CFDateCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent());
+  _CFMutexUnlock(_HostLock);
 
-      /* Get all the hosts in the cache */
-      CFDictionaryGetKeysAndValues(_HostCache, (const void**)keys, (const void**)values);
+  return result;
+}
 
-      /* Iterate through and get rid of expired ones. */
-      for (i = 0; i < count; i++) {
-        /* How long since now?  Use abs in order to handle clock changes. */
-        CFTimeInterval since = fabs(CFDateGetTimeIntervalSinceDate(now, (CFDateRef)CFArrayGetValueAtIndex(values[i], 1)));
+/**
+ *  @brief
+ *    Add or replace the cache entry for a hostname.
+ *
+ *  The least recently used entries are evicted to make room.
+ *
+ *  @note
+ *    This must be called with _HostLock held.
+ *
+ *  @param[in]  name       The hostname the entry is for.
+ *  @param[in]  addresses  The resolved addresses, or NULL for a
+ *                         negative entry.
+ *  @param[in]  error      The error the lookup failed with, for a
+ *                         negative entry.
+ *  @param[in]  ttl        How long the entry stays fresh.
+ *
+ */
+/* static */
+void _HostCacheAddEntry_NoLock(CFStringRef name, CFArrayRef addresses, const CFStreamError* error, CFTimeInterval ttl)
+{
+  _CFHostCacheEntry* entry;
 
-        /* If timeout, remove the entry. */
-        if (since >= _kCFHostCacheTimeout)
-          CFDictionaryRemoveValue(_HostCache, keys[i]);
+  if (!_HostCache || (ttl <= 0.0))
+    return;
 
-        /* If this one is older than the oldest, save it's index. */
-        else if (since > oldest) {
-          j      = i;
-          oldest = since;
-        }
-      }
+  entry = (_CFHostCacheEntry*)CFDictionaryGetValue(_HostCache, name);
 
-      CFRelease(now);
+  if (entry) {
+    /* Keep serving good addresses over a failed refresh; they age out on their own. */
+    if (!addresses && entry->_addresses)
+      return;
 
-      /* If the count still isn't in the bounds of maximum number of entries, remove the oldest. */
-      if (CFDictionaryGetCount(_HostCache) >= _kCFHostCacheMaxEntries)
-        CFDictionaryRemoveValue(_HostCache, keys[j]);
-    }
+    _HostCacheRemoveEntry_NoLock(entry);
+  }
+
+  /* Make room for the new one. */
+  _HostCacheTrim_NoLock(_HostCacheMaxEntries - 1);
+
+  if (_HostCacheMaxEntries == 0)
+    return;
+
+  entry = (_CFHostCacheEntry*)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(entry[0]), 0);
+  if (!entry)
+    return;
+
+  memset(entry, 0, sizeof(entry[0]));
+
+  entry->_name      = CFStringCreateCopy(kCFAllocatorDefault, name);
+  entry->_addresses = addresses ? CFArrayCreateCopy(kCFAllocatorDefault, addresses) : NULL;
+  entry->_fetched   = CFAbsoluteTimeGetCurrent();
+  entry->_ttl       = ttl;
+
+  if (error)
+    memmove(&entry->_error, error, sizeof(entry->_error));
+
+  if (!entry->_name || (addresses && !entry->_addresses)) {
+    if (entry->_name)
+      CFRelease(entry->_name);
+    if (entry->_addresses)
+      CFRelease(entry->_addresses);
+    CFAllocatorDeallocate(kCFAllocatorDefault, entry);
+    return;
+  }
+
+  /* Put it at the front of the list. */
+  entry->_next = _HostCacheHead;
+
+  if (_HostCacheHead)
+    _HostCacheHead->_prev = entry;
+  else
+    _HostCacheTail = entry;
+
+  _HostCacheHead = entry;
+
+  CFDictionaryAddValue(_HostCache, entry->_name, entry);
+}
+
+/* static */
+void _HostCacheRemoveEntry_NoLock(_CFHostCacheEntry* entry)
+{
+  /* Unlink it from the list. */
+  if (entry->_prev)
+    entry->_prev->_next = entry->_next;
+  else
+    _HostCacheHead = entry->_next;
+
+  if (entry->_next)
+    entry->_next->_prev = entry->_prev;
+  else
+    _HostCacheTail = entry->_prev;
+
+  CFDictionaryRemoveValue(_HostCache, entry->_name);
+
+  CFRelease(entry->_name);
+
+  if (entry->_addresses)
+    CFRelease(entry->_addresses);
+
+  CFAllocatorDeallocate(kCFAllocatorDefault, entry);
+}
+
+/* static */
+void _HostCacheTrim_NoLock(CFIndex limit)
+{
+  /* Evict from the least recently used end. */
+  while (_HostCacheTail && (CFDictionaryGetCount(_HostCache) > limit))
+    _HostCacheRemoveEntry_NoLock(_HostCacheTail);
+}
+
+/**
+ *  @brief
+ *    Start a lookup which refreshes a stale cache entry.
+ *
+ *  The lookup is a master lookup with no clients of its own.  Its
+ *  completion callback updates the cache.  Until then, any client
+ *  that misses the cache joins it, just as it would join any other
+ *  outstanding lookup for the name.
+ *
+ *  @param[in]  name       The hostname to refresh.
+ *  @param[in]  schedules  The run loops and modes on which to run the
+ *                         lookup.  If there are none, the lookup only
+ *                         runs once a client joins it.
+ *
+ */
+/* static */
+void _HostCacheRefresh(CFStringRef name, CFArrayRef schedules)
+{
+  CFStreamError error = {0, 0};
 
-    /* If space for keys was made, deallocate it. */
-    if (keys && (keys != &keys_buffer[0]))
-      CFAllocatorDeallocate(kCFAllocatorDefault, keys);
+  /* Lock the master lookups list and cache */
+  _CFMutexLock(_HostLock);
+
+  /* An outstanding lookup for the name will refresh the entry already. */
+  if (!CFDictionaryGetValue(_HostLookups, name)) {
+    CFMutableArrayRef list = _StartMasterLookup_NoLock(name, &error);
 
-    /* If space for values was made, deallocate it. */
-    if (values && (values != &values_buffer[0]))
-      CFAllocatorDeallocate(kCFAllocatorDefault, values);
+    if (list)
+      _CFTypeScheduleOnMultipleRunLoops(CFArrayGetValueAtIndex(list, 0), schedules);
   }
 
   _CFMutexUnlock(_HostLock);
 }
 
+/* static */
+Boolean _HostCacheIsNegativeError(const CFStreamError* error)
+{
+  /* Only an authoritative "no such name" is worth remembering; anything else may be transient. */
+  if (error->domain != (CFStreamErrorDomain)kCFStreamErrorDomainNetDB)
+    return FALSE;
+
+#if defined(EAI_NODATA) && (EAI_NODATA != EAI_NONAME)
+  if (error->error == EAI_NODATA)
+    return TRUE;
+#endif
+
+  return (error->error == EAI_NONAME);
+}
+
 /* static */
 CFArrayRef _CFArrayCreateDeepCopy(CFAllocatorRef alloc, CFArrayRef array)
 {
@@ -991,107 +1424,138 @@ CFTypeRef _CreateMasterAddressLookup(CFStringRef name, CFHostInfoType info, CFTy
   return result;
 }
 
+/**
+ *  @brief
+ *    Create and start the master lookup for a hostname.
+ *
+ *  The master is a CFHost resolving the name on behalf of all of its
+ *  clients.  It is placed at index zero of a new list of clients,
+ *  which is added to the global dictionary of outstanding lookups.
+ *
+ *  @note
+ *    This must be called with _HostLock held.
+ *
+ *  @param[in]      name   The hostname to look up.
+ *  @param[in,out]  error  A pointer to a #CFStreamError structure
+ *                         which is set if the lookup fails to start.
+ *
+ *  @returns
+ *    The list of clients, held by the dictionary of outstanding
+ *    lookups, on success; otherwise, NULL.
+ *
+ */
 /* static */
-CFTypeRef _CreateAddressLookup(CFStringRef name, CFHostInfoType info, void* context, CFStreamError* error)
+CFMutableArrayRef _StartMasterLookup_NoLock(CFStringRef name, CFStreamError* error)
 {
-  Boolean   started = FALSE;
-  CFTypeRef result  = NULL;
+  Boolean           started = FALSE;
+  CFHostRef         host;
+  CFStringRef       key;
+  CFMutableArrayRef list;
 
-  memset(error, 0, sizeof(error[0]));
+  /* Create the list to hold the host and sources. */
+  list = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
 
-  if (info == _kCFHostMasterAddressLookup)
-    result = _CreateMasterAddressLookup(name, info, context, error);
+  /* Set up the error in case the list wasn't created. */
+  if (!list) {
+    error->error  = ENOMEM;
+    error->domain = kCFStreamErrorDomainPOSIX;
 
-  else {
-    CFHostRef         host = NULL;
-    CFMutableArrayRef list = NULL;
+    return NULL;
+  }
 
-    /* Lock the master lookups list and cache */
-    _CFMutexLock(_HostLock);
+  key = CFStringCreateCopy(kCFAllocatorDefault, name);
 
-    /* Get the list with the host lookup and other sources for this name */
-    list = (CFMutableArrayRef)CFDictionaryGetValue(_HostLookups, name);
+  /* Add the list of clients for the name to the dictionary. */
+  CFDictionaryAddValue(_HostLookups, key, list);
 
-    /* Get the host if there is a list.  Host is at index zero. */
-    if (list)
-      host = (CFHostRef)CFArrayGetValueAtIndex(list, 0);
+  /* Dictionary holds it now. */
+  CFRelease(list);
 
-    /* If there is no list, this is the first; so set everything up. */
-    else {
-      /* Create the list to hold the host and sources. */
-      list = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+  /* Make the real lookup. */
+  host = CFHostCreateWithName(kCFAllocatorDefault, key);
 
-      /* Set up the error in case the list wasn't created. */
-      if (!list) {
-        error->error  = ENOMEM;
-        error->domain = kCFStreamErrorDomainPOSIX;
-      }
+  if (!host) {
+    error->error  = ENOMEM;
+    error->domain = kCFStreamErrorDomainPOSIX;
+  }
 
-      else {
-        name = CFStringCreateCopy(kCFAllocatorDefault, name);
+  else {
+    CFHostClientContext ctxt = {0, (void*)key, CFRetain, CFRelease, CFCopyDescription};
 
-        /* Add the list of clients for the name to the dictionary. */
-        CFDictionaryAddValue(_HostLookups, name, list);
+    /* Place the CFHost at index 0. */
+    CFArrayAppendValue(list, host);
 
-        CFRelease(name);
+    /* The list holds it now. */
+    CFRelease(host);
 
-        /* Dictionary holds it now. */
-        CFRelease(list);
+    // Kick off an internal, asynchronous resolution that will nest with the external
+    // resolution. It is definitionally asynchronous because a internal asynchronous
+    // client callback is set, which may not be the case with the outer resolution
+    // that triggered this one.
 
-        /* Make the real lookup. */
-        host = CFHostCreateWithName(kCFAllocatorDefault, name);
+    // Set the asynchronous client callback.
 
-        if (!host) {
-          error->error  = ENOMEM;
-          error->domain = kCFStreamErrorDomainPOSIX;
-        }
+    CFHostSetClient(host, (CFHostClientCallBack)_MasterLookupCallBack, &ctxt);
 
-        else {
-          CFHostClientContext ctxt = {0, (void*)name, CFRetain, CFRelease, CFCopyDescription};
+    // Kick off the internal, asynchronous nested
+    // resolution.
+
+    started = CFHostStartInfoResolution(host, _kCFHostMasterAddressLookup, error);
+    if (!started) {
+      // It is absolutely imperative that CFHostStartInfoResolution (or its
+      // info-type-specific helpers) set an error of some sort if it (they) failed.
+      // In response to failure, the name/list key/value pair will be removed from
+      // _HostLookups and, along with them, the host will then be invalid and go out
+      // of scope.
 
-          /* Place the CFHost at index 0. */
-          CFArrayAppendValue(list, host);
+      // CFAssert2(error->error != 0, __kCFLogAssertion, ""resolution failed but error is not set");
 
-          /* The list holds it now. */
-          CFRelease(host);
+      CFHostSetClient(host, NULL, NULL);
+    }
+  }
+
+  /* If it failed, don't keep it in the outstanding lookups list. */
+  if (!started) {
+    CFDictionaryRemoveValue(_HostLookups, key);
+
+    // The list and host are no longer valid and in scope at this point.
+    list = NULL;
+  }
+
+  CFRelease(key);
 
-          // Kick off an internal, asynchronous resolution that will nest with the external
-          // resolution. It is definitionally asynchronous because a internal asynchronous
-          // client callback is set, which may not be the case with the outer resolution
-          // that triggered this one.
+  return list;
+}
 
-          // Set the asynchronous client callback.
+/* static */
+CFTypeRef _CreateAddressLookup(CFStringRef name, CFHostInfoType info, void* context, CFStreamError* error)
+{
+  Boolean   started = FALSE;
+  CFTypeRef result  = NULL;
 
-          CFHostSetClient(host, (CFHostClientCallBack)_MasterLookupCallBack, &ctxt);
+  memset(error, 0, sizeof(error[0]));
 
-          // Kick off the internal, asynchronous nested
-          // resolution.
+  if (info == _kCFHostMasterAddressLookup)
+    result = _CreateMasterAddressLookup(name, info, context, error);
 
-          started = CFHostStartInfoResolution(host, _kCFHostMasterAddressLookup, error);
-          if (!started) {
-            // It is absolutely imperative that CFHostStartInfoResolution (or its
-            // info-type-specific helpers) set an error of some sort if it (they) failed.
-            // In response to failure, the name/list key/value pair will be removed from
-            // _HostLookups and, along with them, the host will then be invalid and go out
-            // of scope.
-            //
-            // If processing continues on the false assumption that there were no errors,
-            // execution flow will fault when the newly created run loop source below is
-            // added to a list that is no longer valid.
+  else {
+    CFHostRef         host = NULL;
+    CFMutableArrayRef list = NULL;
 
-            // CFAssert2(error->error != 0, __kCFLogAssertion, ""resolution failed but error is not set");
+    /* Lock the master lookups list and cache */
+    _CFMutexLock(_HostLock);
 
-            CFHostSetClient(host, NULL, NULL);
+    /* Get the list with the host lookup and other sources for this name */
+    list = (CFMutableArrayRef)CFDictionaryGetValue(_HostLookups, name);
 
-            /* If it failed, don't keep it in the outstanding lookups list. */
-            CFDictionaryRemoveValue(_HostLookups, name);
+    /* If there is no list, this is the first; so set everything up. */
+    if (!list)
+      list = _StartMasterLookup_NoLock(name, error);
 
-            // Name, host, and list are no longer valid and in scope at this point. A stream
-            // error MUST be set, per the comment above or any manipulation of name, list, or
-            // host hereafter will fault.
-          }
-        }
-      }
+    /* Get the host if there is a list.  Host is at index zero. */
+    if (list) {
+      host    = (CFHostRef)CFArrayGetValueAtIndex(list, 0);
+      started = TRUE;
     }
 
     /* Everything is still good? */
@@ -1141,230 +1605,1662 @@ CFTypeRef _CreateAddressLookup(CFStringRef name, CFHostInfoType info, void* cont
 
 #if defined(__linux__)
 
-  #pragma mark - Signal File Descriptor - Linux
+  #pragma mark - Resolver Worker Pool - Linux
 
 /* static */
-int _SignalFdModifySignalWithError(int how, int signal, sigset_t* set, CFStreamError* error)
+CFHashCode _ResolverKeyHash(const void* key)
 {
-  int result;
-
-  __Require(set != NULL, done);
-  __Require(error != NULL, done);
-
-  sigemptyset(set);
-  sigaddset(set, signal);
-
-  result = pthread_sigmask(how, set, NULL);
-  __Require_Action(result == 0, done, error->error = result; error->domain = kCFStreamErrorDomainPOSIX);
+  const UInt8* p      = (const UInt8*)key;
+  CFHashCode   result = 2166136261U;
 
-done:
+  // FNV-1a over the family and name.
+  while (*p) {
+    result ^= *p++;
+    result *= 16777619U;
+  }
 
   return result;
 }
 
 /* static */
-int _SignalFdSetSignalWithError(int signal, sigset_t* set, CFStreamError* error)
-{
-  return (_SignalFdModifySignalWithError(SIG_BLOCK, signal, set, error));
-}
-
-/* static */
-int _SignalFdClearSignalWithError(int signal, sigset_t* set, CFStreamError* error)
-{
-  return (_SignalFdModifySignalWithError(SIG_UNBLOCK, signal, set, error));
-}
+Boolean _ResolverKeyEqual(const void* key1, const void* key2) { return !strcmp((const char*)key1, (const char*)key2); }
+
+/**
+ *  @brief
+ *    Free a resolver request along with its results.
+ *
+ *  @note
+ *    This must be called with _ResolverLock held, once the request
+ *    is off the queue and has no waiters.
+ *
+ */
+/* static */
+void _ResolverRequestFree_Locked(_CFHostResolverRequest* request)
+{
+  if (request->_result)
+    freeaddrinfo(request->_result);
+
+  CFAllocatorDeallocate(kCFAllocatorDefault, request->_key);
+  CFAllocatorDeallocate(kCFAllocatorDefault, request);
+}
+
+/**
+ *  @brief
+ *    Signal a waiter's run loop source and wake up the run loops it is
+ *    scheduled on, so the completion gets handled promptly.
+ *
+ *  @note
+ *    This must be called with _ResolverLock held.
+ *
+ */
+/* static */
+void _ResolverWaiterSignal_Locked(_CFHostResolverWaiter* waiter)
+{
+  CFIndex i, count = CFArrayGetCount(waiter->_runLoops);
+
+  CFRunLoopSourceSignal(waiter->_source);
+
+  for (i = 0; i < count; i++)
+    CFRunLoopWakeUp((CFRunLoopRef)CFArrayGetValueAtIndex(waiter->_runLoops, i));
+}
+
+/* static */
+void* _ResolverWorkerMain(void* arg)
+{
+  _CFMutexLock(&_ResolverLock);
+
+  for (;;) {
+    _CFHostResolverRequest* request;
+    _CFHostResolverWaiter*  waiter;
+    int                     status;
+
+    // Wait for work, giving up the thread if none comes for a while.
+    while (!_ResolverPending) {
+      struct timespec deadline;
+      int             rc;
+
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += _kCFHostResolverIdleTimeout;
+
+      _ResolverIdle++;
+      rc = pthread_cond_timedwait(&_ResolverCondition, &_ResolverLock, &deadline);
+      _ResolverIdle--;
+
+      if ((rc == ETIMEDOUT) && !_ResolverPending) {
+        _ResolverWorkers--;
+        _CFMutexUnlock(&_ResolverLock);
+        return NULL;
+      }
+    }
+
+    // Take the oldest request off the queue.
+    request          = _ResolverPending;
+    _ResolverPending = request->_next;
+    request->_next   = NULL;
+
+    if (!_ResolverPending)
+      _ResolverPendingTail = NULL;
+
+    // Everybody who wanted it has cancelled already.
+    if (!request->_waiters) {
+      CFDictionaryRemoveValue(_ResolverRequests, request->_key);
+      _ResolverRequestFree_Locked(request);
+      continue;
+    }
+
+    _CFMutexUnlock(&_ResolverLock);
+
+    status = getaddrinfo(request->_name, NULL, &request->_hints, &request->_result);
+
+    _CFMutexLock(&_ResolverLock);
+
+    request->_status = status;
+    request->_errno  = (status == EAI_SYSTEM) ? errno : 0;
+    request->_done   = TRUE;
+
+    // Later lookups for the name start afresh.
+    CFDictionaryRemoveValue(_ResolverRequests, request->_key);
+
+    if (!request->_waiters)
+      _ResolverRequestFree_Locked(request);
+
+    else {
+      for (waiter = request->_waiters; waiter; waiter = waiter->_next)
+        _ResolverWaiterSignal_Locked(waiter);
+    }
+  }
+
+  return NULL;
+}
+
+/* static */
+void _ResolverWaiterSchedule(void* info, CFRunLoopRef rl, CFStringRef mode)
+{
+  _CFHostResolverWaiter* waiter = (_CFHostResolverWaiter*)info;
+
+  _CFMutexLock(&_ResolverLock);
+
+  CFArrayAppendValue(waiter->_runLoops, rl);
+
+  // A result that's already in needs the new run loop to notice the signal.
+  if (waiter->_request->_done)
+    CFRunLoopWakeUp(rl);
+
+  _CFMutexUnlock(&_ResolverLock);
+}
+
+/* static */
+void _ResolverWaiterCancel(void* info, CFRunLoopRef rl, CFStringRef mode)
+{
+  _CFHostResolverWaiter* waiter = (_CFHostResolverWaiter*)info;
+  CFIndex                i;
+
+  _CFMutexLock(&_ResolverLock);
+
+  i = CFArrayGetFirstIndexOfValue(waiter->_runLoops, CFRangeMake(0, CFArrayGetCount(waiter->_runLoops)), rl);
+  if (i != kCFNotFound)
+    CFArrayRemoveValueAtIndex(waiter->_runLoops, i);
+
+  _CFMutexUnlock(&_ResolverLock);
+}
+
+/* static */
+void _ResolverWaiterPerform(void* info)
+{
+  _CFHostResolverWaiter*  waiter  = (_CFHostResolverWaiter*)info;
+  _CFHostResolverRequest* request = waiter->_request;
+  Boolean                 done;
+
+  _CFMutexLock(&_ResolverLock);
+  done = request->_done;
+  _CFMutexUnlock(&_ResolverLock);
+
+  // Results don't change once done, so they can be used without the lock.
+  if (done) {
+    errno = request->_errno;
+
+    // The request owns the results and frees them once all its waiters are done.
+    _GetAddrInfoCallBackWithFree(request->_status, request->_result, waiter->_context, NULL);
+  }
+}
+
+/**
+ *  @brief
+ *    Detach a waiter from its request when its run loop source goes
+ *    away, whether after completion or on cancellation.
+ *
+ *  A request nobody waits on any longer is freed once done; if it is
+ *  still queued or running, the worker which picks it up frees it.
+ *
+ */
+/* static */
+void _ResolverWaiterRelease(const void* info)
+{
+  _CFHostResolverWaiter*  waiter  = (_CFHostResolverWaiter*)info;
+  _CFHostResolverRequest* request = waiter->_request;
+  _CFHostResolverWaiter** p;
+
+  _CFMutexLock(&_ResolverLock);
+
+  for (p = &request->_waiters; *p; p = &(*p)->_next) {
+    if (*p == waiter) {
+      *p = waiter->_next;
+      break;
+    }
+  }
+
+  if (request->_done && !request->_waiters)
+    _ResolverRequestFree_Locked(request);
+
+  _CFMutexUnlock(&_ResolverLock);
+
+  CFRelease(waiter->_runLoops);
+  CFAllocatorDeallocate(kCFAllocatorDefault, waiter);
+}
+
+/**
+ *  @brief
+ *    Start a worker thread for the resolver.
+ *
+ *  Workers are started with all signals blocked, so none of the host
+ *  application's signals are delivered on them.
+ *
+ *  @note
+ *    This must be called with _ResolverLock held.
+ *
+ *  @returns
+ *    Zero on success; otherwise, the error from pthread_create.
+ *
+ */
+/* static */
+int _ResolverStartWorker_Locked(void)
+{
+  pthread_attr_t attr;
+  pthread_t      thread;
+  sigset_t       all, saved;
+  int            result;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+
+  result = pthread_create(&thread, &attr, _ResolverWorkerMain, NULL);
+
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  pthread_attr_destroy(&attr);
+
+  if (result == 0)
+    _ResolverWorkers++;
+
+  return result;
+}
+
+/**
+ *  @brief
+ *    Create a lookup which resolves a name on the resolver's worker
+ *    pool.
+ *
+ *  The lookup is a run loop source, signalled once getaddrinfo has
+ *  returned for the name.  If the same name and family are already
+ *  queued or being resolved, the lookup waits on that request instead
+ *  of making another.  Releasing the source, as canceling the lookup
+ *  does, leaves the request; the last one out frees it.
+ *
+ *  @param[in]      name     The name to resolve.
+ *  @param[in]      info     The CFHostInfoType of the lookup, which
+ *                           selects the address family.
+ *  @param[in]      context  The CFHost to call back.
+ *  @param[in,out]  error    A pointer to a #CFStreamError structure
+ *                           which is set if the lookup can't be made.
+ *
+ *  @returns
+ *    The run loop source for the lookup on success; otherwise, NULL.
+ *
+ */
+/* static */
+CFRunLoopSourceRef _ResolverCreateLookup(const char* name, CFHostInfoType info, void* context, CFStreamError* error)
+{
+  struct addrinfo         hints;
+  char                    key[NI_MAXHOST + 16];
+  _CFHostResolverRequest* request;
+  _CFHostResolverWaiter*  waiter = NULL;
+  CFRunLoopSourceRef      result = NULL;
+
+  _InitGetAddrInfoHints(info, &hints);
+
+  // Identical lookups share a request, so the family is part of the key.
+  snprintf(key, sizeof(key), "%d:%s", hints.ai_family, name);
+
+  _CFMutexLock(&_ResolverLock);
+
+  do {
+    CFRunLoopSourceContext ctxt = {0,
+                                   NULL,
+                                   NULL,
+                                   _ResolverWaiterRelease,
+                                   NULL,
+                                   NULL,
+                                   NULL,
+                                   _ResolverWaiterSchedule,
+                                   _ResolverWaiterCancel,
+                                   _ResolverWaiterPerform};
+
+    if (!_ResolverRequests) {
+      CFDictionaryKeyCallBacks keys = {0, NULL, NULL, NULL, _ResolverKeyEqual, _ResolverKeyHash};
+
+      _ResolverRequests             = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &keys, NULL);
+      __Require_Action(_ResolverRequests != NULL, done, error->error = ENOMEM; error->domain = kCFStreamErrorDomainPOSIX);
+    }
+
+    request = (_CFHostResolverRequest*)CFDictionaryGetValue(_ResolverRequests, key);
+
+    // Nothing in flight for the name, so queue up a new request.
+    if (!request) {
+      size_t length = strlen(key) + 1;
+      int    status = 0;
+
+      request       = (_CFHostResolverRequest*)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(request[0]), 0);
+      __Require_Action(request != NULL, done, error->error = ENOMEM; error->domain = kCFStreamErrorDomainPOSIX);
+
+      memset(request, 0, sizeof(request[0]));
+      memmove(&request->_hints, &hints, sizeof(hints));
+
+      request->_key = (char*)CFAllocatorAllocate(kCFAllocatorDefault, length, 0);
+      __Require_Action(request->_key != NULL, done, CFAllocatorDeallocate(kCFAllocatorDefault, request); error->error = ENOMEM;
+                       error->domain = kCFStreamErrorDomainPOSIX);
+
+      memmove(request->_key, key, length);
+      request->_name = strchr(request->_key, ':') + 1;
+
+      // Make sure somebody will pick it up.
+      if (!_ResolverIdle && (_ResolverWorkers < _kCFHostResolverMaxWorkers))
+        status = _ResolverStartWorker_Locked();
+
+      __Require_Action(_ResolverWorkers != 0, done, _ResolverRequestFree_Locked(request); error->error = status;
+                       error->domain = kCFStreamErrorDomainPOSIX);
+
+      if (_ResolverPendingTail)
+        _ResolverPendingTail->_next = request;
+      else
+        _ResolverPending = request;
+
+      _ResolverPendingTail = request;
+
+      CFDictionaryAddValue(_ResolverRequests, request->_key, request);
+
+      pthread_cond_signal(&_ResolverCondition);
+    }
+
+    waiter = (_CFHostResolverWaiter*)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(waiter[0]), 0);
+    __Require_Action(waiter != NULL, done, error->error = ENOMEM; error->domain = kCFStreamErrorDomainPOSIX);
+
+    memset(waiter, 0, sizeof(waiter[0]));
+
+    waiter->_request  = request;
+    waiter->_context  = context;
+    waiter->_runLoops = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+    __Require_Action(waiter->_runLoops != NULL, done, CFAllocatorDeallocate(kCFAllocatorDefault, waiter); error->error = ENOMEM;
+                     error->domain = kCFStreamErrorDomainPOSIX);
+
+    ctxt.info = waiter;
+
+    // Create the lookup source.  This source will be signalled once the request finishes.
+    result    = CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &ctxt);
+    __Require_Action(result != NULL, done, CFRelease(waiter->_runLoops); CFAllocatorDeallocate(kCFAllocatorDefault, waiter);
+                     error->error = ENOMEM; error->domain = kCFStreamErrorDomainPOSIX);
+
+    // The source owns the waiter now, and gives it up through _ResolverWaiterRelease.
+    waiter->_source   = result;
+    waiter->_next     = request->_waiters;
+    request->_waiters = waiter;
+
+  } while (0);
+
+done:
+  _CFMutexUnlock(&_ResolverLock);
+
+  return result;
+}
+
+  #pragma mark - Native DNS Resolver - Linux
+
+/* static */
+int _DNSClamp(int value, int maximum) { return (value < 1) ? 1 : ((value > maximum) ? maximum : value); }
+
+/* static */
+Boolean _DNSIsNativeName(const char* name)
+{
+  struct in6_addr address;
+  const char*     dot = strchr(name, '.');
+
+  // Single-label names are left to the search list and /etc/hosts.
+  if (!dot || !dot[1])
+    return FALSE;
+
+  // So are numeric addresses.
+  if ((inet_pton(AF_INET, name, &address) == 1) || (inet_pton(AF_INET6, name, &address) == 1))
+    return FALSE;
+
+  return TRUE;
+}
+
+/**
+ *  @brief
+ *    Load the name servers and options from resolv.conf, unless they
+ *    were set with _CFHostSetNameServers.
+ *
+ *  The file is read again whenever its modification time changes.
+ *  Without any usable name server, the local one is used, as with
+ *  the libc resolver.
+ *
+ *  @note
+ *    This must be called with _DNSLock held.
+ *
+ */
+/* static */
+void _DNSLoadConfiguration_Locked(void)
+{
+  struct stat st;
+  FILE*       file;
+  char        line[256];
+
+  if (_DNSServersOverridden)
+    return;
+
+  if (stat(_kCFHostDNSResolvConf, &st) != 0)
+    memset(&st, 0, sizeof(st));
+
+  // Nothing changed since the last time.
+  if (_DNSConfigurationLoaded && (st.st_mtim.tv_sec == _DNSConfigurationTime.tv_sec) &&
+      (st.st_mtim.tv_nsec == _DNSConfigurationTime.tv_nsec))
+    return;
+
+  _DNSConfigurationLoaded = TRUE;
+  _DNSConfigurationTime   = st.st_mtim;
+  _DNSServerCount         = 0;
+  _DNSTimeout             = _kCFHostDNSDefaultTimeout;
+  _DNSAttempts            = _kCFHostDNSDefaultAttempts;
+
+  file                    = fopen(_kCFHostDNSResolvConf, "re");
+
+  while (file && fgets(line, sizeof(line), file)) {
+    char* saved = NULL;
+    char* keyword = strtok_r(line, " \t\r\n", &saved);
+    char* value;
+
+    if (!keyword)
+      continue;
+
+    if (!strcmp(keyword, "nameserver") && (value = strtok_r(NULL, " \t\r\n", &saved)) && (_DNSServerCount < _kCFHostDNSMaxServers)) {
+      struct sockaddr_storage* server = &_DNSServers[_DNSServerCount];
+      struct sockaddr_in*      sin    = (struct sockaddr_in*)server;
+      struct sockaddr_in6*     sin6   = (struct sockaddr_in6*)server;
+      char*                    scope  = strchr(value, '%');
+
+      memset(server, 0, sizeof(server[0]));
+
+      if (scope)
+        *scope++ = '\0';
+
+      if (inet_pton(AF_INET, value, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        sin->sin_port   = htons(_kCFHostDNSPort);
+        _DNSServerCount++;
+      }
+
+      else if (inet_pton(AF_INET6, value, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family   = AF_INET6;
+        sin6->sin6_port     = htons(_kCFHostDNSPort);
+        sin6->sin6_scope_id = scope ? if_nametoindex(scope) : 0;
+        _DNSServerCount++;
+      }
+    }
+
+    else if (!strcmp(keyword, "options")) {
+      while ((value = strtok_r(NULL, " \t\r\n", &saved))) {
+        if (!strncmp(value, "timeout:", 8))
+          _DNSTimeout = _DNSClamp(atoi(value + 8), _kCFHostDNSMaxTimeout);
+
+        else if (!strncmp(value, "attempts:", 9))
+          _DNSAttempts = _DNSClamp(atoi(value + 9), _kCFHostDNSMaxAttempts);
+      }
+    }
+  }
+
+  if (file)
+    fclose(file);
+
+  // Fall back on the local name server.
+  if (!_DNSServerCount) {
+    struct sockaddr_in* sin = (struct sockaddr_in*)&_DNSServers[0];
+
+    memset(&_DNSServers[0], 0, sizeof(_DNSServers[0]));
+
+    sin->sin_family      = AF_INET;
+    sin->sin_port        = htons(_kCFHostDNSPort);
+    sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    _DNSServerCount      = 1;
+  }
+}
+
+/* static */
+Boolean _DNSIsNameServer_Locked(const struct sockaddr_storage* from)
+{
+  CFIndex i;
+
+  for (i = 0; i < _DNSServerCount; i++) {
+    const struct sockaddr_storage* server = &_DNSServers[i];
+
+    if (server->ss_family != from->ss_family)
+      continue;
+
+    if (server->ss_family == AF_INET) {
+      const struct sockaddr_in* a = (const struct sockaddr_in*)server;
+      const struct sockaddr_in* b = (const struct sockaddr_in*)from;
+
+      if ((a->sin_port == b->sin_port) && (a->sin_addr.s_addr == b->sin_addr.s_addr))
+        return TRUE;
+    }
+
+    else {
+      const struct sockaddr_in6* a = (const struct sockaddr_in6*)server;
+      const struct sockaddr_in6* b = (const struct sockaddr_in6*)from;
+
+      if ((a->sin6_port == b->sin6_port) && !memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)))
+        return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/**
+ *  @brief
+ *    Pick a transaction ID no outstanding question is using.
+ *
+ *  @returns
+ *    TRUE with the ID in id; FALSE if none turned up within
+ *    _kCFHostDNSMaxIDAttempts tries, as when nearly all are taken.
+ */
+/* static */
+Boolean _DNSCreateID_Locked(UInt16* id)
+{
+  int attempts;
+
+  // Random IDs, along with the kernel's random source ports, make replies hard to spoof.
+  for (attempts = 0; attempts < _kCFHostDNSMaxIDAttempts; attempts++) {
+    if (getrandom(id, sizeof(*id), GRND_NONBLOCK) != sizeof(*id))
+      *id = (UInt16)random();
+
+    if (!CFDictionaryContainsKey(_DNSQueries, (const void*)(uintptr_t)*id))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/**
+ *  @brief
+ *    Build the query message for a question, in the question's
+ *    packet, after room for the length prefix used over TCP.
+ *
+ *  @returns
+ *    TRUE if the name could be encoded; otherwise, FALSE.
+ *
+ */
+/* static */
+Boolean _DNSQuestionEncode(_CFHostDNSQuestion* question, const char* name)
+{
+  UInt8*      p   = question->_packet + 2;
+  UInt8*      end = question->_packet + sizeof(question->_packet);
+  const char* label;
+
+  memset(p, 0, _kCFHostDNSHeaderSize);
+
+  // ID, recursion desired, and one question.
+  p[0]  = question->_id >> 8;
+  p[1]  = question->_id & 0xFF;
+  p[2]  = 0x01;
+  p[5]  = 1;
+  p    += _kCFHostDNSHeaderSize;
+
+  // The name as a run of labels, ignoring a trailing dot.
+  for (label = name; *label;) {
+    const char* dot    = strchr(label, '.');
+    size_t      length = dot ? (size_t)(dot - label) : strlen(label);
+
+    if (!length || (length > _kCFHostDNSMaxLabelSize) || ((p + 1 + length) >= (end - 5)))
+      return FALSE;
+
+    *p++ = (UInt8)length;
+    memmove(p, label, length);
+    p     += length;
+    label += length;
+
+    if (*label)
+      label++;
+  }
+
+  if ((p - (question->_packet + 2 + _kCFHostDNSHeaderSize)) + 1 > _kCFHostDNSMaxNameSize)
+    return FALSE;
+
+  *p++                  = 0;
+  *p++                  = question->_type >> 8;
+  *p++                  = question->_type & 0xFF;
+  *p++                  = question->_class >> 8;
+  *p++                  = question->_class & 0xFF;
+
+  question->_length     = p - (question->_packet + 2);
+  question->_packet[0]  = question->_length >> 8;
+  question->_packet[1]  = question->_length & 0xFF;
+
+  return TRUE;
+}
+
+/**
+ *  @brief
+ *    Expand a possibly compressed name in a message into its run of
+ *    labels.
+ *
+ *  @returns
+ *    The offset just past the name where it appears in the message;
+ *    otherwise, -1 if the name is malformed.
+ *
+ */
+/* static */
+CFIndex _DNSExpandName(const UInt8* message, CFIndex length, CFIndex offset, UInt8* name, CFIndex* nameLength)
+{
+  CFIndex result = -1;
+  CFIndex used   = 0;
+  CFIndex jumps  = 0;
+
+  while (offset < length) {
+    UInt8 count = message[offset];
+
+    // A pointer to the rest of the name somewhere earlier.
+    if ((count & 0xC0) == 0xC0) {
+      if (((offset + 1) >= length) || (++jumps > _kCFHostDNSMaxPointers))
+        return -1;
+
+      if (result == -1)
+        result = offset + 2;
+
+      offset = ((count & 0x3F) << 8) | message[offset + 1];
+      continue;
+    }
+
+    if (count & 0xC0)
+      return -1;
+
+    if (((offset + 1 + count) > length) || ((used + 1 + count) > _kCFHostDNSMaxNameSize))
+      return -1;
+
+    if (name)
+      memmove(name + used, message + offset, 1 + count);
+
+    used   += 1 + count;
+    offset += 1 + count;
+
+    if (!count) {
+      if (nameLength)
+        *nameLength = used;
+
+      return (result == -1) ? offset : result;
+    }
+  }
+
+  return -1;
+}
+
+/* static */
+Boolean _DNSNameEqual(const UInt8* name1, const UInt8* name2, CFIndex length)
+{
+  CFIndex i;
+
+  // Label lengths never fall in the range of letters, so all bytes can be folded.
+  for (i = 0; i < length; i++) {
+    if (tolower(name1[i]) != tolower(name2[i]))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* static */
+void _DNSFreeAddrInfo(struct addrinfo* info)
+{
+  while (info) {
+    struct addrinfo* next = info->ai_next;
+
+    CFAllocatorDeallocate(kCFAllocatorDefault, info);
+    info = next;
+  }
+}
+
+/**
+ *  @brief
+ *    Add an address from an answer to a question's results.
+ *
+ *  Each result is a single allocation holding the addrinfo and the
+ *  address it points at, freed by _DNSFreeAddrInfo.
+ *
+ */
+/* static */
+void _DNSQuestionAddAddress(_CFHostDNSQuery* query, _CFHostDNSQuestion* question, const UInt8* rdata)
+{
+  struct addrinfo*  info;
+  struct addrinfo** tail;
+  const int         family = (question->_type == _kCFHostDNSTypeAAAA) ? AF_INET6 : AF_INET;
+  const socklen_t   length = (family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+  info                     = (struct addrinfo*)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(info[0]) + sizeof(struct sockaddr_in6), 0);
+  if (!info)
+    return;
+
+  memset(info, 0, sizeof(info[0]) + sizeof(struct sockaddr_in6));
+
+  info->ai_family   = family;
+  info->ai_socktype = query->_socktype;
+  info->ai_protocol = query->_protocol;
+  info->ai_addrlen  = length;
+  info->ai_addr     = (struct sockaddr*)(info + 1);
+
+  if (family == AF_INET6) {
+    ((struct sockaddr_in6*)info->ai_addr)->sin6_family = AF_INET6;
+    memmove(&((struct sockaddr_in6*)info->ai_addr)->sin6_addr, rdata, 16);
+  }
+
+  else {
+    ((struct sockaddr_in*)info->ai_addr)->sin_family = AF_INET;
+    memmove(&((struct sockaddr_in*)info->ai_addr)->sin_addr, rdata, 4);
+  }
+
+  // Keep the answers in the order the server gave them.
+  for (tail = &question->_result; *tail; tail = &(*tail)->ai_next)
+    ;
+
+  *tail = info;
+}
+
+/**
+ *  @brief
+ *    Pull the addresses, and the lowest TTL along the way, out of the
+ *    answers in a reply.
+ *
+ *  @returns
+ *    TRUE if the answers were well formed; otherwise, FALSE.
+ *
+ */
+/* static */
+Boolean _DNSQuestionParseAnswers(_CFHostDNSQuery* query, _CFHostDNSQuestion* question, const UInt8* message, CFIndex length, CFIndex offset)
+{
+  CFIndex count = (message[6] << 8) | message[7];
+
+  while (count--) {
+    UInt16 type, class;
+    UInt32 ttl;
+    CFIndex rdlength;
+
+    offset = _DNSExpandName(message, length, offset, NULL, NULL);
+    if ((offset == -1) || ((offset + 10) > length))
+      return FALSE;
+
+    type     = (message[offset] << 8) | message[offset + 1];
+    class    = (message[offset + 2] << 8) | message[offset + 3];
+    ttl      = ((UInt32)message[offset + 4] << 24) | (message[offset + 5] << 16) | (message[offset + 6] << 8) | message[offset + 7];
+    rdlength = (message[offset + 8] << 8) | message[offset + 9];
+    offset  += 10;
+
+    if ((offset + rdlength) > length)
+      return FALSE;
+
+    if (class == question->_class) {
+      // The chain of aliases holds the addresses no longer than its shortest link.
+      if ((type == question->_type) || (type == _kCFHostDNSTypeCNAME)) {
+        if (!query->_hasTTL || (ttl < query->_ttl))
+          query->_ttl = ttl;
+
+        query->_hasTTL = TRUE;
+      }
+
+      if ((type == _kCFHostDNSTypeA) && (question->_type == type) && (rdlength == 4))
+        _DNSQuestionAddAddress(query, question, message + offset);
+
+      else if ((type == _kCFHostDNSTypeAAAA) && (question->_type == type) && (rdlength == 16))
+        _DNSQuestionAddAddress(query, question, message + offset);
+    }
+
+    offset += rdlength;
+  }
+
+  return TRUE;
+}
+
+/* static */
+void _DNSQuestionCloseStream_Locked(_CFHostDNSQuestion* question)
+{
+  if (question->_stream) {
+    CFFileDescriptorInvalidate(question->_stream);
+    CFRelease(question->_stream);
+    question->_stream = NULL;
+  }
+
+  if (question->_streamSource) {
+    CFRunLoopSourceInvalidate(question->_streamSource);
+    CFRelease(question->_streamSource);
+    question->_streamSource = NULL;
+  }
+
+  if (question->_buffer) {
+    CFAllocatorDeallocate(kCFAllocatorDefault, question->_buffer);
+    question->_buffer = NULL;
+  }
+}
+
+/**
+ *  @brief
+ *    Finish a question, taking it out of the table of outstanding
+ *    queries so late or duplicate replies are dropped.
+ *
+ *  @note
+ *    This must be called with _DNSLock held.
+ *
+ */
+/* static */
+void _DNSQuestionFinish_Locked(_CFHostDNSQuestion* question, int status)
+{
+  if (question->_done)
+    return;
+
+  question->_done   = TRUE;
+  question->_status = status;
+
+  CFDictionaryRemoveValue(_DNSQueries, (const void*)(uintptr_t)question->_id);
+
+  _DNSQuestionCloseStream_Locked(question);
+}
+
+/**
+ *  @brief
+ *    Finish a query once all of its questions are done, and signal
+ *    the lookup so its CFHost is called back.
+ *
+ *  @note
+ *    This must be called with _DNSLock held.
+ *
+ */
+/* static */
+void _DNSQueryFinishIfDone_Locked(_CFHostDNSQuery* query)
+{
+  struct addrinfo** tail = &query->_result;
+  CFIndex           i, count;
+  int               status = EAI_NODATA;
+
+  if (query->_done)
+    return;
+
+  for (i = 0; i < query->_count; i++) {
+    if (!query->_questions[i]._done)
+      return;
+  }
+
+  // Put together the addresses, in the order of the questions.
+  for (i = 0; i < query->_count; i++) {
+    _CFHostDNSQuestion* question = &query->_questions[i];
+
+    *tail                        = question->_result;
+    question->_result            = NULL;
+
+    while (*tail)
+      tail = &(*tail)->ai_next;
+
+    // A missing name beats a temporary failure, which beats a missing record.
+    if (question->_status == EAI_NONAME)
+      status = EAI_NONAME;
+
+    else if ((status != EAI_NONAME) && (question->_status == EAI_AGAIN))
+      status = EAI_AGAIN;
+
+    else if ((status == EAI_NODATA) && (question->_status != 0))
+      status = question->_status;
+  }
+
+  if (query->_addresses)
+    query->_status = query->_result ? 0 : status;
+
+  else
+    query->_status = query->_reply ? 0 : ((status == EAI_NODATA) ? EAI_FAIL : status);
+
+  query->_done = TRUE;
+
+  if (query->_timer)
+    CFRunLoopTimerInvalidate(query->_timer);
+
+  if (query->_source) {
+    CFRunLoopSourceSignal(query->_source);
+
+    count = CFArrayGetCount(query->_schedules);
+
+    for (i = 0; i < count; i += 2)
+      CFRunLoopWakeUp((CFRunLoopRef)CFArrayGetValueAtIndex(query->_schedules, i));
+  }
+}
+
+/* static */
+int _DNSOpenSocket_Locked(int family)
+{
+  const int               index  = (family == AF_INET6) ? 1 : 0;
+  const int               buffer = _kCFHostDNSReceiveBufferSize;
+  CFFileDescriptorContext ctxt   = {0, NULL, NULL, NULL, NULL};
+  CFIndex                 i, count;
+  int                     fd;
+
+  if (_DNSSockets[index] != -1)
+    return _DNSSockets[index];
+
+  fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+
+  // Room for a burst of replies to many lookups at once; the kernel may cap it.
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+
+  _DNSSocketRefs[index] = CFFileDescriptorCreate(kCFAllocatorDefault, fd, TRUE, _DNSSocketCallBack, &ctxt);
+  if (!_DNSSocketRefs[index]) {
+    close(fd);
+    return -1;
+  }
+
+  _DNSSocketSources[index] = CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault, _DNSSocketRefs[index], 0);
+  if (!_DNSSocketSources[index]) {
+    CFFileDescriptorInvalidate(_DNSSocketRefs[index]);
+    CFRelease(_DNSSocketRefs[index]);
+    _DNSSocketRefs[index] = NULL;
+    return -1;
+  }
+
+  CFFileDescriptorEnableCallBacks(_DNSSocketRefs[index], kCFFileDescriptorReadCallBack);
+
+  // Replies are read on whichever of the lookups' run loops gets to them first.
+  count = CFArrayGetCount(_DNSSchedules);
+
+  for (i = 0; i < count; i += 2) {
+    CFRunLoopAddSource((CFRunLoopRef)CFArrayGetValueAtIndex(_DNSSchedules, i), _DNSSocketSources[index],
+                       (CFStringRef)CFArrayGetValueAtIndex(_DNSSchedules, i + 1));
+  }
+
+  _DNSSockets[index] = fd;
+
+  return fd;
+}
+
+/**
+ *  @brief
+ *    Send the unanswered questions of a query to its current name
+ *    server, and arm the timer for the retry.
+ *
+ *  @note
+ *    This must be called with _DNSLock held.
+ *
+ */
+/* static */
+void _DNSQuerySend_Locked(_CFHostDNSQuery* query)
+{
+  const struct sockaddr_storage* server = &_DNSServers[query->_server % _DNSServerCount];
+  const socklen_t                length = (server->ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+  const int                      fd     = _DNSOpenSocket_Locked(server->ss_family);
+  CFIndex                        i;
+
+  query->_tries++;
+
+  // Failures to send are left to the timer, like lost datagrams.
+  for (i = 0; (fd != -1) && (i < query->_count); i++) {
+    _CFHostDNSQuestion* question = &query->_questions[i];
+
+    if (!question->_done && !question->_stream)
+      sendto(fd, question->_packet + 2, question->_length, MSG_NOSIGNAL, (const struct sockaddr*)server, length);
+  }
+
+  query->_deadline = CFAbsoluteTimeGetCurrent() + _DNSTimeout;
+
+  if (query->_timer)
+    CFRunLoopTimerSetNextFireDate(query->_timer, query->_deadline);
+}
+
+/**
+ *  @brief
+ *    Move a query on to the next name server, or give up on it once
+ *    every server has had all of its attempts.
+ *
+ *  @note
+ *    This must be called with _DNSLock held.
+ *
+ */
+/* static */
+void _DNSQueryRetry_Locked(_CFHostDNSQuery* query)
+{
+  CFIndex i;
+
+  if (query->_tries < (_DNSAttempts * _DNSServerCount)) {
+    query->_server++;
+    _DNSQuerySend_Locked(query);
+  }
+
+  else {
+    for (i = 0; i < query->_count; i++)
+      _DNSQuestionFinish_Locked(&query->_questions[i], EAI_AGAIN);
+
+    _DNSQueryFinishIfDone_Locked(query);
+  }
+}
+
+/**
+ *  @brief
+ *    Start asking a question again over TCP, after the UDP reply came
+ *    back truncated.
+ *
+ *  The stream is scheduled wherever the lookup is.
+ *
+ *  @note
+ *    This must be called with _DNSLock held.
+ *
+ */
+/* static */
+void _DNSQuestionStartStream_Locked(_CFHostDNSQuery* query, _CFHostDNSQuestion* question, const struct sockaddr_storage* server)
+{
+  const socklen_t         length = (server->ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+  CFFileDescriptorContext ctxt   = {0, query, NULL, NULL, NULL};
+  CFIndex                 i, count;
+  int                     fd;
+
+  fd                             = socket(server->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    _DNSQuestionFinish_Locked(question, EAI_AGAIN);
+    return;
+  }
+
+  if ((connect(fd, (const struct sockaddr*)server, length) == -1) && (errno != EINPROGRESS)) {
+    close(fd);
+    _DNSQuestionFinish_Locked(question, EAI_AGAIN);
+    return;
+  }
+
+  question->_stream = CFFileDescriptorCreate(kCFAllocatorDefault, fd, TRUE, _DNSStreamCallBack, &ctxt);
+  if (question->_stream)
+    question->_streamSource = CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault, question->_stream, 0);
+
+  if (!question->_streamSource) {
+    if (!question->_stream)
+      close(fd);
+
+    _DNSQuestionFinish_Locked(question, EAI_AGAIN);
+    return;
+  }
+
+  question->_offset = 0;
+
+  // Wait for the connection, then write the query with its length.
+  CFFileDescriptorEnableCallBacks(question->_stream, kCFFileDescriptorWriteCallBack);
+
+  count = CFArrayGetCount(query->_schedules);
+
+  for (i = 0; i < count; i += 2) {
+    CFRunLoopAddSource((CFRunLoopRef)CFArrayGetValueAtIndex(query->_schedules, i), question->_streamSource,
+                       (CFStringRef)CFArrayGetValueAtIndex(query->_schedules, i + 1));
+  }
+}
+
+/**
+ *  @brief
+ *    Handle a reply to one of a query's questions.
+ *
+ *  Replies which don't echo the question are dropped.  A truncated
+ *  reply over UDP moves the question to TCP, and a server failure
+ *  moves the query to the next server.
+ *
+ *  @note
+ *    This must be called with _DNSLock held.
+ *
+ */
+/* static */
+void _DNSQuestionHandleReply_Locked(_CFHostDNSQuery*               query,
+                                    _CFHostDNSQuestion*            question,
+                                    const UInt8*                   message,
+                                    CFIndex                        length,
+                                    const struct sockaddr_storage* from,
+                                    Boolean                        stream)
+{
+  UInt8   name[_kCFHostDNSMaxNameSize];
+  CFIndex nameLength = 0;
+  CFIndex offset;
+  UInt16  flags;
+  int     rcode;
+
+  if ((length < _kCFHostDNSHeaderSize) || question->_done || (!stream && question->_stream))
+    return;
+
+  flags = (message[2] << 8) | message[3];
+
+  // It must be a response to exactly the question asked.
+  if (!(flags & 0x8000) || (message[4] != 0) || (message[5] != 1))
+    return;
+
+  offset = _DNSExpandName(message, length, _kCFHostDNSHeaderSize, name, &nameLength);
+  if ((offset == -1) || ((offset + 4) > length))
+    return;
+
+  if ((nameLength != (question->_length - _kCFHostDNSHeaderSize - 4)) ||
+      !_DNSNameEqual(name, question->_packet + 2 + _kCFHostDNSHeaderSize, nameLength) ||
+      memcmp(message + offset, question->_packet + 2 + question->_length - 4, 4))
+    return;
+
+  offset += 4;
+  rcode   = flags & 0x000F;
+
+  // Too big for a datagram, so ask again over TCP.
+  if ((flags & 0x0200) && !stream) {
+    _DNSQuestionStartStream_Locked(query, question, from);
+    _DNSQueryFinishIfDone_Locked(query);
+    return;
+  }
+
+  switch (rcode) {
+    case _kCFHostDNSRcodeNoError:
+    case _kCFHostDNSRcodeNXDomain:
+      if (query->_addresses) {
+        if (!_DNSQuestionParseAnswers(query, question, message, length, offset)) {
+          _DNSQuestionFinish_Locked(question, EAI_FAIL);
+          break;
+        }
+
+        _DNSQuestionFinish_Locked(question, (rcode == _kCFHostDNSRcodeNXDomain) ? EAI_NONAME : (question->_result ? 0 : EAI_NODATA));
+      }
+
+      // Record lookups hand back the whole reply, as dns_async does.
+      else {
+        query->_reply = (UInt8*)CFAllocatorAllocate(kCFAllocatorDefault, length, 0);
+
+        if (query->_reply) {
+          memmove(query->_reply, message, length);
+          memmove(&query->_from, from, sizeof(query->_from));
+          query->_replyLength = length;
+        }
+
+        _DNSQuestionFinish_Locked(question, query->_reply ? 0 : EAI_MEMORY);
+      }
+      break;
+
+    // This server can't help, so try the next one now.
+    case _kCFHostDNSRcodeServFail:
+    case _kCFHostDNSRcodeNotImp:
+    case _kCFHostDNSRcodeRefused:
+      if (stream)
+        _DNSQuestionFinish_Locked(question, EAI_AGAIN);
+      else
+        _DNSQueryRetry_Locked(query);
+      break;
+
+    default:
+      _DNSQuestionFinish_Locked(question, EAI_FAIL);
+      break;
+  }
+
+  _DNSQueryFinishIfDone_Locked(query);
+}
+
+/* static */
+void _DNSSocketCallBack(CFFileDescriptorRef fdref, CFOptionFlags callBackTypes, void* info)
+{
+  const int fd = CFFileDescriptorGetNativeDescriptor(fdref);
+  UInt8     message[_kCFHostDNSMaxUDPSize];
+
+  // Drain everything that has arrived; one wakeup serves many lookups.
+  for (;;) {
+    struct sockaddr_storage from;
+    socklen_t               fromLength = sizeof(from);
+    ssize_t                 length     = recvfrom(fd, message, sizeof(message), 0, (struct sockaddr*)&from, &fromLength);
+    _CFHostDNSQuery*        query;
+    UInt16                  id;
+    CFIndex                 i;
+
+    if (length == -1) {
+      if (errno == EINTR)
+        continue;
+
+      break;
+    }
+
+    if (length < _kCFHostDNSHeaderSize)
+      continue;
+
+    id = (message[0] << 8) | message[1];
+
+    _CFMutexLock(&_DNSLock);
+
+    query = (_CFHostDNSQuery*)CFDictionaryGetValue(_DNSQueries, (const void*)(uintptr_t)id);
+
+    if (query && _DNSIsNameServer_Locked(&from)) {
+      for (i = 0; i < query->_count; i++) {
+        if (query->_questions[i]._id == id) {
+          _DNSQuestionHandleReply_Locked(query, &query->_questions[i], message, length, &from, FALSE);
+          break;
+        }
+      }
+    }
+
+    _CFMutexUnlock(&_DNSLock);
+  }
+
+  CFFileDescriptorEnableCallBacks(fdref, kCFFileDescriptorReadCallBack);
+}
+
+/* static */
+void _DNSStreamCallBack(CFFileDescriptorRef fdref, CFOptionFlags callBackTypes, void* info)
+{
+  _CFHostDNSQuery*    query    = (_CFHostDNSQuery*)info;
+  _CFHostDNSQuestion* question = NULL;
+  const int           fd       = CFFileDescriptorGetNativeDescriptor(fdref);
+  CFIndex             i;
+
+  _CFMutexLock(&_DNSLock);
+
+  for (i = 0; i < query->_count; i++) {
+    if (query->_questions[i]._stream == fdref)
+      question = &query->_questions[i];
+  }
+
+  // Write the query, with its length in front.
+  if (question && (callBackTypes & kCFFileDescriptorWriteCallBack)) {
+    ssize_t written = send(fd, question->_packet + question->_offset, question->_length + 2 - question->_offset, MSG_NOSIGNAL);
+
+    if ((written == -1) && (errno != EAGAIN) && (errno != EINTR))
+      _DNSQuestionFinish_Locked(question, EAI_AGAIN);
+
+    else {
+      if (written > 0)
+        question->_offset += written;
+
+      if (question->_offset < (question->_length + 2))
+        CFFileDescriptorEnableCallBacks(fdref, kCFFileDescriptorWriteCallBack);
+
+      else {
+        question->_offset = 0;
+        CFFileDescriptorEnableCallBacks(fdref, kCFFileDescriptorReadCallBack);
+      }
+    }
+  }
+
+  // Read the length of the reply, then the reply.
+  else if (question && (callBackTypes & kCFFileDescriptorReadCallBack)) {
+    ssize_t bytes;
+    Boolean failed = FALSE;
+
+    if (!question->_buffer) {
+      bytes = recv(fd, question->_prefix + question->_offset, sizeof(question->_prefix) - question->_offset, 0);
+
+      if ((bytes > 0) && ((question->_offset += bytes) == sizeof(question->_prefix))) {
+        question->_replyLength = (question->_prefix[0] << 8) | question->_prefix[1];
+        question->_offset      = 0;
+
+        if (question->_replyLength >= _kCFHostDNSHeaderSize)
+          question->_buffer = (UInt8*)CFAllocatorAllocate(kCFAllocatorDefault, question->_replyLength, 0);
+
+        failed = (question->_buffer == NULL);
+      }
+    }
+
+    else {
+      bytes = recv(fd, question->_buffer + question->_offset, question->_replyLength - question->_offset, 0);
+      if (bytes > 0)
+        question->_offset += bytes;
+    }
+
+    if (failed || (bytes == 0) || ((bytes == -1) && (errno != EAGAIN) && (errno != EINTR)))
+      _DNSQuestionFinish_Locked(question, EAI_AGAIN);
+
+    else if (question->_buffer && (question->_offset == question->_replyLength)) {
+      struct sockaddr_storage from;
+      socklen_t               fromLength = sizeof(from);
+
+      memset(&from, 0, sizeof(from));
+      getpeername(fd, (struct sockaddr*)&from, &fromLength);
+
+      _DNSQuestionHandleReply_Locked(query, question, question->_buffer, question->_replyLength, &from, TRUE);
+
+      // A reply which didn't match is as good as none.
+      _DNSQuestionFinish_Locked(question, EAI_AGAIN);
+    }
+
+    else
+      CFFileDescriptorEnableCallBacks(fdref, kCFFileDescriptorReadCallBack);
+  }
+
+  _DNSQueryFinishIfDone_Locked(query);
+
+  _CFMutexUnlock(&_DNSLock);
+}
 
 /* static */
-int _SignalFdClearGetAddrInfoSignalWithHost(_CFHost* host)
+void _DNSLookupTimerCallBack(CFRunLoopTimerRef timer, void* info)
 {
-  const int signal = __kCFHostLinuxSignalFdSignal;
-  sigset_t  sigset;
-  int       result;
-
-  __CFSpinLock(&host->_lock);
+  _CFHostDNSQuery* query = (_CFHostDNSQuery*)info;
 
-  result = _SignalFdClearSignalWithError(signal, &sigset, &host->_error);
+  _CFMutexLock(&_DNSLock);
 
-  __CFSpinUnlock(&host->_lock);
+  if (!query->_done)
+    _DNSQueryRetry_Locked(query);
 
-  return result;
+  _CFMutexUnlock(&_DNSLock);
 }
 
+/**
+ *  @brief
+ *    Put a query's retry timer on the first run loop the lookup is
+ *    scheduled on, in each of its modes there.
+ *
+ *  A timer only runs on a single run loop, so the timer is created
+ *  afresh whenever the lookup's schedules change.
+ *
+ *  @note
+ *    This must be called with _DNSLock held.
+ *
+ */
 /* static */
-int _CreateSignalFd(int signal, CFStreamError* error)
+void _DNSQueryScheduleTimer_Locked(_CFHostDNSQuery* query)
 {
-  const int kInvalidExistingDescriptor = -1;
-  const int flags                      = 0;
-  sigset_t  sigset;
-  int       status;
-  int       result = -1;
+  CFRunLoopTimerContext ctxt = {0, query, NULL, NULL, NULL};
+  CFIndex               i, count = CFArrayGetCount(query->_schedules);
+  CFRunLoopRef          rl;
+
+  if (query->_timer) {
+    CFRunLoopTimerInvalidate(query->_timer);
+    CFRelease(query->_timer);
+    query->_timer = NULL;
+  }
 
-  status           = _SignalFdSetSignalWithError(signal, &sigset, error);
-  __Require(status == 0, done);
+  if (query->_done || !count)
+    return;
 
-  result = signalfd(kInvalidExistingDescriptor, &sigset, flags);
-  __Require_Action(result != -1, done, error->error = errno; error->domain = kCFStreamErrorDomainPOSIX);
+  // Repeating, so it stays valid to be pushed back as the query is sent again.
+  query->_timer = CFRunLoopTimerCreate(kCFAllocatorDefault, query->_deadline, _DNSTimeout, 0, 0, _DNSLookupTimerCallBack, &ctxt);
+  if (!query->_timer)
+    return;
 
-done:
-  return result;
+  rl = (CFRunLoopRef)CFArrayGetValueAtIndex(query->_schedules, 0);
+
+  for (i = 0; i < count; i += 2) {
+    if (CFArrayGetValueAtIndex(query->_schedules, i) == rl)
+      CFRunLoopAddTimer(rl, query->_timer, (CFStringRef)CFArrayGetValueAtIndex(query->_schedules, i + 1));
+  }
 }
 
 /* static */
-struct gaicb* _SignalFdGetAddrInfoResult(CFFileDescriptorRef fdref)
+void _DNSLookupSchedule(void* info, CFRunLoopRef rl, CFStringRef mode)
 {
-  CFFileDescriptorNativeDescriptor fd;
-  struct signalfd_siginfo          fdsi;
-  ssize_t                          status;
-  struct gaicb*                    result = NULL;
+  _CFHostDNSQuery* query = (_CFHostDNSQuery*)info;
+  CFIndex          i;
 
-  fd                                      = CFFileDescriptorGetNativeDescriptor(fdref);
-  __Require(fd != -1, done);
+  _CFMutexLock(&_DNSLock);
 
-  do {
-    status = read(fd, &fdsi, sizeof(fdsi));
-  } while ((status == -1) && (errno == EAGAIN));
-  __Require(status == sizeof(fdsi), done);
+  if (_SchedulesAddRunLoopAndMode(query->_schedules, rl, mode)) {
+    // The shared sockets are scheduled once for all the lookups on a run loop and mode.
+    if (_SchedulesFind(_DNSSchedules, rl, mode) == kCFNotFound) {
+      for (i = 0; i < 2; i++) {
+        if (_DNSSocketSources[i])
+          CFRunLoopAddSource(rl, _DNSSocketSources[i], mode);
+      }
+    }
 
-  __Require(fdsi.ssi_signo == __kCFHostLinuxSignalFdSignal, done);
-  __Require(fdsi.ssi_code == SI_ASYNCNL, done);
+    CFArrayAppendValue(_DNSSchedules, rl);
+    CFArrayAppendValue(_DNSSchedules, mode);
 
-  result = (struct gaicb*)(fdsi.ssi_ptr);
-  __Require(result != NULL, done);
+    for (i = 0; i < query->_count; i++) {
+      if (query->_questions[i]._streamSource)
+        CFRunLoopAddSource(rl, query->_questions[i]._streamSource, mode);
+    }
 
-done:
+    _DNSQueryScheduleTimer_Locked(query);
+  }
 
-  return result;
-}
+  // A result that's already in needs the new run loop to notice the signal.
+  if (query->_done)
+    CFRunLoopWakeUp(rl);
 
-  #pragma mark - Address Lookup
+  _CFMutexUnlock(&_DNSLock);
+}
 
 /* static */
-void _MasterAddressLookupCallBack_Linux(CFFileDescriptorRef fdref, CFOptionFlags callBackTypes, void* info)
+void _DNSUnschedule_Locked(CFRunLoopRef rl, CFStringRef mode)
 {
-  int           status;
-  struct gaicb* request = NULL;
+  CFIndex i = _SchedulesFind(_DNSSchedules, rl, mode);
+
+  if (i == kCFNotFound)
+    return;
 
-  // Attempt to retrieve the getaddrinfo_a result that fired the
-  // completion signal that triggered this callback.
+  CFArrayReplaceValues(_DNSSchedules, CFRangeMake(i, 2), NULL, 0);
 
-  request               = _SignalFdGetAddrInfoResult(fdref);
-  __Require(request != NULL, done);
+  // Last lookup out takes the shared sockets with it.
+  if (_SchedulesFind(_DNSSchedules, rl, mode) == kCFNotFound) {
+    for (i = 0; i < 2; i++) {
+      if (_DNSSocketSources[i])
+        CFRunLoopRemoveSource(rl, _DNSSocketSources[i], mode);
+    }
+  }
+}
 
-  // Invoke the common, shared getaddrinfo{,_a} callback.
+/* static */
+void _DNSLookupCancel(void* info, CFRunLoopRef rl, CFStringRef mode)
+{
+  _CFHostDNSQuery* query = (_CFHostDNSQuery*)info;
+  CFIndex          i;
 
-  _GetAddrInfoCallBack(gai_error(request), request->ar_result, info);
+  _CFMutexLock(&_DNSLock);
 
-  // Release the buffer that was previously allocated for the lookup
-  // name when the request was made as well as the request itself.
+  if (_SchedulesRemoveRunLoopAndMode(query->_schedules, rl, mode)) {
+    _DNSUnschedule_Locked(rl, mode);
 
-  CFAllocatorDeallocate(kCFAllocatorDefault, (void*)request->ar_name);
-  CFAllocatorDeallocate(kCFAllocatorDefault, request);
+    for (i = 0; i < query->_count; i++) {
+      if (query->_questions[i]._streamSource)
+        CFRunLoopRemoveSource(rl, query->_questions[i]._streamSource, mode);
+    }
 
-done:
-  // Clear the signal we previously established to trigger this callback.
-  status = _SignalFdClearGetAddrInfoSignalWithHost(info);
-  __Verify(status == 0);
+    _DNSQueryScheduleTimer_Locked(query);
+  }
 
-  CFFileDescriptorInvalidate(fdref);
-  CFRelease(fdref);
+  _CFMutexUnlock(&_DNSLock);
 }
 
 /* static */
-int _CreateAddressLookupRequest(const char* name, CFHostInfoType info, int signal, CFStreamError* error)
+void _DNSLookupPerform(void* info)
 {
-  struct sigevent     sigev;
-  _CFHostGAIARequest* gai_request = NULL;
-  int                 result      = -1;
+  _CFHostDNSQuery* query = (_CFHostDNSQuery*)info;
+  _CFHost*         host  = (_CFHost*)query->_context;
+  Boolean          done;
+
+  _CFMutexLock(&_DNSLock);
+  done = query->_done;
+  _CFMutexUnlock(&_DNSLock);
 
-  __Require_Action(name != NULL, done, result = -EINVAL);
+  // Results don't change once done, so they can be used without the lock.
+  if (!done)
+    return;
 
-  memset(&sigev, 0, sizeof(sigev));
+  if (!query->_addresses)
+    _DNSCallBack(query->_status, (char*)query->_reply, (uint32_t)query->_replyLength, (struct sockaddr*)&query->_from,
+                 (query->_from.ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in), host);
+
+  else {
+    // Pass the record TTL along for the cache.
+    if (query->_hasTTL) {
+      CFNumberRef ttl = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &query->_ttl);
 
-  gai_request = (_CFHostGAIARequest*)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(_CFHostGAIARequest), 0);
-  __Require_Action(gai_request != NULL, done, result = -ENOMEM; error->error = -result; error->domain = kCFStreamErrorDomainPOSIX);
+      if (ttl) {
+        __CFSpinLock(&host->_lock);
 
-  _InitGetAddrInfoHints(info, &gai_request->_request_hints);
+        if (host->_lookup)
+          CFDictionarySetValue(host->_info, (const void*)_kCFHostTimeToLive, ttl);
 
-  memset(&gai_request->_request_gaicb, 0, sizeof(struct gaicb));
+        __CFSpinUnlock(&host->_lock);
 
-  gai_request->_request_gaicb.ar_name    = name;
-  gai_request->_request_gaicb.ar_request = &gai_request->_request_hints;
+        CFRelease(ttl);
+      }
+    }
 
-  gai_request->_request_list[0]          = &gai_request->_request_gaicb;
+    // The query owns the results and frees them when the lookup goes away.
+    _GetAddrInfoCallBackWithFree(query->_status, query->_result, host, NULL);
+  }
+}
 
-  sigev.sigev_notify                     = SIGEV_SIGNAL;
-  sigev.sigev_value.sival_ptr            = &gai_request->_request_gaicb;
-  sigev.sigev_signo                      = signal;
+/* static */
+void _DNSLookupRelease(const void* info)
+{
+  _CFHostDNSQuery* query = (_CFHostDNSQuery*)info;
+  CFIndex          i;
 
-  result                                 = getaddrinfo_a(GAI_NOWAIT, gai_request->_request_list, 1, &sigev);
+  _CFMutexLock(&_DNSLock);
 
-  if (result != 0) {
-    _HandleGetAddrInfoStatus(result, error, TRUE);
+  for (i = 0; i < query->_count; i++) {
+    _DNSQuestionFinish_Locked(&query->_questions[i], EAI_AGAIN);
+    _DNSFreeAddrInfo(query->_questions[i]._result);
+  }
 
-    CFAllocatorDeallocate(kCFAllocatorDefault, gai_request);
+  // Normally canceled already, but leave no stray schedules behind.
+  while (CFArrayGetCount(query->_schedules)) {
+    _DNSUnschedule_Locked((CFRunLoopRef)CFArrayGetValueAtIndex(query->_schedules, 0),
+                          (CFStringRef)CFArrayGetValueAtIndex(query->_schedules, 1));
+    CFArrayReplaceValues(query->_schedules, CFRangeMake(0, 2), NULL, 0);
   }
 
-done:
-  return result;
+  query->_done = TRUE;
+  _DNSQueryScheduleTimer_Locked(query);
+
+  _CFMutexUnlock(&_DNSLock);
+
+  _DNSFreeAddrInfo(query->_result);
+
+  if (query->_reply)
+    CFAllocatorDeallocate(kCFAllocatorDefault, query->_reply);
+
+  CFRelease(query->_schedules);
+  CFAllocatorDeallocate(kCFAllocatorDefault, query);
 }
 
+/**
+ *  @brief
+ *    Create a lookup which asks the name servers directly.
+ *
+ *  Address lookups ask for the A and AAAA records of a name in
+ *  parallel, or just one of them for a single family, and call back
+ *  like getaddrinfo, also passing along the record TTL.  Other
+ *  lookups ask for a single record type, the class and type packed
+ *  into the CFHostInfoType as for dns_async, and call back with the
+ *  whole reply.
+ *
+ *  All lookups share one UDP socket per address family.  The lookup
+ *  is a run loop source; the socket is read on the run loops the
+ *  lookups are scheduled on.
+ *
+ *  @param[in]      name     The name to look up.
+ *  @param[in]      info     The CFHostInfoType of the lookup.
+ *  @param[in]      context  The CFHost to call back.
+ *  @param[in,out]  error    A pointer to a #CFStreamError structure
+ *                           which is set if the lookup can't be made.
+ *
+ *  @returns
+ *    The run loop source for the lookup on success; otherwise, NULL.
+ *
+ */
 /* static */
-CFFileDescriptorRef _CreateAddressLookupSource_Linux(int signal, CFTypeRef context, CFStreamError* error)
+CFRunLoopSourceRef _DNSCreateLookup(const char* name, CFHostInfoType info, void* context, CFStreamError* error)
 {
-  int                     sigfd;
-  CFFileDescriptorContext fdrefContext = {0, (void*)context, NULL, NULL, NULL};
-  CFFileDescriptorRef     result       = NULL;
+  CFRunLoopSourceContext ctxt = {0, NULL, NULL, _DNSLookupRelease, NULL, NULL, NULL, _DNSLookupSchedule, _DNSLookupCancel, _DNSLookupPerform};
+  _CFHostDNSQuery*       query;
+  CFIndex                i;
+  CFRunLoopSourceRef     result = NULL;
 
-  sigfd                                = _CreateSignalFd(signal, error);
-  if (sigfd == -1) {
-    return result;
+  query                         = (_CFHostDNSQuery*)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(query[0]), 0);
+  __Require_Action(query != NULL, done, error->error = ENOMEM; error->domain = kCFStreamErrorDomainPOSIX);
+
+  memset(query, 0, sizeof(query[0]));
+
+  query->_context   = context;
+  query->_schedules = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+  __Require_Action(query->_schedules != NULL, done, CFAllocatorDeallocate(kCFAllocatorDefault, query); query = NULL; error->error = ENOMEM;
+                   error->domain = kCFStreamErrorDomainPOSIX);
+
+  query->_addresses = (info == _kCFHostIPv4Addresses) || (info == _kCFHostIPv6Addresses) || (info == _kCFHostMasterAddressLookup) ||
+                      (info == _kCFHostByPassMasterAddressLookup);
+
+  if (query->_addresses) {
+    struct addrinfo hints;
+
+    _InitGetAddrInfoHints(info, &hints);
+
+    query->_socktype = hints.ai_socktype;
+    query->_protocol = hints.ai_protocol;
+
+    // IPv6 first, as getaddrinfo generally sorts them.
+    if (hints.ai_family != AF_INET)
+      query->_questions[query->_count++]._type = _kCFHostDNSTypeAAAA;
+
+    if (hints.ai_family != AF_INET6)
+      query->_questions[query->_count++]._type = _kCFHostDNSTypeA;
+
+    for (i = 0; i < query->_count; i++)
+      query->_questions[i]._class = _kCFHostDNSClassIN;
   }
 
-  result = CFFileDescriptorCreate(kCFAllocatorDefault, sigfd, TRUE, _MasterAddressLookupCallBack_Linux, &fdrefContext);
-  if (!result) {
-    error->error  = ENOMEM;
-    error->domain = kCFStreamErrorDomainPOSIX;
-    close(sigfd);
-  } else {
-    CFRunLoopSourceRef rlSource = CFFileDescriptorCreateRunLoopSource(kCFAllocatorSystemDefault, result, 0);
-    CFRunLoopAddSource(CFRunLoopGetCurrent(), rlSource, kCFRunLoopDefaultMode);
-    CFRelease(rlSource);
-    CFFileDescriptorEnableCallBacks(result, kCFFileDescriptorReadCallBack);
+  else {
+    query->_questions[0]._class = (info & 0xFFFF0000) >> 16;
+    query->_questions[0]._type  = (info & 0x0000FFFF);
+    query->_count               = 1;
+  }
+
+  _CFMutexLock(&_DNSLock);
+
+  do {
+    if (!_DNSQueries) {
+      _DNSQueries   = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL);
+      _DNSSchedules = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+      __Require_Action((_DNSQueries != NULL) && (_DNSSchedules != NULL), unlock, error->error = ENOMEM; error->domain = kCFStreamErrorDomainPOSIX);
+    }
+
+    _DNSLoadConfiguration_Locked();
+
+    for (i = 0; i < query->_count; i++) {
+      // Too many questions outstanding to find a free ID; try again later.
+      __Require_Action(_DNSCreateID_Locked(&query->_questions[i]._id), unlock, error->error = EAI_AGAIN;
+                       error->domain = (CFStreamErrorDomain)kCFStreamErrorDomainNetDB);
+
+      __Require_Action(_DNSQuestionEncode(&query->_questions[i], name), unlock, error->error = EAI_NONAME;
+                       error->domain = (CFStreamErrorDomain)kCFStreamErrorDomainNetDB);
+
+      CFDictionaryAddValue(_DNSQueries, (const void*)(uintptr_t)query->_questions[i]._id, query);
+    }
+
+    ctxt.info = query;
+
+    // Create the lookup source.  This source will be signalled once all the questions are answered.
+    result    = CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &ctxt);
+    __Require_Action(result != NULL, unlock, error->error = ENOMEM; error->domain = kCFStreamErrorDomainPOSIX);
+
+    // The source owns the query now, and gives it up through _DNSLookupRelease.
+    query->_source = result;
+    query          = NULL;
+
+    _DNSQuerySend_Locked((_CFHostDNSQuery*)ctxt.info);
+
+  } while (0);
+
+unlock:
+  if (query) {
+    for (i = 0; i < query->_count; i++) {
+      if (_DNSQueries && (CFDictionaryGetValue(_DNSQueries, (const void*)(uintptr_t)query->_questions[i]._id) == query))
+        CFDictionaryRemoveValue(_DNSQueries, (const void*)(uintptr_t)query->_questions[i]._id);
+    }
   }
 
+  _CFMutexUnlock(&_DNSLock);
+
+  if (query) {
+    CFRelease(query->_schedules);
+    CFAllocatorDeallocate(kCFAllocatorDefault, query);
+  }
+
+done:
   return result;
 }
 
+  #pragma mark - Address Lookup
+
 /* static */
-CFFileDescriptorRef _CreateMasterAddressLookup_Linux(CFStringRef name, CFHostInfoType info, CFTypeRef context, CFStreamError* error)
+CFRunLoopSourceRef _CreateMasterAddressLookup_Linux(CFStringRef name, CFHostInfoType info, CFTypeRef context, CFStreamError* error)
 {
   const CFAllocatorRef allocator = CFGetAllocator(name);
   UInt8*               buffer;
-  const int            signal = __kCFHostLinuxSignalFdSignal;
-  CFFileDescriptorRef  result = NULL;
-  int                  status;
+  Boolean              native;
+  CFRunLoopSourceRef   result = NULL;
 
   // Create a CFString representation of the lookup by converting it
   // into a null-terminated C string buffer consumable by
-  // getaddrinfo_a.
-  buffer = _CFStringToCStringWithError(name, error);
+  // getaddrinfo.
+  buffer                      = _CFStringToCStringWithError(name, error);
   __Require(buffer != NULL, done);
 
-  // Create the CFFileDescriptor-based lookup source that will
-  // handle the I/O for the asynchronous getaddrinfo_a call.
-  result = _CreateAddressLookupSource_Linux(signal, context, error);
-  __Require_Action(result != NULL, done, CFAllocatorDeallocate(allocator, buffer));
-
-  status = _CreateAddressLookupRequest((const char*)buffer, info, signal, error);
-  if (status != 0) {
-    _HandleGetAddrInfoStatus(status, error, TRUE);
+  _CFMutexLock(&_DNSLock);
+  native = _DNSEnabled;
+  _CFMutexUnlock(&_DNSLock);
 
-    CFAllocatorDeallocate(allocator, buffer);
-    CFFileDescriptorInvalidate(result);
-    CFRelease(result);
+  // Ask the name servers directly if allowed, or else hand the name to the resolver workers.
+  if (native && _DNSIsNativeName((const char*)buffer))
+    result = _DNSCreateLookup((const char*)buffer, info, (void*)context, error);
+  else
+    result = _ResolverCreateLookup((const char*)buffer, info, (void*)context, error);
 
-    result = NULL;
-  }
+  CFAllocatorDeallocate(allocator, buffer);
 
 done:
 
@@ -1549,7 +3445,7 @@ CFMachPortRef _CreateDNSLookup_Mach(CFTypeRef thing, CFHostInfoType info, void*
     CFMachPortContext ctxt = {0, (void*)context, CFRetain, CFRelease, CFCopyDescription};
 
     // Start the async lookup
-    error->error = dns_async_start(&prt, (const char*)buffer, ((info & 0xFFFF0000) >> 16), (info & 0x0000FFFF), 1, _DNSCallBack_Mach, (void*)context);
+    error->error = dns_async_start(&prt, (const char*)buffer, ((info & 0xFFFF0000) >> 16), (info & 0x0000FFFF), 1, _DNSCallBack, (void*)context);
 
     // If the callback port was created, attempt to create the CFMachPort wrapper on it.
     if (!prt || !(result = CFMachPortCreateWithPort(allocator, prt, _DNSMachPortCallBack, &ctxt, NULL))) {
@@ -1566,18 +3462,22 @@ CFMachPortRef _CreateDNSLookup_Mach(CFTypeRef thing, CFHostInfoType info, void*
 
 #if defined(__linux__)
 /* static */
-CFFileDescriptorRef _CreateDNSLookup_Linux(CFTypeRef thing, CFHostInfoType info, void* context, CFStreamError* error)
+CFRunLoopSourceRef _CreateDNSLookup_Linux(CFTypeRef thing, CFHostInfoType info, void* context, CFStreamError* error)
 {
-  CFFileDescriptorRef result = NULL;
+  const CFAllocatorRef allocator = CFGetAllocator(thing);
+  UInt8*               buffer;
+  CFRunLoopSourceRef   result = NULL;
+
+  buffer                      = _CFStringToCStringWithError(thing, error);
 
-  // It is not clear that this function is practically reachable as
-  // CFHost and CFNetwork are currently implemented. Trigger an
-  // unconditional assertion if any use pratically traverses this
-  // path such that it can be properly documented and tested.
+  if (!buffer)
+    return result;
 
-  assert(TRUE);
+  // Record lookups always go to the name servers, as there is no libc call for them.
+  result = _DNSCreateLookup((const char*)buffer, info, context, error);
 
-  result = (CFFileDescriptorRef)_CreateMasterAddressLookup(thing, info, context, error);
+  // Release the buffer that was allocated for the name
+  CFAllocatorDeallocate(allocator, buffer);
 
   return result;
 }
@@ -1643,68 +3543,177 @@ void _GetAddrInfoCallBackWithFree(int eai_status, const struct addrinfo* res, vo
       // This is the list of new addresses to be saved.
       addrs                       = CFArrayCreateMutable(allocator, 0, &kCFTypeArrayCallBacks);
 
-      // Save the memory error if the address cache failed to create.
-      if (!addrs) {
+      // Save the memory error if the address cache failed to create.
+      if (!addrs) {
+        host->_error.error  = ENOMEM;
+        host->_error.domain = kCFStreamErrorDomainPOSIX;
+
+        // Mark to indicate the resolution was performed.
+        CFDictionaryAddValue(host->_info, (const void*)(host->_type), kCFNull);
+      }
+
+      else {
+        const struct addrinfo* i;
+
+        // Loop through all of the addresses saving them in the array.
+        for (i = res; i; i = i->ai_next) {
+          const int family = i->ai_addr->sa_family;
+          CFDataRef data   = NULL;
+          CFIndex   length = 0;
+
+          // Bypass any address families that are not understood by CFSocketStream
+          if (family != AF_INET && family != AF_INET6)
+            continue;
+
+            // Wrap the address in a CFData
+#if HAVE_STRUCT_SOCKADDR_SA_LEN
+          length = i->ai_addr->sa_len;
+#else
+          length = _AddressSizeForSupportedFamily(family);
+#endif /* HAVE_STRUCT_SOCKADDR_SA_LEN */
+          if (length > 0) {
+            data = CFDataCreate(allocator, (UInt8*)(i->ai_addr), length);
+          }
+
+          // Fail with a memory error if the address wouldn't wrap.
+          if (!data) {
+            host->_error.error  = ENOMEM;
+            host->_error.domain = kCFStreamErrorDomainPOSIX;
+
+            // Release the addresses and mark as NULL so as not to save later.
+            CFRelease(addrs);
+            addrs = NULL;
+
+            // Just fail now.
+            break;
+          }
+
+          // Add the address and continue on to the next.
+          CFArrayAppendValue(addrs, data);
+          CFRelease(data);
+        }
+
+        // If the list is still good, need to save it.
+        if (addrs) {
+          // Save the list of address on the host.
+          CFDictionaryAddValue(host->_info, (const void*)(host->_type), addrs);
+          CFRelease(addrs);
+        }
+      }
+    }
+
+    // Save the callback if there is one at this time.
+    cb   = host->_callback;
+
+    type = host->_type;
+
+    // Save the error and client information for the callback
+    memmove(&error, &(host->_error), sizeof(error));
+    info = host->_client.info;
+
+    _HostLookupCancel_NoLock(host);
+  }
+
+  // Unlock the host so the callback can be made safely.
+  __CFSpinUnlock(&host->_lock);
+
+  // Release the results if some were received.
+  if (res) {
+    if (freeaddrinfo_cb) {
+      freeaddrinfo_cb((struct addrinfo*)res);
+    }
+  }
+
+  // If there is a callback, inform the client of the finish.
+  if (cb) {
+    cb((CFHostRef)host, type, &error, info);
+  }
+
+  // Go ahead and release now that the callback is done.
+  CFRelease((CFHostRef)host);
+}
+
+#if defined(__MACH__) || defined(__linux__)
+/* static */
+void _GetAddrInfoCallBack(int eai_status, const struct addrinfo* res, void* ctxt)
+{
+  _GetAddrInfoCallBackWithFree(eai_status, res, ctxt, freeaddrinfo);
+}
+
+/* static */
+void _DNSCallBack(int32_t status, char* buf, uint32_t len, struct sockaddr* from, int fromlen, void* context)
+{
+  _CFHost*             host = (_CFHost*)context;
+  CFHostClientCallBack cb   = NULL;
+  CFStreamError        error;
+  void*                info = NULL;
+  CFHostInfoType       type = _kCFNullHostInfoType;
+
+  // Retain here to guarantee safety really after the lookups release,
+  // but definitely before the callback.
+  CFRetain((CFHostRef)context);
+
+  // Lock the host
+  __CFSpinLock(&host->_lock);
+  ;
+
+  // If the lookup canceled, don't need to do any of this.
+  if (host->_lookup) {
+    // Make sure to toss the cached info now.
+    CFDictionaryRemoveValue(host->_info, (const void*)(host->_type));
+
+    // Set the error if got one back from the lookup
+    if (status) {
+      _HandleGetAddrInfoStatus(status, &host->_error, FALSE);
+
+      // Mark to indicate the resolution was performed.
+      CFDictionaryAddValue(host->_info, (const void*)(host->_type), kCFNull);
+    }
+
+    else {
+      CFAllocatorRef allocator = CFGetAllocator((CFHostRef)context);
+
+      // Wrap the reply and the source of the reply
+      CFDataRef rr             = CFDataCreate(allocator, (const UInt8*)buf, len);
+      CFDataRef sa             = CFDataCreate(allocator, (const UInt8*)from, fromlen);
+
+      // If couldn't wrap, fail with no memory error.
+      if (!rr || !sa) {
         host->_error.error  = ENOMEM;
         host->_error.domain = kCFStreamErrorDomainPOSIX;
-
-        // Mark to indicate the resolution was performed.
-        CFDictionaryAddValue(host->_info, (const void*)(host->_type), kCFNull);
       }
 
       else {
-        const struct addrinfo* i;
-
-        // Loop through all of the addresses saving them in the array.
-        for (i = res; i; i = i->ai_next) {
-          const int family = i->ai_addr->sa_family;
-          CFDataRef data   = NULL;
-          CFIndex   length = 0;
-
-          // Bypass any address families that are not understood by CFSocketStream
-          if (family != AF_INET && family != AF_INET6)
-            continue;
-
-            // Wrap the address in a CFData
-#if HAVE_STRUCT_SOCKADDR_SA_LEN
-          length = i->ai_addr->sa_len;
-#else
-          length = _AddressSizeForSupportedFamily(family);
-#endif /* HAVE_STRUCT_SOCKADDR_SA_LEN */
-          if (length > 0) {
-            data = CFDataCreate(allocator, (UInt8*)(i->ai_addr), length);
-          }
-
-          // Fail with a memory error if the address wouldn't wrap.
-          if (!data) {
-            host->_error.error  = ENOMEM;
-            host->_error.domain = kCFStreamErrorDomainPOSIX;
-
-            // Release the addresses and mark as NULL so as not to save later.
-            CFRelease(addrs);
-            addrs = NULL;
-
-            // Just fail now.
-            break;
-          }
+        // Create the information to put in the info dictionary.
+        CFTypeRef  list[2] = {rr, sa};
+        CFArrayRef array   = CFArrayCreate(allocator, list, sizeof(list) / sizeof(list[0]), &kCFTypeArrayCallBacks);
 
-          // Add the address and continue on to the next.
-          CFArrayAppendValue(addrs, data);
-          CFRelease(data);
+        // Make sure it was created and add it.
+        if (array) {
+          CFDictionaryAddValue(host->_info, (const void*)(host->_type), array);
+          CFRelease(array);
         }
 
-        // If the list is still good, need to save it.
-        if (addrs) {
-          // Save the list of address on the host.
-          CFDictionaryAddValue(host->_info, (const void*)(host->_type), addrs);
-          CFRelease(addrs);
+        // Did make the information list so fail with out of memory
+        else {
+          host->_error.error  = ENOMEM;
+          host->_error.domain = kCFStreamErrorDomainPOSIX;
         }
       }
+
+      // Release the reply if it was created.
+      if (rr)
+        CFRelease(rr);
+
+      // Release the sockaddr wrapper if it was created
+      if (sa)
+        CFRelease(sa);
     }
 
     // Save the callback if there is one at this time.
     cb   = host->_callback;
 
+    // Save the type of lookup for the callback.
     type = host->_type;
 
     // Save the error and client information for the callback
@@ -1716,28 +3725,14 @@ void _GetAddrInfoCallBackWithFree(int eai_status, const struct addrinfo* res, vo
 
   // Unlock the host so the callback can be made safely.
   __CFSpinUnlock(&host->_lock);
-
-  // Release the results if some were received.
-  if (res) {
-    if (freeaddrinfo_cb) {
-      freeaddrinfo_cb((struct addrinfo*)res);
-    }
-  }
+  ;
 
   // If there is a callback, inform the client of the finish.
-  if (cb) {
-    cb((CFHostRef)host, type, &error, info);
-  }
+  if (cb)
+    cb((CFHostRef)context, type, &error, info);
 
   // Go ahead and release now that the callback is done.
-  CFRelease((CFHostRef)host);
-}
-
-#if defined(__MACH__) || defined(__linux__)
-/* static */
-void _GetAddrInfoCallBack(int eai_status, const struct addrinfo* res, void* ctxt)
-{
-  _GetAddrInfoCallBackWithFree(eai_status, res, ctxt, freeaddrinfo);
+  CFRelease((CFHostRef)context);
 }
 #endif /* defined(__MACH__) || defined(__linux__) */
 
@@ -2009,101 +4004,6 @@ void _NetworkReachabilityByIPCallBack(_CFHost* host)
   CFRelease((CFHostRef)host);
 }
 
-/* static */
-void _DNSCallBack_Mach(int32_t status, char* buf, uint32_t len, struct sockaddr* from, int fromlen, void* context)
-{
-  _CFHost*             host = (_CFHost*)context;
-  CFHostClientCallBack cb   = NULL;
-  CFStreamError        error;
-  void*                info = NULL;
-  CFHostInfoType       type = _kCFNullHostInfoType;
-
-  // Retain here to guarantee safety really after the lookups release,
-  // but definitely before the callback.
-  CFRetain((CFHostRef)context);
-
-  // Lock the host
-  __CFSpinLock(&host->_lock);
-  ;
-
-  // If the lookup canceled, don't need to do any of this.
-  if (host->_lookup) {
-    // Make sure to toss the cached info now.
-    CFDictionaryRemoveValue(host->_info, (const void*)(host->_type));
-
-    // Set the error if got one back from the lookup
-    if (status) {
-      _HandleGetAddrInfoStatus(status, &host->_error, FALSE);
-
-      // Mark to indicate the resolution was performed.
-      CFDictionaryAddValue(host->_info, (const void*)(host->_type), kCFNull);
-    }
-
-    else {
-      CFAllocatorRef allocator = CFGetAllocator((CFHostRef)context);
-
-      // Wrap the reply and the source of the reply
-      CFDataRef rr             = CFDataCreate(allocator, (const UInt8*)buf, len);
-      CFDataRef sa             = CFDataCreate(allocator, (const UInt8*)from, fromlen);
-
-      // If couldn't wrap, fail with no memory error.
-      if (!rr || !sa) {
-        host->_error.error  = ENOMEM;
-        host->_error.domain = kCFStreamErrorDomainPOSIX;
-      }
-
-      else {
-        // Create the information to put in the info dictionary.
-        CFTypeRef  list[2] = {rr, sa};
-        CFArrayRef array   = CFArrayCreate(allocator, list, sizeof(list) / sizeof(list[0]), &kCFTypeArrayCallBacks);
-
-        // Make sure it was created and add it.
-        if (array) {
-          CFDictionaryAddValue(host->_info, (const void*)(host->_type), array);
-          CFRelease(array);
-        }
-
-        // Did make the information list so fail with out of memory
-        else {
-          host->_error.error  = ENOMEM;
-          host->_error.domain = kCFStreamErrorDomainPOSIX;
-        }
-      }
-
-      // Release the reply if it was created.
-      if (rr)
-        CFRelease(rr);
-
-      // Release the sockaddr wrapper if it was created
-      if (sa)
-        CFRelease(sa);
-    }
-
-    // Save the callback if there is one at this time.
-    cb   = host->_callback;
-
-    // Save the type of lookup for the callback.
-    type = host->_type;
-
-    // Save the error and client information for the callback
-    memmove(&error, &(host->_error), sizeof(error));
-    info = host->_client.info;
-
-    _HostLookupCancel_NoLock(host);
-  }
-
-  // Unlock the host so the callback can be made safely.
-  __CFSpinUnlock(&host->_lock);
-  ;
-
-  // If there is a callback, inform the client of the finish.
-  if (cb)
-    cb((CFHostRef)context, type, &error, info);
-
-  // Go ahead and release now that the callback is done.
-  CFRelease((CFHostRef)context);
-}
-
 /* static */
 void _DNSMachPortCallBack(CFMachPortRef port, void* msg, CFIndex size, void* info) { dns_async_handle_reply(msg); }
 
@@ -2136,34 +4036,30 @@ void _MasterLookupCallBack(CFHostRef theHost, CFHostInfoType typeInfo, const CFS
     CFIndex    i, count;
     CFArrayRef addrs = CFHostGetInfo(theHost, _kCFHostMasterAddressLookup, NULL);
 
-    /* If no error, add the host to the cache. */
-    if (!error->error) {
-      /* The host will be saved for each name in the list of names for the host. */
+    /* Add the addresses, or an authoritative failure, to the cache. */
+    if ((!error->error && addrs) || _HostCacheIsNegativeError(error)) {
+      /* The entry will be saved for each name in the list of names for the host. */
       CFArrayRef names = CFHostGetInfo(theHost, kCFHostNames, NULL);
 
       if (names && ((CFTypeRef)names != kCFNull)) {
-        /* Each host cache entry is a host with its fetch time. */
-        CFTypeRef orig[2] = {theHost, CFDateCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent())};
+        /* Honor the record's TTL when the lookup learned one. */
+        CFNumberRef    seconds = (CFNumberRef)CFHostGetInfo(theHost, _kCFHostTimeToLive, NULL);
+        CFTimeInterval ttl     = error->error ? _HostCacheNegativeTTL : _HostCacheTTL;
 
-        /* Only add the entries if the date was created. */
-        if (orig[1]) {
-          /* Create the CFArray to be added into the cache. */
-          CFArrayRef items = CFArrayCreate(kCFAllocatorDefault, orig, sizeof(orig) / sizeof(orig[0]), &kCFTypeArrayCallBacks);
+        if (seconds)
+          CFNumberGetValue(seconds, kCFNumberDoubleType, &ttl);
 
-          CFRelease(orig[1]);
+        /* Lock the cache */
+        _CFMutexLock(_HostLock);
 
-          /* Once again, only add if the list was created. */
-          if (items) {
-            /* Loop through all the names of the host. */
-            count = CFArrayGetCount(names);
+        /* Loop through all the names of the host. */
+        count = CFArrayGetCount(names);
 
-            /* Add an entry for each name. */
-            for (i = 0; i < count; i++)
-              CFDictionaryAddValue(_HostCache, CFArrayGetValueAtIndex(names, i), items);
+        /* Add an entry for each name. */
+        for (i = 0; i < count; i++)
+          _HostCacheAddEntry_NoLock(CFArrayGetValueAtIndex(names, i), error->error ? NULL : addrs, error, ttl);
 
-            CFRelease(items);
-          }
-        }
+        _CFMutexUnlock(_HostLock);
       }
     }
 
@@ -2271,6 +4167,7 @@ void _AddressLookupPerform(_CFHost* host)
   CFHostClientCallBack cb = NULL;
   CFStreamError        error;
   void*                info = NULL;
+  CFHostInfoType       type;
 
   // Retain here to guarantee safety really after the lookups release,
   // but definitely before the callback.
@@ -2280,7 +4177,16 @@ void _AddressLookupPerform(_CFHost* host)
   __CFSpinLock(&host->_lock);
 
   // Save the callback if there is one at this time.
-  cb = host->_callback;
+  cb   = host->_callback;
+
+  // Cache hits may be for a single family, so report whatever was asked for.
+  type = host->_type;
+
+  // A negative cache hit reports its error only now that the lookup is done.
+  if (host->_cachedError.error) {
+    memmove(&host->_error, &host->_cachedError, sizeof(host->_error));
+    memset(&host->_cachedError, 0, sizeof(host->_cachedError));
+  }
 
   // Save the error and client information for the callback
   memmove(&error, &(host->_error), sizeof(error));
@@ -2293,7 +4199,7 @@ void _AddressLookupPerform(_CFHost* host)
 
   // If there is a callback, inform the client of the finish.
   if (cb)
-    cb((CFHostRef)host, kCFHostAddresses, &error, info);
+    cb((CFHostRef)host, type, &error, info);
 
   // Go ahead and release now that the callback is done.
   CFRelease((CFHostRef)host);
@@ -2846,3 +4752,127 @@ void CFHostUnscheduleFromRunLoop(CFHostRef theHost, CFRunLoopRef runLoop, CFStri
   __CFSpinUnlock(&host->_lock);
   ;
 }
+
+/* extern */
+Boolean _CFHostSetCacheLimits(CFIndex maxEntries, CFTimeInterval ttl, CFTimeInterval negativeTTL, CFTimeInterval staleTTL)
+{
+  if ((maxEntries < 0) || (ttl < 0.0) || (negativeTTL < 0.0) || (staleTTL < 0.0))
+    return FALSE;
+
+  // Make sure the cache exists.
+  CFHostGetTypeID();
+
+  _CFMutexLock(_HostLock);
+
+  _HostCacheMaxEntries  = maxEntries;
+  _HostCacheTTL         = ttl;
+  _HostCacheNegativeTTL = negativeTTL;
+  _HostCacheStaleTTL    = staleTTL;
+
+  // Existing entries keep their TTLs, but not their place if the cache shrank.
+  _HostCacheTrim_NoLock(maxEntries);
+
+  _CFMutexUnlock(_HostLock);
+
+  return TRUE;
+}
+
+/* extern */
+void _CFHostFlushCache(void)
+{
+  // Make sure the cache exists.
+  CFHostGetTypeID();
+
+  _CFMutexLock(_HostLock);
+
+  _HostCacheTrim_NoLock(0);
+
+  _CFMutexUnlock(_HostLock);
+}
+
+/* extern */
+Boolean _CFHostSetNativeResolverEnabled(Boolean enabled)
+{
+#if defined(__linux__)
+  // Make sure the lock exists.
+  CFHostGetTypeID();
+
+  _CFMutexLock(&_DNSLock);
+
+  // Lookups already started keep the resolver they were started with.
+  _DNSEnabled = enabled;
+
+  _CFMutexUnlock(&_DNSLock);
+
+  return TRUE;
+#else
+  return FALSE;
+#endif /* defined(__linux__) */
+}
+
+/* extern */
+Boolean _CFHostSetNameServers(CFArrayRef servers)
+{
+#if defined(__linux__)
+  struct sockaddr_storage list[_kCFHostDNSMaxServers];
+  CFIndex                 i, count = servers ? CFArrayGetCount(servers) : 0;
+
+  if (count > _kCFHostDNSMaxServers)
+    return FALSE;
+
+  // Validate all the addresses before taking any.
+  for (i = 0; i < count; i++) {
+    CFDataRef              data = (CFDataRef)CFArrayGetValueAtIndex(servers, i);
+    const struct sockaddr* sa;
+    CFIndex                length;
+    size_t                 size;
+
+    if (CFGetTypeID(data) != CFDataGetTypeID())
+      return FALSE;
+
+    sa     = (const struct sockaddr*)CFDataGetBytePtr(data);
+    length = CFDataGetLength(data);
+
+    if ((length < (CFIndex)sizeof(struct sockaddr_in)) || (length > (CFIndex)sizeof(list[i])))
+      return FALSE;
+
+    // Only IPv4 and IPv6 name servers.
+    size = _AddressSizeForSupportedFamily(sa->sa_family);
+    if (!size || (length < (CFIndex)size))
+      return FALSE;
+
+    memset(&list[i], 0, sizeof(list[i]));
+    memmove(&list[i], sa, length);
+
+    // Default to the DNS port.
+    if ((sa->sa_family == AF_INET) && !((struct sockaddr_in*)&list[i])->sin_port)
+      ((struct sockaddr_in*)&list[i])->sin_port = htons(_kCFHostDNSPort);
+
+    else if ((sa->sa_family == AF_INET6) && !((struct sockaddr_in6*)&list[i])->sin6_port)
+      ((struct sockaddr_in6*)&list[i])->sin6_port = htons(_kCFHostDNSPort);
+  }
+
+  // Make sure the lock exists.
+  CFHostGetTypeID();
+
+  _CFMutexLock(&_DNSLock);
+
+  if (count) {
+    memmove(_DNSServers, list, count * sizeof(list[0]));
+    _DNSServerCount       = count;
+    _DNSServersOverridden = TRUE;
+  }
+
+  // Go back to resolv.conf, read afresh on the next lookup.
+  else {
+    _DNSServersOverridden   = FALSE;
+    _DNSConfigurationLoaded = FALSE;
+  }
+
+  _CFMutexUnlock(&_DNSLock);
+
+  return TRUE;
+#else
+  return FALSE;
+#endif /* defined(__linux__) */
+}
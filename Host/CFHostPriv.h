@@ -68,6 +68,30 @@ extern "C" {
   #pragma enumsalwaysint on
 #endif
 
+/*
+ *  CFHostInfoType (private)
+ *
+ *  Discussion:
+ *    Additional host information types to be resolved.
+ */
+enum {
+
+  /*
+   * Results value is a CFArray of CFData's (each being a struct
+   * sockaddr_in).  Resolves only the IPv4 addresses of the name, so
+   * a client can use them before the IPv6 answers arrive.  Answered
+   * from the cache of kCFHostAddresses lookups when it holds the
+   * name, but results are not added to it.
+   */
+  _kCFHostIPv4Addresses = 0x0000FFFE,
+
+  /*
+   * Results value is a CFArray of CFData's (each being a struct
+   * sockaddr_in6).  Same as _kCFHostIPv4Addresses, but for IPv6.
+   */
+  _kCFHostIPv6Addresses = 0x0000FFFD
+};
+
 /*
  *  CFHostGetInfo()
  *
@@ -104,6 +128,119 @@ extern CFTypeRef CFHostGetInfo(CFHostRef      theHost,
                                CFHostInfoType info,
                                Boolean        *hasBeenResolved) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
 
+/*
+ *  _CFHostSetCacheLimits()
+ *
+ *  Discussion:
+ *    Configures the process-wide cache of hostname to address
+ *    lookups.  Successful lookups are cached for the TTL of their
+ *    records when the lookup learns it, and for the given default TTL
+ *    otherwise.  Lookups failing because the name does not exist are
+ *    cached for the negative TTL.  Once a successful entry's TTL
+ *    runs out, it is still returned for up to the stale TTL while a
+ *    fresh lookup runs in the background.  The least recently used
+ *    entries are evicted once the cache holds the maximum number.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ *  Parameters:
+ *
+ *    maxEntries:
+ *      The most hostnames to cache.  Zero turns the cache off.
+ *
+ *    ttl:
+ *      Seconds to cache addresses for when the record TTL is not
+ *      known.
+ *
+ *    negativeTTL:
+ *      Seconds to cache names which do not exist.  Zero turns off
+ *      negative caching.
+ *
+ *    staleTTL:
+ *      Seconds past their TTL that addresses are still served while
+ *      being refreshed.  Zero turns off serving stale entries.
+ *
+ *  Result:
+ *    Returns TRUE if the limits were set, or FALSE if any is
+ *    negative.
+ *
+ */
+extern Boolean _CFHostSetCacheLimits(CFIndex        maxEntries,
+                                     CFTimeInterval ttl,
+                                     CFTimeInterval negativeTTL,
+                                     CFTimeInterval staleTTL) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFHostFlushCache()
+ *
+ *  Discussion:
+ *    Empties the process-wide cache of hostname lookups, for instance
+ *    after the network configuration has changed.  Lookups already in
+ *    progress are not affected.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ */
+extern void _CFHostFlushCache(void) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFHostSetNativeResolverEnabled()
+ *
+ *  Discussion:
+ *    Turns the built-in DNS resolver on or off for hostname to
+ *    address lookups.  When on, names with more than one label are
+ *    looked up by asking the name servers directly, A and AAAA in
+ *    parallel, over a UDP socket shared by all lookups and falling
+ *    back to TCP for truncated replies.  The lookups are driven by
+ *    the run loops the hosts are scheduled on, and the TTL of the
+ *    records is used for the lookup cache.  Other names, and all
+ *    lookups when off, go through getaddrinfo, which honors
+ *    /etc/hosts and the name service switch.  Record lookups always
+ *    use the built-in resolver.  Off by default.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ *  Parameters:
+ *
+ *    enabled:
+ *      Whether address lookups should use the built-in resolver.
+ *
+ *  Result:
+ *    Returns TRUE if set, or FALSE if the platform has no built-in
+ *    resolver.
+ *
+ */
+extern Boolean _CFHostSetNativeResolverEnabled(Boolean enabled) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFHostSetNameServers()
+ *
+ *  Discussion:
+ *    Sets the name servers the built-in DNS resolver asks, in place
+ *    of those in /etc/resolv.conf.  Lookups already in progress keep
+ *    going to their current server until they retry.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ *  Parameters:
+ *
+ *    servers:
+ *      A CFArray of up to three CFData, each holding a struct
+ *      sockaddr_in or sockaddr_in6.  A zero port means port 53.  NULL
+ *      or an empty array goes back to /etc/resolv.conf.
+ *
+ *  Result:
+ *    Returns TRUE if the name servers were set, or FALSE if any
+ *    address is not IPv4 or IPv6, there are too many, or the platform
+ *    has no built-in resolver.
+ *
+ */
+extern Boolean _CFHostSetNameServers(CFArrayRef servers) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
 #if PRAGMA_ENUM_ALWAYSINT
   #pragma enumsalwaysint reset
 #endif
@@ -59,9 +59,57 @@ struct __CFNetConnectionCacheKey {
     CFDictionaryRef properties;
 };
 
+// The cache is split into stripes by key hash, each with its own lock, so
+// lookups for different hosts don't contend.  The hash is the host's, so all
+// the keys for a host land in the same stripe.
+#define CONNECTION_CACHE_STRIPES (16)
+
+// Defaults for the limits; see setConnectionCacheLimits.
+#define CONNECTION_CACHE_MAX_PER_HOST (6)
+#define CONNECTION_CACHE_MAX_TOTAL (256)
+#define CONNECTION_CACHE_IDLE_TIMEOUT ((CFTimeInterval)120.0)
+#define CONNECTION_CACHE_MAX_CONNECTIONS_PER_HOST (6)
+
+// How often a stripe looks for connections that have been idle too long
+#define CONNECTION_CACHE_REAP_INTERVAL ((CFTimeInterval)5.0)
+
+typedef struct __CFNetConnectionCacheEntry {
+    struct __CFNetConnectionCacheEntry *newer;
+    struct __CFNetConnectionCacheEntry *older;
+    struct __CFNetConnectionCacheEntry *sibling;    // Next connection for the same key
+    _CFNetConnectionCacheKey key;   // Owned by the entry; the stripe's dictionary does not retain it
+    _CFNetConnectionRef conn;       // Retained
+} __CFNetConnectionCacheEntry;
+
+// A request waiting its turn for a connection from a full pool; see findOrWaitForNetConnection
+typedef struct __CFNetConnectionCacheWaiter {
+    struct __CFNetConnectionCacheWaiter *next;
+    _CFNetConnectionCacheKey key;   // Owned
+    CFRunLoopSourceRef source;      // Retained; signalled whenever a connection for key may have come free
+    CFArrayRef runLoopsAndModes;    // Retained; the run loops to wake along with the signal
+} __CFNetConnectionCacheWaiter;
+
+typedef struct {
+    CFSpinLock_t lock;
+    CFMutableDictionaryRef dictionary;      // key -> first entry of the key's sibling list
+    __CFNetConnectionCacheEntry *newest;    // Most recently used end of the LRU list
+    __CFNetConnectionCacheEntry *oldest;    // Least recently used end
+    __CFNetConnectionCacheWaiter *waiters;  // In the order they started waiting
+    CFAbsoluteTime lastReap;
+} __CFNetConnectionCacheStripe;
+
 struct __CFNetConnectionCache {
-    CFMutableDictionaryRef dictionary;
-    CFSpinLock_t connectionCacheLock;
+    CFSpinLock_t connectionCacheLock;       // For callers' own bookkeeping; see lockConnectionCache
+    
+    CFSpinLock_t countLock;
+    CFIndex count;                          // Entries across all stripes
+    
+    CFIndex maxPerHost;
+    CFIndex maxTotal;
+    CFTimeInterval idleTimeout;
+    CFIndex maxConnectionsPerHost;          // Pool size for findOrWaitForNetConnection
+    
+    __CFNetConnectionCacheStripe stripes[CONNECTION_CACHE_STRIPES];
 };
 
 const void *connCacheKeyRetain(CFAllocatorRef allocator, const void *value) {
@@ -164,26 +212,222 @@ CFNetConnectionCacheRef createConnectionCache(void)
     CFNetConnectionCacheRef conn_cache = malloc(sizeof(struct __CFNetConnectionCache));
  
     if (conn_cache) {
-        CFMutableDictionaryRef dictionary;
-        CFDictionaryKeyCallBacks connectionCacheCallBacks = {0, connCacheKeyRetain, connCacheKeyRelease, connCacheKeyCopyDesc, connCacheKeyEqual, connCacheKeyHash};
+        int i;
+        // The dictionary only looks at the entries' keys; the entries own them.
+        CFDictionaryKeyCallBacks connectionCacheCallBacks = {0, NULL, NULL, connCacheKeyCopyDesc, connCacheKeyEqual, connCacheKeyHash};
         
-        dictionary = CFDictionaryCreateMutable(NULL, 0, &connectionCacheCallBacks, &kCFTypeDictionaryValueCallBacks);
-        if (dictionary) {
-            conn_cache->dictionary = dictionary;
-            conn_cache->connectionCacheLock = 0;
-        } else {
-            free(conn_cache);
-            conn_cache = NULL;
+        memset(conn_cache, 0, sizeof(struct __CFNetConnectionCache));
+        conn_cache->maxPerHost = CONNECTION_CACHE_MAX_PER_HOST;
+        conn_cache->maxTotal = CONNECTION_CACHE_MAX_TOTAL;
+        conn_cache->idleTimeout = CONNECTION_CACHE_IDLE_TIMEOUT;
+        conn_cache->maxConnectionsPerHost = CONNECTION_CACHE_MAX_CONNECTIONS_PER_HOST;
+        
+        for (i = 0; i < CONNECTION_CACHE_STRIPES; i ++) {
+            CFMutableDictionaryRef dictionary = CFDictionaryCreateMutable(NULL, 0, &connectionCacheCallBacks, NULL);
+            if (!dictionary) {
+                while (i --) CFRelease(conn_cache->stripes[i].dictionary);
+                free(conn_cache);
+                return NULL;
+            }
+            conn_cache->stripes[i].dictionary = dictionary;
         }
     }
     return(conn_cache);
 }
 
+void setConnectionCacheLimits(CFNetConnectionCacheRef cache, CFIndex maxPerHost, CFIndex maxTotal, CFTimeInterval idleTimeout)
+{
+    __CFSpinLock(&cache->countLock);
+    cache->maxPerHost = maxPerHost;
+    cache->maxTotal = maxTotal;
+    cache->idleTimeout = idleTimeout;
+    __CFSpinUnlock(&cache->countLock);
+}
+
+void setConnectionCacheMaxConnectionsPerHost(CFNetConnectionCacheRef cache, CFIndex maxConnectionsPerHost)
+{
+    __CFSpinLock(&cache->countLock);
+    cache->maxConnectionsPerHost = maxConnectionsPerHost;
+    __CFSpinUnlock(&cache->countLock);
+}
+
+static inline __CFNetConnectionCacheStripe *cacheStripeForKey(CFNetConnectionCacheRef cache, _CFNetConnectionCacheKey key) {
+    return &cache->stripes[connCacheKeyHash(key) % CONNECTION_CACHE_STRIPES];
+}
+
+static void cacheEntryUnlink(__CFNetConnectionCacheStripe *stripe, __CFNetConnectionCacheEntry *entry) {
+    if (entry->newer) entry->newer->older = entry->older;
+    else stripe->newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer;
+    else stripe->oldest = entry->newer;
+    entry->newer = entry->older = NULL;
+}
+
+static void cacheEntryMakeNewest(__CFNetConnectionCacheStripe *stripe, __CFNetConnectionCacheEntry *entry) {
+    entry->older = stripe->newest;
+    entry->newer = NULL;
+    if (stripe->newest) stripe->newest->newer = entry;
+    else stripe->oldest = entry;
+    stripe->newest = entry;
+}
+
+// Signals the first waiter for key, if any, that a connection may have come free.  Call with the stripe locked.
+static void cacheWakeWaiter(__CFNetConnectionCacheStripe *stripe, _CFNetConnectionCacheKey key) {
+    __CFNetConnectionCacheWaiter *waiter;
+    for (waiter = stripe->waiters; waiter; waiter = waiter->next) {
+        if (connCacheKeyEqual(waiter->key, key)) {
+            CFRunLoopSourceSignal(waiter->source);
+            if (waiter->runLoopsAndModes) {
+                CFIndex i, c = CFArrayGetCount(waiter->runLoopsAndModes);
+                for (i = 0; i + 1 < c; i += 2) {
+                    CFRunLoopWakeUp((CFRunLoopRef)CFArrayGetValueAtIndex(waiter->runLoopsAndModes, i));
+                }
+            }
+            break;
+        }
+    }
+}
+
+static void cacheWaiterFree(__CFNetConnectionCacheWaiter *waiter) {
+    connCacheKeyRelease(NULL, waiter->key);
+    CFRelease(waiter->source);
+    if (waiter->runLoopsAndModes) CFRelease(waiter->runLoopsAndModes);
+    free(waiter);
+}
+
+// Adds a new entry for conn as the last of its key's siblings.  Call with the stripe locked.
+static void cacheEntryAdd(CFNetConnectionCacheRef cache, __CFNetConnectionCacheStripe *stripe, _CFNetConnectionCacheKey key, _CFNetConnectionRef conn) {
+    __CFNetConnectionCacheEntry *entry = malloc(sizeof(__CFNetConnectionCacheEntry));
+    if (entry) {
+        __CFNetConnectionCacheEntry *last = (__CFNetConnectionCacheEntry *)CFDictionaryGetValue(stripe->dictionary, key);
+        entry->key = (_CFNetConnectionCacheKey)connCacheKeyRetain(NULL, key);
+        entry->conn = (_CFNetConnectionRef)CFRetain(conn);
+        entry->sibling = NULL;
+        cacheEntryMakeNewest(stripe, entry);
+        if (!last) {
+            CFDictionarySetValue(stripe->dictionary, entry->key, entry);
+        } else {
+            while (last->sibling) last = last->sibling;
+            last->sibling = entry;
+        }
+        __CFSpinLock(&cache->countLock);
+        cache->count ++;
+        __CFSpinUnlock(&cache->countLock);
+    }
+}
+
+// Takes the entry out of the stripe and hands its connection to the caller to release once the stripe is unlocked.  Call with the stripe locked.
+static _CFNetConnectionRef cacheEntryRemove(CFNetConnectionCacheRef cache, __CFNetConnectionCacheStripe *stripe, __CFNetConnectionCacheEntry *entry) {
+    _CFNetConnectionRef conn = entry->conn;
+    __CFNetConnectionCacheEntry *first = (__CFNetConnectionCacheEntry *)CFDictionaryGetValue(stripe->dictionary, entry->key);
+    
+    if (first == entry) {
+        // The dictionary's key belongs to the first sibling, so move it along to the next one.
+        CFDictionaryRemoveValue(stripe->dictionary, entry->key);
+        if (entry->sibling) CFDictionarySetValue(stripe->dictionary, entry->sibling->key, entry->sibling);
+    } else {
+        while (first && first->sibling != entry) first = first->sibling;
+        if (first) first->sibling = entry->sibling;
+    }
+    cacheEntryUnlink(stripe, entry);
+    
+    // There's room for another connection to the host now.
+    cacheWakeWaiter(stripe, entry->key);
+    
+    connCacheKeyRelease(NULL, entry->key);
+    free(entry);
+    
+    __CFSpinLock(&cache->countLock);
+    cache->count --;
+    __CFSpinUnlock(&cache->countLock);
+    
+    return conn;
+}
+
+// Evicts the least recently used idle connection of the stripe, limited to the given host if there is one.  Call with the stripe locked.
+static _CFNetConnectionRef cacheEvictOldestIdle(CFNetConnectionCacheRef cache, __CFNetConnectionCacheStripe *stripe, CFStringRef host, _CFNetConnectionRef keep) {
+    __CFNetConnectionCacheEntry *entry;
+    for (entry = stripe->oldest; entry; entry = entry->newer) {
+        if (entry->conn == keep) continue;
+        if (host && (!entry->key->host || !CFEqual(entry->key->host, host))) continue;
+        if (_CFNetConnectionIsEmpty(entry->conn)) {
+            _CFNetConnectionSetAllowsNewRequests(entry->conn, FALSE);
+            return cacheEntryRemove(cache, stripe, entry);
+        }
+    }
+    return NULL;
+}
+
+// Drops connections which have sat idle past the timeout, never keep, the connection being handed out.  If keep was just inserted, also enforces the per-host and total limits.  Victims are appended to victims for release outside the lock.  Call with the stripe locked.
+static void cacheTrim(CFNetConnectionCacheRef cache, __CFNetConnectionCacheStripe *stripe, _CFNetConnectionCacheKey key, _CFNetConnectionRef keep, Boolean inserted, _CFNetConnectionRef *victims, int *numVictims, int maxVictims) {
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    CFIndex maxPerHost, maxTotal, count, hostCount;
+    CFTimeInterval idleTimeout;
+    __CFNetConnectionCacheEntry *entry, *next;
+    _CFNetConnectionRef victim;
+    
+    __CFSpinLock(&cache->countLock);
+    maxPerHost = cache->maxPerHost;
+    maxTotal = cache->maxTotal;
+    idleTimeout = cache->idleTimeout;
+    __CFSpinUnlock(&cache->countLock);
+    
+    // Reap idle connections every so often rather than on every lookup.
+    if (idleTimeout > 0 && now - stripe->lastReap >= CONNECTION_CACHE_REAP_INTERVAL) {
+        stripe->lastReap = now;
+        for (entry = stripe->oldest; entry && *numVictims < maxVictims; entry = next) {
+            next = entry->newer;
+            if (entry->conn != keep && _CFNetConnectionIsEmpty(entry->conn) && now - _CFNetConnectionGetLastAccessTime(entry->conn) >= idleTimeout) {
+                _CFNetConnectionSetAllowsNewRequests(entry->conn, FALSE);
+                victims[(*numVictims) ++] = cacheEntryRemove(cache, stripe, entry);
+            }
+        }
+    }
+    
+    if (!keep || !inserted) return;
+    
+    // Keep the host within its limit.
+    if (maxPerHost > 0 && key->host) {
+        hostCount = 0;
+        for (entry = stripe->newest; entry; entry = entry->older) {
+            if (entry->key->host && CFEqual(entry->key->host, key->host)) hostCount ++;
+        }
+        while (hostCount > maxPerHost && *numVictims < maxVictims && (victim = cacheEvictOldestIdle(cache, stripe, key->host, keep)) != NULL) {
+            victims[(*numVictims) ++] = victim;
+            hostCount --;
+        }
+    }
+    
+    // Keep the whole cache within its limit.  Only this stripe is searched, so the
+    // least recently used connection overall may survive, but no other lock is taken.
+    if (maxTotal > 0) {
+        __CFSpinLock(&cache->countLock);
+        count = cache->count;
+        __CFSpinUnlock(&cache->countLock);
+        while (count > maxTotal && *numVictims < maxVictims && (victim = cacheEvictOldestIdle(cache, stripe, NULL, keep)) != NULL) {
+            victims[(*numVictims) ++] = victim;
+            count --;
+        }
+    }
+}
+
 #if defined(__WIN32__)
 void releaseConnectionCache(CFNetConnectionCacheRef cache)
 {
     if (cache) {
-        CFRelease(cache->dictionary);
+        int i;
+        for (i = 0; i < CONNECTION_CACHE_STRIPES; i ++) {
+            __CFNetConnectionCacheStripe *stripe = &cache->stripes[i];
+            while (stripe->oldest) {
+                CFRelease(cacheEntryRemove(cache, stripe, stripe->oldest));
+            }
+            while (stripe->waiters) {
+                __CFNetConnectionCacheWaiter *waiter = stripe->waiters;
+                stripe->waiters = waiter->next;
+                cacheWaiterFree(waiter);
+            }
+            CFRelease(stripe->dictionary);
+        }
         free(cache);
     }
 }
@@ -199,11 +443,38 @@ void unlockConnectionCache(CFNetConnectionCacheRef cache)
     __CFSpinUnlock(&cache->connectionCacheLock);
 }
 
+#define CONNECTION_CACHE_MAX_VICTIMS (16)
+
+static void applyConnectionProperties(CFAllocatorRef allocator, _CFNetConnectionRef conn, CFDictionaryRef connectionProperties) {
+    CFIndex count;
+    if (connectionProperties && (count = CFDictionaryGetCount(connectionProperties)) > 0) {
+        CFStringRef *keys = CFAllocatorAllocate(allocator, sizeof(CFStringRef)*count*2, 0);
+        CFTypeRef *values = (CFTypeRef *)(keys + count);
+        CFIndex index;
+        CFDictionaryGetKeysAndValues(connectionProperties, (const void **)keys, (const void **)values);
+        for (index = 0; index < count; index ++) {
+            if (!CFReadStreamSetProperty(_CFNetConnectionGetResponseStream(conn), keys[index], values[index])) {
+                CFWriteStreamSetProperty(_CFNetConnectionGetRequestStream(conn), keys[index], values[index]);
+            }
+        }
+        CFAllocatorDeallocate(allocator, keys);
+    }
+}
+
+// Creates a connection and adds it to the stripe.  Call with the stripe locked.
+static _CFNetConnectionRef cacheCreateConnection(CFNetConnectionCacheRef cache, __CFNetConnectionCacheStripe *stripe, CFAllocatorRef allocator, const _CFNetConnectionCallBacks *callbacks, const void *info, _CFNetConnectionCacheKey key) {
+    _CFNetConnectionRef conn = _CFNetConnectionCreate(allocator, info, callbacks, TRUE);
+    if (conn) {
+        cacheEntryAdd(cache, stripe, key, conn);
+        _CFNetConnectionSetAllowsNewRequests(conn, TRUE);
+    }
+    return conn;
+}
+
 _CFNetConnectionRef findOrCreateNetConnection(CFNetConnectionCacheRef connectionCache, CFAllocatorRef allocator, const _CFNetConnectionCallBacks *callbacks, const void *info, _CFNetConnectionCacheKey key, Boolean persistent, CFDictionaryRef connectionProperties)
 {
     _CFNetConnectionRef conn = NULL;
     Boolean created = FALSE;
-    CFIndex count;
     
     if (!persistent) {
         // This request gets its own connection
@@ -212,61 +483,197 @@ _CFNetConnectionRef findOrCreateNetConnection(CFNetConnectionCacheRef connection
             created = TRUE;
         }
     } else {
-        lockConnectionCache(connectionCache);
+        __CFNetConnectionCacheStripe *stripe = cacheStripeForKey(connectionCache, key);
+        __CFNetConnectionCacheEntry *entry, *sibling;
+        _CFNetConnectionRef victims[CONNECTION_CACHE_MAX_VICTIMS];
+        int numVictims = 0;
         
-        conn = (_CFNetConnectionRef)CFDictionaryGetValue(connectionCache->dictionary, key);
-        if (conn) {
-            if (!_CFNetConnectionWillEnqueueRequests(conn)) {
-                conn = NULL;
-                CFDictionaryRemoveValue(connectionCache->dictionary, key);
+        __CFSpinLock(&stripe->lock);
+        
+        // Use the first of the key's connections still taking requests
+        for (entry = (__CFNetConnectionCacheEntry *)CFDictionaryGetValue(stripe->dictionary, key); entry && !conn; entry = sibling) {
+            sibling = entry->sibling;
+            if (!_CFNetConnectionWillEnqueueRequests(entry->conn)) {
+                if (numVictims < CONNECTION_CACHE_MAX_VICTIMS) victims[numVictims ++] = cacheEntryRemove(connectionCache, stripe, entry);
             } else {
-                created = FALSE;
+                conn = entry->conn;
                 CFRetain(conn);
+                cacheEntryUnlink(stripe, entry);
+                cacheEntryMakeNewest(stripe, entry);
             }
         } 
         if (!conn) {
-            conn = _CFNetConnectionCreate(allocator, info, callbacks, TRUE);
-            if (conn) {
-                created = TRUE;
-                _CFNetConnectionSetAllowsNewRequests(conn, TRUE);
-                CFDictionarySetValue(connectionCache->dictionary, key, conn);
-            }
+            conn = cacheCreateConnection(connectionCache, stripe, allocator, callbacks, info, key);
+            created = (conn != NULL);
         }
-        unlockConnectionCache(connectionCache);
+        cacheTrim(connectionCache, stripe, key, conn, created, victims, &numVictims, CONNECTION_CACHE_MAX_VICTIMS);
+        
+        __CFSpinUnlock(&stripe->lock);
+        
+        // Dropping the last reference shuts the connection down, so do it unlocked.
+        while (numVictims --) CFRelease(victims[numVictims]);
     }
-    if (created && (count = CFDictionaryGetCount(connectionProperties)) > 0) {
-        CFStringRef *keys = CFAllocatorAllocate(allocator, sizeof(CFStringRef)*count*2, 0);
-        CFTypeRef *values = (CFTypeRef *)(keys + count);
-        CFIndex index;
-        CFDictionaryGetKeysAndValues(connectionProperties, (const void **)keys, (const void **)values);
-        for (index = 0; index < count; index ++) {
-            if (!CFReadStreamSetProperty(_CFNetConnectionGetResponseStream(conn), keys[index], values[index])) {
-                CFWriteStreamSetProperty(_CFNetConnectionGetRequestStream(conn), keys[index], values[index]);
+    if (created) {
+        applyConnectionProperties(allocator, conn, connectionProperties);
+    }
+    return conn;
+}
+
+/* Hands out a connection from the pool of up to maxConnectionsPerHost persistent connections for key: an
+idle one if there is one, else a new one while the pool has room, else the least loaded of those that
+can pipeline the request right away.  Failing all that, the request waits its turn behind any other
+waiters for key and NULL is returned; waitSource is signalled (and the given run loops woken) whenever
+a connection may have come free, at which point the caller should call again with the same source.
+Calling again keeps the waiter's place in line and refreshes its run loops. */
+_CFNetConnectionRef findOrWaitForNetConnection(CFNetConnectionCacheRef connectionCache, CFAllocatorRef allocator, const _CFNetConnectionCallBacks *callbacks, const void *info, _CFNetConnectionCacheKey key, CFDictionaryRef connectionProperties, CFRunLoopSourceRef waitSource, CFArrayRef runLoopsAndModes)
+{
+    __CFNetConnectionCacheStripe *stripe = cacheStripeForKey(connectionCache, key);
+    __CFNetConnectionCacheEntry *entry, *sibling, *idle = NULL, *pipelinable = NULL;
+    __CFNetConnectionCacheWaiter *waiter, *first = NULL, **link;
+    _CFNetConnectionRef conn = NULL;
+    _CFNetConnectionRef victims[CONNECTION_CACHE_MAX_VICTIMS];
+    int numVictims = 0, pipelinableDepth = 0;
+    CFIndex live = 0, maxConnections;
+    Boolean created = FALSE;
+    
+    __CFSpinLock(&connectionCache->countLock);
+    maxConnections = connectionCache->maxConnectionsPerHost;
+    __CFSpinUnlock(&connectionCache->countLock);
+    
+    __CFSpinLock(&stripe->lock);
+    
+    for (entry = (__CFNetConnectionCacheEntry *)CFDictionaryGetValue(stripe->dictionary, key); entry; entry = sibling) {
+        sibling = entry->sibling;
+        if (!_CFNetConnectionWillEnqueueRequests(entry->conn)) {
+            if (numVictims < CONNECTION_CACHE_MAX_VICTIMS) victims[numVictims ++] = cacheEntryRemove(connectionCache, stripe, entry);
+        } else {
+            int depth = _CFNetConnectionGetQueueDepth(entry->conn);
+            live ++;
+            if (depth == 0) {
+                if (!idle) idle = entry;
+            } else if ((!pipelinable || depth < pipelinableDepth) && _CFNetConnectionCanPipeline(entry->conn)) {
+                pipelinable = entry;
+                pipelinableDepth = depth;
             }
         }
-        CFAllocatorDeallocate(allocator, keys);
+    }
+    
+    // Find our place in line, if we have one; only the first waiter for key may take a connection.
+    for (link = &stripe->waiters; *link; link = &(*link)->next) {
+        if (!connCacheKeyEqual((*link)->key, key)) continue;
+        if (!first) first = *link;
+        if ((*link)->source == waitSource) break;
+    }
+    waiter = *link;
+    
+    if (!first || first == waiter || !waitSource) {
+        if (idle) {
+            conn = idle->conn;
+        } else if (maxConnections <= 0 || live < maxConnections) {
+            conn = cacheCreateConnection(connectionCache, stripe, allocator, callbacks, info, key);
+            created = (conn != NULL);
+        } else if (pipelinable) {
+            conn = pipelinable->conn;
+        }
+    }
+    
+    if (conn) {
+        if (!created) {
+            entry = idle ? idle : pipelinable;
+            CFRetain(conn);
+            cacheEntryUnlink(stripe, entry);
+            cacheEntryMakeNewest(stripe, entry);
+        }
+        if (waiter) {
+            *link = waiter->next;
+            cacheWaiterFree(waiter);
+            
+            // There may be room for the next in line, too.
+            cacheWakeWaiter(stripe, key);
+        }
+    } else if (waiter) {
+        if (runLoopsAndModes) CFRetain(runLoopsAndModes);
+        if (waiter->runLoopsAndModes) CFRelease(waiter->runLoopsAndModes);
+        waiter->runLoopsAndModes = runLoopsAndModes;
+    } else if (waitSource && (waiter = malloc(sizeof(__CFNetConnectionCacheWaiter))) != NULL) {
+        waiter->next = NULL;
+        waiter->key = (_CFNetConnectionCacheKey)connCacheKeyRetain(NULL, key);
+        waiter->source = (CFRunLoopSourceRef)CFRetain(waitSource);
+        waiter->runLoopsAndModes = runLoopsAndModes ? CFRetain(runLoopsAndModes) : NULL;
+        *link = waiter;
+    }
+    
+    cacheTrim(connectionCache, stripe, key, conn, created, victims, &numVictims, CONNECTION_CACHE_MAX_VICTIMS);
+    
+    __CFSpinUnlock(&stripe->lock);
+    
+    while (numVictims --) CFRelease(victims[numVictims]);
+    
+    if (created) {
+        applyConnectionProperties(allocator, conn, connectionProperties);
     }
     return conn;
 }
 
+void cancelConnectionCacheWait(CFNetConnectionCacheRef cache, CFRunLoopSourceRef waitSource) {
+    int i;
+    for (i = 0; i < CONNECTION_CACHE_STRIPES; i ++) {
+        __CFNetConnectionCacheStripe *stripe = &cache->stripes[i];
+        __CFNetConnectionCacheWaiter *waiter = NULL, **link;
+        
+        __CFSpinLock(&stripe->lock);
+        for (link = &stripe->waiters; *link; link = &(*link)->next) {
+            if ((*link)->source == waitSource) {
+                waiter = *link;
+                *link = waiter->next;
+                
+                // Pass on any wakeup meant for us.
+                cacheWakeWaiter(stripe, waiter->key);
+                break;
+            }
+        }
+        __CFSpinUnlock(&stripe->lock);
+        
+        if (waiter) {
+            cacheWaiterFree(waiter);
+            break;
+        }
+    }
+}
+
+void wakeConnectionCacheWaiter(CFNetConnectionCacheRef cache, _CFNetConnectionCacheKey key) {
+    __CFNetConnectionCacheStripe *stripe = cacheStripeForKey(cache, key);
+    __CFSpinLock(&stripe->lock);
+    cacheWakeWaiter(stripe, key);
+    __CFSpinUnlock(&stripe->lock);
+}
+
 void removeFromConnectionCache(CFNetConnectionCacheRef cache, _CFNetConnectionRef conn, _CFNetConnectionCacheKey key) {
-    _CFNetConnectionRef cachedConn;
-    lockConnectionCache(cache);
-    cachedConn = (_CFNetConnectionRef)CFDictionaryGetValue(cache->dictionary, key);
-    if (cachedConn && cachedConn == conn) {
-        CFDictionaryRemoveValue(cache->dictionary, key);
+    __CFNetConnectionCacheStripe *stripe = cacheStripeForKey(cache, key);
+    __CFNetConnectionCacheEntry *entry;
+    _CFNetConnectionRef cachedConn = NULL;
+    __CFSpinLock(&stripe->lock);
+    entry = (__CFNetConnectionCacheEntry *)CFDictionaryGetValue(stripe->dictionary, key);
+    while (entry && entry->conn != conn) entry = entry->sibling;
+    if (entry) {
+        cachedConn = cacheEntryRemove(cache, stripe, entry);
     }
-    unlockConnectionCache(cache);
+    __CFSpinUnlock(&stripe->lock);
+    if (cachedConn) CFRelease(cachedConn);
 }
 
 // for mark & sweep algorithms around callouts, where we're worried about the client removing itself (and possibly others) from the queue while we're walking it.  See sendStateChanged for an example.
 #define MARKED_REQUEST (0)
 #define IS_ZOMBIE_REQUEST (1)
+// Finished transmitting while the response to an earlier request was still outstanding
+#define PIPELINED_REQUEST (2)
 
 typedef struct _CFNetRequest {
     struct _CFNetRequest *next;
     void *request;
     UInt8 flags; 
+    CFAbsoluteTime sent;    // When the request finished transmitting; 0 until then
+    long long length;       // Length of the response body if the client has told us; -1 otherwise
 } _CFNetRequest;
 
 static inline Boolean isMarkedRequest(_CFNetRequest *req) {
@@ -306,6 +713,9 @@ typedef struct {
 
     CFAbsoluteTime emptyTime; // The time at which this connection's queue was completely emptied
 //    int numRequests;
+
+    CFStringRef pipelineServer;         // Server whose pipelining record governs ours; NULL to pipeline without limits
+    CFAbsoluteTime lastResponseTime;    // The time at which the last response completed
     
     const _CFNetConnectionCallBacks *cb;
     const void *info;
@@ -323,12 +733,35 @@ static inline void _CFNetConnectionUnlock(__CFNetConnection *conn) {
 	}
 }
 
+// Adaptive pipelining keeps a record for each server of how pipelining to it has gone.
+#define PIPELINE_INITIAL_DEPTH (2)                      // Requests in flight until there are measurements to go by
+#define PIPELINE_MAX_DEPTH (8)                          // Most requests ever in flight
+#define PIPELINE_LARGE_RESPONSE (128 * 1024)            // Nothing is sent behind responses at least this long
+#define PIPELINE_MAX_FAILURES (2)                       // Failures after which the server is blacklisted
+#define PIPELINE_FORGIVE_COUNT (16)                     // Pipelined responses which make up for one failure
+#define PIPELINE_BLACKLIST_TIME ((CFTimeInterval)3600.0) // How long a blacklisted server goes without pipelining
+#define PIPELINE_MAX_SERVERS (256)                      // Records kept before starting over
+#define PIPELINE_SMOOTHING (0.125)                      // Weight of each new measurement, as with TCP's smoothed RTT
+
+typedef struct {
+    UInt32 failures;            // Errors while pipelining, less those forgiven
+    UInt32 successes;           // Pipelined responses since the last failure or forgiveness
+    CFAbsoluteTime blacklisted; // When the server was blacklisted; 0 if it isn't
+    CFTimeInterval rtt;         // Smoothed wait for the response to a request sent on its own
+    CFTimeInterval interval;    // Smoothed time between back to back pipelined responses
+    double length;              // Smoothed response length
+} __CFNetPipelineRecord;
+
+static _CFMutex gPipelineLock;                              // Not a spin lock; records are allocated and freed under it.  Set up with the class
+static CFMutableDictionaryRef gPipelineRecords = NULL;     // server -> __CFNetPipelineRecord*, which the dictionary doesn't own
+
 //#define LOG_CONNECTIONS 1
 //#define DEBUG_CONNECTIONS 1
 static void shutdownConnectionStreams(__CFNetConnection* conn);
 static void rescheduleStream(CFTypeRef stream, CFArrayRef oldRLArray, CFArrayRef newRLArray);
 static void scheduleNewRequest(__CFNetConnection* conn, _CFNetRequest *newRequest, _CFNetRequest *priorRequest, Boolean priorRequestIsNewResponse);
 static void scheduleNewResponse(__CFNetConnection* conn, _CFNetRequest *newRequest, _CFNetRequest *priorRequest);
+static Boolean shouldPipelineNow(__CFNetConnection *conn);
 
 #if defined(DEBUG_CONNECTIONS)
 static Boolean checkList(_CFNetRequest *head, _CFNetRequest *tail) {
@@ -410,6 +843,7 @@ static void _CFNetConnectionFinalize(__CFNetConnection* conn) {
         }
     }
 //    fprintf(stderr, "Processed %d requests\n", conn->numRequests);
+    if (conn->pipelineServer) CFRelease(conn->pipelineServer);
 	if (__CFBitIsSet(conn->flags, LOCK_NET_CONNECTION)) 
 		_CFMutexDestroy(&conn->lock);
     if (conn->cb->finalize) conn->cb->finalize(alloc, conn->info);
@@ -527,6 +961,9 @@ static void _CFNetConnectionRegisterClass(void) {
 	};
 
     __kCFNetConnectionTypeID = _CFRuntimeRegisterClass(&__CFNetConnectionClass);
+    
+    // Every connection comes through here before it can touch a pipelining record.
+    _CFMutexInit(&gPipelineLock, FALSE);
 }
 
 
@@ -588,6 +1025,8 @@ _CFNetConnectionCreate(CFAllocatorRef alloc, const void *info, const _CFNetConne
 //    connection->numRequests = 0;
     connection->requestStream = NULL;
     connection->responseStream = NULL;
+    connection->pipelineServer = NULL;
+    connection->lastResponseTime = 0;
         
     connection->cb = callbacks;
     if (connection->cb && connection->cb->create) {
@@ -638,6 +1077,8 @@ Boolean _CFNetConnectionEnqueue(_CFNetConnectionRef arg, void *req) {
         newReq->request = req;
         newReq->next = NULL;
         newReq->flags = 0;
+        newReq->sent = 0;
+        newReq->length = -1;
         addToList(&(conn->head), &(conn->tail), newReq);
         if (!conn->currentRequest) {
             conn->currentRequest = newReq;
@@ -647,7 +1088,7 @@ Boolean _CFNetConnectionEnqueue(_CFNetConnectionRef arg, void *req) {
         }
         conn->cb->requestStateChanged(req, kQueued, NULL, (_CFNetConnectionRef)conn, conn->info);
 
-        if (conn->currentRequest == conn->currentResponse || __CFBitIsSet(conn->flags, SHOULD_PIPELINE)) {
+        if (conn->currentRequest == conn->currentResponse || shouldPipelineNow(conn)) {
             if (conn->currentRequest == newReq) {
                 scheduleNewRequest(conn, conn->currentRequest, NULL, FALSE);
             } else if (conn->cb->runLoopAndModesArrayForRequest && conn->requestStream && nextRealRequest(conn->currentRequest) == newReq) {
@@ -874,6 +1315,137 @@ static void schedulePipelinedTransition(__CFNetConnection *conn, _CFNetRequest *
     }
 }
 
+static void pipelineRecordFree(const void *key, const void *value, void *context) {
+    free((void *)value);
+}
+
+// Finds the pipelining record for the server, creating one if asked to.  Call with gPipelineLock held.
+static __CFNetPipelineRecord *pipelineRecordForServer(CFStringRef server, Boolean create) {
+    __CFNetPipelineRecord *record = gPipelineRecords ? (__CFNetPipelineRecord *)CFDictionaryGetValue(gPipelineRecords, server) : NULL;
+    
+    if (!record && create) {
+        if (!gPipelineRecords) {
+            gPipelineRecords = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+        } else if (CFDictionaryGetCount(gPipelineRecords) >= PIPELINE_MAX_SERVERS) {
+            // Rather than track which servers were heard from last, start over.
+            CFDictionaryApplyFunction(gPipelineRecords, pipelineRecordFree, NULL);
+            CFDictionaryRemoveAllValues(gPipelineRecords);
+        }
+        if (gPipelineRecords && (record = calloc(1, sizeof(__CFNetPipelineRecord)))) {
+            CFDictionarySetValue(gPipelineRecords, server, record);
+        }
+    }
+    return record;
+}
+
+// Whether any request behind the current response has gone out.  Call from within a lock.
+static Boolean isPipelining(__CFNetConnection *conn) {
+    _CFNetRequest *next = conn->currentResponse ? conn->currentResponse->next : NULL;
+    if (!next || conn->currentRequest == conn->currentResponse) {
+        return FALSE;
+    } else if (next != conn->currentRequest) {
+        return TRUE;
+    } else {
+        return __CFBitIsSet(conn->flags, TRANSMITTING_CURRENT_REQUEST);
+    }
+}
+
+/* Call from within a lock to decide whether the current request may go out while responses to earlier
+ones are still outstanding.  Without a pipeline server, that's whenever pipelining is on.  With one, the
+server must not be blacklisted, nothing goes out behind a response known to be long, and the number in
+flight is kept to what covers the round trip: one, plus the measured wait for a lone response over the
+measured time each pipelined response takes. */
+static Boolean shouldPipelineNow(__CFNetConnection *conn) {
+    __CFNetPipelineRecord *record;
+    _CFNetRequest *req;
+    CFIndex inFlight = 0, depth = PIPELINE_INITIAL_DEPTH;
+    
+    if (!__CFBitIsSet(conn->flags, SHOULD_PIPELINE)) {
+        return FALSE;
+    } else if (!conn->pipelineServer) {
+        return TRUE;
+    } else if (conn->currentResponse && conn->currentResponse->length >= PIPELINE_LARGE_RESPONSE) {
+        return FALSE;
+    }
+    
+    for (req = conn->currentResponse; req && req != conn->currentRequest; req = req->next) {
+        inFlight ++;
+    }
+    
+    _CFMutexLock(&gPipelineLock);
+    record = pipelineRecordForServer(conn->pipelineServer, FALSE);
+    if (record) {
+        if (record->blacklisted && (CFAbsoluteTimeGetCurrent() - record->blacklisted) >= PIPELINE_BLACKLIST_TIME) {
+            // Time served; give the server a fresh start.
+            memset(record, 0, sizeof(record[0]));
+        }
+        if (record->blacklisted || record->length >= PIPELINE_LARGE_RESPONSE) {
+            depth = 1;
+        } else if (record->rtt > 0 && record->interval > 0) {
+            depth = 1 + (CFIndex)(record->rtt / record->interval);
+            if (depth > PIPELINE_MAX_DEPTH) depth = PIPELINE_MAX_DEPTH;
+        }
+    }
+    _CFMutexUnlock(&gPipelineLock);
+    
+    return (inFlight < depth);
+}
+
+// Call from within a lock to add the completed response to the server's pipelining record.
+static void pipelineRecordResponse(__CFNetConnection *conn, _CFNetRequest *response) {
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    
+    if (conn->pipelineServer && response->sent) {
+        __CFNetPipelineRecord *record;
+        
+        _CFMutexLock(&gPipelineLock);
+        record = pipelineRecordForServer(conn->pipelineServer, TRUE);
+        if (record) {
+            if (__CFBitIsSet(response->flags, PIPELINED_REQUEST)) {
+                // It was waiting behind the last response, so the time since then is all its own.
+                CFTimeInterval interval = now - conn->lastResponseTime;
+                record->interval = record->interval ? record->interval + (interval - record->interval) * PIPELINE_SMOOTHING : interval;
+                
+                if (record->failures && ++ record->successes >= PIPELINE_FORGIVE_COUNT) {
+                    record->failures --;
+                    record->successes = 0;
+                }
+            } else {
+                CFTimeInterval rtt = now - response->sent;
+                record->rtt = record->rtt ? record->rtt + (rtt - record->rtt) * PIPELINE_SMOOTHING : rtt;
+            }
+            if (response->length >= 0) {
+                record->length = record->length ? record->length + (response->length - record->length) * PIPELINE_SMOOTHING : response->length;
+            }
+        }
+        _CFMutexUnlock(&gPipelineLock);
+    }
+    conn->lastResponseTime = now;
+}
+
+// Call from within a lock when the connection fails while pipelining; too many such failures blacklist the server.
+static void pipelineRecordFailure(__CFNetConnection *conn) {
+    __CFNetPipelineRecord *record;
+    
+    _CFMutexLock(&gPipelineLock);
+    record = pipelineRecordForServer(conn->pipelineServer, TRUE);
+    if (record && !record->blacklisted) {
+        record->successes = 0;
+        if (++ record->failures >= PIPELINE_MAX_FAILURES) {
+            record->blacklisted = CFAbsoluteTimeGetCurrent();
+        }
+    }
+    _CFMutexUnlock(&gPipelineLock);
+}
+
+// Call from within a lock to start transmitting the current request if it was held back but may now be pipelined.
+static void pipelineHeldRequest(__CFNetConnection *conn) {
+    if (conn->currentRequest && conn->currentRequest != conn->currentResponse &&
+        !__CFBitIsSet(conn->flags, TRANSMITTING_CURRENT_REQUEST) && !__CFBitIsSet(conn->flags, CONNECTION_LOST) && shouldPipelineNow(conn)) {
+        scheduleNewRequest(conn, conn->currentRequest, NULL, FALSE);
+    }
+}
+
 // Once we invoke the requestStateChanged() callback, the queue could be completely mucked with - 
 // possibly many request could dequeue, and any dequeued request should not be messaged.  So we mark the
 // requests we intend to message, and then keep traversing the list, messaging any that are still there.
@@ -913,6 +1485,11 @@ void _CFNetConnectionErrorOccurred(_CFNetConnectionRef arg, CFStreamError *err)
 #endif
     __CFBitClear(conn->flags, ACCEPTS_NEW_REQUESTS);
     
+    /* An error with requests queued up behind the current response counts against pipelining to the server */
+    if (conn->pipelineServer && isPipelining(conn)) {
+        pipelineRecordFailure(conn);
+    }
+    
     /* Orphan all queued requests */
     alloc = CFGetAllocator(conn);
     req = conn->currentResponse;
@@ -1197,6 +1774,19 @@ Boolean _CFNetConnectionIsEmpty(_CFNetConnectionRef arg) {
     return result;
 }
 
+Boolean _CFNetConnectionCanPipeline(_CFNetConnectionRef arg) {
+    
+    Boolean result;
+    __CFNetConnection* conn = (__CFNetConnection*)arg;
+
+	_CFNetConnectionLock(conn);
+    // Everything queued must already be out, or a new request would wait behind the held one.
+    result = __CFBitIsSet(conn->flags, ACCEPTS_NEW_REQUESTS) && !__CFBitIsSet(conn->flags, CONNECTION_LOST) &&
+        !conn->currentRequest && shouldPipelineNow(conn);
+	_CFNetConnectionUnlock(conn);
+    return result;
+}
+
 Boolean _CFNetConnectionWillEnqueueRequests(_CFNetConnectionRef arg) {
     
     Boolean result;
@@ -1219,7 +1809,7 @@ void _CFNetConnectionSetShouldPipeline(_CFNetConnectionRef arg, Boolean shouldPi
 #endif
     if (shouldPipeline && !__CFBitIsSet(conn->flags, SHOULD_PIPELINE)) {
         __CFBitSet(conn->flags, SHOULD_PIPELINE);
-        if (conn->currentRequest && !__CFBitIsSet(conn->flags, TRANSMITTING_CURRENT_REQUEST)) {
+        if (conn->currentRequest && !__CFBitIsSet(conn->flags, TRANSMITTING_CURRENT_REQUEST) && shouldPipelineNow(conn)) {
             scheduleNewRequest(conn, conn->currentRequest, conn->currentResponse, FALSE);
         }
     }
@@ -1229,6 +1819,28 @@ void _CFNetConnectionSetShouldPipeline(_CFNetConnectionRef arg, Boolean shouldPi
 	_CFNetConnectionUnlock(conn);
 }
 
+void _CFNetConnectionSetPipelineServer(_CFNetConnectionRef arg, _CFNetConnectionCacheKey key) {
+
+    __CFNetConnection* conn = (__CFNetConnection*)arg;
+
+	_CFNetConnectionLock(conn);
+    if (!conn->pipelineServer && key) {
+        conn->pipelineServer = connCacheKeyCopyDesc(key);
+    }
+	_CFNetConnectionUnlock(conn);
+}
+
+void _CFNetConnectionSetResponseLength(_CFNetConnectionRef arg, void *req, long long length) {
+
+    __CFNetConnection* conn = (__CFNetConnection*)arg;
+
+	_CFNetConnectionLock(conn);
+    if (conn->currentResponse && conn->currentResponse->request == req) {
+        conn->currentResponse->length = length;
+    }
+	_CFNetConnectionUnlock(conn);
+}
+
 // Currently not used, so hand dead-stripping for now.
 //Boolean _CFNetConnectionIsPipelining(_CFNetConnectionRef arg) {
 //    __CFNetConnection* conn = (__CFNetConnection*)arg;
@@ -1274,6 +1886,7 @@ void _CFNetConnectionResponseIsComplete(_CFNetConnectionRef arg, void *req) {
             // Do not allow currentResponse to pass currentRequest
             __CFBitSet(conn->flags, CURRENT_RESPONSE_COMPLETE);
         } else {
+            pipelineRecordResponse(conn, oldResponse);
             conn->currentResponse = conn->currentResponse->next;
             if (conn->currentResponse) {
                 if (__CFBitIsSet(conn->flags, CONNECTION_LOST)) {
@@ -1282,8 +1895,8 @@ void _CFNetConnectionResponseIsComplete(_CFNetConnectionRef arg, void *req) {
                 } else if (conn->currentResponse != conn->currentRequest) {
                     // Only start the next response if its  request is done transmitting
                     newResponse = conn->currentResponse;
-                } else if (!__CFBitIsSet(conn->flags, SHOULD_PIPELINE) && !__CFBitIsSet(conn->flags, TRANSMITTING_CURRENT_REQUEST)) {
-                    // Haven't been transmitting currentRequest; start doing so now
+                } else if (!__CFBitIsSet(conn->flags, TRANSMITTING_CURRENT_REQUEST)) {
+                    // Haven't been transmitting currentRequest (not pipelining, or adaptive pipelining held it back); start doing so now
                     // In the non-pipelining case, we must ensure that the former response is completely off the line
                     // before we start the new request, so we need to call scheduleNewResponse first.  This is a 
                     // performance hit we need to work out....
@@ -1293,6 +1906,9 @@ void _CFNetConnectionResponseIsComplete(_CFNetConnectionRef arg, void *req) {
             }
             if (!didNonPipelinedTransition) {
                 scheduleNewResponse(conn, newResponse, oldResponse);
+                
+                // With one less in flight, a request held back by adaptive pipelining may be able to go.
+                pipelineHeldRequest(conn);
             }
         }
     }
@@ -1315,9 +1931,13 @@ void _CFNetConnectionRequestIsComplete(_CFNetConnectionRef arg, void *req) {
         _CFNetRequest *formerRequest = conn->currentRequest;
         Boolean currResponseComplete = __CFBitIsSet(conn->flags, CURRENT_RESPONSE_COMPLETE);
         Boolean formerRequestIsNewResponse = (conn->currentResponse->request == req && !currResponseComplete);
+        formerRequest->sent = CFAbsoluteTimeGetCurrent();
+        if (conn->currentResponse != formerRequest) {
+            __CFBitSet(formerRequest->flags, PIPELINED_REQUEST);
+        }
         if (!__CFBitIsSet(conn->flags, CONNECTION_LOST)) {
             conn->currentRequest = conn->currentRequest->next;
-            if (conn->currentRequest && __CFBitIsSet(conn->flags, SHOULD_PIPELINE)) {
+            if (conn->currentRequest && shouldPipelineNow(conn)) {
                 scheduleNewRequest(conn, conn->currentRequest, formerRequest, formerRequestIsNewResponse);
             } else {
                 scheduleNewRequest(conn, NULL, formerRequest, formerRequestIsNewResponse);
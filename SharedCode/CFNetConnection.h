@@ -46,6 +46,15 @@ extern "C" {
  */
 typedef struct __CFNetConnection*       _CFNetConnectionRef;
 
+/*
+ *  _CFNetConnectionCacheKey
+ *  
+ *  Discussion:
+ *    Names the server, port, connection type and properties a net
+ *    connection is cached under.
+ */
+typedef struct __CFNetConnectionCacheKey*	_CFNetConnectionCacheKey;
+
 /*
  *  _CFNetConnectionState
  *  
@@ -284,6 +293,29 @@ _CFNetConnectionSetShouldPipeline(
   _CFNetConnectionRef   conn,
   Boolean               shouldPipeline)                       AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
 
+
+/* Paces pipelining by the record kept for the server named by key; without a server, pipelining is unlimited.  Only the first call has any effect */
+/*
+ *  _CFNetConnectionSetPipelineServer()
+ *
+ */
+extern void
+_CFNetConnectionSetPipelineServer(
+  _CFNetConnectionRef        conn,
+  _CFNetConnectionCacheKey   key)                             AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
+
+
+/* Announces the length of the response to req, if it is the current response; -1 if unknown.  Used by adaptive pipelining */
+/*
+ *  _CFNetConnectionSetResponseLength()
+ *
+ */
+extern void
+_CFNetConnectionSetResponseLength(
+  _CFNetConnectionRef   conn,
+  void *                req,
+  long long             length)                               AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
+
 extern CFAbsoluteTime 
 _CFNetConnectionGetLastAccessTime(_CFNetConnectionRef arg);
 
@@ -308,6 +340,15 @@ extern Boolean
 _CFNetConnectionWillEnqueueRequests(_CFNetConnectionRef conn) AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
 
 
+/* Whether a request enqueued now would be pipelined straight away, rather than wait for responses to those ahead of it*/
+/*
+ *  _CFNetConnectionCanPipeline()
+ *  
+ */
+extern Boolean 
+_CFNetConnectionCanPipeline(_CFNetConnectionRef conn)         AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
 /* Gets the connection's current opinion about the request's state.  If advanceConnection is TRUE, calling this will cause the connection to attempt to further the state of its queue, and may cause calls back in to the request.  If the connection knows nothing about the request, it will return kOrphaned, and the calling request should forget any tie to this connection*/
 /*
  *  _CFNetConnectionGetState()
@@ -360,7 +401,6 @@ _CFNetConnectionIsEmpty(_CFNetConnectionRef conn)             AVAILABLE_MAC_OS_X
 
 
 typedef struct __CFNetConnectionCache *		CFNetConnectionCacheRef;
-typedef struct __CFNetConnectionCacheKey*	_CFNetConnectionCacheKey;
 
 
 //
@@ -370,10 +410,22 @@ CFNetConnectionCacheRef createConnectionCache();
 #if defined(__WIN32__)
 void releaseConnectionCache(CFNetConnectionCacheRef cache);
 #endif	/* defined(__WIN32__) */
+// Limits on idle persistent connections kept by the cache.  Zero or less disables a limit.
+// Over a limit, the least recently used idle connections are shut down first.
+void setConnectionCacheLimits(CFNetConnectionCacheRef cache, CFIndex maxPerHost, CFIndex maxTotal, CFTimeInterval idleTimeout);
+// The most connections findOrWaitForNetConnection keeps open for a key.  Zero or less disables the limit.
+void setConnectionCacheMaxConnectionsPerHost(CFNetConnectionCacheRef cache, CFIndex maxConnectionsPerHost);
 void lockConnectionCache(CFNetConnectionCacheRef cache);
 void unlockConnectionCache(CFNetConnectionCacheRef cache);
 extern
 _CFNetConnectionRef findOrCreateNetConnection(CFNetConnectionCacheRef connectionCache, CFAllocatorRef allocator, const _CFNetConnectionCallBacks *callbacks, const void *info, _CFNetConnectionCacheKey key, Boolean persistent, CFDictionaryRef connectionProperties);	// This routine ties the two objects (connection cache & connection)
+// Pooled variant of findOrCreateNetConnection for persistent connections.  Returns NULL with the request queued
+// for its turn if the pool for key is full; waitSource is then signalled whenever a connection may have come free.
+extern
+_CFNetConnectionRef findOrWaitForNetConnection(CFNetConnectionCacheRef connectionCache, CFAllocatorRef allocator, const _CFNetConnectionCallBacks *callbacks, const void *info, _CFNetConnectionCacheKey key, CFDictionaryRef connectionProperties, CFRunLoopSourceRef waitSource, CFArrayRef runLoopsAndModes);
+void cancelConnectionCacheWait(CFNetConnectionCacheRef cache, CFRunLoopSourceRef waitSource);
+// Call when a request leaves one of key's connections, so the next waiter can try for it
+void wakeConnectionCacheWaiter(CFNetConnectionCacheRef cache, _CFNetConnectionCacheKey key);
 extern
 void removeFromConnectionCache(CFNetConnectionCacheRef cache, _CFNetConnectionRef conn, _CFNetConnectionCacheKey key);
 
@@ -145,6 +145,10 @@ CF_INLINE int _CFThreadSpawn(_CFThread *thread, void *(*func)(void *), void *arg
     return pthread_create(thread, NULL, func, arg);
 }
 
+CF_INLINE int _CFThreadJoin(_CFThread thread) {
+    return pthread_join(thread, NULL);
+}
+
 #else   // __WIN32__
 
 typedef CRITICAL_SECTION _CFMutex;
@@ -190,6 +194,12 @@ typedef HANDLE _CFThread;
 
 extern int _CFThreadSpawn(_CFThread *thread, void *(*func)(void *), void *arg);
 
+CF_INLINE int _CFThreadJoin(_CFThread thread) {
+    int result = (WaitForSingleObject(thread, INFINITE) == WAIT_OBJECT_0) ? 0 : -1;
+    CloseHandle(thread);
+    return result;
+}
+
 #endif  // __WIN32__
 
 
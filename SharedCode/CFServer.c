@@ -34,6 +34,8 @@
 #include <CoreFoundation/CFRuntime.h>
 #include <CFNetwork/CFNetwork.h>
 
+#include "CFNetworkThreadSupport.h"
+
 #include <assert.h>
 
 #if defined(__WIN32__)
@@ -43,6 +45,10 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 
@@ -67,11 +73,28 @@ static CONST_STRING_DECL(_kCFServerEmptyString, "")
 #pragma mark -
 #pragma mark Type Declarations
 
+typedef struct {
+	_CFThread			_thread;		// Thread running the listener's run loop
+	CFSocketRef			_sockets[2];	// Sockets sharing the server's port through SO_REUSEPORT
+	CFRunLoopSourceRef	_stopSource;	// Signalled to stop the listener's run loop
+	
+	_CFMutex			_lock;			// Protects the fields below
+	CFRunLoopRef		_runLoop;		// The listener's run loop, NULL until the thread is up
+	Boolean				_stopping;		// Set when the listener should exit
+} ServerListener;
+
+
 typedef struct {
     CFRuntimeBase		_base;			// CFRuntimeBase for CF types
 	
 	CFSocketRef			_sockets[2];	// Server sockets listening for connections
 	
+	CFIndex				_listenerCount;	// Number of extra listener threads to open on the port
+	ServerListener*		_listeners;		// The running extra listeners
+	_CFMutex			_callbackLock;	// Serializes the callback once listeners can accept alongside the server's own sockets
+	Boolean				_batchAccept;	// Accept everything queued on each wakeup instead of one at a time
+	CFIndex				_fastOpenQueue;	// Pending TCP Fast Open connections allowed, zero for none
+	
 	CFStringRef			_name;			// Name that is being registered
 	CFStringRef			_type;			// Service type that is being registered
     UInt32				_port;			// Port being serviced
@@ -92,8 +115,16 @@ typedef struct {
 static void _ServerRelease(_CFServerRef server);
 CFStringRef _ServerCopyDescription(_CFServerRef server);
 
+static Boolean _ServerCreateSockets(Server* server, CFSocketRef sockets[2]);
+static Boolean _ServerSetAddresses(CFAllocatorRef alloc, CFSocketRef sockets[2], UInt32* port);
 static void _ServerReleaseSocket(Server* server);
 static void _ServerHandleAccept(Server* server, CFSocketNativeHandle nativeSocket);
+static void _ServerHandleAcceptBatch(Server* server, CFSocketNativeHandle listening);
+
+static Boolean _ServerStartListeners(Server* server);
+static void _ServerStopListeners(Server* server);
+static void* _ServerListenerMain(ServerListener* listener);
+static void _ServerListenerStop(ServerListener* listener);
 static void _SocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address, const void *data, Server* server);
 
 #if defined(__MACH__)
@@ -145,13 +176,6 @@ _CFServerCreate(CFAllocatorRef alloc, _CFServerCallBack callback, _CFServerConte
     Server* server = NULL;
 	    
 	do {
-		int yes = 1;
-		CFSocketContext socketCtxt = {0,
-									  NULL,
-									  (const void*(*)(const void*))&CFRetain,
-									  (void(*)(const void*))&CFRelease,
-									  (CFStringRef(*)(const void *))&CFCopyDescription};
-        
         CFTypeID id = _CFServerGetTypeID();
     
         // Ask CF to allocate the instance and then return it.
@@ -170,43 +194,17 @@ _CFServerCreate(CFAllocatorRef alloc, _CFServerCallBack callback, _CFServerConte
         server->_type = NULL;
         server->_port = 0;
         server->_service = NULL;
+        server->_listenerCount = 0;
+        server->_listeners = NULL;
+        _CFMutexInit(&server->_callbackLock, FALSE);
+        server->_batchAccept = FALSE;
+        server->_fastOpenQueue = 0;
         memset(&server->_callback, 0, sizeof(server->_callback));
         memset(&server->_ctxt, 0, sizeof(server->_ctxt));
         
-		// Make sure the server is saved for the callback.
-		socketCtxt.info = server;
-		
-		// Create the IPv4 server socket.
-		server->_sockets[0] = CFSocketCreate(alloc,
-											 PF_INET,
-											 SOCK_STREAM,
-											 IPPROTO_TCP,
-											 kCFSocketAcceptCallBack,
-											 (CFSocketCallBack)&_SocketCallBack,
-											 &socketCtxt);
-		
-		// If the socket couldn't create, bail.
-		if (server->_sockets[0] == NULL)
-			break;
-		
-		// Create the IPv6 server socket.
-		server->_sockets[1] = CFSocketCreate(alloc,
-											 PF_INET6,
-											 SOCK_STREAM,
-											 IPPROTO_TCP,
-											 kCFSocketAcceptCallBack,
-											 (CFSocketCallBack)&_SocketCallBack,
-											 &socketCtxt);
-		
-		// If the socket couldn't create, bail.
-		if (server->_sockets[1] == NULL)
+		// Create the IPv4 and IPv6 server sockets.  If they couldn't create, bail.
+		if (!_ServerCreateSockets(server, server->_sockets))
 			break;
-		
-		// In order to accomadate stopping and starting the process without closing the socket,
-		// set the addr for resuse on the native socket.  This is not required if the port is
-		// being supplied by the OS opposed to being specified by the user.
-		setsockopt(CFSocketGetNative(server->_sockets[0]), SOL_SOCKET, SO_REUSEADDR, (void*)&yes, sizeof(yes));
-		setsockopt(CFSocketGetNative(server->_sockets[1]), SOL_SOCKET, SO_REUSEADDR, (void*)&yes, sizeof(yes));
         
 		// Save the user's callback in context.
 		server->_callback = callback;
@@ -242,6 +240,8 @@ _ServerRelease(_CFServerRef server) {
 
     // Invalidate the server which will release the socket and service.
     _CFServerInvalidate(server);
+    
+    _CFMutexDestroy(&((Server*)server)->_callbackLock);
 }
 
 
@@ -297,16 +297,11 @@ _CFServerStart(_CFServerRef server, CFStringRef name, CFStringRef type, UInt32 p
 	
 	Server* s = (Server*)server;
 
-	CFDataRef address = NULL;
-	
 	do {
         unsigned i;
 		CFRunLoopRef rl = CFRunLoopGetCurrent();
         CFAllocatorRef alloc = CFGetAllocator(server);
 		
-        struct sockaddr_in addr4;
-        struct sockaddr_in6 addr6;
-				
 		// Make sure the port is valid (0 - 65535).
 		if ((port & 0xFFFF0000U) != 0)
 			break;
@@ -315,6 +310,16 @@ _CFServerStart(_CFServerRef server, CFStringRef name, CFStringRef type, UInt32 p
 		if (name == NULL)
 			name = _kCFServerEmptyString;
 		
+		// Sharing the port, batching accepts and Fast Open all need sockets set
+		// up for it before binding, so trade the ones made at creation for new ones.
+		if ((s->_listenerCount != 0) || s->_batchAccept || (s->_fastOpenQueue != 0)) {
+			
+			_ServerReleaseSocket(s);
+			
+			if (!_ServerCreateSockets(s, s->_sockets))
+				break;
+		}
+		
 		for (i = 0; i < (sizeof(s->_sockets) / sizeof(s->_sockets[0])); i++) {
 		
 			// Create the run loop source for putting on the run loop.
@@ -327,64 +332,8 @@ _CFServerStart(_CFServerRef server, CFStringRef name, CFStringRef type, UInt32 p
 			CFRelease(src);
 		}
 
-		memset(&addr4, 0, sizeof(addr4));
-		
-		// Put the local port and address into the native address.
-#if defined(__MACH__)
-        addr4.sin_len = sizeof(addr4);
-#endif
-		addr4.sin_family = AF_INET;
-		addr4.sin_port = htons((UInt16)port);
-		addr4.sin_addr.s_addr = htonl(INADDR_ANY);
-		
-		// Wrap the native address structure for CFSocketCreate.
-		address = CFDataCreateWithBytesNoCopy(alloc, (const UInt8*)&addr4, sizeof(addr4), kCFAllocatorNull);
-		
-		// If it failed to create the address data, bail.
-		if (address == NULL)
-			break;
-			
-		// Set the local binding which causes the socket to start listening.
-		if (CFSocketSetAddress(s->_sockets[0], address) != kCFSocketSuccess)
-			break;
-		
-		CFRelease(address);
-		
-		address = CFSocketCopyAddress(s->_sockets[0]);
-		memcpy(&addr4, CFDataGetBytePtr(address), CFDataGetLength(address));
-            
-		port = ntohs(addr4.sin_port);
-
-		CFRelease(address);
-
-		memset(&addr6, 0, sizeof(addr6));
-
-        // Put the local port and address into the native address.
-        addr6.sin6_family = AF_INET6;
-#ifndef __WIN32__
-        addr6.sin6_port = htons((UInt16)port);
-#if defined(__MACH__)
-        addr6.sin6_len = sizeof(addr6);
-#endif
-        memcpy(&(addr6.sin6_addr), &in6addr_any, sizeof(addr6.sin6_addr));
-#else
-#ifndef __MINGW32__
-        // real MS headers have this
-        IN6ADDR_SETANY(addr6);
-        addr6.sin6_port = htons((UInt16)port);
-#else
-        addr6.sin6_port = htons((UInt16)port);
-        // mingw's w32 headers have this INIT macro instead, for some odd reason
-        struct sockaddr_in6 in6addr_any = IN6ADDR_ANY_INIT;
-        memcpy(&(addr6.sin6_addr), &in6addr_any, sizeof(addr6.sin6_addr));
-#endif
-#endif
-        
-		// Wrap the native address structure for CFSocketCreate.
-		address = CFDataCreateWithBytesNoCopy(alloc, (const UInt8*)&addr6, sizeof(addr6), kCFAllocatorNull);
-			
-		// Set the local binding which causes the socket to start listening.
-		if (CFSocketSetAddress(s->_sockets[1], address) != kCFSocketSuccess)
+		// Set the local bindings which cause the sockets to start listening.
+		if (!_ServerSetAddresses(alloc, s->_sockets, &port))
 			break;
 		
 		// Save the name, service type and port.
@@ -392,25 +341,22 @@ _CFServerStart(_CFServerRef server, CFStringRef name, CFStringRef type, UInt32 p
 		s->_type = type ? CFRetain(type) : NULL;
 		s->_port = port;
 
+		// Open the other listeners on the port that was just bound.
+		if ((s->_listenerCount != 0) && !_ServerStartListeners(s))
+			break;
+		
 #if defined(__MACH__)
         // Attempt to register the service on the network. 
 		if (type && !_ServerCreateAndRegisterNetService(s))
             break;
 #endif
 
-        // Release this since it's not needed any longer. 
-		CFRelease(address);
-	
 		return TRUE;
         
 	} while (0);
 	
 	// Handle the error cleanup.
 	
-	// Release the address data if it was created.
-	if (address)
-		CFRelease(address);
-
 	// Kill the socket if it was created.
 	_ServerReleaseSocket(s);
 
@@ -418,11 +364,77 @@ _CFServerStart(_CFServerRef server, CFStringRef name, CFStringRef type, UInt32 p
 }
 
 
+/* extern */ Boolean
+_CFServerSetListenerCount(_CFServerRef server, CFIndex count) {
+	
+	Server* s = (Server*)server;
+	
+#if !defined(SO_REUSEPORT) || defined(__WIN32__)
+	// Without SO_REUSEPORT the listeners can't share the port.
+	if (count != 0)
+		return FALSE;
+#endif
+	
+	// Can only be changed before the server is started.
+	if ((s->_port != 0) || (count < 0))
+		return FALSE;
+	
+	s->_listenerCount = count;
+	
+	return TRUE;
+}
+
+
+/* extern */ Boolean
+_CFServerSetAcceptBatching(_CFServerRef server, Boolean batch) {
+	
+	Server* s = (Server*)server;
+	
+#if defined(__WIN32__)
+	// Batching relies on non-blocking BSD accept.
+	if (batch)
+		return FALSE;
+#endif
+	
+	// Can only be changed before the server is started.
+	if (s->_port != 0)
+		return FALSE;
+	
+	s->_batchAccept = batch;
+	
+	return TRUE;
+}
+
+
+/* extern */ Boolean
+_CFServerSetFastOpenQueueLength(_CFServerRef server, CFIndex length) {
+	
+	Server* s = (Server*)server;
+	
+#if !defined(TCP_FASTOPEN) || defined(__WIN32__)
+	// Nothing to turn on without the option.
+	if (length != 0)
+		return FALSE;
+#endif
+	
+	// Can only be changed before the server is started.
+	if ((s->_port != 0) || (length < 0))
+		return FALSE;
+	
+	s->_fastOpenQueue = length;
+	
+	return TRUE;
+}
+
+
 /* extern */ void
 _CFServerInvalidate(_CFServerRef server) {
 	
 	Server* s = (Server*)server;
 	
+	// Stop the listener threads first, so none of them is calling out while the context goes away.
+	_ServerStopListeners(s);
+	
 	// Release the user's context info pointer.
 	if (s->_ctxt.info && s->_ctxt.release)
 		s->_ctxt.release(s->_ctxt.info);
@@ -473,11 +485,164 @@ _ServerReleaseNetService(Server* server) {
 #endif
 
 
+/* static */ Boolean
+_ServerCreateSockets(Server* server, CFSocketRef sockets[2]) {
+	
+	unsigned i;
+	int yes = 1;
+	const int families[] = {PF_INET, PF_INET6};
+	
+	CFSocketContext socketCtxt = {0,
+								  server,
+								  (const void*(*)(const void*))&CFRetain,
+								  (void(*)(const void*))&CFRelease,
+								  (CFStringRef(*)(const void *))&CFCopyDescription};
+	
+	// A batching server drains the accept queue itself, so it only wants to
+	// hear that the socket is readable instead of having CFSocket accept.
+	CFOptionFlags callBackTypes = server->_batchAccept ? kCFSocketReadCallBack : kCFSocketAcceptCallBack;
+	
+	for (i = 0; i < (sizeof(families) / sizeof(families[0])); i++) {
+		
+		CFSocketNativeHandle native;
+		
+		// Create the server socket.
+		sockets[i] = CFSocketCreate(CFGetAllocator((_CFServerRef)server),
+									families[i],
+									SOCK_STREAM,
+									IPPROTO_TCP,
+									callBackTypes,
+									(CFSocketCallBack)&_SocketCallBack,
+									&socketCtxt);
+		
+		// If the socket couldn't create, bail.
+		if (sockets[i] == NULL)
+			return FALSE;
+		
+		native = CFSocketGetNative(sockets[i]);
+		
+		// In order to accomadate stopping and starting the process without closing the socket,
+		// set the addr for resuse on the native socket.  This is not required if the port is
+		// being supplied by the OS opposed to being specified by the user.
+		setsockopt(native, SOL_SOCKET, SO_REUSEADDR, (void*)&yes, sizeof(yes));
+		
+#if defined(SO_REUSEPORT) && !defined(__WIN32__)
+		// Every socket on a shared port has to ask for sharing, the first one included.
+		if (server->_listenerCount != 0)
+			setsockopt(native, SOL_SOCKET, SO_REUSEPORT, (void*)&yes, sizeof(yes));
+#endif
+
+#if defined(TCP_FASTOPEN) && !defined(__WIN32__)
+		// Let clients holding a cookie send their first bytes with the SYN.
+		// Kernels without server side Fast Open refuse it and accept as usual.
+		if (server->_fastOpenQueue != 0) {
+			int qlen = (int)server->_fastOpenQueue;
+			setsockopt(native, IPPROTO_TCP, TCP_FASTOPEN, (void*)&qlen, sizeof(qlen));
+		}
+#endif
+
+#if !defined(__WIN32__)
+		// Batched accepts stop when the queue is empty, so accept can't block.
+		if (server->_batchAccept)
+			fcntl(native, F_SETFL, fcntl(native, F_GETFL, 0) | O_NONBLOCK);
+#endif
+	}
+	
+	return TRUE;
+}
+
+
+/* static */ Boolean
+_ServerSetAddresses(CFAllocatorRef alloc, CFSocketRef sockets[2], UInt32* port) {
+	
+	CFDataRef address = NULL;
+	
+	struct sockaddr_in addr4;
+	struct sockaddr_in6 addr6;
+	
+	do {
+		memset(&addr4, 0, sizeof(addr4));
+		
+		// Put the local port and address into the native address.
+#if defined(__MACH__)
+        addr4.sin_len = sizeof(addr4);
+#endif
+		addr4.sin_family = AF_INET;
+		addr4.sin_port = htons((UInt16)*port);
+		addr4.sin_addr.s_addr = htonl(INADDR_ANY);
+		
+		// Wrap the native address structure for CFSocketCreate.
+		address = CFDataCreateWithBytesNoCopy(alloc, (const UInt8*)&addr4, sizeof(addr4), kCFAllocatorNull);
+		
+		// If it failed to create the address data, bail.
+		if (address == NULL)
+			break;
+			
+		// Set the local binding which causes the socket to start listening.
+		if (CFSocketSetAddress(sockets[0], address) != kCFSocketSuccess)
+			break;
+		
+		CFRelease(address);
+		
+		address = CFSocketCopyAddress(sockets[0]);
+		memcpy(&addr4, CFDataGetBytePtr(address), CFDataGetLength(address));
+            
+		*port = ntohs(addr4.sin_port);
+
+		CFRelease(address);
+
+		memset(&addr6, 0, sizeof(addr6));
+
+        // Put the local port and address into the native address.
+        addr6.sin6_family = AF_INET6;
+#ifndef __WIN32__
+        addr6.sin6_port = htons((UInt16)*port);
+#if defined(__MACH__)
+        addr6.sin6_len = sizeof(addr6);
+#endif
+        memcpy(&(addr6.sin6_addr), &in6addr_any, sizeof(addr6.sin6_addr));
+#else
+#ifndef __MINGW32__
+        // real MS headers have this
+        IN6ADDR_SETANY(addr6);
+        addr6.sin6_port = htons((UInt16)*port);
+#else
+        addr6.sin6_port = htons((UInt16)*port);
+        // mingw's w32 headers have this INIT macro instead, for some odd reason
+        struct sockaddr_in6 in6addr_any = IN6ADDR_ANY_INIT;
+        memcpy(&(addr6.sin6_addr), &in6addr_any, sizeof(addr6.sin6_addr));
+#endif
+#endif
+        
+		// Wrap the native address structure for CFSocketCreate.
+		address = CFDataCreateWithBytesNoCopy(alloc, (const UInt8*)&addr6, sizeof(addr6), kCFAllocatorNull);
+			
+		// Set the local binding which causes the socket to start listening.
+		if (CFSocketSetAddress(sockets[1], address) != kCFSocketSuccess)
+			break;
+		
+		CFRelease(address);
+		
+		return TRUE;
+		
+	} while (0);
+	
+	// Release the address data if it was created.
+	if (address)
+		CFRelease(address);
+	
+	return FALSE;
+}
+
+
 /* static */ void
 _ServerReleaseSocket(Server* server) {
 	
     unsigned i;
     
+	// The listeners go with the server's own sockets.
+	_ServerStopListeners(server);
+	
 	for (i = 0; i < (sizeof(server->_sockets) / sizeof(server->_sockets[0])); i++) {
 		
 		// Invalidate and release the socket if there is one.
@@ -560,11 +725,224 @@ _ServerCreateAndRegisterNetService(Server* server) {
 /* static */ void
 _ServerHandleAccept(Server* server, CFSocketNativeHandle nativeSocket) {
 	
+	// With listeners, connections come in on several threads at once, but the
+	// user's callback is only ever made on one at a time.
+	if (server->_listenerCount != 0)
+		_CFMutexLock(&server->_callbackLock);
+	
 	// Inform the user of an incoming connection.
 	if (server->_callback != NULL) {
 		CFStreamError error = {0, 0};
 		server->_callback((_CFServerRef)server, nativeSocket, &error, server->_ctxt.info);
 	}
+	
+	if (server->_listenerCount != 0)
+		_CFMutexUnlock(&server->_callbackLock);
+}
+
+
+/* static */ void
+_ServerHandleAcceptBatch(Server* server, CFSocketNativeHandle listening) {
+
+#if !defined(__WIN32__)
+	// Take everything in the queue.  The listening socket is non-blocking,
+	// so this ends once the queue runs dry.
+	while (server->_callback != NULL) {
+	
+#if defined(__linux__)
+		CFSocketNativeHandle s = accept4(listening, NULL, NULL, SOCK_CLOEXEC);
+#else
+		CFSocketNativeHandle s = accept(listening, NULL, NULL);
+#endif
+
+		if (s == -1) {
+			
+			// A connection which went away while queued doesn't end the batch.
+			if ((errno == EINTR) || (errno == ECONNABORTED))
+				continue;
+			
+			break;
+		}
+		
+#if !defined(__linux__)
+		// BSD passes the listening socket's non-blocking flag down; hand out what accept used to.
+		fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) & ~O_NONBLOCK);
+#endif
+
+		_ServerHandleAccept(server, s);
+	}
+#endif
+}
+
+
+/* static */ Boolean
+_ServerStartListeners(Server* server) {
+	
+	CFIndex i;
+	UInt32 port = server->_port;
+	CFAllocatorRef alloc = CFGetAllocator((_CFServerRef)server);
+	
+	CFRunLoopSourceContext sourceCtxt = {
+		0,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		(void (*)(void*))_ServerListenerStop
+	};
+	
+	// Allocate all the listeners at once.
+	server->_listeners = CFAllocatorAllocate(alloc, server->_listenerCount * sizeof(server->_listeners[0]), 0);
+	
+	if (server->_listeners == NULL)
+		return FALSE;
+	
+	memset(server->_listeners, 0, server->_listenerCount * sizeof(server->_listeners[0]));
+	
+	for (i = 0; i < server->_listenerCount; i++)
+		_CFMutexInit(&server->_listeners[i]._lock, FALSE);
+	
+	for (i = 0; i < server->_listenerCount; i++) {
+		
+		ServerListener* listener = &server->_listeners[i];
+		
+		// The stop source exists before the thread does, so stopping can never be missed.
+		sourceCtxt.info = listener;
+		listener->_stopSource = CFRunLoopSourceCreate(alloc, 0, &sourceCtxt);
+		
+		// Bind here rather than on the thread, so failure comes back out of _CFServerStart.
+		if ((listener->_stopSource == NULL) ||
+			!_ServerCreateSockets(server, listener->_sockets) ||
+			!_ServerSetAddresses(alloc, listener->_sockets, &port) ||
+			(_CFThreadSpawn(&listener->_thread, (void* (*)(void*))_ServerListenerMain, listener) != 0))
+		{
+			// Don't try to join a thread which never started.
+			memset(&listener->_thread, 0, sizeof(listener->_thread));
+			
+			return FALSE;
+		}
+	}
+	
+	return TRUE;
+}
+
+
+/* static */ void
+_ServerStopListeners(Server* server) {
+	
+	CFIndex i;
+	
+	if (server->_listeners == NULL)
+		return;
+	
+	// Tell every listener to stop first, so they all wind down together.
+	for (i = 0; i < server->_listenerCount; i++) {
+		
+		ServerListener* listener = &server->_listeners[i];
+		
+		_CFMutexLock(&listener->_lock);
+		
+		listener->_stopping = TRUE;
+		
+		// A signalled source stays signalled until its run loop gets to it, so unlike
+		// CFRunLoopStop this isn't lost if the thread is between runs or not yet running.
+		if (listener->_stopSource != NULL)
+			CFRunLoopSourceSignal(listener->_stopSource);
+		
+		if (listener->_runLoop != NULL)
+			CFRunLoopWakeUp(listener->_runLoop);
+		
+		_CFMutexUnlock(&listener->_lock);
+	}
+	
+	for (i = 0; i < server->_listenerCount; i++) {
+		
+		unsigned j;
+		ServerListener* listener = &server->_listeners[i];
+		
+#if !defined(__WIN32__)
+		// Wait for it to be out of any callback.
+		if (listener->_thread)
+			_CFThreadJoin(listener->_thread);
+#endif
+		
+		for (j = 0; j < (sizeof(listener->_sockets) / sizeof(listener->_sockets[0])); j++) {
+			
+			// Invalidate and release the socket if there is one.
+			if (listener->_sockets[j] != NULL) {
+				CFSocketInvalidate(listener->_sockets[j]);
+				CFRelease(listener->_sockets[j]);
+			}
+		}
+		
+		if (listener->_stopSource != NULL) {
+			CFRunLoopSourceInvalidate(listener->_stopSource);
+			CFRelease(listener->_stopSource);
+		}
+		
+		_CFMutexDestroy(&listener->_lock);
+	}
+	
+	CFAllocatorDeallocate(CFGetAllocator((_CFServerRef)server), server->_listeners);
+	server->_listeners = NULL;
+}
+
+
+/* static */ void*
+_ServerListenerMain(ServerListener* listener) {
+	
+	unsigned i;
+	Boolean stopping;
+	CFRunLoopRef rl = CFRunLoopGetCurrent();
+	
+	for (i = 0; i < (sizeof(listener->_sockets) / sizeof(listener->_sockets[0])); i++) {
+		
+		// Create the run loop source for putting on the run loop.
+		CFRunLoopSourceRef src = CFSocketCreateRunLoopSource(CFGetAllocator(listener->_sockets[i]), listener->_sockets[i], 0);
+		if (src == NULL)
+			continue;
+		
+		// Add the run loop source to this thread's run loop.
+		CFRunLoopAddSource(rl, src, kCFRunLoopCommonModes);
+		CFRelease(src);
+	}
+	
+	CFRunLoopAddSource(rl, listener->_stopSource, kCFRunLoopCommonModes);
+	
+	_CFMutexLock(&listener->_lock);
+	
+	// Publish the run loop so the listener can be stopped.
+	listener->_runLoop = rl;
+	stopping = listener->_stopping;
+	
+	_CFMutexUnlock(&listener->_lock);
+	
+	// Run until told to stop.  The run loop can return early, so check the
+	// flag rather than trusting the return.
+	while (!stopping) {
+		
+		CFRunLoopRunInMode(kCFRunLoopDefaultMode, 1.0e10, FALSE);
+		
+		_CFMutexLock(&listener->_lock);
+		stopping = listener->_stopping;
+		_CFMutexUnlock(&listener->_lock);
+	}
+	
+	CFRunLoopRemoveSource(rl, listener->_stopSource, kCFRunLoopCommonModes);
+	
+	return NULL;
+}
+
+
+/* static */ void
+_ServerListenerStop(ServerListener* listener) {
+	
+	// Performed on the listener's own thread, so this stops the run it's in.
+	CFRunLoopStop(CFRunLoopGetCurrent());
 }
 
 
@@ -592,7 +970,7 @@ _ServerHandleNetServiceError(Server* server, CFStreamError* error) {
 /* static */ void
 _SocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address, const void *data, Server* server) {
 
-	assert((sock == server->_sockets[0]) || (sock == server->_sockets[1]));
+	// The socket may be one of the server's own or belong to one of its listeners.
 
 	// Only care about accept callbacks.
     if (type == kCFSocketAcceptCallBack) {
@@ -602,6 +980,10 @@ _SocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address,
 		// Dispatch the accept event.
 		_ServerHandleAccept(server, *((CFSocketNativeHandle*)data));
 	}
+	
+	// A batching server's socket is readable when connections are queued.
+	else if (type == kCFSocketReadCallBack)
+		_ServerHandleAcceptBatch(server, CFSocketGetNative(sock));
 }
 
 
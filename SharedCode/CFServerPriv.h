@@ -284,6 +284,113 @@ extern void
 _CFServerInvalidate(_CFServerRef server)                      AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
 
 
+
+/*
+ *  _CFServerSetListenerCount()
+ *  
+ *  Discussion:
+ *    Sets the number of extra listeners _CFServerStart opens on the
+ *    server's port.  Each one gets its own thread and run loop, and
+ *    all of them share the port through SO_REUSEPORT, so the kernel
+ *    spreads incoming connections across the listeners and the
+ *    server's own sockets.  The server callback for a connection is
+ *    made on the thread of the listener which accepted it, but only
+ *    one callback is made at a time.  With listeners, the server
+ *    must not be invalidated from within any callback.
+ *  
+ *  Mac OS X threading:
+ *    Not thread safe
+ *  
+ *  Parameters:
+ *    
+ *    server:
+ *      Reference to the server.  Must be non-NULL.
+ *    
+ *    count:
+ *      Number of listeners in addition to the server's own sockets on
+ *      the current run loop.  Zero, the default, opens none.
+ *  
+ *  Result:
+ *    Returns TRUE if the count was set.  Returns FALSE if the server
+ *    has already been started or if SO_REUSEPORT is not available.
+ *  
+ */
+extern Boolean 
+_CFServerSetListenerCount(
+  _CFServerRef   server,
+  CFIndex        count)                                       AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
+
+
+
+/*
+ *  _CFServerSetAcceptBatching()
+ *  
+ *  Discussion:
+ *    When set, each time a listening socket becomes readable the
+ *    server accepts every queued connection (with accept4 where
+ *    available) until the queue is empty, instead of one connection
+ *    per run loop pass.  This keeps the kernel's accept queue short
+ *    during bursts of connections.
+ *  
+ *  Mac OS X threading:
+ *    Not thread safe
+ *  
+ *  Parameters:
+ *    
+ *    server:
+ *      Reference to the server.  Must be non-NULL.
+ *    
+ *    batch:
+ *      TRUE to accept in batches.  FALSE, the default, accepts one
+ *      connection at a time.
+ *  
+ *  Result:
+ *    Returns TRUE if the mode was set.  Returns FALSE if the server has
+ *    already been started or if batching is not supported.
+ *  
+ */
+extern Boolean 
+_CFServerSetAcceptBatching(
+  _CFServerRef   server,
+  Boolean        batch)                                       AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
+
+
+
+/*
+ *  _CFServerSetFastOpenQueueLength()
+ *  
+ *  Discussion:
+ *    Turns on TCP Fast Open (RFC 7413) for the server's listening
+ *    sockets.  Clients holding a cookie from an earlier connection
+ *    can then send their first bytes with the SYN, and the connection
+ *    is handed to the server callback with that data already
+ *    readable.  Such data may be delivered twice, so the server must
+ *    be prepared to see a request repeated.
+ *  
+ *  Mac OS X threading:
+ *    Not thread safe
+ *  
+ *  Parameters:
+ *    
+ *    server:
+ *      Reference to the server.  Must be non-NULL.
+ *    
+ *    length:
+ *      Most connections which may be waiting on their handshake after
+ *      sending data with the SYN.  Zero, the default, turns Fast Open
+ *      off.
+ *  
+ *  Result:
+ *    Returns TRUE if the length was set.  Returns FALSE if the server
+ *    has already been started or if TCP Fast Open is not available.
+ *  
+ */
+extern Boolean 
+_CFServerSetFastOpenQueueLength(
+  _CFServerRef   server,
+  CFIndex        length)                                      AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
+
+
 #if PRAGMA_OPTIONS_ALIGN
 #pragma options align=reset
 #endif
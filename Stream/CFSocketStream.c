@@ -38,24 +38,49 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/fcntl.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
 
 #include <CoreFoundation/CFStreamPriv.h>
 #include <CFNetwork/CFSocketStreamPriv.h>
+#include <CFNetwork/CFHostPriv.h>
 #if defined(__MACH__)
   #include <SystemConfiguration/SystemConfiguration.h>
   #include <Security/Security.h>
   #include <Security/SecureTransportPriv.h>
+#elif defined(HAVE_OPENSSL)
+  #include <openssl/ssl.h>
+  #include <openssl/err.h>
+  #include <openssl/x509v3.h>
+  #include <openssl/kdf.h>
+  #include <arpa/inet.h>
+  #if defined(__linux__)
+    #include <linux/tls.h>
+    #if !defined(SOL_TLS)
+      #define SOL_TLS 282
+    #endif
+  #endif
 #endif
 
 #pragma mark - Constants
 
 #define kSocketEvents ((CFOptionFlags)(kCFSocketReadCallBack | kCFSocketConnectCallBack | kCFSocketWriteCallBack))
 #define kReadWriteTimeoutInterval ((CFTimeInterval)75.0)
-#define kRecvBufferSize ((CFIndex)(32768L));
-#define kSecurityBufferSize ((CFIndex)(32768L));
+#define kRecvBufferSize ((CFIndex)(32768L))
+#define kRecvBufferMaxSize ((CFIndex)(262144L))
+#define kSecurityBufferSize ((CFIndex)(65536L))
+#define kSecurityBufferPoolSize ((CFIndex)(16L))
+#define kSecurityDirectReadSize ((CFIndex)(16384L))
+#define kSecurityGatherSize ((CFIndex)(16384L))
+#define kSecuritySessionCacheSize ((CFIndex)(64L))
+#define kConnectionAttemptDelay ((CFTimeInterval)0.25)     /* RFC 8305 recommended default */
+#define kConnectionAttemptMinDelay ((CFTimeInterval)0.01)  /* RFC 8305 lower limit */
 
 #ifndef __MACH__
 const int kCFStreamErrorDomainSOCKS = 5; /* On Mach this lives in CF for historical reasons, even though it is declared in CFNetwork */
@@ -108,6 +133,23 @@ CONST_STRING_DECL(_kCFStreamSocketIChatWantsSubNet, "_kCFStreamSocketIChatWantsS
 CONST_STRING_DECL(_kCFStreamSocketCreatedCallBack, "_kCFStreamSocketCreatedCallBack")
 CONST_STRING_DECL(kCFStreamPropertyProxyExceptionsList, "ExceptionsList")
 CONST_STRING_DECL(kCFStreamPropertyProxyLocalBypass, "ExcludeSimpleHostnames");
+CONST_STRING_DECL(_kCFStreamPropertySocketGatherWrite, "_kCFStreamPropertySocketGatherWrite")
+CONST_STRING_DECL(_kCFStreamPropertySocketSendFile, "_kCFStreamPropertySocketSendFile")
+CONST_STRING_DECL(_kCFStreamPropertySocketRaceConnections, "_kCFStreamPropertySocketRaceConnections")
+CONST_STRING_DECL(_kCFStreamPropertySocketConnectionAttemptDelay, "_kCFStreamPropertySocketConnectionAttemptDelay")
+CONST_STRING_DECL(_kCFStreamPropertySocketFastOpen, "_kCFStreamPropertySocketFastOpen")
+CONST_STRING_DECL(_kCFStreamPropertySocketOptions, "_kCFStreamPropertySocketOptions")
+CONST_STRING_DECL(_kCFStreamPropertySocketKernelTLS, "_kCFStreamPropertySocketKernelTLS")
+CONST_STRING_DECL(_kCFStreamSocketOptionNoDelay, "_kCFStreamSocketOptionNoDelay")
+CONST_STRING_DECL(_kCFStreamSocketOptionSendBufferSize, "_kCFStreamSocketOptionSendBufferSize")
+CONST_STRING_DECL(_kCFStreamSocketOptionReceiveBufferSize, "_kCFStreamSocketOptionReceiveBufferSize")
+CONST_STRING_DECL(_kCFStreamSocketOptionKeepAlive, "_kCFStreamSocketOptionKeepAlive")
+CONST_STRING_DECL(_kCFStreamSocketOptionKeepAliveIdle, "_kCFStreamSocketOptionKeepAliveIdle")
+CONST_STRING_DECL(_kCFStreamSocketOptionKeepAliveInterval, "_kCFStreamSocketOptionKeepAliveInterval")
+CONST_STRING_DECL(_kCFStreamSocketOptionKeepAliveCount, "_kCFStreamSocketOptionKeepAliveCount")
+CONST_STRING_DECL(_kCFStreamSocketOptionNotSentLowWater, "_kCFStreamSocketOptionNotSentLowWater")
+CONST_STRING_DECL(_kCFStreamSocketOptionCongestionControl, "_kCFStreamSocketOptionCongestionControl")
+CONST_STRING_DECL(_kCFStreamSocketOptionBusyPoll, "_kCFStreamSocketOptionBusyPoll")
 
 /* CONNECT tunnel properties.  Still SPI. */
 CONST_STRING_DECL(kCFStreamPropertyCONNECTProxy, "kCFStreamPropertyCONNECTProxy")
@@ -130,9 +172,13 @@ CONST_STRING_DECL(kCFStreamPropertyPreviousCONNECTResponse, "kCFStreamPropertyPr
 #define _kCFStreamPropertyRecvBuffer CFSTR("_kCFStreamPropertyRecvBuffer")
 #define _kCFStreamPropertyRecvBufferCount CFSTR("_kCFStreamPropertyRecvBufferCount")
 #define _kCFStreamPropertyRecvBufferSize CFSTR("_kCFStreamPropertyRecvBufferSize")
+#define _kCFStreamPropertyRecvBufferMaxSize CFSTR("_kCFStreamPropertyRecvBufferMaxSize")
 #define _kCFStreamPropertySecurityRecvBuffer CFSTR("_kCFStreamPropertySecurityRecvBuffer")
-#define _kCFStreamPropertySecurityRecvBufferSize CFSTR("_kCFStreamPropertySecurityRecvBufferSize")
 #define _kCFStreamPropertySecurityRecvBufferCount CFSTR("_kCFStreamPropertySecurityRecvBufferCount")
+#define _kCFStreamPropertySecuritySendBuffer CFSTR("_kCFStreamPropertySecuritySendBuffer")
+#define _kCFStreamPropertySecurityPeerID CFSTR("_kCFStreamPropertySecurityPeerID")
+#define _kCFStreamPropertySecurityClientSecret CFSTR("_kCFStreamPropertySecurityClientSecret")
+#define _kCFStreamPropertySecurityServerSecret CFSTR("_kCFStreamPropertySecurityServerSecret")
 #define _kCFStreamPropertyHandshakes CFSTR("_kCFStreamPropertyHandshakes")
 #define _kCFStreamPropertyCONNECTSendBuffer CFSTR("_kCFStreamPropertyCONNECTSendBuffer")
 #define _kCFStreamPropertySOCKSSendBuffer CFSTR("_kCFStreamPropertySOCKSSendBuffer")
@@ -141,6 +187,10 @@ CONST_STRING_DECL(kCFStreamPropertyPreviousCONNECTResponse, "kCFStreamPropertyPr
 #define _kCFStreamPropertyWriteTimeout CFSTR("_kCFStreamPropertyWriteTimeout")
 #define _kCFStreamPropertyReadCancel CFSTR("_kCFStreamPropertyReadCancel")
 #define _kCFStreamPropertyWriteCancel CFSTR("_kCFStreamPropertyWriteCancel")
+#define _kCFStreamPropertySocketRaceAttempts CFSTR("_kCFStreamPropertySocketRaceAttempts")
+#define _kCFStreamPropertySocketRaceAddresses CFSTR("_kCFStreamPropertySocketRaceAddresses")
+#define _kCFStreamPropertySocketRaceTimer CFSTR("_kCFStreamPropertySocketRaceTimer")
+#define _kCFStreamPropertySocketRaceError CFSTR("_kCFStreamPropertySocketRaceError")
 #else
 static CONST_STRING_DECL(_kCFStreamProxySettingSOCKSEnable, "SOCKSEnable") 
 static CONST_STRING_DECL(_kCFStreamPropertySocketRemotePort, "_kCFStreamPropertySocketRemotePort")
@@ -151,15 +201,23 @@ static CONST_STRING_DECL(_kCFStreamPropertyNetworkReachability, "_kCFStreamPrope
 static CONST_STRING_DECL(_kCFStreamPropertyRecvBuffer, "_kCFStreamPropertyRecvBuffer") 
 static CONST_STRING_DECL(_kCFStreamPropertyRecvBufferCount, "_kCFStreamPropertyRecvBufferCount")
 static CONST_STRING_DECL(_kCFStreamPropertyRecvBufferSize, "_kCFStreamPropertyRecvBufferSize")
+static CONST_STRING_DECL(_kCFStreamPropertyRecvBufferMaxSize, "_kCFStreamPropertyRecvBufferMaxSize")
 static CONST_STRING_DECL(_kCFStreamPropertySecurityRecvBuffer, "_kCFStreamPropertySecurityRecvBuffer")
-static CONST_STRING_DECL(_kCFStreamPropertySecurityRecvBufferSize, "_kCFStreamPropertySecurityRecvBufferSize") 
 static CONST_STRING_DECL(_kCFStreamPropertySecurityRecvBufferCount, "_kCFStreamPropertySecurityRecvBufferCount") 
+static CONST_STRING_DECL(_kCFStreamPropertySecuritySendBuffer, "_kCFStreamPropertySecuritySendBuffer")
+static CONST_STRING_DECL(_kCFStreamPropertySecurityPeerID, "_kCFStreamPropertySecurityPeerID")
+static CONST_STRING_DECL(_kCFStreamPropertySecurityClientSecret, "_kCFStreamPropertySecurityClientSecret")
+static CONST_STRING_DECL(_kCFStreamPropertySecurityServerSecret, "_kCFStreamPropertySecurityServerSecret")
 static CONST_STRING_DECL(_kCFStreamPropertyHandshakes, "_kCFStreamPropertyHandshakes") 
 static CONST_STRING_DECL(_kCFStreamPropertyCONNECTSendBuffer, "_kCFStreamPropertyCONNECTSendBuffer") 
 static CONST_STRING_DECL(_kCFStreamPropertySOCKSSendBuffer, "_kCFStreamPropertySOCKSSendBuffer") 
 static CONST_STRING_DECL(_kCFStreamPropertySOCKSRecvBuffer, "_kCFStreamPropertySOCKSRecvBuffer") 
 static CONST_STRING_DECL(_kCFStreamPropertyReadCancel, "_kCFStreamPropertyReadCancel") 
 static CONST_STRING_DECL(_kCFStreamPropertyWriteCancel, "_kCFStreamPropertyWriteCancel")
+static CONST_STRING_DECL(_kCFStreamPropertySocketRaceAttempts, "_kCFStreamPropertySocketRaceAttempts")
+static CONST_STRING_DECL(_kCFStreamPropertySocketRaceAddresses, "_kCFStreamPropertySocketRaceAddresses")
+static CONST_STRING_DECL(_kCFStreamPropertySocketRaceTimer, "_kCFStreamPropertySocketRaceTimer")
+static CONST_STRING_DECL(_kCFStreamPropertySocketRaceError, "_kCFStreamPropertySocketRaceError")
 #endif /* __CONSTANT_CFSTRINGS__ */
 
 #ifdef __MACH__
@@ -274,6 +332,7 @@ enum {
   kFlagBitRecvdRead,         /* On buffered streams, indicates that a read event has been received but buffer was full. */
   kFlagBitReadHasCancel,     /* Performance check for detecting run loop source for canceling synchronous read. */
   kFlagBitWriteHasCancel,    /* Performance check for detecting run loop source for canceling synchronous write. */
+  kFlagBitKernelTLS,         /* The kernel does the SSL records, so reads and writes go the plain socket path. */
   /*
   ** These flag bits are used to count the number of runs through the run loop short circuit
   ** code at the end of read and write.  CFSocketStream is willing to run kMaximumNumberLoopAttempts
@@ -320,6 +379,69 @@ typedef struct {
 typedef void (*_CFSocketStreamSocketCreatedCallBack)(CFSocketNativeHandle s, void* info);
 typedef void (*_CFSocketStreamPerformHandshakeCallBack)(_CFSocketStreamContext* ctxt);
 
+#if defined(HAVE_OPENSSL)
+/*
+** The OpenSSL engine keeps the Secure Transport names for the context
+** wrapped in kCFStreamPropertySocketSSLContext, the session states and
+** the kCFStreamErrorDomainSSL errors, so the code driving either engine
+** and the clients checking the errors read the same.
+*/
+typedef SSL* SSLContextRef;
+
+typedef enum {
+  kSSLIdle,
+  kSSLHandshake,
+  kSSLConnected,
+  kSSLClosed,
+  kSSLAborted
+} SSLSessionState;
+
+enum {
+  errSSLProtocol          = -9800,
+  errSSLClosedGraceful    = -9805,
+  errSSLClosedAbort       = -9806,
+  errSSLXCertChainInvalid = -9807,
+  errSSLCertExpired       = -9814,
+  errSSLCertNotYetValid   = -9815,
+  errSSLBadCipherSuite    = -9818
+};
+
+/* Per SSL relaxations of the certificate checks, kept in the SSL's ex data. */
+enum {
+  kSecurityAllowsExpired  = 1,
+  kSecurityAllowsAnyRoot  = 2,
+  kSecuritySkipsChain     = 4,
+  kSecuritySkipsPeerName  = 8
+};
+#endif
+
+/*
+** Buffered reads land in a ring whose capacity is a power of two, so the
+** consumer never has to slide the remaining bytes down.  The ring state
+** lives in the bytes of _kCFStreamPropertyRecvBufferCount with the count
+** first, so checks for waiting bytes can keep reading a single CFIndex.
+*/
+typedef struct {
+  CFIndex _count;    /* Bytes waiting to be read.  NOTE this must stay first. */
+  CFIndex _head;     /* Offset of the first waiting byte. */
+  CFIndex _lent;     /* Bytes just before _head handed out by GetBuffer, not yet released. */
+  CFIndex _capacity; /* Length of the buffer, always a power of two. */
+  CFIndex _limit;    /* Largest the buffer may grow to when it fills up. */
+} _CFSocketStreamRecvRing;
+
+/*
+** Encrypted bytes are taken off the socket in one large read and handed
+** to SSL from memory, a record at a time.  The buffer is borrowed from a
+** process-wide pool only while it holds bytes.  The state lives in the
+** bytes of _kCFStreamPropertySecurityRecvBufferCount.
+*/
+typedef struct {
+  CFIndex _start;   /* Offset of the first waiting byte. */
+  CFIndex _count;   /* Bytes waiting to be decrypted. */
+  Boolean _drained; /* The socket came up short during this pass, so don't go back to it. */
+  Boolean _closed;  /* The socket hit the end; reported once the waiting bytes are gone. */
+} _CFSocketStreamSecurityRecv;
+
 #pragma mark - Static Function Declarations
 #pragma mark - * Stream Callbacks
 
@@ -333,12 +455,25 @@ static CFIndex     _SocketStreamRead(CFReadStreamRef         stream,
                                      CFStreamError*          error,
                                      Boolean*                atEOF,
                                      _CFSocketStreamContext* ctxt);
+static const UInt8* _SocketStreamGetBuffer(CFReadStreamRef         stream,
+                                           CFIndex                 maxBytesToRead,
+                                           CFIndex*                numBytesRead,
+                                           CFStreamError*          error,
+                                           Boolean*                atEOF,
+                                           _CFSocketStreamContext* ctxt);
 static Boolean     _SocketStreamCanRead(CFReadStreamRef stream, _CFSocketStreamContext* ctxt);
 static CFIndex     _SocketStreamWrite(CFWriteStreamRef        stream,
                                       const UInt8*            buffer,
                                       CFIndex                 bufferLength,
                                       CFStreamError*          error,
                                       _CFSocketStreamContext* ctxt);
+static CFIndex     _SocketStreamWriteFrom(CFWriteStreamRef        stream,
+                                          const struct iovec*     iov,
+                                          int                     iovcnt,
+                                          int                     file,
+                                          CFIndex                 fileLength,
+                                          CFStreamError*          error,
+                                          _CFSocketStreamContext* ctxt);
 static Boolean     _SocketStreamCanWrite(CFWriteStreamRef stream, _CFSocketStreamContext* ctxt);
 static void        _SocketStreamClose(CFTypeRef stream, _CFSocketStreamContext* ctxt);
 static CFTypeRef   _SocketStreamCopyProperty(CFTypeRef stream, CFStringRef propertyName, _CFSocketStreamContext* ctxt);
@@ -352,6 +487,8 @@ static void _SocketCallBack(CFSocketRef s, CFSocketCallBackType type, CFDataRef
 static void _HostCallBack(CFHostRef theHost, CFHostInfoType typeInfo, const CFStreamError* error, _CFSocketStreamContext* info);
 static void _NetServiceCallBack(CFNetServiceRef theService, CFStreamError* error, _CFSocketStreamContext* info);
 static void _SocksHostCallBack(CFHostRef theHost, CFHostInfoType typeInfo, const CFStreamError* error, _CFSocketStreamContext* info);
+static void _RaceHostCallBack(CFHostRef theHost, CFHostInfoType typeInfo, const CFStreamError* error, _CFSocketStreamContext* info);
+static void _RaceTimerCallBack(CFRunLoopTimerRef timer, _CFSocketStreamContext* info);
 #if defined(__MACH__)
 static void _ReachabilityCallBack(SCNetworkReachabilityRef target, const SCNetworkConnectionFlags flags, _CFSocketStreamContext* ctxt);
 static void _NetworkConnectionCallBack(SCNetworkConnectionRef conn, SCNetworkConnectionStatus status, _CFSocketStreamContext* ctxt);
@@ -371,8 +508,13 @@ static CFDataRef   _CFDataCopyAddressByInjectingPort(CFDataRef address, CFNumber
 static Boolean     _ScheduleAndStartLookup(CFTypeRef lookup, CFArrayRef* schedules, CFStreamError* error, const void* cb, void* info);
 
 static CFIndex _CFSocketRecv(CFSocketRef s, UInt8* buffer, CFIndex length, CFStreamError* error);
+static CFIndex _CFSocketRecvVector(CFSocketRef s, const struct iovec* iov, int iovcnt, CFStreamError* error);
 static CFIndex _CFSocketSend(CFSocketRef s, const UInt8* buffer, CFIndex length, CFStreamError* error);
+static CFIndex _CFSocketSendVector(CFSocketRef s, const struct iovec* iov, int iovcnt, CFStreamError* error);
+static CFIndex _CFSocketSendFile(CFSocketRef s, int fd, CFIndex length, CFStreamError* error);
 static Boolean _CFSocketCan(CFSocketRef s, int mode);
+static Boolean _CFSocketOptionsAreValid(CFDictionaryRef options);
+static void    _CFSocketApplyOptions(CFSocketNativeHandle s, CFDictionaryRef options);
 
 static _CFSocketStreamContext* _SocketStreamCreateContext(CFAllocatorRef alloc);
 static void                    _SocketStreamDestroyContext_NoLock(CFAllocatorRef alloc, _CFSocketStreamContext* ctxt);
@@ -382,6 +524,16 @@ static Boolean _SocketStreamCreateSocket_NoLock(_CFSocketStreamContext* ctxt, CF
 static Boolean _SocketStreamConnect_NoLock(_CFSocketStreamContext* ctxt, CFDataRef address);
 static Boolean _SocketStreamAttemptNextConnection_NoLock(_CFSocketStreamContext* ctxt);
 
+static Boolean _SocketStreamRaceCreate_NoLock(_CFSocketStreamContext* ctxt);
+static Boolean _SocketStreamRaceStart_NoLock(_CFSocketStreamContext* ctxt, CFTypeRef lookup);
+static Boolean _SocketStreamRaceStartLookups_NoLock(_CFSocketStreamContext* ctxt, CFHostRef host);
+static void    _SocketStreamRaceAddAddresses_NoLock(_CFSocketStreamContext* ctxt, CFArrayRef list);
+static Boolean _SocketStreamRaceNextConnection_NoLock(_CFSocketStreamContext* ctxt);
+static Boolean _SocketStreamRaceConnected_NoLock(_CFSocketStreamContext* ctxt, CFSocketRef s, const void* data);
+static Boolean _SocketStreamRaceRemove_NoLock(_CFSocketStreamContext* ctxt, CFTypeRef attempt);
+static Boolean _SocketStreamRaceFinish_NoLock(_CFSocketStreamContext* ctxt, const CFStreamError* error);
+static void    _SocketStreamRaceCancel_NoLock(_CFSocketStreamContext* ctxt);
+
 static Boolean _SocketStreamCan(_CFSocketStreamContext* ctxt, CFTypeRef stream, int test, CFStringRef mode, CFStreamError* error);
 
 #if defined(__MACH__)
@@ -395,8 +547,13 @@ static void               _SocketStreamRemoveHandshake_NoLock(_CFSocketStreamCon
 
 static void _SocketStreamAttemptAutoVPN_NoLock(_CFSocketStreamContext* ctxt, CFStringRef name);
 
-static CFIndex _SocketStreamBufferedRead_NoLock(_CFSocketStreamContext* ctxt, UInt8* buffer, CFIndex length);
-static void    _SocketStreamBufferedSocketRead_NoLock(_CFSocketStreamContext* ctxt);
+static CFIndex      _SocketStreamBufferedRead_NoLock(_CFSocketStreamContext* ctxt, UInt8* buffer, CFIndex length);
+static const UInt8* _SocketStreamBufferedGetBuffer_NoLock(_CFSocketStreamContext* ctxt, CFIndex length, CFIndex* bytesRead);
+static void         _SocketStreamBufferedSocketRead_NoLock(_CFSocketStreamContext* ctxt);
+
+static _CFSocketStreamRecvRing* _SocketStreamGetRecvRing_NoLock(_CFSocketStreamContext* ctxt);
+static int                      _SocketStreamRecvRingGetSpace_NoLock(_CFSocketStreamContext* ctxt, _CFSocketStreamRecvRing* ring, struct iovec iov[2]);
+static void                     _RecvRingRelease(_CFSocketStreamRecvRing* ring);
 
 static void _SocketStreamPerformCancel(void* info);
 
@@ -417,6 +574,35 @@ CF_INLINE SInt32 _LastError(CFStreamError* error)
   return error->error;
 }
 
+CF_INLINE Boolean _SocketStreamRaceEnabled_NoLock(_CFSocketStreamContext* ctxt)
+{
+  return (CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRaceConnections) == kCFBooleanTrue);
+}
+
+CF_INLINE Boolean _SocketStreamRaceIsConnecting_NoLock(_CFSocketStreamContext* ctxt)
+{
+  /* The attempts are a mix of sockets connecting and hosts resolving. */
+  CFArrayRef attempts = (CFArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRaceAttempts);
+  CFIndex    i, count = attempts ? CFArrayGetCount(attempts) : 0;
+
+  for (i = 0; i < count; i++) {
+    if (CFGetTypeID(CFArrayGetValueAtIndex(attempts, i)) == CFSocketGetTypeID())
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+CF_INLINE void _SocketStreamRaceSetError_NoLock(_CFSocketStreamContext* ctxt, const CFStreamError* error)
+{
+  /* Keep the error for reporting if every attempt fails.  A failed connect says more than a failed lookup. */
+  CFMutableDataRef last = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRaceError);
+  CFStreamError*   kept = (CFStreamError*)CFDataGetMutableBytePtr(last);
+
+  if (!kept->error || (error->domain != kCFStreamErrorDomainNetDB))
+    memmove(kept, error, sizeof(kept[0]));
+}
+
 #pragma mark - * SOCKS Support
 
 static void    _PerformSOCKSv5Handshake_NoLock(_CFSocketStreamContext* ctxt);
@@ -448,9 +634,17 @@ static Boolean _CONNECTSetInfo_NoLock(_CFSocketStreamContext* ctxt, CFDictionary
 
 static OSStatus _SecurityReadFunc_NoLock(_CFSocketStreamContext* ctxt, void* data, UInt32* dataLength);
 static OSStatus _SecurityWriteFunc_NoLock(_CFSocketStreamContext* ctxt, const void* data, UInt32* dataLength);
-#if defined(__MACH__)
+#if defined(__MACH__) || defined(HAVE_OPENSSL)
+static CFDataRef _SocketStreamSecurityCreatePeerID_NoLock(_CFSocketStreamContext* ctxt);
+static CFIndex _SocketStreamSecurityRecv_NoLock(_CFSocketStreamContext* ctxt, UInt8* buffer, CFIndex length, CFStreamError* error);
+static void    _SocketStreamSecurityRecvStartPass_NoLock(_CFSocketStreamContext* ctxt);
+static CFIndex _SocketStreamSecurityRecvGetCount_NoLock(_CFSocketStreamContext* ctxt);
+static void    _SocketStreamSecurityRecvRelease_NoLock(_CFSocketStreamContext* ctxt);
+static CFIndex _SocketStreamSecurityDirectRead_NoLock(_CFSocketStreamContext* ctxt, UInt8* buffer, CFIndex length);
 static CFIndex _SocketStreamSecuritySend_NoLock(_CFSocketStreamContext* ctxt, const UInt8* buffer, CFIndex length);
+static CFIndex _SocketStreamSecuritySendVector_NoLock(_CFSocketStreamContext* ctxt, const struct iovec* iov, int iovcnt);
 static void    _SocketStreamSecurityBufferedRead_NoLock(_CFSocketStreamContext* ctxt);
+static void    _SocketStreamSecurityReadStatus_NoLock(_CFSocketStreamContext* ctxt, SSLContextRef ssl, OSStatus status, CFIndex bytesWaiting);
 static void    _PerformSecurityHandshake_NoLock(_CFSocketStreamContext* ctxt);
 static void    _PerformSecuritySendHandshake_NoLock(_CFSocketStreamContext* ctxt);
 static void    _SocketStreamSecurityClose_NoLock(_CFSocketStreamContext* ctxt);
@@ -458,10 +652,32 @@ static Boolean _SocketStreamSecuritySetContext_NoLock(_CFSocketStreamContext* ct
 static Boolean _SocketStreamSecuritySetInfo_NoLock(_CFSocketStreamContext* ctxt, CFDictionaryRef settings);
 #endif
 static Boolean _SocketStreamSecuritySetAuthenticatesServerCertificates_NoLock(_CFSocketStreamContext* ctxt, CFBooleanRef authenticates);
-#if defined(__MACH__)
+#if defined(__MACH__) || defined(HAVE_OPENSSL)
 static CFStringRef     _SecurityGetProtocol(SSLContextRef security);
 static SSLSessionState _SocketStreamSecurityGetSessionState_NoLock(_CFSocketStreamContext* ctxt);
 #endif
+#if defined(HAVE_OPENSSL)
+static int          _SecurityBIORead(BIO* bio, char* data, int dataLength);
+static int          _SecurityBIOWrite(BIO* bio, const char* data, int dataLength);
+static long         _SecurityBIOCtrl(BIO* bio, int cmd, long num, void* ptr);
+static int          _SecurityVerifyCallBack(int ok, X509_STORE_CTX* store);
+static int          _SecurityNewSessionCallBack(SSL* ssl, SSL_SESSION* session);
+static SSL_CTX*     _SecurityGetClientContext(void);
+static Boolean      _SecuritySetPeerName(SSL* ssl, CFTypeRef name, CFAllocatorRef alloc);
+static void         _SecurityPeerNameFree(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp);
+static void         _SocketStreamSecuritySetError_NoLock(_CFSocketStreamContext* ctxt, SSL* ssl, int result);
+static Boolean      _SocketStreamSecurityFlush_NoLock(_CFSocketStreamContext* ctxt);
+static SSL_SESSION* _SecuritySessionCacheCopy(CFDataRef peerID);
+static void         _SecuritySessionCacheAdd(CFDataRef peerID, SSL_SESSION* session);
+static void         _SecuritySessionCacheRemove(CFDataRef peerID);
+#if defined(__linux__)
+static void    _SecurityKeyLogCallBack(const SSL* ssl, const char* line);
+static Boolean _SecurityExpandLabel(const EVP_MD* md, const UInt8* secret, size_t secretLength, const char* label, UInt8* out, size_t outLength);
+static Boolean _SocketStreamSecurityStartKernelTLS_NoLock(_CFSocketStreamContext* ctxt, SSL* ssl);
+static CFIndex _SocketStreamKernelTLSRecv_NoLock(_CFSocketStreamContext* ctxt, const struct iovec* iov, int iovcnt);
+static void    _SocketStreamKernelTLSClose_NoLock(_CFSocketStreamContext* ctxt);
+#endif
+#endif
 
 #pragma mark - Extern Function Declarations
 
@@ -492,7 +708,7 @@ static const CFReadStreamCallBacks kSocketReadStreamCallBacks = {
     (Boolean(*)(CFReadStreamRef, CFErrorRef*, Boolean*, void*))_SocketStreamOpen,
     (Boolean(*)(CFReadStreamRef, CFErrorRef*, void*))_SocketStreamOpenCompleted,
     (CFIndex(*)(CFReadStreamRef, UInt8*, CFIndex, CFErrorRef*, Boolean*, void*))_SocketStreamRead,
-    NULL, /* getbuffer */
+    (const UInt8* (*)(CFReadStreamRef, CFIndex, CFIndex*, CFErrorRef*, Boolean*, void*))_SocketStreamGetBuffer,
     (Boolean (*)(CFReadStreamRef, CFErrorRef*, void*))_SocketStreamCanRead,
     (void (*)(CFReadStreamRef, void*))_SocketStreamClose,
     (CFTypeRef(*)(CFReadStreamRef, CFStringRef, void*))_SocketStreamCopyProperty,
@@ -851,6 +1067,60 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
   return result;
 }
 
+/* static */ const UInt8* _SocketStreamGetBuffer(CFReadStreamRef         stream,
+                                                CFIndex                 maxBytesToRead,
+                                                CFIndex*                numBytesRead,
+                                                CFStreamError*          error,
+                                                Boolean*                atEOF,
+                                                _CFSocketStreamContext* ctxt)
+{
+  /*
+  ** Hands out bytes straight from the receive ring so callers such as the
+  ** HTTP filter can parse them in place.  Only bytes which are already
+  ** buffered are given out; anything else returns NULL with no bytes and
+  ** no error, so the caller falls back to CFReadStreamRead.  The bytes stay
+  ** put until the next read on the stream.
+  */
+  const UInt8*      result = NULL;
+  CFStreamEventType event  = kCFStreamEventNone;
+
+  /* Set as no error to start. */
+  memset(error, 0, sizeof(error[0]));
+
+  /* Not at end yet. */
+  *atEOF        = FALSE;
+  *numBytesRead = 0;
+
+  /* Lock down the context */
+  __CFSpinLock(&ctxt->_lock);
+
+  if (!__CFBitIsSet(ctxt->_flags, kFlagBitHasHandshakes) && __CFBitIsSet(ctxt->_flags, kFlagBitIsBuffered))
+    result = _SocketStreamBufferedGetBuffer_NoLock(ctxt, maxBytesToRead, numBytesRead);
+
+  if (result) {
+    /* Attempt to get the count of buffered bytes. */
+    CFDataRef c = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
+
+    /* Did a read, so the event is no longer good. */
+    __CFBitClear(ctxt->_flags, kFlagBitCanRead);
+
+    /* Similar to the end of _SocketStreamRead; signal if more are waiting. */
+    if (__CFBitIsSet(ctxt->_flags, kFlagBitClosed) || (c && *((CFIndex*)CFDataGetBytePtr(c)))) {
+      __CFBitSet(ctxt->_flags, kFlagBitCanRead);
+      __CFBitClear(ctxt->_flags, kFlagBitPollRead);
+      event = kCFStreamEventHasBytesAvailable;
+    }
+  }
+
+  /* Unlock */
+  __CFSpinUnlock(&ctxt->_lock);
+
+  if (event != kCFStreamEventNone)
+    CFReadStreamSignalEvent(stream, event, NULL);
+
+  return result;
+}
+
 /* static */ Boolean _SocketStreamCanRead(CFReadStreamRef stream, _CFSocketStreamContext* ctxt)
 {
   CFStreamError error;
@@ -871,7 +1141,7 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
       /* Unlock */
       __CFSpinUnlock(&ctxt->_lock);
     }
-#if defined(__MACH__)
+#if defined(__MACH__) || defined(HAVE_OPENSSL)
     /* If none there, check to see if there are encrypted bytes that are buffered. */
     else if (__CFBitIsSet(ctxt->_flags, kFlagBitUseSSL)) {
 
@@ -910,6 +1180,23 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
                                         CFStreamError*          error,
                                         _CFSocketStreamContext* ctxt)
 {
+  struct iovec iov = {(void*)buffer, bufferLength};
+
+  return _SocketStreamWriteFrom(stream, &iov, 1, -1, 0, error, ctxt);
+}
+
+/* static */ CFIndex _SocketStreamWriteFrom(CFWriteStreamRef        stream,
+                                            const struct iovec*     iov,
+                                            int                     iovcnt,
+                                            int                     file,
+                                            CFIndex                 fileLength,
+                                            CFStreamError*          error,
+                                            _CFSocketStreamContext* ctxt)
+{
+  /*
+  ** Sends the iovcnt buffers in iov, or if file isn't -1, up to fileLength
+  ** bytes from file's current position instead.
+  */
   CFIndex           result = 0;
   CFStreamEventType event  = kCFStreamEventNone;
 
@@ -990,12 +1277,14 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
 
     /* If there's no error, try to write now. */
     if (!ctxt->_error.error) {
-#if defined(__MACH__)
-      if (__CFBitIsSet(ctxt->_flags, kFlagBitUseSSL))
-        result = _SocketStreamSecuritySend_NoLock(ctxt, buffer, bufferLength);
+      if (file != -1)
+        result = _CFSocketSendFile(ctxt->_socket, file, fileLength, &ctxt->_error);
+#if defined(__MACH__) || defined(HAVE_OPENSSL)
+      else if (__CFBitIsSet(ctxt->_flags, kFlagBitUseSSL))
+        result = _SocketStreamSecuritySendVector_NoLock(ctxt, iov, iovcnt);
       else
 #endif
-        result = _CFSocketSend(ctxt->_socket, buffer, bufferLength, &ctxt->_error);
+        result = _CFSocketSendVector(ctxt->_socket, iov, iovcnt, &ctxt->_error);
     }
 
     /* Did a write, so the event is no longer good. */
@@ -1123,7 +1412,7 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
   if (!ctxt->_clientReadStream && !ctxt->_clientWriteStream) {
     CFRange r;
 
-#if defined(__MACH__)
+#if defined(__MACH__) || defined(HAVE_OPENSSL)
     if (CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext))
       _SocketStreamSecurityClose_NoLock(ctxt);
 #endif
@@ -1171,6 +1460,12 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
   /* Try to just get the property from the dictionary */
   property = CFDictionaryGetValue(ctxt->_properties, propertyName);
 
+#if defined(HAVE_OPENSSL) && defined(__linux__)
+  /* Once the SSL handshake is done, kernel SSL only reads as on if the kernel took over the records. */
+  if (property && __CFBitIsSet(ctxt->_flags, kFlagBitUseSSL) && CFEqual(_kCFStreamPropertySocketKernelTLS, propertyName))
+    property = NULL;
+#endif
+
   /* Must be some other type that takes a little more work to produce. */
   if (!property) {
     /* Client wants the far end host's name. */
@@ -1206,6 +1501,20 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
       result                 = CFDataCreate(CFGetAllocator(stream), (const void*)(&s), sizeof(s));
     }
 
+    /* Writes through _CFSocketStreamWriteVector are supported once there's a socket. */
+    else if (CFEqual(_kCFStreamPropertySocketGatherWrite, propertyName)) {
+      if (ctxt->_socket)
+        property = kCFBooleanTrue;
+    }
+
+#if defined(__linux__)
+    /* Writes through _CFSocketStreamWriteFile need the plain socket, so not with SSL unless the kernel does it. */
+    else if (CFEqual(_kCFStreamPropertySocketSendFile, propertyName)) {
+      if (ctxt->_socket && !__CFBitIsSet(ctxt->_flags, kFlagBitUseSSL))
+        property = kCFBooleanTrue;
+    }
+#endif
+
     /* Support for legacy ordering.  Response was available right away. */
     else if (CFEqual(kCFStreamPropertyCONNECTResponse, propertyName)) {
       if (CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertyCONNECTProxy))
@@ -1221,6 +1530,31 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
           result = NULL;
         }
       }
+#elif defined(HAVE_OPENSSL)
+      CFDataRef wrapper = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext);
+      STACK_OF(X509)* chain = wrapper ? SSL_get_peer_cert_chain(*((SSLContextRef*)CFDataGetBytePtr(wrapper))) : NULL;
+
+      /* With no SecCertificateRef here, the certificates are handed back DER encoded. */
+      if (chain) {
+        int i, count = sk_X509_num(chain);
+
+        result = CFArrayCreateMutable(CFGetAllocator(ctxt->_properties), count, &kCFTypeArrayCallBacks);
+        for (i = 0; result && (i < count); i++) {
+          UInt8* der    = NULL;
+          int    length = i2d_X509(sk_X509_value(chain, i), &der);
+
+          if (length > 0) {
+            CFDataRef cert = CFDataCreate(CFGetAllocator(ctxt->_properties), der, length);
+            if (cert) {
+              CFArrayAppendValue((CFMutableArrayRef)result, cert);
+              CFRelease(cert);
+            }
+          }
+
+          if (der)
+            OPENSSL_free(der);
+        }
+      }
 #endif
     }
 
@@ -1256,7 +1590,7 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
   if (CFEqual(propertyName, kCFStreamPropertySocketSecurityLevel)) {
     CFDataRef wrapper = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext);
 
-#if defined(__MACH__)
+#if defined(__MACH__) || defined(HAVE_OPENSSL)
     if (wrapper)
       property = _SecurityGetProtocol(*((SSLContextRef*)CFDataGetBytePtr(wrapper)));
 #endif
@@ -1376,7 +1710,7 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
   else if (CFEqual(propertyName, kCFStreamPropertyCONNECTProxy))
     result = _CONNECTSetInfo_NoLock(ctxt, propertyValue);
 
-#if defined(__MACH__)
+#if defined(__MACH__) || defined(HAVE_OPENSSL)
   else if (CFEqual(propertyName, kCFStreamPropertySocketSSLContext))
     result = _SocketStreamSecuritySetContext_NoLock(ctxt, propertyValue);
 
@@ -1463,6 +1797,46 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
     result = TRUE;
   }
 
+  /* Socket options go on the socket now if there is one, otherwise when it's created. */
+  else if (CFEqual(propertyName, _kCFStreamPropertySocketOptions)) {
+    if (!propertyValue) {
+      CFDictionaryRemoveValue(ctxt->_properties, propertyName);
+      result = TRUE;
+    }
+
+    else if (_CFSocketOptionsAreValid((CFDictionaryRef)propertyValue)) {
+      CFDictionarySetValue(ctxt->_properties, propertyName, propertyValue);
+
+      if (ctxt->_socket)
+        _CFSocketApplyOptions(CFSocketGetNative(ctxt->_socket), (CFDictionaryRef)propertyValue);
+
+      result = TRUE;
+    }
+  }
+
+  /* Racing and Fast Open are set up when the open starts, and kernel SSL ahead of the handshake, so they can only be changed before. */
+  else if ((CFEqual(propertyName, _kCFStreamPropertySocketRaceConnections) || CFEqual(propertyName, _kCFStreamPropertySocketConnectionAttemptDelay) ||
+            CFEqual(propertyName, _kCFStreamPropertySocketFastOpen) || CFEqual(propertyName, _kCFStreamPropertySocketKernelTLS)) &&
+           !__CFBitIsSet(ctxt->_flags, kFlagBitOpenStarted) && !__CFBitIsSet(ctxt->_flags, kFlagBitOpenComplete)) {
+    if (propertyValue)
+      CFDictionarySetValue(ctxt->_properties, propertyName, propertyValue);
+    else
+      CFDictionaryRemoveValue(ctxt->_properties, propertyName);
+
+    result = TRUE;
+  }
+
+  /* How far the receive buffer may grow; only meaningful along with the size above. */
+  else if (CFEqual(propertyName, _kCFStreamPropertyRecvBufferMaxSize) && !__CFBitIsSet(ctxt->_flags, kFlagBitOpenStarted) &&
+           !__CFBitIsSet(ctxt->_flags, kFlagBitOpenComplete)) {
+    if (!propertyValue)
+      CFDictionaryRemoveValue(ctxt->_properties, propertyName);
+    else if (CFNumberGetByteSize(propertyValue) == sizeof(CFIndex))
+      CFDictionarySetValue(ctxt->_properties, propertyName, propertyValue);
+
+    result = TRUE;
+  }
+
   /* 3800596 Need to signal errors if setting property caused one. */
   if (ctxt->_error.error) {
     /* Attempt to get the count of buffered bytes. */
@@ -1526,6 +1900,10 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
     switch (type) {
       case kCFSocketConnectCallBack:
 
+        /* A racing attempt only becomes the stream's socket if it won. */
+        if ((s != ctxt->_socket) && !_SocketStreamRaceConnected_NoLock(ctxt, s, data))
+          break;
+
         if (!data) {
           /* See if the client has turned off the error detection. */
           CFBooleanRef reach = (CFBooleanRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertyAutoErrorOnSystemChange);
@@ -1588,7 +1966,7 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
 
         /* Buffered reading has special code. */
         else if (__CFBitIsSet(ctxt->_flags, kFlagBitIsBuffered)) {
-#if defined(__MACH__)
+#if defined(__MACH__) || defined(HAVE_OPENSSL)
           /* Call the buffered read stuff for SSL */
           if (__CFBitIsSet(ctxt->_flags, kFlagBitUseSSL))
             _SocketStreamSecurityBufferedRead_NoLock(ctxt);
@@ -1988,6 +2366,129 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
   }
 }
 
+/* static */ void _RaceHostCallBack(CFHostRef theHost, CFHostInfoType typeInfo, const CFStreamError* error, _CFSocketStreamContext* ctxt)
+{
+  CFStreamError err;
+  CFArrayRef    list;
+  Boolean       failed = FALSE;
+
+  /* Only set to non-NULL if there is an error. */
+  CFReadStreamRef  rStream = NULL;
+  CFWriteStreamRef wStream = NULL;
+
+  /* NOTE the early bail!  Only care about the single family address callbacks. */
+  if ((typeInfo != _kCFHostIPv6Addresses) && (typeInfo != _kCFHostIPv4Addresses))
+    return;
+
+  /* Lock down the context. */
+  __CFSpinLock(&ctxt->_lock);
+
+  /* Hold on to the results, since the lookup is invalidated on its way out of the race. */
+  list = error->error ? NULL : (CFArrayRef)CFHostGetInfo(theHost, typeInfo, NULL);
+  if (list && (CFGetTypeID(list) == CFArrayGetTypeID()))
+    CFRetain(list);
+  else
+    list = NULL;
+
+  /* The lookup is done either way.  If it's not in the race anymore, the race is over. */
+  if (_SocketStreamRaceRemove_NoLock(ctxt, theHost)) {
+    /* Line up whatever addresses came back. */
+    if (list)
+      _SocketStreamRaceAddAddresses_NoLock(ctxt, list);
+
+    /* If nothing is connecting yet, start right away instead of waiting on the other family. */
+    if (!_SocketStreamRaceIsConnecting_NoLock(ctxt))
+      _SocketStreamRaceNextConnection_NoLock(ctxt);
+
+    /* If that was the last of it, the open fails. */
+    failed = _SocketStreamRaceFinish_NoLock(ctxt, error);
+  }
+
+  if (list)
+    CFRelease(list);
+
+  if (failed) {
+    __CFBitSet(ctxt->_flags, kFlagBitOpenComplete);
+    __CFBitClear(ctxt->_flags, kFlagBitOpenStarted);
+    __CFBitClear(ctxt->_flags, kFlagBitPollOpen);
+
+    /* Copy the error for notification. */
+    memmove(&err, &ctxt->_error, sizeof(err));
+
+    /* Grab the client streams for error notification. */
+    if (ctxt->_clientReadStream && __CFBitIsSet(ctxt->_flags, kFlagBitReadStreamOpened))
+      rStream = (CFReadStreamRef)CFRetain(ctxt->_clientReadStream);
+
+    if (ctxt->_clientWriteStream && __CFBitIsSet(ctxt->_flags, kFlagBitWriteStreamOpened))
+      wStream = (CFWriteStreamRef)CFRetain(ctxt->_clientWriteStream);
+  }
+
+  /* Unlock now. */
+  __CFSpinUnlock(&ctxt->_lock);
+
+  /* Signal the streams of the error event. */
+  if (rStream) {
+    CFReadStreamSignalEvent(rStream, kCFStreamEventErrorOccurred, &err);
+    CFRelease(rStream);
+  }
+
+  if (wStream) {
+    CFWriteStreamSignalEvent(wStream, kCFStreamEventErrorOccurred, &err);
+    CFRelease(wStream);
+  }
+}
+
+/* static */ void _RaceTimerCallBack(CFRunLoopTimerRef timer, _CFSocketStreamContext* ctxt)
+{
+  CFStreamError err;
+  Boolean       failed = FALSE;
+
+  /* Only set to non-NULL if there is an error. */
+  CFReadStreamRef  rStream = NULL;
+  CFWriteStreamRef wStream = NULL;
+
+  /* Lock down the context. */
+  __CFSpinLock(&ctxt->_lock);
+
+  /* Time for another attempt, alongside those still connecting. */
+  if (CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRaceTimer) == timer) {
+    _SocketStreamRaceNextConnection_NoLock(ctxt);
+
+    /* If none are left and nothing would start, the open fails. */
+    failed = _SocketStreamRaceFinish_NoLock(ctxt, NULL);
+  }
+
+  if (failed) {
+    __CFBitSet(ctxt->_flags, kFlagBitOpenComplete);
+    __CFBitClear(ctxt->_flags, kFlagBitOpenStarted);
+    __CFBitClear(ctxt->_flags, kFlagBitPollOpen);
+
+    /* Copy the error for notification. */
+    memmove(&err, &ctxt->_error, sizeof(err));
+
+    /* Grab the client streams for error notification. */
+    if (ctxt->_clientReadStream && __CFBitIsSet(ctxt->_flags, kFlagBitReadStreamOpened))
+      rStream = (CFReadStreamRef)CFRetain(ctxt->_clientReadStream);
+
+    if (ctxt->_clientWriteStream && __CFBitIsSet(ctxt->_flags, kFlagBitWriteStreamOpened))
+      wStream = (CFWriteStreamRef)CFRetain(ctxt->_clientWriteStream);
+  }
+
+  /* Unlock now. */
+  __CFSpinUnlock(&ctxt->_lock);
+
+  /* Signal the streams of the error event. */
+  if (rStream) {
+    CFReadStreamSignalEvent(rStream, kCFStreamEventErrorOccurred, &err);
+    CFRelease(rStream);
+  }
+
+  if (wStream) {
+    CFWriteStreamSignalEvent(wStream, kCFStreamEventErrorOccurred, &err);
+    CFRelease(wStream);
+  }
+}
+
 #if defined(__MACH__)
 /* static */ void _ReachabilityCallBack(SCNetworkReachabilityRef target, const SCNetworkConnectionFlags flags, _CFSocketStreamContext* ctxt)
 {
@@ -2547,6 +3048,37 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
   return result;
 }
 
+/* static */ CFIndex _CFSocketRecvVector(CFSocketRef s, const struct iovec* iov, int iovcnt, CFStreamError* error)
+{
+  CFIndex result = -1;
+
+  /* A single buffer doesn't need the scatter machinery. */
+  if (iovcnt == 1)
+    return _CFSocketRecv(s, (UInt8*)iov[0].iov_base, iov[0].iov_len, error);
+
+  /* Zero out the error (no error). */
+  memset(error, 0, sizeof(error[0]));
+
+  /* If the socket is invalid, return an EINVAL error. */
+  if (!s || !CFSocketIsValid(s)) {
+    error->error  = EINVAL;
+    error->domain = kCFStreamErrorDomainPOSIX;
+  }
+
+  else {
+    /* Fill all the pieces in one go. */
+    result = readv(CFSocketGetNative(s), iov, iovcnt);
+
+    /* If readv returned an error, get the error and make sure to return -1. */
+    if (result < 0) {
+      _LastError(error);
+      result = -1;
+    }
+  }
+
+  return result;
+}
+
 /* static */ CFIndex _CFSocketSend(CFSocketRef s, const UInt8* buffer, CFIndex length, CFStreamError* error)
 {
   CFIndex result = -1;
@@ -2574,16 +3106,86 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
   return result;
 }
 
-/* static */ Boolean _CFSocketCan(CFSocketRef s, int mode)
+/* static */ CFIndex _CFSocketSendVector(CFSocketRef s, const struct iovec* iov, int iovcnt, CFStreamError* error)
 {
-  /*
-  ** Unfortunately, this function is required as a result of some odd behavior
-  ** code in CFSocket.  In cases where CFSocket is not scheduled but enable/
-  ** disable of the callbacks are called, they are not truly enabled/disabled.
-  ** Once the CFSocket is scheduled again, it enables all the original events
-  ** which is not necessarily CFSocketStream's intended state.  This code
-  ** is then used in order to double check the incoming event from CFSocket.
-  */
+  CFIndex result = -1;
+
+  /* A single buffer doesn't need the gather machinery. */
+  if (iovcnt == 1)
+    return _CFSocketSend(s, (const UInt8*)iov[0].iov_base, iov[0].iov_len, error);
+
+  /* Zero out the error (no error). */
+  memset(error, 0, sizeof(error[0]));
+
+  /* If the socket is invalid, return an EINVAL error. */
+  if (!s || !CFSocketIsValid(s)) {
+    error->error  = EINVAL;
+    error->domain = kCFStreamErrorDomainPOSIX;
+  }
+
+  else {
+    /* Send all the pieces in one go. */
+    result = writev(CFSocketGetNative(s), iov, iovcnt);
+
+    /* If writev returned an error, get the error and make sure to return -1. */
+    if (result < 0) {
+      _LastError(error);
+      result = -1;
+    }
+  }
+
+  return result;
+}
+
+/* static */ CFIndex _CFSocketSendFile(CFSocketRef s, int fd, CFIndex length, CFStreamError* error)
+{
+  CFIndex result = -1;
+
+  /* Zero out the error (no error). */
+  memset(error, 0, sizeof(error[0]));
+
+  /* If the socket is invalid, return an EINVAL error. */
+  if (!s || !CFSocketIsValid(s)) {
+    error->error  = EINVAL;
+    error->domain = kCFStreamErrorDomainPOSIX;
+  }
+
+  else {
+#if defined(__linux__)
+    /* Let the kernel move the bytes from the file's current position. */
+    result = sendfile(CFSocketGetNative(s), fd, NULL, length);
+
+    /* If sendfile returned an error, get the error and make sure to return -1. */
+    if (result < 0) {
+      _LastError(error);
+      result = -1;
+    }
+
+    /* Nothing left in the file means it's shorter than promised; zero would look like EOF on the socket. */
+    else if (!result && length) {
+      error->error  = EIO;
+      error->domain = kCFStreamErrorDomainPOSIX;
+      result        = -1;
+    }
+#else
+    error->error  = ENOTSUP;
+    error->domain = kCFStreamErrorDomainPOSIX;
+#endif
+  }
+
+  return result;
+}
+
+/* static */ Boolean _CFSocketCan(CFSocketRef s, int mode)
+{
+  /*
+  ** Unfortunately, this function is required as a result of some odd behavior
+  ** code in CFSocket.  In cases where CFSocket is not scheduled but enable/
+  ** disable of the callbacks are called, they are not truly enabled/disabled.
+  ** Once the CFSocket is scheduled again, it enables all the original events
+  ** which is not necessarily CFSocketStream's intended state.  This code
+  ** is then used in order to double check the incoming event from CFSocket.
+  */
 
   /*
   ** This code is also used as a performance win at the end of SocketStreamRead
@@ -2623,6 +3225,112 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
   return (val > 0) ? TRUE : FALSE;
 }
 
+/* static */ Boolean _CFSocketOptionsAreValid(CFDictionaryRef options)
+{
+  CFIndex     i, count;
+  CFStringRef keys[16];
+  CFTypeRef   values[16];
+
+  if (!options || (CFGetTypeID(options) != CFDictionaryGetTypeID()))
+    return FALSE;
+
+  /* There are fewer options than that, so anything more has unknown keys. */
+  count = CFDictionaryGetCount(options);
+  if (count > (sizeof(keys) / sizeof(keys[0])))
+    return FALSE;
+
+  CFDictionaryGetKeysAndValues(options, (const void**)keys, (const void**)values);
+
+  for (i = 0; i < count; i++) {
+    CFTypeID type;
+
+    if (CFGetTypeID(keys[i]) != CFStringGetTypeID())
+      return FALSE;
+
+    /* Find the type the option wants. */
+    if (CFEqual(keys[i], _kCFStreamSocketOptionNoDelay) || CFEqual(keys[i], _kCFStreamSocketOptionKeepAlive))
+      type = CFBooleanGetTypeID();
+
+    else if (CFEqual(keys[i], _kCFStreamSocketOptionCongestionControl))
+      type = CFStringGetTypeID();
+
+    else if (CFEqual(keys[i], _kCFStreamSocketOptionSendBufferSize) || CFEqual(keys[i], _kCFStreamSocketOptionReceiveBufferSize) ||
+             CFEqual(keys[i], _kCFStreamSocketOptionKeepAliveIdle) || CFEqual(keys[i], _kCFStreamSocketOptionKeepAliveInterval) ||
+             CFEqual(keys[i], _kCFStreamSocketOptionKeepAliveCount) || CFEqual(keys[i], _kCFStreamSocketOptionNotSentLowWater) ||
+             CFEqual(keys[i], _kCFStreamSocketOptionBusyPoll))
+      type = CFNumberGetTypeID();
+
+    else
+      return FALSE;
+
+    if (CFGetTypeID(values[i]) != type)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* static */ void _CFSocketApplyOptions(CFSocketNativeHandle s, CFDictionaryRef options)
+{
+  int       i;
+  CFTypeRef value;
+
+  /* The integer options, each the CFNumber or CFBoolean value of its key. */
+  struct {
+    CFStringRef key;
+    int         level;
+    int         name;
+  } ints[] = {
+    {_kCFStreamSocketOptionNoDelay, IPPROTO_TCP, TCP_NODELAY},
+    {_kCFStreamSocketOptionSendBufferSize, SOL_SOCKET, SO_SNDBUF},
+    {_kCFStreamSocketOptionReceiveBufferSize, SOL_SOCKET, SO_RCVBUF},
+    {_kCFStreamSocketOptionKeepAlive, SOL_SOCKET, SO_KEEPALIVE},
+#if defined(TCP_KEEPIDLE)
+    {_kCFStreamSocketOptionKeepAliveIdle, IPPROTO_TCP, TCP_KEEPIDLE},
+#elif defined(TCP_KEEPALIVE)
+    {_kCFStreamSocketOptionKeepAliveIdle, IPPROTO_TCP, TCP_KEEPALIVE},
+#endif
+#if defined(TCP_KEEPINTVL)
+    {_kCFStreamSocketOptionKeepAliveInterval, IPPROTO_TCP, TCP_KEEPINTVL},
+#endif
+#if defined(TCP_KEEPCNT)
+    {_kCFStreamSocketOptionKeepAliveCount, IPPROTO_TCP, TCP_KEEPCNT},
+#endif
+#if defined(TCP_NOTSENT_LOWAT)
+    {_kCFStreamSocketOptionNotSentLowWater, IPPROTO_TCP, TCP_NOTSENT_LOWAT},
+#endif
+#if defined(SO_BUSY_POLL)
+    {_kCFStreamSocketOptionBusyPoll, SOL_SOCKET, SO_BUSY_POLL},
+#endif
+  };
+
+  for (i = 0; i < (sizeof(ints) / sizeof(ints[0])); i++) {
+    int option;
+
+    value = CFDictionaryGetValue(options, ints[i].key);
+    if (!value)
+      continue;
+
+    if (CFGetTypeID(value) == CFBooleanGetTypeID())
+      option = (value == kCFBooleanTrue) ? 1 : 0;
+    else
+      CFNumberGetValue((CFNumberRef)value, kCFNumberIntType, &option);
+
+    /* Failures are left alone, so the socket keeps the system's value. */
+    setsockopt(s, ints[i].level, ints[i].name, (void*)&option, sizeof(option));
+  }
+
+#if defined(TCP_CONGESTION)
+  value = CFDictionaryGetValue(options, _kCFStreamSocketOptionCongestionControl);
+  if (value) {
+    char name[16]; /* TCP_CA_NAME_MAX */
+
+    if (CFStringGetCString((CFStringRef)value, name, sizeof(name), kCFStringEncodingASCII))
+      setsockopt(s, IPPROTO_TCP, TCP_CONGESTION, (void*)name, strlen(name));
+  }
+#endif
+}
+
 /* static */ Boolean _SocketStreamStartLookupForOpen_NoLock(_CFSocketStreamContext* ctxt)
 {
   Boolean result = FALSE;
@@ -2710,13 +3418,21 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
     /* Get the type of lookup for type specific work. */
     lookup_type = CFGetTypeID(lookup);
 
-    /* Given the lookup, try to kick it off */
-    result      = _ScheduleAndStartLookup(lookup, loops, &ctxt->_error,
-                                          ((lookup_type == host_type) ? (const void*)_HostCallBack : (const void*)_NetServiceCallBack), ctxt);
+    /* When racing, a host which still needs resolving is resolved one family at a time instead. */
+    if ((lookup_type == host_type) && _SocketStreamRaceEnabled_NoLock(ctxt) && !CFHostGetAddressing((CFHostRef)lookup, NULL) &&
+        CFHostGetNames((CFHostRef)lookup, NULL)) {
+      result = _SocketStreamRaceStartLookups_NoLock(ctxt, (CFHostRef)lookup);
+    }
 
-    /* Add it to the list of schedulables for future scheduling calls. */
-    if (result)
-      _SchedulablesAdd(ctxt->_schedulables, lookup);
+    else {
+      /* Given the lookup, try to kick it off */
+      result = _ScheduleAndStartLookup(lookup, loops, &ctxt->_error,
+                                       ((lookup_type == host_type) ? (const void*)_HostCallBack : (const void*)_NetServiceCallBack), ctxt);
+
+      /* Add it to the list of schedulables for future scheduling calls. */
+      if (result)
+        _SchedulablesAdd(ctxt->_schedulables, lookup);
+    }
 
     /* Scheduling failed as a result of an error. */
     else if (ctxt->_error.error) {
@@ -2769,6 +3485,7 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
 
     CFArrayRef      callback;
     CFBooleanRef    boolean;
+    CFDictionaryRef options;
     CFDictionaryRef info = (CFDictionaryRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketFamilyTypeProtocol);
 
     /* If there was a dictionary for the CFSocketSignature-type values, get those values. */
@@ -2829,6 +3546,22 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
       setsockopt(s, IPPROTO_IP, IP_TTL, (void*)&ttl, sizeof(ttl));
     }
 
+#if defined(TCP_FASTOPEN_CONNECT)
+    /*
+    ** With a cookie for the server, connect returns right away and the SYN
+    ** waits to carry the first write.  Without one, or on kernels lacking
+    ** the option, the connect just goes ahead as usual.
+    */
+    boolean = (CFBooleanRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketFastOpen);
+    if (boolean == kCFBooleanTrue)
+      setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (void*)&yes, sizeof(yes));
+#endif
+
+    /* The client's own options come last, so they win over any set above or by the callback. */
+    options = (CFDictionaryRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketOptions);
+    if (options)
+      _CFSocketApplyOptions(s, options);
+
 #if defined(__MACH__)
     /* Turn off SIGPIPE on the socket (SIGPIPE doesn't exist on WIN32) */
     setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(yes));
@@ -2907,6 +3640,10 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
     CFTypeRef lookup  = (CFTypeRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyHostForOpen);
     SInt32*   attempt = NULL;
 
+    /* Racing takes over the addresses, unless there's a socket already to connect. */
+    if (lookup && !ctxt->_socket && _SocketStreamRaceEnabled_NoLock(ctxt))
+      return _SocketStreamRaceStart_NoLock(ctxt, lookup); /* NOTE the early return here. */
+
     /* If there was a host, there is more work to do */
     if (lookup) {
       CFIndex          count;
@@ -3034,6 +3771,7 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
       int                  yes = 1;
       CFOptionFlags        flags;
       CFBooleanRef         boolean;
+      CFDictionaryRef      options;
       CFSocketNativeHandle s;
       CFSocketContext      c        = {0, ctxt, NULL, NULL, NULL};
       CFArrayRef           loops[3] = {ctxt->_readloops, ctxt->_writeloops, ctxt->_sharedloops};
@@ -3085,6 +3823,11 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
       setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(yes));
 #endif
 
+      /* Apply the client's socket options, if any. */
+      options = (CFDictionaryRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketOptions);
+      if (options)
+        _CFSocketApplyOptions(s, options);
+
       /* Place the socket in nonblocking mode. */
       ioctl(s, FIONBIO, (void*)&yes);
 
@@ -3119,2270 +3862,4010 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
   return FALSE;
 }
 
-/* static */ Boolean _SocketStreamCan(_CFSocketStreamContext* ctxt, CFTypeRef stream, int test, CFStringRef mode, CFStreamError* error)
+/* static */ Boolean _SocketStreamRaceCreate_NoLock(_CFSocketStreamContext* ctxt)
 {
-  Boolean result = TRUE;
-  Boolean isRead;
+  Boolean        result = FALSE;
+  CFAllocatorRef alloc  = CFGetAllocator(ctxt->_properties);
 
-  /* No error to  start. */
-  memset(error, 0, sizeof(error[0]));
+  /* The attempts in flight, the addresses still to try, and the error to fail with. */
+  CFMutableArrayRef attempts  = CFArrayCreateMutable(alloc, 0, &kCFTypeArrayCallBacks);
+  CFMutableArrayRef addresses = CFArrayCreateMutable(alloc, 0, &kCFTypeArrayCallBacks);
+  CFMutableDataRef  error     = CFDataCreateMutable(alloc, sizeof(CFStreamError));
 
-  /* Lock down the context */
-  __CFSpinLock(&ctxt->_lock);
+  if (attempts && addresses && error) {
+    /* Start out with no error. */
+    CFDataSetLength(error, sizeof(CFStreamError));
+    memset(CFDataGetMutableBytePtr(error), 0, sizeof(CFStreamError));
 
-  isRead = CFReadStreamGetTypeID() == CFGetTypeID(stream);
+    CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySocketRaceAttempts, attempts);
+    CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySocketRaceAddresses, addresses);
+    CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySocketRaceError, error);
 
-  result = __CFBitIsSet(ctxt->_flags, test);
+    result = TRUE;
+  }
 
-  /* If not already been signalled, need to find out. */
-  if (!ctxt->_error.error && !result) {
-    CFMutableArrayRef loops = isRead ? ctxt->_readloops : ctxt->_writeloops;
+  else {
+    ctxt->_error.error  = ENOMEM;
+    ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+  }
 
-    if (!__CFBitIsSet(ctxt->_flags, test + kFlagBitPollOpen) && ((CFArrayGetCount(ctxt->_sharedloops) + CFArrayGetCount(loops)) > 2)) {
-      __CFBitSet(ctxt->_flags, test + kFlagBitPollOpen);
-    }
+  if (attempts)
+    CFRelease(attempts);
+  if (addresses)
+    CFRelease(addresses);
+  if (error)
+    CFRelease(error);
 
-    else {
-      CFTypeRef loopAndMode[2] = {CFRunLoopGetCurrent(), mode};
+  return result;
+}
 
-      /* Add the current loop and the private mode to the list */
-      _SchedulesAddRunLoopAndMode(loops, (CFRunLoopRef)loopAndMode[0], (CFStringRef)loopAndMode[1]);
+/* static */ Boolean _SocketStreamRaceStart_NoLock(_CFSocketStreamContext* ctxt, CFTypeRef lookup)
+{
+  CFArrayRef list;
 
-      if (ctxt->_socket && (CFArrayGetCount(ctxt->_schedulables) == 1) && (ctxt->_socket == CFArrayGetValueAtIndex(ctxt->_schedulables, 0))) {
-        CFRunLoopSourceRef src = CFSocketCreateRunLoopSource(CFGetAllocator(ctxt->_schedulables), ctxt->_socket, 0);
-        if (src) {
-          CFRunLoopAddSource((CFRunLoopRef)loopAndMode[0], src, (CFStringRef)loopAndMode[1]);
-          CFRelease(src);
-        }
-      }
+  /* If the race is on already, this is nothing new. */
+  if (CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRaceAttempts))
+    return TRUE;
 
-      else {
-        /* Make sure to schedule all the schedulables on this loop and mode. */
-        CFArrayApplyFunction(ctxt->_schedulables, CFRangeMake(0, CFArrayGetCount(ctxt->_schedulables)),
-                             (CFArrayApplierFunction)_SchedulablesScheduleApplierFunction, loopAndMode);
-      }
+  if (!_SocketStreamRaceCreate_NoLock(ctxt))
+    return FALSE;
 
-      /* Unlock the context to allow things to fire */
-      __CFSpinUnlock(&ctxt->_lock);
+  /* Get the address list from the lookup. */
+  if (CFGetTypeID(lookup) == CFHostGetTypeID())
+    list = CFHostGetAddressing((CFHostRef)lookup, NULL);
+  else
+    list = CFNetServiceGetAddressing((CFNetServiceRef)lookup);
 
-      /* Run the run loop for a poll (0.0) */
-      CFRunLoopRunInMode(mode, 0.0, FALSE);
+  if (list)
+    _SocketStreamRaceAddAddresses_NoLock(ctxt, list);
 
-      /* Lock the context back up. */
-      __CFSpinLock(&ctxt->_lock);
+  /* Start the first attempt.  The timer takes care of the rest. */
+  _SocketStreamRaceNextConnection_NoLock(ctxt);
 
-      if (ctxt->_socket && (CFArrayGetCount(ctxt->_schedulables) == 1) && (ctxt->_socket == CFArrayGetValueAtIndex(ctxt->_schedulables, 0))) {
-        CFRunLoopSourceRef src = CFSocketCreateRunLoopSource(CFGetAllocator(ctxt->_schedulables), ctxt->_socket, 0);
-        if (src) {
-          CFRunLoopRemoveSource((CFRunLoopRef)loopAndMode[0], src, (CFStringRef)loopAndMode[1]);
-          CFRelease(src);
-        }
-      }
+  /* If nothing could be started, it's already over. */
+  return !_SocketStreamRaceFinish_NoLock(ctxt, NULL);
+}
 
-      else {
-        /* Make sure to unschedule all the schedulables on this loop and mode. */
-        CFArrayApplyFunction(ctxt->_schedulables, CFRangeMake(0, CFArrayGetCount(ctxt->_schedulables)),
-                             (CFArrayApplierFunction)_SchedulablesUnscheduleApplierFunction, loopAndMode);
-      }
+/* static */ Boolean _SocketStreamRaceStartLookups_NoLock(_CFSocketStreamContext* ctxt, CFHostRef host)
+{
+  int               i, j;
+  Boolean           result   = FALSE;
+  CFMutableArrayRef attempts = NULL;
+  CFStringRef       name     = (CFStringRef)CFArrayGetValueAtIndex(CFHostGetNames(host, NULL), 0);
+  CFHostInfoType    types[2] = {_kCFHostIPv6Addresses, _kCFHostIPv4Addresses};
+  CFArrayRef        loops[3] = {ctxt->_readloops, ctxt->_writeloops, ctxt->_sharedloops};
+
+  if (!_SocketStreamRaceCreate_NoLock(ctxt))
+    return FALSE;
 
-      /* Remove this loop and private mode from the list. */
-      _SchedulesRemoveRunLoopAndMode(loops, (CFRunLoopRef)loopAndMode[0], (CFStringRef)loopAndMode[1]);
+  attempts = (CFMutableArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRaceAttempts);
 
-      result = __CFBitIsSet(ctxt->_flags, test);
-    }
-  }
+  /* Each family gets its own host, so the first to answer can start connecting. */
+  for (i = 0; i < (sizeof(types) / sizeof(types[0])); i++) {
+    CFHostClientContext c      = {0, ctxt, NULL, NULL, NULL};
+    CFHostRef           lookup = CFHostCreateWithName(CFGetAllocator(ctxt->_properties), name);
 
-  /* If there was an error, make sure to signal it. */
-  if (ctxt->_error.error) {
-    /* Attempt to get the count of buffered bytes. */
-    CFDataRef c = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
+    if (!lookup) {
+      ctxt->_error.error  = ENOMEM;
+      ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+      continue;
+    }
 
-    /* Copy the error. */
-    memmove(error, &ctxt->_error, sizeof(error[0]));
+    /* Set the stream as the client for callback. */
+    CFHostSetClient(lookup, (CFHostClientCallBack)_RaceHostCallBack, &c);
 
-    /* It's set now. */
-    __CFBitSet(ctxt->_flags, test);
+    /* Now schedule the lookup on all loops and modes */
+    for (j = 0; j < (sizeof(loops) / sizeof(loops[0])); j++)
+      _CFTypeScheduleOnMultipleRunLoops(lookup, loops[j]);
 
-    result = TRUE;
+    /* Add it to the race and the list of schedulables if it starts. */
+    if (CFHostStartInfoResolution(lookup, types[i], &ctxt->_error)) {
+      CFArrayAppendValue(attempts, lookup);
+      _SchedulablesAdd(ctxt->_schedulables, lookup);
+      result = TRUE;
+    }
 
-    /*
-    ** 2998408 Force async callback for errors so there is no worry about the
-    ** context going bad underneath callers of this function.
-    */
+    else {
+      /* Remove it from the all schedules. */
+      for (j = 0; j < (sizeof(loops) / sizeof(loops[0])); j++)
+        _CFTypeUnscheduleFromMultipleRunLoops(lookup, loops[j]);
 
-    /*
-    ** 3863115 If there is a client stream and it's been opened, signal the
-    ** error, but only if there are no bytes in the buffer.
-    */
-    if ((!c || !*((CFIndex*)CFDataGetBytePtr(c))) && (ctxt->_clientReadStream && __CFBitIsSet(ctxt->_flags, kFlagBitReadStreamOpened))) {
-      _CFReadStreamSignalEventDelayed(ctxt->_clientReadStream, kCFStreamEventErrorOccurred, error);
+      /* Invalidate the lookup; never to be used again. */
+      _CFTypeInvalidate(lookup);
     }
 
-    /* If there is a client stream and it's been opened, signal the error. */
-    if (ctxt->_clientWriteStream && __CFBitIsSet(ctxt->_flags, kFlagBitWriteStreamOpened))
-      _CFWriteStreamSignalEventDelayed(ctxt->_clientWriteStream, kCFStreamEventErrorOccurred, error);
+    CFRelease(lookup);
   }
 
-  /* Unlock */
-  __CFSpinUnlock(&ctxt->_lock);
+  /* One family is enough to go on. */
+  if (result)
+    memset(&ctxt->_error, 0, sizeof(ctxt->_error));
+  else
+    _SocketStreamRaceCancel_NoLock(ctxt);
 
   return result;
 }
 
-#if defined(__MACH__)
-/* static */ void _SocketStreamAddReachability_NoLock(_CFSocketStreamContext* ctxt)
+/* static */ void _SocketStreamRaceAddAddresses_NoLock(_CFSocketStreamContext* ctxt, CFArrayRef list)
 {
-  SCNetworkReachabilityRef reachability = (SCNetworkReachabilityRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyNetworkReachability);
+  CFIndex           i, count;
+  int               first     = AF_UNSPEC;
+  CFAllocatorRef    alloc     = CFGetAllocator(ctxt->_properties);
+  CFNumberRef       port      = _CFNumberCopyPortForOpen(ctxt->_properties);
+  CFMutableArrayRef addresses = (CFMutableArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRaceAddresses);
+  CFMutableArrayRef inet6     = CFArrayCreateMutable(alloc, 0, &kCFTypeArrayCallBacks);
+  CFMutableArrayRef inet      = CFArrayCreateMutable(alloc, 0, &kCFTypeArrayCallBacks);
 
-  /* There has to be an open socket and no reachibility item already. */
-  if (ctxt->_socket && __CFBitIsSet(ctxt->_flags, kFlagBitOpenComplete) && !reachability) {
-    /* Copy the addresses for the pipe. */
-    CFDataRef localAddr = CFSocketCopyAddress(ctxt->_socket);
-    CFDataRef peerAddr  = CFSocketCopyPeerAddress(ctxt->_socket);
+  if (!inet6 || !inet) {
+    CFStreamError error = {kCFStreamErrorDomainPOSIX, ENOMEM};
+    _SocketStreamRaceSetError_NoLock(ctxt, &error);
+  }
 
-    if (localAddr && peerAddr) {
-      /* Create the reachability object to watch the route. */
-      SCNetworkReachabilityRef reachability = SCNetworkReachabilityCreateWithAddressPair(
-          CFGetAllocator(ctxt->_properties), (const struct sockaddr*)CFDataGetBytePtr(localAddr), (const struct sockaddr*)CFDataGetBytePtr(peerAddr));
+  else {
+    CFIndex queued6, queued4;
+    CFMutableArrayRef turn, other;
 
-      if (reachability) {
-        int                          i;
-        SCNetworkReachabilityContext c        = {0, ctxt, NULL, NULL, NULL};
-        CFArrayRef                   loops[3] = {ctxt->_readloops, ctxt->_writeloops, ctxt->_sharedloops};
+    /* Split the queued addresses by family, keeping their order. */
+    count = CFArrayGetCount(addresses);
+    for (i = 0; i < count; i++) {
+      CFDataRef address = (CFDataRef)CFArrayGetValueAtIndex(addresses, i);
+      CFArrayAppendValue((((struct sockaddr*)CFDataGetBytePtr(address))->sa_family == AF_INET6) ? inet6 : inet, address);
+    }
 
-        /* Add it to the properties. */
-        CFDictionaryAddValue(ctxt->_properties, _kCFStreamPropertyNetworkReachability, reachability);
+    queued6 = CFArrayGetCount(inet6);
+    queued4 = CFArrayGetCount(inet);
 
-        /* Set the callback */
-        SCNetworkReachabilitySetCallback(reachability, (SCNetworkReachabilityCallBack)_ReachabilityCallBack, &c);
+    /* Then the new ones, with the port put in. */
+    count   = CFArrayGetCount(list);
+    for (i = 0; i < count; i++) {
+      CFDataRef address = _CFDataCopyAddressByInjectingPort((CFDataRef)CFArrayGetValueAtIndex(list, i), port);
 
-        /* Schedule it on all the loops and modes. */
-        for (i = 0; i < (sizeof(loops) / sizeof(loops[0])); i++)
-          _CFTypeScheduleOnMultipleRunLoops(reachability, loops[i]);
+      if (address) {
+        int family = ((struct sockaddr*)CFDataGetBytePtr(address))->sa_family;
 
-        /* Add it to the schedulables. */
-        _SchedulablesAdd(ctxt->_schedulables, reachability);
+        if (first == AF_UNSPEC)
+          first = family;
 
-        /* Schedulables and properties hold it now. */
-        CFRelease(reachability);
+        CFArrayAppendValue((family == AF_INET6) ? inet6 : inet, address);
+        CFRelease(address);
       }
     }
 
-    /* Don't need these anymore. */
-    if (localAddr)
-      CFRelease(localAddr);
-    if (peerAddr)
-      CFRelease(peerAddr);
+    /*
+    ** Families take turns.  Addresses already queued keep their place,
+    ** unless they're all one family, which has just had its turn then.
+    ** Otherwise the family the lookup listed first goes first.
+    */
+    if (queued6 && queued4)
+      first = ((struct sockaddr*)CFDataGetBytePtr((CFDataRef)CFArrayGetValueAtIndex(addresses, 0)))->sa_family;
+    else if (queued6)
+      first = AF_INET;
+    else if (queued4)
+      first = AF_INET6;
+
+    turn  = (first == AF_INET6) ? inet6 : inet;
+    other = (turn == inet6) ? inet : inet6;
+
+    /* Put them back interleaved. */
+    CFArrayRemoveAllValues(addresses);
+
+    count = (CFArrayGetCount(turn) > CFArrayGetCount(other)) ? CFArrayGetCount(turn) : CFArrayGetCount(other);
+    for (i = 0; i < count; i++) {
+      if (i < CFArrayGetCount(turn))
+        CFArrayAppendValue(addresses, CFArrayGetValueAtIndex(turn, i));
+      if (i < CFArrayGetCount(other))
+        CFArrayAppendValue(addresses, CFArrayGetValueAtIndex(other, i));
+    }
   }
+
+  if (inet6)
+    CFRelease(inet6);
+  if (inet)
+    CFRelease(inet);
+  if (port)
+    CFRelease(port);
 }
 
-/* static */ void _SocketStreamRemoveReachability_NoLock(_CFSocketStreamContext* ctxt)
+/* static */ Boolean _SocketStreamRaceNextConnection_NoLock(_CFSocketStreamContext* ctxt)
 {
-  /* Find out if there is a reachability already. */
-  SCNetworkReachabilityRef reachability = (SCNetworkReachabilityRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyNetworkReachability);
+  Boolean           result    = FALSE;
+  CFMutableArrayRef attempts  = (CFMutableArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRaceAttempts);
+  CFMutableArrayRef addresses = (CFMutableArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRaceAddresses);
 
-  if (reachability) {
-    int        i;
-    CFArrayRef loops[3] = {ctxt->_readloops, ctxt->_writeloops, ctxt->_sharedloops};
+  /* Go down the queue until an attempt gets going. */
+  while (!result && addresses && CFArrayGetCount(addresses)) {
+    CFDataRef address = (CFDataRef)CFRetain(CFArrayGetValueAtIndex(addresses, 0));
 
-    /* Invalidate the reachability; never to be used again. */
-    _CFTypeInvalidate(reachability);
+    CFArrayRemoveValueAtIndex(addresses, 0);
 
-    /* Unschedule it from all the loops and modes. */
-    for (i = 0; i < (sizeof(loops) / sizeof(loops[0])); i++)
-      _CFTypeUnscheduleFromMultipleRunLoops(reachability, loops[i]);
+    /*
+    ** Creating and connecting work on the stream's socket.  Once it's
+    ** connecting, it's handed over to the race.
+    */
+    if (_SocketStreamCreateSocket_NoLock(ctxt, address) && _SocketStreamConnect_NoLock(ctxt, address)) {
+      CFArrayAppendValue(attempts, ctxt->_socket);
+      CFRelease(ctxt->_socket);
+      ctxt->_socket = NULL;
 
-    /* Remove the socket from the schedulables. */
-    _SchedulablesRemove(ctxt->_schedulables, reachability);
+      result        = TRUE;
+    }
 
-    /* Remove it from the properties */
-    CFDictionaryRemoveValue(ctxt->_properties, reachability);
+    /* Keep the error in case they all fail, but carry on with the next. */
+    else {
+      _SocketStreamRaceSetError_NoLock(ctxt, &ctxt->_error);
+      memset(&ctxt->_error, 0, sizeof(ctxt->_error));
+    }
+
+    CFRelease(address);
   }
-}
-#endif
 
-/* static */ CFIndex _SocketStreamBufferedRead_NoLock(_CFSocketStreamContext* ctxt, UInt8* buffer, CFIndex length)
-{
-  CFIndex result     = 0;
+  /* The next attempt is due one delay after this one. */
+  if (result) {
+    CFTimeInterval    delay = kConnectionAttemptDelay;
+    CFNumberRef       value = (CFNumberRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketConnectionAttemptDelay);
+    CFRunLoopTimerRef timer = (CFRunLoopTimerRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRaceTimer);
 
-  /* Different bits required for "buffered reading." */
-  CFNumberRef      s = (CFNumberRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferSize);
-  CFMutableDataRef b = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBuffer);
-  CFMutableDataRef c = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
+    if (value)
+      CFNumberGetValue(value, kCFNumberDoubleType, &delay);
 
-  /* All have to be availbe to read. */
-  if (b && c && s) {
-    CFIndex* i   = (CFIndex*)CFDataGetMutableBytePtr(c);
-    UInt8*   ptr = (UInt8*)CFDataGetMutableBytePtr(b);
-    CFIndex  max;
+    if (delay < kConnectionAttemptMinDelay)
+      delay = kConnectionAttemptMinDelay;
 
-    CFNumberGetValue(s, kCFNumberCFIndexType, &max);
+    if (timer)
+      CFRunLoopTimerSetNextFireDate(timer, CFAbsoluteTimeGetCurrent() + delay);
 
-    /* Either read all the bytes or just what the client asked. */
-    result = (*i < length) ? *i : length;
-    *i     = *i - result;
+    /* First attempt, so create the timer which paces the rest. */
+    else {
+      int                   i;
+      CFRunLoopTimerContext c        = {0, ctxt, NULL, NULL, NULL};
+      CFArrayRef            loops[3] = {ctxt->_readloops, ctxt->_writeloops, ctxt->_sharedloops};
 
-    /* Copy the bytes into the client buffer */
-    memmove(buffer, ptr, result);
+      timer = CFRunLoopTimerCreate(CFGetAllocator(ctxt->_properties), CFAbsoluteTimeGetCurrent() + delay, delay, 0, 0,
+                                   (CFRunLoopTimerCallBack)_RaceTimerCallBack, &c);
 
-    /* Move down the bytes in the local buffer. */
-    memmove(ptr, ptr + result, *i);
+      /* Without a timer, the next attempt simply waits for this one to fail. */
+      if (timer) {
+        CFDictionaryAddValue(ctxt->_properties, _kCFStreamPropertySocketRaceTimer, timer);
 
-    /* Zero the bytes at the end of the local buffer */
-    memset(ptr + *i, 0, max - *i);
+        /* Add it to the list of schedulables for future scheduling calls. */
+        _SchedulablesAdd(ctxt->_schedulables, timer);
 
-#if defined(__MACH__)
-    /* If the local buffer is empty, pump SSL along. */
-    if (__CFBitIsSet(ctxt->_flags, kFlagBitUseSSL) && (*i == 0)) {
-      _SocketStreamSecurityBufferedRead_NoLock(ctxt);
-    }
-#endif
-  }
+        /* Now schedule the timer on all loops and modes */
+        for (i = 0; i < (sizeof(loops) / sizeof(loops[0])); i++)
+          _CFTypeScheduleOnMultipleRunLoops(timer, loops[i]);
 
-  /* If no bytes read and the pipe isn't closed, constitute an EAGAIN */
-  if (!result) {
-    if (!ctxt->_error.error && !__CFBitIsSet(ctxt->_flags, kFlagBitClosed)) {
-      ctxt->_error.error  = EAGAIN;
-      ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+        CFRelease(timer);
+      }
     }
-  } else if (__CFBitIsSet(ctxt->_flags, kFlagBitRecvdRead)) {
-    __CFBitClear(ctxt->_flags, kFlagBitRecvdRead);
-    if (ctxt->_socket)
-      CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
   }
 
   return result;
 }
 
-/* static */ void _SocketStreamBufferedSocketRead_NoLock(_CFSocketStreamContext* ctxt)
+/* static */ Boolean _SocketStreamRaceConnected_NoLock(_CFSocketStreamContext* ctxt, CFSocketRef s, const void* data)
 {
-  CFIndex* i;
-  CFIndex  s              = kRecvBufferSize;
-
-  /* Get the bits required in order to work with the buffer. */
-  CFNumberRef      size   = (CFNumberRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferSize);
-  CFMutableDataRef buffer = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBuffer);
-  CFMutableDataRef count  = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
-
-  /* No buffer assumes all are missing. */
-  if (!buffer) {
-    CFAllocatorRef alloc = CFGetAllocator(ctxt->_properties);
-
-    /* If no size, assume a default.  Can be overridden by properties. */
-    if (!size)
-      size = CFNumberCreate(alloc, kCFNumberCFIndexType, &s);
-    else
-      CFNumberGetValue(size, kCFNumberCFIndexType, &s);
-
-    /* Create the backing for the buffer and the counter. */
-    if (size) {
-      buffer = CFDataCreateMutable(alloc, s);
-      count  = CFDataCreateMutable(alloc, sizeof(CFIndex));
-    }
+  CFStreamError     error;
+  CFMutableArrayRef attempts = (CFMutableArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRaceAttempts);
+  CFIndex           i = attempts ? CFArrayGetFirstIndexOfValue(attempts, CFRangeMake(0, CFArrayGetCount(attempts)), s) : kCFNotFound;
 
-    /* If anything failed, set out of memory and bail. */
-    if (!buffer || !count || !size) {
-      if (buffer)
-        CFRelease(buffer);
-      if (count)
-        CFRelease(count);
-      if (size)
-        CFRelease(size);
-
-      ctxt->_error.error  = ENOMEM;
-      ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
-
-      return; /* NOTE the eary return. */
-    }
+  /* If it's not in the race, it lost already. */
+  if (i == kCFNotFound)
+    return FALSE;
 
-    /* Save the buffer information. */
-    CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferSize, size);
-    CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertyRecvBuffer, buffer);
-    CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount, count);
+  /* The winner becomes the stream's socket, and the rest are called off. */
+  if (!data) {
+    ctxt->_socket = (CFSocketRef)CFRetain(s);
+    CFArrayRemoveValueAtIndex(attempts, i);
 
-    CFRelease(size);
-    CFRelease(buffer);
-    CFRelease(count);
+    _SocketStreamRaceCancel_NoLock(ctxt);
 
-    /* Start with a zero byte count. */
-    *((CFIndex*)CFDataGetMutableBytePtr(count)) = 0;
+    return TRUE;
   }
 
-  /* Get the count and size of the buffer, respectively. */
-  i = (CFIndex*)CFDataGetMutableBytePtr(count);
-  CFNumberGetValue(size, kCFNumberCFIndexType, &s);
-
-  /* Only read if there is room in the buffer. */
-  if (*i < s) {
-    UInt8*  ptr       = (UInt8*)CFDataGetMutableBytePtr(buffer);
-    CFIndex bytesRead = _CFSocketRecv(ctxt->_socket, ptr + *i, s - *i, &ctxt->_error);
+  error.error  = *((SInt32*)data);
+  error.domain = _kCFStreamErrorDomainNativeSockets;
 
-    __CFBitClear(ctxt->_flags, kFlagBitRecvdRead);
+  /* A failed attempt makes way for the next one right away. */
+  _SocketStreamRaceRemove_NoLock(ctxt, s);
+  _SocketStreamRaceNextConnection_NoLock(ctxt);
 
-    /* If did read bytes, increase the count. */
-    if (bytesRead > 0) {
-      *i = *i + bytesRead;
-      CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
-      __CFBitSet(ctxt->_flags, kFlagBitCanRead);
-      __CFBitClear(ctxt->_flags, kFlagBitPollRead);
-    }
+  /* If that was the last of it, the error is left for the open to fail with. */
+  _SocketStreamRaceFinish_NoLock(ctxt, &error);
 
-    else if (bytesRead == 0) {
-      __CFBitSet(ctxt->_flags, kFlagBitClosed);
-      __CFBitSet(ctxt->_flags, kFlagBitCanRead);
-      __CFBitClear(ctxt->_flags, kFlagBitPollRead);
-    }
-  } else
-    __CFBitSet(ctxt->_flags, kFlagBitRecvdRead);
+  return FALSE;
 }
 
-/* static */ CFComparisonResult _OrderHandshakes(_CFSocketStreamPerformHandshakeCallBack fn1,
-                                                 _CFSocketStreamPerformHandshakeCallBack fn2,
-                                                 void*                                   context)
+/* static */ Boolean _SocketStreamRaceRemove_NoLock(_CFSocketStreamContext* ctxt, CFTypeRef attempt)
 {
-  if (!fn1)
-    return kCFCompareGreaterThan;
-  if (!fn2)
-    return kCFCompareLessThan;
-
-  /*
-  ** Order of handshakes in increasing priority:
-  **
-  ** 1) SOCKSv5 \__ Conceivably should not be set at the same time.
-  ** 2) SOCKSv4 /
-  ** 3) SOCKSv5 user/pass negotiation
-  ** 3) SOCKSv5 postamble
-  ** 4) CONNECT halt <- Used to halt the stream for another CONNECT
-  ** 5) CONNECT
-  ** 6) SSL send <- could be required for #4
-  ** 7) SSL
-  */
-
-  if (*fn1 == _PerformSOCKSv5Handshake_NoLock)
-    return kCFCompareLessThan;
-  if (*fn2 == _PerformSOCKSv5Handshake_NoLock)
-    return kCFCompareGreaterThan;
-
-  if (*fn1 == _PerformSOCKSv5UserPassHandshake_NoLock)
-    return kCFCompareLessThan;
-  if (*fn2 == _PerformSOCKSv5UserPassHandshake_NoLock)
-    return kCFCompareGreaterThan;
+  int               i;
+  CFArrayRef        loops[3] = {ctxt->_readloops, ctxt->_writeloops, ctxt->_sharedloops};
+  CFMutableArrayRef attempts = (CFMutableArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRaceAttempts);
+  CFIndex           index    = attempts ? CFArrayGetFirstIndexOfValue(attempts, CFRangeMake(0, CFArrayGetCount(attempts)), attempt) : kCFNotFound;
 
-  if (*fn1 == _PerformSOCKSv5PostambleHandshake_NoLock)
-    return kCFCompareLessThan;
-  if (*fn2 == _PerformSOCKSv5PostambleHandshake_NoLock)
-    return kCFCompareGreaterThan;
+  if (index == kCFNotFound)
+    return FALSE;
 
-  if (*fn1 == _PerformSOCKSv4Handshake_NoLock)
-    return kCFCompareLessThan;
-  if (*fn2 == _PerformSOCKSv4Handshake_NoLock)
-    return kCFCompareGreaterThan;
+  /* Remove it from the schedulables and all loops and modes. */
+  _SchedulablesRemove(ctxt->_schedulables, attempt);
 
-  if (*fn1 == _PerformCONNECTHaltHandshake_NoLock)
-    return kCFCompareLessThan;
-  if (*fn2 == _PerformCONNECTHaltHandshake_NoLock)
-    return kCFCompareGreaterThan;
+  for (i = 0; i < (sizeof(loops) / sizeof(loops[0])); i++)
+    _CFTypeUnscheduleFromMultipleRunLoops(attempt, loops[i]);
 
-  if (*fn1 == _PerformCONNECTHandshake_NoLock)
-    return kCFCompareLessThan;
-  if (*fn2 == _PerformCONNECTHandshake_NoLock)
-    return kCFCompareGreaterThan;
+  /* Sockets that didn't win were never handed to the client, so always close them. */
+  if (CFGetTypeID(attempt) == CFSocketGetTypeID())
+    CFSocketSetSocketFlags((CFSocketRef)attempt, CFSocketGetSocketFlags((CFSocketRef)attempt) | kCFSocketCloseOnInvalidate);
 
-#if defined(__MACH__)
-  if (*fn1 == _PerformSecuritySendHandshake_NoLock)
-    return kCFCompareLessThan;
-  if (*fn2 == _PerformSecuritySendHandshake_NoLock)
-    return kCFCompareGreaterThan;
+  /* Invalidate it, canceling any lookup; never to be used again. */
+  _SchedulablesInvalidateApplierFunction(attempt, NULL);
 
-  if (*fn1 == _PerformSecurityHandshake_NoLock)
-    return kCFCompareLessThan;
-  if (*fn2 == _PerformSecurityHandshake_NoLock)
-    return kCFCompareGreaterThan;
-#endif
+  /* Release and forget it. */
+  CFArrayRemoveValueAtIndex(attempts, index);
 
-  return kCFCompareEqualTo;
+  return TRUE;
 }
 
-/* static */ Boolean _SocketStreamAddHandshake_NoLock(_CFSocketStreamContext* ctxt, _CFSocketStreamPerformHandshakeCallBack fn)
+/* static */ Boolean _SocketStreamRaceFinish_NoLock(_CFSocketStreamContext* ctxt, const CFStreamError* error)
 {
-  CFIndex i;
-
-  /* Get the existing list of handshakes. */
-  CFMutableArrayRef handshakes = (CFMutableArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyHandshakes);
+  CFArrayRef attempts  = (CFArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRaceAttempts);
+  CFArrayRef addresses = (CFArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRaceAddresses);
 
-  /* If there is no list, need to create one. */
-  if (!handshakes) {
-    CFArrayCallBacks cb = {0, NULL, NULL, NULL, NULL};
+  /* No race to finish. */
+  if (!attempts)
+    return FALSE;
 
-    /* Create the list of handshakes. */
-    handshakes          = CFArrayCreateMutable(CFGetAllocator(ctxt->_properties), 0, &cb);
+  if (error && error->error)
+    _SocketStreamRaceSetError_NoLock(ctxt, error);
 
-    if (!handshakes)
-      return FALSE;
+  /* Still on while anything is connecting or resolving, or there are addresses left to try. */
+  if (CFArrayGetCount(attempts) || CFArrayGetCount(addresses))
+    return FALSE;
 
-    /* Add the list to the properties for later work. */
-    CFDictionaryAddValue(ctxt->_properties, _kCFStreamPropertyHandshakes, handshakes);
-    __CFBitSet(ctxt->_flags, kFlagBitHasHandshakes);
+  /* Out of options, so fail with the error kept along the way. */
+  memmove(&ctxt->_error, CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRaceError)),
+          sizeof(ctxt->_error));
 
-    CFRelease(handshakes);
+  /* No error means there were never any addresses. */
+  if (!ctxt->_error.error) {
+    ctxt->_error.error  = EAI_NODATA;
+    ctxt->_error.domain = kCFStreamErrorDomainNetDB;
   }
 
-  /* Find out if the handshake is in the list already. */
-  i = CFArrayGetFirstIndexOfValue(handshakes, CFRangeMake(0, CFArrayGetCount(handshakes)), fn);
-
-  /* Need to add it? */
-  if (i == kCFNotFound) {
-    CFRange r;
+  _SocketStreamRaceCancel_NoLock(ctxt);
 
-    /* Add the new handshake to the list. */
-    CFArrayAppendValue(handshakes, fn);
+  return TRUE;
+}
 
-    r = CFRangeMake(0, CFArrayGetCount(handshakes));
+/* static */ void _SocketStreamRaceCancel_NoLock(_CFSocketStreamContext* ctxt)
+{
+  CFMutableArrayRef attempts = (CFMutableArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRaceAttempts);
+  CFRunLoopTimerRef timer    = (CFRunLoopTimerRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRaceTimer);
 
-    /* Make sure to order the list of handshakes correctly */
-    CFArraySortValues(handshakes, r, (CFComparatorFunction)_OrderHandshakes, NULL);
+  /* Call off every attempt still going. */
+  while (attempts && CFArrayGetCount(attempts))
+    _SocketStreamRaceRemove_NoLock(ctxt, CFArrayGetValueAtIndex(attempts, 0));
 
-    /* Update the location. */
-    i = CFArrayGetFirstIndexOfValue(handshakes, r, fn);
-  }
+  /* Stop the timer pacing them. */
+  if (timer) {
+    int        i;
+    CFArrayRef loops[3] = {ctxt->_readloops, ctxt->_writeloops, ctxt->_sharedloops};
 
-  if (!i) {
-    __CFBitClear(ctxt->_flags, kFlagBitCanRead);
-    __CFBitClear(ctxt->_flags, kFlagBitCanWrite);
+    _SchedulablesRemove(ctxt->_schedulables, timer);
 
-    __CFBitClear(ctxt->_flags, kFlagBitRecvdRead);
+    for (i = 0; i < (sizeof(loops) / sizeof(loops[0])); i++)
+      _CFTypeUnscheduleFromMultipleRunLoops(timer, loops[i]);
 
-    /* Make sure all callbacks are set up for handshaking. */
-    if (ctxt->_socket && __CFBitIsSet(ctxt->_flags, kFlagBitOpenComplete))
-      CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack | kCFSocketWriteCallBack);
+    _CFTypeInvalidate(timer);
   }
 
-  return TRUE;
+  /* The race is over. */
+  CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySocketRaceAttempts);
+  CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySocketRaceAddresses);
+  CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySocketRaceTimer);
+  CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySocketRaceError);
 }
 
-/* static */ void _SocketStreamRemoveHandshake_NoLock(_CFSocketStreamContext* ctxt, _CFSocketStreamPerformHandshakeCallBack fn)
+/* static */ Boolean _SocketStreamCan(_CFSocketStreamContext* ctxt, CFTypeRef stream, int test, CFStringRef mode, CFStreamError* error)
 {
-  /* Get the existing list of handshakes. */
-  CFMutableArrayRef handshakes = (CFMutableArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyHandshakes);
+  Boolean result = TRUE;
+  Boolean isRead;
 
-  if (handshakes) {
-    /* Find out if the handshake is in the list. */
-    CFIndex i = CFArrayGetFirstIndexOfValue(handshakes, CFRangeMake(0, CFArrayGetCount(handshakes)), fn);
+  /* No error to  start. */
+  memset(error, 0, sizeof(error[0]));
 
-    /* If it exists, need to remove it. */
-    if (i != kCFNotFound)
-      CFArrayRemoveValueAtIndex(handshakes, i);
+  /* Lock down the context */
+  __CFSpinLock(&ctxt->_lock);
 
-    if (!CFArrayGetCount(handshakes)) {
-      CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertyHandshakes);
-      __CFBitClear(ctxt->_flags, kFlagBitHasHandshakes);
-    }
-  }
+  isRead = CFReadStreamGetTypeID() == CFGetTypeID(stream);
 
-  /* Need to reset the flags as a result of a handshake removal. */
-  __CFBitClear(ctxt->_flags, kFlagBitCanRead);
-  __CFBitClear(ctxt->_flags, kFlagBitCanWrite);
+  result = __CFBitIsSet(ctxt->_flags, test);
 
-  __CFBitClear(ctxt->_flags, kFlagBitRecvdRead);
+  /* If not already been signalled, need to find out. */
+  if (!ctxt->_error.error && !result) {
+    CFMutableArrayRef loops = isRead ? ctxt->_readloops : ctxt->_writeloops;
 
-  /* Make sure all callbacks are reset if open. */
-  if (ctxt->_socket && __CFBitIsSet(ctxt->_flags, kFlagBitOpenComplete)) {
-    if (!__CFBitIsSet(ctxt->_flags, kFlagBitHasHandshakes) && __CFBitIsSet(ctxt->_flags, kFlagBitIsBuffered)) {
-      CFStreamError error = ctxt->_error;
+    if (!__CFBitIsSet(ctxt->_flags, test + kFlagBitPollOpen) && ((CFArrayGetCount(ctxt->_sharedloops) + CFArrayGetCount(loops)) > 2)) {
+      __CFBitSet(ctxt->_flags, test + kFlagBitPollOpen);
+    }
 
-      /* Similar to the end of _SocketStreamRead. */
-      CFDataRef c         = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
-      Boolean   buffered  = (c && *((CFIndex*)CFDataGetBytePtr(c)));
+    else {
+      CFTypeRef loopAndMode[2] = {CFRunLoopGetCurrent(), mode};
 
-      if (buffered)
-        memset(&error, 0, sizeof(error));
+      /* Add the current loop and the private mode to the list */
+      _SchedulesAddRunLoopAndMode(loops, (CFRunLoopRef)loopAndMode[0], (CFStringRef)loopAndMode[1]);
 
-      /* Need to check for buffered bytes or EOF. */
-      if (__CFBitIsSet(ctxt->_flags, kFlagBitClosed) || buffered) {
-        if (ctxt->_clientReadStream && __CFBitIsSet(ctxt->_flags, kFlagBitReadStreamOpened))
-          _CFReadStreamSignalEventDelayed(ctxt->_clientReadStream, kCFStreamEventHasBytesAvailable, &error);
+      if (ctxt->_socket && (CFArrayGetCount(ctxt->_schedulables) == 1) && (ctxt->_socket == CFArrayGetValueAtIndex(ctxt->_schedulables, 0))) {
+        CFRunLoopSourceRef src = CFSocketCreateRunLoopSource(CFGetAllocator(ctxt->_schedulables), ctxt->_socket, 0);
+        if (src) {
+          CFRunLoopAddSource((CFRunLoopRef)loopAndMode[0], src, (CFStringRef)loopAndMode[1]);
+          CFRelease(src);
+        }
       }
-#if defined(__MACH__)
-      /* If none there, check to see if there are encrypted bytes that are buffered. */
-      else if (__CFBitIsSet(ctxt->_flags, kFlagBitUseSSL)) {
 
-        _SocketStreamSecurityBufferedRead_NoLock(ctxt);
+      else {
+        /* Make sure to schedule all the schedulables on this loop and mode. */
+        CFArrayApplyFunction(ctxt->_schedulables, CFRangeMake(0, CFArrayGetCount(ctxt->_schedulables)),
+                             (CFArrayApplierFunction)_SchedulablesScheduleApplierFunction, loopAndMode);
+      }
 
-        if (__CFBitIsSet(ctxt->_flags, kFlagBitCanRead) || __CFBitIsSet(ctxt->_flags, kFlagBitClosed)) {
-          if (ctxt->_clientReadStream && __CFBitIsSet(ctxt->_flags, kFlagBitReadStreamOpened)) {
-            if (c && *((CFIndex*)CFDataGetBytePtr(c)))
-              memset(&error, 0, sizeof(error));
+      /* Unlock the context to allow things to fire */
+      __CFSpinUnlock(&ctxt->_lock);
 
-            _CFReadStreamSignalEventDelayed(ctxt->_clientReadStream, kCFStreamEventHasBytesAvailable, &error);
-          }
+      /* Run the run loop for a poll (0.0) */
+      CFRunLoopRunInMode(mode, 0.0, FALSE);
+
+      /* Lock the context back up. */
+      __CFSpinLock(&ctxt->_lock);
+
+      if (ctxt->_socket && (CFArrayGetCount(ctxt->_schedulables) == 1) && (ctxt->_socket == CFArrayGetValueAtIndex(ctxt->_schedulables, 0))) {
+        CFRunLoopSourceRef src = CFSocketCreateRunLoopSource(CFGetAllocator(ctxt->_schedulables), ctxt->_socket, 0);
+        if (src) {
+          CFRunLoopRemoveSource((CFRunLoopRef)loopAndMode[0], src, (CFStringRef)loopAndMode[1]);
+          CFRelease(src);
         }
       }
-#endif
-    }
 
-    CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack | kCFSocketWriteCallBack);
+      else {
+        /* Make sure to unschedule all the schedulables on this loop and mode. */
+        CFArrayApplyFunction(ctxt->_schedulables, CFRangeMake(0, CFArrayGetCount(ctxt->_schedulables)),
+                             (CFArrayApplierFunction)_SchedulablesUnscheduleApplierFunction, loopAndMode);
+      }
+
+      /* Remove this loop and private mode from the list. */
+      _SchedulesRemoveRunLoopAndMode(loops, (CFRunLoopRef)loopAndMode[0], (CFStringRef)loopAndMode[1]);
+
+      result = __CFBitIsSet(ctxt->_flags, test);
+    }
   }
-}
 
-/* static */ void _SocketStreamAttemptAutoVPN_NoLock(_CFSocketStreamContext* ctxt, CFStringRef name)
-{
-  if (!__CFBitIsSet(ctxt->_flags, kFlagBitTriedVPN)) {
-    CFTypeRef         values[2] = {name, NULL};
-    const CFStringRef keys[2]   = {_kCFStreamAutoHostName, _kCFStreamPropertyAutoConnectPriority};
-    CFAllocatorRef    alloc     = CFGetAllocator(ctxt->_properties);
-    CFDictionaryRef   options;
+  /* If there was an error, make sure to signal it. */
+  if (ctxt->_error.error) {
+    /* Attempt to get the count of buffered bytes. */
+    CFDataRef c = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
 
-    /* Grab the intended value.  If none, give if "default." */
-    values[1] = (CFStringRef)CFDictionaryGetValue(ctxt->_properties, keys[1]);
-    if (!values[1])
-      values[1] = _kCFStreamAutoVPNPriorityDefault;
+    /* Copy the error. */
+    memmove(error, &ctxt->_error, sizeof(error[0]));
 
-    /* Create the dictionary of options for SC. */
-    options = CFDictionaryCreate(alloc, (const void**)keys, (const void**)values, sizeof(values) / sizeof(values[0]), &kCFTypeDictionaryKeyCallBacks,
-                                 &kCFTypeDictionaryValueCallBacks);
+    /* It's set now. */
+    __CFBitSet(ctxt->_flags, test);
 
-    /* Mark the attempt, so another is not made. */
-    __CFBitSet(ctxt->_flags, kFlagBitTriedVPN);
+    result = TRUE;
 
-    /* No options = no memory. */
-    if (!options) {
-      ctxt->_error.error  = ENOMEM;
-      ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+    /*
+    ** 2998408 Force async callback for errors so there is no worry about the
+    ** context going bad underneath callers of this function.
+    */
+
+    /*
+    ** 3863115 If there is a client stream and it's been opened, signal the
+    ** error, but only if there are no bytes in the buffer.
+    */
+    if ((!c || !*((CFIndex*)CFDataGetBytePtr(c))) && (ctxt->_clientReadStream && __CFBitIsSet(ctxt->_flags, kFlagBitReadStreamOpened))) {
+      _CFReadStreamSignalEventDelayed(ctxt->_clientReadStream, kCFStreamEventErrorOccurred, error);
     }
-#if defined(__MACH__)
-    else {
-      CFStringRef     service_id   = NULL;
-      CFDictionaryRef user_options = NULL;
 
-      /* Create the service id and settings. */
-      if (SCNetworkConnectionCopyUserPreferences(options, &service_id, &user_options)) {
-        SCNetworkConnectionContext c = {0, ctxt, NULL, NULL, NULL};
+    /* If there is a client stream and it's been opened, signal the error. */
+    if (ctxt->_clientWriteStream && __CFBitIsSet(ctxt->_flags, kFlagBitWriteStreamOpened))
+      _CFWriteStreamSignalEventDelayed(ctxt->_clientWriteStream, kCFStreamEventErrorOccurred, error);
+  }
 
-        /* Create the connection for auto connect. */
-        SCNetworkConnectionRef conn =
-            SCNetworkConnectionCreateWithServiceID(alloc, service_id, (SCNetworkConnectionCallBack)_NetworkConnectionCallBack, &c);
+  /* Unlock */
+  __CFSpinUnlock(&ctxt->_lock);
 
-        /* Did it create? */
-        if (conn) {
-          int        i;
-          CFArrayRef loops[3] = {ctxt->_readloops, ctxt->_writeloops, ctxt->_sharedloops};
+  return result;
+}
 
-          /* Now schedule the connection on all loops and modes */
-          for (i = 0; i < (sizeof(loops) / sizeof(loops[0])); i++)
-            _CFTypeScheduleOnMultipleRunLoops(conn, loops[i]);
+#if defined(__MACH__)
+/* static */ void _SocketStreamAddReachability_NoLock(_CFSocketStreamContext* ctxt)
+{
+  SCNetworkReachabilityRef reachability = (SCNetworkReachabilityRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyNetworkReachability);
 
-          if (SCNetworkConnectionStart(conn, user_options, TRUE)) {
-            memset(&ctxt->_error, 0, sizeof(ctxt->_error));
+  /* There has to be an open socket and no reachibility item already. */
+  if (ctxt->_socket && __CFBitIsSet(ctxt->_flags, kFlagBitOpenComplete) && !reachability) {
+    /* Copy the addresses for the pipe. */
+    CFDataRef localAddr = CFSocketCopyAddress(ctxt->_socket);
+    CFDataRef peerAddr  = CFSocketCopyPeerAddress(ctxt->_socket);
 
-            /* Succeeded so make sure the connection is in the list of schedulables for future. */
-            _SchedulablesAdd(ctxt->_schedulables, conn);
-          }
+    if (localAddr && peerAddr) {
+      /* Create the reachability object to watch the route. */
+      SCNetworkReachabilityRef reachability = SCNetworkReachabilityCreateWithAddressPair(
+          CFGetAllocator(ctxt->_properties), (const struct sockaddr*)CFDataGetBytePtr(localAddr), (const struct sockaddr*)CFDataGetBytePtr(peerAddr));
 
-          else {
-            /* Remove the connection from all the schedules. */
-            for (i = 0; i < (sizeof(loops) / sizeof(loops[0])); i++)
-              _CFTypeUnscheduleFromMultipleRunLoops(conn, loops[i]);
+      if (reachability) {
+        int                          i;
+        SCNetworkReachabilityContext c        = {0, ctxt, NULL, NULL, NULL};
+        CFArrayRef                   loops[3] = {ctxt->_readloops, ctxt->_writeloops, ctxt->_sharedloops};
 
-            /* Invalidate the connection; never to be used again. */
-            _CFTypeInvalidate(conn);
-          }
-        }
+        /* Add it to the properties. */
+        CFDictionaryAddValue(ctxt->_properties, _kCFStreamPropertyNetworkReachability, reachability);
 
-        /* Clean up. */
-        if (conn)
-          CFRelease(conn);
-      }
+        /* Set the callback */
+        SCNetworkReachabilitySetCallback(reachability, (SCNetworkReachabilityCallBack)_ReachabilityCallBack, &c);
 
-      /* Clean up. */
-      CFRelease(options);
-      if (service_id)
-        CFRelease(service_id);
-      if (user_options)
-        CFRelease(user_options);
+        /* Schedule it on all the loops and modes. */
+        for (i = 0; i < (sizeof(loops) / sizeof(loops[0])); i++)
+          _CFTypeScheduleOnMultipleRunLoops(reachability, loops[i]);
+
+        /* Add it to the schedulables. */
+        _SchedulablesAdd(ctxt->_schedulables, reachability);
+
+        /* Schedulables and properties hold it now. */
+        CFRelease(reachability);
+      }
     }
-#endif
+
+    /* Don't need these anymore. */
+    if (localAddr)
+      CFRelease(localAddr);
+    if (peerAddr)
+      CFRelease(peerAddr);
   }
 }
 
-/* static */ void _SocketStreamPerformCancel(void* info) { (void)info; /* unused */ }
+/* static */ void _SocketStreamRemoveReachability_NoLock(_CFSocketStreamContext* ctxt)
+{
+  /* Find out if there is a reachability already. */
+  SCNetworkReachabilityRef reachability = (SCNetworkReachabilityRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyNetworkReachability);
 
-#pragma mark - * SOCKS Support
+  if (reachability) {
+    int        i;
+    CFArrayRef loops[3] = {ctxt->_readloops, ctxt->_writeloops, ctxt->_sharedloops};
 
-#define kSOCKSv4BufferMaximum ((CFIndex)(8L))
-#define kSOCKSv5BufferMaximum ((CFIndex)(2L))
+    /* Invalidate the reachability; never to be used again. */
+    _CFTypeInvalidate(reachability);
 
-/* static */ void _PerformSOCKSv5Handshake_NoLock(_CFSocketStreamContext* ctxt)
-{
-  do {
-    /* Get the buffer of stuff to send */
-    CFMutableDataRef to_send = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
-    CFMutableDataRef to_recv = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
+    /* Unschedule it from all the loops and modes. */
+    for (i = 0; i < (sizeof(loops) / sizeof(loops[0])); i++)
+      _CFTypeUnscheduleFromMultipleRunLoops(reachability, loops[i]);
 
-    if (!to_recv) {
-      CFStreamError error = {0, 0};
-      CFIndex       length, sent;
+    /* Remove the socket from the schedulables. */
+    _SchedulablesRemove(ctxt->_schedulables, reachability);
 
-      if (!to_send) {
-        UInt8* ptr;
+    /* Remove it from the properties */
+    CFDictionaryRemoveValue(ctxt->_properties, reachability);
+  }
+}
+#endif
 
-        /* Get the user/pass to determine how many methods are supported. */
-        CFDictionaryRef proxy = (CFDictionaryRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySOCKSProxy);
-        CFStringRef     user  = (CFStringRef)CFDictionaryGetValue(proxy, kCFStreamPropertySOCKSUser);
-        CFStringRef     pass  = (CFStringRef)CFDictionaryGetValue(proxy, kCFStreamPropertySOCKSPassword);
+/* static */ _CFSocketStreamRecvRing* _SocketStreamGetRecvRing_NoLock(_CFSocketStreamContext* ctxt)
+{
+  _CFSocketStreamRecvRing* ring;
 
-        /* Create the 4 byte buffer for the intial connect. */
-        to_send               = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), 4);
+  /* Get the bits required in order to work with the buffer. */
+  CFMutableDataRef buffer = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBuffer);
+  CFMutableDataRef count  = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
 
-        /* Couldn't create so error out on no memory. */
-        if (!to_send) {
-          ctxt->_error.error  = ENOMEM;
-          ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
-          break;
-        }
+  /* No buffer assumes all are missing. */
+  if (!buffer) {
+    CFAllocatorRef alloc    = CFGetAllocator(ctxt->_properties);
+    CFIndex        s        = kRecvBufferSize;
+    CFIndex        max      = kRecvBufferMaxSize;
+    CFIndex        capacity = 1024;
 
-        /* Make sure to save the buffer for later. */
-        CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer, to_send);
-        CFRelease(to_send);
+    /* If no size, assume a default.  Can be overridden by properties. */
+    CFNumberRef size  = (CFNumberRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferSize);
+    CFNumberRef limit = (CFNumberRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferMaxSize);
 
-        /* Get the local pointer to set the values. */
-        ptr = CFDataGetMutableBytePtr(to_send);
-        CFDataSetLength(to_send, 4);
+    if (size)
+      CFNumberGetValue(size, kCFNumberCFIndexType, &s);
+    if (limit)
+      CFNumberGetValue(limit, kCFNumberCFIndexType, &max);
 
-        /* By default, perform only 1 method (no authentication). */
-        ptr[0] = 0x05;
-        ptr[1] = 0x01;
-        ptr[2] = 0x00;
-        ptr[3] = 0x02;
+    /* Offsets wrap with a mask, so round up to a power of two. */
+    while (capacity < s)
+      capacity <<= 1;
 
-        /* If there is a valid user and pass, indicate willing to do two methods. */
-        if (user && CFStringGetLength(user) && pass && CFStringGetLength(pass))
-          ptr[1] = 0x02;
-        else
-          CFDataSetLength(to_send, 3);
-      }
+    /* Create the backing for the buffer and the ring state. */
+    buffer = CFDataCreateMutable(alloc, 0);
+    count  = CFDataCreateMutable(alloc, sizeof(ring[0]));
 
-      /* Try sending out the bytes. */
-      length = CFDataGetLength(to_send);
-      sent   = _CFSocketSend(ctxt->_socket, CFDataGetBytePtr(to_send), length, &error);
+    /* If anything failed, set out of memory and bail. */
+    if (!buffer || !count) {
+      if (buffer)
+        CFRelease(buffer);
+      if (count)
+        CFRelease(count);
 
-      /* If sent everything, dump the buffer. */
-      if (sent == length) {
-        CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
+      ctxt->_error.error  = ENOMEM;
+      ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
 
-        /* Create the buffer for receive. */
-        to_recv = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), 2);
+      return NULL; /* NOTE the early return. */
+    }
 
-        /* Fail so error on no memory. */
-        if (!to_recv) {
-          ctxt->_error.error  = ENOMEM;
-          ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
-          break;
-        }
+    CFDataSetLength(buffer, capacity);
+    CFDataSetLength(count, sizeof(ring[0]));
 
-        /* Make sure to save the buffer for later. */
-        CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer, to_recv);
-        CFRelease(to_recv);
-      }
+    /* Start with an empty ring. */
+    ring            = (_CFSocketStreamRecvRing*)CFDataGetMutableBytePtr(count);
+    ring->_count    = 0;
+    ring->_head     = 0;
+    ring->_lent     = 0;
+    ring->_capacity = capacity;
+    ring->_limit    = (max > capacity) ? max : capacity;
 
-      /* If couldn't send everything, trim the buffer. */
-      else if (sent > 0) {
-        UInt8* ptr = CFDataGetMutableBytePtr(to_send);
+    /* Save the buffer information. */
+    CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertyRecvBuffer, buffer);
+    CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount, count);
 
-        /* New length */
-        length -= sent;
+    CFRelease(buffer);
+    CFRelease(count);
+  }
 
-        /* Move the bytes down in the buffer. */
-        memmove(ptr, ptr + sent, length);
+  return (_CFSocketStreamRecvRing*)CFDataGetMutableBytePtr(count);
+}
 
-        /* Trim it. */
-        CFDataSetLength(to_send, length);
+/* static */ int _SocketStreamRecvRingGetSpace_NoLock(_CFSocketStreamContext* ctxt, _CFSocketStreamRecvRing* ring, struct iovec iov[2])
+{
+  /*
+  ** Fills in the free regions of the ring (at most two, if the free space
+  ** wraps) and returns how many there are.  A full ring doubles in place
+  ** as long as it's under its limit and nothing is lent out.
+  */
+  CFMutableDataRef buffer = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBuffer);
+  UInt8*           ptr    = CFDataGetMutableBytePtr(buffer);
+  CFIndex          tail, space;
 
-        /* Re-enable so the rest can be written later. */
-        CFSocketEnableCallBacks(ctxt->_socket, kCFSocketWriteCallBack);
-      }
+  if ((ring->_count == ring->_capacity) && !ring->_lent && (ring->_capacity < ring->_limit)) {
+    CFDataSetLength(buffer, ring->_capacity * 2);
+    ptr = CFDataGetMutableBytePtr(buffer);
 
-      /* If got an error other than EAGAIN, set the error in the context. */
-      else if ((error.error != EAGAIN) || (error.domain != kCFStreamErrorDomainPOSIX))
-        memmove(&ctxt->_error, &error, sizeof(error));
-    }
+    /* The bytes which had wrapped to the front now follow the old end. */
+    memmove(ptr + ring->_capacity, ptr, ring->_head);
 
-    else {
-      UInt8*  ptr    = CFDataGetMutableBytePtr(to_recv);
-      CFIndex length = CFDataGetLength(to_recv);
+    ring->_capacity *= 2;
+  }
 
-      if (length != kSOCKSv5BufferMaximum) {
-        CFStreamError error = {0, 0};
-        CFIndex       recvd = _CFSocketRecv(ctxt->_socket, ptr + length, kSOCKSv5BufferMaximum - length, &error);
+  tail  = (ring->_head + ring->_count) & (ring->_capacity - 1);
+  space = ring->_capacity - ring->_count - ring->_lent;
 
-        /* If read 0 bytes, this is an early close from the other side. */
-        if (recvd == 0) {
-          /* Mark as not connected. */
-          ctxt->_error.error  = ENOTCONN;
-          ctxt->_error.domain = _kCFStreamErrorDomainNativeSockets;
-        }
+  if (!space)
+    return 0;
 
-        /* Successfully read? */
-        else if (recvd > 0) {
-          UInt8 tmp[kSOCKSv5BufferMaximum];
+  iov[0].iov_base = ptr + tail;
+  iov[0].iov_len  = ((ring->_capacity - tail) < space) ? (ring->_capacity - tail) : space;
 
-          /* Set the length of the buffer. */
-          length += recvd;
+  if (iov[0].iov_len == space)
+    return 1;
 
-          /* CF is so kind as to zero the bytes on SetLength, even though it's a fixed capacity. */
-          memmove(tmp, ptr, length);
+  iov[1].iov_base = ptr;
+  iov[1].iov_len  = space - iov[0].iov_len;
 
-          /* Set the length of the buffer. */
-          CFDataSetLength(to_recv, length);
+  return 2;
+}
 
-          /* Put the bytes back. */
-          memmove(ptr, tmp, length);
+/* static */ void _RecvRingRelease(_CFSocketStreamRecvRing* ring)
+{
+  /* Whatever was handed out by GetBuffer is free again. */
+  ring->_lent = 0;
 
-          /* Re-enable after performing a successful read. */
-          CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
-        }
+  /* Start back at the front while empty, so bytes tend to stay contiguous. */
+  if (!ring->_count)
+    ring->_head = 0;
+}
 
-        /* If got an error other than EAGAIN, set the error in the context. */
-        else if ((error.error != EAGAIN) || (error.domain != kCFStreamErrorDomainPOSIX))
-          memmove(&ctxt->_error, &error, sizeof(error));
-      }
+/* static */ CFIndex _SocketStreamBufferedRead_NoLock(_CFSocketStreamContext* ctxt, UInt8* buffer, CFIndex length)
+{
+  CFIndex result     = 0;
 
-      /* Is there enough now? */
-      if (length == kSOCKSv5BufferMaximum) {
-        switch (ptr[1]) {
-          case 0x00:
-            /* Don't need to do anything for "No Authentication Required." */
-            CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
-            _SocketStreamAddHandshake_NoLock(ctxt, _PerformSOCKSv5PostambleHandshake_NoLock);
-            _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv5Handshake_NoLock);
-            break;
+  /* Different bits required for "buffered reading." */
+  CFMutableDataRef b = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBuffer);
+  CFMutableDataRef c = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
 
-            /* **FIXME** Add GSS API support (0x01) */
+#if defined(__MACH__) || defined(HAVE_OPENSSL)
+  /* With nothing decrypted ahead and room for a whole record, SSL can decrypt straight into the client's buffer. */
+  if (b && c && __CFBitIsSet(ctxt->_flags, kFlagBitUseSSL) && !((_CFSocketStreamRecvRing*)CFDataGetMutableBytePtr(c))->_count &&
+      (length >= kSecurityDirectReadSize)) {
+    _RecvRingRelease((_CFSocketStreamRecvRing*)CFDataGetMutableBytePtr(c));
 
-          case 0x02: {
-            CFDictionaryRef proxy = (CFDictionaryRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySOCKSProxy);
-            CFStringRef     user  = (CFStringRef)CFDictionaryGetValue(proxy, kCFStreamPropertySOCKSUser);
-            CFStringRef     pass  = (CFStringRef)CFDictionaryGetValue(proxy, kCFStreamPropertySOCKSPassword);
+    result = _SocketStreamSecurityDirectRead_NoLock(ctxt, buffer, length);
 
-            CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
+    /* If the client's buffer filled, there may be more; decrypt it ahead as usual so it gets signalled. */
+    if (result == length)
+      _SocketStreamSecurityBufferedRead_NoLock(ctxt);
+  }
 
-            if (user && pass) {
-              _SocketStreamAddHandshake_NoLock(ctxt, _PerformSOCKSv5UserPassHandshake_NoLock);
-              _SocketStreamAddHandshake_NoLock(ctxt, _PerformSOCKSv5PostambleHandshake_NoLock);
-              _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv5Handshake_NoLock);
-            }
+  else
+#endif
+  /* All have to be availbe to read. */
+  if (b && c) {
+    _CFSocketStreamRecvRing* ring = (_CFSocketStreamRecvRing*)CFDataGetMutableBytePtr(c);
+    UInt8*                   ptr  = (UInt8*)CFDataGetMutableBytePtr(b);
+    CFIndex                  first;
 
-            else {
-              ctxt->_error.domain = kCFStreamErrorDomainSOCKS;
-              ctxt->_error.error  = ((kCFStreamErrorSOCKS5SubDomainMethod << 16) | (ptr[1] & 0x000000FF));
-            }
+    _RecvRingRelease(ring);
 
-            break;
-          }
+    /* Either read all the bytes or just what the client asked. */
+    result = (ring->_count < length) ? ring->_count : length;
 
-            /* **FIXME** Add CHAP support (0x03) */
+    /* Copy the bytes into the client buffer, in two pieces if they wrap. */
+    first  = ((ring->_capacity - ring->_head) < result) ? (ring->_capacity - ring->_head) : result;
+    memmove(buffer, ptr + ring->_head, first);
+    memmove(buffer + first, ptr, result - first);
 
-          default:
-            ctxt->_error.domain = kCFStreamErrorDomainSOCKS;
-            ctxt->_error.error  = ((kCFStreamErrorSOCKS5SubDomainMethod << 16) | (ptr[1] & 0x000000FF));
-            break;
-        }
-      }
+    ring->_head   = (ring->_head + result) & (ring->_capacity - 1);
+    ring->_count -= result;
+
+    _RecvRingRelease(ring);
+
+#if defined(__MACH__) || defined(HAVE_OPENSSL)
+    /* If the local buffer is empty, pump SSL along. */
+    if (__CFBitIsSet(ctxt->_flags, kFlagBitUseSSL) && (ring->_count == 0)) {
+      _SocketStreamSecurityBufferedRead_NoLock(ctxt);
     }
-  } while (0);
+#endif
+  }
 
-  /* If there was an error remove the handshake. */
-  if (ctxt->_error.error)
-    _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv5Handshake_NoLock);
+  /* If no bytes read and the pipe isn't closed, constitute an EAGAIN */
+  if (!result) {
+    if (!ctxt->_error.error && !__CFBitIsSet(ctxt->_flags, kFlagBitClosed)) {
+      ctxt->_error.error  = EAGAIN;
+      ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+    }
+  } else if (__CFBitIsSet(ctxt->_flags, kFlagBitRecvdRead)) {
+    __CFBitClear(ctxt->_flags, kFlagBitRecvdRead);
+    if (ctxt->_socket)
+      CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
+  }
+
+  return result;
 }
 
-/* static */ void _PerformSOCKSv5PostambleHandshake_NoLock(_CFSocketStreamContext* ctxt)
+/* static */ const UInt8* _SocketStreamBufferedGetBuffer_NoLock(_CFSocketStreamContext* ctxt, CFIndex length, CFIndex* bytesRead)
 {
-  do {
-    /* Get the buffer of stuff to send */
-    CFMutableDataRef to_send = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
-    CFMutableDataRef to_recv = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
-
-    if (!to_recv) {
-      CFStreamError error = {0, 0};
-      CFIndex       length, sent;
+  const UInt8* result = NULL;
 
-      if (!to_send) {
-        UInt8*         ptr;
-        SInt32         value = 0;
-        unsigned short prt;
+  CFMutableDataRef b  = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBuffer);
+  CFMutableDataRef c  = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
 
-        /* Try to get the name for sending in the CONNECT request. */
-        CFHostRef   host = (CFHostRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteHost);
-        CFNumberRef port = (CFNumberRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRemotePort);
-        CFArrayRef  list = CFHostGetNames(host, NULL);
-        CFStringRef name = (list && CFArrayGetCount(list)) ? (CFStringRef)CFArrayGetValueAtIndex(list, 0) : NULL;
+  *bytesRead = 0;
 
-        if (name)
-          CFRetain(name);
-        else {
-          /* Is there one good address to create a name? */
-          list = CFHostGetAddressing(host, NULL);
-          if (list && CFArrayGetCount(list)) {
-            name = _CFNetworkCFStringCreateWithCFDataAddress(CFGetAllocator(list), (CFDataRef)CFArrayGetValueAtIndex(list, 0));
-          }
+  if (b && c) {
+    _CFSocketStreamRecvRing* ring = (_CFSocketStreamRecvRing*)CFDataGetMutableBytePtr(c);
 
-          /* Couldn't create so error out on no memory. */
-          if (!name) {
-            ctxt->_error.error  = ENOMEM;
-            ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
-            break;
-          }
-        }
+    _RecvRingRelease(ring);
 
-        /* Create the buffer for the largest possible CONNECT request. */
-        to_send = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), 262);
+    if (ring->_count) {
+      /* Only the run up to the end of the buffer can be handed out. */
+      *bytesRead = ring->_capacity - ring->_head;
+      if (ring->_count < *bytesRead)
+        *bytesRead = ring->_count;
+      if ((length > 0) && (length < *bytesRead))
+        *bytesRead = length;
 
-        /* Couldn't create so error out on no memory. */
-        if (!to_send) {
-          ctxt->_error.error  = ENOMEM;
-          ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
-          break;
-        }
+      result = CFDataGetBytePtr(b) + ring->_head;
 
-        /* Extend it all the way out for now; shorten later. */
-        CFDataSetLength(to_send, 262);
+      /* Keep the bytes off limits for filling until the next read. */
+      ring->_head   = (ring->_head + *bytesRead) & (ring->_capacity - 1);
+      ring->_count -= *bytesRead;
+      ring->_lent   = *bytesRead;
 
-        /* Get the local pointer to set the values. */
-        ptr = CFDataGetMutableBytePtr(to_send);
+#if defined(__MACH__) || defined(HAVE_OPENSSL)
+      /* If the local buffer is empty, pump SSL along. */
+      if (__CFBitIsSet(ctxt->_flags, kFlagBitUseSSL) && (ring->_count == 0)) {
+        _SocketStreamSecurityBufferedRead_NoLock(ctxt);
+      }
+#endif
 
-        /* Make sure to save the buffer for later. */
-        CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer, to_send);
-        CFRelease(to_send);
+      if (__CFBitIsSet(ctxt->_flags, kFlagBitRecvdRead)) {
+        __CFBitClear(ctxt->_flags, kFlagBitRecvdRead);
+        if (ctxt->_socket)
+          CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
+      }
+    }
+  }
 
-        /* Place the name into the buffer. */
-        CFStringGetPascalString(name, &(ptr[4]), 256, kCFStringEncodingUTF8);
-        CFRelease(name);
+  return result;
+}
 
-        /* Place the header bytes. */
-        ptr[0] = 0x05;
-        ptr[1] = 0x01;
-        ptr[2] = 0x00;
-        ptr[3] = 0x03;
+/* static */ void _SocketStreamBufferedSocketRead_NoLock(_CFSocketStreamContext* ctxt)
+{
+  struct iovec             iov[2];
+  int                      iovcnt;
+  _CFSocketStreamRecvRing* ring = _SocketStreamGetRecvRing_NoLock(ctxt);
 
-        /* Get the port value to lay down. */
-        CFNumberGetValue(port, kCFNumberSInt32Type, &value);
+  /* Failure to create the ring already set the error. */
+  if (!ring)
+    return;
 
-        /* Lay down the port. */
-        prt                                    = htons(value & 0x0000FFFF);
-        *((unsigned short*)(&ptr[ptr[4] + 5])) = prt;
+  iovcnt = _SocketStreamRecvRingGetSpace_NoLock(ctxt, ring, iov);
 
-        /* Trim down the buffer to the correct size. */
-        CFDataSetLength(to_send, 7 + ptr[4]);
-      }
+  /* Only read if there is room in the buffer. */
+  if (iovcnt) {
+    CFIndex bytesRead;
 
-      /* Try sending out the bytes. */
-      length = CFDataGetLength(to_send);
-      sent   = _CFSocketSend(ctxt->_socket, CFDataGetBytePtr(to_send), length, &error);
+#if defined(HAVE_OPENSSL) && defined(__linux__)
+    /* The kernel hands back records other than data separately. */
+    if (__CFBitIsSet(ctxt->_flags, kFlagBitKernelTLS))
+      bytesRead = _SocketStreamKernelTLSRecv_NoLock(ctxt, iov, iovcnt);
+    else
+#endif
+      bytesRead = _CFSocketRecvVector(ctxt->_socket, iov, iovcnt, &ctxt->_error);
 
-      /* If sent everything, dump the buffer. */
-      if (sent == length) {
-        CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
+    __CFBitClear(ctxt->_flags, kFlagBitRecvdRead);
 
-        /* Create the buffer for receive. */
-        to_recv = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), 262);
+    /* If did read bytes, increase the count. */
+    if (bytesRead > 0) {
+      ring->_count += bytesRead;
+      CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
+      __CFBitSet(ctxt->_flags, kFlagBitCanRead);
+      __CFBitClear(ctxt->_flags, kFlagBitPollRead);
+    }
 
-        /* Fail so error on no memory. */
+    else if (bytesRead == 0) {
+      __CFBitSet(ctxt->_flags, kFlagBitClosed);
+      __CFBitSet(ctxt->_flags, kFlagBitCanRead);
+      __CFBitClear(ctxt->_flags, kFlagBitPollRead);
+    }
+  } else
+    __CFBitSet(ctxt->_flags, kFlagBitRecvdRead);
+}
+
+/* static */ CFComparisonResult _OrderHandshakes(_CFSocketStreamPerformHandshakeCallBack fn1,
+                                                 _CFSocketStreamPerformHandshakeCallBack fn2,
+                                                 void*                                   context)
+{
+  if (!fn1)
+    return kCFCompareGreaterThan;
+  if (!fn2)
+    return kCFCompareLessThan;
+
+  /*
+  ** Order of handshakes in increasing priority:
+  **
+  ** 1) SOCKSv5 \__ Conceivably should not be set at the same time.
+  ** 2) SOCKSv4 /
+  ** 3) SOCKSv5 user/pass negotiation
+  ** 3) SOCKSv5 postamble
+  ** 4) CONNECT halt <- Used to halt the stream for another CONNECT
+  ** 5) CONNECT
+  ** 6) SSL send <- could be required for #4
+  ** 7) SSL
+  */
+
+  if (*fn1 == _PerformSOCKSv5Handshake_NoLock)
+    return kCFCompareLessThan;
+  if (*fn2 == _PerformSOCKSv5Handshake_NoLock)
+    return kCFCompareGreaterThan;
+
+  if (*fn1 == _PerformSOCKSv5UserPassHandshake_NoLock)
+    return kCFCompareLessThan;
+  if (*fn2 == _PerformSOCKSv5UserPassHandshake_NoLock)
+    return kCFCompareGreaterThan;
+
+  if (*fn1 == _PerformSOCKSv5PostambleHandshake_NoLock)
+    return kCFCompareLessThan;
+  if (*fn2 == _PerformSOCKSv5PostambleHandshake_NoLock)
+    return kCFCompareGreaterThan;
+
+  if (*fn1 == _PerformSOCKSv4Handshake_NoLock)
+    return kCFCompareLessThan;
+  if (*fn2 == _PerformSOCKSv4Handshake_NoLock)
+    return kCFCompareGreaterThan;
+
+  if (*fn1 == _PerformCONNECTHaltHandshake_NoLock)
+    return kCFCompareLessThan;
+  if (*fn2 == _PerformCONNECTHaltHandshake_NoLock)
+    return kCFCompareGreaterThan;
+
+  if (*fn1 == _PerformCONNECTHandshake_NoLock)
+    return kCFCompareLessThan;
+  if (*fn2 == _PerformCONNECTHandshake_NoLock)
+    return kCFCompareGreaterThan;
+
+#if defined(__MACH__) || defined(HAVE_OPENSSL)
+  if (*fn1 == _PerformSecuritySendHandshake_NoLock)
+    return kCFCompareLessThan;
+  if (*fn2 == _PerformSecuritySendHandshake_NoLock)
+    return kCFCompareGreaterThan;
+
+  if (*fn1 == _PerformSecurityHandshake_NoLock)
+    return kCFCompareLessThan;
+  if (*fn2 == _PerformSecurityHandshake_NoLock)
+    return kCFCompareGreaterThan;
+#endif
+
+  return kCFCompareEqualTo;
+}
+
+/* static */ Boolean _SocketStreamAddHandshake_NoLock(_CFSocketStreamContext* ctxt, _CFSocketStreamPerformHandshakeCallBack fn)
+{
+  CFIndex i;
+
+  /* Get the existing list of handshakes. */
+  CFMutableArrayRef handshakes = (CFMutableArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyHandshakes);
+
+  /* If there is no list, need to create one. */
+  if (!handshakes) {
+    CFArrayCallBacks cb = {0, NULL, NULL, NULL, NULL};
+
+    /* Create the list of handshakes. */
+    handshakes          = CFArrayCreateMutable(CFGetAllocator(ctxt->_properties), 0, &cb);
+
+    if (!handshakes)
+      return FALSE;
+
+    /* Add the list to the properties for later work. */
+    CFDictionaryAddValue(ctxt->_properties, _kCFStreamPropertyHandshakes, handshakes);
+    __CFBitSet(ctxt->_flags, kFlagBitHasHandshakes);
+
+    CFRelease(handshakes);
+  }
+
+  /* Find out if the handshake is in the list already. */
+  i = CFArrayGetFirstIndexOfValue(handshakes, CFRangeMake(0, CFArrayGetCount(handshakes)), fn);
+
+  /* Need to add it? */
+  if (i == kCFNotFound) {
+    CFRange r;
+
+    /* Add the new handshake to the list. */
+    CFArrayAppendValue(handshakes, fn);
+
+    r = CFRangeMake(0, CFArrayGetCount(handshakes));
+
+    /* Make sure to order the list of handshakes correctly */
+    CFArraySortValues(handshakes, r, (CFComparatorFunction)_OrderHandshakes, NULL);
+
+    /* Update the location. */
+    i = CFArrayGetFirstIndexOfValue(handshakes, r, fn);
+  }
+
+  if (!i) {
+    __CFBitClear(ctxt->_flags, kFlagBitCanRead);
+    __CFBitClear(ctxt->_flags, kFlagBitCanWrite);
+
+    __CFBitClear(ctxt->_flags, kFlagBitRecvdRead);
+
+    /* Make sure all callbacks are set up for handshaking. */
+    if (ctxt->_socket && __CFBitIsSet(ctxt->_flags, kFlagBitOpenComplete))
+      CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack | kCFSocketWriteCallBack);
+  }
+
+  return TRUE;
+}
+
+/* static */ void _SocketStreamRemoveHandshake_NoLock(_CFSocketStreamContext* ctxt, _CFSocketStreamPerformHandshakeCallBack fn)
+{
+  /* Get the existing list of handshakes. */
+  CFMutableArrayRef handshakes = (CFMutableArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyHandshakes);
+
+  if (handshakes) {
+    /* Find out if the handshake is in the list. */
+    CFIndex i = CFArrayGetFirstIndexOfValue(handshakes, CFRangeMake(0, CFArrayGetCount(handshakes)), fn);
+
+    /* If it exists, need to remove it. */
+    if (i != kCFNotFound)
+      CFArrayRemoveValueAtIndex(handshakes, i);
+
+    if (!CFArrayGetCount(handshakes)) {
+      CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertyHandshakes);
+      __CFBitClear(ctxt->_flags, kFlagBitHasHandshakes);
+    }
+  }
+
+  /* Need to reset the flags as a result of a handshake removal. */
+  __CFBitClear(ctxt->_flags, kFlagBitCanRead);
+  __CFBitClear(ctxt->_flags, kFlagBitCanWrite);
+
+  __CFBitClear(ctxt->_flags, kFlagBitRecvdRead);
+
+  /* Make sure all callbacks are reset if open. */
+  if (ctxt->_socket && __CFBitIsSet(ctxt->_flags, kFlagBitOpenComplete)) {
+    if (!__CFBitIsSet(ctxt->_flags, kFlagBitHasHandshakes) && __CFBitIsSet(ctxt->_flags, kFlagBitIsBuffered)) {
+      CFStreamError error = ctxt->_error;
+
+      /* Similar to the end of _SocketStreamRead. */
+      CFDataRef c         = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
+      Boolean   buffered  = (c && *((CFIndex*)CFDataGetBytePtr(c)));
+
+      if (buffered)
+        memset(&error, 0, sizeof(error));
+
+      /* Need to check for buffered bytes or EOF. */
+      if (__CFBitIsSet(ctxt->_flags, kFlagBitClosed) || buffered) {
+        if (ctxt->_clientReadStream && __CFBitIsSet(ctxt->_flags, kFlagBitReadStreamOpened))
+          _CFReadStreamSignalEventDelayed(ctxt->_clientReadStream, kCFStreamEventHasBytesAvailable, &error);
+      }
+#if defined(__MACH__) || defined(HAVE_OPENSSL)
+      /* If none there, check to see if there are encrypted bytes that are buffered. */
+      else if (__CFBitIsSet(ctxt->_flags, kFlagBitUseSSL)) {
+
+        _SocketStreamSecurityBufferedRead_NoLock(ctxt);
+
+        if (__CFBitIsSet(ctxt->_flags, kFlagBitCanRead) || __CFBitIsSet(ctxt->_flags, kFlagBitClosed)) {
+          if (ctxt->_clientReadStream && __CFBitIsSet(ctxt->_flags, kFlagBitReadStreamOpened)) {
+            if (c && *((CFIndex*)CFDataGetBytePtr(c)))
+              memset(&error, 0, sizeof(error));
+
+            _CFReadStreamSignalEventDelayed(ctxt->_clientReadStream, kCFStreamEventHasBytesAvailable, &error);
+          }
+        }
+      }
+#endif
+    }
+
+    CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack | kCFSocketWriteCallBack);
+  }
+}
+
+/* static */ void _SocketStreamAttemptAutoVPN_NoLock(_CFSocketStreamContext* ctxt, CFStringRef name)
+{
+  if (!__CFBitIsSet(ctxt->_flags, kFlagBitTriedVPN)) {
+    CFTypeRef         values[2] = {name, NULL};
+    const CFStringRef keys[2]   = {_kCFStreamAutoHostName, _kCFStreamPropertyAutoConnectPriority};
+    CFAllocatorRef    alloc     = CFGetAllocator(ctxt->_properties);
+    CFDictionaryRef   options;
+
+    /* Grab the intended value.  If none, give if "default." */
+    values[1] = (CFStringRef)CFDictionaryGetValue(ctxt->_properties, keys[1]);
+    if (!values[1])
+      values[1] = _kCFStreamAutoVPNPriorityDefault;
+
+    /* Create the dictionary of options for SC. */
+    options = CFDictionaryCreate(alloc, (const void**)keys, (const void**)values, sizeof(values) / sizeof(values[0]), &kCFTypeDictionaryKeyCallBacks,
+                                 &kCFTypeDictionaryValueCallBacks);
+
+    /* Mark the attempt, so another is not made. */
+    __CFBitSet(ctxt->_flags, kFlagBitTriedVPN);
+
+    /* No options = no memory. */
+    if (!options) {
+      ctxt->_error.error  = ENOMEM;
+      ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+    }
+#if defined(__MACH__)
+    else {
+      CFStringRef     service_id   = NULL;
+      CFDictionaryRef user_options = NULL;
+
+      /* Create the service id and settings. */
+      if (SCNetworkConnectionCopyUserPreferences(options, &service_id, &user_options)) {
+        SCNetworkConnectionContext c = {0, ctxt, NULL, NULL, NULL};
+
+        /* Create the connection for auto connect. */
+        SCNetworkConnectionRef conn =
+            SCNetworkConnectionCreateWithServiceID(alloc, service_id, (SCNetworkConnectionCallBack)_NetworkConnectionCallBack, &c);
+
+        /* Did it create? */
+        if (conn) {
+          int        i;
+          CFArrayRef loops[3] = {ctxt->_readloops, ctxt->_writeloops, ctxt->_sharedloops};
+
+          /* Now schedule the connection on all loops and modes */
+          for (i = 0; i < (sizeof(loops) / sizeof(loops[0])); i++)
+            _CFTypeScheduleOnMultipleRunLoops(conn, loops[i]);
+
+          if (SCNetworkConnectionStart(conn, user_options, TRUE)) {
+            memset(&ctxt->_error, 0, sizeof(ctxt->_error));
+
+            /* Succeeded so make sure the connection is in the list of schedulables for future. */
+            _SchedulablesAdd(ctxt->_schedulables, conn);
+          }
+
+          else {
+            /* Remove the connection from all the schedules. */
+            for (i = 0; i < (sizeof(loops) / sizeof(loops[0])); i++)
+              _CFTypeUnscheduleFromMultipleRunLoops(conn, loops[i]);
+
+            /* Invalidate the connection; never to be used again. */
+            _CFTypeInvalidate(conn);
+          }
+        }
+
+        /* Clean up. */
+        if (conn)
+          CFRelease(conn);
+      }
+
+      /* Clean up. */
+      CFRelease(options);
+      if (service_id)
+        CFRelease(service_id);
+      if (user_options)
+        CFRelease(user_options);
+    }
+#endif
+  }
+}
+
+/* static */ void _SocketStreamPerformCancel(void* info) { (void)info; /* unused */ }
+
+#pragma mark - * SOCKS Support
+
+#define kSOCKSv4BufferMaximum ((CFIndex)(8L))
+#define kSOCKSv5BufferMaximum ((CFIndex)(2L))
+
+/* static */ void _PerformSOCKSv5Handshake_NoLock(_CFSocketStreamContext* ctxt)
+{
+  do {
+    /* Get the buffer of stuff to send */
+    CFMutableDataRef to_send = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
+    CFMutableDataRef to_recv = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
+
+    if (!to_recv) {
+      CFStreamError error = {0, 0};
+      CFIndex       length, sent;
+
+      if (!to_send) {
+        UInt8* ptr;
+
+        /* Get the user/pass to determine how many methods are supported. */
+        CFDictionaryRef proxy = (CFDictionaryRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySOCKSProxy);
+        CFStringRef     user  = (CFStringRef)CFDictionaryGetValue(proxy, kCFStreamPropertySOCKSUser);
+        CFStringRef     pass  = (CFStringRef)CFDictionaryGetValue(proxy, kCFStreamPropertySOCKSPassword);
+
+        /* Create the 4 byte buffer for the intial connect. */
+        to_send               = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), 4);
+
+        /* Couldn't create so error out on no memory. */
+        if (!to_send) {
+          ctxt->_error.error  = ENOMEM;
+          ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+          break;
+        }
+
+        /* Make sure to save the buffer for later. */
+        CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer, to_send);
+        CFRelease(to_send);
+
+        /* Get the local pointer to set the values. */
+        ptr = CFDataGetMutableBytePtr(to_send);
+        CFDataSetLength(to_send, 4);
+
+        /* By default, perform only 1 method (no authentication). */
+        ptr[0] = 0x05;
+        ptr[1] = 0x01;
+        ptr[2] = 0x00;
+        ptr[3] = 0x02;
+
+        /* If there is a valid user and pass, indicate willing to do two methods. */
+        if (user && CFStringGetLength(user) && pass && CFStringGetLength(pass))
+          ptr[1] = 0x02;
+        else
+          CFDataSetLength(to_send, 3);
+      }
+
+      /* Try sending out the bytes. */
+      length = CFDataGetLength(to_send);
+      sent   = _CFSocketSend(ctxt->_socket, CFDataGetBytePtr(to_send), length, &error);
+
+      /* If sent everything, dump the buffer. */
+      if (sent == length) {
+        CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
+
+        /* Create the buffer for receive. */
+        to_recv = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), 2);
+
+        /* Fail so error on no memory. */
+        if (!to_recv) {
+          ctxt->_error.error  = ENOMEM;
+          ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+          break;
+        }
+
+        /* Make sure to save the buffer for later. */
+        CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer, to_recv);
+        CFRelease(to_recv);
+      }
+
+      /* If couldn't send everything, trim the buffer. */
+      else if (sent > 0) {
+        UInt8* ptr = CFDataGetMutableBytePtr(to_send);
+
+        /* New length */
+        length -= sent;
+
+        /* Move the bytes down in the buffer. */
+        memmove(ptr, ptr + sent, length);
+
+        /* Trim it. */
+        CFDataSetLength(to_send, length);
+
+        /* Re-enable so the rest can be written later. */
+        CFSocketEnableCallBacks(ctxt->_socket, kCFSocketWriteCallBack);
+      }
+
+      /* If got an error other than EAGAIN, set the error in the context. */
+      else if ((error.error != EAGAIN) || (error.domain != kCFStreamErrorDomainPOSIX))
+        memmove(&ctxt->_error, &error, sizeof(error));
+    }
+
+    else {
+      UInt8*  ptr    = CFDataGetMutableBytePtr(to_recv);
+      CFIndex length = CFDataGetLength(to_recv);
+
+      if (length != kSOCKSv5BufferMaximum) {
+        CFStreamError error = {0, 0};
+        CFIndex       recvd = _CFSocketRecv(ctxt->_socket, ptr + length, kSOCKSv5BufferMaximum - length, &error);
+
+        /* If read 0 bytes, this is an early close from the other side. */
+        if (recvd == 0) {
+          /* Mark as not connected. */
+          ctxt->_error.error  = ENOTCONN;
+          ctxt->_error.domain = _kCFStreamErrorDomainNativeSockets;
+        }
+
+        /* Successfully read? */
+        else if (recvd > 0) {
+          UInt8 tmp[kSOCKSv5BufferMaximum];
+
+          /* Set the length of the buffer. */
+          length += recvd;
+
+          /* CF is so kind as to zero the bytes on SetLength, even though it's a fixed capacity. */
+          memmove(tmp, ptr, length);
+
+          /* Set the length of the buffer. */
+          CFDataSetLength(to_recv, length);
+
+          /* Put the bytes back. */
+          memmove(ptr, tmp, length);
+
+          /* Re-enable after performing a successful read. */
+          CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
+        }
+
+        /* If got an error other than EAGAIN, set the error in the context. */
+        else if ((error.error != EAGAIN) || (error.domain != kCFStreamErrorDomainPOSIX))
+          memmove(&ctxt->_error, &error, sizeof(error));
+      }
+
+      /* Is there enough now? */
+      if (length == kSOCKSv5BufferMaximum) {
+        switch (ptr[1]) {
+          case 0x00:
+            /* Don't need to do anything for "No Authentication Required." */
+            CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
+            _SocketStreamAddHandshake_NoLock(ctxt, _PerformSOCKSv5PostambleHandshake_NoLock);
+            _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv5Handshake_NoLock);
+            break;
+
+            /* **FIXME** Add GSS API support (0x01) */
+
+          case 0x02: {
+            CFDictionaryRef proxy = (CFDictionaryRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySOCKSProxy);
+            CFStringRef     user  = (CFStringRef)CFDictionaryGetValue(proxy, kCFStreamPropertySOCKSUser);
+            CFStringRef     pass  = (CFStringRef)CFDictionaryGetValue(proxy, kCFStreamPropertySOCKSPassword);
+
+            CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
+
+            if (user && pass) {
+              _SocketStreamAddHandshake_NoLock(ctxt, _PerformSOCKSv5UserPassHandshake_NoLock);
+              _SocketStreamAddHandshake_NoLock(ctxt, _PerformSOCKSv5PostambleHandshake_NoLock);
+              _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv5Handshake_NoLock);
+            }
+
+            else {
+              ctxt->_error.domain = kCFStreamErrorDomainSOCKS;
+              ctxt->_error.error  = ((kCFStreamErrorSOCKS5SubDomainMethod << 16) | (ptr[1] & 0x000000FF));
+            }
+
+            break;
+          }
+
+            /* **FIXME** Add CHAP support (0x03) */
+
+          default:
+            ctxt->_error.domain = kCFStreamErrorDomainSOCKS;
+            ctxt->_error.error  = ((kCFStreamErrorSOCKS5SubDomainMethod << 16) | (ptr[1] & 0x000000FF));
+            break;
+        }
+      }
+    }
+  } while (0);
+
+  /* If there was an error remove the handshake. */
+  if (ctxt->_error.error)
+    _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv5Handshake_NoLock);
+}
+
+/* static */ void _PerformSOCKSv5PostambleHandshake_NoLock(_CFSocketStreamContext* ctxt)
+{
+  do {
+    /* Get the buffer of stuff to send */
+    CFMutableDataRef to_send = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
+    CFMutableDataRef to_recv = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
+
+    if (!to_recv) {
+      CFStreamError error = {0, 0};
+      CFIndex       length, sent;
+
+      if (!to_send) {
+        UInt8*         ptr;
+        SInt32         value = 0;
+        unsigned short prt;
+
+        /* Try to get the name for sending in the CONNECT request. */
+        CFHostRef   host = (CFHostRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteHost);
+        CFNumberRef port = (CFNumberRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRemotePort);
+        CFArrayRef  list = CFHostGetNames(host, NULL);
+        CFStringRef name = (list && CFArrayGetCount(list)) ? (CFStringRef)CFArrayGetValueAtIndex(list, 0) : NULL;
+
+        if (name)
+          CFRetain(name);
+        else {
+          /* Is there one good address to create a name? */
+          list = CFHostGetAddressing(host, NULL);
+          if (list && CFArrayGetCount(list)) {
+            name = _CFNetworkCFStringCreateWithCFDataAddress(CFGetAllocator(list), (CFDataRef)CFArrayGetValueAtIndex(list, 0));
+          }
+
+          /* Couldn't create so error out on no memory. */
+          if (!name) {
+            ctxt->_error.error  = ENOMEM;
+            ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+            break;
+          }
+        }
+
+        /* Create the buffer for the largest possible CONNECT request. */
+        to_send = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), 262);
+
+        /* Couldn't create so error out on no memory. */
+        if (!to_send) {
+          ctxt->_error.error  = ENOMEM;
+          ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+          break;
+        }
+
+        /* Extend it all the way out for now; shorten later. */
+        CFDataSetLength(to_send, 262);
+
+        /* Get the local pointer to set the values. */
+        ptr = CFDataGetMutableBytePtr(to_send);
+
+        /* Make sure to save the buffer for later. */
+        CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer, to_send);
+        CFRelease(to_send);
+
+        /* Place the name into the buffer. */
+        CFStringGetPascalString(name, &(ptr[4]), 256, kCFStringEncodingUTF8);
+        CFRelease(name);
+
+        /* Place the header bytes. */
+        ptr[0] = 0x05;
+        ptr[1] = 0x01;
+        ptr[2] = 0x00;
+        ptr[3] = 0x03;
+
+        /* Get the port value to lay down. */
+        CFNumberGetValue(port, kCFNumberSInt32Type, &value);
+
+        /* Lay down the port. */
+        prt                                    = htons(value & 0x0000FFFF);
+        *((unsigned short*)(&ptr[ptr[4] + 5])) = prt;
+
+        /* Trim down the buffer to the correct size. */
+        CFDataSetLength(to_send, 7 + ptr[4]);
+      }
+
+      /* Try sending out the bytes. */
+      length = CFDataGetLength(to_send);
+      sent   = _CFSocketSend(ctxt->_socket, CFDataGetBytePtr(to_send), length, &error);
+
+      /* If sent everything, dump the buffer. */
+      if (sent == length) {
+        CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
+
+        /* Create the buffer for receive. */
+        to_recv = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), 262);
+
+        /* Fail so error on no memory. */
+        if (!to_recv) {
+          ctxt->_error.error  = ENOMEM;
+          ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+          break;
+        }
+
+        /* Make sure to save the buffer for later. */
+        CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer, to_recv);
+        CFRelease(to_recv);
+      }
+
+      /* If couldn't send everything, trim the buffer. */
+      else if (sent > 0) {
+        UInt8* ptr = CFDataGetMutableBytePtr(to_send);
+
+        /* New length */
+        length -= sent;
+
+        /* Move the bytes down in the buffer. */
+        memmove(ptr, ptr + sent, length);
+
+        /* Trim it. */
+        CFDataSetLength(to_send, length);
+
+        /* Re-enable so the rest can be written later. */
+        CFSocketEnableCallBacks(ctxt->_socket, kCFSocketWriteCallBack);
+      }
+
+      /* If got an error other than EAGAIN, set the error in the context. */
+      else if ((error.error != EAGAIN) || (error.domain != kCFStreamErrorDomainPOSIX))
+        memmove(&ctxt->_error, &error, sizeof(error));
+    }
+
+    else {
+      CFStreamError error  = {0, 0};
+      UInt8*        ptr    = CFDataGetMutableBytePtr(to_recv);
+      CFIndex       length = CFDataGetLength(to_recv);
+      CFIndex       recvd  = 0;
+
+      /* Go for the initial return code. */
+      if (length < 2)
+        recvd = _CFSocketRecv(ctxt->_socket, ptr + length, 2 - length, &error);
+
+      /* Add the read bytes if successful */
+      length += (recvd > 0) ? recvd : 0;
+
+      /* Continue on if things are good. */
+      if (!error.error && (length >= 2)) {
+        /* Make sure the header starts correctly.  Fail if not. */
+        if ((ptr[0] != 5) || ptr[1]) {
+          ctxt->_error.domain = kCFStreamErrorDomainSOCKS;
+          ctxt->_error.error  = ((kCFStreamErrorSOCKS5SubDomainResponse << 16) | (((ptr[0] != 5) ? -1 : ptr[1]) & 0x000000FF));
+          break;
+        }
+
+        else {
+          /* Go for as many bytes as the smallest result packet. */
+          if (length < 8)
+            recvd = _CFSocketRecv(ctxt->_socket, ptr + length, 8 - length, &error);
+
+          /* Add the read bytes if successful */
+          length += (recvd > 0) ? recvd : 0;
+
+          /* Can continue so long as result type and length byte are there. */
+          if (!error.error && (length >= 5)) {
+            CFIndex intended = 0;
+
+            /* Check the address type. */
+            switch (ptr[3]) {
+              /* IPv4 type */
+              case 0x01:
+                /* Bail if 10 bytes have been read. */
+                intended = 10;
+                break;
+
+                /* Domain name type */
+              case 0x03:
+                /* Bail if the 7 bytes plus domain name length have been read. */
+                intended = 7 + ptr[4];
+                break;
+
+                /* IPv6 type */
+              case 0x04:
+                /* Bail if 22 bytes have been read. */
+                intended = 22;
+                break;
+
+                /* Got crap data so bail.*/
+              default:
+                ctxt->_error.domain = kCFStreamErrorDomainSOCKS;
+                ctxt->_error.error  = ((kCFStreamErrorSOCKS5SubDomainResponse << 16) | kCFStreamErrorSOCKS5BadResponseAddr);
+                break;
+            }
+
+            /* Not an understood resut, so bail. */
+            if (ctxt->_error.error)
+              break;
+
+            /* If haven't read all the result, continue reading more. */
+            if (length < intended)
+              recvd = _CFSocketRecv(ctxt->_socket, ptr + length, intended - length, &error);
+
+            /* No error on the final read? */
+            if (!error.error) {
+              /* Add the read bytes. */
+              length += recvd;
+
+              /* If got them all, need to remove the handshake and let things fly. */
+              if (length == intended) {
+                /* There is no reason to have this. */
+                CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
+
+                /* Remove the handshake and get out. */
+                _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv5PostambleHandshake_NoLock);
+
+                return; /* NOTE the early return! */
+              }
+            }
+          }
+        }
+      }
+
+      /* If read 0 bytes, this is an early close from the other side. */
+      if (recvd == 0) {
+        /* Mark as not connected. */
+        ctxt->_error.error  = ENOTCONN;
+        ctxt->_error.domain = _kCFStreamErrorDomainNativeSockets;
+      }
+
+      /* Successfully read? */
+      else if (!error.error)
+        break;
+
+      /* Got a blocking error, so need to copy over all the bytes and buffer. */
+      else if ((error.error == EAGAIN) || (error.domain == kCFStreamErrorDomainPOSIX)) {
+        UInt8 tmp[262];
+
+        /* Set the length of the buffer. */
+        length += recvd;
+
+        /* CF is so kind as to zero the bytes on SetLength, even though it's a fixed capacity. */
+        memmove(tmp, ptr, length);
+
+        /* Set the length of the buffer. */
+        CFDataSetLength(to_recv, length);
+
+        /* Put the bytes back. */
+        memmove(ptr, tmp, length);
+
+        /* Re-enable after performing a successful read. */
+        CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
+      }
+
+      /* If got an error other than EAGAIN, set the error in the context. */
+      else
+        memmove(&ctxt->_error, &error, sizeof(error));
+    }
+  } while (0);
+
+  /* If there was an error remove the handshake. */
+  if (ctxt->_error.error)
+    _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv5Handshake_NoLock);
+}
+
+/* static */ void _PerformSOCKSv5UserPassHandshake_NoLock(_CFSocketStreamContext* ctxt)
+{
+  do {
+    /* Get the buffer of stuff to send */
+    CFMutableDataRef to_send = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
+    CFMutableDataRef to_recv = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
+
+    if (!to_recv) {
+      CFStreamError error = {0, 0};
+      CFIndex       length, sent;
+
+      if (!to_send) {
+        UInt8* ptr;
+
+        /* Get the user/pass. */
+        CFDictionaryRef proxy = (CFDictionaryRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySOCKSProxy);
+        CFStringRef     user  = (CFStringRef)CFDictionaryGetValue(proxy, kCFStreamPropertySOCKSUser);
+        CFStringRef     pass  = (CFStringRef)CFDictionaryGetValue(proxy, kCFStreamPropertySOCKSPassword);
+
+        /* Create the buffer for the maximum user/pass packet. */
+        to_send               = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), 513);
+
+        /* Couldn't create so error out on no memory. */
+        if (!to_send) {
+          ctxt->_error.error  = ENOMEM;
+          ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+          break;
+        }
+
+        /* Make sure to save the buffer for later. */
+        CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer, to_send);
+        CFRelease(to_send);
+
+        /* Get the local pointer to set the values. */
+        ptr = CFDataGetMutableBytePtr(to_send);
+        CFDataSetLength(to_send, 513);
+
+        /* Set version 1. */
+        ptr[0] = 0x01;
+
+        /* Place the user and pass into the buffer. */
+        CFStringGetPascalString(user, &(ptr[1]), 256, kCFStringEncodingUTF8);
+        CFStringGetPascalString(pass, &(ptr[2 + ptr[1]]), 256, kCFStringEncodingUTF8);
+
+        /* Set the length. */
+        CFDataSetLength(to_send, 3 + ptr[1] + ptr[2 + ptr[1]]);
+      }
+
+      /* Try sending out the bytes. */
+      length = CFDataGetLength(to_send);
+      sent   = _CFSocketSend(ctxt->_socket, CFDataGetBytePtr(to_send), length, &error);
+
+      /* If sent everything, dump the buffer. */
+      if (sent == length) {
+        CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
+
+        /* Create the buffer for receive. */
+        to_recv = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), 2);
+
+        /* Fail so error on no memory. */
+        if (!to_recv) {
+          ctxt->_error.error  = ENOMEM;
+          ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+          break;
+        }
+
+        /* Make sure to save the buffer for later. */
+        CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer, to_recv);
+        CFRelease(to_recv);
+      }
+
+      /* If couldn't send everything, trim the buffer. */
+      else if (sent > 0) {
+        UInt8* ptr = CFDataGetMutableBytePtr(to_send);
+
+        /* New length */
+        length -= sent;
+
+        /* Move the bytes down in the buffer. */
+        memmove(ptr, ptr + sent, length);
+
+        /* Trim it. */
+        CFDataSetLength(to_send, length);
+
+        /* Re-enable so the rest can be written later. */
+        CFSocketEnableCallBacks(ctxt->_socket, kCFSocketWriteCallBack);
+      }
+
+      /* If got an error other than EAGAIN, set the error in the context. */
+      else if ((error.error != EAGAIN) || (error.domain != kCFStreamErrorDomainPOSIX))
+        memmove(&ctxt->_error, &error, sizeof(error));
+    }
+
+    else {
+      UInt8*  ptr    = CFDataGetMutableBytePtr(to_recv);
+      CFIndex length = CFDataGetLength(to_recv);
+
+      if (length != kSOCKSv5BufferMaximum) {
+        CFStreamError error = {0, 0};
+        CFIndex       recvd = _CFSocketRecv(ctxt->_socket, ptr + length, kSOCKSv5BufferMaximum - length, &error);
+
+        /* If read 0 bytes, this is an early close from the other side. */
+        if (recvd == 0) {
+          /* Mark as not connected. */
+          ctxt->_error.error  = ENOTCONN;
+          ctxt->_error.domain = _kCFStreamErrorDomainNativeSockets;
+        }
+
+        /* Successfully read? */
+        else if (recvd > 0) {
+          UInt8 tmp[kSOCKSv5BufferMaximum];
+
+          /* Set the length of the buffer. */
+          length += recvd;
+
+          /* CF is so kind as to zero the bytes on SetLength, even though it's a fixed capacity. */
+          memmove(tmp, ptr, length);
+
+          /* Set the length of the buffer. */
+          CFDataSetLength(to_recv, length);
+
+          /* Put the bytes back. */
+          memmove(ptr, tmp, length);
+
+          /* Re-enable after performing a successful read. */
+          CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
+        }
+
+        /* If got an error other than EAGAIN, set the error in the context. */
+        else if ((error.error != EAGAIN) || (error.domain != kCFStreamErrorDomainPOSIX))
+          memmove(&ctxt->_error, &error, sizeof(error));
+      }
+
+      /* Is there enough now? */
+      if (length == kSOCKSv5BufferMaximum) {
+        /* Status must be 0x00 for success. */
+        if (ptr[1]) {
+          ctxt->_error.domain = kCFStreamErrorDomainSOCKS;
+          ctxt->_error.error  = ((kCFStreamErrorSOCKS5SubDomainUserPass << 16) | (ptr[1] & 0x000000FF));
+          break;
+        }
+
+        CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
+        _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv5UserPassHandshake_NoLock);
+      }
+    }
+  } while (0);
+
+  /* If there was an error remove the handshake. */
+  if (ctxt->_error.error)
+    _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv5Handshake_NoLock);
+}
+
+/* static */ void _PerformSOCKSv4Handshake_NoLock(_CFSocketStreamContext* ctxt)
+{
+  do {
+    /* Get the buffer of stuff to send */
+    CFMutableDataRef to_send = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
+    CFMutableDataRef to_recv = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
+
+    /* Send anything that is waiting. */
+    if (to_send) {
+      CFStreamError error  = {0, 0};
+      CFIndex       length = CFDataGetLength(to_send);
+      CFIndex       sent   = _CFSocketSend(ctxt->_socket, CFDataGetBytePtr(to_send), length, &error);
+
+      /* If sent everything, dump the buffer. */
+      if (sent == length)
+        CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
+
+      /* If couldn't send everything, trim the buffer. */
+      else if (sent > 0) {
+        UInt8* ptr = CFDataGetMutableBytePtr(to_send);
+
+        /* New length */
+        length -= sent;
+
+        /* Move the bytes down in the buffer. */
+        memmove(ptr, ptr + sent, length);
+
+        /* Trim it. */
+        CFDataSetLength(to_send, length);
+
+        /* Re-enable so the rest can be written later. */
+        CFSocketEnableCallBacks(ctxt->_socket, kCFSocketWriteCallBack);
+      }
+
+      /* If got an error other than EAGAIN, set the error in the context. */
+      else if ((error.error != EAGAIN) || (error.domain != kCFStreamErrorDomainPOSIX))
+        memmove(&ctxt->_error, &error, sizeof(error));
+    }
+
+    else {
+      UInt8*  ptr;
+      CFIndex length;
+
+      /* If there is no receive buffer, need to create it. */
+      if (!to_recv) {
+        /* SOCKSv4 uses only an 8 byte buffer. */
+        to_recv = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), kSOCKSv4BufferMaximum);
+
+        /* Did it create? */
         if (!to_recv) {
+          /* Set no memory error and bail. */
+          ctxt->_error.error  = ENOMEM;
+          ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+
+          /* Fail now. */
+          break;
+        }
+
+        /* Add it to the properties. */
+        CFDictionaryAddValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer, to_recv);
+
+        CFRelease(to_recv);
+      }
+
+      ptr    = CFDataGetMutableBytePtr(to_recv);
+      length = CFDataGetLength(to_recv);
+
+      if (length != kSOCKSv4BufferMaximum) {
+        CFStreamError error = {0, 0};
+        CFIndex       recvd = _CFSocketRecv(ctxt->_socket, ptr + length, kSOCKSv4BufferMaximum - length, &error);
+
+        /* If read 0 bytes, this is an early close from the other side. */
+        if (recvd == 0) {
+          /* Mark as not connected. */
+          ctxt->_error.error  = ENOTCONN;
+          ctxt->_error.domain = _kCFStreamErrorDomainNativeSockets;
+        }
+
+        /* Successfully read? */
+        else if (recvd > 0) {
+          UInt8 tmp[kSOCKSv4BufferMaximum];
+
+          /* Set the length of the buffer. */
+          length += recvd;
+
+          /* CF is so kind as to zero the bytes on SetLength, even though it's a fixed capacity. */
+          memmove(tmp, ptr, length);
+
+          /* Set the length of the buffer. */
+          CFDataSetLength(to_recv, length);
+
+          /* Put the bytes back. */
+          memmove(ptr, tmp, length);
+
+          /* Re-enable after performing a successful read. */
+          CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
+        }
+
+        /* If got an error other than EAGAIN, set the error in the context. */
+        else if ((error.error != EAGAIN) || (error.domain != kCFStreamErrorDomainPOSIX))
+          memmove(&ctxt->_error, &error, sizeof(error));
+      }
+
+      /* Is there enough now? */
+      if (length == kSOCKSv4BufferMaximum) {
+        /* If successful, remove the handshake. */
+        if ((ptr[0] == 0) && (ptr[1] == 90))
+          _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv4Handshake_NoLock);
+
+        /* Set the error based upon the SOCKS result. */
+        else {
+          ctxt->_error.error  = (kCFStreamErrorSOCKS4SubDomainResponse << 16) | (((ptr[0] == 0) ? ptr[1] : -1) & 0x0000FFFF);
+          ctxt->_error.domain = kCFStreamErrorDomainSOCKS;
+        }
+
+        /* Toss this as it's not needed anymore. */
+        CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
+      }
+    }
+  } while (0);
+
+  /* If there was an error remove the handshake. */
+  if (ctxt->_error.error)
+    _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv4Handshake_NoLock);
+}
+
+/* static */ Boolean _SOCKSSetInfo_NoLock(_CFSocketStreamContext* ctxt, CFDictionaryRef settings)
+{
+  CFDictionaryRef old = CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySOCKSProxy);
+
+  /*
+  ** Up front check for correct settings type before tossing
+  ** out the existing SOCKS info.  Can only set SOCKS proxy
+  ** if not opened or opening.  Can't use SOCKS if created
+  ** with a connected socket.
+  */
+  if ((settings && (CFDictionaryGetTypeID() != CFGetTypeID(settings))) || __CFBitIsSet(ctxt->_flags, kFlagBitOpenComplete) ||
+      __CFBitIsSet(ctxt->_flags, kFlagBitOpenStarted) || __CFBitIsSet(ctxt->_flags, kFlagBitCreatedNative)) {
+    return FALSE;
+  }
+
+  if (!old || !CFEqual(old, settings)) {
+    /* Removing the SOCKS proxy? */
+    if (!settings) {
+      /* Remove the settings. */
+      CFDictionaryRemoveValue(ctxt->_properties, kCFStreamPropertySOCKSProxy);
+
+      /* Remove the handshake (removes both to make sure neither socks is set). */
+      _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv4Handshake_NoLock);
+      _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv5Handshake_NoLock);
+    }
+
+    /* Client is setting the proxy. */
+    else {
+      CFStringRef name          = NULL;
+      CFStringRef user          = (CFStringRef)CFDictionaryGetValue(settings, kCFStreamPropertySOCKSUser);
+      CFStringRef pass          = (CFStringRef)CFDictionaryGetValue(settings, kCFStreamPropertySOCKSPassword);
+      CFStringRef version       = _GetSOCKSVersion(settings);
+      CFTypeRef   lookup        = CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteHost);
+      CFNumberRef enabled       = CFDictionaryGetValue(settings, _kCFStreamProxySettingSOCKSEnable);
+      SInt32      enabled_value = 0;
+
+      /* Verify that a valid version has been set.  No setting is SOCKSv5. */
+      if (!CFEqual(version, kCFStreamSocketSOCKSVersion4) && !CFEqual(version, kCFStreamSocketSOCKSVersion5))
+        return FALSE;
+
+      /* See if this is being pulled directly out of SC and try to do the right thing. */
+      if (enabled && CFNumberGetValue(enabled, kCFNumberSInt32Type, &enabled_value) && !enabled_value) {
+        /* If it's not enabled, this means "don't set it." */
+        CFDictionaryRemoveValue(ctxt->_properties, kCFStreamPropertySOCKSProxy);
+
+        return TRUE;
+      }
+
+      /* Is there far end information for setting up the tunnel? */
+      if (lookup) {
+        /* Get the list of names for setting up the tunnel */
+        CFArrayRef list = CFHostGetNames((CFHostRef)lookup, NULL);
+
+        /* Good with at least one name? */
+        if (list && CFArrayGetCount(list))
+          name = (CFStringRef)CFRetain((CFTypeRef)CFArrayGetValueAtIndex(list, 0));
+
+        /* No name, but can create one with an IP. */
+        else {
+          /* Is there one good address to create a name? */
+          list = CFHostGetAddressing((CFHostRef)lookup, NULL);
+          if (list && CFArrayGetCount(list)) {
+            name = _CFNetworkCFStringCreateWithCFDataAddress(CFGetAllocator(list), (CFDataRef)CFArrayGetValueAtIndex(list, 0));
+          }
+        }
+      }
+
+      /* No host, but is there a possible CFNetService? */
+      else if ((lookup = CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteNetService))) {
+        /* Can't perform SOCKS to a CFNetService. */
+        return FALSE;
+      }
+
+      /* Fail if there is no way to put together a SOCKS request. */
+      if (!name) {
+        /* SOCKSv4 can attempt the resolve to get the name. */
+        if (!CFEqual(version, kCFStreamSocketSOCKSVersion4))
+          return FALSE;
+      }
+
+      else {
+        /* The maximum hostname length to be packed is 255 in SOCKSv5 */
+        CFIndex length = CFStringGetLength(name);
+
+        /* Check to see if need this proxy for the intended host. */
+        if (!_CFNetworkDoesNeedProxy(name, CFDictionaryGetValue(settings, kCFStreamPropertyProxyExceptionsList),
+                                     CFDictionaryGetValue(settings, kCFStreamPropertyProxyLocalBypass))) {
+          CFRelease(name);
+          return FALSE;
+        }
+
+        CFRelease(name);
+
+        /* SOCKSv5 requires that the host name be a maximum of 255. */
+        if (CFEqual(version, kCFStreamSocketSOCKSVersion5) && ((length <= 0) || (length > 255)))
+          return FALSE;
+      }
+
+      /* SOCKSv5 maximum password length if given is 255. */
+      if (CFEqual(version, kCFStreamSocketSOCKSVersion5) && pass && (CFStringGetLength(pass) > 255))
+        return FALSE;
+
+      if (user) {
+        /* SOCKSv4 maximum user name length is 512. */
+        if (CFEqual(version, kCFStreamSocketSOCKSVersion4) && (CFStringGetLength(user) > 512))
+          return FALSE;
+
+        /* SOCKSv5 maximum user name length is 255. */
+        else if (CFEqual(version, kCFStreamSocketSOCKSVersion5) && (CFStringGetLength(user) > 255))
+          return FALSE;
+      }
+
+      /* Add the handshake to the list to perform. */
+      if (!_SocketStreamAddHandshake_NoLock(
+              ctxt, CFEqual(version, kCFStreamSocketSOCKSVersion4) ? _PerformSOCKSv4Handshake_NoLock : _PerformSOCKSv5Handshake_NoLock))
+        return FALSE;
+
+      /* Put the new setting in place, removing the old if previously set. */
+      CFDictionarySetValue(ctxt->_properties, kCFStreamPropertySOCKSProxy, settings);
+    }
+  }
+
+  return TRUE;
+}
+
+/* static */ void _SocketStreamSOCKSHandleLookup_NoLock(_CFSocketStreamContext* ctxt, CFHostRef lookup)
+{
+  int               i;
+  CFArrayRef        addresses;
+  CFStringRef       name = NULL;
+  CFMutableArrayRef loops[3];
+  CFIndex           user_len = 0;
+  CFIndex           extra    = 0;
+  CFMutableDataRef  buffer;
+  CFDictionaryRef   settings = (CFDictionaryRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySOCKSProxy);
+  CFStringRef       user     = (CFStringRef)CFDictionaryGetValue(settings, kCFStreamPropertySOCKSUser);
+  UInt8*            ptr      = NULL;
+
+  CFNumberRef port           = CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRemotePort);
+
+  /* Remove the lookup from the schedulables since it's done. */
+  _SchedulablesRemove(ctxt->_schedulables, lookup);
+
+  /* Invalidate it so no callbacks occur. */
+  _CFTypeInvalidate(lookup);
+
+  /* Grab the list of run loops and modes for unscheduling. */
+  loops[0] = ctxt->_readloops;
+  loops[1] = ctxt->_writeloops;
+  loops[2] = ctxt->_sharedloops;
+
+  /* Make sure to remove the lookup from all loops and modes. */
+  for (i = 0; i < (sizeof(loops) / sizeof(loops[0])); i++)
+    _CFTypeUnscheduleFromMultipleRunLoops(lookup, loops[i]);
+
+  /* Get the list of addresses. */
+  addresses = CFHostGetAddressing((CFHostRef)lookup, NULL);
+
+  /* If no addresses, go for the name. */
+  if (!addresses || !CFArrayGetCount(addresses))
+    name = (CFStringRef)CFArrayGetValueAtIndex(CFHostGetNames((CFHostRef)lookup, NULL), 0);
+
+  /* Find the overhead for the user name if one. */
+  if (user) {
+    user_len = CFStringGetBytes(user, CFRangeMake(0, CFStringGetLength(user)), kCFStringEncodingUTF8, 0, FALSE, NULL, 0, NULL);
+  }
+
+  /* Add for null termination. */
+  user_len += 1;
+
+  if (name) {
+    /* What's the cost in bytes of the host name? */
+    extra = CFStringGetBytes(name, CFRangeMake(0, CFStringGetLength(name)), kCFStringEncodingUTF8, 0, FALSE, NULL, 0, NULL);
+    extra += 1;
+  }
+
+  /* Create the send buffer. */
+  buffer = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), 8 + extra + user_len);
+
+  /* If failed, set the no memory error and return. */
+  if (!buffer) {
+    ctxt->_error.error  = ENOMEM;
+    ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+
+    return; /* NOTE the early return. */
+  }
+
+  /* Extend out the length to the full capacity. */
+  CFDataSetLength(buffer, 8 + extra + user_len);
+
+  /* Add it to the properties for future. */
+  CFDictionaryAddValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer, buffer);
+  CFRelease(buffer);
+
+  /* Get the pointer for easier manipulation. */
+  ptr = CFDataGetMutableBytePtr(buffer);
+
+  /* Zero out even though SetLength probably did. */
+  memset(ptr, 0, CFDataGetLength(buffer));
+
+  /* If a name was set, there was no address. */
+  if (name) {
+    /* Copy the name into the buffer.  */
+    CFStringGetBytes(name, CFRangeMake(0, CFStringGetLength(name)), kCFStringEncodingUTF8, 0, FALSE, ptr + 8 + user_len - 1, extra, NULL);
+
+    /* Cap with a null. */
+    ptr[8 + user_len + extra - 1] = '\0';
+  }
+
+  /* Use an address instead of a name. */
+  else {
+    CFIndex i, count = CFArrayGetCount(addresses);
+
+    /* Loop through looking for a valid IPv4 address.  SOCKSv4 doesn't do IPv6. */
+    for (i = 0; i < count; i++) {
+      struct sockaddr_in* sin = (struct sockaddr_in*)CFDataGetBytePtr(CFArrayGetValueAtIndex(addresses, i));
+
+      if (sin->sin_family == AF_INET) {
+        /* Set the IP in the buffer. */
+        memmove(&ptr[4], &sin->sin_addr, sizeof(sin->sin_addr));
+
+        /* If there was no port, it must be in the address. */
+        if (!port)
+          memmove(&ptr[2], &sin->sin_port, sizeof(sin->sin_port));
+
+        break;
+      }
+    }
+
+    /* Went through all the addresses and found none suitable. */
+    if (i == count) {
+      /* Mark as an invalid parameter */
+      ctxt->_error.error  = EINVAL;
+      ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+
+      /* Remove the buffer, 'cause this isn't going anywhere. */
+      CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
+
+      return; /* NOTE the early return. */
+    }
+  }
+
+  /* Set the protocol version and "CONNECT" command. */
+  ptr[0] = 0x04;
+  ptr[1] = 0x01;
+
+  /* If there was a port set, need to copy that. */
+  if (port) {
+    SInt32 value;
+
+    /* Grab the real value. */
+    CFNumberGetValue(port, kCFNumberSInt32Type, &value);
+
+    /* Place the port into the buffer. */
+    *((UInt16*)(&ptr[2])) = htons(value & 0x0000FFFF);
+  }
+
+  /* If there was a user name, need to grab its bytes into place. */
+  if (user) {
+    CFStringGetBytes(user, CFRangeMake(0, CFStringGetLength(user)), kCFStringEncodingUTF8, 0, FALSE, ptr + 8, user_len - 1, NULL);
+  }
+
+  /* If open has already finished, need to pump this thing along. */
+  if (__CFBitIsSet(ctxt->_flags, kFlagBitOpenComplete)) {
+    CFArrayRef handshakes = (CFArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyHandshakes);
+
+    /* Only force the "pump" if SOCKS is the head. */
+    if (handshakes && (CFArrayGetValueAtIndex(handshakes, 0) == _PerformSOCKSv4Handshake_NoLock))
+      _PerformSOCKSv4Handshake_NoLock(ctxt);
+  }
+}
+
+#pragma mark - * CONNECT Support
+
+/* static */ void _CreateNameAndPortForCONNECTProxy(CFDictionaryRef properties, CFStringRef* name, CFNumberRef* port, CFStreamError* error)
+{
+  CFTypeRef      lookup;
+  CFDataRef      addr  = NULL;
+  CFAllocatorRef alloc = CFGetAllocator(properties);
+
+  /* NOTE that this function is used for setting the SSL peer ID for connections other than CONNECT tunnelling. */
+
+  *name                = NULL;
+  *port                = NULL;
+
+  /* No error to start */
+  memset(error, 0, sizeof(error[0]));
+
+  /* Try to simply get the port from the properties. */
+  *port = (CFNumberRef)CFDictionaryGetValue(properties, _kCFStreamPropertySocketRemotePort);
+
+  /* Try to get the service for which the streams were created. */
+  if ((lookup = (CFTypeRef)CFDictionaryGetValue(properties, kCFStreamPropertySocketRemoteNetService))) {
+    /* Does it have a name?  These are checked at set, but just in case they go away. */
+    *name = CFNetServiceGetTargetHost((CFNetServiceRef)lookup);
+
+    /* If didn't get a port, need to go to the address to get it. */
+    if (!*port) {
+      /* Get the list of addresses from the service. */
+      CFArrayRef list = CFNetServiceGetAddressing((CFNetServiceRef)lookup);
+
+      /* Can only pull one out if it's been resolved. */
+      if (list && CFArrayGetCount(list))
+        addr = CFArrayGetValueAtIndex(list, 0);
+    }
+  }
+
+  /* No service, so go for the host. */
+  else if ((lookup = (CFTypeRef)CFDictionaryGetValue(properties, kCFStreamPropertySocketRemoteHost))) {
+    /* Get the list of names in order to get one. */
+    CFArrayRef list = CFHostGetNames((CFHostRef)lookup, NULL);
+
+    /* Pull out the name */
+    if (list && CFArrayGetCount(list))
+      *name = (CFStringRef)CFArrayGetValueAtIndex(list, 0);
+
+    else {
+      /* No name, so get the address as a name instead. */
+      list = CFHostGetAddressing((CFHostRef)lookup, NULL);
+
+      /* Get the first address from the list. */
+      if (list && CFArrayGetCount(list))
+        addr = CFArrayGetValueAtIndex(list, 0);
+    }
+  }
+
+  /* If there is no information at all, error and bail. */
+  if (!*port && !*name && !addr) {
+    error->error  = EINVAL;
+    error->domain = kCFStreamErrorDomainPOSIX;
+    return; /* NOTE the early return */
+  }
+
+  /* Got a port?  If so, just retain it. */
+  if (*port)
+    CFRetain(*port);
+
+  else {
+    SInt32           p;
+    struct sockaddr* sa = (struct sockaddr*)CFDataGetBytePtr(addr);
+
+    /* Need to go to the socket address in order to get the port value */
+    switch (sa->sa_family) {
+      case AF_INET:
+        p     = ntohs(((struct sockaddr_in*)sa)->sin_port);
+        *port = CFNumberCreate(alloc, kCFNumberSInt32Type, &p);
+        break;
+
+      case AF_INET6:
+        p     = ntohs(((struct sockaddr_in6*)sa)->sin6_port);
+        *port = CFNumberCreate(alloc, kCFNumberSInt32Type, &p);
+        break;
+
+      default:
+        /* Not a known type.  Return an error. */
+        error->error  = EINVAL;
+        error->domain = kCFStreamErrorDomainPOSIX;
+        return; /* NOTE the early return */
+    }
+  }
+
+  /* Either retain the current name or create one from the address. */
+  if (*name)
+    CFRetain(*name);
+  else
+    *name = _CFNetworkCFStringCreateWithCFDataAddress(alloc, addr);
+
+  /* If either failed, need to error out. */
+  if (!*name || !*port) {
+    /* Release anything that was created/retained. */
+    if (*name)
+      CFRelease(*name);
+    if (*port)
+      CFRelease(*port);
+
+    /* Set the out of memory error. */
+    error->error  = ENOMEM;
+    error->domain = kCFStreamErrorDomainPOSIX;
+  }
+}
+
+/* static */ void _PerformCONNECTHandshake_NoLock(_CFSocketStreamContext* ctxt)
+{
+  UInt8            buffer[2048];
+  CFIndex          count;
+  CFStreamError    error    = {0, 0};
+  CFAllocatorRef   alloc    = CFGetAllocator(ctxt->_properties);
+  CFHTTPMessageRef response = (CFHTTPMessageRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertyCONNECTResponse);
+
+  /* NOTE, use the lack of response to mean that need to send first. */
+  if (!response) {
+    CFIndex   length;
+    CFDataRef left = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyCONNECTSendBuffer);
+
+    /* If there is nothing waiting, haven't put anything together. */
+    if (!left) {
+      CFDictionaryRef  headers;
+      CFHTTPMessageRef request = NULL;
+      CFStringRef      version, name = NULL;
+      CFDictionaryRef  proxy = (CFDictionaryRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertyCONNECTProxy);
+
+      /* Get the intended version of HTTP. */
+      version                = (CFStringRef)CFDictionaryGetValue(proxy, kCFStreamPropertyCONNECTVersion);
+
+      do {
+        SInt32      p;
+        CFURLRef    url;
+        CFNumberRef port;
+        CFStringRef urlstr;
+
+        /* Figure out what the far end name and port are. */
+        _CreateNameAndPortForCONNECTProxy(ctxt->_properties, &name, &port, &ctxt->_error);
+
+        /* Got an error, so bail. */
+        if (ctxt->_error.error)
+          break;
+
+        /* Get the real port value. */
+        CFNumberGetValue(port, kCFNumberSInt32Type, &p);
+
+        /* Produce the "CONNECT" url which is <host>:<port>. */
+        urlstr = CFStringCreateWithFormat(alloc, NULL, _kCFStreamCONNECTURLFormat, name, p & 0x0000FFFF);
+
+        /* Don't need it. */
+        CFRelease(port);
+
+        /* Make sure there's an url before continuing on. */
+        if (!urlstr)
+          break;
+
+        /* Create the url based upon the string. */
+        url = CFURLCreateWithString(alloc, urlstr, NULL);
+
+        /* Don't need it. */
+        CFRelease(urlstr);
+
+        /* Must have an url to continue. */
+        if (!url)
+          break;
+
+        /*
+        ** Create the "CONNECT" request.  Default HTTP version is 1.0 if none specified.
+        ** NOTE there are actually some servers which will fail if 1.1 is used.
+        */
+        request = CFHTTPMessageCreateRequest(alloc, _kCFStreamCONNECTMethod, url, version ? version : kCFHTTPVersion1_0);
+
+        CFRelease(url);
+
+      } while (0);
+
+      /* Fail if the request wasn't made. */
+      if (!request) {
+        if (name)
+          CFRelease(name);
+
+        /* If an error wasn't set, assume an out of memory error. */
+        if (!ctxt->_error.error) {
           ctxt->_error.error  = ENOMEM;
           ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
-          break;
         }
 
-        /* Make sure to save the buffer for later. */
-        CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer, to_recv);
-        CFRelease(to_recv);
+        return; /* NOTE the early return */
+      }
+
+      /* Add the other headers */
+      headers = CFDictionaryGetValue(proxy, kCFStreamPropertyCONNECTAdditionalHeaders);
+      if (headers) {
+        /* Check to see if "Host:" needs to be added and do so. */
+        CFStringRef value = (CFStringRef)CFDictionaryGetValue(headers, _kCFStreamHostHeader);
+        if (!value)
+          CFHTTPMessageSetHeaderFieldValue(request, _kCFStreamHostHeader, name);
+
+        /* Check to see if "User-Agent:" need to be added and do so. */
+        value = (CFStringRef)CFDictionaryGetValue(headers, _kCFStreamUserAgentHeader);
+        if (!value)
+          CFHTTPMessageSetHeaderFieldValue(request, _kCFStreamUserAgentHeader, _CFNetworkUserAgentString());
+
+        /* Add all the other headers. */
+        CFDictionaryApplyFunction(headers, (CFDictionaryApplierFunction)_CONNECTHeaderApplier, request);
+      } else {
+        /* CONNECT must have "Host:" and "User-Agent:" headers. */
+        CFHTTPMessageSetHeaderFieldValue(request, _kCFStreamHostHeader, name);
+        CFHTTPMessageSetHeaderFieldValue(request, _kCFStreamUserAgentHeader, _CFNetworkUserAgentString());
       }
 
-      /* If couldn't send everything, trim the buffer. */
-      else if (sent > 0) {
-        UInt8* ptr = CFDataGetMutableBytePtr(to_send);
+      CFRelease(name);
 
-        /* New length */
-        length -= sent;
+      /*
+      ** Flatten the request using this special version.  This will
+      ** flatten it for proxy usage (it will keep the full url).
+      */
+      left = _CFHTTPMessageCopySerializedHeaders(request, TRUE);
+      CFRelease(request);
 
-        /* Move the bytes down in the buffer. */
-        memmove(ptr, ptr + sent, length);
+      /* If failed to flatten, specify out of memory. */
+      if (!left) {
+        ctxt->_error.error  = ENOMEM;
+        ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+        return; /* NOTE the early return */
+      }
 
-        /* Trim it. */
-        CFDataSetLength(to_send, length);
+      /* Add the buffer to the properties for future. */
+      CFDictionaryAddValue(ctxt->_properties, _kCFStreamPropertyCONNECTSendBuffer, left);
+      CFRelease(left);
+    }
 
-        /* Re-enable so the rest can be written later. */
-        CFSocketEnableCallBacks(ctxt->_socket, kCFSocketWriteCallBack);
-      }
+    /* Find out how much is left and try sending. */
+    length = CFDataGetLength(left);
+    count  = _CFSocketSend(ctxt->_socket, CFDataGetBytePtr(left), length, &error);
 
-      /* If got an error other than EAGAIN, set the error in the context. */
-      else if ((error.error != EAGAIN) || (error.domain != kCFStreamErrorDomainPOSIX))
+    if (error.error) {
+      /* EAGAIN is not really an error. */
+      if ((error.error == EAGAIN) && (error.domain == _kCFStreamErrorDomainNativeSockets))
+        count = 0;
+
+      /* Other errors, copy into place and bail. */
+      else {
         memmove(&ctxt->_error, &error, sizeof(error));
+        return; /* NOTE the early return */
+      }
     }
 
-    else {
-      CFStreamError error  = {0, 0};
-      UInt8*        ptr    = CFDataGetMutableBytePtr(to_recv);
-      CFIndex       length = CFDataGetLength(to_recv);
-      CFIndex       recvd  = 0;
+    /* Shrink by the sent amount. */
+    length -= count;
 
-      /* Go for the initial return code. */
-      if (length < 2)
-        recvd = _CFSocketRecv(ctxt->_socket, ptr + length, 2 - length, &error);
+    /* Re-enable so can continue. */
+    CFSocketEnableCallBacks(ctxt->_socket, kCFSocketWriteCallBack);
 
-      /* Add the read bytes if successful */
-      length += (recvd > 0) ? recvd : 0;
+    /* Did everything get written? */
+    if (!length) {
+      /* Toss the buffer, since it is done. */
+      CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertyCONNECTSendBuffer);
 
-      /* Continue on if things are good. */
-      if (!error.error && (length >= 2)) {
-        /* Make sure the header starts correctly.  Fail if not. */
-        if ((ptr[0] != 5) || ptr[1]) {
-          ctxt->_error.domain = kCFStreamErrorDomainSOCKS;
-          ctxt->_error.error  = ((kCFStreamErrorSOCKS5SubDomainResponse << 16) | (((ptr[0] != 5) ? -1 : ptr[1]) & 0x000000FF));
-          break;
-        }
+      /* Make sure there is a response for reading. */
+      response = CFHTTPMessageCreateEmpty(alloc, FALSE);
 
-        else {
-          /* Go for as many bytes as the smallest result packet. */
-          if (length < 8)
-            recvd = _CFSocketRecv(ctxt->_socket, ptr + length, 8 - length, &error);
+      /* Bail if failed to create. */
+      if (!response) {
+        ctxt->_error.error  = ENOMEM;
+        ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+        return; /* NOTE the early return */
+      }
 
-          /* Add the read bytes if successful */
-          length += (recvd > 0) ? recvd : 0;
+      /* Save it as a property, since that's what it is. */
+      CFDictionaryAddValue(ctxt->_properties, kCFStreamPropertyCONNECTResponse, response);
+      CFRelease(response);
+    }
 
-          /* Can continue so long as result type and length byte are there. */
-          if (!error.error && (length >= 5)) {
-            CFIndex intended = 0;
+    /* If did read but not everything, need to trim the buffer. */
+    else if (count) {
+      /* Just create a copy of what's left. */
+      left = CFDataCreate(alloc, ((UInt8*)CFDataGetBytePtr(left)) + count, length);
 
-            /* Check the address type. */
-            switch (ptr[3]) {
-              /* IPv4 type */
-              case 0x01:
-                /* Bail if 10 bytes have been read. */
-                intended = 10;
-                break;
+      /* Failed with an out of memory? */
+      if (!left) {
+        ctxt->_error.error  = ENOMEM;
+        ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+        return; /* NOTE the early return */
+      }
 
-                /* Domain name type */
-              case 0x03:
-                /* Bail if the 7 bytes plus domain name length have been read. */
-                intended = 7 + ptr[4];
-                break;
+      /* Put it over top of the other. */
+      CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertyCONNECTSendBuffer, left);
+      CFRelease(left);
+    }
 
-                /* IPv6 type */
-              case 0x04:
-                /* Bail if 22 bytes have been read. */
-                intended = 22;
-                break;
+    /* Would block. */
+    else
+      return; /* NOTE the early return */
+  }
 
-                /* Got crap data so bail.*/
-              default:
-                ctxt->_error.domain = kCFStreamErrorDomainSOCKS;
-                ctxt->_error.error  = ((kCFStreamErrorSOCKS5SubDomainResponse << 16) | kCFStreamErrorSOCKS5BadResponseAddr);
-                break;
-            }
+  /*
+  ** Peek at the socket buffer to get the bytes.  Since there is no capability
+  ** of pushing bytes back, need to peek to pull out the bytes.  Don't  want to
+  ** read bytes beyond the response bytes.
+  */
+  if (-1 == (count = recv(CFSocketGetNative(ctxt->_socket), buffer, sizeof(buffer), MSG_PEEK))) {
+    /* If it's an EAGAIN, re-enable the callback to come back later. */
+    if ((_LastError(&error) == EAGAIN) && (error.domain == _kCFStreamErrorDomainNativeSockets)) {
+      CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
+      return; /* NOTE the early return */
+    }
+
+    /* Some other error, so bail. */
+    else if (error.error) {
+      memmove(&ctxt->_error, &error, sizeof(error));
+      return; /* NOTE the early return */
+    }
+  }
+
+  /* Add the bytes to the response.  Let it determine the end. */
+  if (CFHTTPMessageAppendBytes(response, buffer, count)) {
+    /*
+    ** Detect done if the head is complete.   For CONNECT,
+    ** all bytes after the headers belong to the client.
+    */
+    if (CFHTTPMessageIsHeaderComplete(response)) {
+      /* Get the result code for check later. */
+      UInt32 code    = CFHTTPMessageGetResponseStatusCode(response);
+
+      /* If there were extra bytes read, need to remove those. */
+      CFDataRef body = CFHTTPMessageCopyBody(response);
+      if (body) {
+        /* Reduce the count, so the correct byte count can get sucked out of the kernel. */
+        count -= CFDataGetLength(body);
+        CFRelease(body);
+
+        /* Get rid of the body.  CONNECT responses have no body. */
+        CFHTTPMessageSetBody(response, NULL);
+      }
+
+      /* If it wasn't a 200 series result, stall the stream for another CONNECT. */
+      if ((code < 200) || (code > 299))
+        _SocketStreamAddHandshake_NoLock(ctxt, _PerformCONNECTHaltHandshake_NoLock);
+
+      /* Remove the handshake now that it is complete. */
+      _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformCONNECTHandshake_NoLock);
+
+      CFDictionaryRemoveValue(ctxt->_properties, kCFStreamPropertyPreviousCONNECTResponse);
+    }
+
+    /* Suck the bytes out of the kernel. */
+    if (-1 == recv(CFSocketGetNative(ctxt->_socket), buffer, count, 0)) {
+      /* Copy the last error. */
+      _LastError(&ctxt->_error);
+
+      return; /* NOTE the early return */
+    }
+
+    /* Re-enable for future callbacks. */
+    CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
+  }
+
+  /* Failed to append the bytes, so error as a HTTP parsing failure. */
+  else {
+    ctxt->_error.error  = kCFStreamErrorHTTPParseFailure;
+    ctxt->_error.domain = kCFStreamErrorDomainHTTP;
+  }
+}
+
+/* static */ void _PerformCONNECTHaltHandshake_NoLock(_CFSocketStreamContext* ctxt)
+{
+  (void)ctxt; /* unused */
+
+  /* Do nothing.  This will cause a stall until it's time to go again. */
+
+  if (ctxt->_clientWriteStream && __CFBitIsSet(ctxt->_flags, kFlagBitWriteStreamOpened)) {
+    __CFBitSet(ctxt->_flags, kFlagBitCanWrite);
+    _CFWriteStreamSignalEventDelayed(ctxt->_clientWriteStream, kCFStreamEventCanAcceptBytes, NULL);
+  }
+
+  if (ctxt->_clientReadStream && __CFBitIsSet(ctxt->_flags, kFlagBitReadStreamOpened)) {
+    __CFBitSet(ctxt->_flags, kFlagBitCanRead);
+    _CFReadStreamSignalEventDelayed(ctxt->_clientReadStream, kCFStreamEventHasBytesAvailable, NULL);
+  }
+}
+
+/* static */ void _CONNECTHeaderApplier(CFStringRef key, CFStringRef value, CFHTTPMessageRef request)
+{
+  CFHTTPMessageSetHeaderFieldValue(request, key, value);
+}
+
+/* static */ Boolean _CONNECTSetInfo_NoLock(_CFSocketStreamContext* ctxt, CFDictionaryRef settings)
+{
+  Boolean         resume = FALSE;
+  CFStringRef     server = settings ? CFDictionaryGetValue(settings, kCFStreamPropertyCONNECTProxyHost) : NULL;
+  CFNumberRef     port   = settings ? CFDictionaryGetValue(settings, kCFStreamPropertyCONNECTProxyPort) : NULL;
+  CFDictionaryRef old    = CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertyCONNECTProxy);
+
+  /*
+   ** Up front check for server information before tossing out the
+   ** existing CONNECT info.  Can't use CONNECT if created with a
+   ** connected socket.
+   */
+  if ((settings && (!server || !port)) || __CFBitIsSet(ctxt->_flags, kFlagBitCreatedNative)) {
+    return FALSE;
+  }
+
+  if (__CFBitIsSet(ctxt->_flags, kFlagBitOpenComplete) || __CFBitIsSet(ctxt->_flags, kFlagBitOpenStarted)) {
+    CFMutableArrayRef handshakes = (CFMutableArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyHandshakes);
+
+    if (handshakes && CFArrayGetCount(handshakes) && (_PerformCONNECTHaltHandshake_NoLock == CFArrayGetValueAtIndex(handshakes, 0))) {
+      resume = TRUE;
+    }
 
-            /* Not an understood resut, so bail. */
-            if (ctxt->_error.error)
-              break;
+    else
+      return FALSE;
+  }
 
-            /* If haven't read all the result, continue reading more. */
-            if (length < intended)
-              recvd = _CFSocketRecv(ctxt->_socket, ptr + length, intended - length, &error);
+  /* If setting the same setting, just return TRUE. */
+  if (!old || !CFEqual(old, settings)) {
+    /* Removing the CONNECT proxy? */
+    if (!settings) {
+      /* Remove the settings. */
+      CFDictionaryRemoveValue(ctxt->_properties, kCFStreamPropertyCONNECTProxy);
 
-            /* No error on the final read? */
-            if (!error.error) {
-              /* Add the read bytes. */
-              length += recvd;
+      /* Remove the handshake. */
+      _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformCONNECTHandshake_NoLock);
+    }
 
-              /* If got them all, need to remove the handshake and let things fly. */
-              if (length == intended) {
-                /* There is no reason to have this. */
-                CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
+    /* Client is setting the proxy. */
+    else {
+      Boolean   hasName = FALSE;
+      CFTypeRef lookup  = CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteHost);
 
-                /* Remove the handshake and get out. */
-                _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv5PostambleHandshake_NoLock);
+      /* Is there far end information for setting up the tunnel? */
+      if (lookup) {
+        /* Get the list of names for setting up the tunnel */
+        CFArrayRef list = CFHostGetNames((CFHostRef)lookup, NULL);
 
-                return; /* NOTE the early return! */
-              }
-            }
-          }
-        }
-      }
+        /* Good with at least one name? */
+        if (list && CFArrayGetCount(list))
+          hasName = TRUE;
 
-      /* If read 0 bytes, this is an early close from the other side. */
-      if (recvd == 0) {
-        /* Mark as not connected. */
-        ctxt->_error.error  = ENOTCONN;
-        ctxt->_error.domain = _kCFStreamErrorDomainNativeSockets;
+        /* No name, but can create one with an IP. */
+        else {
+          /* Is there one good address to create a name? */
+          list = CFHostGetAddressing((CFHostRef)lookup, NULL);
+          if (list && CFArrayGetCount(list))
+            hasName = TRUE;
+        }
       }
 
-      /* Successfully read? */
-      else if (!error.error)
-        break;
-
-      /* Got a blocking error, so need to copy over all the bytes and buffer. */
-      else if ((error.error == EAGAIN) || (error.domain == kCFStreamErrorDomainPOSIX)) {
-        UInt8 tmp[262];
+      /* No host, but is there a possible CFNetService with enough information? */
+      else if ((lookup = CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteNetService))) {
+        /* Has the far end server been resolved already? */
+        if (CFNetServiceGetTargetHost((CFNetServiceRef)lookup))
+          hasName = TRUE;
 
-        /* Set the length of the buffer. */
-        length += recvd;
+        /*
+        ** NOTE that the target host is resolved.  If that doesn't exist,
+        ** there is no reason to check addresses since those are resolved
+        ** too.  There is no way to create a CFNetServiceRef from an
+        ** address only.
+        */
+      }
 
-        /* CF is so kind as to zero the bytes on SetLength, even though it's a fixed capacity. */
-        memmove(tmp, ptr, length);
+      /* Fail if there is no way to put together a CONNECT request. */
+      if (!hasName)
+        return FALSE;
 
-        /* Set the length of the buffer. */
-        CFDataSetLength(to_recv, length);
+      /* Add the handshake to the list to perform. */
+      if (!_SocketStreamAddHandshake_NoLock(ctxt, _PerformCONNECTHandshake_NoLock)) {
+        if (resume) {
+          CFDictionaryRemoveValue(ctxt->_properties, kCFStreamPropertyCONNECTResponse);
+          _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformCONNECTHaltHandshake_NoLock);
+        }
 
-        /* Put the bytes back. */
-        memmove(ptr, tmp, length);
+        return FALSE;
+      }
 
-        /* Re-enable after performing a successful read. */
-        CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
+      if (resume) {
+        CFTypeRef last = CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertyCONNECTResponse);
+        if (last)
+          CFDictionarySetValue(ctxt->_properties, kCFStreamPropertyPreviousCONNECTResponse, last);
+        CFDictionaryRemoveValue(ctxt->_properties, kCFStreamPropertyCONNECTResponse);
+        _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformCONNECTHaltHandshake_NoLock);
       }
 
-      /* If got an error other than EAGAIN, set the error in the context. */
-      else
-        memmove(&ctxt->_error, &error, sizeof(error));
+      /* Put the new setting in place, removing the old if previously set. */
+      CFDictionarySetValue(ctxt->_properties, kCFStreamPropertyCONNECTProxy, settings);
     }
-  } while (0);
+  }
 
-  /* If there was an error remove the handshake. */
-  if (ctxt->_error.error)
-    _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv5Handshake_NoLock);
+  return TRUE;
 }
 
-/* static */ void _PerformSOCKSv5UserPassHandshake_NoLock(_CFSocketStreamContext* ctxt)
-{
-  do {
-    /* Get the buffer of stuff to send */
-    CFMutableDataRef to_send = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
-    CFMutableDataRef to_recv = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
+#pragma mark - * SSL Support
 
-    if (!to_recv) {
-      CFStreamError error = {0, 0};
-      CFIndex       length, sent;
+#if defined(__MACH__) || defined(HAVE_OPENSSL)
+/* static */ CFDataRef _SocketStreamSecurityCreatePeerID_NoLock(_CFSocketStreamContext* ctxt)
+{
+  /*
+  ** The peer ID names the far end for session resumption.  Through a
+  ** proxy it's <host>:<port> of the far end, otherwise it's the raw
+  ** address and port of the connected peer.
+  */
 
-      if (!to_send) {
-        UInt8* ptr;
+  CFDataRef      result = NULL;
+  CFAllocatorRef alloc  = CFGetAllocator(ctxt->_properties);
 
-        /* Get the user/pass. */
-        CFDictionaryRef proxy = (CFDictionaryRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySOCKSProxy);
-        CFStringRef     user  = (CFStringRef)CFDictionaryGetValue(proxy, kCFStreamPropertySOCKSUser);
-        CFStringRef     pass  = (CFStringRef)CFDictionaryGetValue(proxy, kCFStreamPropertySOCKSPassword);
+  /* Check to see if going through a proxy.  A different ID is used in that case. */
+  CFTypeRef value       = (CFTypeRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertyCONNECTProxy);
+  if (!value)
+    value = (CFTypeRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySOCKSProxy);
 
-        /* Create the buffer for the maximum user/pass packet. */
-        to_send               = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), 513);
+  /* Use the name and port of the far end host. */
+  if (value) {
+    CFStringRef   host = NULL;
+    CFNumberRef   port = NULL;
+    CFStreamError error;
 
-        /* Couldn't create so error out on no memory. */
-        if (!to_send) {
-          ctxt->_error.error  = ENOMEM;
-          ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
-          break;
-        }
+    /* Re-use some code to get the host and port of the far end. */
+    _CreateNameAndPortForCONNECTProxy(ctxt->_properties, &host, &port, &error);
 
-        /* Make sure to save the buffer for later. */
-        CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer, to_send);
-        CFRelease(to_send);
+    /* Only do it if got the host and port, otherwise it'll fall through to the address. */
+    if (host && port) {
+      SInt32      p;
+      CFStringRef peer;
 
-        /* Get the local pointer to set the values. */
-        ptr = CFDataGetMutableBytePtr(to_send);
-        CFDataSetLength(to_send, 513);
+      /* Get the real port value. */
+      CFNumberGetValue(port, kCFNumberSInt32Type, &p);
 
-        /* Set version 1. */
-        ptr[0] = 0x01;
+      /* Produce the ID as <host>:<port>. */
+      peer = CFStringCreateWithFormat(alloc, NULL, _kCFStreamCONNECTURLFormat, host, p & 0x0000FFFF);
 
-        /* Place the user and pass into the buffer. */
-        CFStringGetPascalString(user, &(ptr[1]), 256, kCFStringEncodingUTF8);
-        CFStringGetPascalString(pass, &(ptr[2 + ptr[1]]), 256, kCFStringEncodingUTF8);
+      if (peer) {
+        UInt8   static_buffer[1024];
+        UInt8*  buffer      = &static_buffer[0];
+        CFIndex buffer_size = sizeof(static_buffer);
 
-        /* Set the length. */
-        CFDataSetLength(to_send, 3 + ptr[1] + ptr[2 + ptr[1]]);
-      }
+        /* Get the raw bytes to use as the ID. */
+        buffer              = _CFStringGetOrCreateCString(alloc, peer, static_buffer, &buffer_size, kCFStringEncodingUTF8);
 
-      /* Try sending out the bytes. */
-      length = CFDataGetLength(to_send);
-      sent   = _CFSocketSend(ctxt->_socket, CFDataGetBytePtr(to_send), length, &error);
+        CFRelease(peer);
 
-      /* If sent everything, dump the buffer. */
-      if (sent == length) {
-        CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
+        result = CFDataCreate(alloc, buffer, buffer_size);
 
-        /* Create the buffer for receive. */
-        to_recv = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), 2);
+        /* Clean up the allocation if made. */
+        if (buffer != &static_buffer[0])
+          CFAllocatorDeallocate(alloc, buffer);
+      }
+    }
 
-        /* Fail so error on no memory. */
-        if (!to_recv) {
-          ctxt->_error.error  = ENOMEM;
-          ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
-          break;
-        }
+    if (host)
+      CFRelease(host);
+    if (port)
+      CFRelease(port);
+  }
 
-        /* Make sure to save the buffer for later. */
-        CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer, to_recv);
-        CFRelease(to_recv);
+  if (!result) {
+    struct sockaddr_storage static_buffer;
+    struct sockaddr*        sa      = (struct sockaddr*)&static_buffer;
+    socklen_t               addrlen = sizeof(static_buffer);
+    UInt8                   id[sizeof(struct in6_addr) + sizeof(in_port_t)];
+
+    if (!getpeername(CFSocketGetNative(ctxt->_socket), sa, &addrlen)) {
+      if (sa->sa_family == AF_INET) {
+        in_port_t port = ((struct sockaddr_in*)sa)->sin_port;
+        memmove(id, &(((struct sockaddr_in*)sa)->sin_addr), sizeof(((struct sockaddr_in*)sa)->sin_addr));
+        memmove(id + sizeof(((struct sockaddr_in*)sa)->sin_addr), &port, sizeof(port));
+        result = CFDataCreate(alloc, id, sizeof(((struct sockaddr_in*)sa)->sin_addr) + sizeof(port));
+      } else if (sa->sa_family == AF_INET6) {
+        in_port_t port = ((struct sockaddr_in6*)sa)->sin6_port;
+        memmove(id, &(((struct sockaddr_in6*)sa)->sin6_addr), sizeof(((struct sockaddr_in6*)sa)->sin6_addr));
+        memmove(id + sizeof(((struct sockaddr_in6*)sa)->sin6_addr), &port, sizeof(port));
+        result = CFDataCreate(alloc, id, sizeof(((struct sockaddr_in6*)sa)->sin6_addr) + sizeof(port));
       }
+    }
+  }
 
-      /* If couldn't send everything, trim the buffer. */
-      else if (sent > 0) {
-        UInt8* ptr = CFDataGetMutableBytePtr(to_send);
+  return result;
+}
 
-        /* New length */
-        length -= sent;
+/* static */ CFIndex _SocketStreamSecuritySendVector_NoLock(_CFSocketStreamContext* ctxt, const struct iovec* iov, int iovcnt)
+{
+  /*
+  ** SSLWrite has no gather form, so small pieces are coalesced into a
+  ** single buffer in order to go out as one record instead of one each.
+  ** Only as much as fits is sent; the caller handles the short write.
+  */
+  UInt8   buffer[kSecurityGatherSize];
+  CFIndex length = 0;
+  int     i;
 
-        /* Move the bytes down in the buffer. */
-        memmove(ptr, ptr + sent, length);
+  if (iovcnt == 1 || iov[0].iov_len >= sizeof(buffer))
+    return _SocketStreamSecuritySend_NoLock(ctxt, (const UInt8*)iov[0].iov_base, iov[0].iov_len);
 
-        /* Trim it. */
-        CFDataSetLength(to_send, length);
+  for (i = 0; i < iovcnt && length < sizeof(buffer); i++) {
+    CFIndex piece = iov[i].iov_len;
 
-        /* Re-enable so the rest can be written later. */
-        CFSocketEnableCallBacks(ctxt->_socket, kCFSocketWriteCallBack);
-      }
+    if (piece > (sizeof(buffer) - length))
+      piece = sizeof(buffer) - length;
 
-      /* If got an error other than EAGAIN, set the error in the context. */
-      else if ((error.error != EAGAIN) || (error.domain != kCFStreamErrorDomainPOSIX))
-        memmove(&ctxt->_error, &error, sizeof(error));
-    }
+    memmove(buffer + length, iov[i].iov_base, piece);
+    length += piece;
+  }
 
-    else {
-      UInt8*  ptr    = CFDataGetMutableBytePtr(to_recv);
-      CFIndex length = CFDataGetLength(to_recv);
+  return _SocketStreamSecuritySend_NoLock(ctxt, buffer, length);
+}
 
-      if (length != kSOCKSv5BufferMaximum) {
-        CFStreamError error = {0, 0};
-        CFIndex       recvd = _CFSocketRecv(ctxt->_socket, ptr + length, kSOCKSv5BufferMaximum - length, &error);
+static CFSpinLock_t      gSecurityRecvPoolLock = 0;
+static CFMutableArrayRef gSecurityRecvPool     = NULL; /* Idle kSecurityBufferSize CFMutableData's */
 
-        /* If read 0 bytes, this is an early close from the other side. */
-        if (recvd == 0) {
-          /* Mark as not connected. */
-          ctxt->_error.error  = ENOTCONN;
-          ctxt->_error.domain = _kCFStreamErrorDomainNativeSockets;
-        }
+/* static */ CFIndex _SocketStreamSecurityRecv_NoLock(_CFSocketStreamContext* ctxt, UInt8* buffer, CFIndex length, CFStreamError* error)
+{
+  /*
+  ** This is where SSL gets its encrypted bytes.  They're served out of
+  ** the buffer, which only goes to the socket when it can't satisfy the
+  ** request, and then for as much as fits.  Returns the count copied, 0
+  ** at the end, or -1 with the error set; EAGAIN if there is no more yet.
+  */
 
-        /* Successfully read? */
-        else if (recvd > 0) {
-          UInt8 tmp[kSOCKSv5BufferMaximum];
+  CFMutableDataRef             state = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySecurityRecvBufferCount);
+  CFMutableDataRef             block = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySecurityRecvBuffer);
+  _CFSocketStreamSecurityRecv* recv;
 
-          /* Set the length of the buffer. */
-          length += recvd;
+  memset(error, 0, sizeof(error[0]));
 
-          /* CF is so kind as to zero the bytes on SetLength, even though it's a fixed capacity. */
-          memmove(tmp, ptr, length);
+  /* The state is made once and kept for the life of the stream. */
+  if (!state) {
+    if (!(state = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), sizeof(recv[0])))) {
+      error->error  = ENOMEM;
+      error->domain = kCFStreamErrorDomainPOSIX;
+      return -1;
+    }
 
-          /* Set the length of the buffer. */
-          CFDataSetLength(to_recv, length);
+    CFDataSetLength(state, sizeof(recv[0]));
+    memset(CFDataGetMutableBytePtr(state), 0, sizeof(recv[0]));
 
-          /* Put the bytes back. */
-          memmove(ptr, tmp, length);
+    CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySecurityRecvBufferCount, state);
+    CFRelease(state);
+  }
 
-          /* Re-enable after performing a successful read. */
-          CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
-        }
+  recv = (_CFSocketStreamSecurityRecv*)CFDataGetMutableBytePtr(state);
 
-        /* If got an error other than EAGAIN, set the error in the context. */
-        else if ((error.error != EAGAIN) || (error.domain != kCFStreamErrorDomainPOSIX))
-          memmove(&ctxt->_error, &error, sizeof(error));
-      }
+  if ((recv->_count < length) && !recv->_drained && !recv->_closed) {
+    UInt8*  ptr;
+    CFIndex space, r;
 
-      /* Is there enough now? */
-      if (length == kSOCKSv5BufferMaximum) {
-        /* Status must be 0x00 for success. */
-        if (ptr[1]) {
-          ctxt->_error.domain = kCFStreamErrorDomainSOCKS;
-          ctxt->_error.error  = ((kCFStreamErrorSOCKS5SubDomainUserPass << 16) | (ptr[1] & 0x000000FF));
-          break;
-        }
+    /* Borrow a buffer if not holding one. */
+    if (!block) {
+      __CFSpinLock(&gSecurityRecvPoolLock);
 
-        CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
-        _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv5UserPassHandshake_NoLock);
+      if (gSecurityRecvPool && CFArrayGetCount(gSecurityRecvPool)) {
+        CFIndex last = CFArrayGetCount(gSecurityRecvPool) - 1;
+
+        block = (CFMutableDataRef)CFRetain(CFArrayGetValueAtIndex(gSecurityRecvPool, last));
+        CFArrayRemoveValueAtIndex(gSecurityRecvPool, last);
       }
-    }
-  } while (0);
 
-  /* If there was an error remove the handshake. */
-  if (ctxt->_error.error)
-    _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv5Handshake_NoLock);
-}
+      __CFSpinUnlock(&gSecurityRecvPoolLock);
 
-/* static */ void _PerformSOCKSv4Handshake_NoLock(_CFSocketStreamContext* ctxt)
-{
-  do {
-    /* Get the buffer of stuff to send */
-    CFMutableDataRef to_send = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
-    CFMutableDataRef to_recv = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
+      /* Buffers go back to a shared pool, so they come from the default allocator. */
+      if (!block && (block = CFDataCreateMutable(kCFAllocatorDefault, 0)))
+        CFDataSetLength(block, kSecurityBufferSize);
 
-    /* Send anything that is waiting. */
-    if (to_send) {
-      CFStreamError error  = {0, 0};
-      CFIndex       length = CFDataGetLength(to_send);
-      CFIndex       sent   = _CFSocketSend(ctxt->_socket, CFDataGetBytePtr(to_send), length, &error);
+      if (!block) {
+        error->error  = ENOMEM;
+        error->domain = kCFStreamErrorDomainPOSIX;
+        return -1;
+      }
 
-      /* If sent everything, dump the buffer. */
-      if (sent == length)
-        CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
+      CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySecurityRecvBuffer, block);
+      CFRelease(block);
+    }
 
-      /* If couldn't send everything, trim the buffer. */
-      else if (sent > 0) {
-        UInt8* ptr = CFDataGetMutableBytePtr(to_send);
+    ptr = CFDataGetMutableBytePtr(block);
 
-        /* New length */
-        length -= sent;
+    /* What's waiting is less than asked for, so at most part of a record; slide it down to make one run of room. */
+    if (recv->_start) {
+      memmove(ptr, ptr + recv->_start, recv->_count);
+      recv->_start = 0;
+    }
 
-        /* Move the bytes down in the buffer. */
-        memmove(ptr, ptr + sent, length);
+    space = kSecurityBufferSize - recv->_count;
+    r     = _CFSocketRecv(ctxt->_socket, ptr + recv->_count, space, error);
 
-        /* Trim it. */
-        CFDataSetLength(to_send, length);
+    __CFBitClear(ctxt->_flags, kFlagBitRecvdRead);
 
-        /* Re-enable so the rest can be written later. */
-        CFSocketEnableCallBacks(ctxt->_socket, kCFSocketWriteCallBack);
-      }
+    if (r > 0) {
+      recv->_count  += r;
 
-      /* If got an error other than EAGAIN, set the error in the context. */
-      else if ((error.error != EAGAIN) || (error.domain != kCFStreamErrorDomainPOSIX))
-        memmove(&ctxt->_error, &error, sizeof(error));
+      /* Coming up short means the socket is empty for now. */
+      recv->_drained = (r < space);
     }
 
-    else {
-      UInt8*  ptr;
-      CFIndex length;
+    else if (!r)
+      recv->_closed = TRUE;
 
-      /* If there is no receive buffer, need to create it. */
-      if (!to_recv) {
-        /* SOCKSv4 uses only an 8 byte buffer. */
-        to_recv = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), kSOCKSv4BufferMaximum);
+    else if ((error->domain == _kCFStreamErrorDomainNativeSockets) && (EAGAIN == error->error)) {
+      recv->_drained = TRUE;
+      memset(error, 0, sizeof(error[0]));
+    }
 
-        /* Did it create? */
-        if (!to_recv) {
-          /* Set no memory error and bail. */
-          ctxt->_error.error  = ENOMEM;
-          ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+    /* A real error. */
+    else
+      return -1;
 
-          /* Fail now. */
-          break;
-        }
+    /* Whatever is done with these bytes, need to hear of more. */
+    if (!recv->_closed)
+      CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
+  }
 
-        /* Add it to the properties. */
-        CFDictionaryAddValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer, to_recv);
+  else
+    __CFBitSet(ctxt->_flags, kFlagBitRecvdRead);
 
-        CFRelease(to_recv);
-      }
+  if (!recv->_count) {
+    if (recv->_closed)
+      return 0;
 
-      ptr    = CFDataGetMutableBytePtr(to_recv);
-      length = CFDataGetLength(to_recv);
+    error->error  = EAGAIN;
+    error->domain = _kCFStreamErrorDomainNativeSockets;
+    return -1;
+  }
 
-      if (length != kSOCKSv4BufferMaximum) {
-        CFStreamError error = {0, 0};
-        CFIndex       recvd = _CFSocketRecv(ctxt->_socket, ptr + length, kSOCKSv4BufferMaximum - length, &error);
+  if (length > recv->_count)
+    length = recv->_count;
 
-        /* If read 0 bytes, this is an early close from the other side. */
-        if (recvd == 0) {
-          /* Mark as not connected. */
-          ctxt->_error.error  = ENOTCONN;
-          ctxt->_error.domain = _kCFStreamErrorDomainNativeSockets;
-        }
+  memmove(buffer, CFDataGetBytePtr(block) + recv->_start, length);
 
-        /* Successfully read? */
-        else if (recvd > 0) {
-          UInt8 tmp[kSOCKSv4BufferMaximum];
+  recv->_start += length;
+  recv->_count -= length;
 
-          /* Set the length of the buffer. */
-          length += recvd;
+  /* Nothing to hold on to, so let another stream use the buffer. */
+  if (!recv->_count)
+    _SocketStreamSecurityRecvRelease_NoLock(ctxt);
 
-          /* CF is so kind as to zero the bytes on SetLength, even though it's a fixed capacity. */
-          memmove(tmp, ptr, length);
+  return length;
+}
 
-          /* Set the length of the buffer. */
-          CFDataSetLength(to_recv, length);
+/* static */ void _SocketStreamSecurityRecvStartPass_NoLock(_CFSocketStreamContext* ctxt)
+{
+  /* Called on the way into each pass of decrypting, since new bytes may have arrived. */
+  CFMutableDataRef state = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySecurityRecvBufferCount);
 
-          /* Put the bytes back. */
-          memmove(ptr, tmp, length);
+  if (state)
+    ((_CFSocketStreamSecurityRecv*)CFDataGetMutableBytePtr(state))->_drained = FALSE;
+}
 
-          /* Re-enable after performing a successful read. */
-          CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
-        }
+/* static */ CFIndex _SocketStreamSecurityRecvGetCount_NoLock(_CFSocketStreamContext* ctxt)
+{
+  CFDataRef state = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySecurityRecvBufferCount);
 
-        /* If got an error other than EAGAIN, set the error in the context. */
-        else if ((error.error != EAGAIN) || (error.domain != kCFStreamErrorDomainPOSIX))
-          memmove(&ctxt->_error, &error, sizeof(error));
-      }
+  return state ? ((const _CFSocketStreamSecurityRecv*)CFDataGetBytePtr(state))->_count : 0;
+}
 
-      /* Is there enough now? */
-      if (length == kSOCKSv4BufferMaximum) {
-        /* If successful, remove the handshake. */
-        if ((ptr[0] == 0) && (ptr[1] == 90))
-          _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv4Handshake_NoLock);
+/* static */ void _SocketStreamSecurityRecvRelease_NoLock(_CFSocketStreamContext* ctxt)
+{
+  /* Gives the buffer back to the pool, dropping anything still in it. */
+  CFMutableDataRef state = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySecurityRecvBufferCount);
+  CFMutableDataRef block = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySecurityRecvBuffer);
 
-        /* Set the error based upon the SOCKS result. */
-        else {
-          ctxt->_error.error  = (kCFStreamErrorSOCKS4SubDomainResponse << 16) | (((ptr[0] == 0) ? ptr[1] : -1) & 0x0000FFFF);
-          ctxt->_error.domain = kCFStreamErrorDomainSOCKS;
-        }
+  if (state) {
+    ((_CFSocketStreamSecurityRecv*)CFDataGetMutableBytePtr(state))->_start = 0;
+    ((_CFSocketStreamSecurityRecv*)CFDataGetMutableBytePtr(state))->_count = 0;
+  }
 
-        /* Toss this as it's not needed anymore. */
-        CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSRecvBuffer);
-      }
-    }
-  } while (0);
+  if (block) {
+    __CFSpinLock(&gSecurityRecvPoolLock);
 
-  /* If there was an error remove the handshake. */
-  if (ctxt->_error.error)
-    _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv4Handshake_NoLock);
+    if (!gSecurityRecvPool)
+      gSecurityRecvPool = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+
+    /* Past the pool's limit, the buffer goes away with the property. */
+    if (gSecurityRecvPool && (CFArrayGetCount(gSecurityRecvPool) < kSecurityBufferPoolSize))
+      CFArrayAppendValue(gSecurityRecvPool, block);
+
+    __CFSpinUnlock(&gSecurityRecvPoolLock);
+
+    CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySecurityRecvBuffer);
+  }
 }
 
-/* static */ Boolean _SOCKSSetInfo_NoLock(_CFSocketStreamContext* ctxt, CFDictionaryRef settings)
+#endif
+
+#if defined(__MACH__)
+/* static */ OSStatus _SecurityReadFunc_NoLock(_CFSocketStreamContext* ctxt, void* data, UInt32* dataLength)
 {
-  CFDictionaryRef old = CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySOCKSProxy);
+  /* This is the read function used by SecureTransport in order to get bytes off the wire. */
 
-  /*
-  ** Up front check for correct settings type before tossing
-  ** out the existing SOCKS info.  Can only set SOCKS proxy
-  ** if not opened or opening.  Can't use SOCKS if created
-  ** with a connected socket.
-  */
-  if ((settings && (CFDictionaryGetTypeID() != CFGetTypeID(settings))) || __CFBitIsSet(ctxt->_flags, kFlagBitOpenComplete) ||
-      __CFBitIsSet(ctxt->_flags, kFlagBitOpenStarted) || __CFBitIsSet(ctxt->_flags, kFlagBitCreatedNative)) {
-    return FALSE;
+  /* NOTE that SSL reads bytes out of a buffer of encrypted bytes; see _SocketStreamSecurityRecv_NoLock. */
+
+  CFStreamError error;
+  UInt32        try = *dataLength;
+  CFIndex       r   = _SocketStreamSecurityRecv_NoLock(ctxt, (UInt8*)data, try, &error);
+
+  /* If no bytes read, return closed.  If couldn't read all, return "would block." */
+  if (r >= 0) {
+    *dataLength = r;
+    return (!r ? errSSLClosedAbort : (try == r) ? 0 : errSSLWouldBlock);
   }
 
-  if (!old || !CFEqual(old, settings)) {
-    /* Removing the SOCKS proxy? */
-    if (!settings) {
-      /* Remove the settings. */
-      CFDictionaryRemoveValue(ctxt->_properties, kCFStreamPropertySOCKSProxy);
+  /* Error condition means no bytes read. */
+  *dataLength = 0;
 
-      /* Remove the handshake (removes both to make sure neither socks is set). */
-      _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv4Handshake_NoLock);
-      _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSOCKSv5Handshake_NoLock);
-    }
+  /* If it's a "would block," return such. */
+  if ((error.domain == _kCFStreamErrorDomainNativeSockets) && (EAGAIN == error.error))
+    return errSSLWouldBlock;
 
-    /* Client is setting the proxy. */
-    else {
-      CFStringRef name          = NULL;
-      CFStringRef user          = (CFStringRef)CFDictionaryGetValue(settings, kCFStreamPropertySOCKSUser);
-      CFStringRef pass          = (CFStringRef)CFDictionaryGetValue(settings, kCFStreamPropertySOCKSPassword);
-      CFStringRef version       = _GetSOCKSVersion(settings);
-      CFTypeRef   lookup        = CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteHost);
-      CFNumberRef enabled       = CFDictionaryGetValue(settings, _kCFStreamProxySettingSOCKSEnable);
-      SInt32      enabled_value = 0;
+  /* It's a real error, so copy it into the context */
+  memmove(&ctxt->_error, &error, sizeof(error));
 
-      /* Verify that a valid version has been set.  No setting is SOCKSv5. */
-      if (!CFEqual(version, kCFStreamSocketSOCKSVersion4) && !CFEqual(version, kCFStreamSocketSOCKSVersion5))
-        return FALSE;
+  /* A bad error occurred. */
+  return errSSLInternal;
+}
 
-      /* See if this is being pulled directly out of SC and try to do the right thing. */
-      if (enabled && CFNumberGetValue(enabled, kCFNumberSInt32Type, &enabled_value) && !enabled_value) {
-        /* If it's not enabled, this means "don't set it." */
-        CFDictionaryRemoveValue(ctxt->_properties, kCFStreamPropertySOCKSProxy);
+/* static */ OSStatus _SecurityWriteFunc_NoLock(_CFSocketStreamContext* ctxt, const void* data, UInt32* dataLength)
+{
+  /* This is the function used by SecureTransport to write bytes to the wire. */
 
-        return TRUE;
-      }
+  CFStreamError error = {0, 0};
+  UInt32        try   = *dataLength;
 
-      /* Is there far end information for setting up the tunnel? */
-      if (lookup) {
-        /* Get the list of names for setting up the tunnel */
-        CFArrayRef list = CFHostGetNames((CFHostRef)lookup, NULL);
+  /* Write what the ST tells. */
+  *dataLength         = _CFSocketSend(ctxt->_socket, data, *dataLength, &error);
 
-        /* Good with at least one name? */
-        if (list && CFArrayGetCount(list))
-          name = (CFStringRef)CFRetain((CFTypeRef)CFArrayGetValueAtIndex(list, 0));
+  /* If no error, return noErr, or if couldn't write everything, return the "would block." */
+  if (!error.error)
+    return ((try == *dataLength) ? 0 : errSSLWouldBlock);
 
-        /* No name, but can create one with an IP. */
-        else {
-          /* Is there one good address to create a name? */
-          list = CFHostGetAddressing((CFHostRef)lookup, NULL);
-          if (list && CFArrayGetCount(list)) {
-            name = _CFNetworkCFStringCreateWithCFDataAddress(CFGetAllocator(list), (CFDataRef)CFArrayGetValueAtIndex(list, 0));
-          }
-        }
-      }
+  /* Error condition means no bytes written. */
+  *dataLength = 0;
 
-      /* No host, but is there a possible CFNetService? */
-      else if ((lookup = CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteNetService))) {
-        /* Can't perform SOCKS to a CFNetService. */
-        return FALSE;
-      }
+  /* If it was a "would block," return such. */
+  if ((error.domain == _kCFStreamErrorDomainNativeSockets) && (EAGAIN == error.error))
+    return errSSLWouldBlock;
 
-      /* Fail if there is no way to put together a SOCKS request. */
-      if (!name) {
-        /* SOCKSv4 can attempt the resolve to get the name. */
-        if (!CFEqual(version, kCFStreamSocketSOCKSVersion4))
-          return FALSE;
-      }
+  /* Copy the real error into place. */
+  memmove(&ctxt->_error, &error, sizeof(error));
 
-      else {
-        /* The maximum hostname length to be packed is 255 in SOCKSv5 */
-        CFIndex length = CFStringGetLength(name);
+  /* Something bad happened. */
+  return errSSLInternal;
+}
 
-        /* Check to see if need this proxy for the intended host. */
-        if (!_CFNetworkDoesNeedProxy(name, CFDictionaryGetValue(settings, kCFStreamPropertyProxyExceptionsList),
-                                     CFDictionaryGetValue(settings, kCFStreamPropertyProxyLocalBypass))) {
-          CFRelease(name);
-          return FALSE;
-        }
+/* static */ CFIndex _SocketStreamSecuritySend_NoLock(_CFSocketStreamContext* ctxt, const UInt8* buffer, CFIndex length)
+{
+  CFIndex bytesWritten = 0;
 
-        CFRelease(name);
+  SSLContextRef ssl    = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
 
-        /* SOCKSv5 requires that the host name be a maximum of 255. */
-        if (CFEqual(version, kCFStreamSocketSOCKSVersion5) && ((length <= 0) || (length > 255)))
-          return FALSE;
-      }
+  /* Try to write bytes on the socket. */
+  OSStatus result      = SSLWrite(ssl, buffer, length, (size_t*)(&bytesWritten));
+
+  /* Check to see if error was set during the write. */
+  if (ctxt->_error.error)
+    return -1;
+
+  /* If the stream wrote bytes but then got a blocking error, pass it as success. */
+  if ((result == errSSLWouldBlock) && bytesWritten) {
+    _SocketStreamAddHandshake_NoLock(ctxt, _PerformSecuritySendHandshake_NoLock);
+    result = noErr;
+  }
 
-      /* SOCKSv5 maximum password length if given is 255. */
-      if (CFEqual(version, kCFStreamSocketSOCKSVersion5) && pass && (CFStringGetLength(pass) > 255))
-        return FALSE;
+  /* Deal with result. */
+  switch (result) {
+    case errSSLClosedGraceful: /* Non-fatal error */
+    case errSSLClosedAbort:    /* Assumed non-fatal error (but may not be) **FIXME** ?? */
 
-      if (user) {
-        /* SOCKSv4 maximum user name length is 512. */
-        if (CFEqual(version, kCFStreamSocketSOCKSVersion4) && (CFStringGetLength(user) > 512))
-          return FALSE;
+      /* Mark SSL as closed.  There could still be bytes in the buffers. */
+      __CFBitSet(ctxt->_flags, kFlagBitClosed);
 
-        /* SOCKSv5 maximum user name length is 255. */
-        else if (CFEqual(version, kCFStreamSocketSOCKSVersion5) && (CFStringGetLength(user) > 255))
-          return FALSE;
-      }
+      /* NOTE the fall through. */
 
-      /* Add the handshake to the list to perform. */
-      if (!_SocketStreamAddHandshake_NoLock(
-              ctxt, CFEqual(version, kCFStreamSocketSOCKSVersion4) ? _PerformSOCKSv4Handshake_NoLock : _PerformSOCKSv5Handshake_NoLock))
-        return FALSE;
+    case noErr:
+      break;
 
-      /* Put the new setting in place, removing the old if previously set. */
-      CFDictionarySetValue(ctxt->_properties, kCFStreamPropertySOCKSProxy, settings);
-    }
+    default:
+      ctxt->_error.error  = result;
+      ctxt->_error.domain = kCFStreamErrorDomainSSL;
+      return -1;
   }
 
-  return TRUE;
+  return bytesWritten;
 }
 
-/* static */ void _SocketStreamSOCKSHandleLookup_NoLock(_CFSocketStreamContext* ctxt, CFHostRef lookup)
+/* static */ void _SocketStreamSecurityBufferedRead_NoLock(_CFSocketStreamContext* ctxt)
 {
-  int               i;
-  CFArrayRef        addresses;
-  CFStringRef       name = NULL;
-  CFMutableArrayRef loops[3];
-  CFIndex           user_len = 0;
-  CFIndex           extra    = 0;
-  CFMutableDataRef  buffer;
-  CFDictionaryRef   settings = (CFDictionaryRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySOCKSProxy);
-  CFStringRef       user     = (CFStringRef)CFDictionaryGetValue(settings, kCFStreamPropertySOCKSUser);
-  UInt8*            ptr      = NULL;
+  /*
+  ** This function is used to read bytes out of the encrypted buffer and
+  ** into the unencrypted buffer.
+  */
 
-  CFNumberRef port           = CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRemotePort);
+  struct iovec             iov[2];
+  OSStatus                 status = noErr;
 
-  /* Remove the lookup from the schedulables since it's done. */
-  _SchedulablesRemove(ctxt->_schedulables, lookup);
+  SSLContextRef            ssl    = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
 
-  /* Invalidate it so no callbacks occur. */
-  _CFTypeInvalidate(lookup);
+  /* Get the bits required in order to work with the buffer. */
+  _CFSocketStreamRecvRing* ring   = _SocketStreamGetRecvRing_NoLock(ctxt);
 
-  /* Grab the list of run loops and modes for unscheduling. */
-  loops[0] = ctxt->_readloops;
-  loops[1] = ctxt->_writeloops;
-  loops[2] = ctxt->_sharedloops;
+  /* Failure to create the ring already set the error. */
+  if (!ring)
+    return;
 
-  /* Make sure to remove the lookup from all loops and modes. */
-  for (i = 0; i < (sizeof(loops) / sizeof(loops[0])); i++)
-    _CFTypeUnscheduleFromMultipleRunLoops(lookup, loops[i]);
+  /* Only read if there is room in the buffer. */
+  if (ring->_count + ring->_lent < ring->_limit) {
+    CFIndex start = ring->_count;
 
-  /* Get the list of addresses. */
-  addresses = CFHostGetAddressing((CFHostRef)lookup, NULL);
+    _SocketStreamSecurityRecvStartPass_NoLock(ctxt);
 
-  /* If no addresses, go for the name. */
-  if (!addresses || !CFArrayGetCount(addresses))
-    name = (CFStringRef)CFArrayGetValueAtIndex(CFHostGetNames((CFHostRef)lookup, NULL), 0);
+    /* Keep reading out of the encrypted buffer until an error or full. */
+    while (!status && _SocketStreamRecvRingGetSpace_NoLock(ctxt, ring, iov)) {
+      CFIndex bytesRead = 0;
 
-  /* Find the overhead for the user name if one. */
-  if (user) {
-    user_len = CFStringGetBytes(user, CFRangeMake(0, CFStringGetLength(user)), kCFStringEncodingUTF8, 0, FALSE, NULL, 0, NULL);
-  }
+      /* Read out of the encrypted and into the unencrypted, one contiguous piece at a time. */
+      status            = SSLRead(ssl, iov[0].iov_base, iov[0].iov_len, (size_t*)(&bytesRead));
 
-  /* Add for null termination. */
-  user_len += 1;
+      /* If did read bytes, increase the count. */
+      if (bytesRead > 0)
+        ring->_count += bytesRead;
+    }
 
-  if (name) {
-    /* What's the cost in bytes of the host name? */
-    extra = CFStringGetBytes(name, CFRangeMake(0, CFStringGetLength(name)), kCFStringEncodingUTF8, 0, FALSE, NULL, 0, NULL);
-    extra += 1;
+    /* If didn't read bytes and the buffer is empty but SSL hasn't closed, need read events again. */
+    if ((ring->_count == start) && (ring->_count == 0) && !__CFBitIsSet(ctxt->_flags, kFlagBitClosed))
+      CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
   }
 
-  /* Create the send buffer. */
-  buffer = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), 8 + extra + user_len);
-
-  /* If failed, set the no memory error and return. */
-  if (!buffer) {
-    ctxt->_error.error  = ENOMEM;
-    ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+  _SocketStreamSecurityReadStatus_NoLock(ctxt, ssl, status, ring->_count);
+}
 
-    return; /* NOTE the early return. */
-  }
+/* static */ CFIndex _SocketStreamSecurityDirectRead_NoLock(_CFSocketStreamContext* ctxt, UInt8* buffer, CFIndex length)
+{
+  /* Same as above, but into the client's buffer, which saves copying through the unencrypted buffer. */
 
-  /* Extend out the length to the full capacity. */
-  CFDataSetLength(buffer, 8 + extra + user_len);
+  CFIndex       result = 0;
+  OSStatus      status = noErr;
 
-  /* Add it to the properties for future. */
-  CFDictionaryAddValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer, buffer);
-  CFRelease(buffer);
+  SSLContextRef ssl    = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
 
-  /* Get the pointer for easier manipulation. */
-  ptr = CFDataGetMutableBytePtr(buffer);
+  _SocketStreamSecurityRecvStartPass_NoLock(ctxt);
 
-  /* Zero out even though SetLength probably did. */
-  memset(ptr, 0, CFDataGetLength(buffer));
+  /* Take as many records as are in and fit. */
+  while (!status && (result < length)) {
+    CFIndex bytesRead = 0;
 
-  /* If a name was set, there was no address. */
-  if (name) {
-    /* Copy the name into the buffer.  */
-    CFStringGetBytes(name, CFRangeMake(0, CFStringGetLength(name)), kCFStringEncodingUTF8, 0, FALSE, ptr + 8 + user_len - 1, extra, NULL);
+    status = SSLRead(ssl, buffer + result, length - result, (size_t*)(&bytesRead));
 
-    /* Cap with a null. */
-    ptr[8 + user_len + extra - 1] = '\0';
+    if (bytesRead > 0)
+      result += bytesRead;
   }
 
-  /* Use an address instead of a name. */
-  else {
-    CFIndex i, count = CFArrayGetCount(addresses);
+  if (!result && !__CFBitIsSet(ctxt->_flags, kFlagBitClosed))
+    CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
 
-    /* Loop through looking for a valid IPv4 address.  SOCKSv4 doesn't do IPv6. */
-    for (i = 0; i < count; i++) {
-      struct sockaddr_in* sin = (struct sockaddr_in*)CFDataGetBytePtr(CFArrayGetValueAtIndex(addresses, i));
+  _SocketStreamSecurityReadStatus_NoLock(ctxt, ssl, status, result);
 
-      if (sin->sin_family == AF_INET) {
-        /* Set the IP in the buffer. */
-        memmove(&ptr[4], &sin->sin_addr, sizeof(sin->sin_addr));
+  return result;
+}
 
-        /* If there was no port, it must be in the address. */
-        if (!port)
-          memmove(&ptr[2], &sin->sin_port, sizeof(sin->sin_port));
+/* static */ void _SocketStreamSecurityReadStatus_NoLock(_CFSocketStreamContext* ctxt, SSLContextRef ssl, OSStatus status, CFIndex bytesWaiting)
+{
+  /* Sorts out how a pass of reading ended. */
 
-        break;
-      }
-    }
+  switch (status) {
+    case errSSLClosedGraceful: /* Non-fatal error */
+    case errSSLClosedAbort:    /* Assumed non-fatal error (but may not be) **FIXME** ?? */
 
-    /* Went through all the addresses and found none suitable. */
-    if (i == count) {
-      /* Mark as an invalid parameter */
-      ctxt->_error.error  = EINVAL;
-      ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+      /* SSL has closed, so mark as such. */
+      __CFBitSet(ctxt->_flags, kFlagBitClosed);
+      __CFBitSet(ctxt->_flags, kFlagBitCanRead);
+      __CFBitClear(ctxt->_flags, kFlagBitPollRead);
 
-      /* Remove the buffer, 'cause this isn't going anywhere. */
-      CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySOCKSSendBuffer);
+      /* NOTE the fall through. */
 
-      return; /* NOTE the early return. */
-    }
+    case noErr:
+    case errSSLWouldBlock:
+
+      /* If there are bytes to be read, set the bit. */
+      if (bytesWaiting) {
+        __CFBitSet(ctxt->_flags, kFlagBitCanRead);
+        __CFBitClear(ctxt->_flags, kFlagBitPollRead);
+      }
+      break;
+
+    default:
+      if (!ctxt->_error.error) {
+        ctxt->_error.error  = status;
+        ctxt->_error.domain = kCFStreamErrorDomainSSL;
+      }
+      break;
   }
+}
 
-  /* Set the protocol version and "CONNECT" command. */
-  ptr[0] = 0x04;
-  ptr[1] = 0x01;
+/* static */ void _PerformSecurityHandshake_NoLock(_CFSocketStreamContext* ctxt)
+{
+  OSStatus    result;
+  const void* peerid = NULL;
+  size_t      peeridlen;
 
-  /* If there was a port set, need to copy that. */
-  if (port) {
-    SInt32 value;
+  SSLContextRef ssl = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
 
-    /* Grab the real value. */
-    CFNumberGetValue(port, kCFNumberSInt32Type, &value);
+  /* Make sure the peer id has been set for ST performance. */
+  result            = SSLGetPeerID(ssl, &peerid, &peeridlen);
+  if (!result && !peerid) {
+    CFDataRef id = _SocketStreamSecurityCreatePeerID_NoLock(ctxt);
 
-    /* Place the port into the buffer. */
-    *((UInt16*)(&ptr[2])) = htons(value & 0x0000FFFF);
+    if (id) {
+      SSLSetPeerID(ssl, CFDataGetBytePtr(id), CFDataGetLength(id));
+      CFRelease(id);
+    }
   }
 
-  /* If there was a user name, need to grab its bytes into place. */
-  if (user) {
-    CFStringGetBytes(user, CFRangeMake(0, CFStringGetLength(user)), kCFStringEncodingUTF8, 0, FALSE, ptr + 8, user_len - 1, NULL);
-  }
+  _SocketStreamSecurityRecvStartPass_NoLock(ctxt);
 
-  /* If open has already finished, need to pump this thing along. */
-  if (__CFBitIsSet(ctxt->_flags, kFlagBitOpenComplete)) {
-    CFArrayRef handshakes = (CFArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyHandshakes);
+  /* Perform the SSL handshake. */
+  result = SSLHandshake(ssl);
 
-    /* Only force the "pump" if SOCKS is the head. */
-    if (handshakes && (CFArrayGetValueAtIndex(handshakes, 0) == _PerformSOCKSv4Handshake_NoLock))
-      _PerformSOCKSv4Handshake_NoLock(ctxt);
+  /* If not blocking, can do something. */
+  if (result != errSSLWouldBlock) {
+    /* Was it noErr? */
+    if (result) {
+      ctxt->_error.error  = result;
+      ctxt->_error.domain = kCFStreamErrorDomainSSL;
+    } else {
+      CFBooleanRef check;
+
+      check = (CFBooleanRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySSLAllowAnonymousCiphers);
+      if (!check || (CFBooleanGetValue(check) == FALSE)) {
+        SSLCipherSuite cipherSuite;
+
+        if (SSLGetNegotiatedCipher(ssl, &cipherSuite) == noErr) {
+          if (cipherSuite == SSL_DH_anon_EXPORT_WITH_RC4_40_MD5 || cipherSuite == SSL_DH_anon_WITH_RC4_128_MD5 ||
+              cipherSuite == SSL_DH_anon_EXPORT_WITH_DES40_CBC_SHA || cipherSuite == SSL_DH_anon_WITH_DES_CBC_SHA ||
+              cipherSuite == SSL_DH_anon_WITH_3DES_EDE_CBC_SHA || cipherSuite == SSL_RSA_WITH_NULL_MD5 ||
+              cipherSuite == TLS_DH_anon_WITH_AES_128_CBC_SHA || cipherSuite == TLS_DH_anon_WITH_AES_256_CBC_SHA) {
+            /* close the connnection and return errSSLBadCipherSuite */
+            (void)SSLClose(ssl);
+            ctxt->_error.error  = errSSLBadCipherSuite;
+            ctxt->_error.domain = kCFStreamErrorDomainSSL;
+          }
+        }
+      }
+    }
+
+    /* Either way, it's done.  Mark the SSL bit for performance checks. */
+    __CFBitSet(ctxt->_flags, kFlagBitUseSSL);
+    __CFBitSet(ctxt->_flags, kFlagBitIsBuffered);
+    _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSecurityHandshake_NoLock);
   }
 }
 
-#pragma mark - * CONNECT Support
-
-/* static */ void _CreateNameAndPortForCONNECTProxy(CFDictionaryRef properties, CFStringRef* name, CFNumberRef* port, CFStreamError* error)
+/* static */ void _PerformSecuritySendHandshake_NoLock(_CFSocketStreamContext* ctxt)
 {
-  CFTypeRef      lookup;
-  CFDataRef      addr  = NULL;
-  CFAllocatorRef alloc = CFGetAllocator(properties);
+  OSStatus result;
+  CFIndex  bytesWritten;
 
-  /* NOTE that this function is used for setting the SSL peer ID for connections other than CONNECT tunnelling. */
+  SSLContextRef ssl = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
+
+  /* Attempt to write. */
+  result            = SSLWrite(ssl, NULL, 0, (size_t*)(&bytesWritten));
+
+  /* If didn't get a block, can do something. */
+  if (result == errSSLWouldBlock)
+    CFSocketEnableCallBacks(ctxt->_socket, kCFSocketWriteCallBack);
+  else {
+    /* Remove the "send" handshake. */
+    _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSecuritySendHandshake_NoLock);
+
+    /* Need to save real errors. */
+    if (result) {
+      ctxt->_error.error  = result;
+      ctxt->_error.domain = kCFStreamErrorDomainSSL;
+    }
+  }
+}
 
-  *name                = NULL;
-  *port                = NULL;
+/* static */ void _SocketStreamSecurityClose_NoLock(_CFSocketStreamContext* ctxt)
+{
+  /*
+  ** This function is required during close in order to fully flush ST
+  ** and dump the SSLContextRef.
+  */
 
-  /* No error to start */
-  memset(error, 0, sizeof(error[0]));
+  SSLContextRef ssl = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
 
-  /* Try to simply get the port from the properties. */
-  *port = (CFNumberRef)CFDictionaryGetValue(properties, _kCFStreamPropertySocketRemotePort);
+  /* Attempt to close and flush out any bytes. */
+  while (!ctxt->_error.error && (errSSLWouldBlock == SSLClose(ssl))) {
+    CFTypeRef loopAndMode[2] = {CFRunLoopGetCurrent(), _kCFStreamSocketSecurityClosePrivateMode};
 
-  /* Try to get the service for which the streams were created. */
-  if ((lookup = (CFTypeRef)CFDictionaryGetValue(properties, kCFStreamPropertySocketRemoteNetService))) {
-    /* Does it have a name?  These are checked at set, but just in case they go away. */
-    *name = CFNetServiceGetTargetHost((CFNetServiceRef)lookup);
+    /* Add the current loop and the private mode to the list */
+    _SchedulesAddRunLoopAndMode(ctxt->_sharedloops, (CFRunLoopRef)loopAndMode[0], (CFStringRef)loopAndMode[1]);
 
-    /* If didn't get a port, need to go to the address to get it. */
-    if (!*port) {
-      /* Get the list of addresses from the service. */
-      CFArrayRef list = CFNetServiceGetAddressing((CFNetServiceRef)lookup);
+    /* Make sure to schedule all the schedulables on this loop and mode. */
+    CFArrayApplyFunction(ctxt->_schedulables, CFRangeMake(0, CFArrayGetCount(ctxt->_schedulables)),
+                         (CFArrayApplierFunction)_SchedulablesScheduleApplierFunction, loopAndMode);
 
-      /* Can only pull one out if it's been resolved. */
-      if (list && CFArrayGetCount(list))
-        addr = CFArrayGetValueAtIndex(list, 0);
-    }
-  }
+    /* Unlock the context to allow things to fire */
+    __CFSpinUnlock(&ctxt->_lock);
 
-  /* No service, so go for the host. */
-  else if ((lookup = (CFTypeRef)CFDictionaryGetValue(properties, kCFStreamPropertySocketRemoteHost))) {
-    /* Get the list of names in order to get one. */
-    CFArrayRef list = CFHostGetNames((CFHostRef)lookup, NULL);
+    /* Run the run loop just waiting for the end. */
+    CFRunLoopRunInMode(_kCFStreamSocketSecurityClosePrivateMode, 1e+20, TRUE);
 
-    /* Pull out the name */
-    if (list && CFArrayGetCount(list))
-      *name = (CFStringRef)CFArrayGetValueAtIndex(list, 0);
+    /* Lock the context back up. */
+    __CFSpinLock(&ctxt->_lock);
 
-    else {
-      /* No name, so get the address as a name instead. */
-      list = CFHostGetAddressing((CFHostRef)lookup, NULL);
+    /* Make sure to unschedule all the schedulables on this loop and mode. */
+    CFArrayApplyFunction(ctxt->_schedulables, CFRangeMake(0, CFArrayGetCount(ctxt->_schedulables)),
+                         (CFArrayApplierFunction)_SchedulablesUnscheduleApplierFunction, loopAndMode);
 
-      /* Get the first address from the list. */
-      if (list && CFArrayGetCount(list))
-        addr = CFArrayGetValueAtIndex(list, 0);
-    }
+    /* Remove this loop and private mode from the list. */
+    _SchedulesRemoveRunLoopAndMode(ctxt->_sharedloops, (CFRunLoopRef)loopAndMode[0], (CFStringRef)loopAndMode[1]);
   }
 
-  /* If there is no information at all, error and bail. */
-  if (!*port && !*name && !addr) {
-    error->error  = EINVAL;
-    error->domain = kCFStreamErrorDomainPOSIX;
-    return; /* NOTE the early return */
-  }
+  /* Destroy the SSLContext. */
+  SSLDisposeContext(ssl);
 
-  /* Got a port?  If so, just retain it. */
-  if (*port)
-    CFRetain(*port);
+  /* Remove it from the properties for no touch. */
+  CFDictionaryRemoveValue(ctxt->_properties, kCFStreamPropertySocketSSLContext);
+  _SocketStreamSecurityRecvRelease_NoLock(ctxt);
+}
 
-  else {
-    SInt32           p;
-    struct sockaddr* sa = (struct sockaddr*)CFDataGetBytePtr(addr);
+/* static */ Boolean _SocketStreamSecuritySetContext_NoLock(_CFSocketStreamContext* ctxt, CFDataRef value)
+{
+  CFDataRef     wrapper  = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext);
+  SSLContextRef old      = wrapper ? *((SSLContextRef*)CFDataGetBytePtr(wrapper)) : NULL;
+  SSLContextRef security = value ? *((SSLContextRef*)CFDataGetBytePtr(value)) : NULL;
 
-    /* Need to go to the socket address in order to get the port value */
-    switch (sa->sa_family) {
-      case AF_INET:
-        p     = ntohs(((struct sockaddr_in*)sa)->sin_port);
-        *port = CFNumberCreate(alloc, kCFNumberSInt32Type, &p);
-        break;
+  if (old) {
+    /* Can only do something if idle (not opened). */
+    if (_SocketStreamSecurityGetSessionState_NoLock(ctxt) != kSSLIdle)
+      return FALSE;
 
-      case AF_INET6:
-        p     = ntohs(((struct sockaddr_in6*)sa)->sin6_port);
-        *port = CFNumberCreate(alloc, kCFNumberSInt32Type, &p);
-        break;
+    /* If not setting the same, destroy the old. */
+    if (security != old)
+      SSLDisposeContext(old);
 
-      default:
-        /* Not a known type.  Return an error. */
-        error->error  = EINVAL;
-        error->domain = kCFStreamErrorDomainPOSIX;
-        return; /* NOTE the early return */
-    }
+    /* Remove the one that was there. */
+    CFDictionaryRemoveValue(ctxt->_properties, kCFStreamPropertySocketSSLContext);
   }
 
-  /* Either retain the current name or create one from the address. */
-  if (*name)
-    CFRetain(*name);
-  else
-    *name = _CFNetworkCFStringCreateWithCFDataAddress(alloc, addr);
+  /* If not setting a new one, remove what's there. */
+  if (!security) {
+    /* Remove the one that was there. */
+    CFDictionaryRemoveValue(ctxt->_properties, kCFStreamPropertySocketSSLContext);
 
-  /* If either failed, need to error out. */
-  if (!*name || !*port) {
-    /* Release anything that was created/retained. */
-    if (*name)
-      CFRelease(*name);
-    if (*port)
-      CFRelease(*port);
+    /* Get rid of the SSL handshake. */
+    _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSecurityHandshake_NoLock);
 
-    /* Set the out of memory error. */
-    error->error  = ENOMEM;
-    error->domain = kCFStreamErrorDomainPOSIX;
+    return TRUE;
   }
-}
 
-/* static */ void _PerformCONNECTHandshake_NoLock(_CFSocketStreamContext* ctxt)
-{
-  UInt8            buffer[2048];
-  CFIndex          count;
-  CFStreamError    error    = {0, 0};
-  CFAllocatorRef   alloc    = CFGetAllocator(ctxt->_properties);
-  CFHTTPMessageRef response = (CFHTTPMessageRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertyCONNECTResponse);
+  /* Set the read/write functions on the context and set the reference. */
+  if ((!(ctxt->_error.error = SSLSetIOFuncs(security, (SSLReadFunc)_SecurityReadFunc_NoLock, (SSLWriteFunc)_SecurityWriteFunc_NoLock))) &&
+      (!(ctxt->_error.error = SSLSetConnection(security, (SSLConnectionRef)ctxt)))) {
+    /* Add the handshake to the list of things to perform. */
+    Boolean result = _SocketStreamAddHandshake_NoLock(ctxt, _PerformSecurityHandshake_NoLock);
 
-  /* NOTE, use the lack of response to mean that need to send first. */
-  if (!response) {
-    CFIndex   length;
-    CFDataRef left = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyCONNECTSendBuffer);
+    /* If added, save the context. */
+    if (result)
+      CFDictionarySetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext, value);
 
-    /* If there is nothing waiting, haven't put anything together. */
-    if (!left) {
-      CFDictionaryRef  headers;
-      CFHTTPMessageRef request = NULL;
-      CFStringRef      version, name = NULL;
-      CFDictionaryRef  proxy = (CFDictionaryRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertyCONNECTProxy);
+    return result;
+  }
 
-      /* Get the intended version of HTTP. */
-      version                = (CFStringRef)CFDictionaryGetValue(proxy, kCFStreamPropertyCONNECTVersion);
+  /* Error was set, so set the domain. */
+  ctxt->_error.domain = kCFStreamErrorDomainSSL;
 
-      do {
-        SInt32      p;
-        CFURLRef    url;
-        CFNumberRef port;
-        CFStringRef urlstr;
+  return FALSE;
+}
 
-        /* Figure out what the far end name and port are. */
-        _CreateNameAndPortForCONNECTProxy(ctxt->_properties, &name, &port, &ctxt->_error);
+/* static */ Boolean _SocketStreamSecuritySetInfo_NoLock(_CFSocketStreamContext* ctxt, CFDictionaryRef settings)
+{
+  SSLContextRef security = NULL;
+  CFDataRef     wrapper  = NULL;
 
-        /* Got an error, so bail. */
-        if (ctxt->_error.error)
-          break;
+  /* Try to clear the existing, if any. */
+  if (!_SocketStreamSecuritySetContext_NoLock(ctxt, NULL))
+    return FALSE;
 
-        /* Get the real port value. */
-        CFNumberGetValue(port, kCFNumberSInt32Type, &p);
+  /* If no new settings, done. */
+  if (!settings)
+    return TRUE;
 
-        /* Produce the "CONNECT" url which is <host>:<port>. */
-        urlstr = CFStringCreateWithFormat(alloc, NULL, _kCFStreamCONNECTURLFormat, name, p & 0x0000FFFF);
+  do {
+    CFTypeRef    value = CFDictionaryGetValue(settings, kCFStreamSSLIsServer);
+    CFBooleanRef check = (CFBooleanRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketSecurityAuthenticatesServerCertificate);
 
-        /* Don't need it. */
-        CFRelease(port);
+    /* Create a new SSLContext. */
+    if (SSLNewContext((value && CFEqual(value, kCFBooleanTrue)), &security))
+      break;
 
-        /* Make sure there's an url before continuing on. */
-        if (!urlstr)
-          break;
+    /* Figure out the correct security level to set and set it. */
+    value = CFDictionaryGetValue(settings, kCFStreamSSLLevel);
+    if ((!value || CFEqual(value, kCFStreamSocketSecurityLevelNegotiatedSSL)) && SSLSetProtocolVersion(security, kTLSProtocol1))
+      break;
 
-        /* Create the url based upon the string. */
-        url = CFURLCreateWithString(alloc, urlstr, NULL);
+    else if (value) {
+      if (CFEqual(value, kCFStreamSocketSecurityLevelNone)) {
+        SSLDisposeContext(security);
+        return TRUE;
+      }
 
-        /* Don't need it. */
-        CFRelease(urlstr);
+      else if (CFEqual(value, kCFStreamSocketSecurityLevelSSLv2) && SSLSetProtocolVersion(security, kSSLProtocol2))
+        break;
 
-        /* Must have an url to continue. */
-        if (!url)
-          break;
+      else if (CFEqual(value, kCFStreamSocketSecurityLevelSSLv3) && SSLSetProtocolVersion(security, kSSLProtocol3Only))
+        break;
 
-        /*
-        ** Create the "CONNECT" request.  Default HTTP version is 1.0 if none specified.
-        ** NOTE there are actually some servers which will fail if 1.1 is used.
-        */
-        request = CFHTTPMessageCreateRequest(alloc, _kCFStreamCONNECTMethod, url, version ? version : kCFHTTPVersion1_0);
+      else if (CFEqual(value, kCFStreamSocketSecurityLevelTLSv1) && SSLSetProtocolVersion(security, kTLSProtocol1Only))
+        break;
 
-        CFRelease(url);
+      else if (CFEqual(value, kCFStreamSocketSecurityLevelTLSv1SSLv3) &&
+               (SSLSetProtocolVersion(security, kTLSProtocol1) || SSLSetProtocolVersionEnabled(security, kSSLProtocol2, FALSE))) {
+        break;
+      }
+    }
 
-      } while (0);
+    /* If old property for cert auth was used, set lax now.  New settings override. */
+    if (check && (check == kCFBooleanFalse)) {
+      if (SSLSetAllowsExpiredRoots(security, TRUE))
+        break;
 
-      /* Fail if the request wasn't made. */
-      if (!request) {
-        if (name)
-          CFRelease(name);
+      if (SSLSetAllowsAnyRoot(security, TRUE))
+        break;
+    }
 
-        /* If an error wasn't set, assume an out of memory error. */
-        if (!ctxt->_error.error) {
-          ctxt->_error.error  = ENOMEM;
-          ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
-        }
+    /* Set all the different properties based upon dictionary settings. */
+    value = CFDictionaryGetValue(settings, kCFStreamSSLAllowsExpiredCertificates);
+    if (value && CFEqual(value, kCFBooleanTrue) && SSLSetAllowsExpiredCerts(security, TRUE))
+      break;
+
+    value = CFDictionaryGetValue(settings, kCFStreamSSLAllowsExpiredRoots);
+    if (value && CFEqual(value, kCFBooleanTrue) && SSLSetAllowsExpiredRoots(security, TRUE))
+      break;
 
-        return; /* NOTE the early return */
-      }
+    value = CFDictionaryGetValue(settings, kCFStreamSSLAllowsAnyRoot);
+    if (value && CFEqual(value, kCFBooleanTrue) && SSLSetAllowsAnyRoot(security, TRUE))
+      break;
 
-      /* Add the other headers */
-      headers = CFDictionaryGetValue(proxy, kCFStreamPropertyCONNECTAdditionalHeaders);
-      if (headers) {
-        /* Check to see if "Host:" needs to be added and do so. */
-        CFStringRef value = (CFStringRef)CFDictionaryGetValue(headers, _kCFStreamHostHeader);
-        if (!value)
-          CFHTTPMessageSetHeaderFieldValue(request, _kCFStreamHostHeader, name);
+    value = CFDictionaryGetValue(settings, kCFStreamSSLValidatesCertificateChain);
+    if (value && CFEqual(value, kCFBooleanFalse) && SSLSetEnableCertVerify(security, FALSE))
+      break;
 
-        /* Check to see if "User-Agent:" need to be added and do so. */
-        value = (CFStringRef)CFDictionaryGetValue(headers, _kCFStreamUserAgentHeader);
-        if (!value)
-          CFHTTPMessageSetHeaderFieldValue(request, _kCFStreamUserAgentHeader, _CFNetworkUserAgentString());
+    value = CFDictionaryGetValue(settings, kCFStreamSSLCertificates);
+    if (value && SSLSetCertificate(security, value))
+      break;
 
-        /* Add all the other headers. */
-        CFDictionaryApplyFunction(headers, (CFDictionaryApplierFunction)_CONNECTHeaderApplier, request);
-      } else {
-        /* CONNECT must have "Host:" and "User-Agent:" headers. */
-        CFHTTPMessageSetHeaderFieldValue(request, _kCFStreamHostHeader, name);
-        CFHTTPMessageSetHeaderFieldValue(request, _kCFStreamUserAgentHeader, _CFNetworkUserAgentString());
-      }
+    /* Get the peer name or figure out the peer name to use. */
+    value = CFDictionaryGetValue(settings, kCFStreamSSLPeerName);
+    if (!value) {
+      CFStringRef name   = (CFStringRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketPeerName);
+      CFTypeRef   lookup = (CFTypeRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteHost);
 
-      CFRelease(name);
+      /* Old property override. */
+      if (check && (check == kCFBooleanFalse))
+        value = kCFNull;
 
       /*
-      ** Flatten the request using this special version.  This will
-      ** flatten it for proxy usage (it will keep the full url).
-      */
-      left = _CFHTTPMessageCopySerializedHeaders(request, TRUE);
-      CFRelease(request);
+       ** **FIXME** Once the new improved CONNECT stuff is in, peer name override
+       ** should go away.
+       */
+      else if (name)
+        value = name;
 
-      /* If failed to flatten, specify out of memory. */
-      if (!left) {
-        ctxt->_error.error  = ENOMEM;
-        ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
-        return; /* NOTE the early return */
+      /* Try to get the name of the host from the CFHost or CFNetService. */
+      else if (lookup) {
+        CFArrayRef names = CFHostGetNames((CFHostRef)lookup, NULL);
+        if (names)
+          value = CFArrayGetValueAtIndex(names, 0);
       }
 
-      /* Add the buffer to the properties for future. */
-      CFDictionaryAddValue(ctxt->_properties, _kCFStreamPropertyCONNECTSendBuffer, left);
-      CFRelease(left);
+      else if ((lookup = (CFTypeRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteNetService)))
+        value = CFNetServiceGetTargetHost((CFNetServiceRef)lookup);
     }
 
-    /* Find out how much is left and try sending. */
-    length = CFDataGetLength(left);
-    count  = _CFSocketSend(ctxt->_socket, CFDataGetBytePtr(left), length, &error);
-
-    if (error.error) {
-      /* EAGAIN is not really an error. */
-      if ((error.error == EAGAIN) && (error.domain == _kCFStreamErrorDomainNativeSockets))
-        count = 0;
+    /* If got a name, try to set it. */
+    if (value) {
+      /* kCFNull value means don't check the peer name. */
+      if (CFEqual(value, kCFNull)) {
+        if (SSLSetPeerDomainName(security, NULL, 0))
+          break;
+      }
 
-      /* Other errors, copy into place and bail. */
+      /* Pull out the bytes and set 'cause ST doesn't do CFString's for this. */
       else {
-        memmove(&ctxt->_error, &error, sizeof(error));
-        return; /* NOTE the early return */
+        OSStatus       err;
+        UInt8          static_buffer[1024];
+        UInt8*         buffer      = &static_buffer[0];
+        CFIndex        buffer_size = sizeof(static_buffer);
+        CFAllocatorRef alloc       = CFGetAllocator(ctxt->_properties);
+
+        buffer                     = _CFStringGetOrCreateCString(alloc, value, static_buffer, &buffer_size, kCFStringEncodingUTF8);
+
+        /* After pulling out the bytes, set the peer name. */
+        err                        = SSLSetPeerDomainName(security, (const char*)buffer, *((size_t*)(&buffer_size)));
+
+        /* Clean up the allocation if made. */
+        if (buffer != &static_buffer[0])
+          CFAllocatorDeallocate(alloc, buffer);
+
+        if (err)
+          break;
       }
     }
 
-    /* Shrink by the sent amount. */
-    length -= count;
+    /* Wrap the SSLContextRef as a CFData. */
+    wrapper = CFDataCreate(CFGetAllocator(ctxt->_properties), (void*)&security, sizeof(security));
 
-    /* Re-enable so can continue. */
-    CFSocketEnableCallBacks(ctxt->_socket, kCFSocketWriteCallBack);
+    /* Set the property. */
+    if (!wrapper || !_SocketStreamSecuritySetContext_NoLock(ctxt, wrapper))
+      break;
 
-    /* Did everything get written? */
-    if (!length) {
-      /* Toss the buffer, since it is done. */
-      CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertyCONNECTSendBuffer);
+    CFRelease(wrapper);
 
-      /* Make sure there is a response for reading. */
-      response = CFHTTPMessageCreateEmpty(alloc, FALSE);
+    return TRUE;
 
-      /* Bail if failed to create. */
-      if (!response) {
-        ctxt->_error.error  = ENOMEM;
-        ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
-        return; /* NOTE the early return */
-      }
+  } while (1);
 
-      /* Save it as a property, since that's what it is. */
-      CFDictionaryAddValue(ctxt->_properties, kCFStreamPropertyCONNECTResponse, response);
-      CFRelease(response);
-    }
+  /* Clean up the SSLContextRef on failure. */
+  if (security)
+    SSLDisposeContext(security);
 
-    /* If did read but not everything, need to trim the buffer. */
-    else if (count) {
-      /* Just create a copy of what's left. */
-      left = CFDataCreate(alloc, ((UInt8*)CFDataGetBytePtr(left)) + count, length);
+  if (wrapper)
+    CFRelease(wrapper);
 
-      /* Failed with an out of memory? */
-      if (!left) {
-        ctxt->_error.error  = ENOMEM;
-        ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
-        return; /* NOTE the early return */
-      }
+  return FALSE;
+}
 
-      /* Put it over top of the other. */
-      CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertyCONNECTSendBuffer, left);
-      CFRelease(left);
-    }
+/* static */ Boolean _SocketStreamSecuritySetAuthenticatesServerCertificates_NoLock(_CFSocketStreamContext* ctxt, CFBooleanRef authenticates)
+{
+  SSLContextRef ssl = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
 
-    /* Would block. */
-    else
-      return; /* NOTE the early return */
-  }
+  do {
+    CFTypeRef   value  = NULL;
+    CFStringRef name   = (CFStringRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketPeerName);
+    CFTypeRef   lookup = (CFTypeRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteHost);
 
-  /*
-  ** Peek at the socket buffer to get the bytes.  Since there is no capability
-  ** of pushing bytes back, need to peek to pull out the bytes.  Don't  want to
-  ** read bytes beyond the response bytes.
-  */
-  if (-1 == (count = recv(CFSocketGetNative(ctxt->_socket), buffer, sizeof(buffer), MSG_PEEK))) {
-    /* If it's an EAGAIN, re-enable the callback to come back later. */
-    if ((_LastError(&error) == EAGAIN) && (error.domain == _kCFStreamErrorDomainNativeSockets)) {
-      CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
-      return; /* NOTE the early return */
-    }
+    /* Set lax if turning off */
+    if (SSLSetAllowsExpiredRoots(ssl, authenticates ? FALSE : TRUE))
+      break;
 
-    /* Some other error, so bail. */
-    else if (error.error) {
-      memmove(&ctxt->_error, &error, sizeof(error));
-      return; /* NOTE the early return */
-    }
-  }
+    /* Set lax if turning off */
+    if (SSLSetAllowsAnyRoot(ssl, authenticates ? FALSE : TRUE))
+      break;
+
+    /* Set peer name as kCFNull if turning off. */
+    if (authenticates == kCFBooleanFalse)
+      value = kCFNull;
 
-  /* Add the bytes to the response.  Let it determine the end. */
-  if (CFHTTPMessageAppendBytes(response, buffer, count)) {
     /*
-    ** Detect done if the head is complete.   For CONNECT,
-    ** all bytes after the headers belong to the client.
+    ** **FIXME** Once the new improved CONNECT stuff is in, peer name override
+    ** should go away.
     */
-    if (CFHTTPMessageIsHeaderComplete(response)) {
-      /* Get the result code for check later. */
-      UInt32 code    = CFHTTPMessageGetResponseStatusCode(response);
-
-      /* If there were extra bytes read, need to remove those. */
-      CFDataRef body = CFHTTPMessageCopyBody(response);
-      if (body) {
-        /* Reduce the count, so the correct byte count can get sucked out of the kernel. */
-        count -= CFDataGetLength(body);
-        CFRelease(body);
+    else if (name)
+      value = name;
 
-        /* Get rid of the body.  CONNECT responses have no body. */
-        CFHTTPMessageSetBody(response, NULL);
-      }
+    /* Figure out the proper peer name for CFHost or CFNetService. */
+    else if (lookup) {
+      CFArrayRef names = CFHostGetNames((CFHostRef)lookup, NULL);
+      if (names)
+        value = CFArrayGetValueAtIndex(names, 0);
+    }
 
-      /* If it wasn't a 200 series result, stall the stream for another CONNECT. */
-      if ((code < 200) || (code > 299))
-        _SocketStreamAddHandshake_NoLock(ctxt, _PerformCONNECTHaltHandshake_NoLock);
+    else if ((lookup = (CFTypeRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteNetService)))
+      value = CFNetServiceGetTargetHost((CFNetServiceRef)lookup);
 
-      /* Remove the handshake now that it is complete. */
-      _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformCONNECTHandshake_NoLock);
+    /* No value is a failure. */
+    if (!value)
+      break;
 
-      CFDictionaryRemoveValue(ctxt->_properties, kCFStreamPropertyPreviousCONNECTResponse);
+    /* kCFNull means no peer name check */
+    if (CFEqual(value, kCFNull)) {
+      if (SSLSetPeerDomainName(ssl, NULL, 0))
+        break;
     }
 
-    /* Suck the bytes out of the kernel. */
-    if (-1 == recv(CFSocketGetNative(ctxt->_socket), buffer, count, 0)) {
-      /* Copy the last error. */
-      _LastError(&ctxt->_error);
+    /* Pull out the bytes and set 'cause ST doesn't do CFString's for this. */
+    else {
+      OSStatus       err;
+      UInt8          static_buffer[1024];
+      UInt8*         buffer      = &static_buffer[0];
+      CFIndex        buffer_size = sizeof(static_buffer);
+      CFAllocatorRef alloc       = CFGetAllocator(ctxt->_properties);
 
-      return; /* NOTE the early return */
+      buffer                     = _CFStringGetOrCreateCString(alloc, value, static_buffer, &buffer_size, kCFStringEncodingUTF8);
+
+      err                        = SSLSetPeerDomainName(ssl, (const char*)buffer, *((size_t*)(&buffer_size)));
+
+      if (err)
+        break;
     }
 
-    /* Re-enable for future callbacks. */
-    CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
-  }
+    return TRUE;
 
-  /* Failed to append the bytes, so error as a HTTP parsing failure. */
-  else {
-    ctxt->_error.error  = kCFStreamErrorHTTPParseFailure;
-    ctxt->_error.domain = kCFStreamErrorDomainHTTP;
-  }
+  } while (1);
+
+  return FALSE;
 }
 
-/* static */ void _PerformCONNECTHaltHandshake_NoLock(_CFSocketStreamContext* ctxt)
+/* static */ CFStringRef _SecurityGetProtocol(SSLContextRef security)
 {
-  (void)ctxt; /* unused */
+  SSLProtocol version = kSSLProtocolUnknown;
 
-  /* Do nothing.  This will cause a stall until it's time to go again. */
+  /* Attempt to get the negotiated protocol */
+  SSLGetNegotiatedProtocolVersion(security, &version);
+  if (kSSLProtocolUnknown == version)
+    SSLGetProtocolVersion(security, &version);
 
-  if (ctxt->_clientWriteStream && __CFBitIsSet(ctxt->_flags, kFlagBitWriteStreamOpened)) {
-    __CFBitSet(ctxt->_flags, kFlagBitCanWrite);
-    _CFWriteStreamSignalEventDelayed(ctxt->_clientWriteStream, kCFStreamEventCanAcceptBytes, NULL);
-  }
+  /* Map the protocol from ST to CFSocketStream property values. */
+  switch (version) {
+    case kSSLProtocol2:
+      return kCFStreamSocketSecurityLevelSSLv2;
 
-  if (ctxt->_clientReadStream && __CFBitIsSet(ctxt->_flags, kFlagBitReadStreamOpened)) {
-    __CFBitSet(ctxt->_flags, kFlagBitCanRead);
-    _CFReadStreamSignalEventDelayed(ctxt->_clientReadStream, kCFStreamEventHasBytesAvailable, NULL);
+    case kSSLProtocol3Only:
+      return kCFStreamSocketSecurityLevelSSLv3;
+
+    case kTLSProtocol1Only:
+      return kCFStreamSocketSecurityLevelTLSv1;
+
+    case kSSLProtocol3:
+    case kTLSProtocol1:
+    default: {
+      Boolean enabled;
+
+      if (!SSLGetProtocolVersionEnabled(security, kSSLProtocol2, &enabled) && !enabled)
+        return kCFStreamSocketSecurityLevelTLSv1SSLv3;
+
+      return kCFStreamSocketSecurityLevelNegotiatedSSL;
+    }
   }
 }
 
-/* static */ void _CONNECTHeaderApplier(CFStringRef key, CFStringRef value, CFHTTPMessageRef request)
+/* static */ SSLSessionState _SocketStreamSecurityGetSessionState_NoLock(_CFSocketStreamContext* ctxt)
 {
-  CFHTTPMessageSetHeaderFieldValue(request, key, value);
+  SSLContextRef ssl = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
+
+  /*
+  ** Slight fib to return Aborted if the SSL call fails, but if it does fail things are
+  ** quite hosed, so it's not such a lie.
+  */
+  SSLSessionState state;
+  return !SSLGetSessionState(ssl, &state) ? state : kSSLAborted;
 }
 
-/* static */ Boolean _CONNECTSetInfo_NoLock(_CFSocketStreamContext* ctxt, CFDictionaryRef settings)
+#elif defined(HAVE_OPENSSL)
+
+/*
+** Sessions are kept process-wide by peer ID so that reconnects to the
+** same origin can resume instead of running the full handshake.  Only
+** sessions from fully checked handshakes go in, and the name checked
+** is part of the key, so a resumption never skips checks the new
+** stream would have made.
+*/
+static CFSpinLock_t           gSecurityLock           = 0;
+static SSL_CTX*               gSecurityClientContext  = NULL;
+static BIO_METHOD*            gSecurityBIOMethod      = NULL;
+static int                    gSecurityFlagsIndex     = -1;
+static int                    gSecurityPeerNameIndex  = -1; /* Name the stream checks, host or address */
+static CFMutableDictionaryRef gSecuritySessions       = NULL; /* Peer ID to SSL_SESSION */
+static CFMutableArrayRef      gSecuritySessionOrder   = NULL; /* Peer IDs, least recently used first */
+static CFIndex                gSecuritySessionMaximum = kSecuritySessionCacheSize;
+
+static const void* _SecuritySessionRetain(CFAllocatorRef alloc, const void* value)
 {
-  Boolean         resume = FALSE;
-  CFStringRef     server = settings ? CFDictionaryGetValue(settings, kCFStreamPropertyCONNECTProxyHost) : NULL;
-  CFNumberRef     port   = settings ? CFDictionaryGetValue(settings, kCFStreamPropertyCONNECTProxyPort) : NULL;
-  CFDictionaryRef old    = CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertyCONNECTProxy);
+  SSL_SESSION_up_ref((SSL_SESSION*)value);
+  return value;
+}
 
-  /*
-   ** Up front check for server information before tossing out the
-   ** existing CONNECT info.  Can't use CONNECT if created with a
-   ** connected socket.
-   */
-  if ((settings && (!server || !port)) || __CFBitIsSet(ctxt->_flags, kFlagBitCreatedNative)) {
-    return FALSE;
-  }
+static void _SecuritySessionRelease(CFAllocatorRef alloc, const void* value) { SSL_SESSION_free((SSL_SESSION*)value); }
 
-  if (__CFBitIsSet(ctxt->_flags, kFlagBitOpenComplete) || __CFBitIsSet(ctxt->_flags, kFlagBitOpenStarted)) {
-    CFMutableArrayRef handshakes = (CFMutableArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyHandshakes);
+/* static */ int _SecurityBIORead(BIO* bio, char* data, int dataLength)
+{
+  /* This is the read function used by OpenSSL in order to get bytes off the wire; see _SocketStreamSecurityRecv_NoLock. */
 
-    if (handshakes && CFArrayGetCount(handshakes) && (_PerformCONNECTHaltHandshake_NoLock == CFArrayGetValueAtIndex(handshakes, 0))) {
-      resume = TRUE;
-    }
+  _CFSocketStreamContext* ctxt = (_CFSocketStreamContext*)BIO_get_data(bio);
+  CFStreamError           error;
+  CFIndex                 r    = _SocketStreamSecurityRecv_NoLock(ctxt, (UInt8*)data, dataLength, &error);
 
-    else
-      return FALSE;
-  }
+  BIO_clear_retry_flags(bio);
 
-  /* If setting the same setting, just return TRUE. */
-  if (!old || !CFEqual(old, settings)) {
-    /* Removing the CONNECT proxy? */
-    if (!settings) {
-      /* Remove the settings. */
-      CFDictionaryRemoveValue(ctxt->_properties, kCFStreamPropertyCONNECTProxy);
+  /* Zero bytes is the end. */
+  if (r >= 0)
+    return (int)r;
 
-      /* Remove the handshake. */
-      _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformCONNECTHandshake_NoLock);
-    }
+  /* If it's a "would block," have OpenSSL retry later. */
+  if ((error.domain == _kCFStreamErrorDomainNativeSockets) && (EAGAIN == error.error))
+    BIO_set_retry_read(bio);
 
-    /* Client is setting the proxy. */
-    else {
-      Boolean   hasName = FALSE;
-      CFTypeRef lookup  = CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteHost);
+  /* It's a real error, so copy it into the context */
+  else
+    memmove(&ctxt->_error, &error, sizeof(error));
 
-      /* Is there far end information for setting up the tunnel? */
-      if (lookup) {
-        /* Get the list of names for setting up the tunnel */
-        CFArrayRef list = CFHostGetNames((CFHostRef)lookup, NULL);
+  return -1;
+}
 
-        /* Good with at least one name? */
-        if (list && CFArrayGetCount(list))
-          hasName = TRUE;
+/* static */ int _SecurityBIOWrite(BIO* bio, const char* data, int dataLength)
+{
+  /*
+  ** This is the function used by OpenSSL to write bytes to the wire.  Like
+  ** Secure Transport, whatever the socket won't take is kept and reported
+  ** as written; it goes out through _SocketStreamSecurityFlush_NoLock.
+  */
 
-        /* No name, but can create one with an IP. */
-        else {
-          /* Is there one good address to create a name? */
-          list = CFHostGetAddressing((CFHostRef)lookup, NULL);
-          if (list && CFArrayGetCount(list))
-            hasName = TRUE;
-        }
-      }
+  _CFSocketStreamContext* ctxt    = (_CFSocketStreamContext*)BIO_get_data(bio);
+  CFMutableDataRef        pending = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySecuritySendBuffer);
+  CFIndex                 sent    = 0;
 
-      /* No host, but is there a possible CFNetService with enough information? */
-      else if ((lookup = CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteNetService))) {
-        /* Has the far end server been resolved already? */
-        if (CFNetServiceGetTargetHost((CFNetServiceRef)lookup))
-          hasName = TRUE;
+  BIO_clear_retry_flags(bio);
 
-        /*
-        ** NOTE that the target host is resolved.  If that doesn't exist,
-        ** there is no reason to check addresses since those are resolved
-        ** too.  There is no way to create a CFNetServiceRef from an
-        ** address only.
-        */
-      }
+  /* Only go to the wire if nothing is queued ahead of these bytes. */
+  if (!pending || !CFDataGetLength(pending)) {
+    CFStreamError error = {0, 0};
 
-      /* Fail if there is no way to put together a CONNECT request. */
-      if (!hasName)
-        return FALSE;
+    sent = _CFSocketSend(ctxt->_socket, (const UInt8*)data, dataLength, &error);
 
-      /* Add the handshake to the list to perform. */
-      if (!_SocketStreamAddHandshake_NoLock(ctxt, _PerformCONNECTHandshake_NoLock)) {
-        if (resume) {
-          CFDictionaryRemoveValue(ctxt->_properties, kCFStreamPropertyCONNECTResponse);
-          _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformCONNECTHaltHandshake_NoLock);
-        }
+    if (error.error) {
+      sent = 0;
 
-        return FALSE;
+      /* Copy the real error into place. */
+      if ((error.domain != _kCFStreamErrorDomainNativeSockets) || (EAGAIN != error.error)) {
+        memmove(&ctxt->_error, &error, sizeof(error));
+        return -1;
       }
+    }
+  }
 
-      if (resume) {
-        CFTypeRef last = CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertyCONNECTResponse);
-        if (last)
-          CFDictionarySetValue(ctxt->_properties, kCFStreamPropertyPreviousCONNECTResponse, last);
-        CFDictionaryRemoveValue(ctxt->_properties, kCFStreamPropertyCONNECTResponse);
-        _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformCONNECTHaltHandshake_NoLock);
+  /* Keep the rest for later. */
+  if (sent < dataLength) {
+    if (!pending) {
+      pending = CFDataCreateMutable(CFGetAllocator(ctxt->_properties), 0);
+
+      if (!pending) {
+        ctxt->_error.error  = ENOMEM;
+        ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+        return -1;
       }
 
-      /* Put the new setting in place, removing the old if previously set. */
-      CFDictionarySetValue(ctxt->_properties, kCFStreamPropertyCONNECTProxy, settings);
+      CFDictionaryAddValue(ctxt->_properties, _kCFStreamPropertySecuritySendBuffer, pending);
+      CFRelease(pending);
     }
+
+    CFDataAppendBytes(pending, (const UInt8*)data + sent, dataLength - sent);
   }
 
-  return TRUE;
+  return dataLength;
 }
 
-#pragma mark - * SSL Support
+/* static */ long _SecurityBIOCtrl(BIO* bio, int cmd, long num, void* ptr)
+{
+  /* Writes are never held in the BIO itself, so there's nothing to flush. */
+  return (cmd == BIO_CTRL_FLUSH) ? 1 : 0;
+}
 
-#if defined(__MACH__)
-/* static */ OSStatus _SecurityReadFunc_NoLock(_CFSocketStreamContext* ctxt, void* data, UInt32* dataLength)
+/* static */ int _SecurityVerifyCallBack(int ok, X509_STORE_CTX* store)
 {
-  /* This is the read function used by SecureTransport in order to get bytes off the wire. */
+  SSL*      ssl = (SSL*)X509_STORE_CTX_get_ex_data(store, SSL_get_ex_data_X509_STORE_CTX_idx());
+  uintptr_t lax = (uintptr_t)SSL_get_ex_data(ssl, gSecurityFlagsIndex);
+
+  if (ok)
+    return 1;
+
+  /* Let through the failures the settings asked to be let through. */
+  switch (X509_STORE_CTX_get_error(store)) {
+    case X509_V_ERR_HOSTNAME_MISMATCH:
+    case X509_V_ERR_IP_ADDRESS_MISMATCH:
+      return 0;
+
+    case X509_V_ERR_CERT_HAS_EXPIRED:
+    case X509_V_ERR_CERT_NOT_YET_VALID:
+      if (lax & kSecurityAllowsExpired)
+        return 1;
+      break;
+
+    case X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT:
+    case X509_V_ERR_SELF_SIGNED_CERT_IN_CHAIN:
+    case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT:
+    case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT_LOCALLY:
+    case X509_V_ERR_UNABLE_TO_VERIFY_LEAF_SIGNATURE:
+    case X509_V_ERR_CERT_UNTRUSTED:
+      if (lax & kSecurityAllowsAnyRoot)
+        return 1;
+      break;
+
+    default:
+      break;
+  }
 
-  /* NOTE that SSL reads bytes off the wire and into a buffer of encrypted bytes. */
+  return (lax & kSecuritySkipsChain) ? 1 : 0;
+}
 
-  CFIndex       i, s;
-  UInt32        try       = *dataLength;
-  CFStreamError error     = {0, 0};
+/* static */ int _SecurityNewSessionCallBack(SSL* ssl, SSL_SESSION* session)
+{
+  /*
+  ** Called from within the handshake or a read, so the context is already
+  ** locked.  TLS 1.3 tickets show up here after the handshake is done.
+  */
+  _CFSocketStreamContext* ctxt   = (_CFSocketStreamContext*)SSL_get_app_data(ssl);
+  CFDataRef               peerID = ctxt ? (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySecurityPeerID) : NULL;
 
-  /* Bits required for buffered reading. */
-  CFDataRef        size   = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySecurityRecvBufferSize);
-  CFMutableDataRef buffer = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySecurityRecvBuffer);
-  CFMutableDataRef count  = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySecurityRecvBufferCount);
+  if (peerID && !SSL_get_ex_data(ssl, gSecurityFlagsIndex))
+    _SecuritySessionCacheAdd(peerID, session);
 
-  /* If missing the buffer, assume nothing has been created. */
-  if (!buffer) {
-    CFAllocatorRef alloc = CFGetAllocator(ctxt->_properties);
+  /* The cache took its own reference, if any. */
+  return 0;
+}
 
-    /* Start with a size.  This could be overridden from properties. */
-    if (!size) {
-      s    = kSecurityBufferSize;
-      size = CFDataCreate(alloc, (const UInt8*)&s, sizeof(s));
+/* static */ SSL_CTX* _SecurityGetClientContext(void)
+{
+  SSL_CTX* result;
+
+  __CFSpinLock(&gSecurityLock);
+
+  if (!gSecurityClientContext) {
+    SSL_CTX*    context = SSL_CTX_new(TLS_client_method());
+    BIO_METHOD* method  = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "CFSocketStream");
+
+    if (context && method &&
+        (gSecurityFlagsIndex != -1 || (gSecurityFlagsIndex = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL)) != -1) &&
+        (gSecurityPeerNameIndex != -1 || (gSecurityPeerNameIndex = SSL_get_ex_new_index(0, NULL, NULL, NULL, _SecurityPeerNameFree)) != -1)) {
+      BIO_meth_set_read(method, _SecurityBIORead);
+      BIO_meth_set_write(method, _SecurityBIOWrite);
+      BIO_meth_set_ctrl(method, _SecurityBIOCtrl);
+
+      /* Trust whatever the system trusts, and keep sessions in the cache here instead of OpenSSL's. */
+      SSL_CTX_set_default_verify_paths(context);
+      SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+      SSL_CTX_sess_set_new_cb(context, _SecurityNewSessionCallBack);
+#if defined(__linux__)
+      /* TLS 1.3 traffic secrets only come out through the key log; see kernel SSL below. */
+      SSL_CTX_set_keylog_callback(context, _SecurityKeyLogCallBack);
+#endif
+#if defined(SSL_OP_IGNORE_UNEXPECTED_EOF)
+      /* A peer going away without a close notify is taken as a close, as with Secure Transport. */
+      SSL_CTX_set_options(context, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+      gSecurityClientContext = context;
+      gSecurityBIOMethod     = method;
     }
 
-    /* If have a size, create buffers for the count and the buffer itself. */
-    if (size) {
-      buffer = CFDataCreateMutable(alloc, *((CFIndex*)CFDataGetBytePtr(size)));
-      count  = CFDataCreateMutable(alloc, sizeof(CFIndex));
+    else {
+      if (context)
+        SSL_CTX_free(context);
+      if (method)
+        BIO_meth_free(method);
     }
+  }
 
-    /* If anything failed, set out of memory and return error. */
-    if (!buffer || !count || !size) {
-      if (buffer)
-        CFRelease(buffer);
-      if (count)
-        CFRelease(count);
-      if (size)
-        CFRelease(size);
+  result = gSecurityClientContext;
 
-      ctxt->_error.error  = ENOMEM;
-      ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+  __CFSpinUnlock(&gSecurityLock);
 
-      return errSSLInternal; /* NOTE the eary return. */
-    }
+  return result;
+}
 
-    /* Place everything in the properties bucket for later. */
-    CFDictionaryAddValue(ctxt->_properties, _kCFStreamPropertySecurityRecvBufferSize, size);
-    CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySecurityRecvBuffer, buffer);
-    CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySecurityRecvBufferCount, count);
+/* static */ Boolean _SecuritySetPeerName(SSL* ssl, CFTypeRef name, CFAllocatorRef alloc)
+{
+  Boolean        result;
+  UInt8          static_buffer[1024];
+  UInt8*         buffer      = &static_buffer[0];
+  CFIndex        buffer_size = sizeof(static_buffer);
+  struct in6_addr addr;
+
+  /* Forget any name from before. */
+  OPENSSL_free(SSL_get_ex_data(ssl, gSecurityPeerNameIndex));
+  SSL_set_ex_data(ssl, gSecurityPeerNameIndex, NULL);
+
+  /* kCFNull means no peer name check */
+  if (CFEqual(name, kCFNull))
+    return SSL_set1_host(ssl, NULL) ? TRUE : FALSE;
+
+  /* Pull out the bytes and set 'cause OpenSSL doesn't do CFString's for this. */
+  buffer = _CFStringGetOrCreateCString(alloc, name, static_buffer, &buffer_size, kCFStringEncodingUTF8);
+
+  /* Addresses are checked against the certificate as such, and never sent as the server name. */
+  if ((inet_pton(AF_INET, (const char*)buffer, &addr) == 1) || (inet_pton(AF_INET6, (const char*)buffer, &addr) == 1))
+    result = X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), (const char*)buffer) ? TRUE : FALSE;
+  else
+    result = (SSL_set_tlsext_host_name(ssl, (const char*)buffer) && SSL_set1_host(ssl, (const char*)buffer)) ? TRUE : FALSE;
 
-    CFRelease(size);
-    CFRelease(buffer);
-    CFRelease(count);
+  /* Keep the name as checked for keying the session cache, since addresses have no server name. */
+  if (result) {
+    char* checked = OPENSSL_strdup((const char*)buffer);
 
-    /* Set the intial count to zero. */
-    *((CFIndex*)CFDataGetMutableBytePtr(count)) = 0;
+    if (!checked || !SSL_set_ex_data(ssl, gSecurityPeerNameIndex, checked)) {
+      OPENSSL_free(checked);
+      result = FALSE;
+    }
   }
 
-  /* Get the count and size, respectively. */
-  i = *((CFIndex*)CFDataGetMutableBytePtr(count));
-  s = *((CFIndex*)CFDataGetBytePtr(size));
+  /* Clean up the allocation if made. */
+  if (buffer != &static_buffer[0])
+    CFAllocatorDeallocate(alloc, buffer);
 
-  /* If the count is less than the request, go to the wire. */
-  if (i < *dataLength) {
-    /* Read the bytes off the wire into what's left of the buffer. */
-    CFIndex r = _CFSocketRecv(ctxt->_socket, ((UInt8*)CFDataGetMutableBytePtr(buffer)) + i, s - i, &error);
+  return result;
+}
 
-    __CFBitClear(ctxt->_flags, kFlagBitRecvdRead);
+/* static */ void _SecurityPeerNameFree(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp)
+{
+  OPENSSL_free(ptr);
+}
 
-    /* If no error occurred, add the read bytes to the count. */
-    if (!error.error)
-      i += r;
-  } else
-    __CFBitSet(ctxt->_flags, kFlagBitRecvdRead);
+/* static */ void _SocketStreamSecuritySetError_NoLock(_CFSocketStreamContext* ctxt, SSL* ssl, int result)
+{
+  /* Errors from the socket underneath were already put in place by the BIO. */
+  if (ctxt->_error.error)
+    return;
+
+  ctxt->_error.domain = kCFStreamErrorDomainSSL;
 
-  /* If still no errr, continue on. */
-  if (!error.error) {
-    UInt8* ptr  = (UInt8*)CFDataGetMutableBytePtr(buffer);
+  /* Map certificate failures to the closest Secure Transport error. */
+  switch ((SSL_get_error(ssl, result) == SSL_ERROR_SSL) ? SSL_get_verify_result(ssl) : X509_V_OK) {
+    case X509_V_OK:
+      ctxt->_error.error = errSSLProtocol;
+      break;
 
-    /* Either read what the client asked or what is in the buffer. */
-    *dataLength = (*dataLength <= i) ? *dataLength : i;
+    case X509_V_ERR_CERT_HAS_EXPIRED:
+      ctxt->_error.error = errSSLCertExpired;
+      break;
 
-    /* Decrease the buffer count by the return value. */
-    i -= *dataLength;
+    case X509_V_ERR_CERT_NOT_YET_VALID:
+      ctxt->_error.error = errSSLCertNotYetValid;
+      break;
 
-    /* Copy the bytes into the client's buffer. */
-    memmove(data, ptr, *dataLength);
+    default:
+      ctxt->_error.error = errSSLXCertChainInvalid;
+      break;
+  }
+}
 
-    /* Move the bytes in the buffer down by the read count. */
-    memmove(ptr, ptr + *dataLength, i);
+/* static */ Boolean _SocketStreamSecurityFlush_NoLock(_CFSocketStreamContext* ctxt)
+{
+  /*
+  ** Pushes out what the socket didn't take before.  Returns TRUE once
+  ** everything is out; otherwise write events are turned on or an error
+  ** has been set.
+  */
 
-    /* Zero the bytes that are no longer part of the buffer count. */
-    memset(ptr + i, 0, s - i);
+  CFMutableDataRef pending = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySecuritySendBuffer);
+  CFIndex          length  = pending ? CFDataGetLength(pending) : 0;
 
-    /* Make sure to set count again. */
-    *((CFIndex*)CFDataGetMutableBytePtr(count)) = i;
+  if (length && !ctxt->_error.error) {
+    CFStreamError error = {0, 0};
+    CFIndex       sent  = _CFSocketSend(ctxt->_socket, CFDataGetBytePtr(pending), length, &error);
 
-    /* If something was read, re-enable the read callback. */
-    if (*dataLength)
-      CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
+    if (!error.error) {
+      CFDataDeleteBytes(pending, CFRangeMake(0, sent));
+      length -= sent;
+    }
 
-    /* If no bytes read, return closed.  If couldn't read all, return "would block." */
-    return (!*dataLength ? errSSLClosedAbort : (try == *dataLength) ? 0 : errSSLWouldBlock);
+    /* Copy the real error into place. */
+    else if ((error.domain != _kCFStreamErrorDomainNativeSockets) || (EAGAIN != error.error))
+      memmove(&ctxt->_error, &error, sizeof(error));
   }
 
-  /* Error condition means no bytes read. */
-  *dataLength = 0;
+  if (!length)
+    return TRUE;
 
-  /* If it's a "would block," return such. */
-  if ((error.domain == _kCFStreamErrorDomainNativeSockets) && (EAGAIN == error.error))
-    return errSSLWouldBlock;
+  if (!ctxt->_error.error)
+    CFSocketEnableCallBacks(ctxt->_socket, kCFSocketWriteCallBack);
 
-  /* It's a real error, so copy it into the context */
-  memmove(&ctxt->_error, &error, sizeof(error));
+  return FALSE;
+}
 
-  /* A bad error occurred. */
-  return errSSLInternal;
+/* static */ SSL_SESSION* _SecuritySessionCacheCopy(CFDataRef peerID)
+{
+  SSL_SESSION* result = NULL;
+
+  __CFSpinLock(&gSecurityLock);
+
+  if (gSecuritySessions && (result = (SSL_SESSION*)CFDictionaryGetValue(gSecuritySessions, peerID))) {
+    CFIndex i = CFArrayGetFirstIndexOfValue(gSecuritySessionOrder, CFRangeMake(0, CFArrayGetCount(gSecuritySessionOrder)), peerID);
+
+    if (!SSL_SESSION_is_resumable(result))
+      result = NULL;
+    else
+      SSL_SESSION_up_ref(result);
+
+    /*
+    ** TLS 1.3 tickets are good for one use, and the server sends new ones
+    ** on the resumed connection.  Others move to the recently used end.
+    */
+    if (!result || (SSL_SESSION_get_protocol_version(result) >= TLS1_3_VERSION)) {
+      CFDictionaryRemoveValue(gSecuritySessions, peerID);
+      CFArrayRemoveValueAtIndex(gSecuritySessionOrder, i);
+    }
+
+    else {
+      CFRetain(peerID);
+      CFArrayRemoveValueAtIndex(gSecuritySessionOrder, i);
+      CFArrayAppendValue(gSecuritySessionOrder, peerID);
+      CFRelease(peerID);
+    }
+  }
+
+  __CFSpinUnlock(&gSecurityLock);
+
+  return result;
 }
 
-/* static */ OSStatus _SecurityWriteFunc_NoLock(_CFSocketStreamContext* ctxt, const void* data, UInt32* dataLength)
+/* static */ void _SecuritySessionCacheAdd(CFDataRef peerID, SSL_SESSION* session)
 {
-  /* This is the function used by SecureTransport to write bytes to the wire. */
+  __CFSpinLock(&gSecurityLock);
 
-  CFStreamError error = {0, 0};
-  UInt32        try   = *dataLength;
+  if (gSecuritySessionMaximum && !gSecuritySessions) {
+    CFDictionaryValueCallBacks callbacks = {0, _SecuritySessionRetain, _SecuritySessionRelease, NULL, NULL};
 
-  /* Write what the ST tells. */
-  *dataLength         = _CFSocketSend(ctxt->_socket, data, *dataLength, &error);
+    gSecuritySessions     = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &callbacks);
+    gSecuritySessionOrder = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
 
-  /* If no error, return noErr, or if couldn't write everything, return the "would block." */
-  if (!error.error)
-    return ((try == *dataLength) ? 0 : errSSLWouldBlock);
+    if (!gSecuritySessions || !gSecuritySessionOrder) {
+      if (gSecuritySessions)
+        CFRelease(gSecuritySessions);
+      if (gSecuritySessionOrder)
+        CFRelease(gSecuritySessionOrder);
+      gSecuritySessions     = NULL;
+      gSecuritySessionOrder = NULL;
+    }
+  }
 
-  /* Error condition means no bytes written. */
-  *dataLength = 0;
+  if (gSecuritySessionMaximum && gSecuritySessions) {
+    CFIndex i = CFArrayGetFirstIndexOfValue(gSecuritySessionOrder, CFRangeMake(0, CFArrayGetCount(gSecuritySessionOrder)), peerID);
+
+    /* A newer session for the peer replaces the older one. */
+    if (i != kCFNotFound)
+      CFArrayRemoveValueAtIndex(gSecuritySessionOrder, i);
 
-  /* If it was a "would block," return such. */
-  if ((error.domain == _kCFStreamErrorDomainNativeSockets) && (EAGAIN == error.error))
-    return errSSLWouldBlock;
+    CFDictionarySetValue(gSecuritySessions, peerID, session);
+    CFArrayAppendValue(gSecuritySessionOrder, peerID);
 
-  /* Copy the real error into place. */
-  memmove(&ctxt->_error, &error, sizeof(error));
+    /* Forget the least recently used once over the limit. */
+    while (CFArrayGetCount(gSecuritySessionOrder) > gSecuritySessionMaximum) {
+      CFDictionaryRemoveValue(gSecuritySessions, CFArrayGetValueAtIndex(gSecuritySessionOrder, 0));
+      CFArrayRemoveValueAtIndex(gSecuritySessionOrder, 0);
+    }
+  }
 
-  /* Something bad happened. */
-  return errSSLInternal;
+  __CFSpinUnlock(&gSecurityLock);
 }
 
-/* static */ CFIndex _SocketStreamSecuritySend_NoLock(_CFSocketStreamContext* ctxt, const UInt8* buffer, CFIndex length)
+/* static */ void _SecuritySessionCacheRemove(CFDataRef peerID)
 {
-  CFIndex bytesWritten = 0;
+  __CFSpinLock(&gSecurityLock);
 
-  SSLContextRef ssl    = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
+  if (gSecuritySessions && CFDictionaryContainsKey(gSecuritySessions, peerID)) {
+    CFDictionaryRemoveValue(gSecuritySessions, peerID);
+    CFArrayRemoveValueAtIndex(gSecuritySessionOrder,
+                              CFArrayGetFirstIndexOfValue(gSecuritySessionOrder, CFRangeMake(0, CFArrayGetCount(gSecuritySessionOrder)), peerID));
+  }
 
-  /* Try to write bytes on the socket. */
-  OSStatus result      = SSLWrite(ssl, buffer, length, (size_t*)(&bytesWritten));
+  __CFSpinUnlock(&gSecurityLock);
+}
 
-  /* Check to see if error was set during the write. */
-  if (ctxt->_error.error)
-    return -1;
+/* static */ CFIndex _SocketStreamSecuritySend_NoLock(_CFSocketStreamContext* ctxt, const UInt8* buffer, CFIndex length)
+{
+  int bytesWritten;
 
-  /* If the stream wrote bytes but then got a blocking error, pass it as success. */
-  if ((result == errSSLWouldBlock) && bytesWritten) {
-    _SocketStreamAddHandshake_NoLock(ctxt, _PerformSecuritySendHandshake_NoLock);
-    result = noErr;
-  }
+  SSL* ssl = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
 
-  /* Deal with result. */
-  switch (result) {
-    case errSSLClosedGraceful: /* Non-fatal error */
-    case errSSLClosedAbort:    /* Assumed non-fatal error (but may not be) **FIXME** ?? */
+  /* The BIO never blocks, so this either takes everything or fails. */
+  ERR_clear_error();
+  bytesWritten = SSL_write(ssl, buffer, (length > INT_MAX) ? INT_MAX : (int)length);
 
-      /* Mark SSL as closed.  There could still be bytes in the buffers. */
-      __CFBitSet(ctxt->_flags, kFlagBitClosed);
+  if (bytesWritten <= 0) {
+    switch (SSL_get_error(ssl, bytesWritten)) {
+      case SSL_ERROR_ZERO_RETURN:
 
-      /* NOTE the fall through. */
+        /* Mark SSL as closed.  There could still be bytes in the buffers. */
+        __CFBitSet(ctxt->_flags, kFlagBitClosed);
+        return 0;
 
-    case noErr:
-      break;
+      default:
+        _SocketStreamSecuritySetError_NoLock(ctxt, ssl, bytesWritten);
+        return -1;
+    }
+  }
 
-    default:
-      ctxt->_error.error  = result;
-      ctxt->_error.domain = kCFStreamErrorDomainSSL;
+  /* If the socket didn't take it all, hold off further writes until it has. */
+  if (!_SocketStreamSecurityFlush_NoLock(ctxt)) {
+    if (ctxt->_error.error)
       return -1;
+
+    _SocketStreamAddHandshake_NoLock(ctxt, _PerformSecuritySendHandshake_NoLock);
   }
 
   return bytesWritten;
@@ -5395,90 +7878,92 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
   ** into the unencrypted buffer.
   */
 
-  CFIndex* i;
-  CFIndex  s            = kRecvBufferSize;
-  OSStatus status       = noErr;
+  struct iovec             iov[2];
+  int                      status = SSL_ERROR_NONE;
 
-  SSLContextRef ssl     = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
+  SSL*                     ssl    = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
 
   /* Get the bits required in order to work with the buffer. */
-  CFNumberRef      size = (CFNumberRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferSize);
-  CFMutableDataRef buffer = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBuffer);
-  CFMutableDataRef count  = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
-
-  /* No buffer assumes all are missing. */
-  if (!buffer) {
-    CFAllocatorRef alloc = CFGetAllocator(ctxt->_properties);
+  _CFSocketStreamRecvRing* ring   = _SocketStreamGetRecvRing_NoLock(ctxt);
 
-    /* If no size, assume a default.  Can be overridden by properties. */
-    if (!size)
-      size = CFNumberCreate(alloc, kCFNumberCFIndexType, &s);
-    else
-      CFNumberGetValue(size, kCFNumberCFIndexType, &s);
+  /* Failure to create the ring already set the error. */
+  if (!ring)
+    return;
 
-    /* Create the backing for the buffer and the counter. */
-    if (size) {
-      buffer = CFDataCreateMutable(alloc, s);
-      count  = CFDataCreateMutable(alloc, sizeof(CFIndex));
-    }
+  /* Only read if there is room in the buffer. */
+  if (ring->_count + ring->_lent < ring->_limit) {
+    CFIndex start = ring->_count;
 
-    /* If anything failed, set out of memory and bail. */
-    if (!buffer || !count || !size) {
-      if (buffer)
-        CFRelease(buffer);
-      if (count)
-        CFRelease(count);
-      if (size)
-        CFRelease(size);
+    _SocketStreamSecurityRecvStartPass_NoLock(ctxt);
 
-      ctxt->_error.error  = ENOMEM;
-      ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+    /* Keep reading out of the encrypted buffer until an error or full. */
+    while ((status == SSL_ERROR_NONE) && _SocketStreamRecvRingGetSpace_NoLock(ctxt, ring, iov)) {
+      size_t bytesRead = 0;
 
-      return; /* NOTE the eary return. */
+      /* Read out of the encrypted and into the unencrypted, one contiguous piece at a time. */
+      ERR_clear_error();
+      if (SSL_read_ex(ssl, iov[0].iov_base, iov[0].iov_len, &bytesRead))
+        ring->_count += bytesRead;
+      else
+        status = SSL_get_error(ssl, 0);
     }
 
-    /* Save the buffer information. */
-    CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferSize, size);
-    CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertyRecvBuffer, buffer);
-    CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount, count);
-
-    CFRelease(size);
-    CFRelease(buffer);
-    CFRelease(count);
+    /* Reading may have produced records of its own, such as key updates. */
+    _SocketStreamSecurityFlush_NoLock(ctxt);
 
-    /* Start with a zero byte count. */
-    *((CFIndex*)CFDataGetMutableBytePtr(count)) = 0;
+    /* If didn't read bytes and the buffer is empty but SSL hasn't closed, need read events again. */
+    if ((ring->_count == start) && (ring->_count == 0) && !__CFBitIsSet(ctxt->_flags, kFlagBitClosed))
+      CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
   }
 
-  /* Get the count and size of the buffer, respectively. */
-  i = (CFIndex*)CFDataGetMutableBytePtr(count);
-  CFNumberGetValue(size, kCFNumberCFIndexType, &s);
+  _SocketStreamSecurityReadStatus_NoLock(ctxt, ssl, status, ring->_count);
+}
 
-  /* Only read if there is room in the buffer. */
-  if (*i < s) {
-    CFIndex start = *i;
-    UInt8*  ptr   = (UInt8*)CFDataGetMutableBytePtr(buffer);
+/* static */ CFIndex _SocketStreamSecurityDirectRead_NoLock(_CFSocketStreamContext* ctxt, UInt8* buffer, CFIndex length)
+{
+  /* Same as above, but into the client's buffer, which saves copying through the unencrypted buffer. */
 
-    /* Keep reading out of the encrypted buffer until an error or full. */
-    while (!status && (*i < s)) {
-      CFIndex bytesRead = 0;
+  CFIndex result = 0;
+  int     status = SSL_ERROR_NONE;
 
-      /* Read out of the encrypted and into the unencrypted. */
-      status            = SSLRead(ssl, ptr + *i, s - *i, (size_t*)(&bytesRead));
+  SSL*    ssl    = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
 
-      /* If did read bytes, increase the count. */
-      if (bytesRead > 0)
-        *i = *i + bytesRead;
-    }
+  _SocketStreamSecurityRecvStartPass_NoLock(ctxt);
 
-    /* If didn't read bytes and the buffer is empty but SSL hasn't closed, need read events again. */
-    if ((*i == start) && (*i == 0) && !__CFBitIsSet(ctxt->_flags, kFlagBitClosed))
-      CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
+  /* Take as many records as are in and fit. */
+  while ((status == SSL_ERROR_NONE) && (result < length)) {
+    size_t bytesRead = 0;
+
+    ERR_clear_error();
+    if (SSL_read_ex(ssl, buffer + result, length - result, &bytesRead))
+      result += bytesRead;
+    else
+      status = SSL_get_error(ssl, 0);
   }
 
+  _SocketStreamSecurityFlush_NoLock(ctxt);
+
+  if (!result && !__CFBitIsSet(ctxt->_flags, kFlagBitClosed))
+    CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
+
+  _SocketStreamSecurityReadStatus_NoLock(ctxt, ssl, status, result);
+
+  return result;
+}
+
+/* static */ void _SocketStreamSecurityReadStatus_NoLock(_CFSocketStreamContext* ctxt, SSLContextRef ssl, OSStatus status, CFIndex bytesWaiting)
+{
+  /* Sorts out how a pass of reading ended. */
+
   switch (status) {
-    case errSSLClosedGraceful: /* Non-fatal error */
-    case errSSLClosedAbort:    /* Assumed non-fatal error (but may not be) **FIXME** ?? */
+    case SSL_ERROR_SYSCALL:
+      /* A socket error is fatal, but the peer going away without a close notify is taken as a close. */
+      if (ctxt->_error.error)
+        break;
+
+      /* NOTE the fall through. */
+
+    case SSL_ERROR_ZERO_RETURN:
 
       /* SSL has closed, so mark as such. */
       __CFBitSet(ctxt->_flags, kFlagBitClosed);
@@ -5487,188 +7972,168 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
 
       /* NOTE the fall through. */
 
-    case noErr:
-    case errSSLWouldBlock:
+    case SSL_ERROR_NONE:
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
 
-      /* If there are bytes in the buffer to be read, set the bit. */
-      if (*i) {
+      /* If there are bytes to be read, set the bit. */
+      if (bytesWaiting) {
         __CFBitSet(ctxt->_flags, kFlagBitCanRead);
         __CFBitClear(ctxt->_flags, kFlagBitPollRead);
       }
       break;
 
     default:
-      if (!ctxt->_error.error) {
-        ctxt->_error.error  = status;
-        ctxt->_error.domain = kCFStreamErrorDomainSSL;
-      }
+      _SocketStreamSecuritySetError_NoLock(ctxt, ssl, -1);
       break;
   }
 }
 
 /* static */ void _PerformSecurityHandshake_NoLock(_CFSocketStreamContext* ctxt)
 {
-  OSStatus    result;
-  const void* peerid = NULL;
-  size_t      peeridlen;
-
-  SSLContextRef ssl = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
+  int result;
 
-  /* Make sure the peer id has been set for ST performance. */
-  result            = SSLGetPeerID(ssl, &peerid, &peeridlen);
-  if (!result && !peerid) {
-    Boolean set     = FALSE;
+  SSL*      ssl    = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
+  CFDataRef peerID = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySecurityPeerID);
 
-    /* Check to see if going through a proxy.  A different ID is used in that case. */
-    CFTypeRef value = (CFTypeRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertyCONNECTProxy);
-    if (!value)
-      value = (CFTypeRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySOCKSProxy);
+  /* Before the first flight, look for a session to resume. */
+  if (!peerID && SSL_in_before(ssl) && !SSL_is_server(ssl)) {
+    CFDataRef id = _SocketStreamSecurityCreatePeerID_NoLock(ctxt);
 
-    /* Use the name and port of the far end host. */
-    if (value) {
-      CFStringRef   host = NULL;
-      CFNumberRef   port = NULL;
-      CFStreamError error;
+    if (id) {
+      const char* name = (const char*)SSL_get_ex_data(ssl, gSecurityPeerNameIndex);
 
-      /* Re-use some code to get the host and port of the far end. */
-      _CreateNameAndPortForCONNECTProxy(ctxt->_properties, &host, &port, &error);
+      /* The name being checked is part of the key; see above. */
+      if (name) {
+        CFMutableDataRef key = CFDataCreateMutableCopy(CFGetAllocator(ctxt->_properties), 0, id);
 
-      /* Only do it if got the host and port, otherwise it'll fall through to the address. */
-      if (host && port) {
-        SInt32         p;
-        CFStringRef    peer;
-        CFAllocatorRef alloc = CFGetAllocator(ctxt->_properties);
+        if (key) {
+          CFDataAppendBytes(key, (const UInt8*)"", 1);
+          CFDataAppendBytes(key, (const UInt8*)name, strlen(name));
+        }
 
-        /* Get the real port value. */
-        CFNumberGetValue(port, kCFNumberSInt32Type, &p);
+        CFRelease(id);
+        id = key;
+      }
+    }
 
-        /* Produce the ID as <host>:<port>. */
-        peer = CFStringCreateWithFormat(alloc, NULL, _kCFStreamCONNECTURLFormat, host, p & 0x0000FFFF);
+    if (id) {
+      SSL_SESSION* session = _SecuritySessionCacheCopy(id);
 
-        if (peer) {
-          UInt8   static_buffer[1024];
-          UInt8*  buffer      = &static_buffer[0];
-          CFIndex buffer_size = sizeof(static_buffer);
+      if (session) {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+      }
 
-          /* Get the raw bytes to use as the ID. */
-          buffer              = _CFStringGetOrCreateCString(alloc, peer, static_buffer, &buffer_size, kCFStringEncodingUTF8);
+      CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertySecurityPeerID, id);
+      CFRelease(id);
 
-          CFRelease(peer);
+      peerID = id;
+    }
+  }
 
-          /* Set the peer ID. */
-          SSLSetPeerID(ssl, buffer, buffer_size);
+  /* Anything from the last pass the socket didn't take goes first. */
+  if (!_SocketStreamSecurityFlush_NoLock(ctxt) && !ctxt->_error.error)
+    return;
 
-          /* Did it. */
-          set = TRUE;
+  _SocketStreamSecurityRecvStartPass_NoLock(ctxt);
 
-          /* Clean up the allocation if made. */
-          if (buffer != &static_buffer[0])
-            CFAllocatorDeallocate(alloc, buffer);
-        }
-      }
+  if (!ctxt->_error.error) {
+    /* Perform the SSL handshake. */
+    ERR_clear_error();
+    result = SSL_do_handshake(ssl);
 
-      if (host)
-        CFRelease(host);
-      if (port)
-        CFRelease(port);
-    }
+    if (result != 1) {
+      int error = SSL_get_error(ssl, result);
 
-    if (!set) {
-      UInt8            static_buffer[SOCK_MAXADDRLEN];
-      struct sockaddr* sa      = (struct sockaddr*)&static_buffer[0];
-      socklen_t        addrlen = sizeof(static_buffer);
-
-      if (!getpeername(CFSocketGetNative(ctxt->_socket), sa, &addrlen)) {
-        if (sa->sa_family == AF_INET) {
-          in_port_t port = ((struct sockaddr_in*)sa)->sin_port;
-          memmove(static_buffer, &(((struct sockaddr_in*)sa)->sin_addr), sizeof(((struct sockaddr_in*)sa)->sin_addr));
-          memmove(static_buffer + sizeof(((struct sockaddr_in*)sa)->sin_addr), &port, sizeof(port));
-          SSLSetPeerID(ssl, static_buffer, sizeof(((struct sockaddr_in*)sa)->sin_addr) + sizeof(port));
-        } else if (sa->sa_family == AF_INET6) {
-          in_port_t port = ((struct sockaddr_in6*)sa)->sin6_port;
-          memmove(static_buffer, &(((struct sockaddr_in6*)sa)->sin6_addr), sizeof(((struct sockaddr_in6*)sa)->sin6_addr));
-          memmove(static_buffer + sizeof(((struct sockaddr_in6*)sa)->sin6_addr), &port, sizeof(port));
-          SSLSetPeerID(ssl, static_buffer, sizeof(((struct sockaddr_in6*)sa)->sin6_addr) + sizeof(port));
+      /* Still going, so wait for the peer once what was produced is out. */
+      if ((error == SSL_ERROR_WANT_READ) || (error == SSL_ERROR_WANT_WRITE)) {
+        if (_SocketStreamSecurityFlush_NoLock(ctxt) || !ctxt->_error.error) {
+          CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
+          return;
         }
       }
+
+      else
+        _SocketStreamSecuritySetError_NoLock(ctxt, ssl, result);
     }
-  }
 
-  /* Perform the SSL handshake. */
-  result = SSLHandshake(ssl);
+    else {
+      CFBooleanRef check = (CFBooleanRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySSLAllowAnonymousCiphers);
 
-  /* If not blocking, can do something. */
-  if (result != errSSLWouldBlock) {
-    /* Was it noErr? */
-    if (result) {
-      ctxt->_error.error  = result;
-      ctxt->_error.domain = kCFStreamErrorDomainSSL;
-    } else {
-      CFBooleanRef check;
+      /* Anything left over of the last flight doesn't need to hold things up. */
+      if (!_SocketStreamSecurityFlush_NoLock(ctxt) && !ctxt->_error.error)
+        _SocketStreamAddHandshake_NoLock(ctxt, _PerformSecuritySendHandshake_NoLock);
 
-      check = (CFBooleanRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySSLAllowAnonymousCiphers);
       if (!check || (CFBooleanGetValue(check) == FALSE)) {
-        SSLCipherSuite cipherSuite;
+        const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl);
 
-        if (SSLGetNegotiatedCipher(ssl, &cipherSuite) == noErr) {
-          if (cipherSuite == SSL_DH_anon_EXPORT_WITH_RC4_40_MD5 || cipherSuite == SSL_DH_anon_WITH_RC4_128_MD5 ||
-              cipherSuite == SSL_DH_anon_EXPORT_WITH_DES40_CBC_SHA || cipherSuite == SSL_DH_anon_WITH_DES_CBC_SHA ||
-              cipherSuite == SSL_DH_anon_WITH_3DES_EDE_CBC_SHA || cipherSuite == SSL_RSA_WITH_NULL_MD5 ||
-              cipherSuite == TLS_DH_anon_WITH_AES_128_CBC_SHA || cipherSuite == TLS_DH_anon_WITH_AES_256_CBC_SHA) {
-            /* close the connnection and return errSSLBadCipherSuite */
-            (void)SSLClose(ssl);
-            ctxt->_error.error  = errSSLBadCipherSuite;
-            ctxt->_error.domain = kCFStreamErrorDomainSSL;
-          }
+        if (cipher && (SSL_CIPHER_get_auth_nid(cipher) == NID_auth_null)) {
+          /* close the connnection and return errSSLBadCipherSuite */
+          (void)SSL_shutdown(ssl);
+          ctxt->_error.error  = errSSLBadCipherSuite;
+          ctxt->_error.domain = kCFStreamErrorDomainSSL;
         }
       }
     }
+  }
 
-    /* Either way, it's done.  Mark the SSL bit for performance checks. */
-    __CFBitSet(ctxt->_flags, kFlagBitUseSSL);
-    __CFBitSet(ctxt->_flags, kFlagBitIsBuffered);
-    _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSecurityHandshake_NoLock);
+  /* Don't try the session again if it didn't work out. */
+  if (ctxt->_error.error && peerID)
+    _SecuritySessionCacheRemove(peerID);
+
+  /* Either way, it's done.  Mark the SSL bit for performance checks. */
+  __CFBitSet(ctxt->_flags, kFlagBitUseSSL);
+  __CFBitSet(ctxt->_flags, kFlagBitIsBuffered);
+  _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSecurityHandshake_NoLock);
+
+#if defined(__linux__)
+  /* If the kernel takes over the records, the plain socket paths are used from here on. */
+  if (!ctxt->_error.error && _SocketStreamSecurityStartKernelTLS_NoLock(ctxt, ssl)) {
+    __CFBitClear(ctxt->_flags, kFlagBitUseSSL);
+    __CFBitSet(ctxt->_flags, kFlagBitKernelTLS);
   }
+
+  /* The secrets aren't needed past the handshake. */
+  CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySecurityClientSecret);
+  CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySecurityServerSecret);
+#endif
 }
 
 /* static */ void _PerformSecuritySendHandshake_NoLock(_CFSocketStreamContext* ctxt)
 {
-  OSStatus result;
-  CFIndex  bytesWritten;
-
-  SSLContextRef ssl = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
-
-  /* Attempt to write. */
-  result            = SSLWrite(ssl, NULL, 0, (size_t*)(&bytesWritten));
-
-  /* If didn't get a block, can do something. */
-  if (result == errSSLWouldBlock)
-    CFSocketEnableCallBacks(ctxt->_socket, kCFSocketWriteCallBack);
-  else {
-    /* Remove the "send" handshake. */
+  /* Once everything is out or it failed, writes can go on (or report the error). */
+  if (_SocketStreamSecurityFlush_NoLock(ctxt) || ctxt->_error.error)
     _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSecuritySendHandshake_NoLock);
-
-    /* Need to save real errors. */
-    if (result) {
-      ctxt->_error.error  = result;
-      ctxt->_error.domain = kCFStreamErrorDomainSSL;
-    }
-  }
 }
 
 /* static */ void _SocketStreamSecurityClose_NoLock(_CFSocketStreamContext* ctxt)
 {
   /*
-  ** This function is required during close in order to fully flush ST
-  ** and dump the SSLContextRef.
+  ** This function is required during close in order to send the close
+  ** notify, fully flush what the socket hasn't taken and free the SSL.
   */
 
-  SSLContextRef ssl = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
+  SSL* ssl = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
 
-  /* Attempt to close and flush out any bytes. */
-  while (!ctxt->_error.error && (errSSLWouldBlock == SSLClose(ssl))) {
+#if defined(__linux__)
+  /* OpenSSL's keys are stale once the kernel has the records, so it does the close notify too. */
+  if (__CFBitIsSet(ctxt->_flags, kFlagBitKernelTLS))
+    _SocketStreamKernelTLSClose_NoLock(ctxt);
+  else
+#endif
+  if (!ctxt->_error.error && SSL_is_init_finished(ssl) && !(SSL_get_shutdown(ssl) & SSL_SENT_SHUTDOWN)) {
+    ERR_clear_error();
+    (void)SSL_shutdown(ssl);
+  }
+
+  /* Attempt to flush out any bytes. */
+  while (!_SocketStreamSecurityFlush_NoLock(ctxt) && !ctxt->_error.error) {
     CFTypeRef loopAndMode[2] = {CFRunLoopGetCurrent(), _kCFStreamSocketSecurityClosePrivateMode};
 
+    /* The write event comes through the send handshake. */
+    _SocketStreamAddHandshake_NoLock(ctxt, _PerformSecuritySendHandshake_NoLock);
+
     /* Add the current loop and the private mode to the list */
     _SchedulesAddRunLoopAndMode(ctxt->_sharedloops, (CFRunLoopRef)loopAndMode[0], (CFStringRef)loopAndMode[1]);
 
@@ -5693,11 +8158,16 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
     _SchedulesRemoveRunLoopAndMode(ctxt->_sharedloops, (CFRunLoopRef)loopAndMode[0], (CFStringRef)loopAndMode[1]);
   }
 
-  /* Destroy the SSLContext. */
-  SSLDisposeContext(ssl);
+  _SocketStreamRemoveHandshake_NoLock(ctxt, _PerformSecuritySendHandshake_NoLock);
+
+  /* Destroy the SSL. */
+  SSL_free(ssl);
 
   /* Remove it from the properties for no touch. */
   CFDictionaryRemoveValue(ctxt->_properties, kCFStreamPropertySocketSSLContext);
+  CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySecuritySendBuffer);
+  CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySecurityPeerID);
+  _SocketStreamSecurityRecvRelease_NoLock(ctxt);
 }
 
 /* static */ Boolean _SocketStreamSecuritySetContext_NoLock(_CFSocketStreamContext* ctxt, CFDataRef value)
@@ -5705,6 +8175,7 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
   CFDataRef     wrapper  = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext);
   SSLContextRef old      = wrapper ? *((SSLContextRef*)CFDataGetBytePtr(wrapper)) : NULL;
   SSLContextRef security = value ? *((SSLContextRef*)CFDataGetBytePtr(value)) : NULL;
+  BIO*          bio;
 
   if (old) {
     /* Can only do something if idle (not opened). */
@@ -5713,7 +8184,7 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
 
     /* If not setting the same, destroy the old. */
     if (security != old)
-      SSLDisposeContext(old);
+      SSL_free(old);
 
     /* Remove the one that was there. */
     CFDictionaryRemoveValue(ctxt->_properties, kCFStreamPropertySocketSSLContext);
@@ -5730,23 +8201,30 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
     return TRUE;
   }
 
-  /* Set the read/write functions on the context and set the reference. */
-  if ((!(ctxt->_error.error = SSLSetIOFuncs(security, (SSLReadFunc)_SecurityReadFunc_NoLock, (SSLWriteFunc)_SecurityWriteFunc_NoLock))) &&
-      (!(ctxt->_error.error = SSLSetConnection(security, (SSLConnectionRef)ctxt)))) {
-    /* Add the handshake to the list of things to perform. */
-    Boolean result = _SocketStreamAddHandshake_NoLock(ctxt, _PerformSecurityHandshake_NoLock);
+  /* Make sure the BIO method exists; contexts may have come from elsewhere. */
+  if (!_SecurityGetClientContext() || !(bio = BIO_new(gSecurityBIOMethod))) {
+    ctxt->_error.error  = ENOMEM;
+    ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+    return FALSE;
+  }
 
-    /* If added, save the context. */
-    if (result)
-      CFDictionarySetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext, value);
+  /* Set the read/write BIO on the context and set the reference. */
+  BIO_set_data(bio, ctxt);
+  BIO_set_init(bio, 1);
+  SSL_set_bio(security, bio, bio);
+  SSL_set_app_data(security, ctxt);
 
-    return result;
-  }
+  if (!SSL_is_server(security))
+    SSL_set_connect_state(security);
 
-  /* Error was set, so set the domain. */
-  ctxt->_error.domain = kCFStreamErrorDomainSSL;
+  /* Add the handshake to the list of things to perform. */
+  if (!_SocketStreamAddHandshake_NoLock(ctxt, _PerformSecurityHandshake_NoLock))
+    return FALSE;
 
-  return FALSE;
+  /* If added, save the context. */
+  CFDictionarySetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext, value);
+
+  return TRUE;
 }
 
 /* static */ Boolean _SocketStreamSecuritySetInfo_NoLock(_CFSocketStreamContext* ctxt, CFDictionaryRef settings)
@@ -5763,67 +8241,66 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
     return TRUE;
 
   do {
+    SSL_CTX*     context;
+    uintptr_t    lax   = 0;
     CFTypeRef    value = CFDictionaryGetValue(settings, kCFStreamSSLIsServer);
     CFBooleanRef check = (CFBooleanRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketSecurityAuthenticatesServerCertificate);
 
-    /* Create a new SSLContext. */
-    if (SSLNewContext((value && CFEqual(value, kCFBooleanTrue)), &security))
+    /* There's no representation of an identity here, so only clients are supported. */
+    if (value && CFEqual(value, kCFBooleanTrue))
       break;
 
-    /* Figure out the correct security level to set and set it. */
     value = CFDictionaryGetValue(settings, kCFStreamSSLLevel);
-    if ((!value || CFEqual(value, kCFStreamSocketSecurityLevelNegotiatedSSL)) && SSLSetProtocolVersion(security, kTLSProtocol1))
-      break;
+    if (value && CFEqual(value, kCFStreamSocketSecurityLevelNone))
+      return TRUE;
 
-    else if (value) {
-      if (CFEqual(value, kCFStreamSocketSecurityLevelNone)) {
-        SSLDisposeContext(security);
-        return TRUE;
-      }
+    /* Create a new SSL. */
+    if (!(context = _SecurityGetClientContext()) || !(security = SSL_new(context)))
+      break;
 
-      else if (CFEqual(value, kCFStreamSocketSecurityLevelSSLv2) && SSLSetProtocolVersion(security, kSSLProtocol2))
+    /*
+    ** Figure out the correct security level to set and set it.  The levels
+    ** naming TLS set the lowest version allowed, since TLS 1.0 alone is
+    ** no longer something servers accept.
+    */
+    if (value && !CFEqual(value, kCFStreamSocketSecurityLevelNegotiatedSSL)) {
+      if (CFEqual(value, kCFStreamSocketSecurityLevelSSLv2))
         break;
 
-      else if (CFEqual(value, kCFStreamSocketSecurityLevelSSLv3) && SSLSetProtocolVersion(security, kSSLProtocol3Only))
+      else if (CFEqual(value, kCFStreamSocketSecurityLevelSSLv3) &&
+               (!SSL_set_min_proto_version(security, SSL3_VERSION) || !SSL_set_max_proto_version(security, SSL3_VERSION)))
         break;
 
-      else if (CFEqual(value, kCFStreamSocketSecurityLevelTLSv1) && SSLSetProtocolVersion(security, kTLSProtocol1Only))
+      else if (CFEqual(value, kCFStreamSocketSecurityLevelTLSv1) && !SSL_set_min_proto_version(security, TLS1_VERSION))
         break;
 
-      else if (CFEqual(value, kCFStreamSocketSecurityLevelTLSv1SSLv3) &&
-               (SSLSetProtocolVersion(security, kTLSProtocol1) || SSLSetProtocolVersionEnabled(security, kSSLProtocol2, FALSE))) {
+      else if (CFEqual(value, kCFStreamSocketSecurityLevelTLSv1SSLv3) && !SSL_set_min_proto_version(security, SSL3_VERSION))
         break;
-      }
     }
 
     /* If old property for cert auth was used, set lax now.  New settings override. */
-    if (check && (check == kCFBooleanFalse)) {
-      if (SSLSetAllowsExpiredRoots(security, TRUE))
-        break;
-
-      if (SSLSetAllowsAnyRoot(security, TRUE))
-        break;
-    }
+    if (check && (check == kCFBooleanFalse))
+      lax |= kSecurityAllowsExpired | kSecurityAllowsAnyRoot;
 
     /* Set all the different properties based upon dictionary settings. */
     value = CFDictionaryGetValue(settings, kCFStreamSSLAllowsExpiredCertificates);
-    if (value && CFEqual(value, kCFBooleanTrue) && SSLSetAllowsExpiredCerts(security, TRUE))
-      break;
+    if (value && CFEqual(value, kCFBooleanTrue))
+      lax |= kSecurityAllowsExpired;
 
     value = CFDictionaryGetValue(settings, kCFStreamSSLAllowsExpiredRoots);
-    if (value && CFEqual(value, kCFBooleanTrue) && SSLSetAllowsExpiredRoots(security, TRUE))
-      break;
+    if (value && CFEqual(value, kCFBooleanTrue))
+      lax |= kSecurityAllowsExpired;
 
     value = CFDictionaryGetValue(settings, kCFStreamSSLAllowsAnyRoot);
-    if (value && CFEqual(value, kCFBooleanTrue) && SSLSetAllowsAnyRoot(security, TRUE))
-      break;
+    if (value && CFEqual(value, kCFBooleanTrue))
+      lax |= kSecurityAllowsAnyRoot;
 
     value = CFDictionaryGetValue(settings, kCFStreamSSLValidatesCertificateChain);
-    if (value && CFEqual(value, kCFBooleanFalse) && SSLSetEnableCertVerify(security, FALSE))
-      break;
+    if (value && CFEqual(value, kCFBooleanFalse))
+      lax |= kSecuritySkipsChain;
 
-    value = CFDictionaryGetValue(settings, kCFStreamSSLCertificates);
-    if (value && SSLSetCertificate(security, value))
+    /* Client identities are SecIdentityRef's, which don't exist here. */
+    if (CFDictionaryGetValue(settings, kCFStreamSSLCertificates))
       break;
 
     /* Get the peer name or figure out the peer name to use. */
@@ -5854,37 +8331,18 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
         value = CFNetServiceGetTargetHost((CFNetServiceRef)lookup);
     }
 
-    /* If got a name, try to set it. */
-    if (value) {
-      /* kCFNull value means don't check the peer name. */
-      if (CFEqual(value, kCFNull)) {
-        if (SSLSetPeerDomainName(security, NULL, 0))
-          break;
-      }
-
-      /* Pull out the bytes and set 'cause ST doesn't do CFString's for this. */
-      else {
-        OSStatus       err;
-        UInt8          static_buffer[1024];
-        UInt8*         buffer      = &static_buffer[0];
-        CFIndex        buffer_size = sizeof(static_buffer);
-        CFAllocatorRef alloc       = CFGetAllocator(ctxt->_properties);
-
-        buffer                     = _CFStringGetOrCreateCString(alloc, value, static_buffer, &buffer_size, kCFStringEncodingUTF8);
-
-        /* After pulling out the bytes, set the peer name. */
-        err                        = SSLSetPeerDomainName(security, (const char*)buffer, *((size_t*)(&buffer_size)));
+    /* No name means nothing to check it against. */
+    if (!value || CFEqual(value, kCFNull))
+      lax |= kSecuritySkipsPeerName;
 
-        /* Clean up the allocation if made. */
-        if (buffer != &static_buffer[0])
-          CFAllocatorDeallocate(alloc, buffer);
+    if (value && !_SecuritySetPeerName(security, value, CFGetAllocator(ctxt->_properties)))
+      break;
 
-        if (err)
-          break;
-      }
-    }
+    /* Check the certificates as asked. */
+    SSL_set_ex_data(security, gSecurityFlagsIndex, (void*)lax);
+    SSL_set_verify(security, SSL_VERIFY_PEER, _SecurityVerifyCallBack);
 
-    /* Wrap the SSLContextRef as a CFData. */
+    /* Wrap the SSL as a CFData. */
     wrapper = CFDataCreate(CFGetAllocator(ctxt->_properties), (void*)&security, sizeof(security));
 
     /* Set the property. */
@@ -5897,9 +8355,9 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
 
   } while (1);
 
-  /* Clean up the SSLContextRef on failure. */
+  /* Clean up the SSL on failure. */
   if (security)
-    SSLDisposeContext(security);
+    SSL_free(security);
 
   if (wrapper)
     CFRelease(wrapper);
@@ -5909,119 +8367,397 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
 
 /* static */ Boolean _SocketStreamSecuritySetAuthenticatesServerCertificates_NoLock(_CFSocketStreamContext* ctxt, CFBooleanRef authenticates)
 {
-  SSLContextRef ssl = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
+  SSL*        ssl    = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
+  uintptr_t   lax    = (uintptr_t)SSL_get_ex_data(ssl, gSecurityFlagsIndex) & ~(kSecurityAllowsExpired | kSecurityAllowsAnyRoot | kSecuritySkipsPeerName);
+  CFTypeRef   value  = NULL;
+  CFStringRef name   = (CFStringRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketPeerName);
+  CFTypeRef   lookup = (CFTypeRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteHost);
 
-  do {
-    CFTypeRef   value  = NULL;
-    CFStringRef name   = (CFStringRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketPeerName);
-    CFTypeRef   lookup = (CFTypeRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteHost);
+  /* Set lax and the peer name as kCFNull if turning off. */
+  if (authenticates == kCFBooleanFalse) {
+    lax |= kSecurityAllowsExpired | kSecurityAllowsAnyRoot;
+    value = kCFNull;
+  }
 
-    /* Set lax if turning off */
-    if (SSLSetAllowsExpiredRoots(ssl, authenticates ? FALSE : TRUE))
-      break;
+  /*
+  ** **FIXME** Once the new improved CONNECT stuff is in, peer name override
+  ** should go away.
+  */
+  else if (name)
+    value = name;
 
-    /* Set lax if turning off */
-    if (SSLSetAllowsAnyRoot(ssl, authenticates ? FALSE : TRUE))
+  /* Figure out the proper peer name for CFHost or CFNetService. */
+  else if (lookup) {
+    CFArrayRef names = CFHostGetNames((CFHostRef)lookup, NULL);
+    if (names)
+      value = CFArrayGetValueAtIndex(names, 0);
+  }
+
+  else if ((lookup = (CFTypeRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteNetService)))
+    value = CFNetServiceGetTargetHost((CFNetServiceRef)lookup);
+
+  /* No value is a failure. */
+  if (!value || !_SecuritySetPeerName(ssl, value, CFGetAllocator(ctxt->_properties)))
+    return FALSE;
+
+  if (CFEqual(value, kCFNull))
+    lax |= kSecuritySkipsPeerName;
+
+  SSL_set_ex_data(ssl, gSecurityFlagsIndex, (void*)lax);
+
+  return TRUE;
+}
+
+/* static */ CFStringRef _SecurityGetProtocol(SSLContextRef security)
+{
+  /* Once negotiated, map the protocol from OpenSSL to CFSocketStream property values. */
+  if (SSL_is_init_finished(security))
+    return (SSL_version(security) == SSL3_VERSION) ? kCFStreamSocketSecurityLevelSSLv3 : kCFStreamSocketSecurityLevelTLSv1;
+
+  /* Otherwise go by the range that was set. */
+  switch (SSL_get_min_proto_version(security)) {
+    case SSL3_VERSION:
+      return (SSL_get_max_proto_version(security) == SSL3_VERSION) ? kCFStreamSocketSecurityLevelSSLv3 : kCFStreamSocketSecurityLevelTLSv1SSLv3;
+
+    case TLS1_VERSION:
+      return kCFStreamSocketSecurityLevelTLSv1;
+
+    default:
+      return kCFStreamSocketSecurityLevelNegotiatedSSL;
+  }
+}
+
+/* static */ SSLSessionState _SocketStreamSecurityGetSessionState_NoLock(_CFSocketStreamContext* ctxt)
+{
+  SSL* ssl = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
+
+  if (SSL_get_shutdown(ssl))
+    return kSSLClosed;
+
+  if (SSL_is_init_finished(ssl))
+    return kSSLConnected;
+
+  return SSL_in_before(ssl) ? kSSLIdle : kSSLHandshake;
+}
+
+#if defined(__linux__)
+
+/*
+** With _kCFStreamPropertySocketKernelTLS, the keys of an AES-GCM session
+** are handed to the kernel once the handshake is done, and from then on
+** the kernel does the records.  Reads and writes go the plain socket
+** paths, which saves the copies through OpenSSL and allows sendfile.
+*/
+enum {
+  kRecordTypeAlert           = 21,
+  kRecordTypeHandshake       = 22,
+  kRecordTypeApplicationData = 23,
+
+  kAlertCloseNotify          = 0,
+  kHandshakeNewSessionTicket = 4
+};
+
+/* static */ void _SecurityKeyLogCallBack(const SSL* ssl, const char* line)
+{
+  /*
+  ** TLS 1.3 traffic secrets are only given out through the key log.  They
+  ** are only kept for streams wanting kernel SSL, until the handshake is
+  ** done.
+  */
+
+  _CFSocketStreamContext* ctxt = (_CFSocketStreamContext*)SSL_get_app_data(ssl);
+  CFStringRef             key  = NULL;
+  UInt8                   secret[EVP_MAX_MD_SIZE];
+  CFIndex                 length = 0;
+  const char*             hex;
+  CFDataRef               value;
+
+  if (!ctxt || (CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketKernelTLS) != kCFBooleanTrue))
+    return;
+
+  if (!strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24))
+    key = _kCFStreamPropertySecurityClientSecret;
+  else if (!strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24))
+    key = _kCFStreamPropertySecurityServerSecret;
+  else
+    return;
+
+  /* The line is the label, the client random and the secret, all in hex. */
+  if (!(hex = strchr(line + 24, ' ')))
+    return;
+
+  for (hex++; hex[0] && hex[1] && (length < sizeof(secret)); hex += 2) {
+    unsigned int byte;
+
+    if (sscanf(hex, "%2x", &byte) != 1)
       break;
 
-    /* Set peer name as kCFNull if turning off. */
-    if (authenticates == kCFBooleanFalse)
-      value = kCFNull;
+    secret[length++] = (UInt8)byte;
+  }
+
+  if ((value = CFDataCreate(CFGetAllocator(ctxt->_properties), secret, length))) {
+    CFDictionarySetValue(ctxt->_properties, key, value);
+    CFRelease(value);
+  }
+
+  OPENSSL_cleanse(secret, sizeof(secret));
+}
+
+/* static */ Boolean _SecurityExpandLabel(const EVP_MD* md, const UInt8* secret, size_t secretLength, const char* label, UInt8* out, size_t outLength)
+{
+  /* HKDF-Expand-Label from RFC 8446 with an empty context. */
+
+  Boolean       result = FALSE;
+  size_t        labelLength = strlen(label);
+  UInt8         info[4 + 6 + 255];
+  EVP_PKEY_CTX* pctx;
+
+  if ((labelLength + 6) > 255)
+    return FALSE;
+
+  info[0] = (UInt8)(outLength >> 8);
+  info[1] = (UInt8)(outLength & 0xFF);
+  info[2] = (UInt8)(labelLength + 6);
+  memmove(&info[3], "tls13 ", 6);
+  memmove(&info[9], label, labelLength);
+  info[9 + labelLength] = 0;
+
+  if ((pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL))) {
+    result = (EVP_PKEY_derive_init(pctx) > 0) && (EVP_PKEY_CTX_hkdf_mode(pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0) &&
+             (EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0) && (EVP_PKEY_CTX_set1_hkdf_key(pctx, secret, (int)secretLength) > 0) &&
+             (EVP_PKEY_CTX_add1_hkdf_info(pctx, info, (int)(10 + labelLength)) > 0) && (EVP_PKEY_derive(pctx, out, &outLength) > 0);
+
+    EVP_PKEY_CTX_free(pctx);
+  }
+
+  return result;
+}
+
+/* static */ Boolean _SocketStreamSecurityStartKernelTLS_NoLock(_CFSocketStreamContext* ctxt, SSL* ssl)
+{
+  /*
+  ** Works out the keys, IVs and sequence numbers for both directions and
+  ** gives them to the kernel.  This has to happen straight after the
+  ** handshake, before OpenSSL has seen any application data, so the
+  ** sequence numbers are known.  Returns FALSE if the session stays with
+  ** OpenSSL, which is also the case if the kernel can't take it.
+  */
+
+  union {
+    struct tls12_crypto_info_aes_gcm_128 gcm128;
+    struct tls12_crypto_info_aes_gcm_256 gcm256;
+  } info[2];                                          /* transmit (client), receive (server) */
+  UInt8             keys[2][32], ivs[2][12], seq[8];
+  socklen_t         infoLength = 0;
+  size_t            keyLength;
+  int               i, version = SSL_version(ssl);
+  const SSL_CIPHER* cipher     = SSL_get_current_cipher(ssl);
+  const EVP_MD*     md         = cipher ? SSL_CIPHER_get_handshake_digest(cipher) : NULL;
+  CFDataRef         pending    = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySecuritySendBuffer);
+  Boolean           result     = FALSE;
+
+  if ((CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketKernelTLS) != kCFBooleanTrue) || !md || SSL_is_server(ssl))
+    return FALSE;
+
+  /* What the socket hasn't taken yet was sealed by OpenSSL, and would have to go out before the kernel's. */
+  if (pending && CFDataGetLength(pending))
+    return FALSE;
+
+  /* Likewise, records already taken off the socket would never reach the kernel. */
+  if (_SocketStreamSecurityRecvGetCount_NoLock(ctxt))
+    return FALSE;
+
+  switch (SSL_CIPHER_get_cipher_nid(cipher)) {
+    case NID_aes_128_gcm: keyLength = 16; break;
+    case NID_aes_256_gcm: keyLength = 32; break;
+    default: return FALSE;
+  }
+
+  memset(seq, 0, sizeof(seq));
 
+  if (version == TLS1_2_VERSION) {
     /*
-    ** **FIXME** Once the new improved CONNECT stuff is in, peer name override
-    ** should go away.
+    ** The key block is the client and server keys followed by their
+    ** 4 byte salts.  Both sides have sent one record, the finished
+    ** message, so the next sequence number is one.
     */
-    else if (name)
-      value = name;
+    UInt8         master[SSL_MAX_MASTER_KEY_LENGTH], random[2 * SSL3_RANDOM_SIZE], block[2 * (32 + 4)];
+    size_t        masterLength = SSL_SESSION_get_master_key(SSL_get_session(ssl), master, sizeof(master));
+    size_t        blockLength  = 2 * (keyLength + 4);
+    EVP_PKEY_CTX* pctx         = EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, NULL);
 
-    /* Figure out the proper peer name for CFHost or CFNetService. */
-    else if (lookup) {
-      CFArrayRef names = CFHostGetNames((CFHostRef)lookup, NULL);
-      if (names)
-        value = CFArrayGetValueAtIndex(names, 0);
-    }
+    SSL_get_server_random(ssl, random, SSL3_RANDOM_SIZE);
+    SSL_get_client_random(ssl, random + SSL3_RANDOM_SIZE, SSL3_RANDOM_SIZE);
 
-    else if ((lookup = (CFTypeRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteNetService)))
-      value = CFNetServiceGetTargetHost((CFNetServiceRef)lookup);
+    if (pctx) {
+      result = masterLength && (EVP_PKEY_derive_init(pctx) > 0) && (EVP_PKEY_CTX_set_tls1_prf_md(pctx, md) > 0) &&
+               (EVP_PKEY_CTX_set1_tls1_prf_secret(pctx, master, (int)masterLength) > 0) &&
+               (EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, (const UInt8*)"key expansion", 13) > 0) &&
+               (EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, random, sizeof(random)) > 0) && (EVP_PKEY_derive(pctx, block, &blockLength) > 0);
 
-    /* No value is a failure. */
-    if (!value)
-      break;
+      EVP_PKEY_CTX_free(pctx);
+    }
 
-    /* kCFNull means no peer name check */
-    if (CFEqual(value, kCFNull)) {
-      if (SSLSetPeerDomainName(ssl, NULL, 0))
-        break;
+    if (result) {
+      seq[7] = 1;
+      for (i = 0; i < 2; i++) {
+        memmove(keys[i], block + (i * keyLength), keyLength);
+        memmove(ivs[i], block + (2 * keyLength) + (i * 4), 4);
+        memmove(ivs[i] + 4, seq, 8);
+      }
     }
 
-    /* Pull out the bytes and set 'cause ST doesn't do CFString's for this. */
-    else {
-      OSStatus       err;
-      UInt8          static_buffer[1024];
-      UInt8*         buffer      = &static_buffer[0];
-      CFIndex        buffer_size = sizeof(static_buffer);
-      CFAllocatorRef alloc       = CFGetAllocator(ctxt->_properties);
+    OPENSSL_cleanse(master, sizeof(master));
+    OPENSSL_cleanse(block, sizeof(block));
+  }
 
-      buffer                     = _CFStringGetOrCreateCString(alloc, value, static_buffer, &buffer_size, kCFStringEncodingUTF8);
+  else if (version == TLS1_3_VERSION) {
+    /* The application traffic keys are new, so numbering starts over. */
+    CFDataRef secrets[2] = {(CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySecurityClientSecret),
+                            (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySecurityServerSecret)};
 
-      err                        = SSLSetPeerDomainName(ssl, (const char*)buffer, *((size_t*)(&buffer_size)));
+    result = secrets[0] && secrets[1];
+    for (i = 0; result && (i < 2); i++) {
+      result = _SecurityExpandLabel(md, CFDataGetBytePtr(secrets[i]), CFDataGetLength(secrets[i]), "key", keys[i], keyLength) &&
+               _SecurityExpandLabel(md, CFDataGetBytePtr(secrets[i]), CFDataGetLength(secrets[i]), "iv", ivs[i], sizeof(ivs[i]));
+    }
+  }
 
-      if (err)
-        break;
+  if (result) {
+    memset(info, 0, sizeof(info));
+
+    for (i = 0; i < 2; i++) {
+      if (keyLength == 16) {
+        info[i].gcm128.info.version     = (version == TLS1_2_VERSION) ? TLS_1_2_VERSION : TLS_1_3_VERSION;
+        info[i].gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memmove(info[i].gcm128.key, keys[i], keyLength);
+        memmove(info[i].gcm128.salt, ivs[i], 4);
+        memmove(info[i].gcm128.iv, ivs[i] + 4, 8);
+        memmove(info[i].gcm128.rec_seq, seq, 8);
+        infoLength = sizeof(info[i].gcm128);
+      }
+
+      else {
+        info[i].gcm256.info.version     = (version == TLS1_2_VERSION) ? TLS_1_2_VERSION : TLS_1_3_VERSION;
+        info[i].gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memmove(info[i].gcm256.key, keys[i], keyLength);
+        memmove(info[i].gcm256.salt, ivs[i], 4);
+        memmove(info[i].gcm256.iv, ivs[i] + 4, 8);
+        memmove(info[i].gcm256.rec_seq, seq, 8);
+        infoLength = sizeof(info[i].gcm256);
+      }
     }
 
-    return TRUE;
+    /*
+    ** Receive goes first, since kernels which can receive a suite can
+    ** also send it; failing there leaves the session with OpenSSL.
+    ** Once receiving is the kernel's, there's no going back.
+    */
+    result = !setsockopt(CFSocketGetNative(ctxt->_socket), SOL_TCP, TCP_ULP, "tls", sizeof("tls")) &&
+             !setsockopt(CFSocketGetNative(ctxt->_socket), SOL_TLS, TLS_RX, &info[1], infoLength);
 
-  } while (1);
+    if (result && setsockopt(CFSocketGetNative(ctxt->_socket), SOL_TLS, TLS_TX, &info[0], infoLength))
+      _LastError(&ctxt->_error);
+  }
 
-  return FALSE;
+  OPENSSL_cleanse(keys, sizeof(keys));
+  OPENSSL_cleanse(ivs, sizeof(ivs));
+  OPENSSL_cleanse(info, sizeof(info));
+
+  return result;
 }
 
-/* static */ CFStringRef _SecurityGetProtocol(SSLContextRef security)
+/* static */ CFIndex _SocketStreamKernelTLSRecv_NoLock(_CFSocketStreamContext* ctxt, const struct iovec* iov, int iovcnt)
 {
-  SSLProtocol version = kSSLProtocolUnknown;
+  /*
+  ** The kernel gives back records other than data one at a time, marked
+  ** with their type.  A close notify is the end, and tickets are of no
+  ** use once the keys are gone from OpenSSL.  Anything else, like a key
+  ** update, can't be handled and is an error.
+  */
 
-  /* Attempt to get the negotiated protocol */
-  SSLGetNegotiatedProtocolVersion(security, &version);
-  if (kSSLProtocolUnknown == version)
-    SSLGetProtocolVersion(security, &version);
+  UInt8           control[CMSG_SPACE(sizeof(UInt8))];
+  UInt8           header[2] = {0, 0};
+  struct msghdr   msg;
+  struct cmsghdr* cmsg;
+  UInt8           type = kRecordTypeApplicationData;
+  ssize_t         result;
+  int             i;
+  size_t          length;
+
+  memset(&ctxt->_error, 0, sizeof(ctxt->_error));
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov        = (struct iovec*)iov;
+  msg.msg_iovlen     = iovcnt;
+  msg.msg_control    = control;
+  msg.msg_controllen = sizeof(control);
+
+  if ((result = recvmsg(CFSocketGetNative(ctxt->_socket), &msg, 0)) < 0) {
+    _LastError(&ctxt->_error);
+    return -1;
+  }
 
-  /* Map the protocol from ST to CFSocketStream property values. */
-  switch (version) {
-    case kSSLProtocol2:
-      return kCFStreamSocketSecurityLevelSSLv2;
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && (cmsg->cmsg_level == SOL_TLS) && (cmsg->cmsg_type == TLS_GET_RECORD_TYPE))
+    type = *((UInt8*)CMSG_DATA(cmsg));
 
-    case kSSLProtocol3Only:
-      return kCFStreamSocketSecurityLevelSSLv3;
+  if (!result || (type == kRecordTypeApplicationData))
+    return result;
 
-    case kTLSProtocol1Only:
-      return kCFStreamSocketSecurityLevelTLSv1;
+  /* The first two bytes tell the alert or handshake message, and may straddle the ring's end. */
+  for (i = 0, length = 0; (i < iovcnt) && (length < sizeof(header)) && (length < (size_t)result); i++) {
+    size_t piece = (((size_t)result < sizeof(header)) ? (size_t)result : sizeof(header)) - length;
 
-    case kSSLProtocol3:
-    case kTLSProtocol1:
-    default: {
-      Boolean enabled;
+    if (piece > iov[i].iov_len)
+      piece = iov[i].iov_len;
 
-      if (!SSLGetProtocolVersionEnabled(security, kSSLProtocol2, &enabled) && !enabled)
-        return kCFStreamSocketSecurityLevelTLSv1SSLv3;
+    memmove(header + length, iov[i].iov_base, piece);
+    length += piece;
+  }
 
-      return kCFStreamSocketSecurityLevelNegotiatedSSL;
-    }
+  if ((type == kRecordTypeAlert) && (length == 2) && (header[1] == kAlertCloseNotify))
+    return 0;
+
+  if ((type == kRecordTypeHandshake) && (header[0] == kHandshakeNewSessionTicket)) {
+    /* Nothing for the client, so wait for the next. */
+    CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
+    return -1;
   }
+
+  ctxt->_error.error  = (type == kRecordTypeAlert) ? errSSLClosedAbort : errSSLProtocol;
+  ctxt->_error.domain = kCFStreamErrorDomainSSL;
+
+  return -1;
 }
 
-/* static */ SSLSessionState _SocketStreamSecurityGetSessionState_NoLock(_CFSocketStreamContext* ctxt)
+/* static */ void _SocketStreamKernelTLSClose_NoLock(_CFSocketStreamContext* ctxt)
 {
-  SSLContextRef ssl = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketSSLContext)));
+  /* Send the close notify as an alert record of its own; it's not worth waiting for the socket. */
 
-  /*
-  ** Slight fib to return Aborted if the SSL call fails, but if it does fail things are
-  ** quite hosed, so it's not such a lie.
-  */
-  SSLSessionState state;
-  return !SSLGetSessionState(ssl, &state) ? state : kSSLAborted;
+  UInt8           alert[2] = {1, kAlertCloseNotify}; /* warning level */
+  UInt8           control[CMSG_SPACE(sizeof(UInt8))];
+  struct iovec    iov      = {alert, sizeof(alert)};
+  struct msghdr   msg;
+  struct cmsghdr* cmsg;
+
+  if (ctxt->_error.error || !ctxt->_socket)
+    return;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control;
+  msg.msg_controllen = sizeof(control);
+
+  cmsg                       = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level           = SOL_TLS;
+  cmsg->cmsg_type            = TLS_SET_RECORD_TYPE;
+  cmsg->cmsg_len             = CMSG_LEN(sizeof(UInt8));
+  *((UInt8*)CMSG_DATA(cmsg)) = kRecordTypeAlert;
+
+  (void)sendmsg(CFSocketGetNative(ctxt->_socket), &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
 }
+#endif /* __linux__ */
 #endif
 
 #pragma mark - Extern Function Definitions (API)
@@ -6171,6 +8907,65 @@ static const CFWriteStreamCallBacks kSocketWriteStreamCallBacks = {
 
 #pragma mark - Extern Function Definitions (SPI)
 
+/* extern */ CFIndex _CFSocketStreamWriteVector(CFWriteStreamRef stream, const struct iovec* iov, int iovcnt, CFStreamError* error)
+{
+  /*
+  ** Callers check _kCFStreamPropertySocketGatherWrite first, so this is
+  ** known to be one of our streams.  Note that since this goes around
+  ** CFWriteStreamWrite, CFStream's own status isn't updated on error;
+  ** the error is returned here and stays on the context for later writes.
+  */
+  return _SocketStreamWriteFrom(stream, iov, iovcnt, -1, 0, error, (_CFSocketStreamContext*)CFWriteStreamGetInfoPointer(stream));
+}
+
+/* extern */ CFIndex _CFSocketStreamWriteFile(CFWriteStreamRef stream, int fd, CFIndex length, CFStreamError* error)
+{
+  /*
+  ** As above, but callers check _kCFStreamPropertySocketSendFile, which
+  ** also guarantees SSL isn't in the way.
+  */
+  return _SocketStreamWriteFrom(stream, NULL, 0, fd, length, error, (_CFSocketStreamContext*)CFWriteStreamGetInfoPointer(stream));
+}
+
+/* extern */ Boolean _CFSocketStreamSetSecuritySessionCacheSize(CFIndex maxEntries)
+{
+#if defined(HAVE_OPENSSL)
+  if (maxEntries < 0)
+    return FALSE;
+
+  __CFSpinLock(&gSecurityLock);
+
+  gSecuritySessionMaximum = maxEntries;
+
+  /* Forget the least recently used down to the new limit. */
+  while (gSecuritySessionOrder && (CFArrayGetCount(gSecuritySessionOrder) > gSecuritySessionMaximum)) {
+    CFDictionaryRemoveValue(gSecuritySessions, CFArrayGetValueAtIndex(gSecuritySessionOrder, 0));
+    CFArrayRemoveValueAtIndex(gSecuritySessionOrder, 0);
+  }
+
+  __CFSpinUnlock(&gSecurityLock);
+
+  return TRUE;
+#else
+  /* Secure Transport keeps its own session cache. */
+  return FALSE;
+#endif
+}
+
+/* extern */ void _CFSocketStreamFlushSecuritySessionCache(void)
+{
+#if defined(HAVE_OPENSSL)
+  __CFSpinLock(&gSecurityLock);
+
+  if (gSecuritySessions) {
+    CFDictionaryRemoveAllValues(gSecuritySessions);
+    CFArrayRemoveAllValues(gSecuritySessionOrder);
+  }
+
+  __CFSpinUnlock(&gSecurityLock);
+#endif
+}
+
 extern void _CFStreamCreatePairWithCFSocketSignaturePieces(CFAllocatorRef    alloc,
                                                            SInt32            protocolFamily,
                                                            SInt32            socketType,
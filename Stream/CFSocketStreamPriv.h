@@ -56,6 +56,10 @@
 
 #include <CFNetwork/AvailabilityMacros.h>
 
+#if !defined(__WIN32__)
+#include <sys/uio.h>
+#endif
+
 #if PRAGMA_ONCE
   #pragma once
 #endif
@@ -283,6 +287,255 @@ extern void CFStreamCreatePairWithNetServicePieces(CFAllocatorRef    alloc,
                                                    CFReadStreamRef  *readStream, /* can be NULL */
                                                    CFWriteStreamRef *writeStream) /* can be NULL */ AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
 
+/*
+ *  _kCFStreamPropertySocketRaceConnections
+ *
+ *  Discussion:
+ *    Stream property key, for both set and copy operations.  Set to
+ *    kCFBooleanTrue before opening to race connections to the
+ *    remote host's addresses, as described in RFC 8305 ("Happy
+ *    Eyeballs").  Attempts start one after another, taking turns
+ *    between IPv6 and IPv4 addresses, without waiting for earlier
+ *    ones to fail.  The first to connect is used and the rest are
+ *    closed.  A host without addresses is resolved one family at a
+ *    time, so attempts can start before the slower family answers.
+ *    Has no effect on streams created from a native socket.
+ *
+ */
+extern const CFStringRef _kCFStreamPropertySocketRaceConnections AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _kCFStreamPropertySocketConnectionAttemptDelay
+ *
+ *  Discussion:
+ *    Stream property key, for both set and copy operations.  A
+ *    CFNumber of seconds to wait before starting each further
+ *    attempt when racing connections.  The default is 0.25 seconds,
+ *    and anything under 0.01 seconds is taken as 0.01.  Must be set
+ *    before opening.
+ *
+ */
+extern const CFStringRef _kCFStreamPropertySocketConnectionAttemptDelay AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _kCFStreamPropertySocketFastOpen
+ *
+ *  Discussion:
+ *    Stream property key, for both set and copy operations.  Set to
+ *    kCFBooleanTrue before opening to connect with TCP Fast Open
+ *    (RFC 7413) where the system supports it.  When the system holds
+ *    a Fast Open cookie for the server, the open completes right away
+ *    and the first bytes written go out with the SYN, saving a round
+ *    trip.  Connection errors are then reported by the first read or
+ *    write instead of the open.  Without a cookie, the connection is
+ *    made as usual and a cookie is asked for along the way.  Data
+ *    sent in the SYN may be delivered twice, so it should only be set
+ *    for requests which are safe to repeat.
+ *
+ */
+extern const CFStringRef _kCFStreamPropertySocketFastOpen AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _kCFStreamPropertySocketKernelTLS
+ *
+ *  Discussion:
+ *    Stream property key, for both set and copy operations.  Set to
+ *    kCFBooleanTrue before opening to have the kernel take over the
+ *    SSL records once the handshake is done, where the system
+ *    supports it.  This is only done for TLS 1.2 and 1.3 sessions
+ *    using AES-GCM.  Reads and writes then skip the copies through
+ *    the SSL library, and _CFSocketStreamWriteFile can be used.
+ *    Once the handshake is done, copying it returns kCFBooleanTrue
+ *    only if the kernel took over.  The session can't be renegotiated
+ *    or have its keys updated afterwards; the stream fails if the
+ *    server tries.  Only Linux with OpenSSL supports it.
+ *
+ */
+extern const CFStringRef _kCFStreamPropertySocketKernelTLS AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _kCFStreamPropertySocketOptions
+ *
+ *  Discussion:
+ *    Stream property key, for both set and copy operations.  A
+ *    CFDictionary of options for the stream's TCP socket, keyed by the
+ *    _kCFStreamSocketOption keys below.  Options left out keep the
+ *    system defaults.  They are applied when the socket is created,
+ *    before it connects, or right away if the stream has its socket
+ *    already.  Setting fails if a key is unknown or its value is not
+ *    of the listed type.  Options the system doesn't support are
+ *    skipped.  The HTTP and FTP streams pass the property on to the
+ *    connections they make, and only reuse connections which were
+ *    made with the same options.
+ *
+ */
+extern const CFStringRef _kCFStreamPropertySocketOptions AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/* CFBoolean, TCP_NODELAY.  kCFBooleanFalse turns Nagle's algorithm back on. */
+extern const CFStringRef _kCFStreamSocketOptionNoDelay AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/* CFNumber, SO_SNDBUF in bytes. */
+extern const CFStringRef _kCFStreamSocketOptionSendBufferSize AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/* CFNumber, SO_RCVBUF in bytes.  Set before connecting, it also decides the window scale. */
+extern const CFStringRef _kCFStreamSocketOptionReceiveBufferSize AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/* CFBoolean, SO_KEEPALIVE. */
+extern const CFStringRef _kCFStreamSocketOptionKeepAlive AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/* CFNumber, seconds a connection is idle before the first keepalive probe. */
+extern const CFStringRef _kCFStreamSocketOptionKeepAliveIdle AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/* CFNumber, seconds between keepalive probes. */
+extern const CFStringRef _kCFStreamSocketOptionKeepAliveInterval AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/* CFNumber, unanswered keepalive probes before the connection is dropped. */
+extern const CFStringRef _kCFStreamSocketOptionKeepAliveCount AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/* CFNumber, TCP_NOTSENT_LOWAT in bytes.  Limits the unsent data the kernel holds for the socket. */
+extern const CFStringRef _kCFStreamSocketOptionNotSentLowWater AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/* CFString, TCP_CONGESTION.  The name of the congestion control algorithm, such as "cubic" or "bbr". */
+extern const CFStringRef _kCFStreamSocketOptionCongestionControl AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/* CFNumber, SO_BUSY_POLL in microseconds to busy poll the device for reads. */
+extern const CFStringRef _kCFStreamSocketOptionBusyPoll AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+#if !defined(__WIN32__)
+/*
+ *  _kCFStreamPropertySocketGatherWrite
+ *
+ *  Discussion:
+ *    Stream property key, for copy operations.  kCFBooleanTrue if
+ *    the write stream accepts _CFSocketStreamWriteVector.  Streams
+ *    which don't support it return NULL.
+ *
+ */
+extern const CFStringRef _kCFStreamPropertySocketGatherWrite;
+
+/*
+ *  _CFSocketStreamWriteVector()
+ *
+ *  Discussion:
+ *    Writes several buffers to a socket stream with a single system
+ *    call, avoiding the copy that would otherwise be needed to put
+ *    them together.  Behaves like CFWriteStreamWrite otherwise; it
+ *    may block, and may write fewer bytes than were given.  With SSL
+ *    on, the buffers are coalesced into one record, up to 16K.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ *  Parameters:
+ *
+ *    stream:
+ *      The socket write stream.  Must have answered kCFBooleanTrue
+ *      for _kCFStreamPropertySocketGatherWrite.
+ *
+ *    iov:
+ *      The buffers to write, in order.
+ *
+ *    iovcnt:
+ *      The number of buffers in iov.
+ *
+ *    error:
+ *      Filled in with the error if one occurs.
+ *
+ *  Result:
+ *    The number of bytes written, 0 at end of stream, or -1 on error.
+ *
+ */
+extern CFIndex _CFSocketStreamWriteVector(CFWriteStreamRef stream, const struct iovec *iov, int iovcnt, CFStreamError *error);
+
+/*
+ *  _kCFStreamPropertySocketSendFile
+ *
+ *  Discussion:
+ *    Stream property key, for copy operations.  kCFBooleanTrue if
+ *    the write stream accepts _CFSocketStreamWriteFile.  Only plain
+ *    sockets do, or those whose SSL records are done by the kernel
+ *    (see _kCFStreamPropertySocketKernelTLS); other streams with SSL
+ *    on return NULL.
+ *
+ */
+extern const CFStringRef _kCFStreamPropertySocketSendFile;
+
+/*
+ *  _CFSocketStreamWriteFile()
+ *
+ *  Discussion:
+ *    Sends bytes from a file straight to the socket with sendfile,
+ *    without copying them through user space.  Reading starts at the
+ *    file's current position, which is advanced by the amount sent.
+ *    Behaves like CFWriteStreamWrite otherwise.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ *  Parameters:
+ *
+ *    stream:
+ *      The socket write stream.  Must have answered kCFBooleanTrue
+ *      for _kCFStreamPropertySocketSendFile.
+ *
+ *    fd:
+ *      Descriptor of a regular file open for reading.
+ *
+ *    length:
+ *      The most bytes to send.  The file must have at least this many
+ *      left; running out early is reported as an error.
+ *
+ *    error:
+ *      Filled in with the error if one occurs.
+ *
+ *  Result:
+ *    The number of bytes sent, or -1 on error.
+ *
+ */
+extern CFIndex _CFSocketStreamWriteFile(CFWriteStreamRef stream, int fd, CFIndex length, CFStreamError *error);
+#endif /* !defined(__WIN32__) */
+
+/*
+ *  _CFSocketStreamSetSecuritySessionCacheSize()
+ *
+ *  Discussion:
+ *    Sets how many SSL sessions are kept process-wide for resumption
+ *    where the built-in OpenSSL engine is used.  Sessions are keyed by
+ *    the far end, <host>:<port> through a proxy or else the address
+ *    and port, along with the peer name checked, so a reconnect to
+ *    the same origin skips the full handshake.  Only sessions whose
+ *    certificates were fully checked are kept.  The least recently
+ *    used are forgotten once over the size, which defaults to 64.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ *  Parameters:
+ *
+ *    maxEntries:
+ *      The most sessions to keep.  Zero turns the cache off.
+ *
+ *  Result:
+ *    Returns TRUE if the size was set, or FALSE if it is negative or
+ *    the platform's SSL keeps its own cache.
+ *
+ */
+extern Boolean _CFSocketStreamSetSecuritySessionCacheSize(CFIndex maxEntries) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFSocketStreamFlushSecuritySessionCache()
+ *
+ *  Discussion:
+ *    Forgets all the SSL sessions kept for resumption, for instance
+ *    after the trusted certificates have changed.  Streams already
+ *    open are not affected.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ */
+extern void _CFSocketStreamFlushSecuritySessionCache(void) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
 #ifdef __cplusplus
 }
 #endif
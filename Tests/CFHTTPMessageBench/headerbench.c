@@ -0,0 +1,130 @@
+#include <CoreFoundation/CFLogUtilities.h>
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFHTTPMessagePriv.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define kIterations 200000
+
+static const char kResponse[] =
+  "HTTP/1.1 200 OK\r\n"
+  "Date: Tue, 15 Nov 1994 08:12:31 GMT\r\n"
+  "Server: Apache/2.4.41 (Unix) OpenSSL/1.1.1d\r\n"
+  "Last-Modified: Mon, 14 Nov 1994 16:02:11 GMT\r\n"
+  "Etag: \"3f80f-1b6-3e1cb03b\"\r\n"
+  "Accept-Ranges: bytes\r\n"
+  "Cache-Control: private, max-age=0, must-revalidate\r\n"
+  "Expires: Wed, 16 Nov 1994 08:12:31 GMT\r\n"
+  "Content-Type: application/json; charset=utf-8\r\n"
+  "Content-Length: 438\r\n"
+  "Connection: keep-alive\r\n"
+  "Vary: Accept-Encoding, Origin\r\n"
+  "Set-Cookie: session=0123456789abcdef0123456789abcdef; Path=/; HttpOnly\r\n"
+  "X-Request-Id: 9b2f4c1e-5d3a-4e7b-8f60-1a2b3c4d5e6f\r\n"
+  "Strict-Transport-Security: max-age=31536000; includeSubDomains\r\n"
+  "\r\n";
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The line splitting done by the parser before the vector scanner went in.
+static size_t splitLegacy(const UInt8 *bytes, size_t len)
+{
+  const UInt8 *start = bytes, *end = bytes + len;
+  size_t colons = 0;
+
+  while (start < end) {
+    const UInt8 *eol = memchr(start, '\n', end - start);
+    if (!eol)
+      eol = memchr(start, '\r', end - start - 1);
+    if (!eol)
+      break;
+    if (memchr(start, ':', eol - start))
+      colons++;
+    start = eol + 1;
+  }
+  return colons;
+}
+
+static size_t splitScanner(const UInt8 *bytes, size_t len)
+{
+  const UInt8 *start = bytes, *end = bytes + len;
+  size_t colons = 0;
+
+  while (start < end) {
+    const UInt8 *eol = _CFHTTPScanForBytes(start, end - start, '\n', '\n', ':');
+    if (eol && *eol == ':') {
+      colons++;
+      eol = _CFHTTPScanForBytes(eol + 1, end - eol - 1, '\n', '\n', '\n');
+    }
+    if (!eol)
+      break;
+    start = eol + 1;
+  }
+  return colons;
+}
+
+static void benchSplit(const char *name, size_t (*split)(const UInt8 *, size_t))
+{
+  const UInt8 *bytes = (const UInt8 *)kResponse;
+  size_t len = sizeof(kResponse) - 1, total = 0;
+  double start = now();
+
+  for (int i = 0; i < kIterations; i++) {
+    total += split(bytes, len);
+  }
+  printf("  %-28s %8.1f ns/message (%zu)\n", name, (now() - start) * 1e9 / kIterations, total);
+}
+
+static void benchParse(const char *name)
+{
+  const UInt8 *bytes = (const UInt8 *)kResponse;
+  CFIndex len = sizeof(kResponse) - 1;
+  double start = now();
+
+  for (int i = 0; i < kIterations; i++) {
+    CFHTTPMessageRef msg = CFHTTPMessageCreateEmpty(kCFAllocatorDefault, FALSE);
+    if (!CFHTTPMessageAppendBytes(msg, bytes, len) || !CFHTTPMessageIsHeaderComplete(msg)) {
+      printf("  %s: parse failed\n", name);
+      exit(1);
+    }
+    CFRelease(msg);
+  }
+  printf("  %-28s %8.1f ns/message\n", name, (now() - start) * 1e9 / kIterations);
+}
+
+int main(int argc, char **argv)
+{
+  static const struct {
+    _CFHTTPScannerKind kind;
+    const char *name;
+  } scanners[] = {
+    {_kCFHTTPScannerScalar, "scalar"},
+    {_kCFHTTPScannerSSE2, "sse2"},
+    {_kCFHTTPScannerAVX2, "avx2"}
+  };
+
+  printf("Line splitting, %zu byte header:\n", sizeof(kResponse) - 1);
+  benchSplit("memchr (legacy)", splitLegacy);
+  for (int i = 0; i < sizeof(scanners) / sizeof(scanners[0]); i++) {
+    if (_CFHTTPSetScanner(scanners[i].kind)) {
+      benchSplit(scanners[i].name, splitScanner);
+    }
+  }
+
+  printf("CFHTTPMessageAppendBytes:\n");
+  for (int i = 0; i < sizeof(scanners) / sizeof(scanners[0]); i++) {
+    if (_CFHTTPSetScanner(scanners[i].kind)) {
+      benchParse(scanners[i].name);
+    }
+  }
+
+  return 0;
+}
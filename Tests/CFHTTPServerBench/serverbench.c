@@ -0,0 +1,234 @@
+#include <CoreFoundation/CoreFoundation.h>
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFHTTPServerPriv.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kDefaultClients  64
+#define kDefaultSeconds  5
+#define kMaxSamples      (1 << 20)
+
+static const char kRequest[] =
+  "GET /bench HTTP/1.1\r\n"
+  "Host: 127.0.0.1\r\n"
+  "User-Agent: serverbench\r\n"
+  "Accept: */*\r\n"
+  "\r\n";
+
+static const char kBody[] = "{\"status\":\"ok\",\"message\":\"hello from CFHTTPServer\"}";
+
+struct client {
+  pthread_t thread;
+  UInt32 port;
+  double stop;
+  size_t requests;
+  size_t errors;
+  double *samples;
+  size_t nsamples, maxSamples;
+};
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void didReceiveRequest(_CFHTTPServerRef server, CFHTTPMessageRef request, void *info)
+{
+  CFHTTPMessageRef response = CFHTTPMessageCreateResponse(kCFAllocatorDefault, 200, NULL, kCFHTTPVersion1_1);
+  CFDataRef body = CFDataCreate(kCFAllocatorDefault, (const UInt8 *)kBody, sizeof(kBody) - 1);
+
+  CFHTTPMessageSetHeaderFieldValue(response, CFSTR("Content-Type"), CFSTR("application/json"));
+  CFHTTPMessageSetBody(response, body);
+  _CFHTTPServerAddResponse(server, request, response);
+
+  CFRelease(body);
+  CFRelease(response);
+}
+
+static void serverError(_CFHTTPServerRef server, const CFStreamError *error, CFHTTPMessageRef request,
+                        CFHTTPMessageRef response, void *info)
+{
+  if (request == NULL) {
+    fprintf(stderr, "server error %d/%d\n", (int)error->domain, (int)error->error);
+  }
+}
+
+// Reads one response off the connection; returns FALSE on error or EOF.
+static Boolean readResponse(int fd, char *buf, size_t size)
+{
+  size_t have = 0, need = 0;
+
+  while (need == 0 || have < need) {
+    ssize_t n = read(fd, buf + have, size - have - 1);
+    if (n <= 0)
+      return FALSE;
+    have += n;
+    buf[have] = '\0';
+
+    if (need == 0) {
+      char *end = strstr(buf, "\r\n\r\n");
+      if (end) {
+        char *length = strcasestr(buf, "\r\nContent-length:");
+        need = (end + 4 - buf) + (length ? strtoul(length + 17, NULL, 10) : 0);
+      }
+      else if (have == size - 1)
+        return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static void *runClient(void *arg)
+{
+  struct client *c = arg;
+  struct sockaddr_in sin;
+  char buf[4096];
+  int one = 1;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(c->port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (fd < 0 || connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+    c->errors++;
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  while (now() < c->stop) {
+    double start = now();
+
+    if (write(fd, kRequest, sizeof(kRequest) - 1) != sizeof(kRequest) - 1 ||
+        !readResponse(fd, buf, sizeof(buf))) {
+      c->errors++;
+      break;
+    }
+    c->requests++;
+    if (c->nsamples < c->maxSamples)
+      c->samples[c->nsamples++] = now() - start;
+  }
+
+  close(fd);
+  return NULL;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+struct run {
+  CFRunLoopRef runLoop;
+  struct client *clients;
+  int nclients;
+};
+
+// Waits for the load generator on its own thread so the listener keeps accepting.
+static void *waitForClients(void *arg)
+{
+  struct run *r = arg;
+
+  for (int i = 0; i < r->nclients; i++) {
+    pthread_join(r->clients[i].thread, NULL);
+  }
+  CFRunLoopStop(r->runLoop);
+  CFRunLoopWakeUp(r->runLoop);
+  return NULL;
+}
+
+static void bench(CFIndex workers, int nclients, int seconds)
+{
+  _CFHTTPServerCallBacks callbacks;
+  _CFHTTPServerContext context;
+  struct client *clients = calloc(nclients, sizeof(*clients));
+  struct run r = {CFRunLoopGetCurrent(), clients, nclients};
+  pthread_t waiter;
+  size_t requests = 0, errors = 0, nsamples = 0;
+  double *samples, start, elapsed;
+  _CFHTTPServerRef server;
+
+  memset(&callbacks, 0, sizeof(callbacks));
+  memset(&context, 0, sizeof(context));
+  callbacks.didReceiveRequestCallBack = didReceiveRequest;
+  callbacks.errorCallBack = serverError;
+
+  server = _CFHTTPServerCreate(kCFAllocatorDefault, &callbacks, &context);
+  if (!server || !_CFHTTPServerSetWorkerCount(server, workers) || !_CFHTTPServerStart(server, NULL, NULL, 0)) {
+    printf("  %2ld workers: failed to start server\n", (long)workers);
+    exit(1);
+  }
+
+  start = now();
+  for (int i = 0; i < nclients; i++) {
+    clients[i].port = _CFHTTPServerGetPort(server);
+    clients[i].stop = start + seconds;
+    clients[i].maxSamples = kMaxSamples / nclients;
+    clients[i].samples = malloc(clients[i].maxSamples * sizeof(double));
+    pthread_create(&clients[i].thread, NULL, runClient, &clients[i]);
+  }
+  pthread_create(&waiter, NULL, waitForClients, &r);
+
+  CFRunLoopRun();
+  pthread_join(waiter, NULL);
+  elapsed = now() - start;
+
+  _CFHTTPServerInvalidate(server);
+  CFRelease(server);
+
+  samples = malloc(kMaxSamples * sizeof(double));
+  for (int i = 0; i < nclients; i++) {
+    requests += clients[i].requests;
+    errors += clients[i].errors;
+    for (size_t j = 0; j < clients[i].nsamples; j++) {
+      samples[nsamples++] = clients[i].samples[j];
+    }
+    free(clients[i].samples);
+  }
+  qsort(samples, nsamples, sizeof(double), compareDoubles);
+
+  if (nsamples == 0) {
+    printf("  %2ld workers: no responses (%zu errors)\n", (long)workers, errors);
+  }
+  else {
+    printf("  %2ld workers: %9.0f req/s  p50 %7.1f us  p99 %7.1f us  max %8.1f us  (%zu errors)\n",
+           (long)workers, requests / elapsed,
+           samples[nsamples / 2] * 1e6,
+           samples[(size_t)(nsamples * 0.99)] * 1e6,
+           samples[nsamples - 1] * 1e6,
+           errors);
+  }
+
+  free(samples);
+  free(clients);
+}
+
+int main(int argc, char **argv)
+{
+  static const CFIndex workers[] = {0, 1, 2, 4, 8};
+  int nclients = argc > 1 ? atoi(argv[1]) : kDefaultClients;
+  int seconds = argc > 2 ? atoi(argv[2]) : kDefaultSeconds;
+
+  printf("Keep-alive GET, %d clients, %d s per run:\n", nclients, seconds);
+  for (int i = 0; i < sizeof(workers) / sizeof(workers[0]); i++) {
+    bench(workers[i], nclients, seconds);
+  }
+
+  return 0;
+}
@@ -0,0 +1,250 @@
+#include <CoreFoundation/CoreFoundation.h>
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFHTTPServerPriv.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define kClients            8
+#define kRequestsPerClient  16
+#define kMaxQueued          (kClients * kRequestsPerClient)
+
+static const char kRequest[] =
+  "GET /answer HTTP/1.1\r\n"
+  "Host: 127.0.0.1\r\n"
+  "\r\n";
+
+static const char kBody[] = "answered off the worker";
+
+// Requests the workers passed on, answered by a thread which is none of them.
+struct responder {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  _CFHTTPServerRef server;
+  CFHTTPMessageRef queue[kMaxQueued];
+  int count;
+  Boolean done;
+  int answered, peers;
+};
+
+struct client {
+  pthread_t thread;
+  UInt32 port;
+  int responses;
+};
+
+struct run {
+  CFRunLoopRef runLoop;
+  struct client *clients;
+};
+
+static void *respond(void *arg)
+{
+  struct responder *r = arg;
+
+  pthread_mutex_lock(&r->lock);
+  while (!r->done || r->count != 0) {
+    CFHTTPMessageRef request, response;
+    CFDataRef body, peer;
+
+    if (r->count == 0) {
+      pthread_cond_wait(&r->ready, &r->lock);
+      continue;
+    }
+    request = r->queue[--r->count];
+    pthread_mutex_unlock(&r->lock);
+
+    peer = _CFHTTPServerCopyPeerAddressForRequest(r->server, request);
+    if (peer) {
+      r->peers++;
+      CFRelease(peer);
+    }
+
+    response = CFHTTPMessageCreateResponse(kCFAllocatorDefault, 200, NULL, kCFHTTPVersion1_1);
+    body = CFDataCreate(kCFAllocatorDefault, (const UInt8 *)kBody, sizeof(kBody) - 1);
+    CFHTTPMessageSetBody(response, body);
+    _CFHTTPServerAddResponse(r->server, request, response);
+    r->answered++;
+
+    CFRelease(body);
+    CFRelease(response);
+    CFRelease(request);
+
+    pthread_mutex_lock(&r->lock);
+  }
+  pthread_mutex_unlock(&r->lock);
+  return NULL;
+}
+
+static void didReceiveRequest(_CFHTTPServerRef server, CFHTTPMessageRef request, void *info)
+{
+  struct responder *r = info;
+
+  pthread_mutex_lock(&r->lock);
+  if (r->count < kMaxQueued) {
+    r->queue[r->count++] = (CFHTTPMessageRef)CFRetain(request);
+    pthread_cond_signal(&r->ready);
+  }
+  pthread_mutex_unlock(&r->lock);
+}
+
+// Reads one response off the connection; returns FALSE on error, EOF or a wrong body.
+static Boolean readResponse(int fd, char *buf, size_t size)
+{
+  size_t have = 0, need = 0;
+  char *end = NULL;
+
+  while (need == 0 || have < need) {
+    ssize_t n = read(fd, buf + have, size - have - 1);
+    if (n <= 0)
+      return FALSE;
+    have += n;
+    buf[have] = '\0';
+
+    if (need == 0) {
+      end = strstr(buf, "\r\n\r\n");
+      if (end) {
+        char *length = strcasestr(buf, "\r\nContent-length:");
+        need = (end + 4 - buf) + (length ? strtoul(length + 17, NULL, 10) : 0);
+      }
+      else if (have == size - 1)
+        return FALSE;
+    }
+  }
+  return strncmp(buf, "HTTP/1.1 200", 12) == 0 && have == need &&
+         strncmp(end + 4, kBody, sizeof(kBody) - 1) == 0;
+}
+
+static void *runClient(void *arg)
+{
+  struct client *c = arg;
+  struct sockaddr_in sin;
+  struct timeval timeout = {10, 0};
+  char buf[4096];
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(c->port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  // A dropped response shows up as a read timing out.
+  if (fd >= 0)
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  if (fd >= 0 && connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0) {
+    for (int i = 0; i < kRequestsPerClient; i++) {
+      if (write(fd, kRequest, sizeof(kRequest) - 1) != sizeof(kRequest) - 1 || !readResponse(fd, buf, sizeof(buf)))
+        break;
+      c->responses++;
+    }
+  }
+
+  if (fd >= 0)
+    close(fd);
+  return NULL;
+}
+
+// Waits for the clients on its own thread so the server's run loop keeps going.
+static void *waitForClients(void *arg)
+{
+  struct run *run = arg;
+
+  for (int i = 0; i < kClients; i++) {
+    pthread_join(run->clients[i].thread, NULL);
+  }
+  CFRunLoopStop(run->runLoop);
+  CFRunLoopWakeUp(run->runLoop);
+  return NULL;
+}
+
+static int failures;
+
+static void check(Boolean ok, const char *what)
+{
+  printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+  failures += !ok;
+}
+
+static void test(CFIndex workers)
+{
+  _CFHTTPServerCallBacks callbacks;
+  _CFHTTPServerContext context;
+  struct responder responder;
+  struct client clients[kClients];
+  struct run run = {CFRunLoopGetCurrent(), clients};
+  pthread_t waiter;
+  int responses = 0;
+  char what[128];
+
+  memset(&responder, 0, sizeof(responder));
+  memset(clients, 0, sizeof(clients));
+  pthread_mutex_init(&responder.lock, NULL);
+  pthread_cond_init(&responder.ready, NULL);
+
+  memset(&callbacks, 0, sizeof(callbacks));
+  memset(&context, 0, sizeof(context));
+  callbacks.didReceiveRequestCallBack = didReceiveRequest;
+  context.info = &responder;
+
+  responder.server = _CFHTTPServerCreate(kCFAllocatorDefault, &callbacks, &context);
+  if (!responder.server || !_CFHTTPServerSetWorkerCount(responder.server, workers) ||
+      !_CFHTTPServerStart(responder.server, NULL, NULL, 0)) {
+    printf("SKIP: no server with %ld workers on this platform\n", (long)workers);
+    if (responder.server)
+      CFRelease(responder.server);
+    return;
+  }
+
+  pthread_create(&responder.thread, NULL, respond, &responder);
+  for (int i = 0; i < kClients; i++) {
+    clients[i].port = _CFHTTPServerGetPort(responder.server);
+    pthread_create(&clients[i].thread, NULL, runClient, &clients[i]);
+  }
+  pthread_create(&waiter, NULL, waitForClients, &run);
+
+  CFRunLoopRun();
+  pthread_join(waiter, NULL);
+
+  pthread_mutex_lock(&responder.lock);
+  responder.done = TRUE;
+  pthread_cond_signal(&responder.ready);
+  pthread_mutex_unlock(&responder.lock);
+  pthread_join(responder.thread, NULL);
+
+  _CFHTTPServerInvalidate(responder.server);
+  CFRelease(responder.server);
+
+  for (int i = 0; i < kClients; i++) {
+    responses += clients[i].responses;
+  }
+
+  snprintf(what, sizeof(what), "%ld workers: responses added off the worker thread are sent", (long)workers);
+  check(responses == kClients * kRequestsPerClient, what);
+
+  snprintf(what, sizeof(what), "%ld workers: peer address found off the worker thread", (long)workers);
+  check(responder.answered != 0 && responder.peers == responder.answered, what);
+
+  pthread_cond_destroy(&responder.ready);
+  pthread_mutex_destroy(&responder.lock);
+}
+
+int main(int argc, char **argv)
+{
+  static const CFIndex workers[] = {1, 4};
+
+  for (int i = 0; i < sizeof(workers) / sizeof(workers[0]); i++) {
+    test(workers[i]);
+  }
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,337 @@
+#include <CoreFoundation/CoreFoundation.h>
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFHostPriv.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define kConcurrentLookups  1000
+#define kBigAnswers         40
+#define kMaxPorts           16
+
+// A fake name server on 127.0.0.1, answering the same zone over UDP and TCP:
+//   www.example.test      A 192.0.2.1, AAAA 2001:db8::1
+//   big.example.test      A; truncated over UDP, kBigAnswers records over TCP
+//   missing.example.test  NXDOMAIN
+//   txt.example.test      TXT "hello"
+//   anything else         A 192.0.2.x
+struct server {
+  int udp, tcp;
+  UInt16 port;
+  int udpQueries, tcpQueries;
+  UInt16 ports[kMaxPorts];   // Client ports seen over UDP
+  int nports;
+};
+
+static size_t appendRecord(UInt8 *p, UInt16 type, UInt32 ttl, const void *data, UInt16 length)
+{
+  UInt8 header[12] = {0xC0, 0x0C, type >> 8, type & 0xFF, 0, 1,
+                      ttl >> 24, (ttl >> 16) & 0xFF, (ttl >> 8) & 0xFF, ttl & 0xFF,
+                      length >> 8, length & 0xFF};
+
+  memcpy(p, header, sizeof(header));
+  memcpy(p + sizeof(header), data, length);
+  return sizeof(header) + length;
+}
+
+// Builds the reply to a query; returns its length, or 0 if the query is malformed.
+static size_t answer(const UInt8 *query, size_t length, UInt8 *reply, Boolean overTCP)
+{
+  char name[256];
+  size_t offset = 12, n = 0, used;
+  UInt16 type, count = 0;
+
+  while (offset < length && query[offset]) {
+    size_t label = query[offset];
+    if (offset + 1 + label > length || n + label + 1 >= sizeof(name))
+      return 0;
+    if (n)
+      name[n++] = '.';
+    memcpy(name + n, query + offset + 1, label);
+    n += label;
+    offset += label + 1;
+  }
+  if (offset + 5 > length)
+    return 0;
+  name[n] = '\0';
+  type = (query[offset + 1] << 8) | query[offset + 2];
+  used = offset + 5;
+
+  // Echo the header and question, marked as a recursive answer.
+  memcpy(reply, query, used);
+  reply[2] = 0x81;
+  reply[3] = 0x80;
+  memset(reply + 6, 0, 6);
+
+  if (!strcmp(name, "missing.example.test")) {
+    reply[3] |= 3;
+    return used;
+  }
+
+  if (!strcmp(name, "big.example.test") && type == 1) {
+    if (!overTCP) {
+      reply[2] |= 0x02;
+      return used;
+    }
+    for (int i = 0; i < kBigAnswers; i++) {
+      UInt8 a[4] = {198, 51, 100, i};
+      used += appendRecord(reply + used, 1, 60, a, sizeof(a));
+      count++;
+    }
+  }
+  else if (!strcmp(name, "txt.example.test") && type == 16) {
+    used += appendRecord(reply + used, 16, 30, "\5hello", 6);
+    count++;
+  }
+  else if (!strcmp(name, "www.example.test") && type == 28) {
+    UInt8 a[16] = {0x20, 0x01, 0x0d, 0xb8, [15] = 1};
+    used += appendRecord(reply + used, 28, 120, a, sizeof(a));
+    count++;
+  }
+  else if (type == 1) {
+    UInt8 a[4] = {192, 0, 2, !strcmp(name, "www.example.test") ? 1 : n % 250 + 2};
+    used += appendRecord(reply + used, 1, 300, a, sizeof(a));
+    count++;
+  }
+
+  reply[6] = count >> 8;
+  reply[7] = count & 0xFF;
+  return used;
+}
+
+static void *serve(void *arg)
+{
+  struct server *s = arg;
+  UInt8 query[512], reply[4096];
+
+  for (;;) {
+    struct pollfd fds[2] = {{s->udp, POLLIN, 0}, {s->tcp, POLLIN, 0}};
+
+    if (poll(fds, 2, -1) <= 0)
+      continue;
+
+    if (fds[0].revents & POLLIN) {
+      struct sockaddr_in from;
+      socklen_t fromLength = sizeof(from);
+      ssize_t n = recvfrom(s->udp, query, sizeof(query), 0, (struct sockaddr *)&from, &fromLength);
+      size_t length;
+      int i;
+
+      s->udpQueries++;
+      for (i = 0; i < s->nports && s->ports[i] != from.sin_port; i++)
+        ;
+      if (i == s->nports && s->nports < kMaxPorts)
+        s->ports[s->nports++] = from.sin_port;
+
+      if (n > 0 && (length = answer(query, n, reply, FALSE)))
+        sendto(s->udp, reply, length, 0, (struct sockaddr *)&from, fromLength);
+    }
+
+    if (fds[1].revents & POLLIN) {
+      int fd = accept(s->tcp, NULL, NULL);
+      UInt8 prefix[2];
+      size_t length;
+
+      s->tcpQueries++;
+      if (fd >= 0 && recv(fd, prefix, 2, MSG_WAITALL) == 2) {
+        size_t n = (prefix[0] << 8) | prefix[1];
+
+        if (n <= sizeof(query) && recv(fd, query, n, MSG_WAITALL) == (ssize_t)n &&
+            (length = answer(query, n, reply + 2, TRUE))) {
+          reply[0] = length >> 8;
+          reply[1] = length & 0xFF;
+          send(fd, reply, length + 2, 0);
+        }
+      }
+      if (fd >= 0)
+        close(fd);
+    }
+  }
+  return NULL;
+}
+
+static void startServer(struct server *s)
+{
+  struct sockaddr_in sin;
+  socklen_t length = sizeof(sin);
+  pthread_t thread;
+  int one = 1;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  s->udp = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s->udp < 0 || bind(s->udp, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+      getsockname(s->udp, (struct sockaddr *)&sin, &length) != 0) {
+    perror("udp");
+    exit(1);
+  }
+  s->port = ntohs(sin.sin_port);
+
+  // TCP on the same port, as resolvers expect.
+  s->tcp = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(s->tcp, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (s->tcp < 0 || bind(s->tcp, (struct sockaddr *)&sin, sizeof(sin)) != 0 || listen(s->tcp, 64) != 0) {
+    perror("tcp");
+    exit(1);
+  }
+
+  pthread_create(&thread, NULL, serve, s);
+  pthread_detach(thread);
+}
+
+struct lookup {
+  CFHostRef host;
+  CFHostInfoType type;
+  Boolean done;
+  CFStreamError error;
+};
+
+static int pending;
+
+static void lookupDone(CFHostRef host, CFHostInfoType type, const CFStreamError *error, void *info)
+{
+  struct lookup *l = info;
+
+  l->done = TRUE;
+  l->error = *error;
+  CFHostUnscheduleFromRunLoop(host, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+  CFHostSetClient(host, NULL, NULL);
+
+  if (--pending == 0)
+    CFRunLoopStop(CFRunLoopGetCurrent());
+}
+
+static void startLookup(struct lookup *l, CFStringRef name, CFHostInfoType type)
+{
+  CFHostClientContext context = {0, l, NULL, NULL, NULL};
+  CFStreamError error;
+
+  l->host = CFHostCreateWithName(kCFAllocatorDefault, name);
+  l->type = type;
+  CFHostSetClient(l->host, lookupDone, &context);
+  CFHostScheduleWithRunLoop(l->host, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+
+  if (!CFHostStartInfoResolution(l->host, type, &error)) {
+    fprintf(stderr, "failed to start lookup: %d/%d\n", (int)error.domain, (int)error.error);
+    exit(1);
+  }
+  pending++;
+}
+
+// Runs until all started lookups call back; returns FALSE on timeout.
+static Boolean waitForLookups(CFTimeInterval seconds)
+{
+  CFRunLoopRunInMode(kCFRunLoopDefaultMode, seconds, FALSE);
+  return pending == 0;
+}
+
+static CFIndex addressCount(struct lookup *l, int family)
+{
+  CFArrayRef addresses = CFHostGetAddressing(l->host, NULL);
+  CFIndex count = 0;
+
+  for (CFIndex i = 0; addresses && i < CFArrayGetCount(addresses); i++) {
+    const struct sockaddr *sa = (const struct sockaddr *)CFDataGetBytePtr(CFArrayGetValueAtIndex(addresses, i));
+    count += (family == AF_UNSPEC || sa->sa_family == family);
+  }
+  return count;
+}
+
+static int failures;
+
+static void check(Boolean ok, const char *what)
+{
+  printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+  failures += !ok;
+}
+
+int main(int argc, char **argv)
+{
+  struct server server;
+  struct sockaddr_in sin;
+  CFDataRef address;
+  CFArrayRef servers;
+  struct lookup www, big, missing, txt;
+  struct lookup *many = calloc(kConcurrentLookups, sizeof(*many));
+  int udpBefore;
+  CFIndex resolved = 0;
+
+  memset(&server, 0, sizeof(server));
+  startServer(&server);
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(server.port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address = CFDataCreate(kCFAllocatorDefault, (const UInt8 *)&sin, sizeof(sin));
+  servers = CFArrayCreate(kCFAllocatorDefault, (const void **)&address, 1, &kCFTypeArrayCallBacks);
+
+  if (!_CFHostSetNativeResolverEnabled(TRUE) || !_CFHostSetNameServers(servers)) {
+    printf("SKIP: no native resolver on this platform\n");
+    return 0;
+  }
+  _CFHostSetCacheLimits(0, 0, 0, 0);
+
+  memset(&www, 0, sizeof(www));
+  memset(&big, 0, sizeof(big));
+  memset(&missing, 0, sizeof(missing));
+  memset(&txt, 0, sizeof(txt));
+
+  startLookup(&www, CFSTR("www.example.test"), kCFHostAddresses);
+  startLookup(&big, CFSTR("big.example.test"), kCFHostAddresses);
+  startLookup(&missing, CFSTR("missing.example.test"), kCFHostAddresses);
+  // Record lookups pack the class in the high half and the type in the low half.
+  startLookup(&txt, CFSTR("txt.example.test"), (1 << 16) | 16);
+
+  check(waitForLookups(10), "lookups finish");
+  check(www.done && !www.error.error && addressCount(&www, AF_INET) == 1 && addressCount(&www, AF_INET6) == 1,
+        "A and AAAA answered in parallel");
+  check(big.done && !big.error.error && addressCount(&big, AF_INET) == kBigAnswers && server.tcpQueries == 1,
+        "truncated reply retried over TCP");
+  check(missing.done && missing.error.error != 0 && missing.error.domain == kCFStreamErrorDomainNetDB,
+        "missing name fails");
+  {
+    CFArrayRef reply = txt.done && !txt.error.error ? CFHostGetInfo(txt.host, txt.type, NULL) : NULL;
+    check(reply && CFGetTypeID(reply) == CFArrayGetTypeID() && CFArrayGetCount(reply) == 2 &&
+          CFDataGetLength(CFArrayGetValueAtIndex(reply, 0)) > 12,
+          "record lookup returns the reply and the server");
+  }
+
+  // Many concurrent lookups share the resolver's socket.
+  udpBefore = server.udpQueries;
+  for (int i = 0; i < kConcurrentLookups; i++) {
+    CFStringRef name = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("host%d.example.test"), i);
+    startLookup(&many[i], name, kCFHostAddresses);
+    CFRelease(name);
+  }
+  check(waitForLookups(30), "concurrent lookups finish");
+  for (int i = 0; i < kConcurrentLookups; i++) {
+    resolved += many[i].done && !many[i].error.error && addressCount(&many[i], AF_INET) == 1;
+  }
+  printf("  %ld/%d resolved with %d queries from %d port(s)\n", (long)resolved, kConcurrentLookups,
+         server.udpQueries - udpBefore, server.nports);
+  check(resolved == kConcurrentLookups, "concurrent lookups resolve");
+  check(server.nports == 1, "one socket for all lookups");
+
+  CFHostRef hosts[] = {www.host, big.host, missing.host, txt.host};
+  for (int i = 0; i < 4; i++) {
+    CFRelease(hosts[i]);
+  }
+  for (int i = 0; i < kConcurrentLookups; i++) {
+    CFRelease(many[i].host);
+  }
+  free(many);
+  CFRelease(servers);
+  CFRelease(address);
+
+  return failures ? 1 : 0;
+}
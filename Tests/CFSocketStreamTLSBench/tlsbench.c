@@ -0,0 +1,242 @@
+#include <CoreFoundation/CoreFoundation.h>
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFSocketStreamPriv.h>
+
+#include <openssl/ec.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kDefaultMegabytes 256
+#define kDefaultRuns      3
+#define kChunkSize        16384
+
+enum { kDownload, kUpload };
+
+struct server {
+  SSL_CTX *context;
+  int listener;
+  UInt32 port;
+  int direction;
+  size_t bytes;
+};
+
+static double now(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A throwaway self-signed P-256 certificate; the client doesn't check it.
+static Boolean useSelfSignedCertificate(SSL_CTX *context)
+{
+  EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+  EVP_PKEY *key = NULL;
+  X509 *cert = X509_new();
+  Boolean result = FALSE;
+
+  if (pctx && cert && EVP_PKEY_keygen_init(pctx) > 0 &&
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) > 0 && EVP_PKEY_keygen(pctx, &key) > 0) {
+    X509_NAME *name = X509_get_subject_name(cert);
+
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"127.0.0.1", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509_set_pubkey(cert, key);
+
+    result = X509_sign(cert, key, EVP_sha256()) > 0 && SSL_CTX_use_certificate(context, cert) == 1 &&
+             SSL_CTX_use_PrivateKey(context, key) == 1;
+  }
+
+  EVP_PKEY_free(key);
+  EVP_PKEY_CTX_free(pctx);
+  X509_free(cert);
+  return result;
+}
+
+// Only AES-GCM, so the kernel can take the session.
+static SSL_CTX *createServerContext(int version)
+{
+  SSL_CTX *context = SSL_CTX_new(TLS_server_method());
+
+  if (!context || !useSelfSignedCertificate(context) ||
+      !SSL_CTX_set_min_proto_version(context, version) || !SSL_CTX_set_max_proto_version(context, version) ||
+      !SSL_CTX_set_cipher_list(context, "ECDHE-ECDSA-AES128-GCM-SHA256") ||
+      !SSL_CTX_set_ciphersuites(context, "TLS_AES_128_GCM_SHA256")) {
+    ERR_print_errors_fp(stderr);
+    exit(1);
+  }
+  return context;
+}
+
+// Serves one connection: sends or swallows the bytes, then closes properly.
+static void *runServer(void *arg)
+{
+  struct server *s = arg;
+  char *buffer = malloc(kChunkSize);
+  int fd = accept(s->listener, NULL, NULL);
+  SSL *ssl = fd >= 0 ? SSL_new(s->context) : NULL;
+
+  memset(buffer, 'x', kChunkSize);
+
+  if (ssl && SSL_set_fd(ssl, fd) && SSL_accept(ssl) == 1) {
+    if (s->direction == kDownload) {
+      size_t sent = 0;
+
+      while (sent < s->bytes) {
+        int n = SSL_write(ssl, buffer, s->bytes - sent < kChunkSize ? (int)(s->bytes - sent) : kChunkSize);
+        if (n <= 0)
+          break;
+        sent += n;
+      }
+    }
+    else {
+      while (SSL_read(ssl, buffer, kChunkSize) > 0)
+        ;
+    }
+    SSL_shutdown(ssl);
+  }
+  else {
+    ERR_print_errors_fp(stderr);
+  }
+
+  SSL_free(ssl);
+  if (fd >= 0)
+    close(fd);
+  free(buffer);
+  return NULL;
+}
+
+static void bench(struct server *s, Boolean kernel, int runs)
+{
+  CFStringRef keys[] = {kCFStreamSSLValidatesCertificateChain, kCFStreamSSLPeerName};
+  CFTypeRef values[] = {kCFBooleanFalse, kCFNull};
+  CFDictionaryRef settings = CFDictionaryCreate(kCFAllocatorDefault, (const void **)keys, values, 2,
+                                                &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  UInt8 *buffer = malloc(kChunkSize);
+  double wall = 0, cpu = 0;
+  size_t moved = 0;
+  Boolean engaged = FALSE;
+
+  memset(buffer, 'x', kChunkSize);
+
+  for (int run = 0; run < runs; run++) {
+    CFReadStreamRef rStream;
+    CFWriteStreamRef wStream;
+    CFBooleanRef inKernel;
+    pthread_t thread;
+    double wallStart, cpuStart;
+    size_t total = 0;
+
+    pthread_create(&thread, NULL, runServer, s);
+
+    CFStreamCreatePairWithSocketToHost(kCFAllocatorDefault, CFSTR("127.0.0.1"), s->port, &rStream, &wStream);
+    CFReadStreamSetProperty(rStream, kCFStreamPropertySSLSettings, settings);
+    if (kernel)
+      CFReadStreamSetProperty(rStream, _kCFStreamPropertySocketKernelTLS, kCFBooleanTrue);
+
+    if (!CFReadStreamOpen(rStream) || !CFWriteStreamOpen(wStream)) {
+      printf("  failed to open\n");
+      exit(1);
+    }
+
+    wallStart = now(CLOCK_MONOTONIC);
+    cpuStart = now(CLOCK_THREAD_CPUTIME_ID);
+
+    if (s->direction == kDownload) {
+      CFIndex n;
+
+      while (total < s->bytes && (n = CFReadStreamRead(rStream, buffer, kChunkSize)) > 0)
+        total += n;
+    }
+    else {
+      while (total < s->bytes) {
+        CFIndex n = CFWriteStreamWrite(wStream, buffer, s->bytes - total < kChunkSize ? s->bytes - total : kChunkSize);
+        if (n <= 0)
+          break;
+        total += n;
+      }
+    }
+
+    // Taken after the transfer, when the handshake is sure to be done.
+    inKernel = CFReadStreamCopyProperty(rStream, _kCFStreamPropertySocketKernelTLS);
+    engaged = inKernel == kCFBooleanTrue;
+    if (inKernel)
+      CFRelease(inKernel);
+
+    CFReadStreamClose(rStream);
+    CFWriteStreamClose(wStream);
+
+    cpu += now(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+    wall += now(CLOCK_MONOTONIC) - wallStart;
+    moved += total;
+
+    CFRelease(rStream);
+    CFRelease(wStream);
+    pthread_join(thread, NULL);
+
+    if (total < s->bytes) {
+      printf("  short transfer: %zu of %zu bytes\n", total, s->bytes);
+      break;
+    }
+  }
+
+  printf("  %-8s %-6s %9.1f MB/s  %7.2f ms CPU per MB%s\n", s->direction == kDownload ? "download" : "upload",
+         kernel ? "kernel" : "user", moved / wall / 1e6, cpu * 1e3 / (moved / 1e6),
+         kernel && !engaged ? "  (kernel TLS not taken up; is the tls module loaded?)" : "");
+
+  CFRelease(settings);
+  free(buffer);
+}
+
+int main(int argc, char **argv)
+{
+  int megabytes = argc > 1 ? atoi(argv[1]) : kDefaultMegabytes;
+  int version = argc > 2 && !strcmp(argv[2], "1.2") ? TLS1_2_VERSION : TLS1_3_VERSION;
+  int runs = argc > 3 ? atoi(argv[3]) : kDefaultRuns;
+  struct sockaddr_in sin;
+  socklen_t length = sizeof(sin);
+  struct server s;
+
+  memset(&s, 0, sizeof(s));
+  s.context = createServerContext(version);
+  s.bytes = (size_t)megabytes << 20;
+  s.listener = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (s.listener < 0 || bind(s.listener, (struct sockaddr *)&sin, sizeof(sin)) != 0 || listen(s.listener, 1) != 0 ||
+      getsockname(s.listener, (struct sockaddr *)&sin, &length) != 0) {
+    perror("listen");
+    return 1;
+  }
+  s.port = ntohs(sin.sin_port);
+
+  printf("TLS %s AES-128-GCM over loopback, %d MB x %d runs, client thread CPU:\n",
+         version == TLS1_2_VERSION ? "1.2" : "1.3", megabytes, runs);
+  for (s.direction = kDownload; s.direction <= kUpload; s.direction++) {
+    bench(&s, FALSE, runs);
+    bench(&s, TRUE, runs);
+  }
+
+  close(s.listener);
+  SSL_CTX_free(s.context);
+  return 0;
+}